@@ -0,0 +1,132 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Context Switch Benchmark Application
+ *   - Two threads hand a token back and forth, so every round trip is two switches
+ *     between memory spaces. Prints the time per switch and how many of the switches
+ *     kept their TLB entries.
+ */
+
+#include <errno.h>
+#include <os/mollenos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+
+#define DEFAULT_ROUNDS 100000
+
+static mtx_t g_lock;
+static cnd_t g_signal;
+static int   g_turn   = 0;
+static int   g_rounds = DEFAULT_ROUNDS;
+
+static int
+__PingPong(
+        _In_ int self)
+{
+    for (int i = 0; i < g_rounds; i++) {
+        mtx_lock(&g_lock);
+        while (g_turn != self) {
+            cnd_wait(&g_signal, &g_lock);
+        }
+        g_turn = !self;
+        cnd_signal(&g_signal);
+        mtx_unlock(&g_lock);
+    }
+    return 0;
+}
+
+static int
+__PongThread(
+        _In_ void* argument)
+{
+    (void)argument;
+    return __PingPong(1);
+}
+
+static int
+__QueryMemoryInfo(
+        _In_ OSSystemMemoryInfo_t* memoryInfo)
+{
+    size_t  bytesQueried;
+    oserr_t oserr;
+
+    oserr = OSSystemQuery(
+            OSSYSTEMQUERY_MEMINFO,
+            memoryInfo,
+            sizeof(OSSystemMemoryInfo_t),
+            &bytesQueried
+    );
+    if (oserr != OS_EOK) {
+        OsErrToErrNo(oserr);
+        printf("ctxbench: failed to retrieve memory stats: %i\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    OSSystemMemoryInfo_t before;
+    OSSystemMemoryInfo_t after;
+    struct timespec      start;
+    struct timespec      end;
+    thrd_t               pong;
+    uint64_t             elapsedNs;
+    uint64_t             switches;
+
+    if (argc > 1) {
+        g_rounds = atoi(argv[1]);
+        if (g_rounds <= 0) {
+            printf("usage: ctxbench [rounds]\n");
+            return -1;
+        }
+    }
+
+    mtx_init(&g_lock, mtx_plain);
+    cnd_init(&g_signal);
+    if (__QueryMemoryInfo(&before)) {
+        return -1;
+    }
+
+    timespec_get(&start, TIME_UTC);
+    if (thrd_create(&pong, __PongThread, NULL) != thrd_success) {
+        printf("ctxbench: failed to create thread\n");
+        return -1;
+    }
+    __PingPong(0);
+    thrd_join(pong, NULL);
+    timespec_get(&end, TIME_UTC);
+
+    if (__QueryMemoryInfo(&after)) {
+        return -1;
+    }
+
+    // Each round is a switch to the other thread and back
+    elapsedNs = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL;
+    elapsedNs = elapsedNs + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+    switches  = (uint64_t)g_rounds * 2;
+    printf("ctxbench: %i rounds in %llu us, %llu ns per switch\n",
+           g_rounds, elapsedNs / 1000, elapsedNs / switches);
+    printf("ctxbench: tlb switches: %u kept, %u flushed\n",
+           (uint32_t)(after.TlbSwitchesKept - before.TlbSwitchesKept),
+           (uint32_t)(after.TlbSwitchesFlushed - before.TlbSwitchesFlushed));
+
+    cnd_destroy(&g_signal);
+    mtx_destroy(&g_lock);
+    return 0;
+}
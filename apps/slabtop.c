@@ -0,0 +1,156 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Kernel Heap Statistics Application
+ */
+
+#include <errno.h>
+#include <os/mollenos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#define SLABTOP_MAX_CACHES 128
+
+static int
+__QueryCaches(
+        _In_ OSSystemHeapCacheInfo_t* caches,
+        _In_ int*                     countOut)
+{
+    oserr_t oserr;
+    size_t  bytesQueried;
+
+    oserr = OSSystemQuery(
+            OSSYSTEMQUERY_HEAPINFO,
+            caches,
+            sizeof(OSSystemHeapCacheInfo_t) * SLABTOP_MAX_CACHES,
+            &bytesQueried
+    );
+    if (oserr != OS_EOK) {
+        OsErrToErrNo(oserr);
+        printf("slabtop: failed to retrieve heap stats: %i\n", errno);
+        return -1;
+    }
+    *countOut = (int)(bytesQueried / sizeof(OSSystemHeapCacheInfo_t));
+    return 0;
+}
+
+static OSSystemHeapCacheInfo_t*
+__FindCache(
+        _In_ OSSystemHeapCacheInfo_t* caches,
+        _In_ int                      count,
+        _In_ const char*              name)
+{
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(&caches[i].Name[0], name)) {
+            return &caches[i];
+        }
+    }
+    return NULL;
+}
+
+static unsigned int
+__Percentage(
+        _In_ uint64_t value,
+        _In_ uint64_t total)
+{
+    if (!total) {
+        return 0;
+    }
+    return (unsigned int)((value * 100) / total);
+}
+
+static void
+__PrintCache(
+        _In_ OSSystemHeapCacheInfo_t* cache,
+        _In_ OSSystemHeapCacheInfo_t* previous,
+        _In_ unsigned int             interval)
+{
+    uint64_t allocations = cache->Allocations;
+    uint64_t frees       = cache->Frees;
+
+    // Caches created after the first sample are reported with
+    // their totals as the rate
+    if (previous != NULL) {
+        allocations -= previous->Allocations;
+        frees       -= previous->Frees;
+    }
+
+    printf("%-24s %7u %8u %8u %6u %5u%% %5u%% %9llu %9llu %8u/%u\n",
+           &cache->Name[0],
+           (uint32_t)cache->ObjectSize,
+           (uint32_t)cache->LiveObjects,
+           (uint32_t)cache->PeakObjects,
+           (uint32_t)cache->SlabCount,
+           __Percentage(cache->PartialObjectsInUse, cache->PartialSlabCount * cache->ObjectsPerSlab),
+           __Percentage(cache->MagazineHits, cache->MagazineHits + cache->MagazineMisses),
+           allocations / interval,
+           frees / interval,
+           (uint32_t)(cache->PaddingBytes / 1024),
+           (uint32_t)(cache->TotalBytes / 1024)
+    );
+}
+
+int main(int argc, char** argv)
+{
+    OSSystemHeapCacheInfo_t* first;
+    OSSystemHeapCacheInfo_t* second;
+    int                      firstCount;
+    int                      secondCount;
+    unsigned int             interval = 1;
+    struct timespec          duration = { 0 };
+
+    if (argc > 1) {
+        interval = (unsigned int)strtoul(argv[1], NULL, 10);
+        if (!interval) {
+            printf("usage: slabtop [interval in seconds]\n");
+            return -1;
+        }
+    }
+
+    first  = malloc(sizeof(OSSystemHeapCacheInfo_t) * SLABTOP_MAX_CACHES);
+    second = malloc(sizeof(OSSystemHeapCacheInfo_t) * SLABTOP_MAX_CACHES);
+    if (first == NULL || second == NULL) {
+        printf("slabtop: out of memory\n");
+        return -1;
+    }
+
+    // The counters are totals, so take two samples to get the rates
+    if (__QueryCaches(first, &firstCount)) {
+        return -1;
+    }
+    duration.tv_sec = interval;
+    thrd_sleep(&duration, NULL);
+    if (__QueryCaches(second, &secondCount)) {
+        return -1;
+    }
+
+    printf("%-24s %7s %8s %8s %6s %6s %6s %9s %9s %s\n",
+           "cache", "objsize", "live", "peak", "slabs", "part", "hits",
+           "allocs/s", "frees/s", "pad/total KiB");
+    for (int i = 0; i < secondCount; i++) {
+        __PrintCache(
+                &second[i],
+                __FindCache(first, firstCount, &second[i].Name[0]),
+                interval
+        );
+    }
+
+    free(first);
+    free(second);
+    return 0;
+}
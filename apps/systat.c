@@ -21,14 +21,86 @@
 #include <os/mollenos.h>
 #include <stdio.h>
 
+#define MAX_SCHEDULER_ENTRIES 64
+
+static OSSystemSchedulerLatencyInfo_t g_latencyInfo[MAX_SCHEDULER_ENTRIES];
+
+static uint32_t
+__TicksToMicroseconds(uint64_t ticks, uint64_t frequency)
+{
+    if (!frequency) {
+        return 0;
+    }
+    return (uint32_t)(((ticks / frequency) * 1000000) + (((ticks % frequency) * 1000000) / frequency));
+}
+
+// Returns the upper bound of the bucket the 99th percentile falls into
+static uint64_t
+__Percentile99(OSSchedulerLatencyHistogram_t* histogram)
+{
+    uint64_t target = histogram->Count - (histogram->Count / 100);
+    uint64_t seen   = 0;
+    for (int i = 0; i < OSSCHEDULER_LATENCY_BUCKETS - 1; i++) {
+        seen += histogram->Buckets[i];
+        if (seen >= target) {
+            return 2ULL << i;
+        }
+    }
+    return histogram->Max;
+}
+
+static void
+__PrintLatencies(void)
+{
+    static const char* names[OSSCHEDULERLATENCY_COUNT] = { "wakeup", "runqueue" };
+    size_t             bytesQueried;
+    oserr_t            oserr;
+
+    oserr = OSSystemQuery(
+            OSSYSTEMQUERY_SCHEDLATENCY,
+            &g_latencyInfo[0],
+            sizeof(g_latencyInfo),
+            &bytesQueried
+    );
+    if (oserr != OS_EOK) {
+        return;
+    }
+
+    for (size_t i = 0; i < bytesQueried / sizeof(OSSystemSchedulerLatencyInfo_t); i++) {
+        OSSystemSchedulerLatencyInfo_t* info  = &g_latencyInfo[i];
+        OSSchedulerLatencyEvent_t*      worst = &info->Worst[0];
+
+        for (int j = 0; j < OSSCHEDULERLATENCY_COUNT; j++) {
+            OSSchedulerLatencyHistogram_t* histogram = &info->Histograms[j];
+            printf("core %u %s latency: %u samples, avg %u us, p99 < %u us, max %u us\n",
+                   (uint32_t)info->CoreId, names[j], (uint32_t)histogram->Count,
+                   __TicksToMicroseconds(histogram->Total / (histogram->Count ? histogram->Count : 1), info->Frequency),
+                   __TicksToMicroseconds(__Percentile99(histogram), info->Frequency),
+                   __TicksToMicroseconds(histogram->Max, info->Frequency));
+        }
+
+        for (int j = 1; j < OSSCHEDULER_LATENCY_WORST; j++) {
+            if (info->Worst[j].Latency > worst->Latency) {
+                worst = &info->Worst[j];
+            }
+        }
+        if (worst->Latency) {
+            printf("core %u worst: thread %u waited %u us (%s)\n",
+                   (uint32_t)info->CoreId, (uint32_t)worst->ThreadHandle,
+                   __TicksToMicroseconds(worst->Latency, info->Frequency), names[worst->Type]);
+        }
+    }
+}
+
 int main(int argc, char** argv)
 {
-    OSSystemCPUInfo_t    cpuInfo;
-    OSSystemMemoryInfo_t memoryInfo;
-    oserr_t              oserr;
-    size_t               bytesQueried;
-    uint64_t             memoryTotal;
-    uint64_t             memoryInUse;
+    OSSystemCPUInfo_t       cpuInfo;
+    OSSystemMemoryInfo_t    memoryInfo;
+    OSSystemSchedulerInfo_t schedulerInfo[MAX_SCHEDULER_ENTRIES];
+    oserr_t                 oserr;
+    size_t                  bytesQueried;
+    uint64_t                memoryTotal;
+    uint64_t                memoryInUse;
 
     oserr = OSSystemQuery(
             OSSYSTEMQUERY_CPUINFO,
@@ -62,5 +134,55 @@ int main(int argc, char** argv)
     printf("page-size: %u bytes\n", (uint32_t)memoryInfo.PageSizeBytes);
     printf("allocation-size: %u bytes\n", (uint32_t)memoryInfo.AllocationGranularityBytes);
     printf("memory usage: %llu/%llu MiB\n", memoryInUse, memoryTotal);
+    if (memoryInfo.LargePageSizeBytes) {
+        printf("large pages: %u in use, %u splits (%u KiB each)\n",
+               (uint32_t)memoryInfo.LargePagesMapped, (uint32_t)memoryInfo.LargePageSplits,
+               (uint32_t)(memoryInfo.LargePageSizeBytes / 1024));
+    }
+    printf("zero pool: %u/%u pages, %u hits, %u misses\n",
+           (uint32_t)memoryInfo.ZeroPoolPages, (uint32_t)memoryInfo.ZeroPoolTarget,
+           (uint32_t)memoryInfo.ZeroPoolHits, (uint32_t)memoryInfo.ZeroPoolMisses);
+    printf("tlb sync: %u ipis sent, %u ipis avoided, %u full flushes\n",
+           (uint32_t)memoryInfo.TlbIpisSent, (uint32_t)memoryInfo.TlbIpisAvoided,
+           (uint32_t)memoryInfo.TlbFullFlushes);
+    printf("tlb switches: %u kept, %u flushed\n",
+           (uint32_t)memoryInfo.TlbSwitchesKept, (uint32_t)memoryInfo.TlbSwitchesFlushed);
+    printf("copy-on-write: %u pages shared, %u copied, %u reused\n",
+           (uint32_t)memoryInfo.SharedPages, (uint32_t)memoryInfo.CopyOnWriteCopies,
+           (uint32_t)memoryInfo.CopyOnWriteReuses);
+    if (memoryInfo.CompressedPages || memoryInfo.CompressRestores) {
+        printf("compressed: %u pages in %u KiB (%u same-filled), %u rejected\n",
+               (uint32_t)memoryInfo.CompressedPages, (uint32_t)(memoryInfo.CompressedBytes / 1024),
+               (uint32_t)memoryInfo.CompressedSameFilled, (uint32_t)memoryInfo.CompressRejected);
+        printf("compressed restores: %u, %u us average, %u us worst\n",
+               (uint32_t)memoryInfo.CompressRestores,
+               (uint32_t)(memoryInfo.CompressRestoreTimeNs / 1000 / (memoryInfo.CompressRestores ? memoryInfo.CompressRestores : 1)),
+               (uint32_t)(memoryInfo.CompressRestoreMaxTimeNs / 1000));
+    }
+
+    oserr = OSSystemQuery(
+            OSSYSTEMQUERY_SCHEDINFO,
+            &schedulerInfo[0],
+            sizeof(schedulerInfo),
+            &bytesQueried
+    );
+    if (oserr == OS_EOK) {
+        for (size_t i = 0; i < bytesQueried / sizeof(OSSystemSchedulerInfo_t); i++) {
+            printf("core %u: %i/%i threads runnable, %u migrated in, %u migrated out (%u to idle cores)\n",
+                   (uint32_t)schedulerInfo[i].CoreId, schedulerInfo[i].RunnableCount,
+                   schedulerInfo[i].ThreadCount, (uint32_t)schedulerInfo[i].MigrationsIn,
+                   (uint32_t)schedulerInfo[i].MigrationsOut, (uint32_t)schedulerInfo[i].Steals);
+            printf("core %u: %u local wakeups, %u remote wakeups, %u placed here\n",
+                   (uint32_t)schedulerInfo[i].CoreId, (uint32_t)schedulerInfo[i].WakeupsLocal,
+                   (uint32_t)schedulerInfo[i].WakeupsRemote, (uint32_t)schedulerInfo[i].WakeupsMoved);
+            if (schedulerInfo[i].DeadlineCount) {
+                printf("core %u: %i deadline threads using %i%%, %u throttled, %u deadlines missed\n",
+                       (uint32_t)schedulerInfo[i].CoreId, schedulerInfo[i].DeadlineCount,
+                       schedulerInfo[i].DeadlineBandwidth, (uint32_t)schedulerInfo[i].DeadlineThrottles,
+                       (uint32_t)schedulerInfo[i].DeadlineMisses);
+            }
+        }
+    }
+    __PrintLatencies();
     return 0;
 }
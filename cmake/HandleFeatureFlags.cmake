@@ -42,6 +42,10 @@ if (VALI_ENABLE_EHCI_64BIT)
     set (FEATURE_FLAGS "${FEATURE_FLAGS} -D__OSCONFIG_EHCI_ALLOW_64BIT")
 endif ()
 
+if (VALI_ENABLE_COMPRESSED_MEMORY)
+    set (FEATURE_FLAGS "${FEATURE_FLAGS} -D__OSCONFIG_COMPRESSED_MEMORY")
+endif ()
+
 if (VALI_RUN_KERNEL_TESTS)
     set (FEATURE_FLAGS "${FEATURE_FLAGS} -D__OSCONFIG_TEST_KERNEL")
 endif ()
@@ -85,6 +85,7 @@ extern uuid_t  ScThreadGetCurrentId(void);
 extern uuid_t  ScThreadCookie(void);
 extern oserr_t ScThreadSetCurrentName(const char* ThreadName);
 extern oserr_t ScThreadGetCurrentName(char* ThreadNameBuffer, size_t MaxLength);
+extern oserr_t ScThreadSetDeadline(const OSThreadDeadlineParameters_t*);
 
 // Synchronization system calls
 extern oserr_t ScFutexWait(OSAsyncContext_t*, OSFutexParameters_t*);
@@ -129,7 +130,7 @@ extern oserr_t ScSystemTime(enum OSTimeSource, Integer64_t*);
 extern oserr_t ScTimeSleep(OSTimestamp_t*, OSTimestamp_t*);
 extern oserr_t ScTimeStall(UInteger64_t*);
 
-#define SYSTEM_CALL_COUNT 62
+#define SYSTEM_CALL_COUNT 63
 
 typedef size_t(*SystemCallHandlerFn)(void*,void*,void*,void*,void*);
 
@@ -230,7 +231,10 @@ static struct SystemCallDescriptor {
         DefineSyscall(58, ScSystemClockFrequency),
         DefineSyscall(59, ScSystemTime),
         DefineSyscall(60, ScTimeSleep),
-        DefineSyscall(61, ScTimeStall)
+        DefineSyscall(61, ScTimeStall),
+
+        // Threading interface (cont)
+        DefineSyscall(62, ScThreadSetDeadline)
 };
 
 Context_t*
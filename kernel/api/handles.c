@@ -41,7 +41,8 @@ ScSetHandleActivity(
         _In_ uuid_t  Handle,
         _In_ unsigned int Flags)
 {
-    return MarkHandle(Handle, Flags);
+    // The sync hint is only trusted from within the kernel
+    return MarkHandle(Handle, Flags & ~(MARKHANDLE_SYNC));
 }
 
 oserr_t
@@ -51,6 +51,9 @@ __ConvertToKernelMemoryFlags(
     else                                 { placementFlags |= MAPPING_VIRTUAL_PROCESS; }
 
     if (userFlags & MEMORY_STACK)        { memoryFlags |= MAPPING_STACK; }
+    if (userFlags & MEMORY_SEQUENTIAL)   { memoryFlags |= MAPPING_SEQUENTIAL; }
+    else if (userFlags & MEMORY_RANDOM)  { memoryFlags |= MAPPING_RANDOM; }
+    if ((userFlags & MEMORY_CLONE) && (userFlags & MEMORY_PRIVATE)) { memoryFlags |= MAPPING_COPYONWRITE; }
 
     //if (!(userFlags & MEMORY_WRITE))   { memoryFlags |= MAPPING_READONLY; }
     if (userFlags & MEMORY_EXECUTABLE)   { memoryFlags |= MAPPING_EXECUTABLE; }
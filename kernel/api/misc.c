@@ -19,12 +19,18 @@
 
 #define __MODULE "SCIF"
 //#define __TRACE
+#define __need_minmax
 
+#include <arch/mmu.h>
 #include <arch/output.h>
 #include <arch/utils.h>
+#include <component/timer.h>
 #include <memoryspace.h>
+#include <scheduler.h>
 #include <threading.h>
 #include <console.h>
+#include <handle.h>
+#include <heap.h>
 #include <machine.h>
 #include <debug.h>
 
@@ -83,14 +89,181 @@ ScSystemQuery(
                 return OS_EINVALPARAMS;
             }
             size_t maxBlocks  = GetMachine()->NumberOfMemoryBlocks;
-            size_t freeBlocks = GetMachine()->NumberOfFreeMemoryBlocks;
+            size_t freeBlocks = atomic_load(&GetMachine()->NumberOfFreeMemoryBlocks);
             info->AllocationGranularityBytes = GetMachine()->MemoryGranularity;
             info->PageSizeBytes = GetMemorySpacePageSize();
             info->PagesTotal = maxBlocks;
             info->PagesUsed  = maxBlocks - freeBlocks;
+            ArchMmuGetLargePageStatistics(
+                    &info->LargePageSizeBytes,
+                    &info->LargePagesMapped,
+                    &info->LargePageSplits
+            );
+            MemoryZeroPoolGetStatistics(
+                    &info->ZeroPoolPages,
+                    &info->ZeroPoolTarget,
+                    &info->ZeroPoolHits,
+                    &info->ZeroPoolMisses
+            );
+            MemorySpaceGetSyncStatistics(
+                    &info->TlbIpisSent,
+                    &info->TlbIpisAvoided,
+                    &info->TlbFullFlushes
+            );
+            MemorySpaceGetSwitchStatistics(
+                    &info->TlbSwitchesKept,
+                    &info->TlbSwitchesFlushed
+            );
+            MemorySpaceGetCopyOnWriteStatistics(
+                    &info->CopyOnWriteCopies,
+                    &info->CopyOnWriteReuses,
+                    &info->SharedPages
+            );
+            MemorySpaceGetCompressionStatistics(
+                    &info->CompressedPages,
+                    &info->CompressedBytes,
+                    &info->CompressedSameFilled,
+                    &info->CompressRejected,
+                    &info->CompressRestores,
+                    &info->CompressRestoreTimeNs,
+                    &info->CompressRestoreMaxTimeNs
+            );
             *bytesQueriedOut = sizeof(OSSystemMemoryInfo_t);
             return OS_EOK;
         } break;
+        case OSSYSTEMQUERY_HEAPINFO: {
+            int count;
+            if (bufferSize < sizeof(OSSystemHeapCacheInfo_t)) {
+                return OS_EINVALPARAMS;
+            }
+            count = MemoryCacheQueryStatistics(buffer, (int)(bufferSize / sizeof(OSSystemHeapCacheInfo_t)));
+            *bytesQueriedOut = count * sizeof(OSSystemHeapCacheInfo_t);
+            return OS_EOK;
+        } break;
+        case OSSYSTEMQUERY_MEMDOMAININFO: {
+            SystemMemoryTopology_t*     topology = &GetMachine()->MemoryTopology;
+            OSSystemMemoryDomainInfo_t* entries  = buffer;
+            int                         count    = MIN(topology->DomainCount, (int)(bufferSize / sizeof(OSSystemMemoryDomainInfo_t)));
+
+            for (int i = 0; i < count; i++) {
+                SystemMemoryDomainStatistics_t stats;
+                SystemMemoryTopologyGetStatistics(topology, i, &stats);
+                entries[i].Domain           = i;
+                entries[i].PhysicalBase     = topology->Domains[i]->PhysicalBase;
+                entries[i].Size             = topology->Domains[i]->Size;
+                entries[i].LocalPages       = stats.LocalPages;
+                entries[i].FallbackPages    = stats.FallbackPages;
+                entries[i].RemotePages      = stats.RemotePages;
+                entries[i].InterleavedPages = stats.InterleavedPages;
+                entries[i].FreedPages       = stats.FreedPages;
+            }
+            *bytesQueriedOut = count * sizeof(OSSystemMemoryDomainInfo_t);
+            return OS_EOK;
+        } break;
+        case OSSYSTEMQUERY_FAULTINFO: {
+            OSSystemFaultInfo_t* info = buffer;
+            oserr_t              oserr;
+            if (bufferSize < sizeof(OSSystemFaultInfo_t)) {
+                return OS_EINVALPARAMS;
+            }
+            oserr = MemorySpaceGetFaultStatistics(
+                    GetCurrentMemorySpace(),
+                    &info->Faults,
+                    &info->SequentialFaults,
+                    &info->FaultAroundPages
+            );
+            if (oserr != OS_EOK) {
+                return oserr;
+            }
+            *bytesQueriedOut = sizeof(OSSystemFaultInfo_t);
+            return OS_EOK;
+        } break;
+        case OSSYSTEMQUERY_SCHEDINFO: {
+            OSSystemSchedulerInfo_t* entries = buffer;
+            int                      max     = (int)(bufferSize / sizeof(OSSystemSchedulerInfo_t));
+            int                      count   = 0;
+
+            for (uuid_t coreId = 0; coreId < __CPU_MAX_COUNT && count < max; coreId++) {
+                SystemCpuCore_t*      core = GetProcessorCore(coreId);
+                SchedulerStatistics_t stats;
+                if (core == NULL) {
+                    continue;
+                }
+
+                SchedulerGetStatistics(CpuCoreScheduler(core), &stats);
+                entries[count].CoreId        = coreId;
+                entries[count].RunnableCount = stats.RunnableCount;
+                entries[count].ThreadCount   = stats.ObjectCount;
+                entries[count].MigrationsIn  = stats.MigrationsIn;
+                entries[count].MigrationsOut = stats.MigrationsOut;
+                entries[count].Steals        = stats.Steals;
+                entries[count].WakeupsLocal  = stats.WakeupsLocal;
+                entries[count].WakeupsRemote = stats.WakeupsRemote;
+                entries[count].WakeupsMoved  = stats.WakeupsMoved;
+                entries[count].DeadlineCount     = stats.DeadlineCount;
+                entries[count].DeadlineBandwidth = stats.DeadlineBandwidth;
+                entries[count].DeadlineThrottles = stats.DeadlineThrottles;
+                entries[count].DeadlineMisses    = stats.DeadlineMisses;
+                count++;
+            }
+            *bytesQueriedOut = count * sizeof(OSSystemSchedulerInfo_t);
+            return OS_EOK;
+        } break;
+        case OSSYSTEMQUERY_SCHEDLATENCY: {
+            OSSystemSchedulerLatencyInfo_t* entries = buffer;
+            int                             max     = (int)(bufferSize / sizeof(OSSystemSchedulerLatencyInfo_t));
+            int                             count   = 0;
+            UInteger64_t                    frequency;
+
+            if (SystemTimerGetPerformanceFrequency(&frequency) != OS_EOK) {
+                return OS_ENOTSUPPORTED;
+            }
+
+            for (uuid_t coreId = 0; coreId < __CPU_MAX_COUNT && count < max; coreId++) {
+                SystemCpuCore_t* core = GetProcessorCore(coreId);
+                if (core == NULL) {
+                    continue;
+                }
+
+                entries[count].CoreId    = coreId;
+                entries[count].Frequency = frequency.QuadPart;
+                SchedulerGetLatencyStatistics(
+                        CpuCoreScheduler(core),
+                        &entries[count].Histograms[0],
+                        &entries[count].Worst[0]
+                );
+                count++;
+            }
+            *bytesQueriedOut = count * sizeof(OSSystemSchedulerLatencyInfo_t);
+            return OS_EOK;
+        } break;
+        case OSSYSTEMQUERY_THREADLATENCY: {
+            OSSystemThreadLatencyInfo_t* info = buffer;
+            Thread_t*                    thread;
+            UInteger64_t                 frequency;
+            if (bufferSize < sizeof(OSSystemThreadLatencyInfo_t)) {
+                return OS_EINVALPARAMS;
+            }
+
+            if (SystemTimerGetPerformanceFrequency(&frequency) != OS_EOK) {
+                return OS_ENOTSUPPORTED;
+            }
+
+            if (info->ThreadHandle == UUID_INVALID) {
+                thread = ThreadCurrentForCore(ArchGetProcessorCoreId());
+            } else {
+                thread = THREAD_GET(info->ThreadHandle);
+            }
+            if (thread == NULL) {
+                return OS_ENOENT;
+            }
+
+            info->ThreadHandle = ThreadHandle(thread);
+            info->Frequency    = frequency.QuadPart;
+            SchedulerObjectGetLatencyStatistics(ThreadSchedulerHandle(thread), &info->Histograms[0]);
+            *bytesQueriedOut = sizeof(OSSystemThreadLatencyInfo_t);
+            return OS_EOK;
+        } break;
         default: {
             return OS_ENOTSUPPORTED;
         }
@@ -23,6 +23,7 @@
 #include <arch/utils.h>
 #include <assert.h>
 #include <os/types/thread.h>
+#include <scheduler.h>
 #include <threading.h>
 #include <string.h>
 #include <debug.h>
@@ -129,6 +130,21 @@ ScThreadSetCurrentName(const char* ThreadName)
     return ThreadSetName(thread, ThreadName);
 }
 
+oserr_t
+ScThreadSetDeadline(const OSThreadDeadlineParameters_t* parameters)
+{
+    if (parameters == NULL) {
+        return OS_EINVALPARAMS;
+    }
+    // Any thread may ask, so it only gets the part of the core set aside for userspace
+    return SchedulerSetDeadline(
+            parameters->Runtime,
+            parameters->Deadline,
+            parameters->Period,
+            SCHEDULER_DEADLINE_BANDWIDTH_USER
+    );
+}
+
 oserr_t
 ScThreadGetCurrentName(char* ThreadNameBuffer, size_t MaxLength)
 {
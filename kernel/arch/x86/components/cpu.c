@@ -47,9 +47,11 @@
 #if defined(_MSC_VER) && !defined(__clang__)
 #include <intrin.h>
 #define __get_cpuid(Function, Registers) __cpuid(Registers, Function);
+#define __get_cpuid_count(Function, SubFunction, Registers) __cpuidex(Registers, Function, SubFunction);
 #else
 #include <cpuid.h>
 #define __get_cpuid(Function, Registers) __cpuid(Function, (Registers)[0], (Registers)[1], (Registers)[2], (Registers)[3]);
+#define __get_cpuid_count(Function, SubFunction, Registers) __cpuid_count(Function, SubFunction, (Registers)[0], (Registers)[1], (Registers)[2], (Registers)[3]);
 #endif
 #define isspace(c) (((c) >= 0x09 && (c) <= 0x0D) || ((c) == 0x20))
 
@@ -57,11 +59,17 @@ extern void __wbinvd(void);
 extern void __hlt(void);
 extern void memory_invalidate_addr(uintptr_t);
 extern void memory_reload_cr3(void);
+#if defined(__amd64__)
+extern uintptr_t memory_get_cr3(void);
+extern void memory_invalidate_pcid(uint64_t type, void* descriptor);
+extern void CpuEnablePcid(void);
+#endif
 extern void CpuEnableXSave(void);
 extern void CpuEnableAvx(void);
 extern void CpuEnableSse(void);
 extern void CpuEnableGpe(void);
 extern void CpuEnableFpu(void);
+extern void CpuEnableWriteProtect(void);
 extern void _rdmsr(size_t reg, uint64_t* value);
 extern void _wrmsr(size_t reg, uint64_t* value);
 
@@ -147,6 +155,14 @@ ArchPlatformInitialize(
             cpu->NumberOfCores = 1;
         }
     }
+
+    if (cpu->PlatformData.MaxLevel >= 7) {
+        __get_cpuid_count(7, 0, cpuRegisters);
+        // EBX[10] = INVPCID
+        if (cpuRegisters[1] & (1 << 10)) {
+            cpu->PlatformData.Flags |= X86_CPU_FLAG_INVPCID;
+        }
+    }
     
     // Get core bits and logical bits
     if (cpu->NumberOfCores != 1) {
@@ -223,6 +239,9 @@ CpuInitializeFeatures(void)
         CpuEnableGpe();
     }
 
+    // Kernel writes to user memory must fault on copy-on-write pages just like user writes
+    CpuEnableWriteProtect();
+
 	// Can we enable FPU?
 	if (CpuHasFeatures(0, CPUID_FEAT_EDX_FPU) == OS_EOK) {
 		CpuEnableFpu();
@@ -242,6 +261,12 @@ CpuInitializeFeatures(void)
     }
 
 #ifdef __amd64__
+    // Process context identifiers let the TLB keep entries of multiple address spaces,
+    // we only use them together with global pages, as the kernel mappings are shared.
+    if (CpuHasFeatures(CPUID_FEAT_ECX_PCID, CPUID_FEAT_EDX_PGE) == OS_EOK) {
+        CpuEnablePcid();
+    }
+
     // In 64 bit mode we want to set the GS-base for the OS. The reason
     // we fill the kernel GS base with the user-one is that we start in kernel mode
     // and don't want the user-one swapped in untill later
@@ -321,6 +346,15 @@ CpuInvalidateMemoryCache(
 {
     if (Start == NULL) {
         // TODO: disable PGE bit
+#if defined(__amd64__)
+        // Only the entries of the current context identifier are flushed, which
+        // is also what reloading CR3 does when they are enabled.
+        if (GetMachine()->Processor.PlatformData.Flags & X86_CPU_FLAG_INVPCID) {
+            uint64_t descriptor[2] = { memory_get_cr3() & 0xFFF, 0 };
+            memory_invalidate_pcid(1, &descriptor[0]);
+            return;
+        }
+#endif
         memory_reload_cr3();
     }
     else {
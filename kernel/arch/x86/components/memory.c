@@ -51,6 +51,10 @@ extern void memory_paging_init(uintptr_t pda, paddr_t stackPhysicalBase, vaddr_t
 extern uintptr_t g_kernelcr3;
 extern uintptr_t g_kernelpd;
 
+// Large page accounting, the number of splits is maintained by the page-table walker
+_Atomic(size_t) g_largePagesMapped = 0;
+_Atomic(size_t) g_largePageSplits  = 0;
+
 // Disable the atomic wrong alignment, as they are aligned and are sanitized
 // in the arch-specific layer
 #if defined(__clang__)
@@ -136,12 +140,17 @@ ConvertGenericAttributesToX86(
     if (flags & MAPPING_NOCACHE) {
         nativeFlags |= PAGE_CACHE_DISABLE;
     }
-    if (!(flags & MAPPING_READONLY)) {
+    if (flags & MAPPING_COPYONWRITE) {
+        nativeFlags |= PAGE_COPYONWRITE;
+    } else if (!(flags & MAPPING_READONLY)) {
         nativeFlags |= PAGE_WRITE;
     }
     if (flags & MAPPING_ISDIRTY) {
         nativeFlags |= PAGE_DIRTY;
     }
+    if (flags & MAPPING_ISACCESSED) {
+        nativeFlags |= PAGE_ACCESSED;
+    }
     if (flags & MAPPING_PERSISTENT) {
         nativeFlags |= PAGE_PERSISTENT;
     }
@@ -159,7 +168,9 @@ ConvertX86AttributesToGeneric(
         if (nativeFlags & PAGE_PRESENT) {
             flags |= MAPPING_COMMIT;
         }
-        if (!(nativeFlags & PAGE_WRITE)) {
+        if (nativeFlags & PAGE_COPYONWRITE) {
+            flags |= MAPPING_COPYONWRITE;
+        } else if (!(nativeFlags & PAGE_WRITE)) {
             flags |= MAPPING_READONLY;
         }
         if (nativeFlags & PAGE_USER) {
@@ -174,18 +185,109 @@ ConvertX86AttributesToGeneric(
         if (nativeFlags & PAGE_DIRTY) {
             flags |= MAPPING_ISDIRTY;
         }
+        if (nativeFlags & PAGE_ACCESSED) {
+            flags |= MAPPING_ISACCESSED;
+        }
     }
     return flags;
 }
 
+static inline int
+__IsLargePageCandidate(
+        _In_ vaddr_t      virtualAddress,
+        _In_ paddr_t      physicalAddress,
+        _In_ int          pageCount,
+        _In_ unsigned int x86Attributes)
+{
+#if defined(__i386__)
+    _CRT_UNUSED(virtualAddress);
+    _CRT_UNUSED(physicalAddress);
+    _CRT_UNUSED(pageCount);
+    _CRT_UNUSED(x86Attributes);
+    return 0;
+#else
+    // Only committed mappings are promoted, reserved memory is committed page by page, and
+    // copy-on-write pages are copied page by page
+    return (x86Attributes & PAGE_PRESENT) && !(x86Attributes & PAGE_COPYONWRITE) && pageCount >= ENTRIES_PER_PAGE &&
+           !(virtualAddress & (LARGE_PAGE_SIZE - 1)) && !(physicalAddress & (LARGE_PAGE_SIZE - 1));
+#endif
+}
+
+static int
+__IsPhysicallyContiguous(
+        _In_ const paddr_t* physicalAddressValues,
+        _In_ int            pageCount)
+{
+    for (int i = 1; i < pageCount; i++) {
+        if (physicalAddressValues[i] != (physicalAddressValues[0] + (i * PAGE_SIZE))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int
+__CoversLargePage(
+        _In_ vaddr_t virtualAddress,
+        _In_ int     pageCount)
+{
+    return !(virtualAddress & (LARGE_PAGE_SIZE - 1)) && pageCount >= ENTRIES_PER_PAGE;
+}
+
+void
+ArchMmuGetLargePageStatistics(
+        _Out_ size_t* pageSizeOut,
+        _Out_ size_t* pagesMappedOut,
+        _Out_ size_t* pageSplitsOut)
+{
+#if defined(__i386__)
+    *pageSizeOut = 0;
+#else
+    *pageSizeOut = LARGE_PAGE_SIZE;
+#endif
+    *pagesMappedOut = atomic_load(&g_largePagesMapped);
+    *pageSplitsOut  = atomic_load(&g_largePageSplits);
+}
+
+int
+ArchMmuAddressSpaceIdCount(void)
+{
+#if defined(__amd64__)
+    // Process context identifiers are only enabled together with global pages
+    if (CpuHasFeatures(CPUID_FEAT_ECX_PCID, CPUID_FEAT_EDX_PGE) == OS_EOK) {
+        return 4096;
+    }
+#endif
+    return 0;
+}
+
 void
 ArchMmuSwitchMemorySpace(
-    _In_ MemorySpace_t* memorySpace)
+        _In_ MemorySpace_t* memorySpace,
+        _In_ int            addressSpaceId,
+        _In_ bool           flush)
 {
+    uintptr_t cr3;
     assert(memorySpace != NULL);
     assert(memorySpace->PlatformData.Cr3PhysicalAddress != 0);
     assert(memorySpace->PlatformData.Cr3VirtualAddress != 0);
-    memory_load_cr3(memorySpace->PlatformData.Cr3PhysicalAddress);
+
+    cr3 = memorySpace->PlatformData.Cr3PhysicalAddress;
+
+#if defined(__amd64__)
+    // Bit 63 tells the cpu to keep the entries tagged with the id
+    if (ArchMmuAddressSpaceIdCount()) {
+        assert(addressSpaceId >= 0 && addressSpaceId < 4096);
+        cr3 |= (uintptr_t)addressSpaceId;
+        if (!flush) {
+            cr3 |= (1ULL << 63);
+        }
+    }
+#else
+    _CRT_UNUSED(addressSpaceId);
+    _CRT_UNUSED(flush);
+#endif
+    memory_load_cr3(cr3);
 }
 
 oserr_t
@@ -198,6 +300,7 @@ ArchMmuGetPageAttributes(
 {
     PAGE_MASTER_LEVEL* parentDirectory;
     PAGE_MASTER_LEVEL* directory;
+    PageDirectory_t*   largeDirectory;
     PageTable_t*       pageTable;
     int                isCurrent, update;
     unsigned int       x86Attributes;
@@ -211,6 +314,19 @@ ArchMmuGetPageAttributes(
 
     directory = MmVirtualGetMasterTable(memorySpace, startAddress, &parentDirectory, &isCurrent);
     while (pageCount) {
+        // Large pages are read directly, there is no reason to split them
+        largeDirectory = MmVirtualGetLargePageDirectory(parentDirectory, directory, startAddress);
+        if (largeDirectory) {
+            x86Attributes = atomic_load(&largeDirectory->pTables[PAGE_DIRECTORY_INDEX(startAddress)]);
+            x86Attributes = ConvertX86AttributesToGeneric(x86Attributes & ATTRIBUTE_MASK & ~PAGETABLE_LARGE);
+
+            index = PAGE_TABLE_INDEX(startAddress);
+            for (; index < ENTRIES_PER_PAGE && pageCount; index++, pageCount--, pagesRetrieved++, startAddress += PAGE_SIZE) {
+                attributeValues[pagesRetrieved] = x86Attributes;
+            }
+            continue;
+        }
+
         pageTable = MmVirtualGetTable(parentDirectory, directory, startAddress, isCurrent, 0, &update);
         if (pageTable == NULL) {
             osStatus = (pagesRetrieved == 0) ? OS_ENOENT : OS_EINCOMPLETE;
@@ -237,6 +353,7 @@ ArchMmuUpdatePageAttributes(
 {
     PAGE_MASTER_LEVEL* parentDirectory;
     PAGE_MASTER_LEVEL* directory;
+    PageDirectory_t*   largeDirectory;
     PageTable_t*       pageTable;
     unsigned int       x86Attributes;
     int                isCurrent, update;
@@ -259,6 +376,33 @@ ArchMmuUpdatePageAttributes(
 
     directory = MmVirtualGetMasterTable(memorySpace, startAddress, &parentDirectory, &isCurrent);
     while (pageCount) {
+        // Large pages that are entirely covered can be updated in place, otherwise
+        // the page-table lookup will split them. Copy-on-write is tracked for each page,
+        // so those always split the large page.
+        largeDirectory = MmVirtualGetLargePageDirectory(parentDirectory, directory, startAddress);
+        if (largeDirectory && __CoversLargePage(startAddress, pageCount) &&
+            (x86Attributes & PAGE_PRESENT) && !(x86Attributes & PAGE_COPYONWRITE)) {
+            index = PAGE_DIRECTORY_INDEX(startAddress);
+            uintptr_t mapping        = atomic_load(&largeDirectory->pTables[index]);
+            uintptr_t updatedMapping = (mapping & LARGE_PAGE_MASK) | x86Attributes | PAGETABLE_LARGE;
+            if (!pagesUpdated) {
+                *attributes = ConvertX86AttributesToGeneric(mapping & ATTRIBUTE_MASK & ~PAGETABLE_LARGE);
+            }
+
+            if (!atomic_compare_exchange_strong(&largeDirectory->pTables[index], &mapping, updatedMapping)) {
+                osStatus = (pagesUpdated == 0) ? OS_EBUSY : OS_EINCOMPLETE;
+                break;
+            }
+
+            if (isCurrent) {
+                memory_invalidate_addr(startAddress);
+            }
+            pageCount    -= ENTRIES_PER_PAGE;
+            pagesUpdated += ENTRIES_PER_PAGE;
+            startAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+
         pageTable = MmVirtualGetTable(parentDirectory, directory, startAddress, isCurrent, 0, &update);
         if (pageTable == NULL) {
             osStatus = (pagesUpdated == 0) ? OS_ENOENT : OS_EINCOMPLETE;
@@ -356,6 +500,54 @@ ArchMmuCommitVirtualPage(
     return osStatus;
 }
 
+oserr_t
+ArchMmuReplaceVirtualPage(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ paddr_t        expectedAddress,
+        _In_ paddr_t        physicalAddress,
+        _In_ unsigned int   attributes)
+{
+    PAGE_MASTER_LEVEL* parentDirectory;
+    PAGE_MASTER_LEVEL* directory;
+    PageTable_t*       pageTable;
+    unsigned int       x86Attributes;
+    uintptr_t          mapping;
+    int                isCurrent, update;
+    int                index;
+
+    x86Attributes = ConvertGenericAttributesToX86(attributes);
+    if (ISINRANGE(address, MEMORY_LOCATION_SHARED_START, MEMORY_LOCATION_SHARED_END)) {
+        if (CpuHasFeatures(0, CPUID_FEAT_EDX_PGE) == OS_EOK) {
+            x86Attributes |= PAGE_GLOBAL;
+        }
+    }
+
+    directory = MmVirtualGetMasterTable(memorySpace, address, &parentDirectory, &isCurrent);
+    pageTable = MmVirtualGetTable(parentDirectory, directory, address, isCurrent, 0, &update);
+    if (pageTable == NULL) {
+        return OS_ENOENT;
+    }
+
+    // The page must still be the one the caller based the new page on, otherwise
+    // someone else got there first.
+    index   = PAGE_TABLE_INDEX(address);
+    mapping = atomic_load(&pageTable->Pages[index]);
+    if (!(mapping & PAGE_PRESENT) || (mapping & PAGE_MASK) != (expectedAddress & PAGE_MASK)) {
+        return OS_EBUSY;
+    }
+
+    if (!atomic_compare_exchange_strong(&pageTable->Pages[index], &mapping,
+                                        (physicalAddress & PAGE_MASK) | x86Attributes)) {
+        return OS_EBUSY;
+    }
+
+    if (isCurrent) {
+        memory_invalidate_addr(address);
+    }
+    return OS_EOK;
+}
+
 oserr_t
 ArchMmuSetContiguousVirtualPages(
         _In_  MemorySpace_t* memorySpace,
@@ -391,6 +583,18 @@ ArchMmuSetContiguousVirtualPages(
 
     directory = MmVirtualGetMasterTable(memorySpace, startAddress, &parentDirectory, &isCurrent);
     while (pageCount && status == OS_EOK) {
+        // Promote the range to a large page when both addresses are aligned. If the range
+        // already has mappings, the regular path below will report it.
+        if (__IsLargePageCandidate(startAddress, physicalStartAddress, pageCount, x86Attributes) &&
+            MmVirtualSetLargePage(parentDirectory, directory, startAddress,
+                                  physicalStartAddress, x86Attributes, isCurrent) == OS_EOK) {
+            pageCount            -= ENTRIES_PER_PAGE;
+            pagesUpdated         += ENTRIES_PER_PAGE;
+            startAddress         += LARGE_PAGE_SIZE;
+            physicalStartAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+
         pageTable = MmVirtualGetTable(parentDirectory, directory, startAddress, isCurrent, 1, &update);
         if (!pageTable) {
             status = (pagesUpdated == 0) ? OS_EOOM : OS_EINCOMPLETE;
@@ -511,6 +715,17 @@ ArchMmuSetVirtualPages(
 
     directory = MmVirtualGetMasterTable(memorySpace, startAddress, &parentDirectory, &isCurrent);
     while (pageCount && status == OS_EOK) {
+        // Promote the range to a large page if the physical pages happen to be contiguous
+        if (__IsLargePageCandidate(startAddress, physicalAddressValues[pagesUpdated], pageCount, x86Attributes) &&
+            __IsPhysicallyContiguous(&physicalAddressValues[pagesUpdated], ENTRIES_PER_PAGE) &&
+            MmVirtualSetLargePage(parentDirectory, directory, startAddress,
+                                  physicalAddressValues[pagesUpdated], x86Attributes, isCurrent) == OS_EOK) {
+            pageCount    -= ENTRIES_PER_PAGE;
+            pagesUpdated += ENTRIES_PER_PAGE;
+            startAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+
         pageTable = MmVirtualGetTable(
                 parentDirectory,
                 directory,
@@ -573,6 +788,23 @@ ArchMmuClearVirtualPages(
 
     directory = MmVirtualGetMasterTable(memorySpace, startAddress, &parentDirectory, &isCurrent);
     while (pageCount) {
+        // Large pages that are entirely covered are cleared in one go, otherwise
+        // the page-table lookup will split them.
+        if (__CoversLargePage(startAddress, pageCount)) {
+            mapping = MmVirtualClearLargePage(parentDirectory, directory, startAddress, isCurrent);
+            if (mapping) {
+                if (freedAddresses && !(mapping & PAGE_PERSISTENT)) {
+                    for (index = 0; index < ENTRIES_PER_PAGE; index++) {
+                        freedAddresses[freedPages++] = (mapping & LARGE_PAGE_MASK) + (index * PAGE_SIZE);
+                    }
+                }
+                pageCount    -= ENTRIES_PER_PAGE;
+                pagesCleared += ENTRIES_PER_PAGE;
+                startAddress += LARGE_PAGE_SIZE;
+                continue;
+            }
+        }
+
         pageTable = MmVirtualGetTable(parentDirectory, directory, startAddress, isCurrent, 0, &update);
         if (pageTable == NULL) {
             status = (pagesCleared == 0) ? OS_ENOENT : OS_EINCOMPLETE;
@@ -612,6 +844,7 @@ ArchMmuVirtualToPhysical(
 {
     PAGE_MASTER_LEVEL* parentDirectory;
     PAGE_MASTER_LEVEL* directory;
+    PageDirectory_t*   largeDirectory;
     PageTable_t*       pageTable;
     uintptr_t          mapping;
     int                isCurrent, update;
@@ -625,6 +858,18 @@ ArchMmuVirtualToPhysical(
 
     directory = MmVirtualGetMasterTable(memorySpace, startAddress, &parentDirectory, &isCurrent);
     while (pageCount) {
+        // Large pages are read directly, there is no reason to split them
+        largeDirectory = MmVirtualGetLargePageDirectory(parentDirectory, directory, startAddress);
+        if (largeDirectory) {
+            mapping = atomic_load(&largeDirectory->pTables[PAGE_DIRECTORY_INDEX(startAddress)]);
+
+            index = PAGE_TABLE_INDEX(startAddress);
+            for (; index < ENTRIES_PER_PAGE && pageCount; index++, pageCount--, pagesRetrieved++, startAddress += PAGE_SIZE) {
+                physicalAddressValues[pagesRetrieved] = (mapping & LARGE_PAGE_MASK) + (index * PAGE_SIZE);
+            }
+            continue;
+        }
+
         pageTable = MmVirtualGetTable(parentDirectory, directory, startAddress, isCurrent, 0, &update);
         if (pageTable == NULL) {
             status = (pagesRetrieved == 0) ? OS_ENOENT : OS_EINCOMPLETE;
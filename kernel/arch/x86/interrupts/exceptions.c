@@ -192,8 +192,20 @@ __HandlePageFault(
             }
         } else if (context->ErrorCode & PAGE_FAULT_WRITE) {
             // Write access, so lets verify that write attributes are set, if they
-            // are not, then the thread tried to write to read-only memory
-            if (attributes & MAPPING_READONLY) {
+            // are not, then the thread tried to write to read-only memory. Copy-on-write
+            // pages are writable, but must be copied first.
+            if (attributes & MAPPING_COPYONWRITE) {
+                oserr_t oserr = MemorySpaceCopyOnWrite(GetCurrentMemorySpace(), address);
+                if (oserr == OS_EOK) {
+                    return true;
+                }
+                ERROR("%s: COPY_ON_WRITE failed: 0x%" PRIxIN ", %u",
+                      thread != NULL ? ThreadName(thread) : "Null", address, oserr);
+                if (context->ErrorCode & PAGE_FAULT_USER) {
+                    SignalExecuteLocalThreadTrap(context, SIGSEGV, SIGNAL_FLAG_PAGEFAULT, (void*)address, NULL);
+                    return true;
+                }
+            } else if (attributes & MAPPING_READONLY) {
                 // If it was a user-process, kill it, otherwise fall through to kernel crash
                 ERROR("%s: WRITE_ACCESS_VIOLATION: 0x%" PRIxIN ", 0x%" PRIxIN ", 0x%" PRIxIN "",
                       thread != NULL ? ThreadName(thread) : "Null",
@@ -31,6 +31,7 @@ global _CpuEnableAvx
 global _CpuEnableSse
 global _CpuEnableFpu
 global _CpuEnableGpe
+global _CpuEnableWriteProtect
 
 ; No matter what, this is booted by vboot, and thus
 ; We can assume the state when this point is reached.
@@ -98,3 +99,10 @@ _CpuEnableGpe:
 	bts eax, 7		; Set Operating System Support for Page Global Enable (Bit 7)
 	mov cr4, eax
 	ret
+
+; Assembly routine to make supervisor writes honor read-only pages, which copy-on-write relies on
+_CpuEnableWriteProtect:
+	mov eax, cr0
+	bts eax, 16		; Set Write Protect (Bit 16)
+	mov cr0, eax
+	ret
@@ -278,6 +278,51 @@ MmuDestroyVirtualSpace(
     return OS_EOK;
 }
 
+PageDirectory_t*
+MmVirtualGetLargePageDirectory(
+        _In_ PageDirectory_t* parentPageDirectory,
+        _In_ PageDirectory_t* pageDirectory,
+        _In_ vaddr_t          address)
+{
+    // Large pages are never mapped on x32, 4MB pages would require PSE
+    _CRT_UNUSED(parentPageDirectory);
+    _CRT_UNUSED(pageDirectory);
+    _CRT_UNUSED(address);
+    return NULL;
+}
+
+oserr_t
+MmVirtualSetLargePage(
+        _In_ PageDirectory_t* parentPageDirectory,
+        _In_ PageDirectory_t* pageDirectory,
+        _In_ vaddr_t          address,
+        _In_ paddr_t          physicalAddress,
+        _In_ unsigned int     attributes,
+        _In_ int              isCurrent)
+{
+    _CRT_UNUSED(parentPageDirectory);
+    _CRT_UNUSED(pageDirectory);
+    _CRT_UNUSED(address);
+    _CRT_UNUSED(physicalAddress);
+    _CRT_UNUSED(attributes);
+    _CRT_UNUSED(isCurrent);
+    return OS_ENOTSUPPORTED;
+}
+
+uintptr_t
+MmVirtualClearLargePage(
+        _In_ PageDirectory_t* parentPageDirectory,
+        _In_ PageDirectory_t* pageDirectory,
+        _In_ vaddr_t          address,
+        _In_ int              isCurrent)
+{
+    _CRT_UNUSED(parentPageDirectory);
+    _CRT_UNUSED(pageDirectory);
+    _CRT_UNUSED(address);
+    _CRT_UNUSED(isCurrent);
+    return 0;
+}
+
 #if defined(__clang__)
 #pragma clang diagnostic pop
 #endif
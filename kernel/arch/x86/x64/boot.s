@@ -31,6 +31,8 @@ global CpuEnableAvx
 global CpuEnableSse
 global CpuEnableFpu
 global CpuEnableGpe
+global CpuEnablePcid
+global CpuEnableWriteProtect
 
 ; No matter what, this is booted by vboot, and thus
 ; We can assume the state when this point is reached.
@@ -99,3 +101,17 @@ CpuEnableGpe:
 	bts rax, 7		; Set Operating System Support for Page Global Enable (Bit 7)
 	mov cr4, rax
 	ret
+
+; Assembly routine to enable process context identifiers, cr3 must have pcid 0 when enabling
+CpuEnablePcid:
+	mov rax, cr4
+	bts rax, 17		; Set Process-Context Identifiers Enable (Bit 17)
+	mov cr4, rax
+	ret
+
+; Assembly routine to make supervisor writes honor read-only pages, which copy-on-write relies on
+CpuEnableWriteProtect:
+	mov rax, cr0
+	bts rax, 16		; Set Write Protect (Bit 16)
+	mov cr0, rax
+	ret
@@ -26,6 +26,7 @@ global memory_reload_cr3
 global memory_get_cr3
 global memory_load_cr3
 global memory_invalidate_addr
+global memory_invalidate_pcid
 global memory_paging_init
 
 ; void memory_reload_cr3(void)
@@ -53,6 +54,12 @@ memory_invalidate_addr:
 	invlpg [rcx]
 	ret
 
+; void memory_invalidate_pcid([rcx] uint64_t type, [rdx] void* descriptor)
+; Invalidates the entries described by the 16 byte descriptor of pcid and address
+memory_invalidate_pcid:
+	invpcid rcx, [rdx]
+	ret
+
 ; void memory_paging_init([rcx] paddr_t pda, [rdx] paddr_t stackPhysicalBase, [r8] vaddr_t stackVirtualBase)
 ; Switches to the new paging table and readjusts stack from it's physical address to virtual
 ; This needs to be called once we setup the new paging mappings.
@@ -150,8 +150,26 @@ SyncPmlWithParent:
     return directoryTable;
 }
 
-PageTable_t*
-MmVirtualGetTable(
+extern void memory_invalidate_addr(uintptr_t pda);
+
+// Large page accounting, shared with the generic x86 mmu layer
+extern _Atomic(size_t) g_largePagesMapped;
+extern _Atomic(size_t) g_largePageSplits;
+
+static unsigned int
+__GetCreateFlags(
+        _In_ vaddr_t virtualAddress)
+{
+    // Modify the creation flags, we need to change them in a few cases
+    // 1) If we are mapping any address above kernel region, it needs PAGE_USER
+    if (virtualAddress >= MEMORY_LOCATION_RING3_CODE) {
+        return PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    }
+    return PAGE_PRESENT | PAGE_WRITE;
+}
+
+static PageDirectory_t*
+__GetPageDirectory(
         _In_  PageMasterTable_t* parentPageMasterTable,
         _In_  PageMasterTable_t* pageMasterTable,
         _In_  vaddr_t            virtualAddress,
@@ -160,25 +178,13 @@ MmVirtualGetTable(
         _Out_ int*               update)
 {
     PageDirectoryTable_t* directoryTable;
-    PageDirectory_t*      directory      = NULL;
-	PageTable_t*          table          = NULL;
-	uintptr_t             physical       = 0;
-    unsigned int          createFlags    = PAGE_PRESENT | PAGE_WRITE;
+    PageDirectory_t*      directory   = NULL;
+    uintptr_t             physical    = 0;
+    unsigned int          createFlags = __GetCreateFlags(virtualAddress);
     uint64_t              mapping;
     int                   result;
 
     int pdpIndex = PAGE_DIRECTORY_POINTER_INDEX(virtualAddress);
-    int pdIndex  = PAGE_DIRECTORY_INDEX(virtualAddress);
-
-    if (!pageMasterTable || !update) {
-        return NULL;
-    }
-
-    // Modify the creation flags, we need to change them in a few cases
-    // 1) If we are mapping any address above kernel region, it needs PAGE_USER
-    if (virtualAddress >= MEMORY_LOCATION_RING3_CODE) {
-        createFlags |= PAGE_USER;
-    }
 
     *update = 0;
     directoryTable = __GetPageDirectoryTable(parentPageMasterTable, pageMasterTable, virtualAddress, isCurrent,
@@ -215,15 +221,100 @@ SyncPdp:
         directoryTable->vTables[pdpIndex] = (uint64_t)directory;
         *update = isCurrent;
     }
+    return directory;
+}
+
+static PageTable_t*
+__SplitLargePage(
+        _In_ PageDirectory_t* directory,
+        _In_ vaddr_t          virtualAddress,
+        _In_ uint64_t         mapping)
+{
+    PageTable_t* table;
+    uintptr_t    physical;
+    uint64_t     pageMapping;
+    int          pdIndex = PAGE_DIRECTORY_INDEX(virtualAddress);
+
+    // Reuse the page-table that was parked when the large page was mapped, otherwise
+    // we need a new one.
+    table = (PageTable_t*)directory->vTables[pdIndex];
+    if (table) {
+        physical = atomic_load(&table->Pages[0]) & PAGE_MASK;
+    } else {
+        table = (PageTable_t*)kmalloc_p(sizeof(PageTable_t), &physical);
+        if (!table) {
+            return NULL;
+        }
+    }
+
+    // Build the page-table so it maps exactly what the large page did, this way the
+    // translation stays the same, and no flushing is required for the split itself.
+    pageMapping = (mapping & LARGE_PAGE_MASK) | (mapping & ATTRIBUTE_MASK & ~PAGETABLE_LARGE);
+    for (int i = 0; i < ENTRIES_PER_PAGE; i++, pageMapping += PAGE_SIZE) {
+        atomic_store_explicit(&table->Pages[i], pageMapping, memory_order_relaxed);
+    }
+
+    physical |= __GetCreateFlags(virtualAddress);
+    if (!atomic_compare_exchange_strong(&directory->pTables[pdIndex], &mapping, physical)) {
+        // The large page was changed underneath us, the caller must retry
+        if (directory->vTables[pdIndex] != (uint64_t)table) {
+            kfree((void*)table);
+        }
+        return NULL;
+    }
+
+    directory->vTables[pdIndex] = (uint64_t)table;
+    atomic_fetch_sub(&g_largePagesMapped, 1);
+    atomic_fetch_add(&g_largePageSplits, 1);
+    TRACE("__SplitLargePage split large page at 0x%" PRIxIN, virtualAddress & LARGE_PAGE_MASK);
+    return table;
+}
+
+PageTable_t*
+MmVirtualGetTable(
+        _In_  PageMasterTable_t* parentPageMasterTable,
+        _In_  PageMasterTable_t* pageMasterTable,
+        _In_  vaddr_t            virtualAddress,
+        _In_  int                isCurrent,
+        _In_  int                createIfMissing,
+        _Out_ int*               update)
+{
+    PageDirectory_t* directory;
+	PageTable_t*     table    = NULL;
+	uintptr_t        physical = 0;
+    uint64_t         mapping;
+    int              result;
+
+    int pdIndex  = PAGE_DIRECTORY_INDEX(virtualAddress);
+
+    if (!pageMasterTable || !update) {
+        return NULL;
+    }
 
     // Sanitize the status of the allocation/synchronization
+    directory = __GetPageDirectory(parentPageMasterTable, pageMasterTable, virtualAddress,
+                                   isCurrent, createIfMissing, update);
     if (directory == NULL) {
         return NULL;
     }
 
     mapping = atomic_load(&directory->pTables[pdIndex]);
 SyncPd:
-    if (mapping & PAGE_PRESENT) {
+    if ((mapping & (PAGE_PRESENT | PAGETABLE_LARGE)) == (PAGE_PRESENT | PAGETABLE_LARGE)) {
+        // Callers of this function operate on individual pages, so the large page
+        // must be split before we can hand out a page-table.
+        table = __SplitLargePage(directory, virtualAddress, mapping);
+        if (!table) {
+            mapping = atomic_load(&directory->pTables[pdIndex]);
+            if (mapping & PAGETABLE_LARGE) {
+                ERROR("MmVirtualGetTable failed to split large page at 0x%" PRIxIN, virtualAddress);
+                return NULL;
+            }
+            goto SyncPd;
+        }
+        *update = isCurrent;
+    }
+    else if (mapping & PAGE_PRESENT) {
         table = (PageTable_t*)directory->vTables[pdIndex];
         assert(table != NULL);
     }
@@ -233,7 +324,7 @@ SyncPd:
         memset((void*)table, 0, sizeof(PageTable_t));
 
         // Adjust the physical pointer to include flags
-        physical |= createFlags;
+        physical |= __GetCreateFlags(virtualAddress);
         result = atomic_compare_exchange_strong(
                 &directory->pTables[pdIndex], &mapping, physical);
         if (!result) {
@@ -249,6 +340,139 @@ SyncPd:
 	return table;
 }
 
+PageDirectory_t*
+MmVirtualGetLargePageDirectory(
+        _In_ PageMasterTable_t* parentPageMasterTable,
+        _In_ PageMasterTable_t* pageMasterTable,
+        _In_ vaddr_t            virtualAddress)
+{
+    PageDirectory_t* directory;
+    uint64_t         mapping;
+    int              update;
+
+    if (!pageMasterTable) {
+        return NULL;
+    }
+
+    directory = __GetPageDirectory(parentPageMasterTable, pageMasterTable, virtualAddress, 0, 0, &update);
+    if (directory == NULL) {
+        return NULL;
+    }
+
+    mapping = atomic_load(&directory->pTables[PAGE_DIRECTORY_INDEX(virtualAddress)]);
+    if ((mapping & (PAGE_PRESENT | PAGETABLE_LARGE)) != (PAGE_PRESENT | PAGETABLE_LARGE)) {
+        return NULL;
+    }
+    return directory;
+}
+
+oserr_t
+MmVirtualSetLargePage(
+        _In_ PageMasterTable_t* parentPageMasterTable,
+        _In_ PageMasterTable_t* pageMasterTable,
+        _In_ vaddr_t            virtualAddress,
+        _In_ paddr_t            physicalAddress,
+        _In_ unsigned int       attributes,
+        _In_ int                isCurrent)
+{
+    PageDirectory_t* directory;
+    PageTable_t*     table = NULL;
+    uint64_t         mapping;
+    int              pdIndex = PAGE_DIRECTORY_INDEX(virtualAddress);
+    int              update;
+
+    if (!pageMasterTable || (virtualAddress & ~LARGE_PAGE_MASK) || (physicalAddress & ~LARGE_PAGE_MASK)) {
+        return OS_EINVALPARAMS;
+    }
+
+    directory = __GetPageDirectory(parentPageMasterTable, pageMasterTable, virtualAddress,
+                                   isCurrent, 1, &update);
+    if (directory == NULL) {
+        return OS_EOOM;
+    }
+
+    // The range is only allowed to be covered by an empty page-table, which can
+    // happen for regions where the page-tables are created up front.
+    mapping = atomic_load(&directory->pTables[pdIndex]);
+    if (mapping & PAGE_PRESENT) {
+        if (mapping & PAGETABLE_LARGE) {
+            return OS_EEXISTS;
+        }
+
+        table = (PageTable_t*)directory->vTables[pdIndex];
+        for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
+            if (atomic_load_explicit(&table->Pages[i], memory_order_relaxed) != 0) {
+                return OS_EEXISTS;
+            }
+        }
+    }
+
+    if (!atomic_compare_exchange_strong(&directory->pTables[pdIndex], &mapping,
+                                        physicalAddress | attributes | PAGETABLE_LARGE)) {
+        return OS_EEXISTS;
+    }
+
+    // The page-tables of the shared region are allocated from boot memory and must never
+    // be freed. Park those for when the large page is split or cleared again, the physical
+    // address is kept in the first entry as the table is not seen by the MMU while parked.
+    if (table) {
+        if (ISINRANGE(virtualAddress, MEMORY_LOCATION_SHARED_START, MEMORY_LOCATION_SHARED_END)) {
+            atomic_store(&table->Pages[0], mapping & PAGE_MASK);
+        } else {
+            directory->vTables[pdIndex] = 0;
+            kfree((void*)table);
+        }
+    }
+
+    if (isCurrent) {
+        memory_invalidate_addr(virtualAddress);
+    }
+    atomic_fetch_add(&g_largePagesMapped, 1);
+    return OS_EOK;
+}
+
+uintptr_t
+MmVirtualClearLargePage(
+        _In_ PageMasterTable_t* parentPageMasterTable,
+        _In_ PageMasterTable_t* pageMasterTable,
+        _In_ vaddr_t            virtualAddress,
+        _In_ int                isCurrent)
+{
+    PageDirectory_t* directory;
+    PageTable_t*     table;
+    uint64_t         mapping;
+    uint64_t         cleared = 0;
+    int              pdIndex = PAGE_DIRECTORY_INDEX(virtualAddress);
+
+    directory = MmVirtualGetLargePageDirectory(parentPageMasterTable, pageMasterTable, virtualAddress);
+    if (directory == NULL) {
+        return 0;
+    }
+
+    // Restore the parked page-table if there is one, so the range looks exactly like
+    // it did before the large page was mapped.
+    table = (PageTable_t*)directory->vTables[pdIndex];
+    if (table) {
+        cleared = (atomic_load(&table->Pages[0]) & PAGE_MASK) | __GetCreateFlags(virtualAddress);
+    }
+
+    mapping = atomic_load(&directory->pTables[pdIndex]);
+    if (!(mapping & PAGETABLE_LARGE) ||
+        !atomic_compare_exchange_strong(&directory->pTables[pdIndex], &mapping, cleared)) {
+        return 0;
+    }
+
+    if (table) {
+        atomic_store(&table->Pages[0], 0);
+    }
+
+    if (isCurrent) {
+        memory_invalidate_addr(virtualAddress);
+    }
+    atomic_fetch_sub(&g_largePagesMapped, 1);
+    return mapping;
+}
+
 static oserr_t
 __CloneKernelDirectory(
         _In_ PageMasterTable_t* source,
@@ -400,6 +624,20 @@ MmVirtualDestroyPageDirectory(
         if ((mapping & PAGETABLE_INHERITED) || !(mapping & PAGE_PRESENT)) {
             continue;
         }
+
+        // Large pages have no page-table, release the physical pages directly. The
+        // persistent bit is shared with the inherited bit, and thus is handled above.
+        if (mapping & PAGETABLE_LARGE) {
+            paddr_t addresses[64];
+            for (int j = 0; j < ENTRIES_PER_PAGE; j++) {
+                addresses[j % 64] = (mapping & LARGE_PAGE_MASK) + (j * PAGE_SIZE);
+                if ((j % 64) == 63) {
+                    FreePhysicalMemory(64, &addresses[0]);
+                }
+            }
+            atomic_fetch_sub(&g_largePagesMapped, 1);
+            continue;
+        }
         MmVirtualDestroyPageTable((PageTable_t*)pageDirectory->vTables[i]);
     }
     kfree(pageDirectory);
@@ -22,10 +22,55 @@
 
 #include <component/domain.h>
 #include <arch/utils.h>
+#include <heap.h>
 #include <machine.h>
+#include <memoryspace.h>
+#include <string.h>
 
 #include "cpu_private.h"
 
+static oserr_t
+__InitializeDomainMemory(
+        _In_ SystemDomain_t* domain,
+        _In_ uintptr_t       memoryStart,
+        _In_ size_t          memoryLength)
+{
+    SystemMemoryAllocator_t* physicalMemory = &GetMachine()->PhysicalMemory;
+    SystemMemoryAllocator_t* allocator      = &domain->Memory.Allocator;
+    size_t                   pageSize       = GetMemorySpacePageSize();
+
+    SystemMemoryConstruct(&domain->Memory, memoryStart, memoryLength, pageSize, 0);
+
+    // The domain uses the same memory masks as the rest of the system, the regions
+    // stay empty until the free pages are distributed to the domains.
+    allocator->MaskCount = physicalMemory->MaskCount;
+    for (int i = 0; i < physicalMemory->MaskCount; i++) {
+        oserr_t oserr;
+        vaddr_t storage;
+        paddr_t page;
+
+        oserr = MemorySpaceMap(
+                GetCurrentMemorySpace(),
+                &(struct MemorySpaceMapOptions) {
+                    .Pages = &page,
+                    .Length = pageSize,
+                    .Mask = __MASK,
+                    .Flags = MAPPING_COMMIT | MAPPING_DOMAIN,
+                    .PlacementFlags = MAPPING_VIRTUAL_GLOBAL
+                },
+                &storage
+        );
+        if (oserr != OS_EOK) {
+            return oserr;
+        }
+
+        allocator->Masks[i] = physicalMemory->Masks[i];
+        SpinlockConstruct(&allocator->Region[i].Lock);
+        MemoryStackConstruct(&allocator->Region[i].Stack, pageSize, storage, pageSize);
+    }
+    return OS_EOK;
+}
+
 oserr_t
 CreateNumaDomain(
         _In_  uuid_t            DomainId,
@@ -34,6 +79,32 @@ CreateNumaDomain(
         _In_  uintptr_t         MemoryRangeLength,
         _Out_ SystemDomain_t**  Domain)
 {
+    SystemDomain_t* domain;
+    oserr_t         oserr;
+    _CRT_UNUSED(NumberOfCores);
+
+    domain = kmalloc(sizeof(SystemDomain_t));
+    if (domain == NULL) {
+        return OS_EOOM;
+    }
+    memset(domain, 0, sizeof(SystemDomain_t));
+    ELEMENT_INIT(&domain->Header, (uintptr_t)DomainId, domain);
+    domain->Id = DomainId;
+
+    oserr = __InitializeDomainMemory(domain, MemoryRangeStart, MemoryRangeLength);
+    if (oserr != OS_EOK) {
+        kfree(domain);
+        return oserr;
+    }
+
+    oserr = SystemMemoryTopologyAddDomain(&GetMachine()->MemoryTopology, &domain->Memory);
+    if (oserr != OS_EOK) {
+        kfree(domain);
+        return oserr;
+    }
+
+    list_append(GetDomains(), &domain->Header);
+    *Domain = domain;
     return OS_EOK;
 }
 
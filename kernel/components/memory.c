@@ -19,8 +19,12 @@
  *   different memory regions that map to physical components
  */
 
+#define __need_minmax
+#include <arch/utils.h>
 #include <assert.h>
 #include <component/memory.h>
+#include <heap.h>
+#include <string.h>
 
 void
 SystemMemoryConstruct(
@@ -36,6 +40,11 @@ SystemMemoryConstruct(
     systemMemory->Size = size;
     systemMemory->BlockSize = blockSize;
     systemMemory->Attributes = attributes;
+    atomic_store(&systemMemory->LocalPages, 0);
+    atomic_store(&systemMemory->FallbackPages, 0);
+    atomic_store(&systemMemory->RemotePages, 0);
+    atomic_store(&systemMemory->InterleavedPages, 0);
+    atomic_store(&systemMemory->FreedPages, 0);
 
     // initialize the allocator if the memory region has data
     if (size != 0) {
@@ -49,64 +58,992 @@ SystemMemoryConstruct(
     }
 }
 
+static void
+__RegionLock(
+        _In_ SystemMemoryAllocatorRegion_t* region)
+{
+    // If someone is holding or waiting for the lock already, count it
+    // so we can see how contended the region is
+    int contended = atomic_load(&region->Lock.Current) != atomic_load(&region->Lock.Next);
+    SpinlockAcquireIrq(&region->Lock);
+    region->LockAcquisitions++;
+    if (contended) {
+        region->LockContention++;
+    }
+}
+
+static void
+__RegionUnlock(
+        _In_ SystemMemoryAllocatorRegion_t* region)
+{
+    SpinlockReleaseIrq(&region->Lock);
+}
+
+// Makes sure the stack of the locked region has room for <entryCount> more entries. The
+// stack is never extended while the region lock is held, as the new storage is mapped with
+// pages from the physical allocator, which may need the same lock. So the lock is released
+// while storage is allocated, and taken again. Storage that is left over is returned in
+// <storage>, and must be freed with MemoryStackFreeStorage once the lock is released.
+static oserr_t
+__RegionReserve(
+        _In_    SystemMemoryAllocatorRegion_t* region,
+        _In_    int                            entryCount,
+        _InOut_ uintptr_t*                     storage,
+        _InOut_ size_t*                        storageSize)
+{
+    oserr_t oserr;
+
+    while ((region->Stack.capacity - region->Stack.index) < entryCount) {
+        __RegionUnlock(region);
+        if (*storage) {
+            MemoryStackFreeStorage(*storage, *storageSize);
+            *storage = 0;
+        }
+        oserr = MemoryStackAllocateStorage(&region->Stack, storage, storageSize);
+        __RegionLock(region);
+        if (oserr != OS_EOK) {
+            *storage = 0;
+            return oserr;
+        }
+
+        // The stack may have been extended by someone else in the meantime,
+        // then the storage we allocated is freed again.
+        if (*storageSize > region->Stack.data_size) {
+            MemoryStackReplaceStorage(&region->Stack, *storage, *storageSize, storage, storageSize);
+        }
+    }
+    return OS_EOK;
+}
+
+// Gives a list of pages back to the region stack. This must be called without any
+// locks held, as the stack may need to be extended.
+static oserr_t
+__RegionPushPages(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            pageCount,
+        _In_ const uintptr_t*               pages)
+{
+    uintptr_t storage     = 0;
+    size_t    storageSize = 0;
+    oserr_t   oserr;
+
+    __RegionLock(region);
+    oserr = __RegionReserve(region, pageCount, &storage, &storageSize);
+    if (oserr == OS_EOK) {
+        MemoryStackPushMultiple(&region->Stack, pages, pageCount);
+    }
+    __RegionUnlock(region);
+
+    if (storage) {
+        MemoryStackFreeStorage(storage, storageSize);
+    }
+    return oserr;
+}
+
+// Pops up to <pageCount> pages from the region stack, returns the number of pages
+// that was popped. The region lock must be held.
+static int
+__RegionPop(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            pageCount,
+        _In_ uintptr_t*                     pages)
+{
+    int     pagesAllocated = pageCount;
+    oserr_t oserr          = MemoryStackPop(&region->Stack, &pagesAllocated, pages);
+    if (oserr == OS_EOOM) {
+        return 0;
+    }
+    return pagesAllocated;
+}
+
+// Takes single pages from the buddy zone of the region, this is only done when the
+// stack is empty, as it fragments the zone. The region lock must be held.
+static int
+__RegionPopBuddy(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            pageCount,
+        _In_ uintptr_t*                     pages)
+{
+    int pagesAllocated = 0;
+    while (pagesAllocated < pageCount) {
+        if (MemoryBuddyAllocate(&region->Buddy, 1, &pages[pagesAllocated]) != OS_EOK) {
+            break;
+        }
+        pagesAllocated++;
+    }
+    return pagesAllocated;
+}
+
+// Returns pages to the region, pages that belong to the buddy zone are coalesced
+// with adjacent pages in the list. Returns the number of pages consumed from the list.
+// The region lock must be held, and the stack must have room for one more entry.
+static int
+__RegionPush(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            pageCount,
+        _In_ const uintptr_t*               pages)
+{
+    int runLength = 1;
+
+    if (!MemoryBuddyContains(&region->Buddy, pages[0])) {
+        MemoryStackPush(&region->Stack, pages[0], 1);
+        return 1;
+    }
+
+    while (runLength < pageCount &&
+           pages[runLength] == (pages[runLength - 1] + region->Buddy.block_size) &&
+           MemoryBuddyContains(&region->Buddy, pages[runLength])) {
+        runLength++;
+    }
+    MemoryBuddyFree(&region->Buddy, pages[0], runLength);
+    return runLength;
+}
+
+static SystemMemoryPageCache_t*
+__GetPageCache(
+        _In_ SystemMemoryAllocatorRegion_t* region)
+{
+    uuid_t coreId = ArchGetProcessorCoreId();
+    if (coreId >= (uuid_t)region->PageCacheCount) {
+        return NULL;
+    }
+    return &region->PageCaches[coreId];
+}
+
+static int
+__PageCacheAllocate(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            pageCount,
+        _In_ uintptr_t*                     pages)
+{
+    SystemMemoryPageCache_t* pageCache = __GetPageCache(region);
+    int                      pagesAllocated;
+
+    if (pageCache == NULL) {
+        return 0;
+    }
+
+    // We may be moved to another core after looking up the cache, which is fine
+    // as the lock is only there to allow others to steal the pages.
+    SpinlockAcquireIrq(&pageCache->Lock);
+    if (pageCache->Count < pageCount) {
+        __RegionLock(region);
+        pageCache->Count += __RegionPop(region, MEMORY_PAGE_CACHE_BATCH, &pageCache->Pages[pageCache->Count]);
+        __RegionUnlock(region);
+        pageCache->Misses++;
+    } else {
+        pageCache->Hits++;
+    }
+
+    pagesAllocated = MIN(pageCount, pageCache->Count);
+    for (int i = 0; i < pagesAllocated; i++) {
+        pages[i] = pageCache->Pages[--pageCache->Count];
+    }
+    SpinlockReleaseIrq(&pageCache->Lock);
+    return pagesAllocated;
+}
+
+// Takes pages from the page caches of all cores, this is only done when the
+// region itself is out of pages.
+static int
+__PageCacheSteal(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            pageCount,
+        _In_ uintptr_t*                     pages)
+{
+    int pagesAllocated = 0;
+
+    for (int i = 0; i < region->PageCacheCount && pagesAllocated < pageCount; i++) {
+        SystemMemoryPageCache_t* pageCache = &region->PageCaches[i];
+        SpinlockAcquireIrq(&pageCache->Lock);
+        while (pageCache->Count && pagesAllocated < pageCount) {
+            pages[pagesAllocated++] = pageCache->Pages[--pageCache->Count];
+        }
+        SpinlockReleaseIrq(&pageCache->Lock);
+    }
+    return pagesAllocated;
+}
+
+static int
+__PageCacheFree(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ uintptr_t                      page)
+{
+    SystemMemoryPageCache_t* pageCache = __GetPageCache(region);
+    uintptr_t                drained[MEMORY_PAGE_CACHE_HIGH - MEMORY_PAGE_CACHE_LOW];
+    int                      pagesDrained = 0;
+
+    if (pageCache == NULL) {
+        return 0;
+    }
+
+    SpinlockAcquireIrq(&pageCache->Lock);
+    if (pageCache->Count == MEMORY_PAGE_CACHE_HIGH) {
+        // Take out the pages at the bottom, they are the ones that
+        // have been in the cache the longest.
+        pagesDrained = MEMORY_PAGE_CACHE_HIGH - MEMORY_PAGE_CACHE_LOW;
+        memcpy(&drained[0], &pageCache->Pages[0], pagesDrained * sizeof(uintptr_t));
+        memmove(&pageCache->Pages[0], &pageCache->Pages[pagesDrained],
+                MEMORY_PAGE_CACHE_LOW * sizeof(uintptr_t));
+        pageCache->Count = MEMORY_PAGE_CACHE_LOW;
+        pageCache->Drains++;
+    }
+    pageCache->Pages[pageCache->Count++] = page;
+    SpinlockReleaseIrq(&pageCache->Lock);
+
+    // The drained pages are given back without the cache lock, as the region stack
+    // may be extended, which allocates pages through this cache.
+    if (pagesDrained) {
+        (void)__RegionPushPages(region, pagesDrained, &drained[0]);
+    }
+    return 1;
+}
+
 static SystemMemoryAllocatorRegion_t*
-__GetAppropriateAllocator(
-        _In_  SystemMemory_t* systemMemory,
-        _In_  size_t          memoryMask)
+__GetRegionForAddress(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ uintptr_t                address)
+{
+    for (int i = 0; i < allocator->MaskCount; i++) {
+        if (address <= allocator->Masks[i]) {
+            return &allocator->Region[i];
+        }
+    }
+    return NULL;
+}
+
+oserr_t
+SystemMemoryAllocatorInitializePageCaches(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      coreCount)
+{
+    for (int i = 0; i < allocator->MaskCount; i++) {
+        SystemMemoryPageCache_t* pageCaches = kmalloc(sizeof(SystemMemoryPageCache_t) * coreCount);
+        if (pageCaches == NULL) {
+            return OS_EOOM;
+        }
+
+        memset(pageCaches, 0, sizeof(SystemMemoryPageCache_t) * coreCount);
+        for (int j = 0; j < coreCount; j++) {
+            SpinlockConstruct(&pageCaches[j].Lock);
+        }
+
+        // Install the caches with the region locked, so no one is in the middle of
+        // a refill or drain while the caches appear
+        __RegionLock(&allocator->Region[i]);
+        allocator->Region[i].PageCaches     = pageCaches;
+        allocator->Region[i].PageCacheCount = coreCount;
+        __RegionUnlock(&allocator->Region[i]);
+    }
+    return OS_EOK;
+}
+
+oserr_t
+SystemMemoryAllocatorAllocate(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages)
 {
+    int pagesLeft = pageCount;
     int i;
-    if (memoryMask == 0) {
-        // if caller do not care then return highest allocator
-        return &systemMemory->Allocator.Region[systemMemory->Allocator.MaskCount - 1];
+
+    // Go from the highest region and downwards, skipping those that
+    // contain memory above the requested mask
+    for (i = allocator->MaskCount - 1; i >= 0 && pagesLeft; i--) {
+        SystemMemoryAllocatorRegion_t* region = &allocator->Region[i];
+        uintptr_t*                     target = &pages[pageCount - pagesLeft];
+        if (memoryMask && memoryMask < allocator->Masks[i]) {
+            continue;
+        }
+
+        if (pagesLeft <= MEMORY_PAGE_CACHE_BATCH) {
+            pagesLeft -= __PageCacheAllocate(region, pagesLeft, target);
+            if (!pagesLeft) {
+                break;
+            }
+            target = &pages[pageCount - pagesLeft];
+        }
+
+        // The buddy zone is not used to refill the page caches, so pages that belong
+        // to it are never found in a cache.
+        __RegionLock(region);
+        pagesLeft -= __RegionPop(region, pagesLeft, target);
+        if (pagesLeft) {
+            pagesLeft -= __RegionPopBuddy(region, pagesLeft, &pages[pageCount - pagesLeft]);
+        }
+        __RegionUnlock(region);
     }
 
-    for (i = systemMemory->Allocator.MaskCount - 1; i > 0; i--) {
-        if (memoryMask >= systemMemory->Allocator.Masks[i]) {
-            break;
+    // Before giving up, take the pages that are resting in the caches
+    // of the other cores.
+    for (i = allocator->MaskCount - 1; i >= 0 && pagesLeft; i--) {
+        if (memoryMask && memoryMask < allocator->Masks[i]) {
+            continue;
         }
+        pagesLeft -= __PageCacheSteal(&allocator->Region[i], pagesLeft, &pages[pageCount - pagesLeft]);
     }
-    return &systemMemory->Allocator.Region[i];
+
+    if (pagesLeft) {
+        if (pageCount - pagesLeft) {
+            SystemMemoryAllocatorFree(allocator, pageCount - pagesLeft, pages);
+        }
+        return OS_EOOM;
+    }
+    return OS_EOK;
 }
 
 oserr_t
-SystemMemoryAllocate(
-        _In_ SystemMemory_t* systemMemory,
-        _In_ size_t          memoryMask,
-        _In_ int             pageCount,
-        _In_ uintptr_t*      pages)
+SystemMemoryAllocatorAllocateContiguous(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages)
 {
-    oserr_t oserr;
-    int     pagesAllocated = pageCount;
-    SystemMemoryAllocatorRegion_t* region;
-
-    // default to highest allocator
-    region = &systemMemory->Allocator.Region[systemMemory->Allocator.MaskCount - 1];
-    if (memoryMask) {
-        for (int i = systemMemory->Allocator.MaskCount - 1; i >= 0; i--) {
-            if (memoryMask >= systemMemory->Allocator.Masks[i]) {
-                region = &systemMemory->Allocator.Region[i];
+    for (int i = allocator->MaskCount - 1; i >= 0; i--) {
+        SystemMemoryAllocatorRegion_t* region = &allocator->Region[i];
+        uintptr_t                      address;
+        oserr_t                        oserr;
+        if (memoryMask && memoryMask < allocator->Masks[i]) {
+            continue;
+        }
+
+        __RegionLock(region);
+        oserr = MemoryBuddyAllocate(&region->Buddy, pageCount, &address);
+        if (oserr == OS_EOK) {
+            region->ContiguousAllocations++;
+        } else {
+            region->ContiguousFailures++;
+        }
+        __RegionUnlock(region);
+
+        if (oserr == OS_EOK) {
+            for (int j = 0; j < pageCount; j++) {
+                pages[j] = address + (j * region->Buddy.block_size);
             }
+            return OS_EOK;
         }
     }
+    return OS_EOOM;
+}
 
-    SpinlockAcquireIrq(&region->Lock);
-    oserr = MemoryStackPop(&region->Stack, &pagesAllocated, pages);
-    if (oserr == OS_EINCOMPLETE) {
-        MemoryStackPushMultiple(&region->Stack, pages, pagesAllocated);
-        oserr = OS_EOOM;
+oserr_t
+SystemMemoryAllocatorFree(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      pageCount,
+        _In_ const uintptr_t*         pages)
+{
+    SystemMemoryAllocatorRegion_t* locked      = NULL;
+    uintptr_t                      storage     = 0;
+    size_t                         storageSize = 0;
+    oserr_t                        oserr       = OS_EOK;
+
+    for (int i = 0; i < pageCount; i++) {
+        SystemMemoryAllocatorRegion_t* region;
+
+        // Let's be OK with partially filled lists
+        if (pages[i] == 0) {
+            continue;
+        }
+
+        region = __GetRegionForAddress(allocator, pages[i]);
+        if (region == NULL) {
+            oserr = OS_EINVALPARAMS;
+            continue;
+        }
+
+        // Small frees are absorbed by the page cache of this core, unless the pages
+        // belong to the buddy zone, which must get them back to coalesce them.
+        if (pageCount <= MEMORY_PAGE_CACHE_BATCH && !MemoryBuddyContains(&region->Buddy, pages[i])) {
+            if (locked != NULL) {
+                __RegionUnlock(locked);
+                locked = NULL;
+            }
+            if (!__PageCacheFree(region, pages[i]) && __RegionPushPages(region, 1, &pages[i]) != OS_EOK) {
+                oserr = OS_EOOM;
+            }
+            continue;
+        }
+
+        // Larger ones go directly to the regions, and we keep the lock
+        // while the pages belong to the same region.
+        if (locked != region) {
+            if (locked != NULL) {
+                __RegionUnlock(locked);
+            }
+            __RegionLock(region);
+            locked = region;
+        }
+
+        // Pages outside the buddy zone take up an entry on the stack
+        if (!MemoryBuddyContains(&region->Buddy, pages[i]) &&
+            __RegionReserve(region, 1, &storage, &storageSize) != OS_EOK) {
+            oserr = OS_EOOM;
+            continue;
+        }
+        i += __RegionPush(region, pageCount - i, &pages[i]) - 1;
+    }
+
+    if (locked != NULL) {
+        __RegionUnlock(locked);
+    }
+    if (storage) {
+        MemoryStackFreeStorage(storage, storageSize);
     }
-    SpinlockReleaseIrq(&region->Lock);
     return oserr;
 }
 
+void
+SystemMemoryAllocatorGetStatistics(
+        _In_  SystemMemoryAllocator_t*           allocator,
+        _Out_ SystemMemoryAllocatorStatistics_t* statistics)
+{
+    memset(statistics, 0, sizeof(SystemMemoryAllocatorStatistics_t));
+    for (int i = 0; i < allocator->MaskCount; i++) {
+        SystemMemoryAllocatorRegion_t* region = &allocator->Region[i];
+        for (int j = 0; j < region->PageCacheCount; j++) {
+            statistics->PageCacheHits   += region->PageCaches[j].Hits;
+            statistics->PageCacheMisses += region->PageCaches[j].Misses;
+            statistics->PageCacheDrains += region->PageCaches[j].Drains;
+            statistics->PagesCached     += (size_t)region->PageCaches[j].Count;
+        }
+        statistics->ContiguousPagesFree   += region->Buddy.blocks_free;
+        statistics->ContiguousAllocations += region->ContiguousAllocations;
+        statistics->ContiguousFailures    += region->ContiguousFailures;
+        statistics->LockAcquisitions += region->LockAcquisitions;
+        statistics->LockContention   += region->LockContention;
+    }
+    statistics->ZeroPoolPages  = (size_t)allocator->ZeroPool.Count;
+    statistics->ZeroPoolTarget = (size_t)allocator->ZeroPool.Target;
+    statistics->ZeroPoolHits   = allocator->ZeroPool.Hits;
+    statistics->ZeroPoolMisses = allocator->ZeroPool.Misses;
+}
+
+void
+SystemMemoryAllocatorInitializeZeroPool(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      target)
+{
+    SpinlockConstruct(&allocator->ZeroPool.Lock);
+    allocator->ZeroPool.Count  = 0;
+    allocator->ZeroPool.Hits   = 0;
+    allocator->ZeroPool.Misses = 0;
+    SystemMemoryAllocatorZeroPoolSetTarget(allocator, target);
+}
+
+void
+SystemMemoryAllocatorZeroPoolSetTarget(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      target)
+{
+    SystemMemoryZeroPool_t* pool = &allocator->ZeroPool;
+
+    SpinlockAcquireIrq(&pool->Lock);
+    pool->Target = MAX(0, MIN(target, MEMORY_ZERO_POOL_CAPACITY));
+    SpinlockReleaseIrq(&pool->Lock);
+}
+
+int
+SystemMemoryAllocatorZeroPoolDeficit(
+        _In_ SystemMemoryAllocator_t* allocator)
+{
+    SystemMemoryZeroPool_t* pool = &allocator->ZeroPool;
+    int                     deficit;
+
+    SpinlockAcquireIrq(&pool->Lock);
+    deficit = MAX(0, pool->Target - pool->Count);
+    SpinlockReleaseIrq(&pool->Lock);
+    return deficit;
+}
+
+int
+SystemMemoryAllocatorZeroPoolTake(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages)
+{
+    SystemMemoryZeroPool_t* pool  = &allocator->ZeroPool;
+    int                     taken = 0;
+
+    SpinlockAcquireIrq(&pool->Lock);
+    // Take pages from the top, skipping those above the mask. The pages left behind
+    // are moved down to keep the pool packed.
+    for (int i = pool->Count - 1; i >= 0 && taken < pageCount; i--) {
+        if (memoryMask && pool->Pages[i] > memoryMask) {
+            continue;
+        }
+        pages[taken++] = pool->Pages[i];
+        pool->Pages[i] = pool->Pages[--pool->Count];
+    }
+    pool->Hits   += (size_t)taken;
+    pool->Misses += (size_t)(pageCount - taken);
+    SpinlockReleaseIrq(&pool->Lock);
+    return taken;
+}
+
+int
+SystemMemoryAllocatorZeroPoolPut(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      pageCount,
+        _In_ const uintptr_t*         pages)
+{
+    SystemMemoryZeroPool_t* pool = &allocator->ZeroPool;
+    int                     added;
+
+    SpinlockAcquireIrq(&pool->Lock);
+    added = MAX(0, MIN(pageCount, pool->Target - pool->Count));
+    memcpy(&pool->Pages[pool->Count], pages, sizeof(uintptr_t) * added);
+    pool->Count += added;
+    SpinlockReleaseIrq(&pool->Lock);
+    return added;
+}
+
+int
+SystemMemoryAllocatorZeroPoolReclaim(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ bool                     drain,
+        _In_ int                      maxPages,
+        _In_ uintptr_t*               pages)
+{
+    SystemMemoryZeroPool_t* pool = &allocator->ZeroPool;
+    int                     removed;
+
+    SpinlockAcquireIrq(&pool->Lock);
+    removed = MAX(0, MIN(maxPages, pool->Count - (drain ? 0 : pool->Target)));
+    pool->Count -= removed;
+    memcpy(pages, &pool->Pages[pool->Count], sizeof(uintptr_t) * removed);
+    SpinlockReleaseIrq(&pool->Lock);
+    return removed;
+}
+
+static void
+__UpdateFallbackOrder(
+        _In_ SystemMemoryTopology_t* topology)
+{
+    for (int i = 0; i < topology->DomainCount; i++) {
+        int* order = &topology->FallbackOrder[i][0];
+
+        // Sort the domains by their distance, with ties broken by walking forward from
+        // the local domain, so domains at the same distance don't all fall back to the same one.
+        for (int j = 0; j < topology->DomainCount; j++) {
+            int domain = (i + j) % topology->DomainCount;
+            int k      = j;
+            while (k > 0 && topology->Distances[i][order[k - 1]] > topology->Distances[i][domain]) {
+                order[k] = order[k - 1];
+                k--;
+            }
+            order[k] = domain;
+        }
+    }
+}
+
 oserr_t
-SystemMemoryFree(
+SystemMemoryTopologyAddDomain(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ SystemMemory_t*         memory)
+{
+    int index = topology->DomainCount;
+    if (index == MEMORY_DOMAIN_COUNT) {
+        return OS_EOOM;
+    }
+
+    for (int i = 0; i < index; i++) {
+        topology->Distances[index][i] = MEMORY_DOMAIN_DISTANCE_REMOTE;
+        topology->Distances[i][index] = MEMORY_DOMAIN_DISTANCE_REMOTE;
+    }
+    topology->Distances[index][index] = MEMORY_DOMAIN_DISTANCE_LOCAL;
+    topology->Domains[index]          = memory;
+    topology->DomainCount++;
+    __UpdateFallbackOrder(topology);
+    return OS_EOK;
+}
+
+void
+SystemMemoryTopologySetDistance(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     from,
+        _In_ int                     to,
+        _In_ uint8_t                 distance)
+{
+    if (from < 0 || from >= topology->DomainCount || to < 0 || to >= topology->DomainCount) {
+        return;
+    }
+    topology->Distances[from][to] = distance;
+    __UpdateFallbackOrder(topology);
+}
+
+static int
+__GetDomainIndex(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ SystemMemory_t*         memory)
+{
+    for (int i = 0; i < topology->DomainCount; i++) {
+        if (topology->Domains[i] == memory) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int
+__GetDomainForAddress(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ uintptr_t               address)
+{
+    for (int i = 0; i < topology->DomainCount; i++) {
+        if (SystemMemoryContainsAddress(topology->Domains[i], address) == OS_EOK) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the domain that owns the page, or -1 if it belongs to the default allocator. The
+// buddy zones are not distributed to the domains, so they always belong to the default allocator.
+static int
+__GetOwnerOfAddress(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ uintptr_t               address)
+{
+    if (topology->Default != NULL) {
+        for (int i = 0; i < topology->Default->MaskCount; i++) {
+            if (MemoryBuddyContains(&topology->Default->Region[i].Buddy, address)) {
+                return -1;
+            }
+        }
+    }
+    return __GetDomainForAddress(topology, address);
+}
+
+// Pushes a run of contiguous pages onto the stack of the region. This must be called
+// without any locks held, as the stack may need to be extended.
+static oserr_t
+__RegionPushRun(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ uintptr_t                      base,
+        _In_ int                            pageCount)
+{
+    uintptr_t storage     = 0;
+    size_t    storageSize = 0;
+    oserr_t   oserr;
+
+    __RegionLock(region);
+    oserr = __RegionReserve(region, 1, &storage, &storageSize);
+    if (oserr == OS_EOK) {
+        MemoryStackPush(&region->Stack, base, pageCount);
+    }
+    __RegionUnlock(region);
+
+    if (storage) {
+        MemoryStackFreeStorage(storage, storageSize);
+    }
+    return oserr;
+}
+
+// Returns the number of pages from the start of the list that are contiguous, and
+// end up in the same region of the same owner.
+static int
+__GetRunLength(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     pageCount,
+        _In_ const uintptr_t*        pages,
+        _In_ size_t                  pageSize)
+{
+    int                            domain = __GetDomainForAddress(topology, pages[0]);
+    SystemMemoryAllocatorRegion_t* region = NULL;
+    int                            runLength = 1;
+
+    if (domain != -1) {
+        region = __GetRegionForAddress(&topology->Domains[domain]->Allocator, pages[0]);
+    }
+
+    while (runLength < pageCount && pages[runLength] == (pages[runLength - 1] + pageSize)) {
+        if (__GetDomainForAddress(topology, pages[runLength]) != domain) {
+            break;
+        }
+        if (domain != -1 && __GetRegionForAddress(&topology->Domains[domain]->Allocator, pages[runLength]) != region) {
+            break;
+        }
+        runLength++;
+    }
+    return runLength;
+}
+
+size_t
+SystemMemoryTopologyDistribute(
+        _In_ SystemMemoryTopology_t*  topology,
+        _In_ SystemMemoryAllocator_t* source)
+{
+    uintptr_t batch[MEMORY_PAGE_CACHE_HIGH];
+    size_t    pagesMoved = 0;
+
+    // The pages are moved as runs of contiguous pages, as the stacks of the domains start
+    // out small, and pages pushed one at a time would each need an entry.
+    for (int i = 0; i < source->MaskCount; i++) {
+        SystemMemoryAllocatorRegion_t* region       = &source->Region[i];
+        size_t                         pageSize     = region->Stack.block_size;
+        uintptr_t*                     kept         = NULL;
+        int                            keptCount    = 0;
+        int                            keptCapacity = 0;
+        int                            pageCount;
+        int                            runLength;
+
+        // Empty the stack of the region, and then give back the pages that
+        // no domain wants once we are done.
+        while (1) {
+            __RegionLock(region);
+            pageCount = __RegionPop(region, MEMORY_PAGE_CACHE_HIGH, &batch[0]);
+            __RegionUnlock(region);
+            if (!pageCount) {
+                break;
+            }
+
+            for (int j = 0; j < pageCount; j += runLength) {
+                int domain = __GetDomainForAddress(topology, batch[j]);
+                runLength  = __GetRunLength(topology, pageCount - j, &batch[j], pageSize);
+                if (domain != -1) {
+                    SystemMemoryAllocatorRegion_t* target = __GetRegionForAddress(
+                            &topology->Domains[domain]->Allocator, batch[j]);
+                    if (target != NULL && __RegionPushRun(target, batch[j], runLength) == OS_EOK) {
+                        pagesMoved += runLength;
+                        continue;
+                    }
+                }
+
+                if (keptCount + runLength > keptCapacity) {
+                    int        capacity = keptCapacity ? (keptCapacity * 2) : MEMORY_PAGE_CACHE_HIGH;
+                    uintptr_t* storage  = kmalloc(capacity * sizeof(uintptr_t));
+                    if (storage == NULL) {
+                        // Out of memory to track the pages in, give them back now
+                        // and stop distributing this region.
+                        for (int k = j; k < pageCount; k += runLength) {
+                            runLength = __GetRunLength(topology, pageCount - k, &batch[k], pageSize);
+                            (void)__RegionPushRun(region, batch[k], runLength);
+                        }
+                        pageCount = 0;
+                        break;
+                    }
+                    if (kept != NULL) {
+                        memcpy(storage, kept, keptCount * sizeof(uintptr_t));
+                        kfree(kept);
+                    }
+                    kept         = storage;
+                    keptCapacity = capacity;
+                }
+                memcpy(&kept[keptCount], &batch[j], runLength * sizeof(uintptr_t));
+                keptCount += runLength;
+            }
+            if (!pageCount) {
+                break;
+            }
+        }
+
+        // The pages were taken from this stack, so unless we are out of memory
+        // they always fit when given back.
+        for (int j = 0; j < keptCount; j += runLength) {
+            runLength = __GetRunLength(topology, keptCount - j, &kept[j], pageSize);
+            (void)__RegionPushRun(region, kept[j], runLength);
+        }
+        if (kept != NULL) {
+            kfree(kept);
+        }
+    }
+    return pagesMoved;
+}
+
+static oserr_t
+__AllocateLocal(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     local,
+        _In_ size_t                  memoryMask,
+        _In_ int                     pageCount,
+        _In_ uintptr_t*              pages)
+{
+    for (int i = 0; i < topology->DomainCount; i++) {
+        int             domain = local == -1 ? i : topology->FallbackOrder[local][i];
+        SystemMemory_t* memory = topology->Domains[domain];
+        if (SystemMemoryAllocatorAllocate(&memory->Allocator, memoryMask, pageCount, pages) != OS_EOK) {
+            continue;
+        }
+
+        // Allocations without a local domain, like the ones made before the cores
+        // are started, are not accounted to any domain.
+        if (local == -1) {
+            return OS_EOK;
+        }
+
+        if (domain == local) {
+            atomic_fetch_add(&memory->LocalPages, pageCount);
+        } else {
+            atomic_fetch_add(&topology->Domains[local]->FallbackPages, pageCount);
+            atomic_fetch_add(&memory->RemotePages, pageCount);
+        }
+        return OS_EOK;
+    }
+
+    if (topology->Default == NULL) {
+        return OS_EOOM;
+    }
+    return SystemMemoryAllocatorAllocate(topology->Default, memoryMask, pageCount, pages);
+}
+
+static oserr_t
+__AllocateInterleaved(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     local,
+        _In_ size_t                  memoryMask,
+        _In_ int                     pageCount,
+        _In_ uintptr_t*              pages)
+{
+    uintptr_t    batch[MEMORY_PAGE_CACHE_BATCH];
+    int          domainCount = topology->DomainCount;
+    int          roundSize   = domainCount * MEMORY_PAGE_CACHE_BATCH;
+    unsigned int cursor;
+
+    // Reserve the slots, so concurrent interleaved allocations continue where
+    // the previous one stopped instead of all starting at the same domain.
+    cursor = atomic_fetch_add(&topology->InterleaveCursor, (unsigned int)pageCount);
+    memset(pages, 0, pageCount * sizeof(uintptr_t));
+
+    // Each round takes up to a batch of pages from every domain, so the domains are
+    // taken one lock acquisition at a time. Page i is served by domain (cursor + i) % domainCount.
+    for (int round = 0; round < pageCount; round += roundSize) {
+        for (int i = 0; i < domainCount; i++) {
+            SystemMemory_t* memory = topology->Domains[i];
+            int             first  = round + (int)((i + domainCount - (cursor % domainCount)) % domainCount);
+            int             count  = 0;
+            oserr_t         oserr;
+
+            for (int j = first; j < MIN(pageCount, round + roundSize); j += domainCount) {
+                count++;
+            }
+            if (!count) {
+                continue;
+            }
+
+            oserr = SystemMemoryAllocatorAllocate(&memory->Allocator, memoryMask, count, &batch[0]);
+            if (oserr == OS_EOK) {
+                atomic_fetch_add(&memory->InterleavedPages, count);
+            } else {
+                // The domain is out of memory, so its share is served like
+                // any other allocation instead.
+                oserr = __AllocateLocal(topology, local, memoryMask, count, &batch[0]);
+                if (oserr != OS_EOK) {
+                    SystemMemoryTopologyFree(topology, pageCount, pages);
+                    return oserr;
+                }
+            }
+
+            for (int j = 0; j < count; j++) {
+                pages[first + (j * domainCount)] = batch[j];
+            }
+        }
+    }
+    return OS_EOK;
+}
+
+oserr_t
+SystemMemoryTopologyAllocate(
+        _In_ SystemMemoryTopology_t*  topology,
+        _In_ SystemMemory_t*          local,
+        _In_ enum SystemMemoryPolicy  policy,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages)
+{
+    int localIndex;
+
+    if (!topology->DomainCount) {
+        return SystemMemoryAllocatorAllocate(topology->Default, memoryMask, pageCount, pages);
+    }
+
+    localIndex = __GetDomainIndex(topology, local);
+    if (policy == SystemMemoryPolicy_INTERLEAVE && topology->DomainCount > 1) {
+        return __AllocateInterleaved(topology, localIndex, memoryMask, pageCount, pages);
+    }
+    return __AllocateLocal(topology, localIndex, memoryMask, pageCount, pages);
+}
+
+oserr_t
+SystemMemoryTopologyFree(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     pageCount,
+        _In_ const uintptr_t*        pages)
+{
+    oserr_t oserr = OS_EOK;
+    int     i     = 0;
+
+    if (!topology->DomainCount) {
+        return SystemMemoryAllocatorFree(topology->Default, pageCount, pages);
+    }
+
+    // Free the pages in runs that belong to the same domain
+    while (i < pageCount) {
+        SystemMemoryAllocator_t* allocator;
+        int                      domain;
+        int                      runLength = 1;
+
+        if (pages[i] == 0) {
+            i++;
+            continue;
+        }
+
+        domain    = __GetOwnerOfAddress(topology, pages[i]);
+        allocator = domain == -1 ? topology->Default : &topology->Domains[domain]->Allocator;
+        while (i + runLength < pageCount && pages[i + runLength] != 0 &&
+               __GetOwnerOfAddress(topology, pages[i + runLength]) == domain) {
+            runLength++;
+        }
+
+        if (allocator == NULL || SystemMemoryAllocatorFree(allocator, runLength, &pages[i]) != OS_EOK) {
+            oserr = OS_EINVALPARAMS;
+        } else if (domain != -1) {
+            atomic_fetch_add(&topology->Domains[domain]->FreedPages, runLength);
+        }
+        i += runLength;
+    }
+    return oserr;
+}
+
+oserr_t
+SystemMemoryTopologyGetStatistics(
+        _In_  SystemMemoryTopology_t*         topology,
+        _In_  int                             domain,
+        _Out_ SystemMemoryDomainStatistics_t* statistics)
+{
+    SystemMemory_t* memory;
+
+    if (domain < 0 || domain >= topology->DomainCount) {
+        return OS_EINVALPARAMS;
+    }
+
+    memory = topology->Domains[domain];
+    statistics->LocalPages       = atomic_load(&memory->LocalPages);
+    statistics->FallbackPages    = atomic_load(&memory->FallbackPages);
+    statistics->RemotePages      = atomic_load(&memory->RemotePages);
+    statistics->InterleavedPages = atomic_load(&memory->InterleavedPages);
+    statistics->FreedPages       = atomic_load(&memory->FreedPages);
+    return OS_EOK;
+}
+
+oserr_t
+SystemMemoryAllocate(
         _In_ SystemMemory_t* systemMemory,
+        _In_ size_t          memoryMask,
         _In_ int             pageCount,
         _In_ uintptr_t*      pages)
 {
+    return SystemMemoryAllocatorAllocate(&systemMemory->Allocator, memoryMask, pageCount, pages);
+}
 
-    return OS_EOK;
+oserr_t
+SystemMemoryFree(
+        _In_ SystemMemory_t* systemMemory,
+        _In_ int             pageCount,
+        _In_ uintptr_t*      pages)
+{
+    return SystemMemoryAllocatorFree(&systemMemory->Allocator, pageCount, pages);
 }
 
 oserr_t
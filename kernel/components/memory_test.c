@@ -0,0 +1,934 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <arch/interrupts.h>
+#include <component/memory.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAGE_SIZE   0x1000
+#define CORE_COUNT  4
+#define LOW_MASK    0xFFFFFF
+#define HIGH_MASK   0x7FFFFFFF
+
+// The memory stack is opaque to the allocator, so the test keeps a plain
+// stack of page addresses to make it easy to verify.
+struct MemoryStackItem {
+    uintptr_t Address;
+};
+
+// The synthetic NUMA map has up to three domains of 512MB each, starting at 256MB
+#define DOMAIN_COUNT   3
+#define DOMAIN_SIZE    ((uintptr_t)0x20000000)
+#define DOMAIN_BASE(i) ((uintptr_t)0x10000000 + ((uintptr_t)(i) * DOMAIN_SIZE))
+
+static struct __TestContext {
+    SystemMemoryAllocator_t Allocator;
+    uint64_t                BuddyBitmaps[MEMORY_MASK_COUNT];
+    SystemMemory_t          Domains[DOMAIN_COUNT];
+    SystemMemoryTopology_t  Topology;
+} g_testContext;
+
+// Each test thread acts as a core
+static __thread uuid_t g_coreId = 0;
+
+// The number of spinlocks held by the test thread, stack storage must
+// never be allocated while holding one.
+static __thread int g_locksHeld = 0;
+static int          g_storageAllocations = 0;
+
+static void
+__FillRegion(int region, uintptr_t base, int pageCount)
+{
+    MemoryStack_t* stack = &g_testContext.Allocator.Region[region].Stack;
+    for (int i = 0; i < pageCount; i++) {
+        MemoryStackPush(stack, base + (i * PAGE_SIZE), 1);
+    }
+}
+
+// The buddy allocator is mocked with a single bitmap of up to 64 pages, which
+// is enough to see which pages the allocator takes from the zone.
+static void
+__FillBuddyZone(int region, uintptr_t base, int pageCount)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Allocator.Region[region].Buddy;
+    assert_true(pageCount <= 64);
+    buddy->base        = base;
+    buddy->block_size  = PAGE_SIZE;
+    buddy->block_count = pageCount;
+    buddy->bitmaps[0]  = &g_testContext.BuddyBitmaps[region];
+    MemoryBuddyFree(buddy, base, pageCount);
+}
+
+static int
+__FreePagesInRegion(int region)
+{
+    return g_testContext.Allocator.Region[region].Stack.index;
+}
+
+static void
+__DestroyAllocator(SystemMemoryAllocator_t* allocator)
+{
+    for (int i = 0; i < MEMORY_MASK_COUNT; i++) {
+        free(allocator->Region[i].Stack.items);
+        free(allocator->Region[i].PageCaches);
+    }
+}
+
+static int
+__SetupAllocator(SystemMemoryAllocator_t* allocator)
+{
+    // Two regions, one below 16MB, and one up to 2GB
+    allocator->MaskCount = 2;
+    allocator->Masks[0]  = LOW_MASK;
+    allocator->Masks[1]  = HIGH_MASK;
+    for (int i = 0; i < 2; i++) {
+        MemoryStack_t* stack = &allocator->Region[i].Stack;
+        stack->block_size = PAGE_SIZE;
+        stack->capacity   = 0x10000;
+        stack->data_size  = sizeof(struct MemoryStackItem) * stack->capacity;
+        stack->items      = malloc(stack->data_size);
+        if (stack->items == NULL) {
+            return -1;
+        }
+        SpinlockConstruct(&allocator->Region[i].Lock);
+    }
+    return 0;
+}
+
+// Builds the synthetic NUMA map, where the default allocator
+// holds the memory outside the domains.
+static void
+__SetupTopology(int domainCount)
+{
+    g_testContext.Topology.Default = &g_testContext.Allocator;
+    for (int i = 0; i < domainCount; i++) {
+        SystemMemoryConstruct(&g_testContext.Domains[i], DOMAIN_BASE(i), DOMAIN_SIZE, PAGE_SIZE, 0);
+        assert_int_equal(SystemMemoryTopologyAddDomain(&g_testContext.Topology, &g_testContext.Domains[i]), OS_EOK);
+    }
+}
+
+static void
+__FillDomain(int domain, int pageCount)
+{
+    MemoryStack_t* stack = &g_testContext.Domains[domain].Allocator.Region[1].Stack;
+    for (int i = 0; i < pageCount; i++) {
+        MemoryStackPush(stack, DOMAIN_BASE(domain) + (i * PAGE_SIZE), 1);
+    }
+}
+
+static int
+__FreePagesInDomain(int domain)
+{
+    return g_testContext.Domains[domain].Allocator.Region[1].Stack.index;
+}
+
+static int
+__DomainOfPage(uintptr_t page)
+{
+    for (int i = 0; i < DOMAIN_COUNT; i++) {
+        if (page >= DOMAIN_BASE(i) && page < DOMAIN_BASE(i) + DOMAIN_SIZE) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int SetupTest(void** state) {
+    (void)state;
+
+    __DestroyAllocator(&g_testContext.Allocator);
+    for (int i = 0; i < DOMAIN_COUNT; i++) {
+        __DestroyAllocator(&g_testContext.Domains[i].Allocator);
+    }
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+
+    if (__SetupAllocator(&g_testContext.Allocator)) {
+        return -1;
+    }
+    for (int i = 0; i < DOMAIN_COUNT; i++) {
+        if (__SetupAllocator(&g_testContext.Domains[i].Allocator)) {
+            return -1;
+        }
+    }
+    g_coreId             = 0;
+    g_storageAllocations = 0;
+    return 0;
+}
+
+void TestAllocate_RespectsMask(void** state)
+{
+    uintptr_t pages[32];
+    (void)state;
+
+    __FillRegion(0, 0x100000, 32);
+    __FillRegion(1, 0x10000000, 32);
+
+    // Without a mask the highest region is used
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 32, &pages[0]), OS_EOK);
+    for (int i = 0; i < 32; i++) {
+        assert_true(pages[i] >= 0x10000000);
+    }
+
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, LOW_MASK, 32, &pages[0]), OS_EOK);
+    for (int i = 0; i < 32; i++) {
+        assert_true(pages[i] <= LOW_MASK);
+    }
+    assert_int_equal(__FreePagesInRegion(0), 0);
+}
+
+void TestAllocate_FallsBackToLowerRegion(void** state)
+{
+    uintptr_t pages[48];
+    (void)state;
+
+    __FillRegion(0, 0x100000, 32);
+    __FillRegion(1, 0x10000000, 32);
+
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 48, &pages[0]), OS_EOK);
+    for (int i = 0; i < 32; i++) {
+        assert_true(pages[i] >= 0x10000000);
+    }
+    for (int i = 32; i < 48; i++) {
+        assert_true(pages[i] <= LOW_MASK);
+    }
+    assert_int_equal(__FreePagesInRegion(0), 16);
+    assert_int_equal(__FreePagesInRegion(1), 0);
+}
+
+void TestAllocate_OutOfMemoryKeepsPages(void** state)
+{
+    uintptr_t pages[80];
+    (void)state;
+
+    __FillRegion(0, 0x100000, 32);
+    __FillRegion(1, 0x10000000, 32);
+
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 80, &pages[0]), OS_EOOM);
+    assert_int_equal(__FreePagesInRegion(0), 32);
+    assert_int_equal(__FreePagesInRegion(1), 32);
+}
+
+void TestFree_InvalidPage(void** state)
+{
+    uintptr_t pages[2] = { 0x1000, 0x80000000 };
+    (void)state;
+
+    // The valid page is still freed
+    assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 2, &pages[0]), OS_EINVALPARAMS);
+    assert_int_equal(__FreePagesInRegion(0), 1);
+}
+
+void TestPageCache_RefillsInBatches(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         pages[MEMORY_PAGE_CACHE_BATCH];
+    (void)state;
+
+    __FillRegion(1, 0x10000000, 128);
+    assert_int_equal(SystemMemoryAllocatorInitializePageCaches(&g_testContext.Allocator, CORE_COUNT), OS_EOK);
+
+    // The first allocation refills the cache, the rest of the batch is served without the lock
+    for (int i = 0; i < MEMORY_PAGE_CACHE_BATCH; i++) {
+        assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 1, &pages[i]), OS_EOK);
+    }
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PageCacheMisses, 1);
+    assert_int_equal(stats.PageCacheHits, MEMORY_PAGE_CACHE_BATCH - 1);
+    assert_int_equal(stats.LockAcquisitions, 3); // installation of two regions, and the refill
+    assert_int_equal(__FreePagesInRegion(1), 128 - MEMORY_PAGE_CACHE_BATCH);
+
+    // The pages go back to the cache
+    for (int i = 0; i < MEMORY_PAGE_CACHE_BATCH; i++) {
+        assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 1, &pages[i]), OS_EOK);
+    }
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PagesCached, MEMORY_PAGE_CACHE_BATCH);
+    assert_int_equal(stats.LockAcquisitions, 3);
+}
+
+void TestPageCache_DrainsAtHighWatermark(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         pages[MEMORY_PAGE_CACHE_BATCH + 1];
+    uintptr_t                         page;
+    (void)state;
+
+    assert_int_equal(SystemMemoryAllocatorInitializePageCaches(&g_testContext.Allocator, CORE_COUNT), OS_EOK);
+
+    for (int i = 0; i <= MEMORY_PAGE_CACHE_HIGH; i++) {
+        page = 0x10000000 + (i * PAGE_SIZE);
+        assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 1, &page), OS_EOK);
+    }
+
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PageCacheDrains, 1);
+    assert_int_equal(stats.PagesCached, MEMORY_PAGE_CACHE_LOW + 1);
+    assert_int_equal(__FreePagesInRegion(1), MEMORY_PAGE_CACHE_HIGH - MEMORY_PAGE_CACHE_LOW);
+
+    // Large frees bypass the cache
+    for (int i = 0; i < MEMORY_PAGE_CACHE_BATCH + 1; i++) {
+        pages[i] = 0x20000000 + (i * PAGE_SIZE);
+    }
+    assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, MEMORY_PAGE_CACHE_BATCH + 1, &pages[0]), OS_EOK);
+    assert_int_equal(__FreePagesInRegion(1), MEMORY_PAGE_CACHE_HIGH - MEMORY_PAGE_CACHE_LOW + MEMORY_PAGE_CACHE_BATCH + 1);
+}
+
+// Gives the stack of the region a single page of storage, like the stacks start out with
+static void
+__ShrinkRegionStack(SystemMemoryAllocator_t* allocator, int region)
+{
+    MemoryStack_t* stack = &allocator->Region[region].Stack;
+    free(stack->items);
+    stack->capacity  = 256;
+    stack->data_size = sizeof(struct MemoryStackItem) * stack->capacity;
+    stack->items     = malloc(stack->data_size);
+    assert_non_null(stack->items);
+}
+
+void TestPageCache_DrainExtendsStackOutsideLocks(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         page;
+    (void)state;
+
+    __ShrinkRegionStack(&g_testContext.Allocator, 1);
+    __FillRegion(1, 0x20000000, 256);
+    assert_int_equal(SystemMemoryAllocatorInitializePageCaches(&g_testContext.Allocator, CORE_COUNT), OS_EOK);
+
+    // The stack is full when the cache drains, so it is extended on the way
+    for (int i = 0; i <= MEMORY_PAGE_CACHE_HIGH; i++) {
+        page = 0x10000000 + (i * PAGE_SIZE);
+        assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 1, &page), OS_EOK);
+    }
+
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PageCacheDrains, 1);
+    assert_int_equal(g_storageAllocations, 1);
+    assert_int_equal(__FreePagesInRegion(1), 256 + MEMORY_PAGE_CACHE_HIGH - MEMORY_PAGE_CACHE_LOW);
+}
+
+void TestFree_ExtendsStackOutsideLocks(void** state)
+{
+    uintptr_t pages[MEMORY_PAGE_CACHE_BATCH * 4];
+    uintptr_t page = 0x30000000;
+    (void)state;
+
+    __ShrinkRegionStack(&g_testContext.Allocator, 1);
+    __FillRegion(1, 0x20000000, 256);
+
+    // Without page caches, even single pages go to the region
+    assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 1, &page), OS_EOK);
+    assert_int_equal(g_storageAllocations, 1);
+    assert_int_equal(__FreePagesInRegion(1), 257);
+
+    // Every other page is freed, so none of them can share an entry
+    __FillRegion(1, 0x20400000, 511 - 257);
+    for (int i = 0; i < MEMORY_PAGE_CACHE_BATCH * 4; i++) {
+        pages[i] = 0x10000000 + (i * 2 * PAGE_SIZE);
+    }
+    assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, MEMORY_PAGE_CACHE_BATCH * 4, &pages[0]), OS_EOK);
+    assert_int_equal(g_storageAllocations, 2);
+    assert_int_equal(__FreePagesInRegion(1), 511 + (MEMORY_PAGE_CACHE_BATCH * 4));
+}
+
+void TestPageCache_StealsWhenRegionIsEmpty(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         pages[4];
+    (void)state;
+
+    __FillRegion(1, 0x10000000, MEMORY_PAGE_CACHE_BATCH);
+    assert_int_equal(SystemMemoryAllocatorInitializePageCaches(&g_testContext.Allocator, CORE_COUNT), OS_EOK);
+
+    // Core 0 takes the entire region into its cache
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 1, &pages[0]), OS_EOK);
+    assert_int_equal(__FreePagesInRegion(1), 0);
+
+    // Core 1 must take the pages from core 0
+    g_coreId = 1;
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 4, &pages[0]), OS_EOK);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PagesCached, MEMORY_PAGE_CACHE_BATCH - 5);
+
+    // Until everything is gone
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 12, &pages[0]), OS_EOOM);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PagesCached + __FreePagesInRegion(1), MEMORY_PAGE_CACHE_BATCH - 5);
+}
+
+void TestAllocate_FallsBackToBuddyZone(void** state)
+{
+    uintptr_t pages[8];
+    (void)state;
+
+    __FillRegion(1, 0x10000000, 4);
+    __FillBuddyZone(1, 0x20000000, 16);
+
+    // The stack is used first, and then single pages from the zone
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 8, &pages[0]), OS_EOK);
+    for (int i = 0; i < 4; i++) {
+        assert_true(pages[i] < 0x20000000);
+    }
+    for (int i = 4; i < 8; i++) {
+        assert_true(MemoryBuddyContains(&g_testContext.Allocator.Region[1].Buddy, pages[i]));
+    }
+    assert_int_equal(g_testContext.Allocator.Region[1].Buddy.blocks_free, 12);
+}
+
+void TestAllocateContiguous_RespectsMask(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         pages[8];
+    (void)state;
+
+    __FillBuddyZone(0, 0x400000, 32);
+    __FillBuddyZone(1, 0x10000000, 32);
+
+    assert_int_equal(SystemMemoryAllocatorAllocateContiguous(&g_testContext.Allocator, 0, 8, &pages[0]), OS_EOK);
+    assert_int_equal(pages[0], 0x10000000);
+    for (int i = 1; i < 8; i++) {
+        assert_int_equal(pages[i], pages[i - 1] + PAGE_SIZE);
+    }
+
+    assert_int_equal(SystemMemoryAllocatorAllocateContiguous(&g_testContext.Allocator, LOW_MASK, 8, &pages[0]), OS_EOK);
+    assert_int_equal(pages[0], 0x400000);
+
+    // Only the low zone may be used, and it does not have 32 pages left
+    assert_int_equal(SystemMemoryAllocatorAllocateContiguous(&g_testContext.Allocator, LOW_MASK, 32, &pages[0]), OS_EOOM);
+
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.ContiguousAllocations, 2);
+    assert_int_equal(stats.ContiguousFailures, 1);
+    assert_int_equal(stats.ContiguousPagesFree, 48);
+}
+
+void TestFree_BuddyPagesBypassPageCache(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         pages[20];
+    (void)state;
+
+    __FillRegion(1, 0x10000000, 4);
+    __FillBuddyZone(1, 0x20000000, 32);
+    assert_int_equal(SystemMemoryAllocatorInitializePageCaches(&g_testContext.Allocator, CORE_COUNT), OS_EOK);
+
+    // Small frees of zone pages go back to the zone, while the others are cached
+    assert_int_equal(SystemMemoryAllocatorAllocateContiguous(&g_testContext.Allocator, 0, 16, &pages[4]), OS_EOK);
+    assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, 4, &pages[0]), OS_EOK);
+    assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 2, &pages[3]), OS_EOK);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.PagesCached, 1);
+    assert_int_equal(stats.ContiguousPagesFree, 17);
+
+    // Large frees go back in runs
+    assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, 15, &pages[5]), OS_EOK);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.ContiguousPagesFree, 32);
+}
+
+void TestZeroPool_TakeCountsHitsAndMisses(void** state)
+{
+    SystemMemoryAllocatorStatistics_t stats;
+    uintptr_t                         pages[8];
+    uintptr_t                         taken[8];
+    (void)state;
+
+    SystemMemoryAllocatorInitializeZeroPool(&g_testContext.Allocator, 4);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolDeficit(&g_testContext.Allocator), 4);
+
+    // The pool only accepts pages up to its target
+    for (int i = 0; i < 8; i++) {
+        pages[i] = 0x10000000 + (i * PAGE_SIZE);
+    }
+    assert_int_equal(SystemMemoryAllocatorZeroPoolPut(&g_testContext.Allocator, 8, &pages[0]), 4);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolDeficit(&g_testContext.Allocator), 0);
+
+    // Asking for more than the pool holds serves what it can, the rest are misses
+    assert_int_equal(SystemMemoryAllocatorZeroPoolTake(&g_testContext.Allocator, 0, 6, &taken[0]), 4);
+    for (int i = 0; i < 4; i++) {
+        assert_true(taken[i] >= pages[0] && taken[i] <= pages[3]);
+    }
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    assert_int_equal(stats.ZeroPoolPages, 0);
+    assert_int_equal(stats.ZeroPoolTarget, 4);
+    assert_int_equal(stats.ZeroPoolHits, 4);
+    assert_int_equal(stats.ZeroPoolMisses, 2);
+}
+
+void TestZeroPool_TakeRespectsMask(void** state)
+{
+    uintptr_t pages[2] = { LOW_MASK - PAGE_SIZE + 1, 0x10000000 };
+    uintptr_t taken[2];
+    (void)state;
+
+    SystemMemoryAllocatorInitializeZeroPool(&g_testContext.Allocator, 4);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolPut(&g_testContext.Allocator, 2, &pages[0]), 2);
+
+    // Only the low page fits below the mask, and the high page must stay in the pool
+    assert_int_equal(SystemMemoryAllocatorZeroPoolTake(&g_testContext.Allocator, LOW_MASK, 2, &taken[0]), 1);
+    assert_int_equal(taken[0], pages[0]);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolTake(&g_testContext.Allocator, 0, 1, &taken[0]), 1);
+    assert_int_equal(taken[0], pages[1]);
+}
+
+void TestZeroPool_ReclaimAboveTarget(void** state)
+{
+    uintptr_t pages[8];
+    uintptr_t reclaimed[8];
+    (void)state;
+
+    for (int i = 0; i < 8; i++) {
+        pages[i] = 0x10000000 + (i * PAGE_SIZE);
+    }
+    SystemMemoryAllocatorInitializeZeroPool(&g_testContext.Allocator, 8);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolPut(&g_testContext.Allocator, 8, &pages[0]), 8);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolReclaim(&g_testContext.Allocator, false, 8, &reclaimed[0]), 0);
+
+    // Lowering the target leaves the pages in place until they are reclaimed
+    SystemMemoryAllocatorZeroPoolSetTarget(&g_testContext.Allocator, 3);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolDeficit(&g_testContext.Allocator), 0);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolReclaim(&g_testContext.Allocator, false, 2, &reclaimed[0]), 2);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolReclaim(&g_testContext.Allocator, false, 8, &reclaimed[2]), 3);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolReclaim(&g_testContext.Allocator, false, 8, &reclaimed[5]), 0);
+
+    // Draining ignores the target
+    assert_int_equal(SystemMemoryAllocatorZeroPoolReclaim(&g_testContext.Allocator, true, 8, &reclaimed[5]), 3);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolDeficit(&g_testContext.Allocator), 3);
+
+    // The target is capped at the capacity of the pool
+    SystemMemoryAllocatorZeroPoolSetTarget(&g_testContext.Allocator, MEMORY_ZERO_POOL_CAPACITY * 2);
+    assert_int_equal(SystemMemoryAllocatorZeroPoolDeficit(&g_testContext.Allocator), MEMORY_ZERO_POOL_CAPACITY);
+}
+
+void TestTopology_WithoutDomainsUsesDefault(void** state)
+{
+    uintptr_t pages[4];
+    (void)state;
+
+    __SetupTopology(0);
+    __FillRegion(1, 0x10000000, 4);
+
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, NULL, SystemMemoryPolicy_INTERLEAVE, 0, 4, &pages[0]), OS_EOK);
+    assert_int_equal(__FreePagesInRegion(1), 0);
+    assert_int_equal(SystemMemoryTopologyFree(&g_testContext.Topology, 4, &pages[0]), OS_EOK);
+    assert_int_equal(__FreePagesInRegion(1), 4);
+}
+
+void TestTopology_AllocatesLocalFirst(void** state)
+{
+    SystemMemoryDomainStatistics_t stats;
+    uintptr_t                      pages[8];
+    (void)state;
+
+    __SetupTopology(2);
+    __FillDomain(0, 32);
+    __FillDomain(1, 32);
+
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[1],
+                                                  SystemMemoryPolicy_LOCAL, 0, 8, &pages[0]), OS_EOK);
+    for (int i = 0; i < 8; i++) {
+        assert_int_equal(__DomainOfPage(pages[i]), 1);
+    }
+
+    assert_int_equal(SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 1, &stats), OS_EOK);
+    assert_int_equal(stats.LocalPages, 8);
+    assert_int_equal(stats.FallbackPages, 0);
+    assert_int_equal(SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 0, &stats), OS_EOK);
+    assert_int_equal(stats.RemotePages, 0);
+    assert_int_equal(SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 2, &stats), OS_EINVALPARAMS);
+}
+
+void TestTopology_FallsBackByDistance(void** state)
+{
+    SystemMemoryDomainStatistics_t stats;
+    uintptr_t                      pages[8];
+    (void)state;
+
+    // Domain 2 is closer to domain 0 than domain 1 is
+    __SetupTopology(3);
+    SystemMemoryTopologySetDistance(&g_testContext.Topology, 0, 2, 15);
+    __FillDomain(1, 8);
+    __FillDomain(2, 8);
+    __FillRegion(1, 0x8000000, 8);
+
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_LOCAL, 0, 8, &pages[0]), OS_EOK);
+    assert_int_equal(__DomainOfPage(pages[0]), 2);
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_LOCAL, 0, 8, &pages[0]), OS_EOK);
+    assert_int_equal(__DomainOfPage(pages[0]), 1);
+
+    // Memory outside the domains is the last resort
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_LOCAL, 0, 8, &pages[0]), OS_EOK);
+    assert_int_equal(__DomainOfPage(pages[0]), -1);
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_LOCAL, 0, 1, &pages[0]), OS_EOOM);
+
+    SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 0, &stats);
+    assert_int_equal(stats.LocalPages, 0);
+    assert_int_equal(stats.FallbackPages, 16);
+    SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 2, &stats);
+    assert_int_equal(stats.RemotePages, 8);
+}
+
+void TestTopology_Interleave(void** state)
+{
+    SystemMemoryDomainStatistics_t stats;
+    uintptr_t                      pages[40];
+    (void)state;
+
+    __SetupTopology(2);
+    __FillDomain(0, 64);
+    __FillDomain(1, 64);
+
+    // Consecutive pages come from consecutive domains, across the batch boundaries
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_INTERLEAVE, 0, 39, &pages[0]), OS_EOK);
+    for (int i = 0; i < 39; i++) {
+        assert_int_equal(__DomainOfPage(pages[i]), i % 2);
+    }
+
+    // The next allocation continues where the last one stopped
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_INTERLEAVE, 0, 1, &pages[39]), OS_EOK);
+    assert_int_equal(__DomainOfPage(pages[39]), 1);
+
+    SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 0, &stats);
+    assert_int_equal(stats.InterleavedPages, 20);
+    SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 1, &stats);
+    assert_int_equal(stats.InterleavedPages, 20);
+
+    // And the pages go back to the domain they came from
+    assert_int_equal(SystemMemoryTopologyFree(&g_testContext.Topology, 40, &pages[0]), OS_EOK);
+    assert_int_equal(__FreePagesInDomain(0), 64);
+    assert_int_equal(__FreePagesInDomain(1), 64);
+    SystemMemoryTopologyGetStatistics(&g_testContext.Topology, 1, &stats);
+    assert_int_equal(stats.FreedPages, 20);
+}
+
+void TestTopology_InterleaveFallsBackWhenDomainIsFull(void** state)
+{
+    uintptr_t pages[32];
+    (void)state;
+
+    __SetupTopology(2);
+    __FillDomain(0, 32);
+    __FillDomain(1, 4);
+
+    // Domain 1 can't take its share, so that is served from the local domain
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_INTERLEAVE, 0, 16, &pages[0]), OS_EOK);
+    for (int i = 0; i < 16; i++) {
+        assert_int_equal(__DomainOfPage(pages[i]), 0);
+    }
+    assert_int_equal(__FreePagesInDomain(1), 4);
+
+    // When no one can serve the request, nothing is kept
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, &g_testContext.Domains[0],
+                                                  SystemMemoryPolicy_INTERLEAVE, 0, 32, &pages[0]), OS_EOOM);
+    assert_int_equal(__FreePagesInDomain(0), 16);
+    assert_int_equal(__FreePagesInDomain(1), 4);
+}
+
+void TestTopology_Distribute(void** state)
+{
+    (void)state;
+
+    __SetupTopology(2);
+    __FillRegion(0, 0x100000, 8);
+    __FillRegion(1, DOMAIN_BASE(0), 16);
+    __FillRegion(1, DOMAIN_BASE(1), 16);
+    __FillRegion(1, DOMAIN_BASE(2), 8);
+
+    assert_int_equal(SystemMemoryTopologyDistribute(&g_testContext.Topology, &g_testContext.Allocator), 32);
+    assert_int_equal(__FreePagesInDomain(0), 16);
+    assert_int_equal(__FreePagesInDomain(1), 16);
+    assert_int_equal(__FreePagesInRegion(0), 8);
+    assert_int_equal(__FreePagesInRegion(1), 8);
+}
+
+void TestTopology_DistributeExtendsStacksOutsideLocks(void** state)
+{
+    MemoryStack_t* stack = &g_testContext.Domains[0].Allocator.Region[1].Stack;
+    (void)state;
+
+    // The domains start out with a single page of storage for their stacks, and
+    // every other page is free, so none of them can share an entry.
+    __ShrinkRegionStack(&g_testContext.Domains[0].Allocator, 1);
+
+    __SetupTopology(1);
+    for (int i = 0; i < 600; i++) {
+        __FillRegion(1, DOMAIN_BASE(0) + (i * 2 * PAGE_SIZE), 1);
+    }
+
+    assert_int_equal(SystemMemoryTopologyDistribute(&g_testContext.Topology, &g_testContext.Allocator), 600);
+    assert_int_equal(__FreePagesInDomain(0), 600);
+    assert_int_equal(__FreePagesInRegion(1), 0);
+    assert_true(stack->capacity >= 600);
+    assert_int_not_equal(g_storageAllocations, 0);
+}
+
+void TestTopology_AllocateWithoutLocalDomainIsNotAccounted(void** state)
+{
+    SystemMemoryDomainStatistics_t stats;
+    uintptr_t                      pages[4];
+    (void)state;
+
+    __SetupTopology(2);
+    __FillDomain(0, 4);
+    __FillDomain(1, 4);
+
+    // Allocations made before the cores know their domain must not show up as local to domain 0
+    assert_int_equal(SystemMemoryTopologyAllocate(&g_testContext.Topology, NULL,
+                                                  SystemMemoryPolicy_LOCAL, 0, 4, &pages[0]), OS_EOK);
+    for (int i = 0; i < 2; i++) {
+        assert_int_equal(SystemMemoryTopologyGetStatistics(&g_testContext.Topology, i, &stats), OS_EOK);
+        assert_int_equal(stats.LocalPages, 0);
+        assert_int_equal(stats.FallbackPages, 0);
+        assert_int_equal(stats.RemotePages, 0);
+    }
+}
+
+struct __BenchmarkThread {
+    pthread_t Thread;
+    uuid_t    CoreId;
+    int       Iterations;
+};
+
+static void*
+__BenchmarkWorker(void* context)
+{
+    struct __BenchmarkThread* thread = context;
+    uintptr_t                 pages[4];
+
+    g_coreId = thread->CoreId;
+    for (int i = 0; i < thread->Iterations; i++) {
+        int count = (i & 3) + 1;
+        assert_int_equal(SystemMemoryAllocatorAllocate(&g_testContext.Allocator, 0, count, &pages[0]), OS_EOK);
+        assert_int_equal(SystemMemoryAllocatorFree(&g_testContext.Allocator, count, &pages[0]), OS_EOK);
+    }
+    return NULL;
+}
+
+static double
+__RunBenchmark(int iterations)
+{
+    struct __BenchmarkThread threads[CORE_COUNT];
+    struct timespec          start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CORE_COUNT; i++) {
+        threads[i].CoreId     = (uuid_t)i;
+        threads[i].Iterations = iterations;
+        pthread_create(&threads[i].Thread, NULL, __BenchmarkWorker, &threads[i]);
+    }
+    for (int i = 0; i < CORE_COUNT; i++) {
+        pthread_join(threads[i].Thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+void TestPageCache_SmpBenchmark(void** state)
+{
+    SystemMemoryAllocatorStatistics_t before;
+    SystemMemoryAllocatorStatistics_t stats;
+    const int                         iterations = 200000;
+    double                            elapsed;
+    (void)state;
+
+    __FillRegion(1, 0x10000000, 4096);
+
+    elapsed = __RunBenchmark(iterations);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    printf("region only: %.0f ops/s, %zu lock acquisitions, %zu contended\n",
+           (CORE_COUNT * iterations * 2) / elapsed, stats.LockAcquisitions, stats.LockContention);
+    assert_int_equal(__FreePagesInRegion(1), 4096);
+
+    assert_int_equal(SystemMemoryAllocatorInitializePageCaches(&g_testContext.Allocator, CORE_COUNT), OS_EOK);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &before);
+    elapsed = __RunBenchmark(iterations);
+    SystemMemoryAllocatorGetStatistics(&g_testContext.Allocator, &stats);
+    printf("page caches: %.0f ops/s, %zu lock acquisitions, %zu contended, %zu hits, %zu misses\n",
+           (CORE_COUNT * iterations * 2) / elapsed,
+           stats.LockAcquisitions - before.LockAcquisitions,
+           stats.LockContention - before.LockContention,
+           stats.PageCacheHits, stats.PageCacheMisses);
+    assert_true(stats.PageCacheHits > stats.PageCacheMisses);
+    assert_int_equal(stats.PagesCached + __FreePagesInRegion(1), 4096);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestAllocate_RespectsMask, SetupTest),
+            cmocka_unit_test_setup(TestAllocate_FallsBackToLowerRegion, SetupTest),
+            cmocka_unit_test_setup(TestAllocate_OutOfMemoryKeepsPages, SetupTest),
+            cmocka_unit_test_setup(TestFree_InvalidPage, SetupTest),
+            cmocka_unit_test_setup(TestAllocate_FallsBackToBuddyZone, SetupTest),
+            cmocka_unit_test_setup(TestAllocateContiguous_RespectsMask, SetupTest),
+            cmocka_unit_test_setup(TestFree_BuddyPagesBypassPageCache, SetupTest),
+            cmocka_unit_test_setup(TestZeroPool_TakeCountsHitsAndMisses, SetupTest),
+            cmocka_unit_test_setup(TestZeroPool_TakeRespectsMask, SetupTest),
+            cmocka_unit_test_setup(TestZeroPool_ReclaimAboveTarget, SetupTest),
+            cmocka_unit_test_setup(TestTopology_WithoutDomainsUsesDefault, SetupTest),
+            cmocka_unit_test_setup(TestTopology_AllocatesLocalFirst, SetupTest),
+            cmocka_unit_test_setup(TestTopology_FallsBackByDistance, SetupTest),
+            cmocka_unit_test_setup(TestTopology_Interleave, SetupTest),
+            cmocka_unit_test_setup(TestTopology_InterleaveFallsBackWhenDomainIsFull, SetupTest),
+            cmocka_unit_test_setup(TestTopology_Distribute, SetupTest),
+            cmocka_unit_test_setup(TestTopology_DistributeExtendsStacksOutsideLocks, SetupTest),
+            cmocka_unit_test_setup(TestTopology_AllocateWithoutLocalDomainIsNotAccounted, SetupTest),
+            cmocka_unit_test_setup(TestPageCache_RefillsInBatches, SetupTest),
+            cmocka_unit_test_setup(TestPageCache_DrainsAtHighWatermark, SetupTest),
+            cmocka_unit_test_setup(TestPageCache_DrainExtendsStackOutsideLocks, SetupTest),
+            cmocka_unit_test_setup(TestFree_ExtendsStackOutsideLocks, SetupTest),
+            cmocka_unit_test_setup(TestPageCache_StealsWhenRegionIsEmpty, SetupTest),
+            cmocka_unit_test_setup(TestPageCache_SmpBenchmark, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+// Mocks
+uuid_t ArchGetProcessorCoreId(void) {
+    return g_coreId;
+}
+
+irqstate_t InterruptDisable(void) {
+    return 0;
+}
+
+irqstate_t InterruptRestoreState(irqstate_t state) {
+    return state;
+}
+
+void SpinlockConstruct(Spinlock_t* spinlock) {
+    assert_non_null(spinlock);
+    atomic_store(&spinlock->Current, 0);
+    atomic_store(&spinlock->Next, 0);
+}
+
+void SpinlockAcquireIrq(Spinlock_t* spinlock) {
+    irqstate_t   irqState = InterruptDisable();
+    unsigned int ticket   = atomic_fetch_add(&spinlock->Next, 1);
+    while (atomic_load(&spinlock->Current) != ticket) {
+        sched_yield();
+    }
+    spinlock->IrqState = irqState;
+    g_locksHeld++;
+}
+
+void SpinlockReleaseIrq(Spinlock_t* spinlock) {
+    irqstate_t irqState = spinlock->IrqState;
+    g_locksHeld--;
+    atomic_fetch_add(&spinlock->Current, 1);
+    InterruptRestoreState(irqState);
+}
+
+void* kmalloc(size_t size) {
+    return malloc(size);
+}
+
+void kfree(void* object) {
+    free(object);
+}
+
+void MemoryStackPush(MemoryStack_t* stack, uintptr_t address, int blockCount) {
+    for (int i = 0; i < blockCount; i++) {
+        assert_true(stack->index < stack->capacity);
+        stack->items[stack->index++].Address = address + (i * stack->block_size);
+    }
+}
+
+void MemoryStackPushMultiple(MemoryStack_t* stack, const uintptr_t* blocks, int blockCount) {
+    for (int i = 0; i < blockCount; i++) {
+        MemoryStackPush(stack, blocks[i], 1);
+    }
+}
+
+oserr_t MemoryStackAllocateStorage(MemoryStack_t* stack, uintptr_t* dataAddressOut, size_t* dataSizeOut) {
+    assert_int_equal(g_locksHeld, 0);
+    *dataSizeOut    = stack->data_size * 2;
+    *dataAddressOut = (uintptr_t)malloc(*dataSizeOut);
+    assert_true(*dataAddressOut != 0);
+    g_storageAllocations++;
+    return OS_EOK;
+}
+
+void MemoryStackReplaceStorage(MemoryStack_t* stack, uintptr_t dataAddress, size_t dataSize,
+                               uintptr_t* oldDataAddressOut, size_t* oldDataSizeOut) {
+    memcpy((void*)dataAddress, stack->items, stack->index * sizeof(struct MemoryStackItem));
+    *oldDataAddressOut = (uintptr_t)stack->items;
+    *oldDataSizeOut    = stack->data_size;
+    stack->capacity    = (int)(dataSize / sizeof(struct MemoryStackItem));
+    stack->data_size   = dataSize;
+    stack->items       = (struct MemoryStackItem*)dataAddress;
+}
+
+void MemoryStackFreeStorage(uintptr_t dataAddress, size_t dataSize) {
+    (void)dataSize;
+    free((void*)dataAddress);
+}
+
+oserr_t MemoryStackPop(MemoryStack_t* stack, int* blockCount, uintptr_t* blocks) {
+    int i;
+    if (!stack->index) {
+        return OS_EOOM;
+    }
+    for (i = 0; i < *blockCount && stack->index; i++) {
+        blocks[i] = stack->items[--stack->index].Address;
+    }
+    if (i != *blockCount) {
+        *blockCount = i;
+        return OS_EINCOMPLETE;
+    }
+    return OS_EOK;
+}
+
+bool MemoryBuddyContains(MemoryBuddy_t* buddy, uintptr_t address) {
+    return address >= buddy->base && address < (buddy->base + (buddy->block_count * buddy->block_size));
+}
+
+oserr_t MemoryBuddyAllocate(MemoryBuddy_t* buddy, int blockCount, uintptr_t* addressOut) {
+    for (int i = 0; i + blockCount <= buddy->block_count; i++) {
+        uint64_t mask = (blockCount == 64 ? ~0ULL : ((1ULL << blockCount) - 1)) << i;
+        if ((*buddy->bitmaps[0] & mask) == mask) {
+            *buddy->bitmaps[0] &= ~mask;
+            buddy->blocks_free -= blockCount;
+            *addressOut = buddy->base + (i * buddy->block_size);
+            return OS_EOK;
+        }
+    }
+    return OS_EOOM;
+}
+
+void MemoryBuddyFree(MemoryBuddy_t* buddy, uintptr_t address, int blockCount) {
+    int index = (int)((address - buddy->base) / buddy->block_size);
+    assert_true(index + blockCount <= buddy->block_count);
+    for (int i = 0; i < blockCount; i++) {
+        assert_false(*buddy->bitmaps[0] & (1ULL << (index + i)));
+        *buddy->bitmaps[0] |= (1ULL << (index + i));
+    }
+    buddy->blocks_free += blockCount;
+}
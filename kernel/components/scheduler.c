@@ -26,6 +26,7 @@
 //#define __TRACE
 
 #define __need_minmax
+#define __need_static_assert
 #include "assert.h"
 #include "arch/thread.h"
 #include "arch/utils.h"
@@ -53,6 +54,9 @@
 #define STATE_BLOCKED  5
 #define STATE_RUNNING  6
 
+// The level bitmap must be able to hold a bit for each queue
+STATIC_ASSERT(SCHEDULER_LEVEL_COUNT <= 64, Invalid_SchedulerLevelCount);
+
 // all timing units are in nanoseconds
 typedef struct SchedulerObject {
     element_t               Header;
@@ -62,12 +66,36 @@ typedef struct SchedulerObject {
     clock_t                 TimeSlice;
     clock_t                 TimeSliceLeft;
     int                     Queue;
+    int                     InheritedQueue; // SCHEDULER_LEVEL_COUNT when nothing is inherited
+    int                     QueuedLevel;    // The level the object was last queued at
     struct SchedulerObject* Link;
     void*                   Object;
     
     list_t*                 WaitQueueHandle;
     OSTimestamp_t           WakeUpTime;
     oserr_t                 TimeoutReason;
+    OSTimestamp_t           LastMigration;
+    uint64_t                LastRun; // Wall clock in nanoseconds when it last left its core
+    unsigned int            WakeFlags;   // SCHEDULER_WAKE_* of the last wakeup
+    uuid_t                  WakerCoreId; // The core that queued it the last time
+    TimerWheelEntry_t       SleepEntry;
+
+    // Deadline class, all in nanoseconds of wall clock time. The budget is the part
+    // of the runtime that is left in the current period.
+    uint64_t                Runtime;
+    uint64_t                RelativeDeadline;
+    uint64_t                Period;
+    uint64_t                Budget;
+    uint64_t                AbsoluteDeadline;
+    uint64_t                NextPeriod;
+    uint64_t                MissedDeadline; // The last deadline that was counted as missed
+
+    // Latency tracing, in performance counter ticks. The wakeup is only measured
+    // for objects that actually blocked.
+    uint64_t                      BlockedAt;
+    uint64_t                      WokenAt;
+    uint64_t                      QueuedAt;
+    OSSchedulerLatencyHistogram_t Latency[OSSCHEDULERLATENCY_COUNT];
 } SchedulerObject_t;
 
 static struct Transition {
@@ -171,6 +199,95 @@ GetNameOfObject(
     return ThreadName(Thread);
 }
 
+// Latencies are traced with the performance counter, which is the TSC on x86 when
+// it is usable. Without one, nothing is traced.
+static inline uint64_t
+__LatencyTick(void)
+{
+    UInteger64_t tick;
+    if (SystemTimerGetPerformanceTick(&tick) != OS_EOK) {
+        return 0;
+    }
+    return tick.QuadPart;
+}
+
+static void
+__AddToHistogram(
+        _In_ OSSchedulerLatencyHistogram_t* histogram,
+        _In_ uint64_t                       latency)
+{
+    int bucket = latency ? (63 - __builtin_clzll(latency)) : 0;
+
+    histogram->Count++;
+    histogram->Total += latency;
+    histogram->Max    = MAX(histogram->Max, latency);
+    histogram->Buckets[MIN(bucket, OSSCHEDULER_LATENCY_BUCKETS - 1)]++;
+}
+
+// Keeps the largest latencies seen on the core. The smallest of them is the
+// one replaced, so most events are rejected by a single compare.
+static void
+__AddToWorst(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object,
+        _In_ int                type,
+        _In_ uint64_t           latency,
+        _In_ uint64_t           timestamp)
+{
+    OSSchedulerLatencyEvent_t* event = &scheduler->LatencyWorst[scheduler->LatencyWorstMin];
+
+    if (latency <= event->Latency) {
+        return;
+    }
+
+    event->ThreadHandle = ThreadHandle(object->Object);
+    event->Type         = type;
+    event->Latency      = latency;
+    event->Timestamp    = timestamp;
+    for (int i = 0; i < OSSCHEDULER_LATENCY_WORST; i++) {
+        if (scheduler->LatencyWorst[i].Latency < scheduler->LatencyWorst[scheduler->LatencyWorstMin].Latency) {
+            scheduler->LatencyWorstMin = i;
+        }
+    }
+}
+
+static void
+__RecordLatency(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object,
+        _In_ int                type,
+        _In_ uint64_t           since,
+        _In_ uint64_t           now)
+{
+    // Timestamps taken on other cores can be slightly ahead
+    uint64_t latency = now > since ? now - since : 0;
+
+    __AddToHistogram(&object->Latency[type], latency);
+    __AddToHistogram(&scheduler->LatencyHistograms[type], latency);
+    __AddToWorst(scheduler, object, type, latency, now);
+}
+
+// Called for the object that was picked to run next
+static void
+__TraceDispatch(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object)
+{
+    uint64_t now = __LatencyTick();
+    if (!now) {
+        return;
+    }
+
+    if (object->QueuedAt) {
+        __RecordLatency(scheduler, object, OSSCHEDULERLATENCY_RUNQUEUE, object->QueuedAt, now);
+    }
+    if (object->WokenAt) {
+        __RecordLatency(scheduler, object, OSSCHEDULERLATENCY_WAKEUP, object->WokenAt, now);
+    }
+    object->QueuedAt = 0;
+    object->WokenAt  = 0;
+}
+
 static void
 __AppendToQueue(
     _In_ SchedulerQueue_t*  queue,
@@ -220,27 +337,178 @@ __RemoveFromQueue(
     return OS_ENOENT;
 }
 
+// The level queues must only be modified through these, so the bitmap always reflects
+// which queues have runnable objects.
+static void
+__AppendToLevel(
+        _In_ Scheduler_t*       scheduler,
+        _In_ int                level,
+        _In_ SchedulerObject_t* start,
+        _In_ SchedulerObject_t* end)
+{
+    __AppendToQueue(&scheduler->Queues[level], start, end);
+    scheduler->QueueBitmap |= (1ULL << level);
+}
+
+static oserr_t
+__RemoveFromLevel(
+        _In_ Scheduler_t*       scheduler,
+        _In_ int                level,
+        _In_ SchedulerObject_t* object)
+{
+    oserr_t oserr = __RemoveFromQueue(&scheduler->Queues[level], object);
+    if (scheduler->Queues[level].Head == NULL) {
+        scheduler->QueueBitmap &= ~(1ULL << level);
+    }
+    return oserr;
+}
+
+// The level an object runs at is the better of its own level and the level it
+// has inherited from the threads waiting on it.
+static inline int
+__EffectiveLevel(
+        _In_ SchedulerObject_t* object)
+{
+    return MIN(object->Queue, object->InheritedQueue);
+}
+
+static inline uint64_t
+__TimestampToNs(
+        _In_ OSTimestamp_t* timestamp)
+{
+    return ((uint64_t)timestamp->Seconds * NSEC_PER_SEC) + (uint64_t)timestamp->Nanoseconds;
+}
+
+static inline unsigned int
+__DeadlineBandwidth(
+        _In_ uint64_t runtime,
+        _In_ uint64_t period)
+{
+    return (unsigned int)((runtime * SCHEDULER_DEADLINE_SCALE) / period);
+}
+
+static inline uint64_t
+__DeadlineKey(
+        _In_ SchedulerObject_t* object,
+        _In_ bool               throttled)
+{
+    return throttled ? object->NextPeriod : object->AbsoluteDeadline;
+}
+
+// The deadline queues are kept sorted, objects with the same key are kept in
+// the order they were queued.
+static void
+__InsertSorted(
+        _In_ SchedulerQueue_t*  queue,
+        _In_ SchedulerObject_t* object,
+        _In_ bool               throttled)
+{
+    uint64_t           key      = __DeadlineKey(object, throttled);
+    SchedulerObject_t* current  = queue->Head;
+    SchedulerObject_t* previous = NULL;
+
+    while (current && __DeadlineKey(current, throttled) <= key) {
+        previous = current;
+        current  = current->Link;
+    }
+
+    object->Link = current;
+    if (previous == NULL) queue->Head   = object;
+    else previous->Link = object;
+    if (current == NULL) {
+        queue->Tail = object;
+    }
+}
+
+static void
+__StartPeriod(
+        _In_ SchedulerObject_t* object,
+        _In_ uint64_t           start)
+{
+    object->Budget           = object->Runtime;
+    object->AbsoluteDeadline = start + object->RelativeDeadline;
+    object->NextPeriod       = start + object->Period;
+}
+
+// A woken object only keeps its current deadline if it can use the rest of its
+// budget before the deadline without running at more than its admitted bandwidth,
+// otherwise it could take time from the other deadline objects.
+static bool
+__CanKeepPeriod(
+        _In_ SchedulerObject_t* object,
+        _In_ uint64_t           now)
+{
+    if (now >= object->AbsoluteDeadline) {
+        return false;
+    }
+    return (object->Budget * object->Period) <= ((object->AbsoluteDeadline - now) * object->Runtime);
+}
+
+static void
+__QueueDeadlineObject(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object,
+        _In_ int                preempted)
+{
+    OSTimestamp_t currentTime;
+    uint64_t      now;
+
+    SystemTimerGetWallClockTime(&currentTime);
+    now = __TimestampToNs(&currentTime);
+
+    // Out of budget, it has to wait for its next period
+    if (object->Budget == 0 && now < object->NextPeriod) {
+        atomic_fetch_add(&scheduler->DeadlineThrottles, 1);
+        __InsertSorted(&scheduler->ThrottledQueue, object, true);
+        return;
+    }
+
+    if (object->Budget == 0 || (!preempted && !__CanKeepPeriod(object, now))) {
+        __StartPeriod(object, now);
+    }
+    __InsertSorted(&scheduler->DeadlineQueue, object, false);
+}
+
+// Preempted is set when the object is queued again after running, instead of being
+// woken. Deadline objects are not counted as runnable, as they can not be moved to
+// other cores by load balancing.
 static void
 __QueueForScheduler(
         _In_ Scheduler_t*       scheduler,
         _In_ SchedulerObject_t* object,
-        _In_ int                outsideAdvance)
+        _In_ int                preempted)
 {
     int resultState;
     
-    // Verify it doesn't exist in sleep queue, and check both the case where
-    // it is the end of the list and if it's not
-    if (object->Link != NULL ||
-        scheduler->SleepQueue.Tail == object ||
-        scheduler->SleepQueue.Head == object) {
-        __RemoveFromQueue(&scheduler->SleepQueue, object);
+    // Cancel the timeout if it was woken before it
+    if (TIMER_WHEEL_ENTRY_QUEUED(&object->SleepEntry)) {
+        TimerWheelRemove(&scheduler->SleepWheel, &object->SleepEntry);
     }
 
     resultState = ExecuteEvent(object, EVENT_QUEUE_FINISH);
     if (resultState == STATE_INVALID) {
         FATAL(FATAL_SCOPE_KERNEL, "__QueueForScheduler object was NOT in correct state for queueing");
     }
-    __AppendToQueue(&scheduler->Queues[object->Queue], object, object);
+    object->QueuedAt = __LatencyTick();
+    if (object->Flags & SCHEDULER_FLAG_DEADLINE) {
+        __QueueDeadlineObject(scheduler, object, preempted);
+        return;
+    }
+
+    object->QueuedLevel = __EffectiveLevel(object);
+    __AppendToLevel(scheduler, object->QueuedLevel, object, object);
+    atomic_fetch_add(&scheduler->RunnableCount, 1);
+}
+
+// Called when a blocked object is queued again
+static inline void
+__TraceWakeup(
+        _In_ SchedulerObject_t* object)
+{
+    if (object->BlockedAt) {
+        object->WokenAt   = __LatencyTick();
+        object->BlockedAt = 0;
+    }
 }
 
 static void
@@ -249,24 +517,38 @@ __QueueOnCoreFunction(
 {
     Scheduler_t*       scheduler = CpuCoreScheduler(CpuCoreCurrent());
     SchedulerObject_t* object    = (SchedulerObject_t*)context;
-    __QueueForScheduler(scheduler, object, 1);
+    __QueueForScheduler(scheduler, object, 0);
 
     if (ThreadIsCurrentIdle(object->CoreId)) {
         ArchThreadYield();
     }
 }
 
+// Counts a wakeup that queues the object on the core it last ran on
+static inline void
+__CountWakeup(
+    _In_ SchedulerObject_t* object)
+{
+    if (object->CoreId == object->WakerCoreId) {
+        atomic_fetch_add(&SchedulerGetFromCore(object->CoreId)->WakeupsLocal, 1);
+    } else {
+        atomic_fetch_add(&SchedulerGetFromCore(object->CoreId)->WakeupsRemote, 1);
+    }
+}
+
 static inline oserr_t
 __QueueObjectImmediately(
     _In_ SchedulerObject_t* object)
 {
     SystemCpuCore_t* core      = CpuCoreCurrent();
     Scheduler_t*     scheduler = CpuCoreScheduler(core);
+
+    __TraceWakeup(object);
     
     // If the object is running on our core, just append it
     if (CpuCoreId(core) == object->CoreId) {
         SpinlockAcquireIrq(&scheduler->SyncObject);
-        __QueueForScheduler(scheduler, object, 1);
+        __QueueForScheduler(scheduler, object, 0);
         SpinlockReleaseIrq(&scheduler->SyncObject);
 
         // If we are running on the idle thread, we can switch immediately, unless
@@ -279,21 +561,45 @@ __QueueObjectImmediately(
     }
 }
 
+// Moves the accounting of an object that is not in any queue to the target core
+static void
+__TransferObject(
+        _In_ SchedulerObject_t* object,
+        _In_ uuid_t             targetCoreId,
+        _In_ OSTimestamp_t*     currentTime)
+{
+    Scheduler_t* source = SchedulerGetFromCore(object->CoreId);
+    Scheduler_t* target = SchedulerGetFromCore(targetCoreId);
+
+    atomic_fetch_sub(&source->Bandwidth, object->TimeSlice);
+    atomic_fetch_sub(&source->ObjectCount, 1);
+    atomic_fetch_add(&target->Bandwidth, object->TimeSlice);
+    atomic_fetch_add(&target->ObjectCount, 1);
+    OSTimestampCopy(&object->LastMigration, currentTime);
+    object->CoreId = targetCoreId;
+    smp_wmb();
+}
+
+// Objects are only ever placed on, or moved between, the cores of the current domain
+static SystemCpu_t*
+__GetCoreGroup(void)
+{
+    SystemDomain_t* domain = GetCurrentDomain();
+    if (domain != NULL) {
+        return &domain->CoreGroup;
+    }
+    return &GetMachine()->Processor;
+}
+
 static void
 __AllocateScheduler(
     _In_ SchedulerObject_t* object)
 {
-    SystemDomain_t*  domain    = GetCurrentDomain();
-    SystemCpu_t*     coreGroup = &GetMachine()->Processor;
+    SystemCpu_t*     coreGroup = __GetCoreGroup();
     SystemCpuCore_t* iter;
     Scheduler_t*     scheduler;
     uuid_t           coreId;
-    
-    // Select the default core range
-    if (domain != NULL) {
-        // Use the core range from our domain
-        coreGroup = &domain->CoreGroup;
-    }
+
     scheduler = CpuCoreScheduler(coreGroup->Cores);
     coreId    = CpuCoreId(coreGroup->Cores);
     iter      = CpuCoreNext(coreGroup->Cores);
@@ -341,8 +647,10 @@ SchedulerCreateObject(
     
     memset(object, 0, sizeof(SchedulerObject_t));
     ELEMENT_INIT(&object->Header, 0, object);
-    object->State  = STATE_INITIAL;
-    object->Object = payload;
+    TIMER_WHEEL_ENTRY_INIT(&object->SleepEntry, object);
+    object->State          = STATE_INITIAL;
+    object->Object         = payload;
+    object->InheritedQueue = SCHEDULER_LEVEL_COUNT;
 
     if (flags & THREADING_IDLE) {
         object->Queue     = SCHEDULER_LEVEL_LOW;
@@ -350,6 +658,13 @@ SchedulerCreateObject(
         object->CoreId    = ArchGetProcessorCoreId();
         WRITE_VOLATILE(object->Flags, SCHEDULER_FLAG_BOUND);
         // This only happens on the running core, no need for barriers.
+    } else if (flags & THREADING_BACKGROUND) {
+        // Background work only gets the processor when nothing else wants it, until
+        // it is moved up by the periodic boost like any other thread.
+        object->Queue     = SCHEDULER_LEVEL_LOW;
+        object->TimeSlice = SCHEDULER_TIMESLICE_INITIAL + (SCHEDULER_LEVEL_LOW * SCHEDULER_TIMESLICE_STEP);
+        __AllocateScheduler(object);
+        smp_mb();
     } else {
         object->Queue     = 0;
         object->TimeSlice = SCHEDULER_TIMESLICE_INITIAL;
@@ -371,6 +686,10 @@ SchedulerDestroyObject(
     // memory writes to other cores that allocate objects
     atomic_fetch_sub(&scheduler->Bandwidth, object->TimeSlice);
     atomic_fetch_sub(&scheduler->ObjectCount, 1);
+    if (object->Flags & SCHEDULER_FLAG_DEADLINE) {
+        atomic_fetch_sub(&scheduler->DeadlineBandwidth, __DeadlineBandwidth(object->Runtime, object->Period));
+        atomic_fetch_sub(&scheduler->DeadlineCount, 1);
+    }
     
     kfree(object);
 }
@@ -463,11 +782,13 @@ SchedulerExpediteObject(
             (void)list_remove(object->WaitQueueHandle, &object->Header);
         }
         object->TimeoutReason = OS_EINTERRUPTED;
+        object->WakerCoreId   = ArchGetProcessorCoreId();
         
         // Either the resulting state is RUNNING which means we cancelled the block,
         // the rest is then up to the scheduler, or we update the state to QUEUEING,
         // which means we must initiate a queue operation.
         if (resultState == STATE_QUEUEING) {
+            __CountWakeup(object);
             __QueueObjectImmediately(object);
         }
     }
@@ -497,11 +818,195 @@ SchedulerQueueObject(
     // the rest is then up to the scheduler, or we update the state to QUEUEING,
     // which means we must initiate a queue operation.
     if (resultState == STATE_QUEUEING) {
+        object->WakerCoreId = ArchGetProcessorCoreId();
+        __CountWakeup(object);
         osStatus = __QueueObjectImmediately(object);
     }
     return osStatus;
 }
 
+// A core is idle when it runs its idle thread and has nothing waiting to run
+static inline bool
+__IsCoreIdle(
+        _In_ uuid_t coreId)
+{
+    return ThreadIsCurrentIdle(coreId) &&
+        atomic_load(&SchedulerGetFromCore(coreId)->RunnableCount) == 0;
+}
+
+static uuid_t
+__SelectWakeupCore(
+        _In_ SchedulerObject_t* object,
+        _In_ OSTimestamp_t*     currentTime)
+{
+    SystemCpuCore_t* iter;
+
+    // Bound objects and deadline objects, which have their bandwidth admitted on
+    // their core, are never moved.
+    if (object->Flags & (SCHEDULER_FLAG_BOUND | SCHEDULER_FLAG_DEADLINE)) {
+        return object->CoreId;
+    }
+
+    if (__IsCoreIdle(object->CoreId) &&
+        (__TimestampToNs(currentTime) - object->LastRun) < (SCHEDULER_CACHE_HOT_MS * NSEC_PER_MSEC)) {
+        return object->CoreId;
+    }
+
+    // The waker is going to wait for the object, which then runs on the data the
+    // waker just touched. Only do this if nothing else is waiting for that core.
+    if ((object->WakeFlags & SCHEDULER_WAKE_SYNC) &&
+        atomic_load(&SchedulerGetFromCore(object->WakerCoreId)->RunnableCount) == 0) {
+        return object->WakerCoreId;
+    }
+
+    if (__IsCoreIdle(object->CoreId)) {
+        return object->CoreId;
+    }
+
+    iter = __GetCoreGroup()->Cores;
+    while (iter) {
+        smp_rmb();
+        if ((CpuCoreState(iter) & CpuStateRunning) && __IsCoreIdle(CpuCoreId(iter))) {
+            return CpuCoreId(iter);
+        }
+        iter = CpuCoreNext(iter);
+    }
+    return object->CoreId;
+}
+
+// Must be called on the previous core of the object. Only this core knows the
+// object has been switched out completely, so only this core can move it.
+static oserr_t
+__PlaceObject(
+        _In_ SchedulerObject_t* object)
+{
+    Scheduler_t*  scheduler = SchedulerGetFromCore(object->CoreId);
+    OSTimestamp_t currentTime;
+    uuid_t        coreId;
+
+    SystemTimerGetWallClockTime(&currentTime);
+    coreId = __SelectWakeupCore(object, &currentTime);
+    if (coreId != object->CoreId) {
+        TRACE("__PlaceObject %s core %u => %u", GetNameOfObject(object), object->CoreId, coreId);
+
+        // The timeout can only be cancelled in the sleep wheel of this core
+        SpinlockAcquireIrq(&scheduler->SyncObject);
+        if (TIMER_WHEEL_ENTRY_QUEUED(&object->SleepEntry)) {
+            TimerWheelRemove(&scheduler->SleepWheel, &object->SleepEntry);
+        }
+        SpinlockReleaseIrq(&scheduler->SyncObject);
+
+        __TransferObject(object, coreId, &currentTime);
+        atomic_fetch_add(&SchedulerGetFromCore(coreId)->WakeupsMoved, 1);
+    } else {
+        __CountWakeup(object);
+    }
+    return __QueueObjectImmediately(object);
+}
+
+static void
+__WakeOnCoreFunction(
+        _In_ void* context)
+{
+    (void)__PlaceObject((SchedulerObject_t*)context);
+}
+
+oserr_t
+SchedulerWakeObject(
+        _In_ SchedulerObject_t* object,
+        _In_ unsigned int       flags)
+{
+    int resultState;
+    TRACE("SchedulerWakeObject()");
+
+    assert(object != NULL);
+
+    resultState = ExecuteEvent(object, EVENT_QUEUE);
+    if (resultState == STATE_INVALID) {
+        WARNING("SchedulerWakeObject object %s was in invalid state", GetNameOfObject(object));
+        return OS_EINVALPARAMS;
+    }
+
+    // The object is in no queue while it is QUEUEING, and the waker owns it until
+    // it has been queued, so the hints can be stored in the object.
+    if (resultState == STATE_QUEUEING) {
+        object->WakeFlags   = flags;
+        object->WakerCoreId = ArchGetProcessorCoreId();
+        if (object->CoreId == object->WakerCoreId) {
+            return __PlaceObject(object);
+        }
+
+        __TraceWakeup(object);
+        return TxuMessageSend(object->CoreId, CpuFunctionCustom, __WakeOnCoreFunction, object, 1);
+    }
+    return OS_EOK;
+}
+
+oserr_t
+SchedulerSetDeadline(
+        _In_ uint64_t runtime,
+        _In_ uint64_t deadline,
+        _In_ uint64_t period,
+        _In_ int      maxBandwidth)
+{
+    SchedulerObject_t* object;
+    Scheduler_t*       scheduler;
+    OSTimestamp_t      currentTime;
+    unsigned int       limit;
+    unsigned int       oldBandwidth = 0;
+    unsigned int       newBandwidth = 0;
+    unsigned int       bandwidth;
+
+    maxBandwidth = MAX(0, MIN(maxBandwidth, SCHEDULER_DEADLINE_BANDWIDTH_MAX));
+    limit        = (unsigned int)(((uint64_t)SCHEDULER_DEADLINE_SCALE * maxBandwidth) / 100);
+
+    if (runtime) {
+        if (period < SCHEDULER_DEADLINE_PERIOD_MIN || period > SCHEDULER_DEADLINE_PERIOD_MAX ||
+            deadline > period || runtime > deadline) {
+            return OS_EINVALPARAMS;
+        }
+        newBandwidth = __DeadlineBandwidth(runtime, period);
+    }
+
+    object = SchedulerGetCurrentObject(ArchGetProcessorCoreId());
+    assert(object != NULL);
+
+    scheduler = SchedulerGetFromCore(object->CoreId);
+    if (object->Flags & SCHEDULER_FLAG_DEADLINE) {
+        oldBandwidth = __DeadlineBandwidth(object->Runtime, object->Period);
+    }
+
+    // Admit the new bandwidth in place of the old one, if it fits on the core
+    bandwidth = atomic_load(&scheduler->DeadlineBandwidth);
+    do {
+        // Leaving the class, or asking for less, is always allowed
+        if (newBandwidth > oldBandwidth && (bandwidth - oldBandwidth) + newBandwidth > limit) {
+            return OS_EBUSY;
+        }
+    } while (!atomic_compare_exchange_weak(&scheduler->DeadlineBandwidth, &bandwidth,
+                                           (bandwidth - oldBandwidth) + newBandwidth));
+
+    // The object is running, so it is only changed under our feet by the scheduler
+    // of this core.
+    SystemTimerGetWallClockTime(&currentTime);
+    SpinlockAcquireIrq(&scheduler->SyncObject);
+    if (runtime) {
+        if (!(object->Flags & SCHEDULER_FLAG_DEADLINE)) {
+            atomic_fetch_add(&scheduler->DeadlineCount, 1);
+        }
+        object->Runtime          = runtime;
+        object->RelativeDeadline = deadline;
+        object->Period           = period;
+        __StartPeriod(object, __TimestampToNs(&currentTime));
+        object->Flags |= SCHEDULER_FLAG_DEADLINE;
+    } else if (object->Flags & SCHEDULER_FLAG_DEADLINE) {
+        atomic_fetch_sub(&scheduler->DeadlineCount, 1);
+        object->Flags &= ~(SCHEDULER_FLAG_DEADLINE);
+    }
+    SpinlockReleaseIrq(&scheduler->SyncObject);
+    return OS_EOK;
+}
+
 int
 SchedulerObjectGetQueue(
     _In_ SchedulerObject_t* object)
@@ -509,7 +1014,76 @@ SchedulerObjectGetQueue(
     assert(object != NULL);
     
     smp_rmb();
-    return object->Queue;
+    return __EffectiveLevel(object);
+}
+
+// Moves a queued object to the level it should be queued at now. Must be called on
+// the core that owns the object.
+static void
+__RequeueObject(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object)
+{
+    int level = __EffectiveLevel(object);
+
+    // The object may have been picked, or moved to another core, since the
+    // request was made. Deadline objects already run before every level.
+    if (atomic_load(&object->State) != STATE_QUEUED ||
+        (object->Flags & SCHEDULER_FLAG_DEADLINE) ||
+        object->CoreId != ArchGetProcessorCoreId() ||
+        object->QueuedLevel == level) {
+        return;
+    }
+
+    // The boost moves entire levels to level 0 without updating the objects, and
+    // those objects are already at the top.
+    if (__RemoveFromLevel(scheduler, object->QueuedLevel, object) != OS_EOK) {
+        return;
+    }
+    object->QueuedLevel = level;
+    __AppendToLevel(scheduler, level, object, object);
+}
+
+static void
+__RequeueOnCoreFunction(
+        _In_ void* context)
+{
+    __RequeueObject(CpuCoreScheduler(CpuCoreCurrent()), (SchedulerObject_t*)context);
+}
+
+void
+SchedulerObjectSetInheritedQueue(
+        _In_ SchedulerObject_t* object,
+        _In_ int                queue)
+{
+    Scheduler_t* scheduler;
+    uuid_t       coreId;
+
+    assert(object != NULL);
+
+    queue = MIN(queue, SCHEDULER_LEVEL_COUNT);
+    if (object->InheritedQueue == queue) {
+        return;
+    }
+    object->InheritedQueue = queue;
+    smp_wmb();
+
+    // Objects that are running or blocked pick up the new level the next
+    // time they are queued.
+    if (atomic_load(&object->State) != STATE_QUEUED) {
+        return;
+    }
+
+    coreId = object->CoreId;
+    if (coreId != ArchGetProcessorCoreId()) {
+        (void)TxuMessageSend(coreId, CpuFunctionCustom, __RequeueOnCoreFunction, object, 1);
+        return;
+    }
+
+    scheduler = SchedulerGetFromCore(coreId);
+    SpinlockAcquireIrq(&scheduler->SyncObject);
+    __RequeueObject(scheduler, object);
+    SpinlockReleaseIrq(&scheduler->SyncObject);
 }
 
 uuid_t
@@ -529,6 +1103,44 @@ SchedulerGetTimeoutReason(void)
     return object->TimeoutReason;
 }
 
+void
+SchedulerGetStatistics(
+        _In_  Scheduler_t*           scheduler,
+        _Out_ SchedulerStatistics_t* statistics)
+{
+    statistics->RunnableCount = atomic_load(&scheduler->RunnableCount);
+    statistics->ObjectCount   = atomic_load(&scheduler->ObjectCount);
+    statistics->MigrationsIn  = atomic_load(&scheduler->MigrationsIn);
+    statistics->MigrationsOut = atomic_load(&scheduler->MigrationsOut);
+    statistics->Steals        = atomic_load(&scheduler->Steals);
+    statistics->WakeupsLocal  = atomic_load(&scheduler->WakeupsLocal);
+    statistics->WakeupsRemote = atomic_load(&scheduler->WakeupsRemote);
+    statistics->WakeupsMoved  = atomic_load(&scheduler->WakeupsMoved);
+    statistics->DeadlineCount     = atomic_load(&scheduler->DeadlineCount);
+    statistics->DeadlineBandwidth = (int)(((uint64_t)atomic_load(&scheduler->DeadlineBandwidth) * 100) / SCHEDULER_DEADLINE_SCALE);
+    statistics->DeadlineThrottles = atomic_load(&scheduler->DeadlineThrottles);
+    statistics->DeadlineMisses    = atomic_load(&scheduler->DeadlineMisses);
+}
+
+void
+SchedulerGetLatencyStatistics(
+        _In_  Scheduler_t*                   scheduler,
+        _Out_ OSSchedulerLatencyHistogram_t* histograms,
+        _Out_ OSSchedulerLatencyEvent_t*     worst)
+{
+    memcpy(histograms, &scheduler->LatencyHistograms[0], sizeof(scheduler->LatencyHistograms));
+    memcpy(worst, &scheduler->LatencyWorst[0], sizeof(scheduler->LatencyWorst));
+}
+
+void
+SchedulerObjectGetLatencyStatistics(
+        _In_  SchedulerObject_t*             object,
+        _Out_ OSSchedulerLatencyHistogram_t* histograms)
+{
+    assert(object != NULL);
+    memcpy(histograms, &object->Latency[0], sizeof(object->Latency));
+}
+
 void SchedulerDisable(void)
 {
     Scheduler_t* scheduler = SchedulerGetFromCore(ArchGetProcessorCoreId());
@@ -570,15 +1182,208 @@ static void
 __Boost(
         _In_ Scheduler_t* scheduler)
 {
-    for (int i = 1; i < SCHEDULER_LEVEL_CRITICAL; i++) {
-        if (scheduler->Queues[i].Head) {
-            __AppendToQueue(&scheduler->Queues[0],
-                            scheduler->Queues[i].Head,
-                            scheduler->Queues[i].Tail);
-            scheduler->Queues[i].Head = NULL;
-            scheduler->Queues[i].Tail = NULL;
+    // Only visit the levels that actually have objects, the critical level
+    // and level 0 are never moved.
+    uint64_t levels = scheduler->QueueBitmap & (((1ULL << SCHEDULER_LEVEL_CRITICAL) - 1) & ~1ULL);
+    while (levels) {
+        int i = __builtin_ctzll(levels);
+        __AppendToLevel(scheduler, 0,
+                        scheduler->Queues[i].Head,
+                        scheduler->Queues[i].Tail);
+        scheduler->Queues[i].Head = NULL;
+        scheduler->Queues[i].Tail = NULL;
+        scheduler->QueueBitmap &= ~(1ULL << i);
+        levels &= levels - 1;
+    }
+}
+
+static clock_t
+__MillisecondsSince(
+        _In_ OSTimestamp_t* currentTime,
+        _In_ OSTimestamp_t* since)
+{
+    OSTimestamp_t diff;
+    OSTimestampSubtract(&diff, currentTime, since);
+    return (diff.Seconds * MSEC_PER_SEC) + (diff.Nanoseconds / NSEC_PER_MSEC);
+}
+
+static bool
+__CanMigrate(
+        _In_ SchedulerObject_t* object,
+        _In_ OSTimestamp_t*     currentTime)
+{
+    if (object->Flags & SCHEDULER_FLAG_BOUND) {
+        return false;
+    }
+
+    // Keep recently moved objects where they are, so two cores that are
+    // almost equally loaded do not keep passing the same object around.
+    if (!OSTimestampIsZero(&object->LastMigration) &&
+        __MillisecondsSince(currentTime, &object->LastMigration) < SCHEDULER_MIGRATE_COOLDOWN_MS) {
+        return false;
+    }
+    return true;
+}
+
+// Prefers objects from the lowest priority levels, as those are the ones that
+// would otherwise wait the longest on this core.
+static SchedulerObject_t*
+__FindMigrationCandidate(
+        _In_  Scheduler_t*   scheduler,
+        _In_  OSTimestamp_t* currentTime,
+        _Out_ int*           levelOut)
+{
+    uint64_t levels  = scheduler->QueueBitmap & ((1ULL << SCHEDULER_LEVEL_CRITICAL) - 1);
+    int      scanned = 0;
+
+    while (levels && scanned < SCHEDULER_MIGRATE_SCAN) {
+        int                level  = 63 - __builtin_clzll(levels);
+        SchedulerObject_t* object = scheduler->Queues[level].Head;
+        while (object && scanned < SCHEDULER_MIGRATE_SCAN) {
+            if (__CanMigrate(object, currentTime)) {
+                *levelOut = level;
+                return object;
+            }
+            object = object->Link;
+            scanned++;
         }
+        levels &= ~(1ULL << level);
     }
+    return NULL;
+}
+
+// Must be called on the core that owns the scheduler. The object is taken out of
+// the local queues and queued on the target core the same way a remote wakeup is.
+static oserr_t
+__MigrateObject(
+        _In_ Scheduler_t*   scheduler,
+        _In_ uuid_t         targetCoreId,
+        _In_ OSTimestamp_t* currentTime)
+{
+    Scheduler_t*       target = SchedulerGetFromCore(targetCoreId);
+    SchedulerObject_t* object;
+    int                level;
+
+    object = __FindMigrationCandidate(scheduler, currentTime, &level);
+    if (object == NULL) {
+        return OS_ENOENT;
+    }
+
+    __RemoveFromLevel(scheduler, level, object);
+    atomic_fetch_sub(&scheduler->RunnableCount, 1);
+
+    // Move the object back into the transition state, queueing it on the
+    // target core finishes the transition again.
+    atomic_store(&object->State, STATE_QUEUEING);
+    __TransferObject(object, targetCoreId, currentTime);
+
+    atomic_fetch_add(&scheduler->MigrationsOut, 1);
+    atomic_fetch_add(&target->MigrationsIn, 1);
+    TRACE("__MigrateObject %s => core %u", GetNameOfObject(object), targetCoreId);
+    return TxuMessageSend(targetCoreId, CpuFunctionCustom, __QueueOnCoreFunction, object, 1);
+}
+
+static void
+__StealOnCoreFunction(
+        _In_ void* context)
+{
+    uuid_t        requesterId = (uuid_t)(uintptr_t)context;
+    Scheduler_t*  scheduler   = CpuCoreScheduler(CpuCoreCurrent());
+    OSTimestamp_t currentTime;
+
+    // Only give away objects that are waiting here, the requester may also
+    // have received work by itself since it asked.
+    SystemTimerGetWallClockTime(&currentTime);
+    if (atomic_load(&scheduler->RunnableCount) > 0 &&
+        __MigrateObject(scheduler, requesterId, &currentTime) == OS_EOK) {
+        atomic_fetch_add(&scheduler->Steals, 1);
+    }
+    atomic_store(&SchedulerGetFromCore(requesterId)->StealPending, 0);
+}
+
+// Finds the least (or most) loaded running core other than the given core. Returns
+// the load of that core, or -1 if there are no other cores.
+static int
+__FindCoreByLoad(
+        _In_  uuid_t  coreId,
+        _In_  bool    busiest,
+        _Out_ uuid_t* coreIdOut)
+{
+    SystemCpuCore_t* iter = __GetCoreGroup()->Cores;
+    int              load = -1;
+
+    while (iter) {
+        int iterLoad;
+
+        smp_rmb();
+        if (CpuCoreId(iter) == coreId || !(CpuCoreState(iter) & CpuStateRunning)) {
+            iter = CpuCoreNext(iter);
+            continue;
+        }
+
+        iterLoad = atomic_load(&CpuCoreScheduler(iter)->RunnableCount);
+        if (load == -1 || (busiest ? iterLoad > load : iterLoad < load)) {
+            load       = iterLoad;
+            *coreIdOut = CpuCoreId(iter);
+        }
+        iter = CpuCoreNext(iter);
+    }
+    return load;
+}
+
+// Pushes one object to the least loaded core if the difference is large enough
+static void
+__Balance(
+        _In_ Scheduler_t*   scheduler,
+        _In_ uuid_t         coreId,
+        _In_ OSTimestamp_t* currentTime)
+{
+    uuid_t targetCoreId;
+    int    load;
+    int    targetLoad;
+
+    if (OSTimestampIsZero(&scheduler->LastBalance)) {
+        OSTimestampCopy(&scheduler->LastBalance, currentTime);
+        return;
+    }
+    if (__MillisecondsSince(currentTime, &scheduler->LastBalance) < SCHEDULER_BALANCE_MS) {
+        return;
+    }
+    OSTimestampCopy(&scheduler->LastBalance, currentTime);
+
+    // The object that is about to be picked is still in the queues here, while the
+    // objects running on the other cores are not, so leave it out of the load.
+    load = atomic_load(&scheduler->RunnableCount) - 1;
+    if (load < SCHEDULER_BALANCE_IMBALANCE) {
+        return;
+    }
+
+    targetLoad = __FindCoreByLoad(coreId, false, &targetCoreId);
+    if (targetLoad != -1 && (load - targetLoad) >= SCHEDULER_BALANCE_IMBALANCE) {
+        (void)__MigrateObject(scheduler, targetCoreId, currentTime);
+    }
+}
+
+// Called when this core is about to go idle. The queues of other cores are only ever
+// touched by their own core, so instead of taking an object directly we ask the
+// busiest core to hand one over.
+static void
+__RequestWork(
+        _In_ Scheduler_t* scheduler,
+        _In_ uuid_t       coreId)
+{
+    uuid_t victimCoreId;
+
+    if (atomic_exchange(&scheduler->StealPending, 1)) {
+        return;
+    }
+
+    if (__FindCoreByLoad(coreId, true, &victimCoreId) <= 0) {
+        atomic_store(&scheduler->StealPending, 0);
+        return;
+    }
+    (void)TxuMessageSend(victimCoreId, CpuFunctionCustom, __StealOnCoreFunction,
+                         (void*)(uintptr_t)coreId, 1);
 }
 
 static void
@@ -599,6 +1404,7 @@ __PerformObjectTimeout(
         }
 
         object->TimeoutReason = OS_ETIMEOUT;
+        __TraceWakeup(object);
         __QueueForScheduler(scheduler, object, 0);
     }
     else {
@@ -610,38 +1416,144 @@ static inline bool
 __HasDeadlineSet(
         _In_ SchedulerObject_t* schedulerObject)
 {
-    if (schedulerObject->WakeUpTime.Seconds != 0 &&
-        schedulerObject->WakeUpTime.Nanoseconds != 0) {
-        return true;
+    return !OSTimestampIsZero(&schedulerObject->WakeUpTime);
+}
+
+// The sleep wheel runs in milliseconds. Deadlines are rounded up so a sleep
+// never ends early.
+static inline uint64_t
+__TimestampToTicks(
+        _In_ OSTimestamp_t* timestamp,
+        _In_ bool           roundUp)
+{
+    uint64_t ticks = ((uint64_t)timestamp->Seconds * MSEC_PER_SEC) + (timestamp->Nanoseconds / NSEC_PER_MSEC);
+    if (roundUp && (timestamp->Nanoseconds % NSEC_PER_MSEC)) {
+        ticks++;
     }
-    return false;
+    return ticks;
 }
 
-// The sleep list is thread-safe due to the fact that the function that removes
-// from the sleep queue is only called on this core, while the function that adds
-// is also only called on this core, and the list here is only iterated on this core.
+// The sleep wheel is thread-safe due to the fact that the function that removes
+// from the sleep wheel is only called on this core, while the function that adds
+// is also only called on this core, and the wheel here is only advanced on this core.
 static clock_t
 __UpdateSleepQueue(
         _In_ Scheduler_t*       scheduler,
         _In_ OSTimestamp_t*     currentTime,
         _In_ SchedulerObject_t* ignoreObject)
 {
-    clock_t            nextUpdate = __MASK;
-    SchedulerObject_t* i          = scheduler->SleepQueue.Head;
-    OSTimestamp_t      timeDiff;
-
-    while (i) {
-        if (i != ignoreObject && __HasDeadlineSet(i)) {
-            if (OSTimestampCompare(currentTime, &i->WakeUpTime) >= 0) {
-                __PerformObjectTimeout(scheduler, i);
-            } else {
-                OSTimestampSubtract(&timeDiff, &i->WakeUpTime, currentTime);
-                nextUpdate = (timeDiff.Seconds * NSEC_PER_SEC) + timeDiff.Nanoseconds;
-            }
+    uint64_t           now = __TimestampToTicks(currentTime, false);
+    TimerWheelEntry_t* entry;
+    uint64_t           next;
+
+    entry = TimerWheelAdvance(&scheduler->SleepWheel, now);
+    while (entry) {
+        TimerWheelEntry_t* nextEntry = entry->Next;
+        SchedulerObject_t* object    = entry->Value;
+
+        // The object that just went to sleep is timed out on the next update
+        // at the earliest.
+        entry->Next = NULL;
+        if (object == ignoreObject) {
+            TimerWheelAdd(&scheduler->SleepWheel, entry, entry->Expires);
+        } else {
+            __PerformObjectTimeout(scheduler, object);
         }
-        i = i->Link;
+        entry = nextEntry;
+    }
+
+    if (!TimerWheelNext(&scheduler->SleepWheel, &next)) {
+        return __MASK;
     }
-    return nextUpdate;
+    return ((next - now) * NSEC_PER_MSEC) - (currentTime->Nanoseconds % NSEC_PER_MSEC);
+}
+
+// Moves the throttled objects whose next period has started back to the deadline
+// queue, and moves the next deadline up if another period starts before it.
+static void
+__UpdateThrottledQueue(
+        _In_    Scheduler_t* scheduler,
+        _In_    uint64_t     now,
+        _InOut_ clock_t*     nextDeadline)
+{
+    SchedulerObject_t* object;
+
+    while ((object = scheduler->ThrottledQueue.Head) != NULL && object->NextPeriod <= now) {
+        __RemoveFromQueue(&scheduler->ThrottledQueue, object);
+
+        // Keep the periods aligned unless the object was released too late to
+        // make the deadline of the period anyway.
+        if (object->NextPeriod + object->RelativeDeadline > now) {
+            __StartPeriod(object, object->NextPeriod);
+        } else {
+            __StartPeriod(object, now);
+        }
+        __InsertSorted(&scheduler->DeadlineQueue, object, false);
+    }
+
+    if (object != NULL && (clock_t)(object->NextPeriod - now) < *nextDeadline) {
+        *nextDeadline = (clock_t)(object->NextPeriod - now);
+    }
+}
+
+// Charges the time the deadline object ran to its budget. An object that runs past
+// its deadline did not finish its work in time.
+static void
+__ChargeDeadlineObject(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object,
+        _In_ clock_t            nanosecondsPassed,
+        _In_ uint64_t           now)
+{
+    object->Budget -= MIN(object->Budget, (uint64_t)nanosecondsPassed);
+    if (now > object->AbsoluteDeadline && object->MissedDeadline != object->AbsoluteDeadline) {
+        object->MissedDeadline = object->AbsoluteDeadline;
+        atomic_fetch_add(&scheduler->DeadlineMisses, 1);
+    }
+}
+
+static inline bool
+__HasTimeLeft(
+        _In_ SchedulerObject_t* object,
+        _In_ clock_t            nanosecondsPassed)
+{
+    if (object->Flags & SCHEDULER_FLAG_DEADLINE) {
+        return object->Budget > 0;
+    }
+    return nanosecondsPassed < object->TimeSliceLeft;
+}
+
+// Runnable deadline objects preempt level objects, and deadline objects with a later deadline
+static inline bool
+__IsPreempted(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object)
+{
+    SchedulerObject_t* head = scheduler->DeadlineQueue.Head;
+    if (head == NULL) {
+        return false;
+    }
+    if (!(object->Flags & SCHEDULER_FLAG_DEADLINE)) {
+        return true;
+    }
+    return head->AbsoluteDeadline < object->AbsoluteDeadline;
+}
+
+// Level objects on a core with deadline objects must give up the core in time for
+// a woken deadline object to run.
+static inline clock_t
+__TimeSliceOf(
+        _In_ Scheduler_t*       scheduler,
+        _In_ SchedulerObject_t* object,
+        _In_ clock_t            timeSlice)
+{
+    if (object->Flags & SCHEDULER_FLAG_DEADLINE) {
+        return (clock_t)object->Budget;
+    }
+    if (atomic_load(&scheduler->DeadlineCount)) {
+        return MIN(timeSlice, SCHEDULER_DEADLINE_TICK);
+    }
+    return timeSlice;
 }
 
 static void
@@ -664,17 +1576,22 @@ __HandleObjectRequeue(
         if (preemptive) {
             // Nah, we interrupted it, demote it for that unless we are at max
             // priority queue.
-            if (object->Queue < SCHEDULER_LEVEL_LOW) {
+            if (object->Queue < SCHEDULER_LEVEL_LOW && !(object->Flags & SCHEDULER_FLAG_DEADLINE)) {
                 __UpdatePressureForObject(scheduler, object, object->Queue + 1);
             }
         }
-        __QueueForScheduler(scheduler, object, 0);
-    } else if (__HasDeadlineSet(object)) {
-        TRACE("__HandleObjectRequeue sleep 0x%llx (Head 0x%llx, Tail 0x%llx)",
-              object->Link, scheduler->SleepQueue.Head, scheduler->SleepQueue.Tail);
+        __QueueForScheduler(scheduler, object, 1);
+        return;
+    }
+
+    object->BlockedAt = __LatencyTick();
+    if (__HasDeadlineSet(object)) {
+        TRACE("__HandleObjectRequeue sleep %s (%" PRIuIN " sleeping)",
+              GetNameOfObject(object), scheduler->SleepWheel.Count);
         // OK, so we are blocking this object which means we won't be
         // queuing the object up again, should we track the sleep?
-        __AppendToQueue(&scheduler->SleepQueue, object, object);
+        TimerWheelAdd(&scheduler->SleepWheel, &object->SleepEntry,
+                      __TimestampToTicks(&object->WakeUpTime, true));
     }
 }
 
@@ -685,10 +1602,13 @@ SchedulerAdvance(
     _In_  clock_t            nanosecondsPassed,
     _Out_ clock_t*           nextDeadlineOut)
 {
-    Scheduler_t*       scheduler  = CpuCoreScheduler(CpuCoreCurrent());
+    SystemCpuCore_t*   core       = CpuCoreCurrent();
+    Scheduler_t*       scheduler  = CpuCoreScheduler(core);
+    uuid_t             coreId     = CpuCoreId(core);
     SchedulerObject_t* nextObject = NULL;
     clock_t            nextDeadline;
     OSTimestamp_t      currentTime;
+    uint64_t           now;
     int                i;
     TRACE("SchedulerAdvance(current 0x%llx, forced %i, ns-passed %llu)",
           object, preemptive, nanosecondsPassed);
@@ -699,40 +1619,68 @@ SchedulerAdvance(
     // Get current timestamp, we need it to look at sleep queue and
     // calculate time until next boost
     SystemTimerGetWallClockTime(&currentTime);
+    now = __TimestampToNs(&currentTime);
+    if (object != NULL && (object->Flags & SCHEDULER_FLAG_DEADLINE)) {
+        __ChargeDeadlineObject(scheduler, object, nanosecondsPassed, now);
+    }
 
     // In one case we can skip the whole requeue etc. etc. This happens when there
-    // was a sleep event before the objects time-slice is out. Adjust and continue
+    // was a sleep event before the objects time-slice is out. Adjust and continue,
+    // unless a deadline object has become runnable that must run before it.
     if (object != NULL &&
         preemptive &&
-        nanosecondsPassed < object->TimeSliceLeft &&
+        __HasTimeLeft(object, nanosecondsPassed) &&
         atomic_load(&object->State) == STATE_RUNNING) {
         // Steps to take here is, adjusting the current time-slice,
         // updating the sleep queue and returning the current task again
-        object->TimeSliceLeft -= nanosecondsPassed;
+        if (!(object->Flags & SCHEDULER_FLAG_DEADLINE)) {
+            object->TimeSliceLeft -= nanosecondsPassed;
+        }
         nextDeadline = __UpdateSleepQueue(scheduler, &currentTime, NULL);
-        *nextDeadlineOut = MIN(object->TimeSliceLeft, nextDeadline);
-        TRACE("SchedulerAdvance redeploy next deadline %llu", *nextDeadlineOut);
-        return object->Object;
+        __UpdateThrottledQueue(scheduler, now, &nextDeadline);
+        if (!__IsPreempted(scheduler, object)) {
+            *nextDeadlineOut = MIN(__TimeSliceOf(scheduler, object, object->TimeSliceLeft), nextDeadline);
+            TRACE("SchedulerAdvance redeploy next deadline %llu", *nextDeadlineOut);
+            return object->Object;
+        }
+
+        // It did not use up its time, so it is not demoted for this
+        preemptive = 0;
     }
 
     // Handle the scheduled object first. The only times it's up to this function
     // to requeue immediately is if the thread was running. Otherwise, it's because
     // we've been interrupted or blocked.
     if (object != NULL) {
+        object->LastRun = now;
         __HandleObjectRequeue(scheduler, object, preemptive);
     }
     nextDeadline = __UpdateSleepQueue(scheduler, &currentTime, object);
-
-    // Get next object
-    for (i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
-        if (scheduler->Queues[i].Head != NULL) {
-            nextObject = scheduler->Queues[i].Head;
-            __RemoveFromQueue(&scheduler->Queues[i], nextObject);
+    __UpdateThrottledQueue(scheduler, now, &nextDeadline);
+    __Balance(scheduler, coreId, &currentTime);
+
+    // Deadline objects run before any of the levels, the earliest deadline first.
+    // Otherwise the lowest set bit is the highest priority queue that has runnable objects.
+    if (scheduler->DeadlineQueue.Head != NULL) {
+        nextObject = scheduler->DeadlineQueue.Head;
+        __RemoveFromQueue(&scheduler->DeadlineQueue, nextObject);
+        __TraceDispatch(scheduler, nextObject);
+        nextDeadline = MIN(__TimeSliceOf(scheduler, nextObject, nextObject->TimeSlice), nextDeadline);
+        ExecuteEvent(nextObject, EVENT_EXECUTE);
+    } else if (scheduler->QueueBitmap) {
+        i          = __builtin_ctzll(scheduler->QueueBitmap);
+        nextObject = scheduler->Queues[i].Head;
+        __RemoveFromLevel(scheduler, i, nextObject);
+        atomic_fetch_sub(&scheduler->RunnableCount, 1);
+
+        // An object found at another level than it was queued at has been moved
+        // up by the boost, an inherited level is not its own and must not stick.
+        if (i != nextObject->QueuedLevel) {
             __UpdatePressureForObject(scheduler, nextObject, i);
-            nextDeadline = MIN(nextObject->TimeSlice, nextDeadline);
-            ExecuteEvent(nextObject, EVENT_EXECUTE);
-            break;
         }
+        __TraceDispatch(scheduler, nextObject);
+        nextDeadline = MIN(__TimeSliceOf(scheduler, nextObject, nextObject->TimeSlice), nextDeadline);
+        ExecuteEvent(nextObject, EVENT_EXECUTE);
     }
     
     // Handle the boost timer as long as there are active objects running
@@ -758,6 +1706,7 @@ SchedulerAdvance(
         // Reset boost
         scheduler->LastBoost.Seconds = 0;
         scheduler->LastBoost.Nanoseconds = 0;
+        __RequestWork(scheduler, coreId);
         *nextDeadlineOut = (nextDeadline == __MASK) ? 0 : nextDeadline;
         TRACE("SchedulerAdvance no next object, deadline in %llu", *nextDeadlineOut);
     }
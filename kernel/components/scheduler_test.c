@@ -0,0 +1,1136 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define __need_minmax
+#include <testbase.h>
+#include <component/cpu.h>
+#include <component/domain.h>
+#include <component/timer.h>
+#include <ds/list.h>
+#include <machine.h>
+#include <scheduler.h>
+#include <threading.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OBJECT_COUNT  4096
+#define CORE_COUNT    4
+#define MESSAGE_COUNT 256
+
+// TXU messages are queued and delivered when the simulation decides to, on the
+// core they were sent to.
+struct __TxuMessage {
+    uuid_t        CoreId;
+    TxuFunction_t Function;
+    void*         Argument;
+};
+
+// Cores are represented by their scheduler, and each core runs the object index
+// in Current, or nothing (-1).
+static struct __TestContext {
+    Scheduler_t         Schedulers[CORE_COUNT];
+    int                 Current[CORE_COUNT];
+    int                 CoreCount;
+    int                 OnlineCount;
+    uuid_t              CurrentCore;
+    SystemMachine_t     Machine;
+    OSTimestamp_t       Time;
+    uint64_t            Tick; // The performance counter, 0 when there is none
+    SchedulerObject_t*  Objects[OBJECT_COUNT];
+    int                 Payloads[OBJECT_COUNT];
+    int                 ObjectCount;
+    clock_t             Deadline; // The deadline returned by the last advance
+    struct __TxuMessage Messages[MESSAGE_COUNT];
+    int                 MessageCount;
+} g_testContext;
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(g_testContext));
+    g_testContext.Machine.Processor.Cores = (SystemCpuCore_t*)&g_testContext.Schedulers[0];
+    g_testContext.CoreCount    = 1;
+    g_testContext.OnlineCount  = 1;
+    g_testContext.Time.Seconds = 1;
+    for (int i = 0; i < CORE_COUNT; i++) {
+        g_testContext.Current[i] = -1;
+    }
+    return 0;
+}
+
+int TeardownTest(void** state) {
+    (void)state;
+    for (int i = 0; i < g_testContext.ObjectCount; i++) {
+        SchedulerDestroyObject(g_testContext.Objects[i]);
+    }
+    return 0;
+}
+
+static int
+__CreateObject(unsigned int flags)
+{
+    int index = g_testContext.ObjectCount++;
+    assert_true(index < OBJECT_COUNT);
+
+    g_testContext.Payloads[index] = index;
+    g_testContext.Objects[index]  = SchedulerCreateObject(&g_testContext.Payloads[index], flags);
+    assert_non_null(g_testContext.Objects[index]);
+    assert_int_equal(SchedulerQueueObject(g_testContext.Objects[index]), OS_EOK);
+    return index;
+}
+
+static int
+__Advance(int current, int preemptive, clock_t passed)
+{
+    SchedulerObject_t* object = current < 0 ? NULL : g_testContext.Objects[current];
+    int*               next;
+
+    next = SchedulerAdvance(object, preemptive, passed, &g_testContext.Deadline);
+    g_testContext.Current[g_testContext.CurrentCore] = next == NULL ? -1 : *next;
+    return g_testContext.Current[g_testContext.CurrentCore];
+}
+
+// The bitmap must match the queue heads exactly after every operation
+static void
+__VerifyBitmap(void)
+{
+    for (int i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
+        bool occupied = (g_testContext.Schedulers[0].QueueBitmap & (1ULL << i)) != 0;
+        assert_int_equal(occupied, g_testContext.Schedulers[0].Queues[i].Head != NULL);
+    }
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap >> SCHEDULER_LEVEL_COUNT, 0);
+}
+
+void TestAdvance_EmptyReturnsNothing(void** state)
+{
+    (void)state;
+
+    assert_int_equal(__Advance(-1, 0, 0), -1);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 0);
+}
+
+void TestAdvance_PicksHighestPriorityLevel(void** state)
+{
+    int background, normal;
+    (void)state;
+
+    background = __CreateObject(THREADING_BACKGROUND);
+    normal     = __CreateObject(0);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, (1ULL << 0) | (1ULL << SCHEDULER_LEVEL_LOW));
+    __VerifyBitmap();
+
+    assert_int_equal(__Advance(-1, 0, 0), normal);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 1ULL << SCHEDULER_LEVEL_LOW);
+    __VerifyBitmap();
+
+    // Preempting it demotes it a level, but it still ranks above the background object
+    assert_int_equal(__Advance(normal, 1, SCHEDULER_TIMESLICE_INITIAL), normal);
+    assert_int_equal(SchedulerObjectGetQueue(g_testContext.Objects[normal]), 1);
+    __VerifyBitmap();
+
+    // Blocking it leaves only the background object
+    assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+    assert_int_equal(__Advance(normal, 0, 0), background);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 0);
+    __VerifyBitmap();
+}
+
+void TestAdvance_RoundRobinWithinLevel(void** state)
+{
+    int first, second, current;
+    (void)state;
+
+    first  = __CreateObject(THREADING_BACKGROUND);
+    second = __CreateObject(THREADING_BACKGROUND);
+
+    current = __Advance(-1, 0, 0);
+    assert_int_equal(current, first);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 1ULL << SCHEDULER_LEVEL_LOW);
+
+    current = __Advance(current, 0, 0);
+    assert_int_equal(current, second);
+    current = __Advance(current, 0, 0);
+    assert_int_equal(current, first);
+    __VerifyBitmap();
+}
+
+void TestBoost_MovesLevelsToTop(void** state)
+{
+    int background, normal;
+    (void)state;
+
+    background = __CreateObject(THREADING_BACKGROUND);
+    normal     = __CreateObject(0);
+
+    // The first pick starts the boost timer
+    assert_int_equal(__Advance(-1, 0, 0), normal);
+
+    g_testContext.Time.Seconds += (SCHEDULER_BOOST_MS / MSEC_PER_SEC) + 1;
+    assert_int_equal(__Advance(normal, 1, SCHEDULER_TIMESLICE_INITIAL), normal);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 1ULL << 0);
+    __VerifyBitmap();
+
+    // The boosted background object now runs ahead of the demoted object
+    assert_int_equal(__Advance(normal, 0, 0), background);
+    assert_int_equal(SchedulerObjectGetQueue(g_testContext.Objects[background]), 0);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 1ULL << 1);
+    __VerifyBitmap();
+}
+
+void TestInheritance_MovesQueuedObject(void** state)
+{
+    int background, normal;
+    (void)state;
+
+    background = __CreateObject(THREADING_BACKGROUND);
+    normal     = __CreateObject(0);
+
+    // Lending a level to a waiting object moves it right away
+    SchedulerObjectSetInheritedQueue(g_testContext.Objects[background], 0);
+    assert_int_equal(SchedulerObjectGetQueue(g_testContext.Objects[background]), 0);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 1ULL << 0);
+    __VerifyBitmap();
+
+    assert_int_equal(__Advance(-1, 0, 0), normal);
+    assert_int_equal(__Advance(normal, 0, 0), background);
+
+    // The inherited level is not kept once it is taken back
+    SchedulerObjectSetInheritedQueue(g_testContext.Objects[background], SCHEDULER_LEVEL_COUNT);
+    assert_int_equal(SchedulerObjectGetQueue(g_testContext.Objects[background]), SCHEDULER_LEVEL_LOW);
+    assert_int_equal(__Advance(background, 0, 0), normal);
+    assert_int_equal(g_testContext.Schedulers[0].QueueBitmap, 1ULL << SCHEDULER_LEVEL_LOW);
+    __VerifyBitmap();
+}
+
+// Puts the object to sleep as if it was running and called SchedulerSleep
+static void
+__Sleep(int index, clock_t ns)
+{
+    OSTimestamp_t deadline;
+
+    assert_int_equal(__Advance(g_testContext.Current[0], 0, 0), index);
+    OSTimestampAddNsec(&deadline, &g_testContext.Time, ns);
+    (void)SchedulerSleep(&deadline);
+    __Advance(index, 0, 0);
+}
+
+void TestSleep_TimesOut(void** state)
+{
+    int object;
+    (void)state;
+
+    object = __CreateObject(0);
+    __Sleep(object, 25 * NSEC_PER_MSEC);
+    assert_int_equal(g_testContext.Current[0], -1);
+    assert_int_equal(g_testContext.Schedulers[0].SleepWheel.Count, 1);
+
+    // The idle core is woken exactly at the deadline
+    assert_int_equal(g_testContext.Deadline, 25 * NSEC_PER_MSEC);
+
+    OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, 24 * NSEC_PER_MSEC);
+    assert_int_equal(__Advance(-1, 0, 0), -1);
+    assert_int_equal(g_testContext.Deadline, NSEC_PER_MSEC);
+
+    OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, NSEC_PER_MSEC);
+    assert_int_equal(__Advance(-1, 0, 0), object);
+    assert_int_equal(SchedulerGetTimeoutReason(), OS_ETIMEOUT);
+    assert_int_equal(g_testContext.Schedulers[0].SleepWheel.Count, 0);
+}
+
+void TestSleep_WakeCancelsTimeout(void** state)
+{
+    int object;
+    (void)state;
+
+    object = __CreateObject(0);
+    __Sleep(object, 10 * NSEC_PER_SEC);
+    assert_int_equal(g_testContext.Schedulers[0].SleepWheel.Count, 1);
+
+    assert_int_equal(SchedulerQueueObject(g_testContext.Objects[object]), OS_EOK);
+    assert_int_equal(g_testContext.Schedulers[0].SleepWheel.Count, 0);
+    assert_int_equal(__Advance(-1, 0, 0), object);
+
+    // Nothing is left that needs the timer, so the idle core is not woken again
+    __Sleep(object, 0);
+    assert_int_equal(__Advance(-1, 0, 0), -1);
+    OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, NSEC_PER_MSEC);
+    assert_int_equal(__Advance(-1, 0, 0), object);
+    assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+    assert_int_equal(__Advance(object, 0, 0), -1);
+    assert_int_equal(g_testContext.Deadline, 0);
+}
+
+void TestLatency_RecordsRunqueueAndWakeup(void** state)
+{
+    OSSchedulerLatencyHistogram_t histograms[OSSCHEDULERLATENCY_COUNT];
+    Scheduler_t*                  scheduler = &g_testContext.Schedulers[0];
+    int                           object;
+    bool                          found;
+    (void)state;
+
+    g_testContext.Tick = 100;
+    object = __CreateObject(0);
+
+    // A new object has only waited in the queue
+    g_testContext.Tick = 150;
+    assert_int_equal(__Advance(-1, 0, 0), object);
+    assert_int_equal(scheduler->LatencyHistograms[OSSCHEDULERLATENCY_RUNQUEUE].Count, 1);
+    assert_int_equal(scheduler->LatencyHistograms[OSSCHEDULERLATENCY_RUNQUEUE].Buckets[5], 1);
+    assert_int_equal(scheduler->LatencyHistograms[OSSCHEDULERLATENCY_WAKEUP].Count, 0);
+
+    g_testContext.Tick = 200;
+    assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+    assert_int_equal(__Advance(object, 0, 0), -1);
+
+    g_testContext.Tick = 1000;
+    assert_int_equal(SchedulerQueueObject(g_testContext.Objects[object]), OS_EOK);
+    g_testContext.Tick = 1300;
+    assert_int_equal(__Advance(-1, 0, 0), object);
+
+    SchedulerObjectGetLatencyStatistics(g_testContext.Objects[object], &histograms[0]);
+    assert_int_equal(histograms[OSSCHEDULERLATENCY_WAKEUP].Count, 1);
+    assert_int_equal(histograms[OSSCHEDULERLATENCY_WAKEUP].Max, 300);
+    assert_int_equal(histograms[OSSCHEDULERLATENCY_WAKEUP].Buckets[8], 1);
+    assert_int_equal(histograms[OSSCHEDULERLATENCY_RUNQUEUE].Count, 2);
+    assert_int_equal(histograms[OSSCHEDULERLATENCY_RUNQUEUE].Total, 350);
+
+    // Yielding queues it again, which is not a wakeup
+    g_testContext.Tick = 1400;
+    assert_int_equal(__Advance(object, 0, 0), object);
+    assert_int_equal(scheduler->LatencyHistograms[OSSCHEDULERLATENCY_WAKEUP].Count, 1);
+    assert_int_equal(scheduler->LatencyHistograms[OSSCHEDULERLATENCY_RUNQUEUE].Buckets[0], 1);
+
+    // The worst list holds every event until it is full
+    found = false;
+    for (int i = 0; i < OSSCHEDULER_LATENCY_WORST; i++) {
+        OSSchedulerLatencyEvent_t* event = &scheduler->LatencyWorst[i];
+        if (event->Latency == 300 && event->Type == OSSCHEDULERLATENCY_WAKEUP) {
+            assert_int_equal(event->ThreadHandle, object);
+            assert_int_equal(event->Timestamp, 1300);
+            found = true;
+        }
+    }
+    assert_true(found);
+}
+
+// Makes the newly created object the running one, and moves it into the deadline class
+static oserr_t
+__SetDeadline(int index, clock_t runtime, clock_t deadline, clock_t period)
+{
+    assert_int_equal(__Advance(g_testContext.Current[0], 0, 0), index);
+    return SchedulerSetDeadline(runtime, deadline, period, SCHEDULER_DEADLINE_BANDWIDTH_MAX);
+}
+
+void TestDeadline_AdmissionControl(void** state)
+{
+    int first, second;
+    (void)state;
+
+    first = __CreateObject(0);
+    assert_int_equal(__SetDeadline(first, 2 * NSEC_PER_MSEC, 20 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC), OS_EINVALPARAMS);
+    assert_int_equal(SchedulerSetDeadline(4 * NSEC_PER_MSEC, 2 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EINVALPARAMS);
+    assert_int_equal(SchedulerSetDeadline(NSEC_PER_USEC, NSEC_PER_USEC, 10 * NSEC_PER_USEC, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EINVALPARAMS);
+    assert_int_equal(SchedulerSetDeadline(6 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EOK);
+
+    // Changing the parameters replaces the bandwidth of the object
+    assert_int_equal(SchedulerSetDeadline(5 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EOK);
+    assert_int_equal(atomic_load(&g_testContext.Schedulers[0].DeadlineCount), 1);
+    assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+    assert_int_equal(__Advance(first, 0, 0), -1);
+
+    // Only 40% of the core is left for the second object
+    second = __CreateObject(0);
+    assert_int_equal(__SetDeadline(second, 5 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC), OS_EBUSY);
+    assert_int_equal(SchedulerSetDeadline(4 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EOK);
+    assert_int_equal(SchedulerSetDeadline(0, 0, 0, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EOK);
+    assert_int_equal(atomic_load(&g_testContext.Schedulers[0].DeadlineCount), 1);
+    assert_int_equal(SchedulerSetDeadline(4 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_MAX), OS_EOK);
+}
+
+void TestDeadline_AdmissionControlUser(void** state)
+{
+    int first, second;
+    (void)state;
+
+    // Userspace gets at most 20% of the core, no matter how many threads ask
+    first = __CreateObject(0);
+    assert_int_equal(__Advance(g_testContext.Current[0], 0, 0), first);
+    assert_int_equal(SchedulerSetDeadline(3 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_USER), OS_EBUSY);
+    assert_int_equal(SchedulerSetDeadline(NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_USER), OS_EOK);
+    assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+    assert_int_equal(__Advance(first, 0, 0), -1);
+
+    second = __CreateObject(0);
+    assert_int_equal(__Advance(g_testContext.Current[0], 0, 0), second);
+    assert_int_equal(SchedulerSetDeadline(2 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_USER), OS_EBUSY);
+    assert_int_equal(SchedulerSetDeadline(NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_USER), OS_EOK);
+
+    // The kernel limit is never exceeded, and asking for less always succeeds
+    assert_int_equal(SchedulerSetDeadline(9 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 100), OS_EBUSY);
+    assert_int_equal(SchedulerSetDeadline(8 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 100), OS_EOK);
+    assert_int_equal(SchedulerSetDeadline(NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC, SCHEDULER_DEADLINE_BANDWIDTH_USER), OS_EOK);
+    assert_int_equal(SchedulerSetDeadline(0, 0, 0, SCHEDULER_DEADLINE_BANDWIDTH_USER), OS_EOK);
+    assert_int_equal(atomic_load(&g_testContext.Schedulers[0].DeadlineCount), 1);
+}
+
+// Deadline objects of the simulation wake up at the start of every period, and block again
+// when they have done their work. Timed tasks sleep until their next period, the others are
+// woken by an interrupt, which does not reschedule the core. A runaway task never blocks.
+struct __DeadlineTask {
+    int      Object;
+    clock_t  Runtime;
+    clock_t  Deadline;
+    clock_t  Period;
+    clock_t  Work;
+    bool     Interrupt;
+    bool     Runaway;
+    bool     Blocked;  // Waiting for the interrupt
+    clock_t  Left;     // Work left in the current period
+    uint64_t Released; // Start of the current period
+    clock_t  RunTime;  // Time it ran in the current period
+    int      Periods;
+    int      Missed;
+};
+
+static uint64_t
+__Now(void)
+{
+    return ((uint64_t)g_testContext.Time.Seconds * NSEC_PER_SEC) + g_testContext.Time.Nanoseconds;
+}
+
+static void
+__SleepUntil(int index, uint64_t ns, clock_t passed)
+{
+    OSTimestamp_t deadline;
+    deadline.Seconds     = (int64_t)(ns / NSEC_PER_SEC);
+    deadline.Nanoseconds = (int64_t)(ns % NSEC_PER_SEC);
+    (void)SchedulerSleep(&deadline);
+    __Advance(index, 0, passed);
+}
+
+static struct __DeadlineTask*
+__FindTask(struct __DeadlineTask* tasks, int count, int index)
+{
+    for (int i = 0; i < count; i++) {
+        if (tasks[i].Object == index) {
+            return &tasks[i];
+        }
+    }
+    return NULL;
+}
+
+// Raises the interrupts that are due, and returns the time until the next one
+static clock_t
+__RaiseInterrupts(struct __DeadlineTask* tasks, int count)
+{
+    clock_t next = NSEC_PER_SEC;
+    for (int i = 0; i < count; i++) {
+        if (!tasks[i].Blocked) {
+            continue;
+        }
+        if (__Now() >= tasks[i].Released) {
+            tasks[i].Blocked = false;
+            assert_int_equal(SchedulerQueueObject(g_testContext.Objects[tasks[i].Object]), OS_EOK);
+        } else {
+            next = MIN(next, (clock_t)(tasks[i].Released - __Now()));
+        }
+    }
+    return next;
+}
+
+// Runs the deadline tasks together with level objects that always want to run, and
+// returns the time the level objects got. The core is rescheduled when the deadline
+// returned by the scheduler has passed, or when the running task blocks.
+static clock_t
+__RunDeadlineSimulation(struct __DeadlineTask* tasks, int taskCount, int levelCount, clock_t duration)
+{
+    uint64_t start, end;
+    clock_t  levelTime = 0;
+    clock_t  elapsed   = 0;
+    int      current;
+
+    // Keeps the sleep wheel from ever being empty, like a system always has a timer pending
+    __Sleep(__CreateObject(0), 3600 * NSEC_PER_SEC);
+
+    start = __Now() + NSEC_PER_MSEC;
+    end   = start + duration;
+    for (int i = 0; i < taskCount; i++) {
+        tasks[i].Object = __CreateObject(0);
+        assert_int_equal(__SetDeadline(tasks[i].Object, tasks[i].Runtime, tasks[i].Deadline, tasks[i].Period), OS_EOK);
+        tasks[i].Released = start;
+        if (tasks[i].Interrupt) {
+            tasks[i].Blocked = true;
+            assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+            __Advance(tasks[i].Object, 0, 0);
+        } else {
+            __SleepUntil(tasks[i].Object, start, 0);
+        }
+    }
+    for (int i = 0; i < levelCount; i++) {
+        (void)__CreateObject(i & 1 ? THREADING_BACKGROUND : 0);
+    }
+
+    current = __Advance(-1, 0, 0);
+    while (__Now() < end) {
+        struct __DeadlineTask* task = __FindTask(tasks, taskCount, current);
+        clock_t                step;
+        assert_true(g_testContext.Deadline > elapsed);
+
+        // A task that is dispatched without work left has been woken for its next period
+        if (task && !task->Left) {
+            assert_true(__Now() >= task->Released);
+            task->Left    = task->Work;
+            task->RunTime = 0;
+        }
+        while (task && task->Runaway && __Now() >= task->Released + task->Period) {
+            task->Released += task->Period;
+            task->RunTime   = 0;
+        }
+
+        step = MIN(g_testContext.Deadline - elapsed, __RaiseInterrupts(tasks, taskCount));
+        if (task) {
+            step = MIN(step, task->Left);
+        }
+        OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, step);
+        elapsed += step;
+        if (task) {
+            task->Left    -= step;
+            task->RunTime += step;
+            assert_true(task->RunTime <= task->Runtime);
+        } else if (current >= 0) {
+            levelTime += step;
+        }
+        (void)__RaiseInterrupts(tasks, taskCount);
+
+        if (task && !task->Left) {
+            if (__Now() > task->Released + task->Deadline) {
+                task->Missed++;
+            }
+            task->Periods++;
+            task->Released += task->Period;
+            if (task->Interrupt) {
+                task->Blocked = true;
+                assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+                __Advance(current, 0, elapsed);
+            } else {
+                __SleepUntil(current, task->Released, elapsed);
+            }
+        } else if (elapsed >= g_testContext.Deadline || current < 0) {
+            // An idle core is woken by any interrupt
+            __Advance(current, 1, elapsed);
+        } else {
+            continue;
+        }
+        current = g_testContext.Current[0];
+        elapsed = 0;
+    }
+    return levelTime;
+}
+
+void TestDeadline_MeetsDeadlinesUnderLoad(void** state)
+{
+    struct __DeadlineTask tasks[] = {
+        { .Runtime = 2 * NSEC_PER_MSEC, .Deadline = 10 * NSEC_PER_MSEC, .Period = 10 * NSEC_PER_MSEC, .Work = 2 * NSEC_PER_MSEC },
+        { .Runtime = NSEC_PER_MSEC, .Deadline = 4 * NSEC_PER_MSEC, .Period = 5 * NSEC_PER_MSEC, .Work = 900 * NSEC_PER_USEC, .Interrupt = true },
+        { .Runtime = 6 * NSEC_PER_MSEC, .Deadline = 40 * NSEC_PER_MSEC, .Period = 40 * NSEC_PER_MSEC, .Work = 5 * NSEC_PER_MSEC },
+        { .Runtime = 3 * NSEC_PER_MSEC, .Deadline = 25 * NSEC_PER_MSEC, .Period = 25 * NSEC_PER_MSEC, .Work = 3 * NSEC_PER_MSEC }
+    };
+    const int taskCount = sizeof(tasks) / sizeof(tasks[0]);
+    clock_t   levelTime;
+    (void)state;
+
+    // 20% + 20% + 15% + 12% of the core, together with 8 level objects that never block. The
+    // shortest deadline task is woken by an interrupt, and must not wait for a level object
+    // to use its time slice.
+    levelTime = __RunDeadlineSimulation(tasks, taskCount, 8, 2 * NSEC_PER_SEC);
+    for (int i = 0; i < taskCount; i++) {
+        assert_true(tasks[i].Periods >= (int)((2 * NSEC_PER_SEC) / tasks[i].Period) - 1);
+        assert_int_equal(tasks[i].Missed, 0);
+    }
+    assert_int_equal(atomic_load(&g_testContext.Schedulers[0].DeadlineMisses), 0);
+
+    // The level objects get the rest of the core
+    assert_true(levelTime > (2 * NSEC_PER_SEC) / 4);
+}
+
+void TestDeadline_ThrottlesRunaway(void** state)
+{
+    struct __DeadlineTask tasks[] = {
+        { .Runtime = 2 * NSEC_PER_MSEC, .Deadline = 10 * NSEC_PER_MSEC, .Period = 10 * NSEC_PER_MSEC, .Runaway = true },
+        { .Runtime = NSEC_PER_MSEC, .Deadline = 3 * NSEC_PER_MSEC, .Period = 5 * NSEC_PER_MSEC, .Work = NSEC_PER_MSEC }
+    };
+    clock_t levelTime;
+    (void)state;
+
+    // The runaway never finishes its work, but only ever gets its runtime
+    tasks[0].Work = 10 * NSEC_PER_SEC;
+    levelTime = __RunDeadlineSimulation(tasks, 2, 2, NSEC_PER_SEC);
+    assert_int_equal(tasks[1].Missed, 0);
+    assert_true(tasks[1].Periods >= 199);
+    assert_true(atomic_load(&g_testContext.Schedulers[0].DeadlineThrottles) >= 99);
+    assert_true(levelTime >= (NSEC_PER_SEC * 55) / 100);
+}
+
+// Runs the queued TXU messages on the cores they were sent to
+static void
+__DeliverMessages(void)
+{
+    uuid_t currentCore = g_testContext.CurrentCore;
+    for (int i = 0; i < g_testContext.MessageCount; i++) {
+        struct __TxuMessage* message = &g_testContext.Messages[i];
+        g_testContext.CurrentCore = message->CoreId;
+        message->Function(message->Argument);
+    }
+    g_testContext.MessageCount = 0;
+    g_testContext.CurrentCore  = currentCore;
+}
+
+// Every round is one timer tick on each online core. All objects are cpu-bound and
+// never block, so a core is only idle when it has nothing queued.
+static void
+__Simulate(int rounds, int* busyTicks)
+{
+    const clock_t tick = 10 * NSEC_PER_MSEC;
+
+    for (int round = 0; round < rounds; round++) {
+        OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, tick);
+        for (int core = 0; core < g_testContext.OnlineCount; core++) {
+            __DeliverMessages();
+            g_testContext.CurrentCore = core;
+            if (__Advance(g_testContext.Current[core], 1, tick) >= 0 && busyTicks) {
+                busyTicks[core]++;
+            }
+        }
+    }
+    __DeliverMessages();
+    g_testContext.CurrentCore = 0;
+}
+
+static void
+__PrintCores(const char* name, int* busyTicks, int rounds)
+{
+    printf("%s:", name);
+    for (int core = 0; core < g_testContext.OnlineCount; core++) {
+        SchedulerStatistics_t stats;
+        SchedulerGetStatistics(&g_testContext.Schedulers[core], &stats);
+        printf(" [core %i: %i threads, %3i%% busy, %zu in, %zu out, %zu stolen]",
+               core, stats.ObjectCount, busyTicks ? (busyTicks[core] * 100) / rounds : 0,
+               stats.MigrationsIn, stats.MigrationsOut, stats.Steals);
+    }
+    printf("\n");
+}
+
+static size_t
+__TotalMigrations(void)
+{
+    size_t total = 0;
+    for (int core = 0; core < g_testContext.CoreCount; core++) {
+        total += g_testContext.Schedulers[core].MigrationsOut;
+    }
+    return total;
+}
+
+void TestBalance_SpreadsPiledUpObjects(void** state)
+{
+    const int threadCount = 3 * CORE_COUNT;
+    int       busyTicks[CORE_COUNT] = { 0 };
+    int       minThreads = threadCount, maxThreads = 0;
+    size_t    migrations;
+    (void)state;
+
+    // All threads are created while only the boot core is up, like the services
+    // that are started during boot.
+    g_testContext.CoreCount = CORE_COUNT;
+    for (int i = 0; i < threadCount; i++) {
+        __CreateObject(0);
+    }
+    assert_int_equal(g_testContext.Schedulers[0].ObjectCount, threadCount);
+
+    g_testContext.OnlineCount = CORE_COUNT;
+    __Simulate(1, busyTicks);
+    __PrintCores("before", busyTicks, 1);
+
+    __Simulate(200, NULL);
+    memset(&busyTicks[0], 0, sizeof(busyTicks));
+    __Simulate(100, busyTicks);
+    __PrintCores("after", busyTicks, 100);
+
+    for (int core = 0; core < CORE_COUNT; core++) {
+        int threads = g_testContext.Schedulers[core].ObjectCount;
+        minThreads = threads < minThreads ? threads : minThreads;
+        maxThreads = threads > maxThreads ? threads : maxThreads;
+        assert_int_equal(busyTicks[core], 100);
+    }
+    assert_true(maxThreads - minThreads <= 1);
+    assert_true(g_testContext.Schedulers[0].Steals > 0);
+
+    // Once balanced the threads must stay where they are
+    migrations = __TotalMigrations();
+    __Simulate(500, NULL);
+    assert_int_equal(__TotalMigrations(), migrations);
+}
+
+void TestBalance_SmallImbalanceIsKept(void** state)
+{
+    (void)state;
+
+    // Two threads on one core and one on the other, moving one would only
+    // flip the imbalance around.
+    g_testContext.CoreCount = 2;
+    __CreateObject(0);
+    __CreateObject(0);
+    g_testContext.OnlineCount = 2;
+    __CreateObject(0);
+    assert_int_equal(g_testContext.Schedulers[0].ObjectCount, 2);
+    assert_int_equal(g_testContext.Schedulers[1].ObjectCount, 1);
+    __DeliverMessages();
+
+    __Simulate(500, NULL);
+    assert_int_equal(__TotalMigrations(), 0);
+}
+
+void TestBalance_BoundObjectsStay(void** state)
+{
+    int busyTicks[CORE_COUNT] = { 0 };
+    (void)state;
+
+    // Bound objects are placed on the calling core and never moved
+    g_testContext.CoreCount   = 2;
+    g_testContext.OnlineCount = 2;
+    for (int i = 0; i < 4; i++) {
+        __CreateObject(THREADING_IDLE);
+    }
+
+    __Simulate(200, busyTicks);
+    assert_int_equal(__TotalMigrations(), 0);
+    for (int i = 0; i < 4; i++) {
+        assert_int_equal(SchedulerObjectGetAffinity(g_testContext.Objects[i]), 0);
+    }
+    assert_int_equal(busyTicks[1], 0);
+}
+
+// Creates one object on each of the cores, and runs them
+static void
+__StartOnEachCore(int coreCount)
+{
+    g_testContext.CoreCount   = coreCount;
+    g_testContext.OnlineCount = coreCount;
+    for (int i = 0; i < coreCount; i++) {
+        assert_int_equal(SchedulerObjectGetAffinity(g_testContext.Objects[__CreateObject(0)]), i);
+    }
+    __DeliverMessages();
+    for (int i = 0; i < coreCount; i++) {
+        g_testContext.CurrentCore = i;
+        assert_int_equal(__Advance(-1, 0, 0), i);
+    }
+    g_testContext.CurrentCore = 0;
+}
+
+// Blocks the object that runs on the core, and runs whatever is next there
+static void
+__BlockOnCore(uuid_t coreId)
+{
+    g_testContext.CurrentCore = coreId;
+    assert_int_equal(SchedulerBlock(NULL, NULL), OS_EOK);
+    __Advance(g_testContext.Current[coreId], 0, 0);
+    g_testContext.CurrentCore = 0;
+}
+
+static void
+__Wake(int index, unsigned int flags)
+{
+    assert_int_equal(SchedulerWakeObject(g_testContext.Objects[index], flags), OS_EOK);
+    __DeliverMessages();
+}
+
+void TestWakeup_PrefersWarmIdleCore(void** state)
+{
+    size_t remote;
+    (void)state;
+
+    // Starting the objects counts as a wakeup too
+    __StartOnEachCore(3);
+    remote = g_testContext.Schedulers[1].WakeupsRemote;
+    assert_int_equal(g_testContext.Schedulers[0].WakeupsLocal, 1);
+
+    // The previous core is idle and the object ran there just now
+    __BlockOnCore(1);
+    OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, NSEC_PER_MSEC);
+    __Wake(1, SCHEDULER_WAKE_SYNC);
+    assert_int_equal(SchedulerObjectGetAffinity(g_testContext.Objects[1]), 1);
+    assert_int_equal(g_testContext.Schedulers[1].RunnableCount, 1);
+    assert_int_equal(g_testContext.Schedulers[1].WakeupsRemote, remote + 1);
+    assert_int_equal(g_testContext.Schedulers[1].WakeupsMoved, 0);
+
+    // Once its cache has gone cold, a sync waker with nothing else to run takes it
+    g_testContext.CurrentCore = 1;
+    assert_int_equal(__Advance(-1, 0, 0), 1);
+    __BlockOnCore(1);
+    OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, 2 * SCHEDULER_CACHE_HOT_MS * NSEC_PER_MSEC);
+    __Wake(1, SCHEDULER_WAKE_SYNC);
+    assert_int_equal(SchedulerObjectGetAffinity(g_testContext.Objects[1]), 0);
+    assert_int_equal(g_testContext.Schedulers[0].RunnableCount, 1);
+    assert_int_equal(g_testContext.Schedulers[0].ObjectCount, 2);
+    assert_int_equal(g_testContext.Schedulers[1].ObjectCount, 0);
+    assert_int_equal(g_testContext.Schedulers[0].WakeupsLocal, 1);
+    assert_int_equal(g_testContext.Schedulers[0].WakeupsMoved, 1);
+    assert_int_equal(__Advance(0, 0, 0), 1);
+}
+
+void TestWakeup_PicksIdleCore(void** state)
+{
+    size_t remote;
+    int    bound;
+    (void)state;
+
+    __StartOnEachCore(3);
+    remote = g_testContext.Schedulers[2].WakeupsRemote;
+    __BlockOnCore(2);
+
+    // Something else runs on the previous core by the time the object is woken
+    __BlockOnCore(1);
+    g_testContext.CurrentCore = 1;
+    bound = __CreateObject(THREADING_IDLE);
+    assert_int_equal(__Advance(-1, 0, 0), bound);
+    g_testContext.CurrentCore = 0;
+
+    __Wake(1, 0);
+    assert_int_equal(SchedulerObjectGetAffinity(g_testContext.Objects[1]), 2);
+    assert_int_equal(g_testContext.Schedulers[2].RunnableCount, 1);
+    assert_int_equal(g_testContext.Schedulers[2].WakeupsRemote, remote);
+    assert_int_equal(g_testContext.Schedulers[2].WakeupsMoved, 1);
+
+    // Bound objects always stay
+    __BlockOnCore(1);
+    OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, 2 * SCHEDULER_CACHE_HOT_MS * NSEC_PER_MSEC);
+    __Wake(bound, SCHEDULER_WAKE_SYNC);
+    assert_int_equal(SchedulerObjectGetAffinity(g_testContext.Objects[bound]), 1);
+    assert_int_equal(g_testContext.Schedulers[1].RunnableCount, 1);
+}
+
+// Simple LCG, so the benchmarks are reproducible
+static unsigned int
+__Random(unsigned int* seed)
+{
+    *seed = (*seed * 1103515245U) + 12345U;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+// The lookup SchedulerAdvance did before the level bitmap was introduced
+static int
+__LinearLookup(Scheduler_t* scheduler)
+{
+    for (int i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
+        if (scheduler->Queues[i].Head != NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static double
+__Elapsed(struct timespec* start, struct timespec* end)
+{
+    return ((double)(end->tv_sec - start->tv_sec) * 1e9) + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void
+__RunBenchmark(const char* name, unsigned int flags, int objectCount)
+{
+    const int       iterations = 2000000;
+    struct timespec start, end;
+    volatile int    sink = 0;
+    double          advance, linear, bitmap;
+    int             current;
+
+    SetupTest(NULL);
+    for (int i = 0; i < objectCount; i++) {
+        __CreateObject(flags);
+    }
+
+    current = __Advance(-1, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        current = __Advance(current, 0, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    advance = __Elapsed(&start, &end) / iterations;
+    assert_true(current >= 0);
+    __VerifyBitmap();
+
+    // Compare only the lookup itself on the same queue state
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        sink += __LinearLookup(&g_testContext.Schedulers[0]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    linear = __Elapsed(&start, &end) / iterations;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        sink += __builtin_ctzll(*(volatile uint64_t*)&g_testContext.Schedulers[0].QueueBitmap);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    bitmap = __Elapsed(&start, &end) / iterations;
+    (void)sink;
+
+    printf("%-12s %2i objects: %6.1f ns/advance, lookup %5.2f ns linear, %5.2f ns bitmap\n",
+           name, objectCount, advance, linear, bitmap);
+    TeardownTest(NULL);
+}
+
+void TestAdvance_Benchmark(void** state)
+{
+    (void)state;
+
+    __RunBenchmark("top level", 0, 2);
+    __RunBenchmark("top level", 0, 64);
+    __RunBenchmark("low level", THREADING_BACKGROUND, 2);
+    __RunBenchmark("low level", THREADING_BACKGROUND, 64);
+}
+
+// What every tick cost before the sleep wheel, a walk over all the sleepers
+static clock_t
+__LinearSleepScan(OSTimestamp_t* wakeUpTimes, int count, OSTimestamp_t* currentTime)
+{
+    clock_t next = __MASK;
+    for (int i = 0; i < count; i++) {
+        if (OSTimestampCompare(currentTime, &wakeUpTimes[i]) < 0) {
+            OSTimestamp_t diff;
+            clock_t       ns;
+            OSTimestampSubtract(&diff, &wakeUpTimes[i], currentTime);
+            ns   = (diff.Seconds * NSEC_PER_SEC) + diff.Nanoseconds;
+            next = ns < next ? ns : next;
+        }
+    }
+    return next;
+}
+
+static void
+__RunTickBenchmark(int sleeperCount)
+{
+    const int       iterations = 200000;
+    unsigned int    seed       = 1;
+    OSTimestamp_t*  wakeUpTimes;
+    struct timespec start, end;
+    volatile clock_t sink = 0;
+    double          tick, linear;
+    int             running;
+
+    SetupTest(NULL);
+    wakeUpTimes = malloc(sizeof(OSTimestamp_t) * sleeperCount);
+    assert_non_null(wakeUpTimes);
+
+    // Sleepers are spread over 10 to 60 seconds, so none of them expire while measuring
+    for (int i = 0; i < sleeperCount; i++) {
+        clock_t ns = (10 * NSEC_PER_SEC) + ((clock_t)(__Random(&seed) % 50000) * NSEC_PER_MSEC);
+        __Sleep(__CreateObject(0), ns);
+        OSTimestampAddNsec(&wakeUpTimes[i], &g_testContext.Time, ns);
+    }
+    assert_int_equal(g_testContext.Schedulers[0].SleepWheel.Count, sleeperCount);
+
+    running = __CreateObject(0);
+    assert_int_equal(__Advance(-1, 0, 0), running);
+
+    // Timer ticks while the same object keeps running, 2us apart
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        OSTimestampAddNsec(&g_testContext.Time, &g_testContext.Time, 2000);
+        running = __Advance(running, 1, 2000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tick = __Elapsed(&start, &end) / iterations;
+    assert_int_equal(g_testContext.Schedulers[0].SleepWheel.Count, sleeperCount);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations / 100; i++) {
+        sink += __LinearSleepScan(wakeUpTimes, sleeperCount, &g_testContext.Time);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    linear = __Elapsed(&start, &end) / (iterations / 100);
+    (void)sink;
+
+    printf("%5i sleepers: %7.1f ns/tick, %9.1f ns/tick walking the sleepers\n",
+           sleeperCount, tick, linear);
+    free(wakeUpTimes);
+    TeardownTest(NULL);
+}
+
+void TestSleep_TickBenchmark(void** state)
+{
+    (void)state;
+
+    __RunTickBenchmark(1);
+    __RunTickBenchmark(64);
+    __RunTickBenchmark(1024);
+    __RunTickBenchmark(OBJECT_COUNT - 1);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup_teardown(TestAdvance_EmptyReturnsNothing, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestAdvance_PicksHighestPriorityLevel, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestAdvance_RoundRobinWithinLevel, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestBoost_MovesLevelsToTop, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestInheritance_MovesQueuedObject, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestBalance_SpreadsPiledUpObjects, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestBalance_SmallImbalanceIsKept, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestBalance_BoundObjectsStay, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestSleep_TimesOut, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestSleep_WakeCancelsTimeout, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestLatency_RecordsRunqueueAndWakeup, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestDeadline_AdmissionControl, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestDeadline_AdmissionControlUser, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestDeadline_MeetsDeadlinesUnderLoad, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestDeadline_ThrottlesRunaway, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestWakeup_PrefersWarmIdleCore, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestWakeup_PicksIdleCore, SetupTest, TeardownTest),
+            cmocka_unit_test(TestAdvance_Benchmark),
+            cmocka_unit_test(TestSleep_TickBenchmark),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+// Mocks
+
+static uuid_t
+__CoreIndex(SystemCpuCore_t* cpuCore) {
+    return (uuid_t)((Scheduler_t*)cpuCore - &g_testContext.Schedulers[0]);
+}
+
+SystemCpuCore_t* CpuCoreCurrent(void) {
+    return (SystemCpuCore_t*)&g_testContext.Schedulers[g_testContext.CurrentCore];
+}
+
+SystemCpuCore_t* GetProcessorCore(uuid_t coreId) {
+    assert_true(coreId < (uuid_t)g_testContext.CoreCount);
+    return (SystemCpuCore_t*)&g_testContext.Schedulers[coreId];
+}
+
+Scheduler_t* CpuCoreScheduler(SystemCpuCore_t* cpuCore) {
+    return (Scheduler_t*)cpuCore;
+}
+
+uuid_t CpuCoreId(SystemCpuCore_t* cpuCore) {
+    return __CoreIndex(cpuCore);
+}
+
+SystemCpuCore_t* CpuCoreNext(SystemCpuCore_t* cpuCore) {
+    uuid_t next = __CoreIndex(cpuCore) + 1;
+    return next < (uuid_t)g_testContext.CoreCount ? (SystemCpuCore_t*)&g_testContext.Schedulers[next] : NULL;
+}
+
+SystemCpuState_t CpuCoreState(SystemCpuCore_t* cpuCore) {
+    return __CoreIndex(cpuCore) < (uuid_t)g_testContext.OnlineCount ? CpuStateRunning : CpuStateShutdown;
+}
+
+Thread_t* CpuCoreCurrentThread(SystemCpuCore_t* cpuCore) {
+    return (Thread_t*)&g_testContext.Current[__CoreIndex(cpuCore)];
+}
+
+SchedulerObject_t* ThreadSchedulerHandle(Thread_t* thread) {
+    int current = *(int*)thread;
+    return current < 0 ? NULL : g_testContext.Objects[current];
+}
+
+uuid_t ThreadHandle(Thread_t* thread) {
+    return (uuid_t)*(int*)thread;
+}
+
+const char* ThreadName(Thread_t* thread) {
+    (void)thread;
+    return "test";
+}
+
+int ThreadIsCurrentIdle(uuid_t coreId) {
+    return g_testContext.Current[coreId] < 0;
+}
+
+uuid_t ArchGetProcessorCoreId(void) {
+    return g_testContext.CurrentCore;
+}
+
+void ArchThreadYield(void) { }
+
+SystemDomain_t* GetCurrentDomain(void) {
+    return NULL;
+}
+
+SystemMachine_t* GetMachine(void) {
+    return &g_testContext.Machine;
+}
+
+oserr_t TxuMessageSend(uuid_t coreId, SystemCpuFunctionType_t type, TxuFunction_t function, void* argument, int async) {
+    struct __TxuMessage* message;
+    (void)type;
+    assert_true(async);
+    assert_true(g_testContext.MessageCount < MESSAGE_COUNT);
+
+    message = &g_testContext.Messages[g_testContext.MessageCount++];
+    message->CoreId   = coreId;
+    message->Function = function;
+    message->Argument = argument;
+    return OS_EOK;
+}
+
+void SystemTimerGetWallClockTime(OSTimestamp_t* time) {
+    *time = g_testContext.Time;
+}
+
+oserr_t SystemTimerGetPerformanceTick(UInteger64_t* tick) {
+    if (!g_testContext.Tick) {
+        return OS_ENOTSUPPORTED;
+    }
+    tick->QuadPart = g_testContext.Tick;
+    return OS_EOK;
+}
+
+void SystemTimerStall(OSTimestamp_t* deadline) {
+    (void)deadline;
+}
+
+void SpinlockAcquireIrq(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void SpinlockReleaseIrq(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void WriteVolatileMemory(volatile void* pointer, void* data, size_t length) {
+    memcpy((void*)pointer, data, length);
+}
+
+int list_append(list_t* list, element_t* element) {
+    (void)list; (void)element;
+    return 0;
+}
+
+int list_remove(list_t* list, element_t* element) {
+    (void)list; (void)element;
+    return 0;
+}
+
+void* kmalloc(size_t size) {
+    return malloc(size);
+}
+
+void kfree(void* object) {
+    free(object);
+}
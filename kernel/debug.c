@@ -23,7 +23,6 @@
 #include <debug.h>
 #include <memoryspace.h>
 #include <machine.h>
-#include <shm.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -45,52 +44,6 @@ DebugBreakpoint(
     return OS_EOK;
 }
 
-static oserr_t
-__MapFaultingAddress(
-        _In_ OSMemoryDescriptor_t* descriptor,
-        _In_ uintptr_t             address)
-{
-    MemorySpace_t* memorySpace = GetCurrentMemorySpace();
-    size_t         pageSize = GetMemorySpacePageSize();
-    oserr_t        oserr;
-
-    // Otherwise, commit the page and continue without anyone noticing, and handle race-conditions
-    // if two different threads have accessed a reserved page. OsExists will be returned.
-    if (descriptor->SHMTag != UUID_INVALID) {
-        oserr = SHMCommit(
-                descriptor->SHMTag,
-                (void*)descriptor->StartAddress,
-                (void*)address,
-                pageSize
-        );
-    } else {
-        uintptr_t physicalAddress;
-        oserr = MemorySpaceCommit(
-                memorySpace,
-                address,
-                &physicalAddress,
-                pageSize,
-                0,
-                0
-        );
-        if (oserr == OS_EOK) {
-            // If the mapping has the attribute CLEAN, then we zero each
-            // allocated page. However if the mapping was read-only, we cannot
-            // zero the pages. And only do it in the case of OS_EOK, as that means
-            // a physical page was actually comitted.
-            bool readOnly = (descriptor->Attributes & MAPPING_READONLY) != 0;
-            bool shouldClean = (descriptor->Attributes & MAPPING_CLEAN) != 0;
-            if (!readOnly && shouldClean) {
-                memset((void*)(address & (pageSize - 1)), 0, pageSize);
-            }
-        }
-    }
-    if (oserr == OS_EEXISTS) {
-        oserr = OS_EOK;
-    }
-    return oserr;
-}
-
 static enum OSPageFaultCode
 __HandleUserspaceFault(
         _In_ OSMemoryDescriptor_t* descriptor,
@@ -121,7 +74,7 @@ __HandleUserspaceFault(
         result = OSPAGEFAULT_RESULT_TRAP;
     }
 
-    if (__MapFaultingAddress(descriptor, address) != OS_EOK) {
+    if (MemorySpaceCommitFault(GetCurrentMemorySpace(), descriptor, address) != OS_EOK) {
         result = OSPAGEFAULT_RESULT_FAULT;
     }
     return result;
@@ -145,7 +98,7 @@ DebugPageFault(
         return __HandleUserspaceFault(&descriptor, address);
     }
 
-    oserr = __MapFaultingAddress(&descriptor, address);
+    oserr = MemorySpaceCommitFault(memorySpace, &descriptor, address);
     if (oserr != OS_EOK) {
         result = OSPAGEFAULT_RESULT_FAULT;
     }
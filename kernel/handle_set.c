@@ -279,7 +279,7 @@ MarkHandleCallback(
 {
     struct handleset_element* setElement     = element->value;
     unsigned int              flags          = (unsigned int)(uintptr_t)context;
-    unsigned int              acceptedEvents = setElement->Configuration & flags;
+    unsigned int              acceptedEvents = setElement->Configuration & flags & ~MARKHANDLE_SYNC;
     TRACE("MarkHandleCallback(config=0x%x, accept=0x%x)", setElement->Configuration, acceptedEvents);
     
     if (acceptedEvents) {
@@ -289,7 +289,8 @@ MarkHandleCallback(
 
             previousEvents = atomic_fetch_add(&setElement->set->events_pending, 1);
             if (!previousEvents) {
-                (void)FutexWake(&setElement->set->events_pending, 1, 0);
+                (void)FutexWake(&setElement->set->events_pending, 1,
+                                (flags & MARKHANDLE_SYNC) ? FUTEX_FLAG_SYNC : 0);
             }
         }
     }
@@ -95,14 +95,25 @@ MmuDestroyVirtualSpace(
         _In_ MemorySpace_t* memorySpace);
 
 /**
- * @brief Switches the current memory space out with the given memory space. This
- * will cause a total TLB flush.
+ * @brief Returns the number of address space ids the platform can tag TLB entries with,
+ * or 0 if TLB entries can't be tagged.
+ */
+KERNELAPI int KERNELABI
+ArchMmuAddressSpaceIdCount(void);
+
+/**
+ * @brief Switches the current memory space out with the given memory space. Without
+ * address space ids this will cause a total TLB flush of non-global entries.
  *
- * @param MemorySpace [In]
+ * @param memorySpace    [In] The memory space to switch to.
+ * @param addressSpaceId [In] The address space id to tag the TLB entries with, 0 if not used.
+ * @param flush          [In] Whether existing TLB entries tagged with the address space id must be flushed.
  */
 KERNELAPI void KERNELABI
 ArchMmuSwitchMemorySpace(
-        _In_ MemorySpace_t* memorySpace);
+        _In_ MemorySpace_t* memorySpace,
+        _In_ int            addressSpaceId,
+        _In_ bool           flush);
 
 /**
  * @brief Retrieves memory attributes for the number of virtual address provided. The array
@@ -163,6 +174,26 @@ ArchMmuCommitVirtualPage(
         _In_  int            pageCount,
         _Out_ int*           pagesComittedOut);
 
+/**
+ * @brief Replaces the physical page of a single committed mapping, but only if the mapping
+ * still points to <expectedAddress>. Used to give a copy-on-write mapping its own copy of the page.
+ *
+ * @param memorySpace     [In] The memory space the mapping is in.
+ * @param address         [In] The virtual address of the page.
+ * @param expectedAddress [In] The physical page the mapping must currently point to.
+ * @param physicalAddress [In] The physical page the mapping should point to.
+ * @param attributes      [In] The new attributes of the mapping.
+ *
+ * @return OS_EBUSY if the mapping was changed by someone else, OS_ENOENT if there is no mapping.
+ */
+KERNELAPI oserr_t KERNELABI
+ArchMmuReplaceVirtualPage(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ paddr_t        expectedAddress,
+        _In_ paddr_t        physicalAddress,
+        _In_ unsigned int   attributes);
+
 /**
  * @brief Creates @PageCount number of virtual memory mappings that correspond to the
  * physical address given.
@@ -272,4 +303,19 @@ ArchMmuVirtualToPhysical(
         _In_  paddr_t*,
         _Out_ int*);
 
+/**
+ * @brief Retrieves statistics about large page mappings. Mappings are promoted to large
+ * pages when both the virtual and the physical range is suitably aligned and contiguous, and
+ * are split again when only a part of them is changed.
+ *
+ * @param pageSizeOut    [Out] The size of a large page in bytes, or 0 if the platform does not use them.
+ * @param pagesMappedOut [Out] The number of large pages currently mapped.
+ * @param pageSplitsOut  [Out] The number of times a large page has been split.
+ */
+KERNELAPI void KERNELABI
+ArchMmuGetLargePageStatistics(
+        _Out_ size_t* pageSizeOut,
+        _Out_ size_t* pagesMappedOut,
+        _Out_ size_t* pageSplitsOut);
+
 #endif //!__SYSTEM_MMU_INTEFACE_H__
@@ -38,6 +38,7 @@
 #define MAX_SUPPORTED_INTERRUPTS        256
 
 #define X86_CPU_FLAG_INVARIANT_TSC 0x1
+#define X86_CPU_FLAG_INVPCID       0x2
 
 typedef struct PlatformCpuBlock {
     uint32_t MaxLevel;
@@ -75,6 +75,7 @@ enum CpuFeatures {
 	CPUID_FEAT_ECX_CX16 = 1 << 13,
 	CPUID_FEAT_ECX_ETPRD = 1 << 14,
 	CPUID_FEAT_ECX_PDCM = 1 << 15,
+	CPUID_FEAT_ECX_PCID = 1 << 17,
 	CPUID_FEAT_ECX_DCA = 1 << 18,
 	CPUID_FEAT_ECX_SSE4_1 = 1 << 19,
 	CPUID_FEAT_ECX_SSE4_2 = 1 << 20,
@@ -53,6 +53,7 @@ DECL_STRUCT(MemorySpace);
 // OS Bitfields for pages, bits 9-11 are available
 #define PAGE_PERSISTENT         0x200U
 #define PAGE_RESERVED           0x400U
+#define PAGE_COPYONWRITE        0x800U // Shared page that is copied on the first write, never writable
 #define PAGE_NX                 0x8000000000000000U // amd64 + nx cpuid must be set
 
 // OS Bitfields for page tables, bits 9-11 are available
@@ -105,7 +106,8 @@ MmVirtualGetMasterTable(
         _In_ int*                isCurrentOut);
 
 /**
- * @brief
+ * @brief Retrieves the page-table for the address. If the address is mapped by a large page, the large
+ * page is split into a page-table with the same mappings before it is returned.
  *
  * @param parentPageDirectory
  * @param pageDirectory
@@ -124,6 +126,60 @@ MmVirtualGetTable(
         _In_  int                createIfMissing,
         _Out_ int*               update);
 
+/**
+ * @brief Retrieves the page-directory that holds the entry for the address, but only if the
+ * address is mapped by a large page. The entry is located at PAGE_DIRECTORY_INDEX(address).
+ *
+ * @param parentPageDirectory The parent master table of the memory space, if any.
+ * @param pageDirectory       The master table of the memory space.
+ * @param address             The virtual address to look up.
+ * @return The page-directory if the address is mapped by a large page, otherwise NULL.
+ */
+KERNELAPI PageDirectory_t* KERNELABI
+MmVirtualGetLargePageDirectory(
+        _In_ PAGE_MASTER_LEVEL* parentPageDirectory,
+        _In_ PAGE_MASTER_LEVEL* pageDirectory,
+        _In_ vaddr_t            address);
+
+/**
+ * @brief Maps a large page at the address. Both the virtual and the physical address must be aligned
+ * to LARGE_PAGE_SIZE. The range must not have any existing mappings, but an empty page-table is allowed,
+ * which will be released or kept for when the large page is split.
+ *
+ * @param parentPageDirectory The parent master table of the memory space, if any.
+ * @param pageDirectory       The master table of the memory space.
+ * @param address             The virtual address of the large page.
+ * @param physicalAddress     The physical address of the large page.
+ * @param attributes          The x86 page attributes for the mapping.
+ * @param isCurrent           Whether the memory space is the currently loaded.
+ * @return OS_EOK if the large page was mapped, OS_EEXISTS if the range had mappings and OS_ENOTSUPPORTED
+ *         if the platform does not support large pages.
+ */
+KERNELAPI oserr_t KERNELABI
+MmVirtualSetLargePage(
+        _In_ PAGE_MASTER_LEVEL* parentPageDirectory,
+        _In_ PAGE_MASTER_LEVEL* pageDirectory,
+        _In_ vaddr_t            address,
+        _In_ paddr_t            physicalAddress,
+        _In_ unsigned int       attributes,
+        _In_ int                isCurrent);
+
+/**
+ * @brief Removes the large page mapped at the address, the address must be aligned to LARGE_PAGE_SIZE.
+ *
+ * @param parentPageDirectory The parent master table of the memory space, if any.
+ * @param pageDirectory       The master table of the memory space.
+ * @param address             The virtual address of the large page.
+ * @param isCurrent           Whether the memory space is the currently loaded.
+ * @return The large page entry that was removed, or 0 if the address was not mapped by a large page.
+ */
+KERNELAPI uintptr_t KERNELABI
+MmVirtualClearLargePage(
+        _In_ PAGE_MASTER_LEVEL* parentPageDirectory,
+        _In_ PAGE_MASTER_LEVEL* pageDirectory,
+        _In_ vaddr_t            address,
+        _In_ int                isCurrent);
+
 /**
  * @brief
  *
@@ -36,6 +36,11 @@
 #define TABLE_SPACE_SIZE        (PAGE_SIZE * ENTRIES_PER_PAGE)
 #define MEMORY_ALLOCATION_MASK  0x3FFFFF
 
+/* Large pages (4mb) require PSE, and are not used on x32, these are
+ * defined for the shared mmu code. */
+#define LARGE_PAGE_SIZE         TABLE_SPACE_SIZE
+#define LARGE_PAGE_MASK         0xFFC00000
+
 /* Indices
  * 10 bits each are used for each part, with the first 12 bits reserved */
 #define PAGE_DIRECTORY_INDEX(x) (((x) >> 22) & 0x3FF)
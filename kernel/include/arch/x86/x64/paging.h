@@ -48,6 +48,13 @@
 #define PML4_SPACE_SIZE            ((uint64_t)DIRECTORY_TABLE_SPACE_SIZE * (uint64_t)ENTRIES_PER_PAGE)
 #define MEMORY_ALLOCATION_MASK     0x1FFFFFU
 
+/**
+ * Large pages are mapped directly by a page-directory entry, and covers
+ * the same space as a page-table.
+ */
+#define LARGE_PAGE_SIZE            TABLE_SPACE_SIZE
+#define LARGE_PAGE_MASK            0xFFFFFFFFFFE00000ULL
+
 /**
  * Page directory indices
  * 9 bits each are used for each part, with the first 12 bits reserved
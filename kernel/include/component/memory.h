@@ -24,10 +24,35 @@
 
 #include <os/osdefs.h>
 #include <spinlock.h>
+#include <utils/memory_buddy.h>
 #include <utils/memory_stack.h>
 
 #define MEMORY_MASK_COUNT 5
 
+// Each core keeps a small list of free pages per region. Allocations of up to a batch are
+// served from there, and the list is refilled from the region a batch at a time. Frees
+// go to the list, and once it reaches the high watermark it is drained to the low watermark.
+#define MEMORY_PAGE_CACHE_HIGH  64
+#define MEMORY_PAGE_CACHE_LOW   32
+#define MEMORY_PAGE_CACHE_BATCH 16
+
+// Each allocator keeps a pool of pages that have been zeroed in the background, so
+// allocations that need clean pages can skip zeroing them on the spot. The target is the
+// number of pages the pool is refilled to, and can be changed at runtime.
+#define MEMORY_ZERO_POOL_CAPACITY 1024
+#define MEMORY_ZERO_POOL_TARGET   256
+
+// Memory domains, allocations prefer the domain of the calling core, and then
+// fall back to the other domains in the order of their distance.
+#define MEMORY_DOMAIN_COUNT           8
+#define MEMORY_DOMAIN_DISTANCE_LOCAL  10
+#define MEMORY_DOMAIN_DISTANCE_REMOTE 20
+
+enum SystemMemoryPolicy {
+    SystemMemoryPolicy_LOCAL,     // Prefer the local domain, then the nearest domains
+    SystemMemoryPolicy_INTERLEAVE // Spread the pages round-robin over all domains
+};
+
 enum SystemMemoryAttributes {
     SystemMemoryAttributes_REMOVABLE,
     SystemMemoryAttributes_NONVOLATILE
@@ -45,25 +70,94 @@ typedef struct SystemMemoryMap {
     SystemMemoryRange_t ThreadLocal;
 } SystemMemoryMap_t;
 
+typedef struct SystemMemoryPageCache {
+    Spinlock_t Lock; // Only contended when another core steals the pages
+    int        Count;
+    uintptr_t  Pages[MEMORY_PAGE_CACHE_HIGH];
+    size_t     Hits;
+    size_t     Misses;
+    size_t     Drains;
+} SystemMemoryPageCache_t;
+
+// Each region reserves a zone that is managed by a buddy allocator, which serves requests for
+// physically contiguous pages. Single pages are only taken from the zone once the stack is empty.
 typedef struct SystemMemoryAllocatorRegion {
-    MemoryStack_t Stack;
-    Spinlock_t    Lock;
+    MemoryStack_t            Stack;
+    MemoryBuddy_t            Buddy;
+    Spinlock_t               Lock;
+    SystemMemoryPageCache_t* PageCaches;
+    int                      PageCacheCount;
+    size_t                   LockAcquisitions;
+    size_t                   LockContention;
+    size_t                   ContiguousAllocations;
+    size_t                   ContiguousFailures;
 } SystemMemoryAllocatorRegion_t;
 
+typedef struct SystemMemoryZeroPool {
+    Spinlock_t Lock;
+    int        Count;
+    int        Target;
+    uintptr_t  Pages[MEMORY_ZERO_POOL_CAPACITY];
+    size_t     Hits;
+    size_t     Misses;
+} SystemMemoryZeroPool_t;
+
 typedef struct SystemMemoryAllocator {
     int                           MaskCount;
     size_t                        Masks[MEMORY_MASK_COUNT];
     SystemMemoryAllocatorRegion_t Region[MEMORY_MASK_COUNT];
+    SystemMemoryZeroPool_t        ZeroPool;
 } SystemMemoryAllocator_t;
 
+typedef struct SystemMemoryAllocatorStatistics {
+    size_t PageCacheHits;
+    size_t PageCacheMisses;
+    size_t PageCacheDrains;
+    size_t PagesCached;
+    size_t ContiguousPagesFree;
+    size_t ContiguousAllocations;
+    size_t ContiguousFailures;
+    size_t LockAcquisitions;
+    size_t LockContention;
+    size_t ZeroPoolPages;
+    size_t ZeroPoolTarget;
+    size_t ZeroPoolHits;
+    size_t ZeroPoolMisses;
+} SystemMemoryAllocatorStatistics_t;
+
+typedef struct SystemMemoryDomainStatistics {
+    size_t LocalPages;       // Pages requested from this domain that it served itself
+    size_t FallbackPages;    // Pages requested from this domain that another domain served
+    size_t RemotePages;      // Pages this domain served for requests from another domain
+    size_t InterleavedPages; // Pages this domain served for interleaved requests
+    size_t FreedPages;
+} SystemMemoryDomainStatistics_t;
+
 typedef struct SystemMemory {
     uintptr_t               PhysicalBase;
     size_t                  Size;
     size_t                  BlockSize;
     unsigned int            Attributes; // enum SystemMemoryAttributes
     SystemMemoryAllocator_t Allocator;
+
+    _Atomic(size_t) LocalPages;
+    _Atomic(size_t) FallbackPages;
+    _Atomic(size_t) RemotePages;
+    _Atomic(size_t) InterleavedPages;
+    _Atomic(size_t) FreedPages;
 } SystemMemory_t;
 
+// The topology routes allocations to the memory of the domains. Memory that is not
+// part of any domain, or all memory when there are no domains, is served by the default allocator.
+typedef struct SystemMemoryTopology {
+    int                      DomainCount;
+    SystemMemory_t*          Domains[MEMORY_DOMAIN_COUNT];
+    uint8_t                  Distances[MEMORY_DOMAIN_COUNT][MEMORY_DOMAIN_COUNT];
+    int                      FallbackOrder[MEMORY_DOMAIN_COUNT][MEMORY_DOMAIN_COUNT];
+    SystemMemoryAllocator_t* Default;
+    _Atomic(unsigned int)    InterleaveCursor;
+} SystemMemoryTopology_t;
+
 /**
  * @brief
  *
@@ -111,6 +205,158 @@ SystemMemoryFree(
         _In_ int             pageCount,
         _In_ uintptr_t*      pages);
 
+/**
+ * @brief Enables the per-core page caches of the allocator. Until this is called all
+ * allocations and frees go directly to the regions.
+ *
+ * @param[In] allocator The allocator to install the page caches for.
+ * @param[In] coreCount The number of cores in the system.
+ * @return OS_EOK if the page caches were installed, OS_EOOM if memory could not be allocated.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryAllocatorInitializePageCaches(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      coreCount);
+
+/**
+ * @brief Allocates pages from the allocator, it will try the regions from the highest one that
+ * satisfies the memory mask and downwards. The pages are not necessarily contiguous.
+ *
+ * @param[In]  allocator  The allocator to allocate pages from.
+ * @param[In]  memoryMask The highest physical address that can be accepted, 0 if the caller does not care.
+ * @param[In]  pageCount  The number of pages to allocate.
+ * @param[Out] pages      An array of at least <pageCount> entries that will receive the page addresses.
+ * @return OS_EOK if all pages were allocated, otherwise OS_EOOM and no pages are allocated.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryAllocatorAllocate(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages);
+
+/**
+ * @brief Allocates physically contiguous pages from the buddy zones of the allocator, it will
+ * try the regions from the highest one that satisfies the memory mask and downwards.
+ *
+ * @param[In]  allocator  The allocator to allocate pages from.
+ * @param[In]  memoryMask The highest physical address that can be accepted, 0 if the caller does not care.
+ * @param[In]  pageCount  The number of contiguous pages to allocate.
+ * @param[Out] pages      An array of at least <pageCount> entries that will receive the page addresses.
+ * @return OS_EOK if the pages were allocated, otherwise OS_EOOM.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryAllocatorAllocateContiguous(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages);
+
+/**
+ * @brief Returns pages to the allocator. Empty entries (0) in the array are skipped.
+ *
+ * @param[In] allocator The allocator that the pages were allocated from.
+ * @param[In] pageCount The number of entries in <pages>.
+ * @param[In] pages     The pages to free.
+ * @return OS_EOK if the pages were freed, OS_EINVALPARAMS if a page does not belong to the allocator.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryAllocatorFree(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      pageCount,
+        _In_ const uintptr_t*         pages);
+
+/**
+ * @brief Retrieves the page cache and lock statistics, summed for all regions of the allocator.
+ *
+ * @param[In]  allocator  The allocator to retrieve statistics for.
+ * @param[Out] statistics The structure to fill in.
+ */
+KERNELAPI void KERNELABI
+SystemMemoryAllocatorGetStatistics(
+        _In_  SystemMemoryAllocator_t*           allocator,
+        _Out_ SystemMemoryAllocatorStatistics_t* statistics);
+
+/**
+ * @brief Initializes the pool of zeroed pages of the allocator. The pool starts out empty,
+ * and is filled by the owner of the allocator with SystemMemoryAllocatorZeroPoolPut.
+ *
+ * @param[In] allocator The allocator to initialize the pool for.
+ * @param[In] target    The number of pages the pool should be kept at.
+ */
+KERNELAPI void KERNELABI
+SystemMemoryAllocatorInitializeZeroPool(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      target);
+
+/**
+ * @brief Changes the number of pages the pool of zeroed pages should be kept at. The target
+ * is capped at MEMORY_ZERO_POOL_CAPACITY. Lowering the target does not release any pages, those
+ * are returned by SystemMemoryAllocatorZeroPoolReclaim.
+ *
+ * @param[In] allocator The allocator to change the target for.
+ * @param[In] target    The new number of pages.
+ */
+KERNELAPI void KERNELABI
+SystemMemoryAllocatorZeroPoolSetTarget(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      target);
+
+/**
+ * @brief Returns the number of pages needed to bring the pool of zeroed pages up to its target.
+ */
+KERNELAPI int KERNELABI
+SystemMemoryAllocatorZeroPoolDeficit(
+        _In_ SystemMemoryAllocator_t* allocator);
+
+/**
+ * @brief Takes up to <pageCount> zeroed pages from the pool. Pages taken count as hits, and
+ * the pages that could not be served count as misses.
+ *
+ * @param[In]  allocator  The allocator whose pool the pages should be taken from.
+ * @param[In]  memoryMask The highest physical address that can be accepted, 0 if the caller does not care.
+ * @param[In]  pageCount  The number of pages wanted.
+ * @param[Out] pages      An array of at least <pageCount> entries that will receive the page addresses.
+ * @return The number of pages taken, which are placed first in <pages>.
+ */
+KERNELAPI int KERNELABI
+SystemMemoryAllocatorZeroPoolTake(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages);
+
+/**
+ * @brief Adds zeroed pages to the pool, the pages must already be allocated from the allocator.
+ * The pool only accepts pages up to its target.
+ *
+ * @param[In] allocator The allocator whose pool the pages should be added to.
+ * @param[In] pageCount The number of pages in <pages>.
+ * @param[In] pages     The zeroed pages.
+ * @return The number of pages that was added, starting with the first.
+ */
+KERNELAPI int KERNELABI
+SystemMemoryAllocatorZeroPoolPut(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ int                      pageCount,
+        _In_ const uintptr_t*         pages);
+
+/**
+ * @brief Removes the pages that exceed the target of the pool, so they can be freed by the caller.
+ *
+ * @param[In]  allocator The allocator whose pool should be trimmed.
+ * @param[In]  drain     Remove all pages regardless of the target, used when memory is low.
+ * @param[In]  maxPages  The maximum number of pages to remove.
+ * @param[Out] pages     An array of at least <maxPages> entries that will receive the page addresses.
+ * @return The number of pages removed.
+ */
+KERNELAPI int KERNELABI
+SystemMemoryAllocatorZeroPoolReclaim(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ bool                     drain,
+        _In_ int                      maxPages,
+        _In_ uintptr_t*               pages);
+
 /**
  * @brief
  *
@@ -123,4 +369,96 @@ SystemMemoryContainsAddress(
         _In_ SystemMemory_t* systemMemory,
         _In_ uintptr_t       address);
 
+/**
+ * @brief Adds the memory of a domain to the topology. The distance to the other domains
+ * defaults to MEMORY_DOMAIN_DISTANCE_REMOTE.
+ *
+ * @param[In] topology The topology to add the domain memory to.
+ * @param[In] memory   The memory of the domain, its allocator must be initialized.
+ * @return OS_EOK if the domain was added, OS_EOOM if the topology is full.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryTopologyAddDomain(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ SystemMemory_t*         memory);
+
+/**
+ * @brief Updates the distance between two domains, which decides the order in which
+ * the domains are used when the local domain is out of memory.
+ *
+ * @param[In] topology The topology to update.
+ * @param[In] from     The index of the domain requesting memory.
+ * @param[In] to       The index of the domain serving memory.
+ * @param[In] distance The relative distance, as reported by the ACPI SLIT.
+ */
+KERNELAPI void KERNELABI
+SystemMemoryTopologySetDistance(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     from,
+        _In_ int                     to,
+        _In_ uint8_t                 distance);
+
+/**
+ * @brief Moves the free pages of <source> that belong to a domain into the allocator
+ * of that domain. Pages outside of all domains are left in <source>.
+ *
+ * @param[In] topology The topology whose domains should receive the pages.
+ * @param[In] source   The allocator that holds the pages, usually the default allocator.
+ * @return The number of pages that was moved.
+ */
+KERNELAPI size_t KERNELABI
+SystemMemoryTopologyDistribute(
+        _In_ SystemMemoryTopology_t*  topology,
+        _In_ SystemMemoryAllocator_t* source);
+
+/**
+ * @brief Allocates pages according to the memory policy. With SystemMemoryPolicy_LOCAL the
+ * pages are taken from a single domain, the local one first. With SystemMemoryPolicy_INTERLEAVE
+ * consecutive pages are taken from consecutive domains.
+ *
+ * @param[In]  topology   The topology to allocate pages from.
+ * @param[In]  local      The memory of the domain the caller runs in, NULL if unknown.
+ * @param[In]  policy     The policy to allocate pages with.
+ * @param[In]  memoryMask The highest physical address that can be accepted, 0 if the caller does not care.
+ * @param[In]  pageCount  The number of pages to allocate.
+ * @param[Out] pages      An array of at least <pageCount> entries that will receive the page addresses.
+ * @return OS_EOK if all pages were allocated, otherwise OS_EOOM and no pages are allocated.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryTopologyAllocate(
+        _In_ SystemMemoryTopology_t*  topology,
+        _In_ SystemMemory_t*          local,
+        _In_ enum SystemMemoryPolicy  policy,
+        _In_ size_t                   memoryMask,
+        _In_ int                      pageCount,
+        _In_ uintptr_t*               pages);
+
+/**
+ * @brief Returns pages to the domains they belong to. Empty entries (0) in the array are skipped.
+ *
+ * @param[In] topology  The topology the pages were allocated from.
+ * @param[In] pageCount The number of entries in <pages>.
+ * @param[In] pages     The pages to free.
+ * @return OS_EOK if the pages were freed, OS_EINVALPARAMS if a page does not belong to any allocator.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryTopologyFree(
+        _In_ SystemMemoryTopology_t* topology,
+        _In_ int                     pageCount,
+        _In_ const uintptr_t*        pages);
+
+/**
+ * @brief Retrieves the allocation statistics of a domain.
+ *
+ * @param[In]  topology   The topology the domain belongs to.
+ * @param[In]  domain     The index of the domain.
+ * @param[Out] statistics The structure to fill in.
+ * @return OS_EOK if the statistics were retrieved, OS_EINVALPARAMS if the domain does not exist.
+ */
+KERNELAPI oserr_t KERNELABI
+SystemMemoryTopologyGetStatistics(
+        _In_  SystemMemoryTopology_t*         topology,
+        _In_  int                             domain,
+        _Out_ SystemMemoryDomainStatistics_t* statistics);
+
 #endif // !__COMPONENT_MEMORY__
@@ -38,6 +38,8 @@
 #ifdef TESTING
 #include <stdio.h>
 #define PRIxIN "zx"
+#define PRIuIN "zu"
+#define PRIiIN "zi"
 #endif
 
 // __func__ 
@@ -67,6 +69,7 @@
 #define NOTIMPLEMENTED(Message) DebugPanic(FATAL_SCOPE_KERNEL, NULL, "NOT-IMPLEMENTED: %s, line %d, %s", __FILE__, __LINE__, Message)
 #define TODO(Message)           LogAppendMessage(OSSYSLOGLEVEL_WARNING, "TODO: %s, line %d, %s", __FILE__, __LINE__, Message)
 #else //!TESTING
+#define DEBUG(...)              printf(__VA_ARGS__)
 #define WARNING(...)            printf(__VA_ARGS__)
 #define ERROR(...)              fprintf(stderr, __VA_ARGS__)
 #define FATAL(Scope, ...)       fprintf(stderr, __VA_ARGS__)
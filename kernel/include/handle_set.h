@@ -77,11 +77,14 @@ WaitForHandleSet(
         _In_  OSTimestamp_t*      deadline,
         _Out_ int*                numEventsOut);
 
+// Kernel only hint for MarkHandle, the caller is about to wait for the thread it wakes
+#define MARKHANDLE_SYNC 0x80000000U
+
 /** 
  * @brief Marks a handle that an event has been completed. If the handle has any
  * sets registered they will be notified.
  * @param handle [In] The handle upon which an event has taken place
- * @param flags  [In] The event flags that are defined in ioset.h.
+ * @param flags  [In] The event flags that are defined in ioset.h, optionally with MARKHANDLE_SYNC.
  */
 KERNELAPI oserr_t KERNELABI
 MarkHandle(
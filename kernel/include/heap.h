@@ -23,9 +23,23 @@
 #define __VALI_HEAP_H__
 
 #include <os/osdefs.h>
+#include <os/types/query.h>
 
 typedef struct MemoryCache MemoryCache_t;
 
+typedef struct MemoryCacheReapStatistics {
+    size_t PagesReclaimed;
+    size_t SlabsReclaimed;
+    size_t ObjectsDrained;
+} MemoryCacheReapStatistics_t;
+
+typedef struct MemoryCacheCpuStatistics {
+    size_t MagazineHits;    // Allocations and frees served by the per-core magazines
+    size_t MagazineMisses;  // Allocations and frees that had to use the slab layer
+    size_t DepotExchanges;
+    size_t DepotContention;
+} MemoryCacheCpuStatistics_t;
+
 // Debug options for caches
 #define HEAP_DEBUG_USE_AFTER_FREE 0x01U
 #define HEAP_DEBUG_OVERRUN        0x02U
@@ -36,11 +50,17 @@ typedef struct MemoryCache MemoryCache_t;
 #define HEAP_INITIAL_SLAB         0x10U // Set to allocate the initial slab
 #define HEAP_SINGLE_SLAB          0x20U // Set to disable multiple slabs
 #define HEAP_CACHE_USERSPACE      0x40U // Set to allow the pages to accessed by userspace
+#define HEAP_SLAB_FREELIST        0x80U // Set to track free objects with a list threaded through them
 
 // MemoryCacheInitialize
 // Initialize the default cache that is required for allocating new caches.
 void MemoryCacheInitialize(void);
 
+// MemoryCacheInitializeCpuCaches
+// Enables the per-core magazine layer for all caches, must be called once the number of
+// cores in the system is known. Caches install their per-core state on first use.
+void MemoryCacheInitializeCpuCaches(void);
+
 // MemoryCacheCreate
 // Create a new custom memory cache that can be used to allocate objects for. Can be customized
 // both with alignment, flags and constructor/destructor functionality upon creation of objects.
@@ -55,11 +75,13 @@ MemoryCacheCreate(
     _In_ void        (*ObjectDestructor)(struct MemoryCache*, void*));
 
 // MemoryCacheAllocate
-// Allocates a new object from the cache.
+// Allocates a new object from the cache. This is safe to call from interrupt context
+// as long as the per-core magazines can serve the allocation.
 void* MemoryCacheAllocate(MemoryCache_t* Cache);
 
 // MemoryCacheFree
-// Frees the given object in the cache.
+// Frees the given object in the cache. This is safe to call from interrupt context
+// as long as the per-core magazines can take the object.
 void MemoryCacheFree(MemoryCache_t* Cache, void* Object);
 
 // MemoryCacheDestroy
@@ -72,6 +94,29 @@ void MemoryCacheDestroy(MemoryCache_t* Cache);
 // to free up memory. Returns number of pages freed.
 int MemoryCacheReap(void);
 
+// MemoryCacheInitializeReaper
+// Starts the background reaper, which periodically trims free slabs from all caches
+// and drains the per-core caches when the system is low on memory.
+oserr_t MemoryCacheInitializeReaper(void);
+
+// MemoryCacheReapTrigger
+// Wakes the background reaper if the system is low on memory. Safe to call often, requests
+// are coalesced until the reaper has run.
+void MemoryCacheReapTrigger(void);
+
+// MemoryCacheGetReapStatistics
+// Retrieves the number of pages, slabs and objects that has been reclaimed from the cache.
+void MemoryCacheGetReapStatistics(MemoryCache_t* Cache, MemoryCacheReapStatistics_t* Statistics);
+
+// MemoryCacheGetCpuStatistics
+// Retrieves the usage statistics of the per-core magazines and the depot of the cache.
+void MemoryCacheGetCpuStatistics(MemoryCache_t* Cache, MemoryCacheCpuStatistics_t* Statistics);
+
+// MemoryCacheQueryStatistics
+// Fills in the usage statistics of up to <MaxEntries> caches in the system. Returns
+// the number of entries that were filled in.
+int MemoryCacheQueryStatistics(OSSystemHeapCacheInfo_t* Entries, int MaxEntries);
+
 // MemoryCacheDump
 // Dumps information about the cache and the slabs allocated for it.
 // If NULL is passed the fixed size caches will be dumped.
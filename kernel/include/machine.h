@@ -47,6 +47,7 @@ typedef struct SystemMachine {
     SystemCpu_t             Processor;      // Used in UMA mode
     MemorySpace_t           SystemSpace;    // Used in UMA mode
     SystemMemoryAllocator_t PhysicalMemory;
+    SystemMemoryTopology_t  MemoryTopology; // Routes to the domains, or PhysicalMemory in UMA mode
     
     // Global Hardware Resources
     StaticMemoryPool_t          GlobalAccessMemory;
@@ -62,7 +63,7 @@ typedef struct SystemMachine {
     _Atomic(int)                NumberOfCores;
     _Atomic(int)                NumberOfActiveCores;
     size_t                      NumberOfMemoryBlocks;
-    size_t                      NumberOfFreeMemoryBlocks;
+    _Atomic(size_t)             NumberOfFreeMemoryBlocks;
     size_t                      MemoryGranularity;
 } SystemMachine_t;
 
@@ -147,7 +148,138 @@ AllocatePhysicalMemory(
         _In_ uintptr_t* pages);
 
 /**
- * @brief
+ * @brief Tries to allocate the requested number of physically contiguous memory pages. The pages
+ * are freed with FreePhysicalMemory like any other pages.
+ *
+ * @param pageMask  [In] The allowed mask of the physical pages
+ * @param pageCount [In] The number of physical memory pages to allocate
+ * @param pages     [In] The pages allocated, in ascending order
+ * @return          The status of the operation
+ */
+KERNELAPI oserr_t KERNELABI
+AllocatePhysicalMemoryContiguous(
+        _In_ size_t     pageMask,
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages);
+
+/**
+ * @brief Tries to allocate the requested number of memory pages, spread evenly over all memory
+ * domains. This is meant for large buffers that are shared by threads on all domains.
+ *
+ * @param pageMask  [In] The allowed mask of the physical pages
+ * @param pageCount [In] The number of physical memory pages to allocate
+ * @param pages     [In] The pages allocated
+ * @return          The status of the operation
+ */
+KERNELAPI oserr_t KERNELABI
+AllocatePhysicalMemoryInterleaved(
+        _In_ size_t     pageMask,
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages);
+
+/**
+ * @brief Tries to allocate the requested number of memory pages, preferring pages that were zeroed
+ * in the background by the zero worker. The pre-zeroed pages are placed first in <pages>, and the
+ * remaining pages must be zeroed by the caller, which can do so through its own mapping of them.
+ *
+ * @param pageMask       [In]  The allowed mask of the physical pages
+ * @param pageCount      [In]  The number of physical memory pages to allocate
+ * @param pages          [In]  The pages allocated
+ * @param pagesZeroedOut [Out] The number of pages at the start of <pages> that are already zeroed
+ * @return               The status of the operation
+ */
+KERNELAPI oserr_t KERNELABI
+AllocatePhysicalMemoryZeroed(
+        _In_  size_t     pageMask,
+        _In_  int        pageCount,
+        _In_  uintptr_t* pages,
+        _Out_ int*       pagesZeroedOut);
+
+/**
+ * @brief Starts the zero worker, which keeps the zero pool of each memory domain filled while the
+ * system has memory to spare. It runs at the lowest scheduler level.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryZeroPoolInitialize(void);
+
+/**
+ * @brief Starts the compression worker, which compresses the cold pages of processes while the system
+ * is low on memory. It runs at the lowest scheduler level.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryCompressionInitialize(void);
+
+/**
+ * @brief Changes the number of zeroed pages each memory domain should keep ready. A target of 0
+ * disables the pool, and any pages above the target are given back by the zero worker.
+ *
+ * @param pageCount [In] The new target, capped at MEMORY_ZERO_POOL_CAPACITY
+ */
+KERNELAPI void KERNELABI
+MemoryZeroPoolSetTarget(
+        _In_ int pageCount);
+
+/**
+ * @brief Retrieves the combined zero pool statistics of all memory domains.
+ */
+KERNELAPI void KERNELABI
+MemoryZeroPoolGetStatistics(
+        _Out_ size_t* pagesOut,
+        _Out_ size_t* targetOut,
+        _Out_ size_t* hitsOut,
+        _Out_ size_t* missesOut);
+
+/**
+ * @brief Sets up the reference counters of the physical pages, one for each page frame up to
+ * <highestAddress>. Must be called before any pages are shared.
+ *
+ * @param highestAddress [In] The end of the highest physical memory range that can be allocated.
+ */
+KERNELAPI oserr_t KERNELABI
+PhysicalMemoryReferencesInitialize(
+        _In_ uintptr_t highestAddress);
+
+/**
+ * @brief Adds a reference to each of the physical pages, for pages that are owned by more than one
+ * mapping. Each reference is dropped again by FreePhysicalMemory, and the page is only freed when
+ * the last reference is dropped.
+ *
+ * @param pageCount [In] The number of pages in <pages>
+ * @param pages     [In] The physical pages to add a reference to
+ * @return OS_EINVALPARAMS if a page has no reference counter, in which case none were added.
+ */
+KERNELAPI oserr_t KERNELABI
+SharePhysicalMemory(
+        _In_ int              pageCount,
+        _In_ const uintptr_t* pages);
+
+/**
+ * @brief Drops a reference to a shared physical page.
+ *
+ * @param page [In] The physical page to drop a reference to
+ * @return True if the page was shared and the reference was dropped, false if the page was not shared,
+ * in which case the caller holds the only reference and must free the page.
+ */
+KERNELAPI bool KERNELABI
+UnsharePhysicalMemory(
+        _In_ uintptr_t page);
+
+/**
+ * @brief Retrieves the number of references to a physical page, which is 1 for pages that are not shared.
+ */
+KERNELAPI int KERNELABI
+GetPhysicalMemoryReferences(
+        _In_ uintptr_t page);
+
+/**
+ * @brief Retrieves the number of physical pages that currently have more than one reference.
+ */
+KERNELAPI size_t KERNELABI
+GetPhysicalMemorySharedPages(void);
+
+/**
+ * @brief Drops a reference to each of the physical pages, and frees the pages that have no references
+ * left. Pages that were never shared are freed immediately.
  *
  * @param pageCount
  * @param pages
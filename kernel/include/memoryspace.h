@@ -36,6 +36,7 @@ DECL_STRUCT(PlatformMemoryMapping);
  */
 #define MEMORY_SPACE_INHERIT            0x00000001U
 #define MEMORY_SPACE_APPLICATION        0x00000002U
+#define MEMORY_SPACE_FORK               0x00000004U  // Duplicate the calling memory space, copy-on-write
 
 /**
  * MemorySpace (Flags) Definitions
@@ -46,6 +47,15 @@ DECL_STRUCT(PlatformMemoryMapping);
  * Trap pages are purely (at this moment) to support memory fault handlers in userspace. These mappings
  * will be marked MAPPING_TRAPPAGE and thus be not handled in kernel, and instead be sent to the thread as a signal
  * of type SIGSEGV with the address as parameter.
+ *
+ * MAPPING_COPYONWRITE:
+ * Copy-on-write pages are owned by multiple mappings, and are mapped read-only in all of them. The first write
+ * to such a page gives the writer its own copy of it, or the page itself if all other owners have let go of it.
+ *
+ * MAPPING_SEQUENTIAL / MAPPING_RANDOM:
+ * Access hints for the fault-around of demand committed mappings. By default a fault commits a window of
+ * neighbouring pages, which adapts to how the mapping is accessed. Sequential mappings start out with, and keep,
+ * the largest window, and random mappings commit only the page that faulted.
  */
 #define MAPPING_USERSPACE               0x00000001U  // Userspace mapping
 #define MAPPING_NOCACHE                 0x00000002U  // Disable caching for mapping
@@ -58,9 +68,14 @@ DECL_STRUCT(PlatformMemoryMapping);
 #define MAPPING_CLEAN                   0x00000400U  // Memory should be zeroed when underlying physical pages are allocated
 #define MAPPING_STACK                   0x00000100U  // Memory resource is a stack and needs a guard page
 #define MAPPING_TRAPPAGE                0x00000200U  // Memory pages should trigger a trap
+#define MAPPING_COPYONWRITE             0x00000800U  // Memory pages are shared read-only until they are written to
+#define MAPPING_SEQUENTIAL              0x00001000U  // Memory is accessed sequentially
+#define MAPPING_RANDOM                  0x00002000U  // Memory is accessed randomly
+#define MAPPING_ISACCESSED              0x00004000U  // Memory that has been read or written since the bit was cleared
 
 #define MAPPING_PHYSICAL_FIXED          0x00000001U  // (Physical) Mappings are supplied
 #define MAPPING_PHYSICAL_CONTIGUOUS     0x00000002U  // (Physical) Mapping shall be physically contigious
+#define MAPPING_PHYSICAL_INTERLEAVED    0x00000003U  // (Physical) Mapping shall be spread over all memory domains
 #define MAPPING_PHYSICAL_MASK           0x0000000FU
 
 #define MAPPING_VIRTUAL_GLOBAL          0x00000010U  // (Virtual) Mapping is done in global access memory
@@ -69,6 +84,8 @@ DECL_STRUCT(PlatformMemoryMapping);
 #define MAPPING_VIRTUAL_FIXED           0x00000040U  // (Virtual) Mapping is supplied
 #define MAPPING_VIRTUAL_MASK            0x000000F0U
 
+#define MAPPING_PHYSICAL_ZEROED         0x00000100U  // (Physical) Allocated pages are zeroed, pages are taken from the zero pool first
+
 #define MEMORYSPACE_GET(handle) (MemorySpace_t*)LookupHandleOfType(handle, HandleTypeMemorySpace)
 
 // Addressing spaces are seperated into two layers. Because the kernel
@@ -81,6 +98,7 @@ struct MSContext;
 
 // one per thread
 typedef struct MemorySpace {
+    size_t                Id;
     uuid_t                ParentHandle;
     unsigned int          Flags;
     DynamicMemoryPool_t   ThreadMemory;
@@ -152,7 +170,8 @@ struct MemorySpaceMapOptions {
     vaddr_t VirtualStart;
     // PhysicalStart is the start of the physical memory that should be used
     // for the virtual mapping. This is only used when mapping contigious memory,
-    // otherwise <Pages> should be used instead.
+    // otherwise <Pages> should be used instead. If MAPPING_PHYSICAL_CONTIGUOUS is
+    // set together with <Pages>, then contiguous memory is allocated instead.
     paddr_t PhysicalStart;
     // Pages is a pointer to an array of physical memory pages. If MAPPING_PHYSICAL_FIXED
     // is set, then this array contains physical pages which will be supplied to the
@@ -206,7 +225,9 @@ MemorySpaceUnmap(
  * @param physicalAddressValues [In] The dma vector where the physical mappings should be provided.
  * @param size                  [In] Length that should be committed.
  * @param pageMask              [In] The accepted page mask for physical pages allocated.
- * @param placementFlags        [In] Supports MAPPING_PHYSICAL_* flags.
+ * @param placementFlags        [In] Supports MAPPING_PHYSICAL_* flags. With MAPPING_PHYSICAL_ZEROED the
+ *                                   address must be writable from the current memory space, as pages
+ *                                   that could not be taken from the zero pool are cleared through it.
  */
 KERNELAPI oserr_t KERNELABI
 MemorySpaceCommit(
@@ -257,6 +278,47 @@ MemorySpaceCloneMapping(
         _In_    unsigned int   memoryFlags,
         _In_    unsigned int   placementFlags);
 
+/**
+ * @brief Resolves a write to a copy-on-write page, by giving the memory space its own copy of the page, or
+ * the page itself if no one else owns it anymore.
+ *
+ * @param memorySpace [In] The memory space the write happened in.
+ * @param address     [In] The address that was written to.
+ * @return OS_EOK if the write can be retried.
+ */
+KERNELAPI oserr_t KERNELABI
+MemorySpaceCopyOnWrite(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address);
+
+/**
+ * @brief Duplicates all process memory of a memory space into a new memory space. Writable pages are shared
+ * copy-on-write, and the destination ends up with the same virtual memory layout as the source.
+ *
+ * @param source      [In] The memory space to duplicate.
+ * @param destination [In] The new memory space, which must have its own, empty context.
+ */
+KERNELAPI oserr_t KERNELABI
+MemorySpaceFork(
+        _In_ MemorySpace_t* source,
+        _In_ MemorySpace_t* destination);
+
+/**
+ * @brief Commits a reserved page that was accessed for the first time. For userspace mappings a window of
+ * neighbouring pages is committed with it, unless the mapping traps faults or is accessed randomly.
+ *
+ * @param memorySpace [In] The memory space the fault happened in.
+ * @param descriptor  [In] The allocation the address belongs to, or a descriptor with an invalid SHM tag and no
+ *                         attributes for memory that is not allocation tracked.
+ * @param address     [In] The address that faulted.
+ * @return OS_EOK if the access can be retried.
+ */
+KERNELAPI oserr_t KERNELABI
+MemorySpaceCommitFault(
+        _In_ MemorySpace_t*        memorySpace,
+        _In_ OSMemoryDescriptor_t* descriptor,
+        _In_ vaddr_t               address);
+
 /**
  * @brief Converts a virtual address range into the mapped physical range.
  *
@@ -324,4 +386,96 @@ KERNELAPI vaddr_t KERNELABI
 MemorySpaceSignalHandler(
         _In_ MemorySpace_t* memorySpace);
 
+/**
+ * @brief Retrieves statistics about the TLB synchronization done between cores when mappings
+ * are changed. Only cores that have the memory space loaded are interrupted, which is counted
+ * as IPIs avoided for every other active core.
+ *
+ * @param ipisSentOut    [Out] The number of synchronization IPIs sent.
+ * @param ipisAvoidedOut [Out] The number of IPIs skipped because the core did not have the memory space loaded.
+ * @param fullFlushesOut [Out] The number of synchronizations that flushed the entire TLB.
+ */
+KERNELAPI void KERNELABI
+MemorySpaceGetSyncStatistics(
+        _Out_ size_t* ipisSentOut,
+        _Out_ size_t* ipisAvoidedOut,
+        _Out_ size_t* fullFlushesOut);
+
+/**
+ * @brief Retrieves statistics about memory space switches. When the platform supports address
+ * space ids, switches can keep the TLB entries of the memory space switched to.
+ *
+ * @param switchesKeptOut    [Out] The number of switches that kept the TLB entries.
+ * @param switchesFlushedOut [Out] The number of switches that flushed the TLB entries.
+ */
+KERNELAPI void KERNELABI
+MemorySpaceGetSwitchStatistics(
+        _Out_ size_t* switchesKeptOut,
+        _Out_ size_t* switchesFlushedOut);
+
+/**
+ * @brief Retrieves statistics about copy-on-write pages.
+ *
+ * @param copiesOut      [Out] The number of writes that copied a shared page.
+ * @param reusesOut      [Out] The number of writes that took over a page no one else owned anymore.
+ * @param sharedPagesOut [Out] The number of physical pages currently owned by more than one mapping.
+ */
+KERNELAPI void KERNELABI
+MemorySpaceGetCopyOnWriteStatistics(
+        _Out_ size_t* copiesOut,
+        _Out_ size_t* reusesOut,
+        _Out_ size_t* sharedPagesOut);
+
+/**
+ * @brief Retrieves the demand fault statistics of the process the memory space belongs to.
+ *
+ * @param memorySpace    [In]  The memory space to retrieve the statistics for.
+ * @param faultsOut      [Out] The number of faults that committed memory.
+ * @param sequentialOut  [Out] The number of those faults that continued a sequential access.
+ * @param faultAroundOut [Out] The number of neighbouring pages committed ahead of being accessed.
+ */
+KERNELAPI oserr_t KERNELABI
+MemorySpaceGetFaultStatistics(
+        _In_  MemorySpace_t* memorySpace,
+        _Out_ size_t*        faultsOut,
+        _Out_ size_t*        sequentialOut,
+        _Out_ size_t*        faultAroundOut);
+
+/**
+ * @brief Scans the pages of a process for pages that have not been accessed since the previous scan, and
+ * compresses them to give their physical memory back to the system. Pages are restored when they are
+ * faulted on. The scan continues where the previous scan of the memory space stopped. Must be called from
+ * a kernel thread, as the pages are read through temporary mappings in the current memory space.
+ *
+ * @param memorySpace   [In]  The memory space to scan.
+ * @param pageCount     [In]  The number of pages to scan.
+ * @param compressedOut [Out] The number of pages that were compressed.
+ */
+KERNELAPI oserr_t KERNELABI
+MemorySpaceCompressColdPages(
+        _In_  MemorySpace_t* memorySpace,
+        _In_  int            pageCount,
+        _Out_ int*           compressedOut);
+
+/**
+ * @brief Retrieves statistics about compressed pages.
+ *
+ * @param pagesOut          [Out] The number of pages currently stored compressed.
+ * @param bytesOut          [Out] The number of bytes the compressed pages take up.
+ * @param sameFilledOut     [Out] The number of those pages that were filled with a single word, and take up no space.
+ * @param rejectedOut       [Out] The number of cold pages that were left alone, because they did not compress well.
+ * @param restoresOut       [Out] The number of pages that have been restored on a fault.
+ * @param restoreTimeOut    [Out] The total time spent restoring pages, in nanoseconds.
+ * @param restoreMaxTimeOut [Out] The longest time a single restore took, in nanoseconds.
+ */
+KERNELAPI void KERNELABI
+MemorySpaceGetCompressionStatistics(
+        _Out_ size_t*   pagesOut,
+        _Out_ size_t*   bytesOut,
+        _Out_ size_t*   sameFilledOut,
+        _Out_ size_t*   rejectedOut,
+        _Out_ size_t*   restoresOut,
+        _Out_ uint64_t* restoreTimeOut,
+        _Out_ uint64_t* restoreMaxTimeOut);
+
 #endif //!__MEMORY_SPACE_INTERFACE__
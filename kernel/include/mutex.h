@@ -35,15 +35,26 @@
 #define MUTEX_FLAG_RECURSIVE 0x1
 #define MUTEX_FLAG_TIMED     0x2
 
-typedef struct Mutex {
+typedef struct Mutex Mutex_t;
+
+// Priority inheritance state of a thread. Only mutexes that have waiters are
+// tracked in the held list, as only those can lend a priority to the owner.
+typedef struct MutexInheritance {
+    Mutex_t* BlockedOn;
+    Mutex_t* Held;
+} MutexInheritance_t;
+
+struct Mutex {
     _Atomic(unsigned int) Flags;
     _Atomic(uuid_t)       Owner;
     int                   ReferenceCount;
     list_t                BlockQueue;
     Spinlock_t            Lock;
-} Mutex_t;
+    MutexInheritance_t*   HeldBy;
+    Mutex_t*              HeldLink;
+};
 
-#define OS_MUTEX_INIT(Flags) { Flags, UUID_INVALID, 0, LIST_INIT, SPINLOCK_INIT }
+#define OS_MUTEX_INIT(Flags) { Flags, UUID_INVALID, 0, LIST_INIT, SPINLOCK_INIT, NULL, NULL }
 
 /**
  * Initializes a mutex to default values.
@@ -24,8 +24,11 @@
 #define __VALI_SCHEDULER_H__
 
 #include <os/osdefs.h>
+#include <os/types/query.h>
+#include <os/types/time.h>
 #include <spinlock.h>
 #include <time.h>
+#include <utils/timer_wheel.h>
 
 typedef struct list list_t;
 
@@ -41,7 +44,38 @@ typedef struct list list_t;
 #define SCHEDULER_TIMESLICE_STEP    (2  * NSEC_PER_MSEC)
 #define SCHEDULER_BOOST_MS          5000
 
+// Each core compares its load against the other cores in its domain at this interval,
+// and moves an object only when the difference in runnable objects is at least the
+// imbalance. Moving on a difference of one would just move the imbalance to the other core.
+// A migrated object stays on its new core for at least the cooldown.
+#define SCHEDULER_BALANCE_MS          100
+#define SCHEDULER_BALANCE_IMBALANCE   2
+#define SCHEDULER_MIGRATE_COOLDOWN_MS 1000
+#define SCHEDULER_MIGRATE_SCAN        16
+
+// Deadline objects run before any of the levels, earliest deadline first. At most
+// this share of each core can be admitted to them, so the levels always get some of it.
+// While a core has deadline objects, level objects are preempted at least every tick,
+// which bounds how long a woken deadline object waits for the core.
+#define SCHEDULER_DEADLINE_BANDWIDTH_MAX 90 // percent
+// Userspace can ask for the deadline class without any privileges, so requests through the
+// system call are only admitted while the deadline objects of the core stay within this share.
+#define SCHEDULER_DEADLINE_BANDWIDTH_USER 20 // percent
+#define SCHEDULER_DEADLINE_PERIOD_MIN    (100 * NSEC_PER_USEC)
+#define SCHEDULER_DEADLINE_PERIOD_MAX    NSEC_PER_SEC
+#define SCHEDULER_DEADLINE_TICK          NSEC_PER_MSEC
+#define SCHEDULER_DEADLINE_SCALE         (1U << 20) // Bandwidths are fractions of this
+
+// A woken object goes back to its previous core if that core is idle and the object
+// ran there recently enough for its cache to still be warm. Otherwise it is placed on
+// the waking core for sync wakeups, or on an idle core of the domain.
+#define SCHEDULER_CACHE_HOT_MS 5
+
 #define SCHEDULER_FLAG_BOUND            0x1
+#define SCHEDULER_FLAG_DEADLINE         0x2
+
+// Wakeup hints for SchedulerWakeObject
+#define SCHEDULER_WAKE_SYNC 0x1 // The waker is about to block, waiting on the woken object
 
 typedef struct SchedulerObject SchedulerObject_t;
 
@@ -56,15 +90,62 @@ typedef struct Scheduler {
     int              Enabled;
     OSTimestamp_t    LastBoost;
     Spinlock_t       SyncObject;
-    SchedulerQueue_t SleepQueue;
+    TimerWheel_t     SleepWheel;
     SchedulerQueue_t Queues[SCHEDULER_LEVEL_COUNT];
+    uint64_t         QueueBitmap; // Bit n is set while Queues[n] is non-empty
 
     // TODO bandwidth should be 64 bit, remove use of atomic here and protect
     // with a lock insteasd
     _Atomic(int)           ObjectCount;
     _Atomic(unsigned long) Bandwidth;
+
+    // Load balancing, the runnable count is the number of objects waiting in
+    // the level queues and is read by other cores.
+    _Atomic(int)    RunnableCount;
+    _Atomic(int)    StealPending;
+    OSTimestamp_t   LastBalance;
+    _Atomic(size_t) MigrationsIn;
+    _Atomic(size_t) MigrationsOut;
+    _Atomic(size_t) Steals;
+
+    // Wakeups that queued an object on this core, either from this core or from
+    // another core. Moved counts the wakeups that placed an object here that last
+    // ran on another core, those are not counted as local or remote.
+    _Atomic(size_t) WakeupsLocal;
+    _Atomic(size_t) WakeupsRemote;
+    _Atomic(size_t) WakeupsMoved;
+
+    // Deadline class. Runnable deadline objects are kept sorted by their absolute
+    // deadline, and objects that ran out of budget by the time it is replenished.
+    SchedulerQueue_t      DeadlineQueue;
+    SchedulerQueue_t      ThrottledQueue;
+    _Atomic(unsigned int) DeadlineBandwidth; // Admitted, in parts per SCHEDULER_DEADLINE_SCALE
+    _Atomic(int)          DeadlineCount;
+    _Atomic(size_t)       DeadlineThrottles;
+    _Atomic(size_t)       DeadlineMisses;
+
+    // Latency tracing, only written by the owning core. LatencyWorstMin is the
+    // index of the entry in LatencyWorst that is replaced next.
+    OSSchedulerLatencyHistogram_t LatencyHistograms[OSSCHEDULERLATENCY_COUNT];
+    OSSchedulerLatencyEvent_t     LatencyWorst[OSSCHEDULER_LATENCY_WORST];
+    int                           LatencyWorstMin;
 } Scheduler_t;
 
+typedef struct SchedulerStatistics {
+    int    RunnableCount;
+    int    ObjectCount;
+    size_t MigrationsIn;
+    size_t MigrationsOut;
+    size_t Steals; // The part of MigrationsOut that was handed to idle cores
+    size_t WakeupsLocal;
+    size_t WakeupsRemote;
+    size_t WakeupsMoved;
+    int    DeadlineCount;
+    int    DeadlineBandwidth; // In percent
+    size_t DeadlineThrottles;
+    size_t DeadlineMisses;
+} SchedulerStatistics_t;
+
 /* SchedulerCreateObject
  * Creates a new scheduling object and allocates a cpu core for the object.
  * This must be done before the kernel scheduler is used for the thread. */
@@ -85,6 +166,15 @@ KERNELAPI oserr_t KERNELABI
 SchedulerQueueObject(
     _In_ SchedulerObject_t* object);
 
+/* SchedulerWakeObject
+ * Queues up a blocked object like SchedulerQueueObject, but first places it on the
+ * core it should run on when woken. See SCHEDULER_CACHE_HOT_MS for the placement.
+ * Flags are a combination of SCHEDULER_WAKE_*. */
+KERNELAPI oserr_t KERNELABI
+SchedulerWakeObject(
+    _In_ SchedulerObject_t* object,
+    _In_ unsigned int       flags);
+
 /* SchedulerExpediteObject
  * If the given object is currently blocked, it will be unblocked and requeued
  * immediately. This function is core-safe and can be called across cores. */
@@ -142,7 +232,28 @@ SchedulerAdvance(
     _Out_ clock_t*           nextDeadlineOut);
 
 /**
- * @brief Gets the current queue priority of the object.
+ * @brief Moves the current scheduler object into the deadline class, or back to the levels.
+ * The object is admitted only if the bandwidth runtime / period fits on its core within the
+ * given limit. The new parameters take effect the next time the object is queued.
+ *
+ * @param[In] runtime      The processor time the object gets every period, in nanoseconds. 0 leaves the class.
+ * @param[In] deadline     The time from the start of a period the runtime must be received within.
+ * @param[In] period       The length of a period.
+ * @param[In] maxBandwidth The share of the core, in percent, all deadline objects on it may have
+ *                         with this one admitted. Capped at SCHEDULER_DEADLINE_BANDWIDTH_MAX.
+ * @return OS_EINVALPARAMS if the parameters are out of range, OS_EBUSY if the core cannot
+ *         admit the bandwidth. Otherwise OS_EOK.
+ */
+KERNELAPI oserr_t KERNELABI
+SchedulerSetDeadline(
+        _In_ uint64_t runtime,
+        _In_ uint64_t deadline,
+        _In_ uint64_t period,
+        _In_ int      maxBandwidth);
+
+/**
+ * @brief Gets the current queue priority of the object. This includes any
+ * queue the object has inherited.
  *
  * @param[In] object The object to read the queue of.
  * @return    The queue of the object.
@@ -151,6 +262,19 @@ KERNELAPI int KERNELABI
 SchedulerObjectGetQueue(
     _In_ SchedulerObject_t* object);
 
+/**
+ * @brief Lends a queue priority to the object, used for priority inheritance. The object
+ * runs at the better of its own queue and the inherited queue until this is called again.
+ * If the object is waiting to run, it is moved to the new queue immediately.
+ *
+ * @param[In] object The object to lend the queue to.
+ * @param[In] queue  The queue to lend, or SCHEDULER_LEVEL_COUNT to remove it again.
+ */
+KERNELAPI void KERNELABI
+SchedulerObjectSetInheritedQueue(
+    _In_ SchedulerObject_t* object,
+    _In_ int                queue);
+
 /**
  * @brief Gets the current cpu core affinity for the object.
  *
@@ -161,6 +285,42 @@ KERNELAPI uuid_t KERNELABI
 SchedulerObjectGetAffinity(
     _In_ SchedulerObject_t* object);
 
+/**
+ * @brief Retrieves the load and migration counters of the given scheduler.
+ *
+ * @param[In]  scheduler  The scheduler to read the counters of.
+ * @param[Out] statistics The counters.
+ */
+KERNELAPI void KERNELABI
+SchedulerGetStatistics(
+        _In_  Scheduler_t*           scheduler,
+        _Out_ SchedulerStatistics_t* statistics);
+
+/**
+ * @brief Retrieves the latency histograms and the worst latencies of the given scheduler.
+ * The latencies are in ticks of the performance counter.
+ *
+ * @param[In]  scheduler  The scheduler to read the latencies of.
+ * @param[Out] histograms Array of OSSCHEDULERLATENCY_COUNT histograms.
+ * @param[Out] worst      Array of OSSCHEDULER_LATENCY_WORST events.
+ */
+KERNELAPI void KERNELABI
+SchedulerGetLatencyStatistics(
+        _In_  Scheduler_t*                   scheduler,
+        _Out_ OSSchedulerLatencyHistogram_t* histograms,
+        _Out_ OSSchedulerLatencyEvent_t*     worst);
+
+/**
+ * @brief Retrieves the latency histograms of the given object.
+ *
+ * @param[In]  object     The object to read the latencies of.
+ * @param[Out] histograms Array of OSSCHEDULERLATENCY_COUNT histograms.
+ */
+KERNELAPI void KERNELABI
+SchedulerObjectGetLatencyStatistics(
+        _In_  SchedulerObject_t*             object,
+        _Out_ OSSchedulerLatencyHistogram_t* histograms);
+
 /**
  * @brief Disables scheduling for the current core. This can be used in cases where we want to
  * schedule a number of threads without being interrupted before the end.
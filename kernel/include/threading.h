@@ -75,6 +75,7 @@ typedef void(*ThreadEntry_t)(void*);
 #define THREADING_IDLE                  0x00000008U  // Mark this thread as an idle thread
 #define THREADING_INHERIT               0x00000010U  // Inherit from creator
 #define THREADING_FORKED                0x00000020U  // Thread was forked during blockage
+#define THREADING_BACKGROUND            0x00000040U  // Thread starts at the lowest scheduler level
 #define THREADING_TRANSITION_USERMODE   0x10000000U
 
 #define THREAD_GET(Handle) (Thread_t*)LookupHandleOfType(Handle, HandleTypeThread)
@@ -257,6 +258,14 @@ KERNELAPI SchedulerObject_t* KERNELABI
 ThreadSchedulerHandle(
         _In_ Thread_t* Thread);
 
+/**
+ * @param[In] thread A pointer to a thread structure
+ * @return    A pointer to the priority inheritance state of the thread
+ */
+KERNELAPI MutexInheritance_t* KERNELABI
+ThreadMutexInheritance(
+        _In_ Thread_t* thread);
+
 /**
  * @param[In] thread A pointer to a thread structure
  * @return    A pointer to the thread-specific platform data
@@ -55,6 +55,12 @@ KERNELAPI void KERNELABI
 DynamicMemoryPoolDestroy(
     _In_ DynamicMemoryPool_t* Pool);
 
+// Creates a copy of the pool with the same allocations, for duplicating address spaces
+KERNELAPI oserr_t KERNELABI
+DynamicMemoryPoolClone(
+    _In_ DynamicMemoryPool_t* Pool,
+    _In_ DynamicMemoryPool_t* Clone);
+
 KERNELAPI uintptr_t KERNELABI
 DynamicMemoryPoolAllocate(
     _In_ DynamicMemoryPool_t* Pool,
@@ -0,0 +1,107 @@
+/**
+ * Copyright 2021, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * MollenOS System Component Infrastructure
+ * - Buddy allocator for physically contiguous memory. Free blocks are
+ *   tracked with a bitmap per order, which is kept outside the memory managed.
+ */
+
+#ifndef __UTILS_MEMORYBUDDY_H__
+#define __UTILS_MEMORYBUDDY_H__
+
+#include <os/osdefs.h>
+
+// The largest block is 2^10 blocks, which is 4MB with 4KB pages
+#define MEMORY_BUDDY_MAX_ORDER 10
+
+// The number of 64 bit words needed to track <blockCount> blocks across all orders
+#define MEMORY_BUDDY_STORAGE_WORDS(blockCount) ((2 * DIVUP(blockCount, 64)) + MEMORY_BUDDY_MAX_ORDER + 1)
+
+typedef struct MemoryBuddy {
+    uintptr_t base;
+    size_t    block_size;
+    int       block_count;
+    size_t    blocks_free;
+    uint64_t* bitmaps[MEMORY_BUDDY_MAX_ORDER + 1];
+    int       free_count[MEMORY_BUDDY_MAX_ORDER + 1];
+    int       word_hint[MEMORY_BUDDY_MAX_ORDER + 1];
+} MemoryBuddy_t;
+
+/**
+ * @brief Initializes the buddy allocator to cover the range [base, base + blockCount * blockSize).
+ * The allocator starts out without any free blocks, they must be added with MemoryBuddyFree.
+ *
+ * @param buddy       The buddy allocator to initialize.
+ * @param base        The start of the range, this must be aligned to the largest block.
+ * @param blockSize   The size of the smallest block, which is the page size.
+ * @param blockCount  The number of blocks the allocator should cover.
+ * @param storage     Storage for the bitmaps, of at least MEMORY_BUDDY_STORAGE_WORDS(blockCount) words.
+ */
+KERNELAPI void KERNELABI
+MemoryBuddyConstruct(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ uintptr_t      base,
+        _In_ size_t         blockSize,
+        _In_ int            blockCount,
+        _In_ uint64_t*      storage);
+
+/**
+ * @brief Allocates <blockCount> physically contiguous blocks. The allocation is aligned to
+ * the nearest power of two above the block count, and any excess blocks are given back.
+ *
+ * @param buddy       The buddy allocator to allocate from.
+ * @param blockCount  The number of contiguous blocks to allocate.
+ * @param addressOut  The start address of the allocation.
+ * @return OS_EOK on success, OS_EOOM if there is no free range that is large enough.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryBuddyAllocate(
+        _In_  MemoryBuddy_t* buddy,
+        _In_  int            blockCount,
+        _Out_ uintptr_t*     addressOut);
+
+/**
+ * @brief Frees <blockCount> contiguous blocks starting at <address>. Any free buddies are
+ * coalesced into larger blocks. This does not need to match a previous allocation, it can
+ * also be used to add memory to the allocator.
+ *
+ * @param buddy       The buddy allocator to free to.
+ * @param address     The start address of the blocks.
+ * @param blockCount  The number of blocks to free.
+ */
+KERNELAPI void KERNELABI
+MemoryBuddyFree(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ uintptr_t      address,
+        _In_ int            blockCount);
+
+/**
+ * @brief Returns whether the address is within the range covered by the buddy allocator.
+ */
+KERNELAPI bool KERNELABI
+MemoryBuddyContains(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ uintptr_t      address);
+
+/**
+ * @brief Returns the largest order that currently has a free block, or -1 if the
+ * buddy allocator is empty.
+ */
+KERNELAPI int KERNELABI
+MemoryBuddyLargestFreeOrder(
+        _In_ MemoryBuddy_t* buddy);
+
+#endif //!__UTILS_MEMORYBUDDY_H__
@@ -0,0 +1,189 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Datastructure (Memory Range)
+ * - Allocator for ranges of virtual addresses. Allocated ranges are kept in a red-black tree
+ *   ordered by address, where every node knows the free gap in front of it and the largest
+ *   gap in its subtree. A second tree orders the same nodes by the size of their gap.
+ */
+
+#ifndef __UTILS_MEMORY_RANGE_H__
+#define __UTILS_MEMORY_RANGE_H__
+
+#include <os/osdefs.h>
+#include <spinlock.h>
+
+enum MemoryRangeFit {
+    // The lowest address the allocation fits at
+    MemoryRangeFirstFit,
+    // The smallest gap the allocation fits in, which keeps large gaps intact
+    MemoryRangeBestFit
+};
+
+typedef struct MemoryRangeLinks {
+    struct MemoryRangeNode* Parent;
+    struct MemoryRangeNode* Left;
+    struct MemoryRangeNode* Right;
+    int                     Color;
+} MemoryRangeLinks_t;
+
+typedef struct MemoryRangeNode {
+    // Links for the address tree and the gap tree
+    MemoryRangeLinks_t Links[2];
+    uintptr_t          Start;
+    size_t             Length;
+    // The free space between the previous range and this one
+    size_t             Gap;
+    // The largest gap in the subtree of the address tree
+    size_t             MaxGap;
+} MemoryRangeNode_t;
+
+typedef struct MemoryRange {
+    uintptr_t          StartAddress;
+    size_t             Length;
+    size_t             Granularity;
+    MemoryRangeNode_t* Roots[2];
+    MemoryRangeNode_t  Nil;
+    // Zero-length range at the end, which holds the gap after the last allocation
+    MemoryRangeNode_t  End;
+    int                Count;
+    size_t             BytesAllocated;
+    Spinlock_t         SyncObject;
+} MemoryRange_t;
+
+/**
+ * @brief Initializes the allocator to hand out ranges of [startAddress, startAddress + length).
+ * The allocator must not be moved in memory after this.
+ *
+ * @param range        The allocator to initialize.
+ * @param startAddress The first address that can be allocated.
+ * @param length       The length of the address range.
+ * @param granularity  Allocations are rounded up to, and aligned on, this size. Must be a power of two.
+ */
+KERNELAPI void KERNELABI
+MemoryRangeConstruct(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      startAddress,
+        _In_ size_t         length,
+        _In_ size_t         granularity);
+
+/**
+ * @brief Frees all resources of the allocator, any allocations are forgotten.
+ *
+ * @param range The allocator to destroy.
+ */
+KERNELAPI void KERNELABI
+MemoryRangeDestroy(
+        _In_ MemoryRange_t* range);
+
+/**
+ * @brief Initializes <clone> as a copy of the allocator with the same allocations, for duplicating
+ * address spaces.
+ *
+ * @param range The allocator to copy.
+ * @param clone The allocator to initialize, which must not be constructed.
+ * @return OS_EOOM if there was not enough memory for the copy, in which case <clone> is empty.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryRangeClone(
+        _In_ MemoryRange_t* range,
+        _In_ MemoryRange_t* clone);
+
+/**
+ * @brief Allocates a range of addresses anywhere in the allocator.
+ *
+ * @param range      The allocator to allocate from.
+ * @param length     The number of bytes to allocate, rounded up to the granularity.
+ * @param alignment  The alignment of the range, which must be a power of two. Alignments below
+ *                   the granularity are raised to it.
+ * @param fit        How to choose between the gaps the allocation fits in.
+ * @param addressOut The start of the allocated range.
+ * @return OS_EOOM if no gap is large enough.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryRangeAllocate(
+        _In_  MemoryRange_t*      range,
+        _In_  size_t              length,
+        _In_  size_t              alignment,
+        _In_  enum MemoryRangeFit fit,
+        _Out_ uintptr_t*          addressOut);
+
+/**
+ * @brief Allocates a specific range of addresses.
+ *
+ * @param range   The allocator to allocate from.
+ * @param address The start of the range, which must be aligned on the granularity.
+ * @param length  The number of bytes to allocate, rounded up to the granularity.
+ * @return OS_EEXISTS if any part of the range is allocated already, OS_EINVALPARAMS if the range
+ *         is not within the allocator.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryRangeReserve(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address,
+        _In_ size_t         length);
+
+/**
+ * @brief Frees a previously allocated range.
+ *
+ * @param range   The allocator the range was allocated from.
+ * @param address The start of the allocated range.
+ * @return OS_ENOENT if no allocated range starts at the address.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryRangeFree(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address);
+
+/**
+ * @brief Frees part of a previously allocated range, the rest of the range stays allocated.
+ *
+ * @param range   The allocator the range was allocated from.
+ * @param address The start of the part to free, which must be aligned on the granularity.
+ * @param length  The number of bytes to free, rounded up to the granularity.
+ * @return OS_ENOENT if the part is not within a single allocated range, OS_EOOM if the range
+ *         had to be split and there was not enough memory to do so.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryRangeRelease(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address,
+        _In_ size_t         length);
+
+/**
+ * @brief Determines whether an address is managed by the allocator, regardless of it being allocated.
+ */
+KERNELAPI bool KERNELABI
+MemoryRangeContains(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address);
+
+/**
+ * @brief Retrieves the usage of the allocator.
+ *
+ * @param range          The allocator to retrieve the usage of.
+ * @param allocationsOut The number of allocated ranges.
+ * @param bytesFreeOut   The number of bytes that are not allocated.
+ * @param largestGapOut  The size of the largest free gap.
+ */
+KERNELAPI void KERNELABI
+MemoryRangeStatistics(
+        _In_  MemoryRange_t* range,
+        _Out_ int*           allocationsOut,
+        _Out_ size_t*        bytesFreeOut,
+        _Out_ size_t*        largestGapOut);
+
+#endif //!__UTILS_MEMORY_RANGE_H__
@@ -49,6 +49,51 @@ MemoryStackConstruct(
         _In_ uintptr_t      dataAddress,
         _In_ size_t         dataSize);
 
+/**
+ * @brief Allocates storage that is twice the size of the current storage of the stack. This
+ * maps new memory, and thus must not be called while holding a lock the physical allocator
+ * may need. The storage is then installed with MemoryStackReplaceStorage.
+ *
+ * @param stack
+ * @param dataAddressOut
+ * @param dataSizeOut
+ * @return OS_EOK if the storage was allocated.
+ */
+KERNELAPI oserr_t KERNELABI
+MemoryStackAllocateStorage(
+        _In_  MemoryStack_t* stack,
+        _Out_ uintptr_t*     dataAddressOut,
+        _Out_ size_t*        dataSizeOut);
+
+/**
+ * @brief Copies the stack to the new storage and starts using it. The previous storage is
+ * returned, and must be freed with MemoryStackFreeStorage once any locks are released.
+ *
+ * @param stack
+ * @param dataAddress
+ * @param dataSize
+ * @param oldDataAddressOut
+ * @param oldDataSizeOut
+ */
+KERNELAPI void KERNELABI
+MemoryStackReplaceStorage(
+        _In_  MemoryStack_t* stack,
+        _In_  uintptr_t      dataAddress,
+        _In_  size_t         dataSize,
+        _Out_ uintptr_t*     oldDataAddressOut,
+        _Out_ size_t*        oldDataSizeOut);
+
+/**
+ * @brief Frees storage allocated by MemoryStackAllocateStorage.
+ *
+ * @param dataAddress
+ * @param dataSize
+ */
+KERNELAPI void KERNELABI
+MemoryStackFreeStorage(
+        _In_ uintptr_t dataAddress,
+        _In_ size_t    dataSize);
+
 /**
  * @brief We simply just update the address pointer. This function is only here
  * because the OS needs to relocate the stack to a virtual address instead
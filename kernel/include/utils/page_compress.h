@@ -0,0 +1,69 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Page Compression
+ * - Fast LZ77 compression of memory pages in an LZ4-like block format. Each sequence is a
+ *   token with the literal and match lengths, the literals, and a 16 bit offset to the match.
+ *   The kernel can't use libzstd_static from librt, which is built against the userspace C
+ *   runtime and needs contexts far larger than the fixed workspace used here.
+ */
+
+#ifndef __UTILS_PAGE_COMPRESS_H__
+#define __UTILS_PAGE_COMPRESS_H__
+
+#include <os/osdefs.h>
+
+// Offsets are 16 bit, so a block can at most be this large
+#define PAGE_COMPRESS_MAX_LENGTH     0x10000
+#define PAGE_COMPRESS_HASH_LOG       12
+#define PAGE_COMPRESS_WORKSPACE_SIZE ((1 << PAGE_COMPRESS_HASH_LOG) * sizeof(uint16_t))
+
+/**
+ * @brief Compresses a block of memory.
+ *
+ * @param source            The data to compress.
+ * @param length            The length of the data, at most PAGE_COMPRESS_MAX_LENGTH.
+ * @param destination       The buffer for the compressed data.
+ * @param capacity          The size of the buffer. Data that does not compress below this is rejected.
+ * @param workspace         Scratch memory of PAGE_COMPRESS_WORKSPACE_SIZE bytes.
+ * @return The length of the compressed data, or 0 if it did not fit in the buffer.
+ */
+KERNELAPI size_t KERNELABI
+PageCompress(
+        _In_ const void* source,
+        _In_ size_t      length,
+        _In_ void*       destination,
+        _In_ size_t      capacity,
+        _In_ void*       workspace);
+
+/**
+ * @brief Decompresses a block of memory compressed with PageCompress.
+ *
+ * @param source            The compressed data.
+ * @param length            The length of the compressed data.
+ * @param destination       The buffer for the decompressed data.
+ * @param destinationLength The exact length of the decompressed data.
+ * @return OS_EINVALPARAMS if the compressed data is malformed, or does not decompress to exactly
+ *         <destinationLength> bytes.
+ */
+KERNELAPI oserr_t KERNELABI
+PageDecompress(
+        _In_ const void* source,
+        _In_ size_t      length,
+        _In_ void*       destination,
+        _In_ size_t      destinationLength);
+
+#endif //!__UTILS_PAGE_COMPRESS_H__
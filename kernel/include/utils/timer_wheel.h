@@ -0,0 +1,125 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Datastructure (Timer Wheel)
+ * - Hierarchical timing wheel of intrusive entries keyed by an absolute expiry time in
+ *   ticks. Adding and removing entries is constant time, and neither allocates memory,
+ *   so the wheel can be used with interrupts disabled.
+ */
+
+#ifndef __UTILS_TIMER_WHEEL_H__
+#define __UTILS_TIMER_WHEEL_H__
+
+#include <os/osdefs.h>
+
+// Each level has 64 slots, and each slot of a level covers 64 times as many ticks as a
+// slot on the level below. With millisecond ticks the levels cover 64ms, 4s, 4min and
+// 4.6h, anything further out is parked in the top level until it comes in range.
+#define TIMER_WHEEL_LEVELS    4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS     (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct TimerWheelEntry {
+    struct TimerWheelEntry* Next;
+    struct TimerWheelEntry* Prev;
+    uint64_t                Expires;
+    // The slot the entry is queued in, or -1 if it is not queued
+    int                     Slot;
+    void*                   Value;
+} TimerWheelEntry_t;
+
+typedef struct TimerWheel {
+    // Every slot up to and including this tick has been processed
+    uint64_t           Time;
+    size_t             Count;
+    uint64_t           Occupied[TIMER_WHEEL_LEVELS];
+    TimerWheelEntry_t* Slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel_t;
+
+#define TIMER_WHEEL_ENTRY_INIT(entry, value) do { \
+        (entry)->Next    = NULL;                  \
+        (entry)->Prev    = NULL;                  \
+        (entry)->Expires = 0;                     \
+        (entry)->Slot    = -1;                    \
+        (entry)->Value   = value;                 \
+    } while (0)
+
+#define TIMER_WHEEL_ENTRY_QUEUED(entry) ((entry)->Slot != -1)
+
+/**
+ * @brief Initializes an empty wheel.
+ *
+ * @param wheel The wheel to initialize.
+ * @param time  The current time in ticks.
+ */
+KERNELAPI void KERNELABI
+TimerWheelConstruct(
+        _In_ TimerWheel_t* wheel,
+        _In_ uint64_t      time);
+
+/**
+ * @brief Queues an entry that expires at the given time. Entries that have
+ * already expired are returned by the next advance of the wheel.
+ *
+ * @param wheel   The wheel to queue the entry in.
+ * @param entry   The entry to queue, must not already be queued.
+ * @param expires The absolute time in ticks the entry expires at.
+ */
+KERNELAPI void KERNELABI
+TimerWheelAdd(
+        _In_ TimerWheel_t*      wheel,
+        _In_ TimerWheelEntry_t* entry,
+        _In_ uint64_t           expires);
+
+/**
+ * @brief Removes a queued entry from the wheel.
+ *
+ * @param wheel The wheel the entry is queued in.
+ * @param entry The entry to remove, must be queued.
+ */
+KERNELAPI void KERNELABI
+TimerWheelRemove(
+        _In_ TimerWheel_t*      wheel,
+        _In_ TimerWheelEntry_t* entry);
+
+/**
+ * @brief Moves the wheel forward to the given time, and removes every entry that
+ * has expired. The cost depends on the number of entries that expire, not on the
+ * number of entries in the wheel or the time passed.
+ *
+ * @param wheel The wheel to advance.
+ * @param time  The current time in ticks.
+ * @return The expired entries linked through Next, or NULL.
+ */
+KERNELAPI TimerWheelEntry_t* KERNELABI
+TimerWheelAdvance(
+        _In_ TimerWheel_t* wheel,
+        _In_ uint64_t      time);
+
+/**
+ * @brief Gets the time the wheel must be advanced at next. This is never later than
+ * the first expiry, but can be earlier when entries are queued in the upper levels.
+ *
+ * @param wheel     The wheel to check.
+ * @param timeOut   The time in ticks the wheel should be advanced at.
+ * @return False if the wheel is empty.
+ */
+KERNELAPI bool KERNELABI
+TimerWheelNext(
+        _In_  TimerWheel_t* wheel,
+        _Out_ uint64_t*     timeOut);
+
+#endif //!__UTILS_TIMER_WHEEL_H__
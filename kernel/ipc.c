@@ -100,7 +100,10 @@ SendMessage(
 {
     TRACE("SendMessage()");
     streambuffer_write_packet_end(packetCtx);
-    MarkHandle(streamID, IOSETIN);
+
+    // Messages are mostly requests the sender waits for the reply of, so let
+    // the receiver run on the core of the sender.
+    MarkHandle(streamID, IOSETIN | MARKHANDLE_SYNC);
 }
 
 oserr_t
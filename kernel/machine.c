@@ -37,6 +37,7 @@
 #include <futex.h>
 #include <handle.h>
 #include <handle_set.h>
+#include <heap.h>
 #include <hpet.h>
 #include <interrupts.h>
 #include <scheduler.h>
@@ -49,6 +50,7 @@ extern void SpawnBootstrapper(void);
 static SystemMachine_t g_machine = {
     { 0 }, { 0 }, { 0 },                        // Strings
     { 0 }, SYSTEM_CPU_INIT, { 0 }, { 0 },              // BootInformation, Processor, MemorySpace, PhysicalMemory
+    { 0, { NULL }, { { 0 } }, { { 0 } }, &g_machine.PhysicalMemory, 0 }, // MemoryTopology
     { 0 }, { { 0 } }, LIST_INIT, // GAMemory, Memory Map, SystemDomains
     NULL, 0, NULL,                                     // InterruptControllers
     SYSTEM_TIMERS_INIT,                                     // SystemTimers
@@ -140,6 +142,34 @@ InitializeMachine(
     SetMachineUmaMode();
 #endif
 
+    // Move the free memory of each NUMA domain to the domain, so pages can be
+    // served from the domain of the core that asks for them.
+    if (GetMachine()->MemoryTopology.DomainCount) {
+        size_t pagesMoved = SystemMemoryTopologyDistribute(
+                &GetMachine()->MemoryTopology,
+                &GetMachine()->PhysicalMemory
+        );
+        TRACE("InitializeMachine moved %" PRIuIN " pages to %i domains",
+              pagesMoved, GetMachine()->MemoryTopology.DomainCount);
+    }
+
+    // The topology is known now, so the heap and the physical memory
+    // allocator can size their per-core caches
+    MemoryCacheInitializeCpuCaches();
+    oserr = SystemMemoryAllocatorInitializePageCaches(
+            &GetMachine()->PhysicalMemory,
+            (int)atomic_load(&GetMachine()->NumberOfCores)
+    );
+    for (int i = 0; i < GetMachine()->MemoryTopology.DomainCount && oserr == OS_EOK; i++) {
+        oserr = SystemMemoryAllocatorInitializePageCaches(
+                &GetMachine()->MemoryTopology.Domains[i]->Allocator,
+                (int)atomic_load(&GetMachine()->NumberOfCores)
+        );
+    }
+    if (oserr != OS_EOK) {
+        WARNING("InitializeMachine failed to initialize the per-core page caches, continuing without");
+    }
+
     // Create the rest of the OS systems
     LogInitializeFull();
     oserr = InitializeHandles();
@@ -201,6 +231,30 @@ InitializeMachine(
         ArchProcessorHalt();
     }
 
+    // The heap reaper gives unused slab memory back to the system, and is woken by the
+    // physical memory allocator when the system is running low on memory.
+    oserr = MemoryCacheInitializeReaper();
+    if (oserr != OS_EOK) {
+        ERROR("Failed to initialize heap reaper.");
+        ArchProcessorHalt();
+    }
+
+    // The zero worker keeps a pool of zeroed pages ready for page faults and clean
+    // mappings. The system works without it, it just has to zero pages on demand.
+    oserr = MemoryZeroPoolInitialize();
+    if (oserr != OS_EOK) {
+        WARNING("InitializeMachine failed to start the zero worker, continuing without");
+    }
+
+#ifdef __OSCONFIG_COMPRESSED_MEMORY
+    // The compression worker compresses the cold pages of processes when the system runs
+    // low on memory, it must be started before any processes are created.
+    oserr = MemoryCompressionInitialize();
+    if (oserr != OS_EOK) {
+        WARNING("InitializeMachine failed to start the compression worker, continuing without");
+    }
+#endif
+
     // Perform the full acpi initialization sequence. This should not be a part of the kernel
     // and should be a seperate driver module. We only need the table-parsing capability of ACPICA in
     // the kernel to discover system metrics/configuration, but the entire ACPICA initialization should
@@ -236,88 +290,120 @@ InitializeMachine(
     }
 }
 
+static SystemMemory_t*
+__GetLocalMemory(void)
+{
+    SystemDomain_t* domain = GetCurrentDomain();
+    if (domain == NULL) {
+        return NULL;
+    }
+    return &domain->Memory;
+}
+
 oserr_t
 AllocatePhysicalMemory(
         _In_ size_t     pageMask,
         _In_ int        pageCount,
         _In_ uintptr_t* pages)
 {
-    SystemMemoryAllocatorRegion_t* region;
-    oserr_t                        oserr;
-    int                            pagesLeftToAllocate = pageCount;
-    int                            i = GetMachine()->PhysicalMemory.MaskCount - 1;
-
-    // default to the highest allocator
-    region = &GetMachine()->PhysicalMemory.Region[i];
-    while (pagesLeftToAllocate > 0 && i >= 0) {
-        int pagesAllocated = pagesLeftToAllocate;
-
-        // make sure pagemask is correct if one is provided
-        if (pageMask) {
-            if (pageMask < GetMachine()->PhysicalMemory.Masks[i]) {
-                region = &GetMachine()->PhysicalMemory.Region[--i];
-                continue;
-            }
-        }
+    oserr_t oserr;
 
-        // try to allocate all neccessary pages from this memory mask allocator
-        SpinlockAcquireIrq(&region->Lock);
-        oserr = MemoryStackPop(&region->Stack, &pagesAllocated, pages);
-        SpinlockReleaseIrq(&region->Lock);
+    oserr = SystemMemoryTopologyAllocate(
+            &GetMachine()->MemoryTopology,
+            __GetLocalMemory(),
+            SystemMemoryPolicy_LOCAL,
+            pageMask,
+            pageCount,
+            pages
+    );
+    if (oserr == OS_EOK) {
+        atomic_fetch_sub(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)pageCount);
+    }
 
-        // if it returns out of memory, then no pages are available here
-        if (oserr != OS_EOOM) {
-            // otherwise, we subtract the number of pages allocated from this
-            pagesLeftToAllocate -= pagesAllocated;
-        }
+    // Let the heap give back memory before we run dry
+    MemoryCacheReapTrigger();
+    return oserr;
+}
 
-        // go to next allocator
-        region = &GetMachine()->PhysicalMemory.Region[--i];
+oserr_t
+AllocatePhysicalMemoryInterleaved(
+        _In_ size_t     pageMask,
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages)
+{
+    oserr_t oserr;
+
+    oserr = SystemMemoryTopologyAllocate(
+            &GetMachine()->MemoryTopology,
+            __GetLocalMemory(),
+            SystemMemoryPolicy_INTERLEAVE,
+            pageMask,
+            pageCount,
+            pages
+    );
+    if (oserr == OS_EOK) {
+        atomic_fetch_sub(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)pageCount);
     }
 
+    MemoryCacheReapTrigger();
+    return oserr;
+}
+
+oserr_t
+AllocatePhysicalMemoryContiguous(
+        _In_ size_t     pageMask,
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages)
+{
+    oserr_t oserr;
+
+    oserr = SystemMemoryAllocatorAllocateContiguous(&GetMachine()->PhysicalMemory, pageMask, pageCount, pages);
     if (oserr == OS_EOK) {
-        GetMachine()->NumberOfFreeMemoryBlocks -= (size_t)pageCount;
+        atomic_fetch_sub(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)pageCount);
     }
     return oserr;
 }
 
-void
-FreePhysicalMemory(
+static void
+__FreePhysicalPages(
         _In_ int              pageCount,
         _In_ const uintptr_t* pages)
 {
-    SystemMemoryAllocatorRegion_t* region = NULL;
-    int                            i;
-
-    for (i = 0; i < pageCount; i++) {
-        uintptr_t address = pages[i];
-        if (address == 0) {
-            // Let's be OK with partially filled lists
-            continue;
-        }
+    oserr_t oserr;
 
-        for (int j = 0; j < GetMachine()->PhysicalMemory.MaskCount; j++) {
-            if (address < GetMachine()->PhysicalMemory.Masks[j]) {
-                region = &GetMachine()->PhysicalMemory.Region[j];
-                break;
-            }
-        }
+    if (!pageCount) {
+        return;
+    }
 
-        if (region == NULL) {
-            // Tring to free an invalid address
-            ERROR("FreePhysicalMemory tried to free an invalid page");
-            ERROR("FreePhysicalMemory pageCount=%i, i=%i", pageCount, i);
-            ERROR("FreePhysicalMemory PAGES:");
-            for (int j = 0; j < pageCount; j++) {
-                ERROR("FreePhysicalMemory 0x%llx", pages[j]);
-            }
-            assert(0);
+    oserr = SystemMemoryTopologyFree(&GetMachine()->MemoryTopology, pageCount, pages);
+    if (oserr != OS_EOK) {
+        // Tring to free an invalid address
+        ERROR("FreePhysicalMemory tried to free an invalid page");
+        ERROR("FreePhysicalMemory pageCount=%i", pageCount);
+        ERROR("FreePhysicalMemory PAGES:");
+        for (int j = 0; j < pageCount; j++) {
+            ERROR("FreePhysicalMemory 0x%llx", pages[j]);
         }
-
-        SpinlockAcquireIrq(&region->Lock);
-        MemoryStackPush(&region->Stack, address, 1);
-        SpinlockReleaseIrq(&region->Lock);
+        assert(0);
     }
 
-    GetMachine()->NumberOfFreeMemoryBlocks += (size_t)pageCount;
+    atomic_fetch_add(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)pageCount);
+}
+
+void
+FreePhysicalMemory(
+        _In_ int              pageCount,
+        _In_ const uintptr_t* pages)
+{
+    int start = 0;
+
+    // Pages that are still referenced by other mappings stay allocated, free
+    // the runs of pages in between them.
+    for (int i = 0; i < pageCount; i++) {
+        if (UnsharePhysicalMemory(pages[i])) {
+            __FreePhysicalPages(i - start, &pages[start]);
+            start = i + 1;
+        }
+    }
+    __FreePhysicalPages(pageCount - start, &pages[start]);
 }
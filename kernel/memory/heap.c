@@ -23,39 +23,109 @@
 #define __MODULE "HEAP"
 //#define __TRACE
 
+#define __need_minmax
+#include <arch/interrupts.h>
 #include <arch/utils.h>
 #include <assert.h>
 #include <debug.h>
 #include <ds/list.h>
+#include <ds/rbtree.h>
+#include <futex.h>
 #include <heap.h>
 #include <mutex.h>
 #include <memoryspace.h>
 #include <machine.h>
 #include <string.h>
+#include <threading.h>
 
 #define MEMORY_OVERRUN_PATTERN                      0xA5A5A5A5U
 #define MEMORY_SLAB_ONSITE_THRESHOLD                512
-#define MEMORY_ATOMIC_CACHE(Cache, Core)            (MemoryAtomicCache_t*)((Cache)->AtomicCaches + ((Core) * (sizeof(MemoryAtomicCache_t) + ((Cache)->ObjectCount * sizeof(void*)))))
-#define MEMORY_ATOMIC_ELEMENT(AtomicCache, Element) ((uintptr_t**)((uintptr_t)(AtomicCache) + sizeof(MemoryAtomicCache_t) + ((Element) * sizeof(void*))))
 #define MEMORY_SLAB_ELEMENT(Cache, Slab, Element)   (void*)((uintptr_t)(Slab)->Address + ((Element) * ((Cache)->ObjectSize + (Cache)->ObjectPadding)))
+#define MEMORY_SLAB_BITMAP_WORDS(ObjectCount)       (((ObjectCount) + 63) / 64)
+
+// The per-core state of each cache is kept on separate cache lines, so cores
+// never share lines when they use their magazines.
+#define MEMORY_CPU_CACHE_STRIDE                     64
+#define MEMORY_CPU_CACHE(Cache, Core)               ((MemoryCpuCache_t*)((Cache)->CpuCaches + ((Core) * MEMORY_CPU_CACHE_STRIDE)))
+#define MEMORY_MAGAZINE_MAX_ROUNDS                  32
+
+#define MEMORY_CPU_CACHES_NONE       0
+#define MEMORY_CPU_CACHES_INSTALLING 1
+#define MEMORY_CPU_CACHES_READY      2
+
+// The reaper runs periodically, where it only trims caches down to their free slab
+// watermark. When memory is low it is woken immediately, and caches are drained fully.
+#define MEMORY_REAP_INTERVAL_MS    5000
+#define MEMORY_REAP_FREE_WATERMARK 1
+#define MEMORY_REAP_DRAIN_TIMEOUT  1000
+
+// Allocations above the threshold do not go through the fixed size caches, they get their own
+// virtual range that is backed by (non-contiguous) pages. The pages are committed in batches.
+#define MEMORY_LARGE_THRESHOLD     65536
+#define MEMORY_LARGE_COMMIT_BATCH  64
 
 // Slab size is equal to a page size, and memory layout of a slab is as below
 // FreeBitmap | Object | Object | Object |
+// The bitmap is scanned a word at a time, starting from the first word that may have
+// a free object. Caches with HEAP_SLAB_FREELIST instead thread a list through the free objects.
 typedef struct MemorySlab {
-    element_t  Header;
-    int        NumberOfFreeObjects;
-    uintptr_t* Address;  // Points to first object
-    uint8_t*   FreeBitmap;
+    element_t           Header;
+    struct MemoryCache* Cache;
+    int                 NumberOfFreeObjects;
+    int                 FirstFreeWord;
+    uintptr_t*          Address;  // Points to first object
+    void*               FreeList;
+    uint64_t*           FreeBitmap;
 } MemorySlab_t;
 
-// Memory Atomic Cache is followed directly by the buffer area for pointers
-// MemoryAtomicCache_t | Pointer | Pointer | Pointer | Pointer | MemoryAtomicCache_t ...
-typedef struct MemoryAtomicCache {
-    _Atomic(int) Available;
-    int          Limit;
-} MemoryAtomicCache_t;
+// The slab map is a two-level page-indexed table that covers the global access
+// memory region, which is where all slab memory is allocated from. Each leaf is a
+// single page of slab pointers, and leafs are only allocated once a slab is created
+// in the range they cover. This allows us to go from any object address to the owning
+// slab (and thus cache) in constant time.
+typedef struct MemorySlabMap {
+    _Atomic(uintptr_t) Directory;
+    size_t             DirectoryCount;
+    size_t             LeafCount;
+} MemorySlabMap_t;
+
+// A magazine holds a number of constructed objects (rounds) of a single cache, and
+// is the unit that is exchanged between the cores and the depot.
+typedef struct MemoryMagazine {
+    struct MemoryMagazine* Link;
+    int                    Rounds;
+    void*                  Objects[MEMORY_MAGAZINE_MAX_ROUNDS];
+} MemoryMagazine_t;
+
+// Each core has a loaded and a previous magazine per cache. The previous magazine absorbs
+// alternating allocations and frees, so we don't thrash the depot at magazine boundaries.
+// The per-core state is only ever touched by its own core with interrupts disabled, this
+// includes the counters which are summed up when read.
+typedef struct MemoryCpuCache {
+    MemoryMagazine_t* Loaded;
+    MemoryMagazine_t* Previous;
+    size_t            Allocations;
+    size_t            Frees;
+    size_t            Misses;
+} MemoryCpuCache_t;
+
+// The depot holds the magazines not loaded on any core. Magazines that contain rounds
+// are kept on the full list, the rest on the empty list. The lowest count of each list
+// since the last reap is the part of the depot that was not needed, and can be reclaimed.
+typedef struct MemoryDepot {
+    Spinlock_t        Lock;
+    MemoryMagazine_t* Full;
+    MemoryMagazine_t* Empty;
+    int               FullCount;
+    int               EmptyCount;
+    int               FullMinimum;
+    int               EmptyMinimum;
+    size_t            Exchanges;
+    size_t            Contention;
+} MemoryDepot_t;
 
 typedef struct MemoryCache {
+    element_t        Header;
     const char*      Name;
     Mutex_t          SyncObject;
     unsigned int     Flags;
@@ -75,11 +145,38 @@ typedef struct MemoryCache {
     list_t           PartialSlabs;
     list_t           FullSlabs;
 
-    uintptr_t        AtomicCaches;
+    uintptr_t        CpuCaches;
+    int              CpuCacheCount;
+    _Atomic(int)     CpuCacheState;
+    int              MagazineSize;
+    MemoryDepot_t    Depot;
+
+    // Number of free slabs the reaper will leave alone when
+    // there is no memory pressure
+    int              FreeSlabWatermark;
+    size_t           PagesReclaimed;
+    size_t           SlabsReclaimed;
+    size_t           ObjectsDrained;
+
+    // Usage of the slab layer, protected by the cache lock. The peak is the
+    // highest number of objects that has been taken out of the slabs at once.
+    int              SlabCount;
+    uint64_t         SlabAllocations;
+    uint64_t         SlabFrees;
+    size_t           PeakObjects;
 } MemoryCache_t;
 
+// A large allocation, the leaf is keyed by the address of the allocation
+typedef struct MemoryLargeAllocation {
+    rb_leaf_t Header;
+    size_t    Size;
+    int       PageCount;
+} MemoryLargeAllocation_t;
+
 // All the standard caches DO not use contigious memory
-static MemoryCache_t g_initialCache = { 0 };
+static MemoryCache_t g_initialCache  = { 0 };
+static MemoryCache_t g_magazineCache = { 0 };
+static int           g_cpuCacheCount = 0;
 static struct FixedCache {
     size_t         ObjectSize;
     const char*    Name;
@@ -98,11 +195,28 @@ static struct FixedCache {
     { 16384,  "size16384_cache",  NULL, HEAP_CACHE_DEFAULT },
     { 32768,  "size32768_cache",  NULL, HEAP_CACHE_DEFAULT },
     { 65536,  "size65536_cache",  NULL, HEAP_CACHE_DEFAULT },
-    { 131072, "size131072_cache", NULL, HEAP_CACHE_DEFAULT },
-    { 262144, "size262144_cache", NULL, HEAP_CACHE_DEFAULT },
     { 0,      NULL,               NULL, 0 }
 };
 
+static MemorySlabMap_t g_slabMap = { 0 };
+
+// All caches in the system are registered here, so the reaper can find them. The
+// reap lock is held for the duration of a reap, and when caches are destroyed.
+static list_t       g_caches;
+static Mutex_t      g_reapLock;
+static _Atomic(int) g_reapRequests = 0;
+static uuid_t       g_reaperHandle = UUID_INVALID;
+
+// Large allocations are tracked in their own tree, so kfree can find them when the
+// address is not owned by a slab. The statistics are protected by the same lock.
+static rb_tree_t g_largeAllocations;
+static Mutex_t   g_largeLock;
+static uint64_t  g_largeAllocationCount = 0;
+static uint64_t  g_largeFreeCount       = 0;
+static size_t    g_largePagesInUse      = 0;
+static size_t    g_largeBytesInUse      = 0;
+static size_t    g_largePeakCount       = 0;
+
 static uintptr_t
 __AllocateVirtualPages(
     _In_ int          pageCount,
@@ -149,6 +263,108 @@ __FreeVirtualPages(
     }
 }
 
+static _Atomic(uintptr_t)*
+__SlabMapDirectory(void)
+{
+    size_t    pageSize  = GetMemorySpacePageSize();
+    uintptr_t directory = atomic_load(&g_slabMap.Directory);
+    uintptr_t expected  = 0;
+    int       pageCount;
+
+    if (directory) {
+        return (_Atomic(uintptr_t)*)directory;
+    }
+
+    g_slabMap.LeafCount      = pageSize / sizeof(MemorySlab_t*);
+    g_slabMap.DirectoryCount = DIVUP(GetMachine()->MemoryMap.Shared.Length, g_slabMap.LeafCount * pageSize);
+    pageCount = (int)DIVUP(g_slabMap.DirectoryCount * sizeof(uintptr_t), pageSize);
+    directory = __AllocateVirtualPages(pageCount, 0);
+    if (!directory) {
+        return NULL;
+    }
+    memset((void*)directory, 0, pageCount * pageSize);
+
+    // Install the directory, if someone beat us to it, then use theirs instead
+    if (!atomic_compare_exchange_strong(&g_slabMap.Directory, &expected, directory)) {
+        __FreeVirtualPages(directory, pageCount);
+        directory = expected;
+    }
+    return (_Atomic(uintptr_t)*)directory;
+}
+
+static MemorySlab_t**
+__SlabMapLeaf(
+        _In_ uintptr_t address,
+        _In_ int       create)
+{
+    size_t              pageSize = GetMemorySpacePageSize();
+    uintptr_t           base     = GetMachine()->MemoryMap.Shared.Start;
+    _Atomic(uintptr_t)* directory;
+    uintptr_t           expected = 0;
+    uintptr_t           leaf;
+    size_t              index;
+
+    if (address < base || address >= (base + GetMachine()->MemoryMap.Shared.Length)) {
+        return NULL;
+    }
+
+    directory = create ? __SlabMapDirectory() : (_Atomic(uintptr_t)*)atomic_load(&g_slabMap.Directory);
+    if (directory == NULL) {
+        return NULL;
+    }
+
+    index = ((address - base) / pageSize) / g_slabMap.LeafCount;
+    leaf  = atomic_load(&directory[index]);
+    if (!leaf && create) {
+        leaf = __AllocateVirtualPages(1, 0);
+        if (!leaf) {
+            return NULL;
+        }
+        memset((void*)leaf, 0, pageSize);
+
+        if (!atomic_compare_exchange_strong(&directory[index], &expected, leaf)) {
+            __FreeVirtualPages(leaf, 1);
+            leaf = expected;
+        }
+    }
+    return (MemorySlab_t**)leaf;
+}
+
+static oserr_t
+__SlabMapUpdate(
+        _In_ uintptr_t     address,
+        _In_ int           pageCount,
+        _In_ MemorySlab_t* slab)
+{
+    size_t    pageSize = GetMemorySpacePageSize();
+    uintptr_t base     = GetMachine()->MemoryMap.Shared.Start;
+    int       i;
+
+    for (i = 0; i < pageCount; i++, address += pageSize) {
+        MemorySlab_t** leaf = __SlabMapLeaf(address, slab != NULL);
+        if (leaf == NULL) {
+            if (slab == NULL) {
+                continue;
+            }
+            return OS_EOOM;
+        }
+        leaf[((address - base) / pageSize) % g_slabMap.LeafCount] = slab;
+    }
+    return OS_EOK;
+}
+
+static inline MemorySlab_t*
+__SlabMapLookup(
+        _In_ uintptr_t address)
+{
+    size_t         pageSize = GetMemorySpacePageSize();
+    MemorySlab_t** leaf     = __SlabMapLeaf(address, 0);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return leaf[((address - GetMachine()->MemoryMap.Shared.Start) / pageSize) % g_slabMap.LeafCount];
+}
+
 static inline struct FixedCache*
 __CacheFindFixedSize(
     _In_ size_t size)
@@ -172,17 +388,31 @@ __SlabAllocateIndex(
     _In_ MemoryCache_t* Cache,
     _In_ MemorySlab_t*  Slab)
 {
+    int Words = MEMORY_SLAB_BITMAP_WORDS(Cache->ObjectCount);
     int i;
     
     assert(Slab->NumberOfFreeObjects <= Cache->ObjectCount);
-    for (i = 0; i < (int)Cache->ObjectCount; i++) {
-        unsigned Block  = i / 8;
-        unsigned Offset = i % 8;
-        uint8_t  Bit    = (1u << Offset);
-        if (!(Slab->FreeBitmap[Block] & Bit)) {
-            Slab->FreeBitmap[Block] |= Bit;
+    if (!Slab->NumberOfFreeObjects) {
+        return -1;
+    }
+
+    if (Cache->Flags & HEAP_SLAB_FREELIST) {
+        uintptr_t Object = (uintptr_t)Slab->FreeList;
+        Slab->FreeList = *((void**)Object);
+        Slab->NumberOfFreeObjects--;
+        return (int)((Object - (uintptr_t)Slab->Address) / (Cache->ObjectSize + Cache->ObjectPadding));
+    }
+
+    // Words before the first free word are known to be full, and the bits
+    // after the last object are always set, so the first clear bit is ours.
+    for (i = Slab->FirstFreeWord; i < Words; i++) {
+        uint64_t Word = Slab->FreeBitmap[i];
+        if (Word != UINT64_MAX) {
+            int Bit = __builtin_ctzll(~Word);
+            Slab->FreeBitmap[i]  = Word | (1ULL << Bit);
+            Slab->FirstFreeWord  = i;
             Slab->NumberOfFreeObjects--;
-            return i;
+            return (i * 64) + Bit;
         }
     }
     return -1;
@@ -194,14 +424,25 @@ __SlabFreeIndex(
     _In_ MemorySlab_t*  Slab,
     _In_ int            Index)
 {
-    unsigned Block  = Index / 8;
-    unsigned Offset = Index % 8;
-    uint8_t  Bit    = (1u << Offset);
+    int      Word = Index / 64;
+    uint64_t Bit  = 1ULL << (Index % 64);
     assert(Slab->NumberOfFreeObjects < Cache->ObjectCount);
-    if (Index < (int)Cache->ObjectCount) {
-        Slab->FreeBitmap[Block] &= ~(Bit);
-        Slab->NumberOfFreeObjects++;
+    if (Index >= (int)Cache->ObjectCount) {
+        return;
     }
+
+    if (Cache->Flags & HEAP_SLAB_FREELIST) {
+        void** Object = MEMORY_SLAB_ELEMENT(Cache, Slab, Index);
+        *Object        = Slab->FreeList;
+        Slab->FreeList = Object;
+    } else {
+        assert(Slab->FreeBitmap[Word] & Bit);
+        Slab->FreeBitmap[Word] &= ~Bit;
+        if (Word < Slab->FirstFreeWord) {
+            Slab->FirstFreeWord = Word;
+        }
+    }
+    Slab->NumberOfFreeObjects++;
 }
 
 static int
@@ -239,6 +480,20 @@ __SlabInitalizeObjects(MemoryCache_t* Cache, MemorySlab_t* Slab)
         }
         Address += Cache->ObjectPadding;
     }
+
+    // Mark the bits after the last object as allocated, so they are never handed out
+    if (Cache->ObjectCount % 64) {
+        Slab->FreeBitmap[MEMORY_SLAB_BITMAP_WORDS(Cache->ObjectCount) - 1] = UINT64_MAX << (Cache->ObjectCount % 64);
+    }
+
+    // Thread the freelist through the objects in reverse, so the lowest object is handed out first
+    if (Cache->Flags & HEAP_SLAB_FREELIST) {
+        for (i = Cache->ObjectCount - 1; i >= 0; i--) {
+            void** Object  = MEMORY_SLAB_ELEMENT(Cache, Slab, i);
+            *Object        = Slab->FreeList;
+            Slab->FreeList = Object;
+        }
+    }
 }
 
 static void 
@@ -283,7 +538,7 @@ __SlabCreate(
         if (cache->Flags & HEAP_CACHE_DEFAULT) {
             struct FixedCache* Fixed = __CacheFindFixedSize(cache->SlabStructureSize);
             if (Fixed->ObjectSize == cache->ObjectSize) {
-                FATAL(FATAL_SCOPE_KERNEL, "Recursive allocation %u for default cache %u",
+                FATAL(FATAL_SCOPE_KERNEL, "Recursive allocation %" PRIuIN " for default cache %" PRIuIN "",
                       cache->SlabStructureSize, cache->ObjectSize);
             }
         }
@@ -305,10 +560,25 @@ __SlabCreate(
     memset(slab, 0, cache->SlabStructureSize);
 
     ELEMENT_INIT(&slab->Header, 0, slab);
+    slab->Cache               = cache;
     slab->NumberOfFreeObjects = cache->ObjectCount;
-    slab->FreeBitmap          = (uint8_t*)((uintptr_t)slab + sizeof(MemorySlab_t));
+    slab->FreeBitmap          = (uint64_t*)((uintptr_t)slab + sizeof(MemorySlab_t));
     slab->Address             = (uintptr_t*)objectAddress;
+
+    // Register the slab pages in the slab map, so we can resolve objects
+    // back to the slab without having to search for it.
+    if (__SlabMapUpdate(dataAddress, cache->PageCount, slab) != OS_EOK) {
+        ERROR("[heap] [__SlabCreate] failed to register slab in the slab map");
+        __SlabMapUpdate(dataAddress, cache->PageCount, NULL);
+        if (!cache->SlabOnSite) {
+            kfree(slab);
+        }
+        __FreeVirtualPages(dataAddress, cache->PageCount);
+        return NULL;
+    }
+
     __SlabInitalizeObjects(cache, slab);
+    cache->SlabCount++;
     return slab;
 }
 
@@ -318,15 +588,27 @@ __SlabDestroy(
     _In_ MemorySlab_t*  Slab)
 {
     __SlabDestroyObjects(Cache, Slab);
+    Cache->SlabCount--;
     if (!Cache->SlabOnSite) {
+        __SlabMapUpdate((uintptr_t)Slab->Address, Cache->PageCount, NULL);
         __FreeVirtualPages((uintptr_t) Slab->Address, Cache->PageCount);
         kfree(Slab);
     }
     else {
+        __SlabMapUpdate((uintptr_t)Slab, Cache->PageCount, NULL);
         __FreeVirtualPages((uintptr_t) Slab, Cache->PageCount);
     }
 }
 
+// Returns the number of objects taken out of the slabs, this includes the
+// objects that are resting in the magazines. The cache lock must be held.
+static inline size_t
+__CacheObjectsInUse(
+    _In_ MemoryCache_t* Cache)
+{
+    return ((size_t)Cache->SlabCount * Cache->ObjectCount) - Cache->NumberOfFreeObjects;
+}
+
 static void
 __SlabDumpInformation(
     _In_ MemoryCache_t* cache,
@@ -336,7 +618,7 @@ __SlabDumpInformation(
     uintptr_t EndAddress   = StartAddress + (cache->ObjectCount * (cache->ObjectSize + cache->ObjectPadding));
     
     // Write slab information
-    DEBUG(" -- slab: 0x%" PRIxIN " => 0x%" PRIxIN ", FreeObjects %" PRIuIN "", StartAddress, EndAddress, slab->NumberOfFreeObjects);
+    DEBUG(" -- slab: 0x%" PRIxIN " => 0x%" PRIxIN ", FreeObjects %i", StartAddress, EndAddress, slab->NumberOfFreeObjects);
 }
 
 static void
@@ -346,9 +628,18 @@ __CacheDumpInformation(
     element_t* i;
     
     // Write cache information
-    DEBUG("%s: Object Size %" PRIuIN ", Alignment %" PRIuIN ", Padding %" PRIuIN ", Count %" PRIuIN ", FreeObjects %" PRIuIN "",
+    DEBUG("%s: Object Size %" PRIuIN ", Alignment %" PRIuIN ", Padding %" PRIuIN ", Count %i, FreeObjects %i",
           cache->Name, cache->ObjectSize, cache->ObjectAlignment, cache->ObjectPadding,
           cache->ObjectCount, cache->NumberOfFreeObjects);
+    if (atomic_load(&cache->CpuCacheState) == MEMORY_CPU_CACHES_READY) {
+        MemoryCacheCpuStatistics_t stats;
+        MemoryCacheGetCpuStatistics(cache, &stats);
+        DEBUG("Magazines %i Rounds, %" PRIuIN " Hits, %" PRIuIN " Misses, Depot %" PRIuIN " Exchanges, %" PRIuIN " Contended",
+              cache->MagazineSize, stats.MagazineHits, stats.MagazineMisses,
+              stats.DepotExchanges, stats.DepotContention);
+    }
+    DEBUG("Reclaimed %" PRIuIN " Pages, %" PRIuIN " Slabs, Drained %" PRIuIN " Objects",
+          cache->PagesReclaimed, cache->SlabsReclaimed, cache->ObjectsDrained);
         
     // Dump slabs
     DEBUG("* full slabs");
@@ -368,114 +659,408 @@ __CacheDumpInformation(
     DEBUG("");
 }
 
-struct FindSlabContext {
-    MemoryCache_t* Cache;
-    uintptr_t      Address;
-    int            Found;
-};
+static inline size_t
+__CacheCalculateSlabStructureSize(
+    _In_ size_t objectsPerSlab)
+{
+    // Calculate how many bytes the slab metadata will need, the bitmap
+    // is kept in whole words so it can be scanned a word at a time
+    return sizeof(MemorySlab_t) + (MEMORY_SLAB_BITMAP_WORDS(objectsPerSlab) * sizeof(uint64_t));
+}
 
 static int
-SlabContainsAddress(
-    _In_ int        Unused,
-    _In_ element_t* element,
-    _In_ void*      contextPointer)
-{
-    struct FindSlabContext* Context = contextPointer;
-    int                     Index   = __SlabContainsAddress(
-            Context->Cache, element->value, Context->Address);
-    
-    if (Index == -1) {
-        return LIST_ENUMERATE_CONTINUE;
+__CacheCalculateMagazineSize(
+    _In_ MemoryCache_t* cache)
+{
+    // Rounds of large objects tie up a lot of memory on each core, so
+    // scale the magazines down as the objects grow.
+    if (cache->ObjectSize <= 256) {
+        return MEMORY_MAGAZINE_MAX_ROUNDS;
+    } else if (cache->ObjectSize <= 2048) {
+        return 16;
+    } else if (cache->ObjectSize <= 16384) {
+        return 8;
     }
-    
-    Context->Found = 1;
-    return LIST_ENUMERATE_STOP;
+    return 2;
 }
 
-static int
-__CacheContainsAddress(
-    _In_ MemoryCache_t* cache,
-    _In_ uintptr_t      address)
+static void
+__DepotLock(
+    _In_ MemoryDepot_t* depot)
 {
-    struct FindSlabContext Context = {
-        .Cache   = cache,
-        .Address = address,
-        .Found   = 0
-    };
-    
-    TRACE("__CacheContainsAddress(%s, 0x%" PRIxIN ")", cache->Name, address);
+    // If someone is holding or waiting for the lock already, count it
+    // so we can see how contended the depot is
+    int contended = atomic_load(&depot->Lock.Current) != atomic_load(&depot->Lock.Next);
+    SpinlockAcquireIrq(&depot->Lock);
+    if (contended) {
+        depot->Contention++;
+    }
+}
 
-    // Check partials first, we have to lock the cache as slabs can 
-    // get rearranged as we go, which is not ideal
-    MutexLock(&cache->SyncObject);
-    list_enumerate(&cache->PartialSlabs, SlabContainsAddress, &Context);
-    if (!Context.Found) {
-        list_enumerate(&cache->FullSlabs, SlabContainsAddress, &Context);
+static MemoryMagazine_t*
+__DepotGet(
+    _In_ MemoryDepot_t* depot,
+    _In_ int            full)
+{
+    MemoryMagazine_t* magazine;
+
+    __DepotLock(depot);
+    if (full) {
+        magazine = depot->Full;
+        if (magazine) {
+            depot->Full = magazine->Link;
+            if (--depot->FullCount < depot->FullMinimum) {
+                depot->FullMinimum = depot->FullCount;
+            }
+        }
+    } else {
+        magazine = depot->Empty;
+        if (magazine) {
+            depot->Empty = magazine->Link;
+            if (--depot->EmptyCount < depot->EmptyMinimum) {
+                depot->EmptyMinimum = depot->EmptyCount;
+            }
+        }
     }
-    MutexUnlock(&cache->SyncObject);
-    return Context.Found;
+
+    if (magazine) {
+        depot->Exchanges++;
+    }
+    SpinlockReleaseIrq(&depot->Lock);
+    return magazine;
 }
 
-static inline size_t
-__CacheCalculateSlabStructureSize(
-    _In_ size_t objectsPerSlab)
+static void
+__DepotPut(
+    _In_ MemoryDepot_t*    depot,
+    _In_ MemoryMagazine_t* magazine)
 {
-    size_t slabStructure = sizeof(MemorySlab_t);
-    // Calculate how many bytes the slab metadata will need
-    slabStructure += (objectsPerSlab / 8);
-    if (objectsPerSlab % 8) {
-        slabStructure++;
+    __DepotLock(depot);
+    if (magazine->Rounds) {
+        magazine->Link = depot->Full;
+        depot->Full    = magazine;
+        depot->FullCount++;
+    } else {
+        magazine->Link = depot->Empty;
+        depot->Empty   = magazine;
+        depot->EmptyCount++;
     }
-    return slabStructure;
+    SpinlockReleaseIrq(&depot->Lock);
 }
 
-static size_t
-__CacheCalculateAtomicCache(
-    _In_ MemoryCache_t* cache)
+// Detaches magazines from the depot. Unless all magazines are requested, only the
+// magazines that were not needed since the last reap are detached.
+static MemoryMagazine_t*
+__DepotReap(
+    _In_ MemoryDepot_t* depot,
+    _In_ int            all)
 {
-    // number of cpu * cpu_cache_objects + number of cpu * objects per slab * pointer size
-    size_t bytesRequired = 0;
-    int    numberOfCores = atomic_load(&GetMachine()->NumberOfCores);
-    
-    if (numberOfCores > 1) {
-        bytesRequired = (numberOfCores *
-                         (sizeof(MemoryAtomicCache_t) + (cache->ObjectCount * sizeof(void*))));
-        if (__CacheFindFixedSize(bytesRequired) == NULL) {
-            bytesRequired = 0;
-        }
+    MemoryMagazine_t* magazines = NULL;
+    MemoryMagazine_t* magazine;
+    int               fullCount;
+    int               emptyCount;
+
+    __DepotLock(depot);
+    fullCount  = all ? depot->FullCount : depot->FullMinimum;
+    emptyCount = all ? depot->EmptyCount : depot->EmptyMinimum;
+    while (fullCount--) {
+        magazine       = depot->Full;
+        depot->Full    = magazine->Link;
+        magazine->Link = magazines;
+        magazines      = magazine;
+        depot->FullCount--;
+    }
+    while (emptyCount--) {
+        magazine       = depot->Empty;
+        depot->Empty   = magazine->Link;
+        magazine->Link = magazines;
+        magazines      = magazine;
+        depot->EmptyCount--;
     }
-    return bytesRequired;
+    depot->FullMinimum  = depot->FullCount;
+    depot->EmptyMinimum = depot->EmptyCount;
+    SpinlockReleaseIrq(&depot->Lock);
+    return magazines;
 }
 
 static void
-__CacheInitializeAtomicCache(
+__CacheInitializeCpuCaches(
     _In_ MemoryCache_t* cache)
 {
-    size_t atomicCacheSize = __CacheCalculateAtomicCache(cache);
-    int    numberOfCores   = atomic_load(&GetMachine()->NumberOfCores);
-    int    i;
-    if (atomicCacheSize) {
-        cache->AtomicCaches = (uintptr_t)kmalloc(atomicCacheSize);
-        if (!cache->AtomicCaches) {
-            return;
+    int   expected = MEMORY_CPU_CACHES_NONE;
+    void* cpuCaches;
+
+    // Only one can install the cpu caches, anyone racing us, or recursing into
+    // the cache while we allocate, will use the slab layer in the meantime.
+    if (!atomic_compare_exchange_strong(&cache->CpuCacheState, &expected, MEMORY_CPU_CACHES_INSTALLING)) {
+        return;
+    }
+
+    cpuCaches = kmalloc(g_cpuCacheCount * MEMORY_CPU_CACHE_STRIDE);
+    if (!cpuCaches) {
+        atomic_store(&cache->CpuCacheState, MEMORY_CPU_CACHES_NONE);
+        return;
+    }
+    memset(cpuCaches, 0, g_cpuCacheCount * MEMORY_CPU_CACHE_STRIDE);
+
+    cache->CpuCaches     = (uintptr_t)cpuCaches;
+    cache->CpuCacheCount = g_cpuCacheCount;
+    atomic_store(&cache->CpuCacheState, MEMORY_CPU_CACHES_READY);
+}
+
+// Returns whether the cpu caches are ready for use, and installs them
+// on first use if the caller is allowed to block.
+static int
+__CacheUseCpuCaches(
+    _In_ MemoryCache_t* cache)
+{
+    int state = atomic_load(&cache->CpuCacheState);
+    if (state == MEMORY_CPU_CACHES_NONE && g_cpuCacheCount != 0 &&
+        !(cache->Flags & HEAP_SLAB_NO_ATOMIC_CACHE) && !InterruptIsDisabled()) {
+        __CacheInitializeCpuCaches(cache);
+        state = atomic_load(&cache->CpuCacheState);
+    }
+    return state == MEMORY_CPU_CACHES_READY;
+}
+
+// Interrupts must be disabled by the caller, so we are not moved to another core
+// or interrupted by someone using the cache from interrupt context.
+static inline MemoryCpuCache_t*
+__CacheGetCpuCache(
+    _In_ MemoryCache_t* cache)
+{
+    uuid_t coreId = ArchGetProcessorCoreId();
+    if (coreId >= (uuid_t)cache->CpuCacheCount) {
+        return NULL;
+    }
+    return MEMORY_CPU_CACHE(cache, coreId);
+}
+
+static void*
+__CpuCacheAllocate(
+    _In_ MemoryCache_t* cache)
+{
+    MemoryCpuCache_t* cpuCache;
+    MemoryMagazine_t* magazine;
+    void*             object = NULL;
+    irqstate_t        irqState;
+
+    irqState = InterruptDisable();
+    cpuCache = __CacheGetCpuCache(cache);
+    while (cpuCache) {
+        if (cpuCache->Loaded && cpuCache->Loaded->Rounds) {
+            object = cpuCache->Loaded->Objects[--cpuCache->Loaded->Rounds];
+            cpuCache->Allocations++;
+            break;
         }
-        
-        memset((void*)cache->AtomicCaches, 0, atomicCacheSize);
-        for (i = 0; i < numberOfCores; i++) {
-            MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(cache, i);
-            AtomicCache->Available           = 0;
-            AtomicCache->Limit               = cache->ObjectCount;
+
+        if (cpuCache->Previous && cpuCache->Previous->Rounds) {
+            magazine           = cpuCache->Loaded;
+            cpuCache->Loaded   = cpuCache->Previous;
+            cpuCache->Previous = magazine;
+            continue;
+        }
+
+        // Both magazines are empty, exchange the previous for a full one from the depot
+        magazine = __DepotGet(&cache->Depot, 1);
+        if (!magazine) {
+            cpuCache->Misses++;
+            break;
+        }
+
+        if (cpuCache->Previous) {
+            __DepotPut(&cache->Depot, cpuCache->Previous);
+        }
+        cpuCache->Previous = cpuCache->Loaded;
+        cpuCache->Loaded   = magazine;
+    }
+    InterruptRestoreState(irqState);
+    return object;
+}
+
+static int
+__CpuCacheFree(
+    _In_ MemoryCache_t* cache,
+    _In_ void*          object)
+{
+    MemoryCpuCache_t* cpuCache;
+    MemoryMagazine_t* magazine;
+    int               freed = 0;
+    irqstate_t        irqState;
+
+    irqState = InterruptDisable();
+    cpuCache = __CacheGetCpuCache(cache);
+    while (cpuCache) {
+        if (cpuCache->Loaded && cpuCache->Loaded->Rounds < cache->MagazineSize) {
+            cpuCache->Loaded->Objects[cpuCache->Loaded->Rounds++] = object;
+            cpuCache->Frees++;
+            freed = 1;
+            break;
+        }
+
+        if (cpuCache->Previous && !cpuCache->Previous->Rounds) {
+            magazine           = cpuCache->Loaded;
+            cpuCache->Loaded   = cpuCache->Previous;
+            cpuCache->Previous = magazine;
+            continue;
+        }
+
+        // Both magazines are full, exchange the previous for an empty one from the depot. If
+        // there are none, it's up to the caller to allocate one, as that may block.
+        magazine = __DepotGet(&cache->Depot, 0);
+        if (!magazine) {
+            cpuCache->Misses++;
+            break;
+        }
+
+        if (cpuCache->Previous) {
+            __DepotPut(&cache->Depot, cpuCache->Previous);
         }
+        cpuCache->Previous = cpuCache->Loaded;
+        cpuCache->Loaded   = magazine;
     }
+    InterruptRestoreState(irqState);
+    return freed;
 }
 
 static void
-__CacheDrainAtomicCache(
-    _In_ MemoryCache_t* Cache)
+__CpuCacheFlush(
+    _In_ MemoryCache_t*    cache,
+    _In_ MemoryCpuCache_t* cpuCache)
+{
+    if (cpuCache->Loaded) {
+        __DepotPut(&cache->Depot, cpuCache->Loaded);
+        cpuCache->Loaded = NULL;
+    }
+    if (cpuCache->Previous) {
+        __DepotPut(&cache->Depot, cpuCache->Previous);
+        cpuCache->Previous = NULL;
+    }
+}
+
+struct CacheFlushContext {
+    MemoryCache_t* Cache;
+    _Atomic(int)   Completed;
+};
+
+// Executed on the core that owns the cpu cache, with interrupts disabled, so the
+// owner can never be in the middle of using its magazines.
+static void
+__CpuCacheFlushCore(
+    _In_ void* Context)
 {
-    // Send out IPI to all cores to empty their caches and put them into the gloal
-    // cache, this should be done when attempting to free up memory.
-    // @todo
+    struct CacheFlushContext* flushContext = Context;
+    __CpuCacheFlush(flushContext->Cache, MEMORY_CPU_CACHE(flushContext->Cache, ArchGetProcessorCoreId()));
+    atomic_store(&flushContext->Completed, 1);
+}
+
+static oserr_t
+__CpuCacheFlushOnCore(
+    _In_ struct CacheFlushContext* flushContext,
+    _In_ uuid_t                    coreId)
+{
+    OSTimestamp_t wakeUp;
+    size_t        timeout = MEMORY_REAP_DRAIN_TIMEOUT;
+    irqstate_t    irqState;
+    oserr_t       oserr;
+
+    atomic_store(&flushContext->Completed, 0);
+    if (coreId == ArchGetProcessorCoreId()) {
+        irqState = InterruptDisable();
+        __CpuCacheFlushCore(flushContext);
+        InterruptRestoreState(irqState);
+        return OS_EOK;
+    }
+
+    oserr = TxuMessageSend(coreId, CpuFunctionCustom, __CpuCacheFlushCore, flushContext, 1);
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    SystemTimerGetWallClockTime(&wakeUp);
+    while (!atomic_load(&flushContext->Completed) && timeout > 0) {
+        OSTimestampAddNsec(&wakeUp, &wakeUp, 5 * NSEC_PER_MSEC);
+        SchedulerSleep(&wakeUp);
+        timeout -= 5;
+    }
+
+    // We cannot safely reuse the context if the core never got to it
+    if (!atomic_load(&flushContext->Completed)) {
+        ERROR("[heap] [%s] timeout flushing cpu cache of core %u", flushContext->Cache->Name, coreId);
+        return OS_ETIMEOUT;
+    }
+    return OS_EOK;
+}
+
+static void __CacheFreeInSlab(MemoryCache_t*, MemorySlab_t*, void*);
+
+// Returns the rounds of the magazines to their slabs, and frees the magazines.
+static void
+__CacheFreeMagazines(
+    _In_ MemoryCache_t*    cache,
+    _In_ MemoryMagazine_t* magazines)
+{
+    MemoryMagazine_t* magazine;
+    int               i;
+
+    if (!magazines) {
+        return;
+    }
+
+    MutexLock(&cache->SyncObject);
+    for (magazine = magazines; magazine != NULL; magazine = magazine->Link) {
+        for (i = 0; i < magazine->Rounds; i++) {
+            MemorySlab_t* slab = __SlabMapLookup((uintptr_t)magazine->Objects[i]);
+            assert(slab != NULL && slab->Cache == cache);
+            __CacheFreeInSlab(cache, slab, magazine->Objects[i]);
+        }
+        cache->ObjectsDrained += magazine->Rounds;
+    }
+    MutexUnlock(&cache->SyncObject);
+
+    while (magazines) {
+        magazine  = magazines;
+        magazines = magazine->Link;
+        MemoryCacheFree(&g_magazineCache, magazine);
+    }
+}
+
+// Gives back the magazines of the depot that were not needed since the last reap. When
+// aggressive, each core first moves its magazines to the depot, and the depot is emptied.
+static void
+__CacheReapMagazines(
+    _In_ MemoryCache_t* cache,
+    _In_ int            aggressive)
+{
+    struct CacheFlushContext* flushContext;
+    int                       i;
+
+    if (atomic_load(&cache->CpuCacheState) != MEMORY_CPU_CACHES_READY) {
+        return;
+    }
+
+    if (aggressive) {
+        flushContext = kmalloc(sizeof(struct CacheFlushContext));
+        if (!flushContext) {
+            return;
+        }
+        flushContext->Cache = cache;
+
+        for (i = 0; i < cache->CpuCacheCount; i++) {
+            SystemCpuCore_t* core = GetProcessorCore(i);
+            if (core == NULL || !(CpuCoreState(core) & CpuStateRunning)) {
+                continue;
+            }
+
+            if (__CpuCacheFlushOnCore(flushContext, i) != OS_EOK) {
+                // The context may still be in use by the remote core, so we must leak it
+                flushContext = NULL;
+                break;
+            }
+        }
+        kfree(flushContext);
+    }
+    __CacheFreeMagazines(cache, __DepotReap(&cache->Depot, aggressive));
 }
 
 // Object size is the size of the actual object.
@@ -585,6 +1170,13 @@ MemoryCacheConstruct(
         ObjectPadding += ObjectAlignment - ((ObjectSize + ObjectPadding) % ObjectAlignment);
     }
 
+    // The freelist is stored in the free objects themselves, which would destroy
+    // the state of constructed objects, and requires room for a pointer
+    if ((Flags & HEAP_SLAB_FREELIST) && (ObjectConstructor != NULL || ObjectSize < sizeof(void*))) {
+        WARNING("[cache_construct] [%s] freelist is not supported for this cache, using bitmap", Name);
+        Flags &= ~(HEAP_SLAB_FREELIST);
+    }
+
     MutexConstruct(&Cache->SyncObject, MUTEX_FLAG_RECURSIVE);
     Cache->Name                = Name;
     Cache->Flags               = Flags;
@@ -593,19 +1185,29 @@ MemoryCacheConstruct(
     Cache->ObjectPadding       = ObjectPadding;
     Cache->ObjectConstructor   = ObjectConstructor;
     Cache->ObjectDestructor    = ObjectDestructor;
-    Cache->AtomicCaches        = 0;
+    Cache->CpuCaches           = 0;
+    Cache->CpuCacheCount       = 0;
     Cache->NumberOfFreeObjects = 0;
+    Cache->FreeSlabWatermark   = MEMORY_REAP_FREE_WATERMARK;
+    Cache->PagesReclaimed      = 0;
+    Cache->SlabsReclaimed      = 0;
+    Cache->ObjectsDrained      = 0;
+    Cache->SlabCount           = 0;
+    Cache->SlabAllocations     = 0;
+    Cache->SlabFrees           = 0;
+    Cache->PeakObjects         = 0;
     
     list_construct(&Cache->FreeSlabs);
     list_construct(&Cache->PartialSlabs);
     list_construct(&Cache->FullSlabs);
 
     __CacheCalculateSlabSize(Cache, ObjectSize, ObjectAlignment, ObjectPadding, ObjectMinCount);
-    
-    // We only perform this if it has been requested and is not a default cache
-    if (!(Cache->Flags & (HEAP_CACHE_DEFAULT | HEAP_SLAB_NO_ATOMIC_CACHE))) {
-        __CacheInitializeAtomicCache(Cache);
-    }
+
+    // The cpu caches are installed on first use, once the number of cores is known
+    atomic_store(&Cache->CpuCacheState, MEMORY_CPU_CACHES_NONE);
+    Cache->MagazineSize = __CacheCalculateMagazineSize(Cache);
+    memset(&Cache->Depot, 0, sizeof(MemoryDepot_t));
+    SpinlockConstruct(&Cache->Depot.Lock);
     
     // Should we create the initial slab?
     if (Flags & HEAP_INITIAL_SLAB) {
@@ -615,6 +1217,12 @@ MemoryCacheConstruct(
         list_append(&Cache->FreeSlabs, &Slab->Header);
     }
     
+    // Register the cache so the reaper can find it
+    ELEMENT_INIT(&Cache->Header, 0, Cache);
+    MutexLock(&g_reapLock);
+    list_append(&g_caches, &Cache->Header);
+    MutexUnlock(&g_reapLock);
+    
     TRACE("[cache_construct] [%s] number of objects %i/%i", 
         Cache->Name, Cache->NumberOfFreeObjects, Cache->ObjectCount);
 }
@@ -676,10 +1284,20 @@ void
 MemoryCacheDestroy(
     _In_ MemoryCache_t* Cache)
 {
-    // If there are any cpu caches, free them, there is no need to drain the cpu caches
-    // here at this point as we assume that when destroying a cache we do it for good reason
-    if (Cache->AtomicCaches != 0) {
-        kfree((void*)Cache->AtomicCaches);
+    // Make sure the reaper is not looking at the cache while we remove it
+    MutexLock(&g_reapLock);
+    list_remove(&g_caches, &Cache->Header);
+    MutexUnlock(&g_reapLock);
+
+    // If there are any cpu caches, free them. The cache must not be in use anymore, so we can
+    // move the magazines of all cores to the depot without asking the cores to do it.
+    if (atomic_load(&Cache->CpuCacheState) == MEMORY_CPU_CACHES_READY) {
+        int i;
+        for (i = 0; i < Cache->CpuCacheCount; i++) {
+            __CpuCacheFlush(Cache, MEMORY_CPU_CACHE(Cache, i));
+        }
+        __CacheFreeMagazines(Cache, __DepotReap(&Cache->Depot, 1));
+        kfree((void*)Cache->CpuCaches);
     }
     __CacheDestroyList(Cache, &Cache->FreeSlabs);
     __CacheDestroyList(Cache, &Cache->PartialSlabs);
@@ -696,18 +1314,13 @@ MemoryCacheAllocate(
     int           Index;
     TRACE("MemoryCacheAllocate(%s)", Cache->Name);
 
-    // Can we allocate from cpu cache? No need to use explicit macros with memory
-    // barriers here as there is no risc of other cpus changing the atomic caches
-    if (Cache->AtomicCaches != 0) {
-        MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, ArchGetProcessorCoreId());
-        int Available = atomic_load(&AtomicCache->Available);
-        while (Available) {
-            if (atomic_compare_exchange_weak(&AtomicCache->Available, &Available, Available - 1)) {
-                Allocated = MEMORY_ATOMIC_ELEMENT(AtomicCache, (Available - 1))[0];
-                TRACE("[heap] [%s] ATOMIC ALLOC 0x%" PRIxIN " (%u, %u, %u)", 
-                    Cache->Name, Allocated, Cache->ObjectSize, Cache->ObjectPadding, Available);
-                return Allocated;
-            }
+    // Can we allocate from cpu cache? The magazines of this core, and the depot, are
+    // safe to use from interrupt context. Only the slab layer may block.
+    if (__CacheUseCpuCaches(Cache)) {
+        Allocated = __CpuCacheAllocate(Cache);
+        if (Allocated) {
+            TRACE("[heap] [%s] MAGAZINE ALLOC 0x%" PRIxIN, Cache->Name, Allocated);
+            return Allocated;
         }
     }
 
@@ -765,6 +1378,14 @@ MemoryCacheAllocate(
         Allocated = NULL;
         Index     = -1;
     }
+
+    if (Allocated) {
+        size_t InUse = __CacheObjectsInUse(Cache);
+        Cache->SlabAllocations++;
+        if (InUse > Cache->PeakObjects) {
+            Cache->PeakObjects = InUse;
+        }
+    }
     MutexUnlock(&Cache->SyncObject);
 
     TRACE(" => 0x%" PRIxIN " (%u [0x%x], %u, %i)", Allocated, Cache->ObjectSize, 
@@ -772,38 +1393,30 @@ MemoryCacheAllocate(
     return Allocated;
 }
 
-struct FreeContext {
-    MemoryCache_t* Cache;
-    uintptr_t      Object;
-    element_t*     Element;
-    int            AddToFree;
-};
-
-static int
-__FreeInSlab(
-    _In_ int        Unused,
-    _In_ element_t* Element,
-    _In_ void*      ContextPointer)
+// Returns the object to the slab it belongs to, and moves the slab to the correct
+// list. The cache lock must be held by the caller.
+static void
+__CacheFreeInSlab(
+    _In_ MemoryCache_t* Cache,
+    _In_ MemorySlab_t*  Slab,
+    _In_ void*          Object)
 {
-    struct FreeContext* Context = ContextPointer;
-    MemorySlab_t*       Slab    = Element->value;
-    int                 Index   = __SlabContainsAddress(Context->Cache, Slab, Context->Object);
-    int                 Result  = LIST_ENUMERATE_STOP;
-    
-    if (Index == -1) {
-        return LIST_ENUMERATE_CONTINUE;
-    }
+    int Index   = __SlabContainsAddress(Cache, Slab, (uintptr_t)Object);
+    int WasFull = (Slab->NumberOfFreeObjects == 0);
+
+    assert(Index != -1);
+    __SlabFreeIndex(Cache, Slab, Index);
+    Cache->NumberOfFreeObjects++;
 
-    __SlabFreeIndex(Context->Cache, Slab, Index);
-    if (Slab->NumberOfFreeObjects == Context->Cache->ObjectCount) {
-        Context->AddToFree = 1;
-        Result |= LIST_ENUMERATE_REMOVE;
+    // Move the slab to the correct list, a slab can go directly from full to free
+    // if the object count is 1
+    if (Slab->NumberOfFreeObjects == Cache->ObjectCount) {
+        list_remove(WasFull ? &Cache->FullSlabs : &Cache->PartialSlabs, &Slab->Header);
+        list_append(&Cache->FreeSlabs, &Slab->Header);
+    } else if (WasFull) {
+        list_remove(&Cache->FullSlabs, &Slab->Header);
+        list_append(&Cache->PartialSlabs, &Slab->Header);
     }
-    
-    Context->Element = Element;
-    Context->Cache->NumberOfFreeObjects++;
-    
-    return Result;
 }
 
 void
@@ -811,12 +1424,7 @@ MemoryCacheFree(
     _In_ MemoryCache_t* Cache,
     _In_ void*          Object)
 {
-    struct FreeContext Context = { 
-        .Cache     = Cache, 
-        .Object    = (uintptr_t)Object, 
-        .Element   = NULL, 
-        .AddToFree = 0
-    };
+    MemorySlab_t* Slab;
     
     TRACE("MemoryCacheFree(%s, 0x%" PRIxIN ")", Cache->Name, Object);
 
@@ -826,57 +1434,401 @@ MemoryCacheFree(
     }
 
     // Can we push to cpu cache?
-    if (Cache->AtomicCaches != 0) {
-        TRACE("[heap] [%s] ATOMIC FREE 0x%" PRIxIN, Cache->Name, Object);
-        MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, ArchGetProcessorCoreId());
-        int Available = atomic_load(&AtomicCache->Available);
-        while (Available < AtomicCache->Limit) {
-            if (atomic_compare_exchange_weak(&AtomicCache->Available, &Available, Available + 1)) {
-                MEMORY_ATOMIC_ELEMENT(AtomicCache, Available)[0] = Object;
-                return;
+    if (__CacheUseCpuCaches(Cache)) {
+        TRACE("[heap] [%s] MAGAZINE FREE 0x%" PRIxIN, Cache->Name, Object);
+        if (__CpuCacheFree(Cache, Object)) {
+            return;
+        }
+
+        // Both our magazines are full and the depot is out of empty magazines. Allocate
+        // a new one if we are allowed to block, otherwise the object goes to its slab.
+        if (!InterruptIsDisabled()) {
+            MemoryMagazine_t* Magazine = MemoryCacheAllocate(&g_magazineCache);
+            if (Magazine) {
+                Magazine->Rounds = 0;
+                __DepotPut(&Cache->Depot, Magazine);
+                if (__CpuCacheFree(Cache, Object)) {
+                    return;
+                }
             }
         }
-        
-        // If the atomic cache is full then drain it
+    }
+
+    Slab = __SlabMapLookup((uintptr_t)Object);
+    if (Slab == NULL || Slab->Cache != Cache ||
+        __SlabContainsAddress(Cache, Slab, (uintptr_t)Object) == -1) {
+        ERROR("[heap] [%s] object 0x%" PRIxIN " does not belong to this cache", Cache->Name, (uintptr_t)Object);
+        return;
     }
 
     MutexLock(&Cache->SyncObject);
-    list_enumerate(&Cache->PartialSlabs, __FreeInSlab, &Context);
-    if (Context.AddToFree) {
-        list_append(&Cache->FreeSlabs, Context.Element);
+    __CacheFreeInSlab(Cache, Slab, Object);
+    Cache->SlabFrees++;
+    MutexUnlock(&Cache->SyncObject);
+}
+
+// Releases free slabs of the cache until only <keep> free slabs are left. Returns
+// the number of pages given back to the system.
+static int
+__CacheShrink(
+    _In_ MemoryCache_t* Cache,
+    _In_ int            Keep)
+{
+    int PagesFreed = 0;
+
+    // Caches that cannot grow must keep their slabs
+    if (Cache->Flags & HEAP_SINGLE_SLAB) {
+        return 0;
     }
-    
-    // Element was not present in partial slabs, check the full slabs now
-    if (!Context.Element) {
-        list_enumerate(&Cache->FullSlabs, __FreeInSlab, &Context);
-        if (Context.Element) {
-            // AddToFree is set if the object was removed already
-            if (!Context.AddToFree) {
-                list_remove(&Cache->FullSlabs, Context.Element);
-            }
-            
-            // A slab can go directly from full to free if the count is 1
-            if (Cache->ObjectCount == 1) {
-                list_append(&Cache->FreeSlabs, Context.Element);
-            }
-            else {
-                list_append(&Cache->PartialSlabs, Context.Element);
-            }
+
+    MutexLock(&Cache->SyncObject);
+    while (list_count(&Cache->FreeSlabs) > Keep) {
+        element_t*    Element = list_front(&Cache->FreeSlabs);
+        MemorySlab_t* Slab    = Element->value;
+
+        list_remove(&Cache->FreeSlabs, Element);
+        Cache->NumberOfFreeObjects -= Cache->ObjectCount;
+        __SlabDestroy(Cache, Slab);
+
+        Cache->SlabsReclaimed++;
+        Cache->PagesReclaimed += Cache->PageCount;
+        PagesFreed            += Cache->PageCount;
+    }
+    MutexUnlock(&Cache->SyncObject);
+    return PagesFreed;
+}
+
+static int
+__ReapCaches(
+    _In_ int Aggressive)
+{
+    element_t* i;
+    int        PagesFreed = 0;
+
+    MutexLock(&g_reapLock);
+    _foreach(i, &g_caches) {
+        MemoryCache_t* Cache = i->value;
+        __CacheReapMagazines(Cache, Aggressive);
+        PagesFreed += __CacheShrink(Cache, Aggressive ? 0 : Cache->FreeSlabWatermark);
+    }
+    MutexUnlock(&g_reapLock);
+    TRACE("[heap] [reap] reclaimed %i pages", PagesFreed);
+    return PagesFreed;
+}
+
+// Memory is considered low when less than an eighth of the memory is free
+static int
+__IsMemoryLow(void)
+{
+    size_t MaxBlocks  = GetMachine()->NumberOfMemoryBlocks;
+    size_t FreeBlocks = atomic_load(&GetMachine()->NumberOfFreeMemoryBlocks);
+    return FreeBlocks < (MaxBlocks >> 3U);
+}
+
+_Noreturn static void
+__ReaperThread(
+    _In_Opt_ void* Argument)
+{
+    OSTimestamp_t Deadline;
+    _CRT_UNUSED(Argument);
+
+    for (;;) {
+        SystemTimerGetWallClockTime(&Deadline);
+        OSTimestampAddNsec(&Deadline, &Deadline, MEMORY_REAP_INTERVAL_MS * NSEC_PER_MSEC);
+        (void)FutexWait(NULL, &g_reapRequests, 0, 0, NULL, 0, 0, &Deadline);
+
+        // Reset the request before reaping, so new requests that come in
+        // while we run will trigger another round.
+        atomic_store(&g_reapRequests, 0);
+        if (__IsMemoryLow()) {
+            MemoryCacheReap();
+        } else {
+            (void)__ReapCaches(0);
+        }
+    }
+}
+
+oserr_t
+MemoryCacheInitializeReaper(void)
+{
+    return ThreadCreate("heap-reaper", __ReaperThread, NULL,
+                        0, UUID_INVALID, 0, 0,
+                        &g_reaperHandle);
+}
+
+void
+MemoryCacheReapTrigger(void)
+{
+    // Only wake the reaper on the first request, further requests
+    // are coalesced until it has run.
+    int Expected = 0;
+    if (g_reaperHandle == UUID_INVALID || !__IsMemoryLow()) {
+        return;
+    }
+    if (atomic_compare_exchange_strong(&g_reapRequests, &Expected, 1)) {
+        FutexWake(&g_reapRequests, 1, 0);
+    }
+}
+
+void
+MemoryCacheGetReapStatistics(
+    _In_  MemoryCache_t*               Cache,
+    _Out_ MemoryCacheReapStatistics_t* Statistics)
+{
+    MutexLock(&Cache->SyncObject);
+    Statistics->PagesReclaimed = Cache->PagesReclaimed;
+    Statistics->SlabsReclaimed = Cache->SlabsReclaimed;
+    Statistics->ObjectsDrained = Cache->ObjectsDrained;
+    MutexUnlock(&Cache->SyncObject);
+}
+
+void
+MemoryCacheGetCpuStatistics(
+    _In_  MemoryCache_t*              Cache,
+    _Out_ MemoryCacheCpuStatistics_t* Statistics)
+{
+    int i;
+
+    memset(Statistics, 0, sizeof(MemoryCacheCpuStatistics_t));
+    if (atomic_load(&Cache->CpuCacheState) == MEMORY_CPU_CACHES_READY) {
+        for (i = 0; i < Cache->CpuCacheCount; i++) {
+            MemoryCpuCache_t* CpuCache = MEMORY_CPU_CACHE(Cache, i);
+            Statistics->MagazineHits   += CpuCache->Allocations + CpuCache->Frees;
+            Statistics->MagazineMisses += CpuCache->Misses;
+        }
+    }
+    Statistics->DepotExchanges  = Cache->Depot.Exchanges;
+    Statistics->DepotContention = Cache->Depot.Contention;
+}
+
+// Takes a snapshot of the cache statistics. The slab layer is read under the cache lock, while
+// the per-core counters are read without synchronization, as they only ever increase.
+static void
+__CacheQueryStatistics(
+    _In_  MemoryCache_t*           Cache,
+    _Out_ OSSystemHeapCacheInfo_t* Info)
+{
+    size_t     SlabBytes           = (size_t)Cache->PageCount * GetMemorySpacePageSize();
+    uint64_t   MagazineAllocations = 0;
+    uint64_t   MagazineFrees       = 0;
+    element_t* i;
+    int        j;
+
+    memset(Info, 0, sizeof(OSSystemHeapCacheInfo_t));
+    strncpy(&Info->Name[0], Cache->Name, sizeof(Info->Name) - 1);
+    Info->ObjectSize     = Cache->ObjectSize;
+    Info->ObjectPadding  = Cache->ObjectPadding;
+    Info->ObjectsPerSlab = (size_t)Cache->ObjectCount;
+
+    if (atomic_load(&Cache->CpuCacheState) == MEMORY_CPU_CACHES_READY) {
+        for (j = 0; j < Cache->CpuCacheCount; j++) {
+            MemoryCpuCache_t* CpuCache = MEMORY_CPU_CACHE(Cache, j);
+            MagazineAllocations  += CpuCache->Allocations;
+            MagazineFrees        += CpuCache->Frees;
+            Info->MagazineMisses += CpuCache->Misses;
         }
     }
+    Info->MagazineHits = MagazineAllocations + MagazineFrees;
+
+    MutexLock(&Cache->SyncObject);
+    Info->SlabCount   = (size_t)Cache->SlabCount;
+    Info->Allocations = MagazineAllocations + Cache->SlabAllocations;
+    Info->Frees       = MagazineFrees + Cache->SlabFrees;
+    Info->PeakObjects = Cache->PeakObjects;
+    _foreach(i, &Cache->PartialSlabs) {
+        MemorySlab_t* Slab = i->value;
+        Info->PartialSlabCount++;
+        Info->PartialObjectsInUse += (size_t)(Cache->ObjectCount - Slab->NumberOfFreeObjects);
+    }
     MutexUnlock(&Cache->SyncObject);
+
+    // The counters of the cores are read unlocked, so make sure a racing
+    // free does not make it look like we have a negative number of objects
+    if (Info->Allocations > Info->Frees) {
+        Info->LiveObjects = (size_t)(Info->Allocations - Info->Frees);
+    }
+
+    // Everything in the slab memory that cannot be used for object data counts as
+    // padding, that is the object padding, the on-site slab structure and the tail
+    Info->TotalBytes   = Info->SlabCount * SlabBytes;
+    Info->PaddingBytes = Info->SlabCount * (SlabBytes - (Info->ObjectsPerSlab * Cache->ObjectSize));
+}
+
+// The large allocations are reported as a cache without slabs, the padding is
+// the unused part of the last page of each allocation.
+static void
+__LargeQueryStatistics(
+    _Out_ OSSystemHeapCacheInfo_t* Info)
+{
+    memset(Info, 0, sizeof(OSSystemHeapCacheInfo_t));
+    strncpy(&Info->Name[0], "kmalloc_large", sizeof(Info->Name) - 1);
+
+    MutexLock(&g_largeLock);
+    Info->Allocations  = g_largeAllocationCount;
+    Info->Frees        = g_largeFreeCount;
+    Info->LiveObjects  = (size_t)(g_largeAllocationCount - g_largeFreeCount);
+    Info->PeakObjects  = g_largePeakCount;
+    Info->TotalBytes   = g_largePagesInUse * GetMemorySpacePageSize();
+    Info->PaddingBytes = Info->TotalBytes - g_largeBytesInUse;
+    MutexUnlock(&g_largeLock);
+}
+
+int
+MemoryCacheQueryStatistics(
+    _In_ OSSystemHeapCacheInfo_t* Entries,
+    _In_ int                      MaxEntries)
+{
+    OSSystemHeapCacheInfo_t* Snapshot;
+    element_t*               i;
+    int                      Count = 0;
+    int                      CacheCount;
+    bool                     IncludeLarge;
+
+    if (MaxEntries <= 0) {
+        return 0;
+    }
+
+    // The target buffer may be user memory and must not be touched with the
+    // cache list locked, so the entries are built in a kernel snapshot first. The
+    // heap can not be called with the list locked either, so size it up front. Caches
+    // created in the meantime, also by allocating the snapshot, are left out.
+    MutexLock(&g_reapLock);
+    CacheCount = MIN((int)list_count(&g_caches), MaxEntries);
+    MutexUnlock(&g_reapLock);
+    IncludeLarge = CacheCount < MaxEntries;
+
+    Snapshot = kmalloc((CacheCount + 1) * sizeof(OSSystemHeapCacheInfo_t));
+    if (Snapshot == NULL) {
+        return 0;
+    }
+
+    MutexLock(&g_reapLock);
+    _foreach(i, &g_caches) {
+        if (Count == CacheCount) {
+            break;
+        }
+        __CacheQueryStatistics(i->value, &Snapshot[Count++]);
+    }
+    MutexUnlock(&g_reapLock);
+
+    if (IncludeLarge) {
+        __LargeQueryStatistics(&Snapshot[Count++]);
+    }
+    memcpy(Entries, Snapshot, Count * sizeof(OSSystemHeapCacheInfo_t));
+    kfree(Snapshot);
+    return Count;
 }
 
 int MemoryCacheReap(void)
 {
     // Iterate the caches in the system and drain their cpu caches
     // Then start looking at the entirely free slabs, and free them.
-    return 0;
+    return __ReapCaches(1);
+}
+
+static void*
+__LargeAllocate(
+    _In_ size_t Size)
+{
+    MemoryLargeAllocation_t* allocation;
+    size_t                   pageSize  = GetMemorySpacePageSize();
+    int                      pageCount = (int)DIVUP(Size, pageSize);
+    paddr_t                  pages[MEMORY_LARGE_COMMIT_BATCH];
+    vaddr_t                  address;
+    oserr_t                  oserr;
+    int                      i;
+
+    allocation = kmalloc(sizeof(MemoryLargeAllocation_t));
+    if (!allocation) {
+        return NULL;
+    }
+
+    // Reserve the virtual range first, and then back it with pages in batches, this
+    // way we never need the entire list of physical pages at once.
+    oserr = MemorySpaceMap(
+            GetCurrentMemorySpace(),
+            &(struct MemorySpaceMapOptions) {
+                .Length = pageSize * pageCount,
+                .Mask = __MASK,
+                .Flags = MAPPING_DOMAIN,
+                .PlacementFlags = MAPPING_VIRTUAL_GLOBAL
+            },
+            &address
+    );
+    if (oserr != OS_EOK) {
+        ERROR("[heap] [large] failed to reserve %i pages", pageCount);
+        kfree(allocation);
+        return NULL;
+    }
+
+    for (i = 0; i < pageCount; i += MEMORY_LARGE_COMMIT_BATCH) {
+        int batch = MIN(MEMORY_LARGE_COMMIT_BATCH, pageCount - i);
+        oserr = MemorySpaceCommit(
+                GetCurrentMemorySpace(),
+                address + (i * pageSize),
+                &pages[0],
+                batch * pageSize,
+                __MASK,
+                0
+        );
+        if (oserr != OS_EOK) {
+            ERROR("[heap] [large] failed to commit %i pages", pageCount);
+            __FreeVirtualPages(address, pageCount);
+            kfree(allocation);
+            return NULL;
+        }
+    }
+
+    RB_LEAF_INIT(&allocation->Header, address, allocation);
+    allocation->Size      = Size;
+    allocation->PageCount = pageCount;
+
+    MutexLock(&g_largeLock);
+    rb_tree_append(&g_largeAllocations, &allocation->Header);
+    g_largeAllocationCount++;
+    g_largePagesInUse += (size_t)pageCount;
+    g_largeBytesInUse += Size;
+    if ((size_t)(g_largeAllocationCount - g_largeFreeCount) > g_largePeakCount) {
+        g_largePeakCount = (size_t)(g_largeAllocationCount - g_largeFreeCount);
+    }
+    MutexUnlock(&g_largeLock);
+
+    TRACE("[heap] [large] 0x%" PRIxIN " (%" PRIuIN " bytes)", address, Size);
+    return (void*)address;
+}
+
+static oserr_t
+__LargeFree(
+    _In_ void* Object)
+{
+    MemoryLargeAllocation_t* allocation;
+    rb_leaf_t*               leaf;
+
+    MutexLock(&g_largeLock);
+    leaf = rb_tree_remove(&g_largeAllocations, Object);
+    if (!leaf) {
+        MutexUnlock(&g_largeLock);
+        return OS_ENOENT;
+    }
+
+    allocation = leaf->value;
+    g_largeFreeCount++;
+    g_largePagesInUse -= (size_t)allocation->PageCount;
+    g_largeBytesInUse -= allocation->Size;
+    MutexUnlock(&g_largeLock);
+
+    __FreeVirtualPages((uintptr_t)Object, allocation->PageCount);
+    kfree(allocation);
+    return OS_EOK;
 }
 
 void* kmalloc(size_t Size)
 {
     TRACE("kmalloc(%" PRIuIN ")", Size);
+    if (Size > MEMORY_LARGE_THRESHOLD) {
+        return __LargeAllocate(Size);
+    }
+
     struct FixedCache* Selected = __CacheFindFixedSize(Size);
     if (Selected == NULL) {
         ERROR("Could not find a cache for size %" PRIuIN "", Size);
@@ -907,30 +1859,25 @@ void* kmalloc_p(size_t Size, uintptr_t* DmaOut)
 
 void kfree(void* Object)
 {
-    struct FixedCache* selected = NULL;
-    int                i = 0;
+    MemorySlab_t* slab;
 
     if (Object == NULL) {
         return;
     }
 
-    // Find the cache that the allocation was done in
-    while (g_defaultCaches[i].ObjectSize != 0) {
-        if (g_defaultCaches[i].Cache != NULL) {
-            if (__CacheContainsAddress(g_defaultCaches[i].Cache, (uintptr_t) Object)) {
-                selected = &g_defaultCaches[i];
-                break;
-            }
-        }
-        i++;
+    // Resolve the slab, and thus the cache the allocation was done in
+    slab = __SlabMapLookup((uintptr_t)Object);
+    if (slab && (slab->Cache->Flags & HEAP_CACHE_DEFAULT)) {
+        MemoryCacheFree(slab->Cache, Object);
+        return;
     }
 
-    if (selected) {
-        MemoryCacheFree(selected->Cache, Object);
+    // Not owned by a slab, then it must be a large allocation
+    if (__LargeFree(Object) == OS_EOK) {
         return;
     }
 
-    ERROR("Could not find a cache for object 0x%" PRIxIN "", Object);
+    ERROR("Could not find a cache for object 0x%" PRIxIN "", (uintptr_t)Object);
     MemoryCacheDump(NULL);
     assert(0);
 }
@@ -940,7 +1887,7 @@ MemoryCacheDump(
     _In_ MemoryCache_t* Cache)
 {
     size_t maxBlocks  = GetMachine()->NumberOfMemoryBlocks;
-    size_t freeBlocks = GetMachine()->NumberOfFreeMemoryBlocks;
+    size_t freeBlocks = atomic_load(&GetMachine()->NumberOfFreeMemoryBlocks);
     int    i          = 0;
     
     if (Cache != NULL) {
@@ -955,6 +1902,9 @@ MemoryCacheDump(
         }
         i++;
     }
+
+    DEBUG("Large Allocations: %" PRIuIN " Live, %" PRIuIN " Pages",
+          (size_t)(g_largeAllocationCount - g_largeFreeCount), g_largePagesInUse);
     
     // Dump memory information
     DEBUG("\nMemory Stats: %" PRIuIN "/%" PRIuIN " Bytes, %" PRIuIN "/%" PRIuIN " Blocks",
@@ -965,8 +1915,26 @@ MemoryCacheDump(
 void
 MemoryCacheInitialize(void)
 {
+    list_construct(&g_caches);
+    MutexConstruct(&g_reapLock, MUTEX_FLAG_PLAIN);
+    rb_tree_construct(&g_largeAllocations);
+    MutexConstruct(&g_largeLock, MUTEX_FLAG_PLAIN);
+
     // Initialize the default cache and disable atomics for this one
     MemoryCacheConstruct(&g_initialCache, "cache_cache", sizeof(MemoryCache_t),
                          16, 0, HEAP_SLAB_NO_ATOMIC_CACHE,
                          NULL, NULL);
+
+    // Magazines are allocated from their own cache, which cannot use magazines itself
+    MemoryCacheConstruct(&g_magazineCache, "magazine_cache", sizeof(MemoryMagazine_t),
+                         sizeof(void*), 0, HEAP_SLAB_NO_ATOMIC_CACHE,
+                         NULL, NULL);
+}
+
+void
+MemoryCacheInitializeCpuCaches(void)
+{
+    // The number of cores is known at this point, caches install
+    // their cpu caches the next time they are used.
+    g_cpuCacheCount = atomic_load(&GetMachine()->NumberOfCores);
 }
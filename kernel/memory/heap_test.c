@@ -0,0 +1,1090 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <arch/interrupts.h>
+#include <component/cpu.h>
+#include <futex.h>
+#include <heap.h>
+#include <machine.h>
+#include <memoryspace.h>
+#include <mutex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spinlock.h>
+#include <string.h>
+#include <threading.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The arena acts as the global access memory region, all slab memory
+// is handed out from here. It is never reset between tests, as the heap
+// keeps global state.
+#define ARENA_SIZE (128 * 1024 * 1024)
+#define PAGE_SIZE  0x1000
+#define CORE_COUNT 4
+
+struct __MemorySpaceMap {
+    oserr_t      ReturnValue;
+    _Atomic(int) Calls;
+};
+
+struct __MemorySpaceUnmap {
+    _Atomic(int) Calls;
+};
+
+struct __MemorySpaceCommit {
+    oserr_t      ReturnValue;
+    _Atomic(int) Calls;
+};
+
+struct __MutexLock {
+    _Atomic(int) Calls;
+    _Atomic(int) Contended;
+};
+
+struct __TxuMessageSend {
+    int Calls;
+};
+
+struct __FutexWake {
+    int Calls;
+};
+
+static struct __TestContext {
+    SystemMachine_t Machine;
+    MemorySpace_t   MemorySpace;
+    uint8_t*        Arena;
+    _Atomic(size_t) ArenaUsed;
+
+    // Function mocks
+    struct __MemorySpaceMap    MemorySpaceMap;
+    struct __MemorySpaceUnmap  MemorySpaceUnmap;
+    struct __MemorySpaceCommit MemorySpaceCommit;
+    struct __MutexLock         MutexLock;
+    struct __TxuMessageSend    TxuMessageSend;
+    struct __FutexWake         FutexWake;
+} g_testContext;
+
+// Each test thread acts as a core, with its own interrupt state
+static __thread uuid_t g_coreId             = 0;
+static __thread uuid_t g_threadId           = 1;
+static __thread int    g_interruptsDisabled = 0;
+
+int Setup(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+
+    g_testContext.Arena = aligned_alloc(PAGE_SIZE, ARENA_SIZE);
+    if (g_testContext.Arena == NULL) {
+        return -1;
+    }
+
+    g_testContext.Machine.MemoryGranularity       = PAGE_SIZE;
+    g_testContext.Machine.NumberOfCores           = CORE_COUNT;
+    g_testContext.Machine.MemoryMap.Shared.Start  = (uintptr_t)g_testContext.Arena;
+    g_testContext.Machine.MemoryMap.Shared.Length = ARENA_SIZE;
+    MemoryCacheInitialize();
+    MemoryCacheInitializeCpuCaches();
+    return 0;
+}
+
+int Teardown(void** state) {
+    (void)state;
+    free(g_testContext.Arena);
+    return 0;
+}
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext.MemorySpaceMap, 0, sizeof(struct __MemorySpaceMap));
+    memset(&g_testContext.MemorySpaceUnmap, 0, sizeof(struct __MemorySpaceUnmap));
+    memset(&g_testContext.MemorySpaceCommit, 0, sizeof(struct __MemorySpaceCommit));
+    memset(&g_testContext.MutexLock, 0, sizeof(struct __MutexLock));
+    memset(&g_testContext.TxuMessageSend, 0, sizeof(struct __TxuMessageSend));
+    memset(&g_testContext.FutexWake, 0, sizeof(struct __FutexWake));
+    g_testContext.Machine.NumberOfMemoryBlocks     = 1024;
+    g_testContext.Machine.NumberOfFreeMemoryBlocks = 1024;
+    return 0;
+}
+
+static uint64_t __Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+void TestKfree_ReusesObject(void** state)
+{
+    void* first;
+    void* second;
+    (void)state;
+
+    first = kmalloc(32);
+    assert_non_null(first);
+    kfree(first);
+
+    // Freeing the object must have made it available again in
+    // the same cache
+    second = kmalloc(32);
+    assert_ptr_equal(first, second);
+    kfree(second);
+}
+
+void TestKfree_RoutesToCorrectCache(void** state)
+{
+    void* small;
+    void* large;
+    (void)state;
+
+    small = kmalloc(24);
+    large = kmalloc(3000);
+    assert_non_null(small);
+    assert_non_null(large);
+
+    // Free in reverse order and make sure each ends up back in the
+    // cache it was allocated from
+    kfree(large);
+    kfree(small);
+    assert_ptr_equal(kmalloc(3000), large);
+    assert_ptr_equal(kmalloc(24), small);
+    kfree(small);
+    kfree(large);
+}
+
+void TestKfree_ManySlabs(void** state)
+{
+    void* objects[2048];
+    int   mapCalls;
+    int   i;
+    (void)state;
+
+    for (i = 0; i < 2048; i++) {
+        objects[i] = kmalloc(128);
+        assert_non_null(objects[i]);
+    }
+    assert_true(g_testContext.MemorySpaceMap.Calls > 1);
+
+    // Free every other object first, which moves full slabs into partial
+    // and then the rest, which moves partial slabs into free
+    for (i = 0; i < 2048; i += 2) {
+        kfree(objects[i]);
+    }
+    for (i = 1; i < 2048; i += 2) {
+        kfree(objects[i]);
+    }
+
+    // Freeing may have needed new magazines, which is fine
+    mapCalls = g_testContext.MemorySpaceMap.Calls;
+
+    // All slabs should now be free, so allocating the same amount again
+    // must not require any new memory
+    for (i = 0; i < 2048; i++) {
+        objects[i] = kmalloc(128);
+        assert_non_null(objects[i]);
+    }
+    assert_int_equal(g_testContext.MemorySpaceMap.Calls, mapCalls);
+    for (i = 0; i < 2048; i++) {
+        kfree(objects[i]);
+    }
+}
+
+void TestMemoryCacheFree_CustomCache(void** state)
+{
+    MemoryCache_t* cache;
+    void*          objects[64];
+    int            mapCalls;
+    int            i;
+    (void)state;
+
+    cache = MemoryCacheCreate("test_cache", 200, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    assert_non_null(cache);
+
+    for (i = 0; i < 64; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+    mapCalls = g_testContext.MemorySpaceMap.Calls;
+    for (i = 63; i >= 0; i--) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+
+    // All objects went back to their slabs, so they must be handed out
+    // again without any new slabs being created
+    for (i = 0; i < 64; i++) {
+        assert_non_null(MemoryCacheAllocate(cache));
+    }
+    assert_int_equal(g_testContext.MemorySpaceMap.Calls, mapCalls);
+    MemoryCacheDestroy(cache);
+    assert_true(g_testContext.MemorySpaceUnmap.Calls > 0);
+}
+
+void TestMemoryCacheReap_ReleasesFreeSlabs(void** state)
+{
+    MemoryCache_t*              cache;
+    MemoryCacheReapStatistics_t stats;
+    MemoryCacheReapStatistics_t stats2;
+    void*                       objects[256];
+    int                         pagesFreed;
+    int                         mapCalls;
+    int                         i;
+    (void)state;
+
+    cache = MemoryCacheCreate("reap_cache", 512, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    assert_non_null(cache);
+    for (i = 0; i < 256; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+    for (i = 0; i < 256; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+
+    // All slabs of the cache are now free, and must be given back
+    pagesFreed = MemoryCacheReap();
+    assert_true(pagesFreed > 0);
+    assert_true(g_testContext.MemorySpaceUnmap.Calls > 0);
+
+    MemoryCacheGetReapStatistics(cache, &stats);
+    assert_true(stats.SlabsReclaimed > 1);
+    assert_true(stats.PagesReclaimed >= stats.SlabsReclaimed);
+    assert_true(stats.PagesReclaimed <= (size_t)pagesFreed);
+    assert_int_equal(stats.ObjectsDrained, 0);
+
+    // Nothing is left to reclaim in this cache, and it must still be able to grow again.
+    // Other caches may still give back memory, as slab structures were freed by the reap.
+    MemoryCacheReap();
+    MemoryCacheGetReapStatistics(cache, &stats2);
+    assert_int_equal(stats2.SlabsReclaimed, stats.SlabsReclaimed);
+    mapCalls = g_testContext.MemorySpaceMap.Calls;
+    objects[0] = MemoryCacheAllocate(cache);
+    assert_non_null(objects[0]);
+    assert_true(g_testContext.MemorySpaceMap.Calls > mapCalls);
+    MemoryCacheFree(cache, objects[0]);
+    MemoryCacheDestroy(cache);
+}
+
+void TestMemoryCacheReap_KeepsUsedSlabs(void** state)
+{
+    MemoryCache_t*              cache;
+    MemoryCacheReapStatistics_t stats;
+    void*                       objects[64];
+    int                         i;
+    (void)state;
+
+    cache = MemoryCacheCreate("reap_used_cache", 1024, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    assert_non_null(cache);
+    for (i = 0; i < 64; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+
+    // Keep every other object alive, no slab becomes entirely free
+    for (i = 0; i < 64; i += 2) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    MemoryCacheReap();
+    MemoryCacheGetReapStatistics(cache, &stats);
+    assert_int_equal(stats.SlabsReclaimed, 0);
+
+    for (i = 1; i < 64; i += 2) {
+        memset(objects[i], 0xAB, 1024);
+        MemoryCacheFree(cache, objects[i]);
+    }
+    MemoryCacheReap();
+    MemoryCacheGetReapStatistics(cache, &stats);
+    assert_true(stats.SlabsReclaimed > 0);
+    MemoryCacheDestroy(cache);
+}
+
+void TestMemoryCacheReap_FlushesMagazines(void** state)
+{
+    MemoryCache_t*              cache;
+    MemoryCacheReapStatistics_t stats;
+    void*                       objects[32];
+    int                         i;
+    (void)state;
+
+    cache = MemoryCacheCreate("reap_magazine_cache", 64, 0, 0, 0, NULL, NULL);
+    assert_non_null(cache);
+
+    // Spread the frees over all cores, so each core has a loaded magazine
+    for (i = 0; i < 32; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+    for (i = 0; i < 32; i++) {
+        g_coreId = i % CORE_COUNT;
+        MemoryCacheFree(cache, objects[i]);
+    }
+    g_coreId = 0;
+    assert_int_equal(g_interruptsDisabled, 0);
+
+    // The remote cores must flush their own magazines
+    MemoryCacheReap();
+    MemoryCacheGetReapStatistics(cache, &stats);
+    assert_int_equal(stats.ObjectsDrained, 32);
+    assert_true(stats.SlabsReclaimed > 0);
+    assert_true(g_testContext.TxuMessageSend.Calls >= CORE_COUNT - 1);
+
+    MemoryCacheDestroy(cache);
+}
+
+void TestMemoryCacheCpu_InterruptContext(void** state)
+{
+    MemoryCache_t*             cache;
+    MemoryCacheCpuStatistics_t stats;
+    void*                      objects[40];
+    irqstate_t                 irqState;
+    int                        i;
+    (void)state;
+
+    // Objects of this size get magazines of 16 rounds
+    cache = MemoryCacheCreate("irq_cache", 1024, 0, 0, 0, NULL, NULL);
+    assert_non_null(cache);
+    for (i = 0; i < 40; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+
+    // In interrupt context no new magazines can be allocated, so once the loaded
+    // magazine is full, the objects must go directly to their slabs
+    irqState = InterruptDisable();
+    for (i = 8; i < 40; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    for (i = 0; i < 16; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+    InterruptRestoreState(irqState);
+    assert_int_equal(g_interruptsDisabled, 0);
+
+    // 8 + 8 frees and 16 allocations are served by the magazine. The 40 initial allocations,
+    // the first free that needed a magazine, and 24 frees in interrupt context are misses.
+    MemoryCacheGetCpuStatistics(cache, &stats);
+    assert_int_equal(stats.MagazineHits, 32);
+    assert_int_equal(stats.MagazineMisses, 65);
+
+    for (i = 0; i < 16; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    MemoryCacheDestroy(cache);
+}
+
+static OSSystemHeapCacheInfo_t*
+__FindCacheInfo(OSSystemHeapCacheInfo_t* entries, int count, const char* name)
+{
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(&entries[i].Name[0], name)) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+void TestMemoryCacheQueryStatistics_TracksUsage(void** state)
+{
+    OSSystemHeapCacheInfo_t  entries[64];
+    OSSystemHeapCacheInfo_t* info;
+    MemoryCache_t*           cache;
+    void*                    objects[40];
+    int                      count;
+    int                      i;
+    (void)state;
+
+    cache = MemoryCacheCreate("stats_cache", 1024, 0, 0, 0, NULL, NULL);
+    assert_non_null(cache);
+    for (i = 0; i < 40; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+    for (i = 0; i < 10; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+
+    count = MemoryCacheQueryStatistics(&entries[0], 64);
+    info  = __FindCacheInfo(&entries[0], count, "stats_cache");
+    assert_non_null(info);
+    assert_int_equal(info->ObjectSize, 1024);
+    assert_int_equal(info->Allocations, 40);
+    assert_int_equal(info->Frees, 10);
+    assert_int_equal(info->LiveObjects, 30);
+    assert_int_equal(info->PeakObjects, 40);
+
+    // The 40 allocations and the first free that needed a magazine missed, the
+    // frees went to the magazine. The objects in the magazine still occupy the slabs.
+    assert_int_equal(info->MagazineHits, 10);
+    assert_int_equal(info->MagazineMisses, 41);
+    assert_true(info->SlabCount * info->ObjectsPerSlab >= 40);
+    assert_true(info->PartialObjectsInUse <= info->PartialSlabCount * info->ObjectsPerSlab);
+    assert_int_equal(info->TotalBytes % 0x1000, 0);
+    assert_true(info->PaddingBytes < info->TotalBytes);
+    assert_true(info->PaddingBytes >= info->SlabCount * info->ObjectsPerSlab * info->ObjectPadding);
+
+    // Peak must stay at the high water mark
+    for (i = 10; i < 40; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    count = MemoryCacheQueryStatistics(&entries[0], 64);
+    info  = __FindCacheInfo(&entries[0], count, "stats_cache");
+    assert_non_null(info);
+    assert_int_equal(info->Frees, 40);
+    assert_int_equal(info->LiveObjects, 0);
+    assert_int_equal(info->PeakObjects, 40);
+
+    // The number of entries returned is limited by the caller
+    assert_int_equal(MemoryCacheQueryStatistics(&entries[0], 1), 1);
+
+    MemoryCacheDestroy(cache);
+    count = MemoryCacheQueryStatistics(&entries[0], 64);
+    assert_null(__FindCacheInfo(&entries[0], count, "stats_cache"));
+}
+
+void TestKmalloc_LargeAllocation(void** state)
+{
+    OSSystemHeapCacheInfo_t  entries[64];
+    OSSystemHeapCacheInfo_t* info;
+    uint8_t*                 large;
+    uint8_t*                 medium;
+    int                      count;
+    (void)state;
+
+    // 300KiB is 75 pages, which are committed in two batches
+    large = kmalloc(300 * 1024);
+    assert_non_null(large);
+    assert_int_equal((uintptr_t)large % PAGE_SIZE, 0);
+    assert_int_equal(g_testContext.MemorySpaceCommit.Calls, 2);
+    memset(large, 0xCC, 300 * 1024);
+
+    // Anything above 64KiB no longer uses the fixed caches
+    medium = kmalloc(100 * 1024);
+    assert_non_null(medium);
+    assert_int_equal(g_testContext.MemorySpaceCommit.Calls, 3);
+    memset(medium, 0xCC, 100 * 1024);
+
+    count = MemoryCacheQueryStatistics(&entries[0], 64);
+    info  = __FindCacheInfo(&entries[0], count, "kmalloc_large");
+    assert_non_null(info);
+    assert_int_equal(info->LiveObjects, 2);
+    assert_int_equal(info->TotalBytes, (75 + 25) * PAGE_SIZE);
+    assert_int_equal(info->PaddingBytes, 0);
+
+    kfree(large);
+    kfree(medium);
+    assert_true(g_testContext.MemorySpaceUnmap.Calls >= 2);
+
+    count = MemoryCacheQueryStatistics(&entries[0], 64);
+    info  = __FindCacheInfo(&entries[0], count, "kmalloc_large");
+    assert_non_null(info);
+    assert_int_equal(info->LiveObjects, 0);
+    assert_int_equal(info->PeakObjects, 2);
+    assert_int_equal(info->TotalBytes, 0);
+    assert_int_equal(info->Frees, info->Allocations);
+}
+
+void TestKmalloc_LargeCommitFails(void** state)
+{
+    int unmapCalls;
+    (void)state;
+
+    // Make sure the tracking cache is populated, so the only unmap is the reservation
+    kfree(kmalloc(64));
+    unmapCalls = g_testContext.MemorySpaceUnmap.Calls;
+
+    g_testContext.MemorySpaceCommit.ReturnValue = OS_EOOM;
+    assert_null(kmalloc(512 * 1024));
+    assert_int_equal(g_testContext.MemorySpaceCommit.Calls, 1);
+    assert_int_equal(g_testContext.MemorySpaceUnmap.Calls, unmapCalls + 1);
+}
+
+void TestMemoryCacheReapTrigger_OnlyWhenLow(void** state)
+{
+    (void)state;
+
+    assert_int_equal(MemoryCacheInitializeReaper(), OS_EOK);
+
+    MemoryCacheReapTrigger();
+    assert_int_equal(g_testContext.FutexWake.Calls, 0);
+
+    // Drop below the low memory threshold, repeated triggers must
+    // only wake the reaper once
+    g_testContext.Machine.NumberOfFreeMemoryBlocks = 64;
+    MemoryCacheReapTrigger();
+    MemoryCacheReapTrigger();
+    assert_int_equal(g_testContext.FutexWake.Calls, 1);
+}
+
+struct __SmpWorker {
+    pthread_t      Thread;
+    uuid_t         CoreId;
+    MemoryCache_t* Cache;
+    int            Iterations;
+};
+
+#define SMP_BATCH_SIZE 16
+
+static void* __SmpWorkerMain(void* context)
+{
+    struct __SmpWorker* worker = context;
+    void*               objects[SMP_BATCH_SIZE];
+    int                 i, j;
+
+    g_coreId   = worker->CoreId;
+    g_threadId = worker->CoreId + 2;
+    for (i = 0; i < worker->Iterations; i++) {
+        for (j = 0; j < SMP_BATCH_SIZE; j++) {
+            objects[j] = worker->Cache ? MemoryCacheAllocate(worker->Cache) : kmalloc(128);
+            assert_non_null(objects[j]);
+        }
+        for (j = 0; j < SMP_BATCH_SIZE; j++) {
+            if (worker->Cache) {
+                MemoryCacheFree(worker->Cache, objects[j]);
+            } else {
+                kfree(objects[j]);
+            }
+        }
+    }
+    return NULL;
+}
+
+struct __SmpResult {
+    uint64_t OpsPerSecond;
+    int      Locks;
+    int      Contended;
+};
+
+static struct __SmpResult __BenchmarkSmp(const char* name, MemoryCache_t* cache)
+{
+    struct __SmpWorker workers[CORE_COUNT];
+    struct __SmpResult result;
+    const int          iterations = 20000;
+    uint64_t           start, end;
+    int                i;
+
+    memset(&g_testContext.MutexLock, 0, sizeof(struct __MutexLock));
+    start = __Now();
+    for (i = 0; i < CORE_COUNT; i++) {
+        workers[i].CoreId     = i;
+        workers[i].Cache      = cache;
+        workers[i].Iterations = iterations;
+        assert_int_equal(pthread_create(&workers[i].Thread, NULL, __SmpWorkerMain, &workers[i]), 0);
+    }
+    for (i = 0; i < CORE_COUNT; i++) {
+        pthread_join(workers[i].Thread, NULL);
+    }
+    end = __Now();
+
+    result.OpsPerSecond = ((uint64_t)CORE_COUNT * iterations * SMP_BATCH_SIZE * 2 * 1000000000ULL) / (end - start);
+    result.Locks        = g_testContext.MutexLock.Calls;
+    result.Contended    = g_testContext.MutexLock.Contended;
+    printf("%s: %i threads, %llu ops/s, %i cache lock acquisitions, %i contended\n",
+           name, CORE_COUNT, (unsigned long long)result.OpsPerSecond, result.Locks, result.Contended);
+    return result;
+}
+
+void TestMemoryCacheCpu_SmpBenchmark(void** state)
+{
+    MemoryCache_t*             slabCache;
+    MemoryCache_t*             magazineCache;
+    MemoryCacheCpuStatistics_t stats;
+    struct __SmpResult         slabResult;
+    struct __SmpResult         magazineResult;
+    (void)state;
+
+    slabCache     = MemoryCacheCreate("smp_slab_cache", 128, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    magazineCache = MemoryCacheCreate("smp_magazine_cache", 128, 0, 0, 0, NULL, NULL);
+    assert_non_null(slabCache);
+    assert_non_null(magazineCache);
+
+    // Make sure the default cache exists before the threads race to create it
+    kfree(kmalloc(128));
+
+    slabResult     = __BenchmarkSmp("slab layer only", slabCache);
+    magazineResult = __BenchmarkSmp("magazine layer", magazineCache);
+    (void)__BenchmarkSmp("kmalloc(128)", NULL);
+
+    MemoryCacheGetCpuStatistics(magazineCache, &stats);
+    printf("magazine layer: %llu hits, %llu misses, %llu depot exchanges, %llu depot contended\n",
+           (unsigned long long)stats.MagazineHits, (unsigned long long)stats.MagazineMisses,
+           (unsigned long long)stats.DepotExchanges, (unsigned long long)stats.DepotContention);
+
+    // The magazine layer must keep almost all operations away from the cache lock
+    assert_true(magazineResult.Locks * 100 < slabResult.Locks);
+    assert_true(stats.MagazineHits > stats.MagazineMisses * 100);
+
+    MemoryCacheDestroy(slabCache);
+    MemoryCacheDestroy(magazineCache);
+}
+
+void TestSlab_BitmapReusesHoles(void** state)
+{
+    MemoryCache_t* cache;
+    void*          objects[256];
+    int            count = 0;
+    int            i, j;
+    (void)state;
+
+    // A single slab makes it possible to know exactly which objects are free
+    cache = MemoryCacheCreate("bitmap_cache", 32, 0, 0,
+                              HEAP_SLAB_NO_ATOMIC_CACHE | HEAP_INITIAL_SLAB | HEAP_SINGLE_SLAB,
+                              NULL, NULL);
+    assert_non_null(cache);
+    while (count < 256 && (objects[count] = MemoryCacheAllocate(cache)) != NULL) {
+        for (j = 0; j < count; j++) {
+            assert_ptr_not_equal(objects[count], objects[j]);
+        }
+        count++;
+    }
+
+    // With 32 byte objects the slab spans more than one bitmap word
+    assert_true(count > 64 && count < 256);
+
+    // Punch holes into the slab, the same objects must be handed out again
+    for (i = 0; i < count; i += 3) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    for (i = 0; i < count; i += 3) {
+        void* object = MemoryCacheAllocate(cache);
+        for (j = 0; j < count; j += 3) {
+            if (objects[j] == object) {
+                break;
+            }
+        }
+        assert_true(j < count);
+    }
+    assert_null(MemoryCacheAllocate(cache));
+    MemoryCacheDestroy(cache);
+}
+
+void TestSlab_FreelistPoisonsObjects(void** state)
+{
+    MemoryCache_t* cache;
+    uint8_t*       objects[64];
+    int            count = 0;
+    int            i, j;
+    (void)state;
+
+    cache = MemoryCacheCreate("freelist_cache", 64, 0, 0,
+                              HEAP_SLAB_NO_ATOMIC_CACHE | HEAP_INITIAL_SLAB | HEAP_SINGLE_SLAB |
+                              HEAP_SLAB_FREELIST | HEAP_DEBUG_USE_AFTER_FREE,
+                              NULL, NULL);
+    assert_non_null(cache);
+    while (count < 64 && (objects[count] = MemoryCacheAllocate(cache)) != NULL) {
+        memset(objects[count], 0, 64);
+        count++;
+    }
+    assert_true(count > 1);
+
+    // Everything but the freelist link must be poisoned after free
+    for (i = 0; i < count; i++) {
+        MemoryCacheFree(cache, objects[i]);
+        for (j = sizeof(void*); j < 64; j++) {
+            assert_int_equal(objects[i][j], 0xA5);
+        }
+    }
+
+    // The freelist is last in, first out
+    for (i = count - 1; i >= 0; i--) {
+        assert_ptr_equal(MemoryCacheAllocate(cache), objects[i]);
+    }
+    MemoryCacheDestroy(cache);
+}
+
+static void __ConstructObject(struct MemoryCache* cache, void* object)
+{
+    (void)cache;
+    *((uint64_t*)object) = 0xC0FFEE;
+}
+
+void TestSlab_FreelistKeepsConstructedObjects(void** state)
+{
+    MemoryCache_t* cache;
+    uint64_t*      object;
+    (void)state;
+
+    // Caches with constructors must not use the freelist, as that would
+    // overwrite the constructed state of free objects
+    cache = MemoryCacheCreate("freelist_ctor_cache", 64, 0, 0,
+                              HEAP_SLAB_NO_ATOMIC_CACHE | HEAP_SLAB_FREELIST,
+                              __ConstructObject, NULL);
+    assert_non_null(cache);
+    object = MemoryCacheAllocate(cache);
+    assert_int_equal(*object, 0xC0FFEE);
+    MemoryCacheFree(cache, object);
+    object = MemoryCacheAllocate(cache);
+    assert_int_equal(*object, 0xC0FFEE);
+    MemoryCacheFree(cache, object);
+    MemoryCacheDestroy(cache);
+}
+
+static uint64_t __BenchmarkAllocate(unsigned int flags, int objectCount)
+{
+    MemoryCache_t* cache;
+    void**         objects;
+    uint64_t       start, end;
+    int            i;
+
+    objects = malloc(sizeof(void*) * objectCount);
+    assert_non_null(objects);
+
+    cache = MemoryCacheCreate("bench_alloc_cache", 32, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE | flags, NULL, NULL);
+    assert_non_null(cache);
+
+    // Create the slabs up front, and free every object again so that we
+    // only measure filling slabs and not creating them.
+    for (i = 0; i < objectCount; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+    }
+    for (i = 0; i < objectCount; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+
+    start = __Now();
+    for (i = 0; i < objectCount; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+    }
+    end = __Now();
+
+    MemoryCacheDestroy(cache);
+    free(objects);
+    return ((end - start) * 1000) / (uint64_t)objectCount;
+}
+
+void TestSlab_AllocateBenchmark(void** state)
+{
+    uint64_t bitmapCost;
+    uint64_t freelistCost;
+    (void)state;
+
+    bitmapCost   = __BenchmarkAllocate(0, 100000);
+    freelistCost = __BenchmarkAllocate(HEAP_SLAB_FREELIST, 100000);
+    printf("MemoryCacheAllocate (32 bytes): bitmap %llu.%03llu ns, freelist %llu.%03llu ns\n",
+           (unsigned long long)(bitmapCost / 1000), (unsigned long long)(bitmapCost % 1000),
+           (unsigned long long)(freelistCost / 1000), (unsigned long long)(freelistCost % 1000));
+
+    // A slab of 32 byte objects only has two bitmap words, so the word scan
+    // must be in the same ballpark as the freelist.
+    assert_true(bitmapCost <= (freelistCost * 4) + 50000);
+}
+
+static uint64_t __BenchmarkFree(int objectCount)
+{
+    MemoryCache_t* cache;
+    void**         objects;
+    uint64_t       start, end;
+    int            i;
+
+    objects = malloc(sizeof(void*) * objectCount);
+    assert_non_null(objects);
+
+    cache = MemoryCacheCreate("bench_cache", 256, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    assert_non_null(cache);
+    for (i = 0; i < objectCount; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        assert_non_null(objects[i]);
+    }
+
+    // Free from the oldest slab first, which is the worst case for
+    // anything that has to search the slab lists
+    start = __Now();
+    for (i = 0; i < objectCount; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    end = __Now();
+
+    MemoryCacheDestroy(cache);
+    free(objects);
+    return (end - start) / (uint64_t)objectCount;
+}
+
+void TestMemoryCacheFree_Benchmark(void** state)
+{
+    const int counts[] = { 1000, 10000, 100000 };
+    uint64_t  costs[3];
+    int       i;
+    (void)state;
+
+    for (i = 0; i < 3; i++) {
+        costs[i] = __BenchmarkFree(counts[i]);
+        printf("MemoryCacheFree: %i objects, %llu ns/free\n",
+               counts[i], (unsigned long long)costs[i]);
+    }
+
+    // The cost of freeing must not grow with the number of slabs, allow
+    // plenty of slack for noise on the build machine.
+    assert_true(costs[2] <= (costs[0] * 4) + 50);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestKfree_ReusesObject, SetupTest),
+            cmocka_unit_test_setup(TestKfree_RoutesToCorrectCache, SetupTest),
+            cmocka_unit_test_setup(TestKfree_ManySlabs, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheFree_CustomCache, SetupTest),
+            cmocka_unit_test_setup(TestKmalloc_LargeAllocation, SetupTest),
+            cmocka_unit_test_setup(TestKmalloc_LargeCommitFails, SetupTest),
+            cmocka_unit_test_setup(TestSlab_BitmapReusesHoles, SetupTest),
+            cmocka_unit_test_setup(TestSlab_FreelistPoisonsObjects, SetupTest),
+            cmocka_unit_test_setup(TestSlab_FreelistKeepsConstructedObjects, SetupTest),
+            cmocka_unit_test_setup(TestSlab_AllocateBenchmark, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheReap_ReleasesFreeSlabs, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheReap_KeepsUsedSlabs, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheReap_FlushesMagazines, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheCpu_InterruptContext, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheQueryStatistics_TracksUsage, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheCpu_SmpBenchmark, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheReapTrigger_OnlyWhenLow, SetupTest),
+            cmocka_unit_test_setup(TestMemoryCacheFree_Benchmark, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, Setup, Teardown);
+}
+
+size_t GetMemorySpacePageSize(void) {
+    return g_testContext.Machine.MemoryGranularity;
+}
+
+SystemMachine_t* GetMachine(void) {
+    return &g_testContext.Machine;
+}
+
+MemorySpace_t* GetCurrentMemorySpace(void) {
+    return &g_testContext.MemorySpace;
+}
+
+uuid_t ArchGetProcessorCoreId(void) {
+    return g_coreId;
+}
+
+irqstate_t InterruptDisable(void) {
+    return g_interruptsDisabled++;
+}
+
+irqstate_t InterruptRestoreState(irqstate_t state) {
+    assert_int_equal(g_interruptsDisabled, state + 1);
+    g_interruptsDisabled = (int)state;
+    return state;
+}
+
+int InterruptIsDisabled(void) {
+    return g_interruptsDisabled != 0;
+}
+
+void SpinlockConstruct(Spinlock_t* spinlock) {
+    assert_non_null(spinlock);
+    atomic_store(&spinlock->Current, 0);
+    atomic_store(&spinlock->Next, 0);
+}
+
+void SpinlockAcquireIrq(Spinlock_t* spinlock) {
+    irqstate_t   irqState = InterruptDisable();
+    unsigned int ticket   = atomic_fetch_add(&spinlock->Next, 1);
+    while (atomic_load(&spinlock->Current) != ticket) {
+        sched_yield();
+    }
+    spinlock->IrqState = irqState;
+}
+
+void SpinlockReleaseIrq(Spinlock_t* spinlock) {
+    irqstate_t irqState = spinlock->IrqState;
+    atomic_fetch_add(&spinlock->Current, 1);
+    InterruptRestoreState(irqState);
+}
+
+SystemCpuCore_t* GetProcessorCore(uuid_t coreId) {
+    // Only the pointer value matters, the core structure is opaque
+    return (SystemCpuCore_t*)&g_testContext.Machine;
+}
+
+SystemCpuState_t CpuCoreState(SystemCpuCore_t* cpuCore) {
+    assert_non_null(cpuCore);
+    return CpuStateRunning;
+}
+
+oserr_t TxuMessageSend(
+        _In_ uuid_t                  coreId,
+        _In_ SystemCpuFunctionType_t type,
+        _In_ TxuFunction_t           function,
+        _In_ void*                   argument,
+        _In_ int                     asynchronous)
+{
+    uuid_t previousCore = g_coreId;
+    assert_int_not_equal(coreId, previousCore);
+    assert_int_equal(type, CpuFunctionCustom);
+    g_testContext.TxuMessageSend.Calls++;
+
+    // Execute the function as if we were the target core
+    g_coreId = coreId;
+    function(argument);
+    g_coreId = previousCore;
+    return OS_EOK;
+}
+
+void SystemTimerGetWallClockTime(OSTimestamp_t* time) {
+    memset(time, 0, sizeof(OSTimestamp_t));
+}
+
+oserr_t SchedulerSleep(OSTimestamp_t* deadline) {
+    return OS_EOK;
+}
+
+oserr_t ThreadCreate(
+        _In_  const char*  name,
+        _In_  ThreadEntry_t entry,
+        _In_  void*         arguments,
+        _In_  unsigned int  flags,
+        _In_  uuid_t        memorySpaceHandle,
+        _In_  size_t        kernelMaxStackSize,
+        _In_  size_t        userMaxStackSize,
+        _Out_ uuid_t*       handle)
+{
+    assert_non_null(entry);
+    *handle = 1;
+    return OS_EOK;
+}
+
+oserr_t FutexWait(
+        _In_ OSAsyncContext_t* asyncContext,
+        _In_ _Atomic(int)*     futex,
+        _In_ int               expectedValue,
+        _In_ int               flags,
+        _In_ _Atomic(int)*     futex2,
+        _In_ int               count,
+        _In_ int               operation,
+        _In_ OSTimestamp_t*    deadline)
+{
+    return OS_ETIMEOUT;
+}
+
+oserr_t FutexWake(
+        _In_ _Atomic(int)* futex,
+        _In_ int           count,
+        _In_ int           flags)
+{
+    g_testContext.FutexWake.Calls++;
+    return OS_EOK;
+}
+
+void MutexConstruct(Mutex_t* mutex, unsigned int configuration) {
+    assert_non_null(mutex);
+    atomic_store(&mutex->Owner, UUID_INVALID);
+    mutex->ReferenceCount = 0;
+}
+
+// A recursive spinning mutex, so the heap can be exercised by multiple
+// threads, and we can count how often the cache locks are contended.
+void MutexLock(Mutex_t* mutex) {
+    uuid_t expected = UUID_INVALID;
+    assert_non_null(mutex);
+
+    if (atomic_load(&mutex->Owner) == g_threadId) {
+        mutex->ReferenceCount++;
+        return;
+    }
+
+    atomic_fetch_add(&g_testContext.MutexLock.Calls, 1);
+    if (!atomic_compare_exchange_strong(&mutex->Owner, &expected, g_threadId)) {
+        atomic_fetch_add(&g_testContext.MutexLock.Contended, 1);
+        do {
+            sched_yield();
+            expected = UUID_INVALID;
+        } while (!atomic_compare_exchange_weak(&mutex->Owner, &expected, g_threadId));
+    }
+    mutex->ReferenceCount = 1;
+}
+
+void MutexUnlock(Mutex_t* mutex) {
+    assert_non_null(mutex);
+    assert_int_equal(atomic_load(&mutex->Owner), g_threadId);
+    if (--mutex->ReferenceCount == 0) {
+        atomic_store(&mutex->Owner, UUID_INVALID);
+    }
+}
+
+oserr_t MemorySpaceMap(
+        _In_  MemorySpace_t*                memorySpace,
+        _In_  struct MemorySpaceMapOptions* options,
+        _Out_ vaddr_t*                      mappingOut)
+{
+    size_t offset;
+    assert_non_null(memorySpace);
+    assert_non_null(options);
+    assert_non_null(mappingOut);
+    assert_int_equal(options->PlacementFlags, MAPPING_VIRTUAL_GLOBAL);
+    assert_int_equal(options->Length % PAGE_SIZE, 0);
+
+    atomic_fetch_add(&g_testContext.MemorySpaceMap.Calls, 1);
+    if (g_testContext.MemorySpaceMap.ReturnValue != OS_EOK) {
+        return g_testContext.MemorySpaceMap.ReturnValue;
+    }
+
+    offset = atomic_fetch_add(&g_testContext.ArenaUsed, options->Length);
+    if (offset + options->Length > ARENA_SIZE) {
+        return OS_EOOM;
+    }
+    *mappingOut = (vaddr_t)&g_testContext.Arena[offset];
+    return OS_EOK;
+}
+
+oserr_t MemorySpaceUnmap(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ size_t         size)
+{
+    assert_non_null(memorySpace);
+    assert_true(address >= (vaddr_t)g_testContext.Arena);
+    assert_true(address + size <= (vaddr_t)g_testContext.Arena + ARENA_SIZE);
+    atomic_fetch_add(&g_testContext.MemorySpaceUnmap.Calls, 1);
+    return OS_EOK;
+}
+
+oserr_t MemorySpaceCommit(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ uintptr_t*     physicalAddressValues,
+        _In_ size_t         size,
+        _In_ size_t         pageMask,
+        _In_ unsigned int   placementFlags)
+{
+    assert_non_null(memorySpace);
+    assert_non_null(physicalAddressValues);
+    assert_true(address >= (vaddr_t)g_testContext.Arena);
+    assert_true(address + size <= (vaddr_t)g_testContext.Arena + ARENA_SIZE);
+    assert_int_equal(size % PAGE_SIZE, 0);
+    atomic_fetch_add(&g_testContext.MemorySpaceCommit.Calls, 1);
+    return g_testContext.MemorySpaceCommit.ReturnValue;
+}
+
+oserr_t GetMemorySpaceMapping(
+        _In_  MemorySpace_t* memorySpace,
+        _In_  vaddr_t        address,
+        _In_  int            pageCount,
+        _Out_ uintptr_t*     dmaVectorOut)
+{
+    assert_non_null(memorySpace);
+    assert_non_null(dmaVectorOut);
+    for (int i = 0; i < pageCount; i++) {
+        dmaVectorOut[i] = address + (i * PAGE_SIZE);
+    }
+    return OS_EOK;
+}
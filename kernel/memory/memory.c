@@ -30,6 +30,10 @@
 
 #define KERNEL_MAPPING_PAGECOUNT 2
 
+// Each region reserves up to 64MB (with 4KB pages) for contiguous allocations, but never
+// more than half of the memory chunk it is taken from.
+#define MEMORY_BUDDY_ZONE_PAGES 16384
+
 struct MemoryBootContext {
     // keep identity mappings, so we can remap them afterwards
     // we need 5 for memory masks, and 1 for GA
@@ -39,6 +43,10 @@ struct MemoryBootContext {
     uintptr_t               BootMemoryStart;
 };
 
+// The bitmaps of the buddy zones are kept in the kernel image, so they don't
+// need to be relocated when we switch away from the identity mappings.
+static uint64_t g_buddyStorage[MEMORY_MASK_COUNT][MEMORY_BUDDY_STORAGE_WORDS(MEMORY_BUDDY_ZONE_PAGES)];
+
 static PlatformMemoryMapping_t* g_kernelMappings        = NULL;
 static int                      g_kernelMappingIndex    = 0;
 static int                      g_kernelMappingCapacity = 0;
@@ -49,7 +57,7 @@ static oserr_t __AllocateIdentity(struct MemoryBootContext*, size_t, void**);
 static void
 __PrintMemoryUsage(void) {
     size_t maxBlocks       = READ_VOLATILE(GetMachine()->NumberOfMemoryBlocks);
-    size_t freeBlocks      = READ_VOLATILE(GetMachine()->NumberOfFreeMemoryBlocks);
+    size_t freeBlocks      = atomic_load(&GetMachine()->NumberOfFreeMemoryBlocks);
     size_t allocatedBlocks = maxBlocks - freeBlocks;
     size_t memoryInUse     = ((size_t)allocatedBlocks * (size_t)GetMemorySpacePageSize());
 
@@ -78,6 +86,22 @@ __GetAvailablePhysicalMemory(
     return memorySize;
 }
 
+static uintptr_t
+__GetHighestPhysicalAddress(
+        _In_ struct VBoot* bootInformation)
+{
+    struct VBootMemoryEntry* entries;
+    uintptr_t                highestAddress = 0;
+
+    entries = (struct VBootMemoryEntry*)bootInformation->Memory.Entries;
+    for (unsigned int i = 0; i < bootInformation->Memory.NumberOfEntries; i++) {
+        if (entries[i].Type == VBootMemoryType_Available) {
+            highestAddress = MAX(highestAddress, (uintptr_t)(entries[i].PhysicalBase + entries[i].Length));
+        }
+    }
+    return highestAddress;
+}
+
 static oserr_t
 __AddKernelMapping(
         _In_ paddr_t physicalBase,
@@ -268,7 +292,7 @@ MachineAllocateBootMemory(
         blockCount -= pagesAllocated;
 
         // keep the number of free blocks in the machine stats up to date here
-        GetMachine()->NumberOfFreeMemoryBlocks -= (size_t)pagesAllocated;
+        atomic_fetch_sub(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)pagesAllocated);
     }
 
     if (osStatus == OS_EOK) {
@@ -330,6 +354,40 @@ __InitializePhysicalMemory(
     return OS_EOK;
 }
 
+static void
+__FillRegion(
+        _In_ SystemMemoryAllocatorRegion_t* region,
+        _In_ int                            regionIndex,
+        _In_ uintptr_t                      baseAddress,
+        _In_ int                            blockCount,
+        _In_ size_t                         pageSize)
+{
+    size_t    zoneAlignment = pageSize << MEMORY_BUDDY_MAX_ORDER;
+    uintptr_t zoneBase      = (baseAddress + (zoneAlignment - 1)) & ~(zoneAlignment - 1);
+    int       skipped       = (int)((zoneBase - baseAddress) / pageSize);
+    int       zoneBlocks;
+
+    // The first chunk of the region that is large enough becomes the buddy zone
+    zoneBlocks = MIN(MEMORY_BUDDY_ZONE_PAGES, (blockCount - skipped) / 2);
+    if (region->Buddy.block_count || skipped >= blockCount || zoneBlocks < (1 << MEMORY_BUDDY_MAX_ORDER)) {
+        MemoryStackPush(&region->Stack, baseAddress, blockCount);
+        return;
+    }
+
+    TRACE("__FillRegion buddy zone for region %i: 0x%" PRIxIN " (%i pages)",
+          regionIndex, zoneBase, zoneBlocks);
+    MemoryBuddyConstruct(&region->Buddy, zoneBase, pageSize, zoneBlocks, &g_buddyStorage[regionIndex][0]);
+    MemoryBuddyFree(&region->Buddy, zoneBase, zoneBlocks);
+    if (skipped) {
+        MemoryStackPush(&region->Stack, baseAddress, skipped);
+    }
+    MemoryStackPush(
+            &region->Stack,
+            zoneBase + (zoneBlocks * pageSize),
+            blockCount - skipped - zoneBlocks
+    );
+}
+
 static void
 __FillPhysicalMemory(
         _In_ struct MemoryBootContext* bootContext,
@@ -376,10 +434,10 @@ __FillPhysicalMemory(
                 maskSize      = (physicalMemory->Masks[j] - baseAddress) + 1;
                 sizeAvailable = MIN(maskSize, length);
                 blockCount    = (int)(sizeAvailable / pageSize);
-                MemoryStackPush(&physicalMemory->Region[j].Stack, baseAddress, blockCount);
+                __FillRegion(&physicalMemory->Region[j], j, baseAddress, blockCount, pageSize);
 
                 // add statistics so we can keep track of free memory
-                GetMachine()->NumberOfFreeMemoryBlocks += (size_t)blockCount;
+                atomic_fetch_add(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)blockCount);
 
                 // adjust base and length
                 baseAddress += sizeAvailable;
@@ -478,6 +536,7 @@ MachineMemoryInitialize(
     struct MemoryBootContext      bootContext;
     PlatformMemoryConfiguration_t configuration;
     size_t                        memorySize;
+    uintptr_t                     highestAddress;
     oserr_t                       oserr;
     TRACE("MachineMemoryInitialize()");
 
@@ -492,6 +551,9 @@ MachineMemoryInitialize(
         return OS_EINVALPARAMS;
     }
 
+    // The memory map is not accessible after switching address space
+    highestAddress = __GetHighestPhysicalAddress(&machine->BootInformation);
+
     // Get fixed virtual memory layout and platform page size
     MmuGetMemoryConfiguration(&configuration);
 
@@ -589,6 +651,12 @@ MachineMemoryInitialize(
     // Initialize the slab allocator now that subsystems are up
     MemoryCacheInitialize();
 
+    // The reference counters of the physical pages are needed before any pages can be shared
+    oserr = PhysicalMemoryReferencesInitialize(highestAddress);
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
     __PrintMemoryUsage();
     return OS_EOK;
 }
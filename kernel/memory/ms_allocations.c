@@ -16,9 +16,9 @@
  */
 
 #include <debug.h>
-#include <ds/list.h>
 #include <heap.h>
 #include <mutex.h>
+#include <string.h>
 #include "private.h"
 
 static void
@@ -75,7 +75,7 @@ MSAllocationCreate(
         goto exit;
     }
 
-    ELEMENT_INIT(&allocation->Header, 0, allocation);
+    INTERVAL_NODE_INIT(&allocation->Header, address, address + (pageCount * pageSize), allocation);
     bitmap_construct(&allocation->Pages, (int)pageCount, bitmap);
     allocation->MemorySpace = memorySpace;
     allocation->SHMTag      = shmTag;
@@ -84,6 +84,7 @@ MSAllocationCreate(
     allocation->Flags       = flags;
     allocation->References  = 1;
     allocation->CloneOf     = NULL;
+    memset(&allocation->FaultAround, 0, sizeof(struct MSFaultAround));
     MSContextAddAllocation(memorySpace->Context, allocation);
 
 exit:
@@ -95,13 +96,11 @@ __FindAllocation(
         _In_ struct MSContext* context,
         _In_ vaddr_t           address)
 {
-    foreach(element, &context->Allocations) {
-        struct MSAllocation* allocation = element->value;
-        if (ISINRANGE(address, allocation->Address, allocation->Address + allocation->Length)) {
-            return allocation;
-        }
+    interval_node_t* node = interval_tree_lookup(&context->Allocations, address);
+    if (node == NULL) {
+        return NULL;
     }
-    return NULL;
+    return node->value;
 }
 
 struct MSAllocation*
@@ -152,7 +151,7 @@ MSAllocationRelease(
     MutexLock(&context->SyncObject);
     allocation->References--;
     if (!allocation->References) {
-        list_remove(&context->Allocations, &allocation->Header);
+        interval_tree_remove(&context->Allocations, &allocation->Header);
         __MSAllocationDelete(allocation);
     }
     MutexUnlock(&context->SyncObject);
@@ -210,7 +209,7 @@ MSAllocationFree(
 
     // Are we now fully freed?
     if (bitmap_bits_clear_count(&allocation->Pages) == 0) {
-        list_remove(&context->Allocations, &allocation->Header);
+        interval_tree_remove(&context->Allocations, &allocation->Header);
         __MSAllocationDelete(allocation);
         oserr = OS_EOK;
     } else {
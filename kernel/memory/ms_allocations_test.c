@@ -20,7 +20,9 @@
 #include <stdarg.h>
 #include <cmocka.h>
 #include "private.h"
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 static struct __TestContext {
     int                  MSContextAddAllocationCalls;
@@ -43,15 +45,18 @@ int Teardown(void** state) {
 int SetupTest(void** state) {
     (void)state;
     memset(&g_testContext, 0, sizeof(struct __TestContext));
-    list_construct(&g_testContext.MSContext.Allocations);
+    interval_tree_construct(&g_testContext.MSContext.Allocations);
     return 0;
 }
 
-static void __CleanupAllocation(element_t* element, void* context) {
-    (void)context;
-    struct MSAllocation* allocation = (struct MSAllocation*)element;
-    test_free(allocation->Pages.data);
-    test_free(allocation);
+static void __CleanupAllocations(void) {
+    interval_node_t* node;
+    while ((node = interval_tree_minimum(&g_testContext.MSContext.Allocations)) != NULL) {
+        struct MSAllocation* allocation = node->value;
+        interval_tree_remove(&g_testContext.MSContext.Allocations, node);
+        test_free(allocation->Pages.data);
+        test_free(allocation);
+    }
 }
 
 void TestMSAllocationCreate_Happy(void** state)
@@ -87,7 +92,7 @@ void TestMSAllocationCreate_Happy(void** state)
     assert_int_equal(g_testContext.MutexUnlockCalls, 0);
 
     // cleanup allocations made
-    list_clear(&g_testContext.MSContext.Allocations, __CleanupAllocation, NULL);
+    __CleanupAllocations();
 }
 
 void TestMSAllocationCreate_NonPageAlignedLengthHappy(void** state)
@@ -123,7 +128,7 @@ void TestMSAllocationCreate_NonPageAlignedLengthHappy(void** state)
     assert_int_equal(g_testContext.MutexUnlockCalls, 0);
 
     // cleanup allocations made
-    list_clear(&g_testContext.MSContext.Allocations, __CleanupAllocation, NULL);
+    __CleanupAllocations();
 }
 
 void TestMSAllocationCreate_MissingContext(void** state)
@@ -210,7 +215,7 @@ void TestMSAllocationLookup_Happy(void** state)
     assert_int_equal(g_testContext.MutexUnlockCalls, 3);
 
     // cleanup allocations made
-    list_clear(&g_testContext.MSContext.Allocations, __CleanupAllocation, NULL);
+    __CleanupAllocations();
 }
 
 void TestMSAllocationLookup_InvalidContext(void** state)
@@ -252,7 +257,7 @@ void TestMSAllocationAcquire_Happy(void** state)
     assert_int_equal(allocation->References, 2);
 
     // cleanup allocations made
-    list_clear(&g_testContext.MSContext.Allocations, __CleanupAllocation, NULL);
+    __CleanupAllocations();
 }
 
 void TestMSAllocationAcquire_InvalidContext(void** state)
@@ -336,7 +341,7 @@ void TestMSAllocationFree_PartialFree(void** state)
 
     // Inspect the bitmap to ensure that the free call calculated the
     // correct bits to clear
-    clonedFrom = (struct MSAllocation*)g_testContext.MSContext.Allocations.head;
+    clonedFrom = interval_tree_minimum(&g_testContext.MSContext.Allocations)->value;
     assert_int_equal(bitmap_bits_set(&clonedFrom->Pages, 1, 1), 1);
     assert_int_equal(bitmap_bits_clear(&clonedFrom->Pages, 0, 1), 1);
     assert_int_equal(bitmap_bits_clear(&clonedFrom->Pages, 2, 2), 1);
@@ -501,7 +506,7 @@ void TestMSAllocationLink_Happy(void** state)
     assert_int_equal(g_testContext.MutexUnlockCalls, 1);
 
     // cleanup allocations made
-    list_clear(&g_testContext.MSContext.Allocations, __CleanupAllocation, NULL);
+    __CleanupAllocations();
 }
 
 void TestMSAllocationLink_InvalidContext(void** state)
@@ -531,6 +536,157 @@ void TestMSAllocationLink_InvalidAddress(void** state)
     assert_int_equal(g_testContext.MutexUnlockCalls, 1);
 }
 
+void TestMSAllocationLookup_ManyAllocations(void** state)
+{
+    MemorySpace_t memorySpace = {
+            .Context = &g_testContext.MSContext
+    };
+    struct MSAllocation* clonedFrom;
+    (void)state;
+
+    // Allocations of 1-4 pages, each followed by a one page gap. Create them
+    // out of order, so the tree has to rebalance.
+    for (int i = 0; i < 1000; i++) {
+        int     index = (i * 7) % 1000;
+        vaddr_t base  = 0x100000 + (index * 0x5000);
+        assert_int_equal(MSAllocationCreate(&memorySpace, UUID_INVALID, base, ((index % 4) + 1) * 0x1000, 0), OS_EOK);
+    }
+    assert_int_equal(interval_tree_count(&g_testContext.MSContext.Allocations), 1000);
+
+    for (int i = 0; i < 1000; i++) {
+        vaddr_t              base   = 0x100000 + (i * 0x5000);
+        size_t               length = ((i % 4) + 1) * 0x1000;
+        struct MSAllocation* allocation;
+
+        allocation = MSAllocationLookup(&g_testContext.MSContext, base);
+        assert_non_null(allocation);
+        assert_int_equal(allocation->Address, base);
+        allocation = MSAllocationLookup(&g_testContext.MSContext, base + length - 1);
+        assert_non_null(allocation);
+        assert_int_equal(allocation->Address, base);
+        assert_null(MSAllocationLookup(&g_testContext.MSContext, base + length));
+    }
+
+    // Free every other allocation, and make sure the others are still found
+    for (int i = 0; i < 1000; i += 2) {
+        vaddr_t base = 0x100000 + (i * 0x5000);
+        assert_int_equal(MSAllocationFree(&g_testContext.MSContext, base, ((i % 4) + 1) * 0x1000, &clonedFrom), OS_EOK);
+    }
+    assert_int_equal(interval_tree_count(&g_testContext.MSContext.Allocations), 500);
+    for (int i = 0; i < 1000; i++) {
+        vaddr_t              base       = 0x100000 + (i * 0x5000);
+        struct MSAllocation* allocation = MSAllocationLookup(&g_testContext.MSContext, base);
+        if (i & 1) {
+            assert_non_null(allocation);
+            assert_int_equal(allocation->Address, base);
+        } else {
+            assert_null(allocation);
+        }
+    }
+    __CleanupAllocations();
+}
+
+static uint32_t g_seed = 0x12345678;
+
+static uint32_t __Random(void) {
+    g_seed = (g_seed * 1103515245U) + 12345U;
+    return g_seed >> 8;
+}
+
+void TestMSAllocationTree_OverlapQueries(void** state)
+{
+    interval_tree_t  tree;
+    interval_node_t* nodes;
+    const int        nodeCount = 2000;
+    (void)state;
+
+    // The allocation tree supports overlapping ranges as well, check the range
+    // queries against a brute force scan while ranges are inserted and removed.
+    nodes = test_malloc(sizeof(interval_node_t) * nodeCount);
+    assert_non_null(nodes);
+    interval_tree_construct(&tree);
+    for (int i = 0; i < nodeCount; i++) {
+        uintptr_t start = __Random() % 100000;
+        INTERVAL_NODE_INIT(&nodes[i], start, start + 1 + (__Random() % 2000), &nodes[i]);
+        interval_tree_insert(&tree, &nodes[i]);
+    }
+
+    for (int round = 0; round < 2; round++) {
+        for (int q = 0; q < 500; q++) {
+            uintptr_t        start = __Random() % 102000;
+            uintptr_t        end   = start + 1 + (__Random() % 500);
+            uintptr_t        lastStart = 0;
+            int              expected = 0;
+            int              found    = 0;
+            interval_node_t* node;
+
+            for (int i = 0; i < nodeCount; i++) {
+                if (nodes[i].parent != NULL || tree.root == &nodes[i]) {
+                    if (nodes[i].start < end && nodes[i].end > start) {
+                        expected++;
+                    }
+                }
+            }
+
+            node = interval_tree_first_overlap(&tree, start, end);
+            while (node != NULL) {
+                assert_true(node->start < end && node->end > start);
+                assert_true(node->start >= lastStart);
+                lastStart = node->start;
+                found++;
+                node = interval_tree_next_overlap(&tree, node, start, end);
+            }
+            assert_int_equal(found, expected);
+        }
+
+        // Remove every other node before running the queries again
+        if (round == 0) {
+            for (int i = 0; i < nodeCount; i += 2) {
+                interval_tree_remove(&tree, &nodes[i]);
+            }
+            assert_int_equal(interval_tree_count(&tree), nodeCount / 2);
+        }
+    }
+    test_free(nodes);
+}
+
+static double
+__BenchmarkLookups(int allocationCount, int lookupCount)
+{
+    MemorySpace_t memorySpace = {
+            .Context = &g_testContext.MSContext
+    };
+    struct timespec start, end;
+
+    for (int i = 0; i < allocationCount; i++) {
+        assert_int_equal(MSAllocationCreate(&memorySpace, UUID_INVALID, 0x100000 + ((vaddr_t)i * 0x3000), 0x2000, 0), OS_EOK);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < lookupCount; i++) {
+        int     index   = (int)(__Random() % (uint32_t)allocationCount);
+        vaddr_t address = 0x100000 + ((vaddr_t)index * 0x3000) + 0x1800;
+        assert_non_null(MSAllocationLookup(&g_testContext.MSContext, address));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __CleanupAllocations();
+    return ((double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec)) / lookupCount;
+}
+
+void TestMSAllocationLookup_ScalingBenchmark(void** state)
+{
+    const int counts[] = { 100, 10000, 50000, 100000 };
+    (void)state;
+
+    // The cost of a lookup should grow with the depth of the tree, and not with the
+    // number of allocations like the list it replaced.
+    for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+        double cost = __BenchmarkLookups(counts[i], 200000);
+        printf("%6i allocations: %.1f ns per lookup\n", counts[i], cost);
+    }
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
@@ -551,6 +707,9 @@ int main(void)
             cmocka_unit_test_setup(TestMSAllocationLink_Happy, SetupTest),
             cmocka_unit_test_setup(TestMSAllocationLink_InvalidContext, SetupTest),
             cmocka_unit_test_setup(TestMSAllocationLink_InvalidAddress, SetupTest),
+            cmocka_unit_test_setup(TestMSAllocationLookup_ManyAllocations, SetupTest),
+            cmocka_unit_test_setup(TestMSAllocationTree_OverlapQueries, SetupTest),
+            cmocka_unit_test_setup(TestMSAllocationLookup_ScalingBenchmark, SetupTest),
     };
     return cmocka_run_group_tests(tests, Setup, Teardown);
 }
@@ -561,7 +720,7 @@ void MSContextAddAllocation(struct MSContext* context, struct MSAllocation* allo
     assert_non_null(allocation);
 
     g_testContext.MSContextAddAllocationCalls++;
-    list_append(&context->Allocations, &allocation->Header);
+    interval_tree_insert(&context->Allocations, &allocation->Header);
 
     if (g_testContext.Expected != NULL) {
         assert_ptr_equal(allocation->MemorySpace, g_testContext.Expected->MemorySpace);
@@ -0,0 +1,133 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Address Space Ids
+ *   - Each core tags the TLB entries of the memory spaces it runs with a small set of ids,
+ *     so switching between them does not have to flush the TLB. Ids are handed out per core
+ *     and recycled in least recently used order.
+ */
+
+#include "private.h"
+
+// Generations wrap around, so they are compared by their distance
+#define __GENERATION_BEFORE(a, b) ((intptr_t)((a) - (b)) < 0)
+
+void
+MSAsidInitialize(
+        _In_ struct MSAsidCore* core)
+{
+    for (int i = 0; i < MS_ASID_SLOTS; i++) {
+        core->Slots[i].SpaceId    = 0;
+        core->Slots[i].Generation = 0;
+        core->Slots[i].LastUsed   = 0;
+    }
+    core->Current         = -1;
+    core->Clock           = 0;
+    core->SwitchesKept    = 0;
+    core->SwitchesFlushed = 0;
+}
+
+static int
+__FindSlot(
+        _In_ struct MSAsidCore* core,
+        _In_ size_t             spaceId)
+{
+    int victim = 0;
+
+    for (int i = 0; i < MS_ASID_SLOTS; i++) {
+        if (core->Slots[i].SpaceId == spaceId) {
+            return i;
+        }
+        if (core->Slots[i].LastUsed < core->Slots[victim].LastUsed) {
+            victim = i;
+        }
+    }
+
+    // Recycle the least recently used slot, empty slots were never used
+    core->Slots[victim].SpaceId = spaceId;
+    return -(victim + 1);
+}
+
+int
+MSAsidAssign(
+        _In_  struct MSAsidCore* core,
+        _In_  size_t             spaceId,
+        _In_  size_t             generation,
+        _Out_ bool*              flushOut)
+{
+    struct MSAsidSlot* slot;
+    int                index;
+
+    if (spaceId == 0) {
+        core->Current = -1;
+        core->SwitchesFlushed++;
+        *flushOut = true;
+        return 0;
+    }
+
+    index = __FindSlot(core, spaceId);
+    if (index < 0) {
+        // The entries left by the previous owner of the slot must go
+        index = -(index + 1);
+        slot  = &core->Slots[index];
+        *flushOut = true;
+    } else {
+        slot = &core->Slots[index];
+        *flushOut = __GENERATION_BEFORE(slot->Generation, generation);
+    }
+
+    if (*flushOut) {
+        core->SwitchesFlushed++;
+    } else {
+        core->SwitchesKept++;
+    }
+    slot->Generation = generation;
+    slot->LastUsed   = ++core->Clock;
+    core->Current    = index;
+    return index + 1;
+}
+
+enum MSAsidFlush
+MSAsidSynchronize(
+        _In_ struct MSAsidCore* core,
+        _In_ size_t             syncGeneration,
+        _In_ size_t             currentGeneration)
+{
+    struct MSAsidSlot* slot;
+
+    // Untagged memory spaces are flushed on every switch, so only the changed range
+    // can be stale.
+    if (core->Current < 0) {
+        return MSAsidFlushRange;
+    }
+
+    // If the slot was synchronized with the generation, or a later one, then it was
+    // loaded or flushed after the change was made.
+    slot = &core->Slots[core->Current];
+    if (!__GENERATION_BEFORE(slot->Generation, syncGeneration)) {
+        return MSAsidFlushNone;
+    }
+
+    // If the slot is exactly one generation behind, this is the only change it has
+    // missed. Otherwise it has missed the ranges of other synchronizations too, which
+    // could have been skipped while the core had another address space id loaded.
+    if (slot->Generation + 1 == syncGeneration) {
+        slot->Generation = syncGeneration;
+        return MSAsidFlushRange;
+    }
+    slot->Generation = currentGeneration;
+    return MSAsidFlushFull;
+}
@@ -0,0 +1,171 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <machine.h>
+#include "private.h"
+#include <string.h>
+
+static struct MSAsidCore g_core;
+
+int Setup(void** state) {
+    (void)state;
+    return 0;
+}
+
+int Teardown(void** state) {
+    (void)state;
+    return 0;
+}
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_core, 0xFF, sizeof(struct MSAsidCore));
+    MSAsidInitialize(&g_core);
+    return 0;
+}
+
+void TestMSAsidAssign_KeepsEntries(void** state)
+{
+    bool flush;
+    int  asidA, asidB;
+    (void)state;
+
+    // The first time a memory space is seen on the core, the id must be flushed
+    asidA = MSAsidAssign(&g_core, 100, 0, &flush);
+    assert_int_not_equal(asidA, 0);
+    assert_true(flush);
+
+    asidB = MSAsidAssign(&g_core, 200, 0, &flush);
+    assert_int_not_equal(asidB, 0);
+    assert_int_not_equal(asidB, asidA);
+    assert_true(flush);
+
+    // Switching back keeps the entries of both
+    assert_int_equal(MSAsidAssign(&g_core, 100, 0, &flush), asidA);
+    assert_false(flush);
+    assert_int_equal(MSAsidAssign(&g_core, 200, 0, &flush), asidB);
+    assert_false(flush);
+
+    assert_int_equal(g_core.SwitchesFlushed, 2);
+    assert_int_equal(g_core.SwitchesKept, 2);
+}
+
+void TestMSAsidAssign_Untagged(void** state)
+{
+    bool flush = false;
+    (void)state;
+
+    // Memory spaces without an id always flush, and can't be synchronized by generation
+    assert_int_equal(MSAsidAssign(&g_core, 0, 0, &flush), 0);
+    assert_true(flush);
+    assert_int_equal(g_core.Current, -1);
+    assert_int_equal(MSAsidSynchronize(&g_core, 1, 1), MSAsidFlushRange);
+}
+
+void TestMSAsidAssign_Stale(void** state)
+{
+    bool flush;
+    int  asid;
+    (void)state;
+
+    asid = MSAsidAssign(&g_core, 100, 3, &flush);
+    (void)MSAsidAssign(&g_core, 200, 0, &flush);
+
+    // The context was synchronized while the core ran something else
+    assert_int_equal(MSAsidAssign(&g_core, 100, 4, &flush), asid);
+    assert_true(flush);
+
+    // And it's up-to-date again after the flush
+    (void)MSAsidAssign(&g_core, 200, 0, &flush);
+    assert_int_equal(MSAsidAssign(&g_core, 100, 4, &flush), asid);
+    assert_false(flush);
+}
+
+void TestMSAsidAssign_Recycle(void** state)
+{
+    bool flush;
+    int  asids[MS_ASID_SLOTS];
+    int  asid;
+    (void)state;
+
+    for (int i = 0; i < MS_ASID_SLOTS; i++) {
+        asids[i] = MSAsidAssign(&g_core, 100 + i, 0, &flush);
+        assert_true(flush);
+    }
+
+    // Touch the first one, which leaves the second one as the least recently used
+    assert_int_equal(MSAsidAssign(&g_core, 100, 0, &flush), asids[0]);
+    assert_false(flush);
+
+    asid = MSAsidAssign(&g_core, 500, 0, &flush);
+    assert_int_equal(asid, asids[1]);
+    assert_true(flush);
+
+    // The previous owner lost its id, and gets a new one that must be flushed
+    asid = MSAsidAssign(&g_core, 101, 0, &flush);
+    assert_int_equal(asid, asids[2]);
+    assert_true(flush);
+}
+
+void TestMSAsidSynchronize(void** state)
+{
+    bool flush;
+    (void)state;
+
+    (void)MSAsidAssign(&g_core, 100, 7, &flush);
+
+    // Loaded at generation 7, so the synchronization to 7 was already seen
+    assert_int_equal(MSAsidSynchronize(&g_core, 7, 7), MSAsidFlushNone);
+
+    // The next generation only changed the range that was synchronized
+    assert_int_equal(MSAsidSynchronize(&g_core, 8, 8), MSAsidFlushRange);
+    assert_int_equal(MSAsidSynchronize(&g_core, 8, 8), MSAsidFlushNone);
+
+    // Synchronizations can arrive out of order, when one was skipped the
+    // whole id must be flushed, which also covers everything up to now
+    assert_int_equal(MSAsidSynchronize(&g_core, 10, 10), MSAsidFlushFull);
+    assert_int_equal(MSAsidSynchronize(&g_core, 9, 10), MSAsidFlushNone);
+    assert_int_equal(MSAsidSynchronize(&g_core, 11, 11), MSAsidFlushRange);
+}
+
+void TestMSAsidSynchronize_Wraparound(void** state)
+{
+    bool flush;
+    (void)state;
+
+    (void)MSAsidAssign(&g_core, 100, SIZE_MAX, &flush);
+    assert_int_equal(MSAsidSynchronize(&g_core, 0, 0), MSAsidFlushRange);
+    assert_int_equal(MSAsidSynchronize(&g_core, SIZE_MAX, 0), MSAsidFlushNone);
+
+    (void)MSAsidAssign(&g_core, 200, 0, &flush);
+    assert_int_equal(MSAsidAssign(&g_core, 100, 1, &flush), 1);
+    assert_true(flush);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestMSAsidAssign_KeepsEntries, SetupTest),
+            cmocka_unit_test_setup(TestMSAsidAssign_Untagged, SetupTest),
+            cmocka_unit_test_setup(TestMSAsidAssign_Stale, SetupTest),
+            cmocka_unit_test_setup(TestMSAsidAssign_Recycle, SetupTest),
+            cmocka_unit_test_setup(TestMSAsidSynchronize, SetupTest),
+            cmocka_unit_test_setup(TestMSAsidSynchronize_Wraparound, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, Setup, Teardown);
+}
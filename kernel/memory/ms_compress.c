@@ -0,0 +1,695 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Memory Space Compressed Pages
+ *   - Compresses pages of processes that have not been accessed for a while, and gives their
+ *     physical memory back to the system. The pages are left reserved, and are restored from
+ *     their compressed copy when they are faulted on. The accessed bit of the pages is used
+ *     as a second chance, a page must go a full scan without being accessed to be compressed.
+ */
+
+#define __MODULE "MEM2"
+#define __need_minmax
+
+//#define __TRACE
+
+#include <arch/mmu.h>
+#include <component/timer.h>
+#include <debug.h>
+#include <futex.h>
+#include <handle.h>
+#include <heap.h>
+#include <machine.h>
+#include <memoryspace.h>
+#include <spinlock.h>
+#include <string.h>
+#include <threading.h>
+#include <utils/page_compress.h>
+#include "private.h"
+
+// Pages are scanned in batches, the attributes of each batch are read with a single page-table walk
+#define COMPRESS_BATCH_PAGES  32
+
+// Pages must compress to three quarters of their size or better, otherwise they are left alone
+#define COMPRESS_MAX_LENGTH(pageSize) ((pageSize) - ((pageSize) / 4))
+
+// The worker scans each process this many pages at a time, and checks on the memory every interval
+#define COMPRESS_SCAN_PAGES   1024
+#define COMPRESS_INTERVAL_MS  1000
+
+// Each space is numbered when it's registered, so the worker can continue its pass over
+// the spaces by number while spaces come and go.
+struct MSCompressSpace {
+    struct MSCompressSpace* Link;
+    MemorySpace_t*          MemorySpace;
+    uuid_t                  Handle;
+    size_t                  Sequence;
+};
+
+static struct MSCompressSpace* g_spaces         = NULL;
+static size_t                  g_spacesSequence = 0;
+static Spinlock_t              g_spacesLock     = OS_SPINLOCK_INIT;
+static uuid_t                  g_compressHandle = UUID_INVALID;
+static _Atomic(int)            g_compressWakeup = 0;
+
+static _Atomic(size_t)   g_storedPages     = 0;
+static _Atomic(size_t)   g_storedBytes     = 0;
+static _Atomic(size_t)   g_sameFilledPages = 0;
+static _Atomic(size_t)   g_rejectedPages   = 0;
+static _Atomic(size_t)   g_restores        = 0;
+static _Atomic(uint64_t) g_restoreTime     = 0;
+static _Atomic(uint64_t) g_restoreMaxTime  = 0;
+
+static void
+__AccountPage(
+        _In_ struct MSCompressedPage* page,
+        _In_ int                      direction)
+{
+    if (direction > 0) {
+        atomic_fetch_add(&g_storedPages, 1);
+        atomic_fetch_add(&g_storedBytes, page->Length);
+        if (!page->Length) {
+            atomic_fetch_add(&g_sameFilledPages, 1);
+        }
+    } else {
+        atomic_fetch_sub(&g_storedPages, 1);
+        atomic_fetch_sub(&g_storedBytes, page->Length);
+        if (!page->Length) {
+            atomic_fetch_sub(&g_sameFilledPages, 1);
+        }
+    }
+}
+
+static void
+__DeletePage(
+        _In_ struct MSCompressedPage* page)
+{
+    __AccountPage(page, -1);
+    kfree(page->Data);
+    kfree(page);
+}
+
+static oserr_t
+__MapPage(
+        _In_  paddr_t  physicalAddress,
+        _Out_ vaddr_t* mappingOut)
+{
+    return MemorySpaceMap(
+            GetCurrentMemorySpace(),
+            &(struct MemorySpaceMapOptions) {
+                .Pages = &physicalAddress,
+                .Length = GetMemorySpacePageSize(),
+                .Flags = MAPPING_COMMIT | MAPPING_PERSISTENT,
+                .PlacementFlags = MAPPING_PHYSICAL_FIXED | MAPPING_VIRTUAL_GLOBAL
+            },
+            mappingOut
+    );
+}
+
+static oserr_t
+__StorePage(
+        _In_ struct MSCompressedPage* page,
+        _In_ const void*              data,
+        _In_ void*                    buffer,
+        _In_ void*                    workspace)
+{
+    size_t           pageSize = GetMemorySpacePageSize();
+    const uintptr_t* words    = data;
+    size_t           i;
+
+    // Zeroed and otherwise uniformly filled pages are the most common, and need no data
+    for (i = 1; i < pageSize / sizeof(uintptr_t); i++) {
+        if (words[i] != words[0]) {
+            break;
+        }
+    }
+    if (i == pageSize / sizeof(uintptr_t)) {
+        page->Data   = NULL;
+        page->Length = 0;
+        page->Fill   = words[0];
+        return OS_EOK;
+    }
+
+    page->Length = PageCompress(data, pageSize, buffer, COMPRESS_MAX_LENGTH(pageSize), workspace);
+    if (!page->Length) {
+        atomic_fetch_add(&g_rejectedPages, 1);
+        return OS_EINCOMPLETE;
+    }
+
+    page->Data = kmalloc(page->Length);
+    if (!page->Data) {
+        return OS_EOOM;
+    }
+    memcpy(page->Data, buffer, page->Length);
+    return OS_EOK;
+}
+
+static oserr_t
+__LoadPage(
+        _In_ struct MSCompressedPage* page,
+        _In_ void*                    data)
+{
+    size_t pageSize = GetMemorySpacePageSize();
+
+    if (!page->Length) {
+        uintptr_t* words = data;
+        for (size_t i = 0; i < pageSize / sizeof(uintptr_t); i++) {
+            words[i] = page->Fill;
+        }
+        return OS_EOK;
+    }
+    return PageDecompress(page->Data, page->Length, data, pageSize);
+}
+
+// Decommits the page, so its contents can't change while we compress them. Faults on it wait
+// for the context lock, and find it in the tree. Other cores may still have the page cached
+// until the memory space is synchronized.
+static struct MSCompressedPage*
+__DecommitPage(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ paddr_t        physicalAddress,
+        _In_ unsigned int   attributes)
+{
+    struct MSContext*        context = memorySpace->Context;
+    struct MSCompressedPage* page;
+    oserr_t                  oserr;
+
+    page = kmalloc(sizeof(struct MSCompressedPage));
+    if (!page) {
+        return NULL;
+    }
+    page->Data      = NULL;
+    page->Restoring = false;
+    page->Discarded = false;
+
+    atomic_fetch_add(&context->CompressedPageCount, 1);
+    oserr = ArchMmuReplaceVirtualPage(
+            memorySpace, address, physicalAddress, 0,
+            attributes & ~(MAPPING_COMMIT | MAPPING_ISACCESSED | MAPPING_ISDIRTY)
+    );
+    if (oserr != OS_EOK) {
+        atomic_fetch_sub(&context->CompressedPageCount, 1);
+        kfree(page);
+        return NULL;
+    }
+    return page;
+}
+
+static oserr_t
+__CompressPage(
+        _In_ MemorySpace_t*           memorySpace,
+        _In_ vaddr_t                  address,
+        _In_ paddr_t                  physicalAddress,
+        _In_ struct MSCompressedPage* page,
+        _In_ void*                    buffer,
+        _In_ void*                    workspace)
+{
+    struct MSContext* context  = memorySpace->Context;
+    size_t            pageSize = GetMemorySpacePageSize();
+    vaddr_t           mapping;
+    oserr_t           oserr;
+    int               pagesCommitted;
+
+    oserr = __MapPage(physicalAddress, &mapping);
+    if (oserr == OS_EOK) {
+        oserr = __StorePage(page, (void*)mapping, buffer, workspace);
+        (void)MemorySpaceUnmap(GetCurrentMemorySpace(), mapping, pageSize);
+    }
+    if (oserr != OS_EOK) {
+        // Put the page back the way it was, the reserved page still has the attributes
+        (void)ArchMmuCommitVirtualPage(memorySpace, address, &physicalAddress, 1, &pagesCommitted);
+        atomic_fetch_sub(&context->CompressedPageCount, 1);
+        kfree(page->Data);
+        kfree(page);
+        return oserr;
+    }
+
+    INTERVAL_NODE_INIT(&page->Header, address, address + pageSize, page);
+    interval_tree_insert(&context->CompressedPages, &page->Header);
+    __AccountPage(page, 1);
+    FreePhysicalMemory(1, &physicalAddress);
+    return OS_EOK;
+}
+
+static bool
+__IsCompressible(
+        _In_ struct MSAllocation* allocation)
+{
+    // Shared memory is owned by the buffer, and persistent memory is not owned at all
+    if (allocation->SHMTag != UUID_INVALID) {
+        return false;
+    }
+    return !(allocation->Flags & (MAPPING_PERSISTENT | MAPPING_TRAPPAGE));
+}
+
+static int
+__ScanBatch(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ int            pageCount,
+        _In_ void*          buffer,
+        _In_ void*          workspace)
+{
+    struct MSCompressedPage* decommitted[COMPRESS_BATCH_PAGES] = { NULL };
+    unsigned int             attributes[COMPRESS_BATCH_PAGES];
+    paddr_t                  pages[COMPRESS_BATCH_PAGES];
+    struct MSSyncBatch       batch;
+    size_t                   pageSize        = GetMemorySpacePageSize();
+    int                      pagesCompressed = 0;
+    int                      pagesRetrieved;
+
+    memset(&attributes[0], 0, sizeof(attributes));
+    memset(&pages[0], 0, sizeof(pages));
+    (void)ArchMmuGetPageAttributes(memorySpace, address, pageCount, &attributes[0], &pagesRetrieved);
+    (void)ArchMmuVirtualToPhysical(memorySpace, address, pageCount, &pages[0], &pagesRetrieved);
+
+    MSSyncBatchInitialize(&batch, memorySpace);
+    for (int i = 0; i < pageCount; i++) {
+        vaddr_t pageAddress = address + (i * pageSize);
+
+        // Only committed pages that are owned by this mapping alone can be compressed
+        if (!(attributes[i] & MAPPING_COMMIT) || (attributes[i] & (MAPPING_PERSISTENT | MAPPING_COPYONWRITE))) {
+            continue;
+        }
+
+        // Pages that have been accessed get a second chance. Other cores are not synchronized, an
+        // entry they have cached keeps the page looking cold until it's evicted, which only costs
+        // an extra fault if the page was in use.
+        if (attributes[i] & MAPPING_ISACCESSED) {
+            unsigned int updatedAttributes = attributes[i] & ~(MAPPING_ISACCESSED);
+            int          pagesUpdated;
+            (void)ArchMmuUpdatePageAttributes(memorySpace, pageAddress, 1, &updatedAttributes, &pagesUpdated);
+            continue;
+        }
+
+        if (GetPhysicalMemoryReferences(pages[i]) != 1) {
+            continue;
+        }
+
+        decommitted[i] = __DecommitPage(memorySpace, pageAddress, pages[i], attributes[i]);
+        if (decommitted[i] != NULL) {
+            MSSyncBatchAdd(&batch, pageAddress, pageSize);
+        }
+    }
+
+    // The other cores must stop using the pages before their contents are read, they are
+    // synchronized once for all the pages of the batch.
+    MSSyncBatchFlush(&batch);
+
+    for (int i = 0; i < pageCount; i++) {
+        if (decommitted[i] == NULL) {
+            continue;
+        }
+        if (__CompressPage(memorySpace, address + (i * pageSize), pages[i], decommitted[i], buffer, workspace) == OS_EOK) {
+            pagesCompressed++;
+        }
+    }
+    return pagesCompressed;
+}
+
+oserr_t
+MemorySpaceCompressColdPages(
+        _In_  MemorySpace_t* memorySpace,
+        _In_  int            pageCount,
+        _Out_ int*           compressedOut)
+{
+    struct MSContext* context;
+    interval_node_t*  node;
+    size_t            pageSize = GetMemorySpacePageSize();
+    void*             buffer;
+    void*             workspace;
+    vaddr_t           cursor;
+    int               pagesScanned    = 0;
+    int               pagesCompressed = 0;
+    TRACE("MemorySpaceCompressColdPages(pageCount=%i)", pageCount);
+
+    if (memorySpace == NULL || memorySpace->Context == NULL || compressedOut == NULL) {
+        return OS_EINVALPARAMS;
+    }
+
+    buffer    = kmalloc(pageSize);
+    workspace = kmalloc(PAGE_COMPRESS_WORKSPACE_SIZE);
+    if (!buffer || !workspace) {
+        kfree(buffer);
+        kfree(workspace);
+        return OS_EOOM;
+    }
+
+    context = memorySpace->Context;
+    MutexLock(&context->SyncObject);
+
+    // Continue where the previous scan stopped, and start over once the end is reached
+    cursor = context->CompressCursor;
+    node   = interval_tree_first_overlap(&context->Allocations, cursor, UINTPTR_MAX);
+    while (node != NULL) {
+        struct MSAllocation* allocation = node->value;
+        vaddr_t              end        = allocation->Address + allocation->Length;
+
+        cursor = MAX(cursor, allocation->Address);
+        if (!__IsCompressible(allocation)) {
+            cursor = end;
+        }
+
+        while (cursor < end && pagesScanned < pageCount) {
+            int batchPages = (int)MIN((end - cursor) / pageSize, COMPRESS_BATCH_PAGES);
+            batchPages       = MIN(batchPages, pageCount - pagesScanned);
+            pagesCompressed += __ScanBatch(memorySpace, cursor, batchPages, buffer, workspace);
+            pagesScanned    += batchPages;
+            cursor          += batchPages * pageSize;
+        }
+
+        if (pagesScanned >= pageCount) {
+            break;
+        }
+        node = interval_tree_next_overlap(&context->Allocations, node, cursor, UINTPTR_MAX);
+    }
+    context->CompressCursor = node != NULL ? cursor : 0;
+    MutexUnlock(&context->SyncObject);
+
+    kfree(workspace);
+    kfree(buffer);
+    *compressedOut = pagesCompressed;
+    return OS_EOK;
+}
+
+static void
+__UpdateRestoreTime(
+        _In_ uint64_t elapsed)
+{
+    uint64_t maxTime = atomic_load(&g_restoreMaxTime);
+
+    atomic_fetch_add(&g_restores, 1);
+    atomic_fetch_add(&g_restoreTime, elapsed);
+    while (elapsed > maxTime && !atomic_compare_exchange_weak(&g_restoreMaxTime, &maxTime, elapsed));
+}
+
+oserr_t
+MSCompressedPageRestore(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address)
+{
+    struct MSContext*        context = memorySpace->Context;
+    struct MSCompressedPage* page;
+    interval_node_t*         node;
+    tick_t                   start, end;
+    paddr_t                  physicalAddress;
+    vaddr_t                  mapping;
+    oserr_t                  oserr;
+    int                      pagesCommitted;
+    TRACE("MSCompressedPageRestore(address=0x%" PRIxIN ")", address);
+
+    MutexLock(&context->SyncObject);
+    node = interval_tree_lookup(&context->CompressedPages, address);
+    if (node == NULL) {
+        MutexUnlock(&context->SyncObject);
+        return OS_ENOENT;
+    }
+
+    page = node->value;
+    if (page->Restoring) {
+        MutexUnlock(&context->SyncObject);
+        return OS_EOK;
+    }
+    page->Restoring = true;
+    MutexUnlock(&context->SyncObject);
+
+    // Decompress the page without holding the lock, the temporary mapping needs it
+    SystemTimerGetTimestamp(&start);
+    oserr = AllocatePhysicalMemory(0, 1, &physicalAddress);
+    if (oserr == OS_EOK) {
+        oserr = __MapPage(physicalAddress, &mapping);
+        if (oserr == OS_EOK) {
+            oserr = __LoadPage(page, (void*)mapping);
+            (void)MemorySpaceUnmap(GetCurrentMemorySpace(), mapping, GetMemorySpacePageSize());
+        }
+        if (oserr != OS_EOK) {
+            FreePhysicalMemory(1, &physicalAddress);
+        }
+    }
+
+    MutexLock(&context->SyncObject);
+    if (page->Discarded) {
+        // The page was unmapped while we restored it, the access is retried and
+        // faults on the unmapped page instead.
+        MutexUnlock(&context->SyncObject);
+        if (oserr == OS_EOK) {
+            FreePhysicalMemory(1, &physicalAddress);
+        }
+        __DeletePage(page);
+        return OS_EOK;
+    }
+
+    if (oserr == OS_EOK) {
+        oserr = ArchMmuCommitVirtualPage(memorySpace, address, &physicalAddress, 1, &pagesCommitted);
+        if (oserr != OS_EOK) {
+            FreePhysicalMemory(1, &physicalAddress);
+        }
+    }
+    if (oserr != OS_EOK) {
+        // Let the next fault on the page try again
+        page->Restoring = false;
+        MutexUnlock(&context->SyncObject);
+        ERROR("MSCompressedPageRestore failed to restore 0x%" PRIxIN ": %u", address, oserr);
+        return oserr;
+    }
+
+    interval_tree_remove(&context->CompressedPages, &page->Header);
+    atomic_fetch_sub(&context->CompressedPageCount, 1);
+    MutexUnlock(&context->SyncObject);
+    __DeletePage(page);
+
+    SystemTimerGetTimestamp(&end);
+    __UpdateRestoreTime(end - start);
+    return OS_EOK;
+}
+
+void
+MSCompressedPagesExclude(
+        _In_ struct MSContext* context,
+        _In_ vaddr_t           address,
+        _In_ int               pageCount,
+        _In_ unsigned int*     attributes)
+{
+    size_t           pageSize = GetMemorySpacePageSize();
+    vaddr_t          end      = address + (pageCount * pageSize);
+    interval_node_t* node;
+
+    MutexLock(&context->SyncObject);
+    node = interval_tree_first_overlap(&context->CompressedPages, address, end);
+    while (node != NULL) {
+        attributes[(node->start - address) / pageSize] = 0;
+        node = interval_tree_next_overlap(&context->CompressedPages, node, address, end);
+    }
+    MutexUnlock(&context->SyncObject);
+}
+
+void
+MSCompressedPagesDiscard(
+        _In_ struct MSContext* context,
+        _In_ vaddr_t           address,
+        _In_ size_t            length)
+{
+    interval_node_t* node;
+
+    MutexLock(&context->SyncObject);
+    while ((node = interval_tree_first_overlap(&context->CompressedPages, address, address + length)) != NULL) {
+        struct MSCompressedPage* page = node->value;
+
+        interval_tree_remove(&context->CompressedPages, node);
+        atomic_fetch_sub(&context->CompressedPageCount, 1);
+
+        // Pages that are being restored are cleaned up by the restore
+        page->Discarded = true;
+        if (!page->Restoring) {
+            __DeletePage(page);
+        }
+    }
+    MutexUnlock(&context->SyncObject);
+}
+
+oserr_t
+MSCompressedPagesClone(
+        _In_ struct MSContext* source,
+        _In_ struct MSContext* destination)
+{
+    interval_node_t* node;
+
+    node = interval_tree_first_overlap(&source->CompressedPages, 0, UINTPTR_MAX);
+    while (node != NULL) {
+        struct MSCompressedPage* page = node->value;
+        struct MSCompressedPage* clone;
+
+        clone = kmalloc(sizeof(struct MSCompressedPage));
+        if (!clone) {
+            return OS_EOOM;
+        }
+        memcpy(clone, page, sizeof(struct MSCompressedPage));
+        clone->Restoring = false;
+        clone->Discarded = false;
+        if (page->Length) {
+            clone->Data = kmalloc(page->Length);
+            if (!clone->Data) {
+                kfree(clone);
+                return OS_EOOM;
+            }
+            memcpy(clone->Data, page->Data, page->Length);
+        }
+
+        INTERVAL_NODE_INIT(&clone->Header, node->start, node->end, clone);
+        interval_tree_insert(&destination->CompressedPages, &clone->Header);
+        atomic_fetch_add(&destination->CompressedPageCount, 1);
+        __AccountPage(clone, 1);
+        node = interval_tree_next_overlap(&source->CompressedPages, node, 0, UINTPTR_MAX);
+    }
+    return OS_EOK;
+}
+
+void
+MSCompressRegister(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ uuid_t         handle)
+{
+    struct MSCompressSpace* space;
+
+    if (g_compressHandle == UUID_INVALID) {
+        return;
+    }
+
+    space = kmalloc(sizeof(struct MSCompressSpace));
+    if (!space) {
+        return;
+    }
+    space->MemorySpace = memorySpace;
+    space->Handle      = handle;
+
+    SpinlockAcquireIrq(&g_spacesLock);
+    space->Sequence = ++g_spacesSequence;
+    space->Link     = g_spaces;
+    g_spaces        = space;
+    SpinlockReleaseIrq(&g_spacesLock);
+}
+
+void
+MSCompressUnregister(
+        _In_ MemorySpace_t* memorySpace)
+{
+    struct MSCompressSpace** link;
+    struct MSCompressSpace*  space = NULL;
+
+    SpinlockAcquireIrq(&g_spacesLock);
+    link = &g_spaces;
+    while (*link && (*link)->MemorySpace != memorySpace) {
+        link = &(*link)->Link;
+    }
+    if (*link) {
+        space = *link;
+        *link = space->Link;
+    }
+    SpinlockReleaseIrq(&g_spacesLock);
+    kfree(space);
+}
+
+// Memory is considered low at the same point where the zero pool and the heap
+// reaper start giving memory back.
+static int
+__IsMemoryLow(void)
+{
+    size_t maxBlocks  = GetMachine()->NumberOfMemoryBlocks;
+    size_t freeBlocks = atomic_load(&GetMachine()->NumberOfFreeMemoryBlocks);
+    return freeBlocks < (maxBlocks >> 3U);
+}
+
+// Retrieves the handle of the space registered next after <sequence>, and moves the sequence to it.
+static uuid_t
+__GetNextSpaceHandle(
+        _InOut_ size_t* sequence)
+{
+    struct MSCompressSpace* space;
+    struct MSCompressSpace* next = NULL;
+    uuid_t                  handle = UUID_INVALID;
+
+    SpinlockAcquireIrq(&g_spacesLock);
+    for (space = g_spaces; space != NULL; space = space->Link) {
+        if (space->Sequence > *sequence && (next == NULL || space->Sequence < next->Sequence)) {
+            next = space;
+        }
+    }
+    if (next) {
+        handle    = next->Handle;
+        *sequence = next->Sequence;
+    }
+    SpinlockReleaseIrq(&g_spacesLock);
+    return handle;
+}
+
+_Noreturn static void
+__CompressThread(
+        _In_Opt_ void* argument)
+{
+    OSTimestamp_t deadline;
+    _CRT_UNUSED(argument);
+
+    for (;;) {
+        SystemTimerGetWallClockTime(&deadline);
+        OSTimestampAddNsec(&deadline, &deadline, COMPRESS_INTERVAL_MS * NSEC_PER_MSEC);
+        (void)FutexWait(NULL, &g_compressWakeup, 0, 0, NULL, 0, 0, &deadline);
+
+        // Go over the processes once, the handle keeps each memory space alive while it's scanned
+        for (size_t sequence = 0; __IsMemoryLow();) {
+            MemorySpace_t* memorySpace;
+            uuid_t         handle = __GetNextSpaceHandle(&sequence);
+            int            pagesCompressed;
+
+            if (handle == UUID_INVALID) {
+                break;
+            }
+
+            if (AcquireHandleOfType(handle, HandleTypeMemorySpace, (void**)&memorySpace) != OS_EOK) {
+                continue;
+            }
+            (void)MemorySpaceCompressColdPages(memorySpace, COMPRESS_SCAN_PAGES, &pagesCompressed);
+            DestroyHandle(handle);
+        }
+    }
+}
+
+oserr_t
+MemoryCompressionInitialize(void)
+{
+    return ThreadCreate("compress-worker", __CompressThread, NULL,
+                        THREADING_BACKGROUND, UUID_INVALID, 0, 0,
+                        &g_compressHandle);
+}
+
+void
+MemorySpaceGetCompressionStatistics(
+        _Out_ size_t*   pagesOut,
+        _Out_ size_t*   bytesOut,
+        _Out_ size_t*   sameFilledOut,
+        _Out_ size_t*   rejectedOut,
+        _Out_ size_t*   restoresOut,
+        _Out_ uint64_t* restoreTimeOut,
+        _Out_ uint64_t* restoreMaxTimeOut)
+{
+    *pagesOut          = g_storedPages;
+    *bytesOut          = g_storedBytes;
+    *sameFilledOut     = g_sameFilledPages;
+    *rejectedOut       = g_rejectedPages;
+    *restoresOut       = g_restores;
+    *restoreTimeOut    = g_restoreTime;
+    *restoreMaxTimeOut = g_restoreMaxTime;
+}
@@ -30,32 +30,46 @@ MSContextNew(void)
     }
 
     MutexConstruct(&context->SyncObject, MUTEX_FLAG_PLAIN);
-    DynamicMemoryPoolConstruct(&context->Heap, GetMachine()->MemoryMap.UserHeap.Start,
-                               GetMachine()->MemoryMap.UserHeap.Length, GetMachine()->MemoryGranularity);
-    list_construct(&context->Allocations);
+    MemoryRangeConstruct(&context->Heap, GetMachine()->MemoryMap.UserHeap.Start,
+                         GetMachine()->MemoryMap.UserHeap.Length, GetMachine()->MemoryGranularity);
+    interval_tree_construct(&context->Allocations);
+    interval_tree_construct(&context->CompressedPages);
+    atomic_store(&context->CompressedPageCount, 0);
+    context->CompressCursor = 0;
     context->SignalHandler = 0;
+    for (unsigned int i = 0; i < MS_CORE_MASK_WORDS; i++) {
+        atomic_store(&context->ActiveCores[i], 0);
+    }
+    atomic_store(&context->TlbGeneration, 0);
+    atomic_store(&context->Faults, 0);
+    atomic_store(&context->SequentialFaults, 0);
+    atomic_store(&context->FaultAroundPages, 0);
     return context;
 }
 
 static void
-__CleanupMemoryAllocation(
-        _In_ element_t* element,
-        _In_ void*      context)
+__CleanupMemoryAllocations(
+        _In_ struct MSContext* context)
 {
-    struct MSAllocation* allocation = element->value;
-    struct MSContext*    msContext = context;
+    interval_node_t* node;
 
-    DynamicMemoryPoolFree(&msContext->Heap, allocation->Address);
-    kfree(allocation);
+    while ((node = interval_tree_minimum(&context->Allocations)) != NULL) {
+        struct MSAllocation* allocation = node->value;
+
+        interval_tree_remove(&context->Allocations, node);
+        MemoryRangeFree(&context->Heap, allocation->Address);
+        kfree(allocation);
+    }
 }
 
 void
 MSContextDelete(
         _In_ struct MSContext* context)
 {
+    MSCompressedPagesDiscard(context, 0, UINTPTR_MAX);
     MutexDestruct(&context->SyncObject);
-    list_clear(&context->Allocations, __CleanupMemoryAllocation, context);
-    DynamicMemoryPoolDestroy(&context->Heap);
+    __CleanupMemoryAllocations(context);
+    MemoryRangeDestroy(&context->Heap);
     kfree(context);
 }
 
@@ -65,6 +79,6 @@ MSContextAddAllocation(
         _In_ struct MSAllocation* allocation)
 {
     MutexLock(&context->SyncObject);
-    list_append(&context->Allocations, &allocation->Header);
+    interval_tree_insert(&context->Allocations, &allocation->Header);
     MutexUnlock(&context->SyncObject);
 }
@@ -28,9 +28,10 @@ static struct __TestContext {
     int   MutexLockCalls;
     int   MutexUnlockCalls;
     int   MutexDestructCalls;
-    int   DynamicMemoryPoolConstructCalls;
-    int   DynamicMemoryPoolFreeCalls;
-    int   DynamicMemoryPoolDestroyCalls;
+    int   MemoryRangeConstructCalls;
+    int   MemoryRangeFreeCalls;
+    int   MemoryRangeDestroyCalls;
+    int   MSCompressedPagesDiscardCalls;
     void* SkipFree;
 } g_testContext;
 
@@ -57,8 +58,8 @@ void TestMSContextNew_Happy(void** state)
     context = MSContextNew();
     assert_non_null(context);
     assert_int_equal(g_testContext.MutexConstructCalls, 1);
-    assert_int_equal(g_testContext.DynamicMemoryPoolConstructCalls, 1);
-    assert_int_equal(list_count(&context->Allocations), 0);
+    assert_int_equal(g_testContext.MemoryRangeConstructCalls, 1);
+    assert_int_equal(interval_tree_count(&context->Allocations), 0);
     assert_int_equal(context->SignalHandler, 0);
 
     // delete again, should be OK to invoke this
@@ -81,7 +82,7 @@ void TestMSContextAddAllocation_Happy(void** state)
     MSContextAddAllocation(context, &allocation);
     assert_int_equal(g_testContext.MutexLockCalls, 1);
     assert_int_equal(g_testContext.MutexUnlockCalls, 1);
-    assert_int_equal(list_count(&context->Allocations), 1);
+    assert_int_equal(interval_tree_count(&context->Allocations), 1);
 
     // manually free object, don't want to free the allocation
     // we have on the stack
@@ -92,7 +93,7 @@ void TestMSContextDelete_Happy(void** state)
 {
     struct MSContext*   context;
     struct MSAllocation allocation = {
-            .Header = { .value = &allocation },
+            .Header = { .start = 0x13444, .end = 0x14444, .value = &allocation },
             .Address = 0x13444,
             .Length = 0x1000
     };
@@ -105,16 +106,17 @@ void TestMSContextDelete_Happy(void** state)
     MSContextAddAllocation(context, &allocation);
     assert_int_equal(g_testContext.MutexLockCalls, 1);
     assert_int_equal(g_testContext.MutexUnlockCalls, 1);
-    assert_int_equal(list_count(&context->Allocations), 1);
+    assert_int_equal(interval_tree_count(&context->Allocations), 1);
 
     g_testContext.SkipFree = &allocation;
     MSContextDelete(context);
 
-    // ensure that DynamicMemoryPoolFree was called once, this means
+    // ensure that MemoryRangeFree was called once, this means
     // the allocation was freed
     assert_int_equal(g_testContext.MutexDestructCalls, 1);
-    assert_int_equal(g_testContext.DynamicMemoryPoolFreeCalls, 1);
-    assert_int_equal(g_testContext.DynamicMemoryPoolDestroyCalls, 1);
+    assert_int_equal(g_testContext.MemoryRangeFreeCalls, 1);
+    assert_int_equal(g_testContext.MemoryRangeDestroyCalls, 1);
+    assert_int_equal(g_testContext.MSCompressedPagesDiscardCalls, 1);
 }
 
 int main(void)
@@ -146,23 +148,32 @@ void MutexDestruct(Mutex_t* mutex) {
     g_testContext.MutexDestructCalls++;
 }
 
-void DynamicMemoryPoolConstruct(DynamicMemoryPool_t* pool, uintptr_t startAddress,
-                                size_t size, size_t chunkSize) {
-    assert_non_null(pool);
+void MemoryRangeConstruct(MemoryRange_t* range, uintptr_t startAddress,
+                          size_t length, size_t granularity) {
+    assert_non_null(range);
     assert_int_equal(startAddress, 0x1000); // match values in GetMachine
-    assert_int_equal(size, 0x10000); // match values in GetMachine
-    assert_int_equal(chunkSize, 0x1000); // match values in GetMachine
-    g_testContext.DynamicMemoryPoolConstructCalls++;
+    assert_int_equal(length, 0x10000); // match values in GetMachine
+    assert_int_equal(granularity, 0x1000); // match values in GetMachine
+    g_testContext.MemoryRangeConstructCalls++;
 }
 
-void DynamicMemoryPoolFree(DynamicMemoryPool_t* pool, uintptr_t address) {
-    assert_non_null(pool);
-    g_testContext.DynamicMemoryPoolFreeCalls++;
+oserr_t MemoryRangeFree(MemoryRange_t* range, uintptr_t address) {
+    assert_non_null(range);
+    g_testContext.MemoryRangeFreeCalls++;
+    return OS_EOK;
 }
 
-void DynamicMemoryPoolDestroy(DynamicMemoryPool_t* pool) {
-    assert_non_null(pool);
-    g_testContext.DynamicMemoryPoolDestroyCalls++;
+void MemoryRangeDestroy(MemoryRange_t* range) {
+    assert_non_null(range);
+    g_testContext.MemoryRangeDestroyCalls++;
+}
+
+void MSCompressedPagesDiscard(struct MSContext* context, vaddr_t address, size_t length) {
+    assert_non_null(context);
+    assert_int_equal(address, 0);
+    assert_int_equal(length, UINTPTR_MAX);
+    assert_int_equal(g_testContext.MutexDestructCalls, 0);
+    g_testContext.MSCompressedPagesDiscardCalls++;
 }
 
 void* kmalloc(size_t size) {
@@ -0,0 +1,437 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Memory Space Copy-On-Write
+ *   - Shares pages between memory spaces read-only, and gives a memory space its own
+ *     copy of a page when it writes to it. Used for private clones of mappings and for
+ *     forking entire memory spaces.
+ */
+
+#define __MODULE "MEM2"
+
+//#define __TRACE
+
+#include <arch/mmu.h>
+#include <debug.h>
+#include <heap.h>
+#include <machine.h>
+#include <memoryspace.h>
+#include <string.h>
+#include "private.h"
+
+static _Atomic(size_t) g_copies = 0;
+static _Atomic(size_t) g_reuses = 0;
+
+enum __ShareType {
+    __SHARE_NONE,
+    __SHARE_RESERVED,
+    __SHARE_PERSISTENT,
+    __SHARE_READONLY,
+    __SHARE_COPYONWRITE
+};
+
+static enum __ShareType
+__GetShareType(
+        _In_ unsigned int attributes)
+{
+    if (!attributes) {
+        return __SHARE_NONE;
+    }
+    if (!(attributes & MAPPING_COMMIT)) {
+        return __SHARE_RESERVED;
+    }
+    if (attributes & MAPPING_PERSISTENT) {
+        return __SHARE_PERSISTENT;
+    }
+    if (attributes & MAPPING_READONLY) {
+        return __SHARE_READONLY;
+    }
+    return __SHARE_COPYONWRITE;
+}
+
+static oserr_t
+__ShareRun(
+        _In_ MemorySpace_t*      source,
+        _In_ vaddr_t             sourceAddress,
+        _In_ MemorySpace_t*      destination,
+        _In_ vaddr_t             destinationAddress,
+        _In_ const paddr_t*      pages,
+        _In_ int                 pageCount,
+        _In_ enum __ShareType    type,
+        _In_ unsigned int        sourceAttributes,
+        _In_ unsigned int        attributes,
+        _In_ struct MSSyncBatch* batch)
+{
+    oserr_t oserr;
+    int     pagesUpdated;
+
+    switch (type) {
+        case __SHARE_RESERVED:
+            return ArchMmuReserveVirtualPages(
+                    destination, destinationAddress, pageCount,
+                    attributes & ~(MAPPING_COMMIT), &pagesUpdated);
+
+        case __SHARE_PERSISTENT:
+            // Pages that are not owned by the mapping, are not owned by the clone either
+            return ArchMmuSetVirtualPages(
+                    destination, destinationAddress, pages, pageCount,
+                    attributes | MAPPING_PERSISTENT, &pagesUpdated);
+
+        case __SHARE_READONLY:
+        case __SHARE_COPYONWRITE:
+            break;
+
+        default:
+            return OS_EOK;
+    }
+
+    oserr = SharePhysicalMemory(pageCount, pages);
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    if (type == __SHARE_COPYONWRITE) {
+        // Writes in the source must copy the pages as well, from now on
+        if (!(sourceAttributes & MAPPING_COPYONWRITE)) {
+            sourceAttributes |= MAPPING_COPYONWRITE;
+            oserr = ArchMmuUpdatePageAttributes(source, sourceAddress, pageCount, &sourceAttributes, &pagesUpdated);
+            if (pagesUpdated) {
+                MSSyncBatchAdd(batch, sourceAddress, pagesUpdated * GetMemorySpacePageSize());
+            }
+            if (oserr != OS_EOK) {
+                FreePhysicalMemory(pageCount, pages);
+                return oserr;
+            }
+        }
+    }
+
+    // The destination may only write to its own copy of the pages
+    if (!(attributes & MAPPING_READONLY)) {
+        attributes |= MAPPING_COPYONWRITE;
+    }
+
+    oserr = ArchMmuSetVirtualPages(destination, destinationAddress, pages, pageCount, attributes, &pagesUpdated);
+    if (oserr != OS_EOK) {
+        // Drop the references of the pages that were not mapped
+        FreePhysicalMemory(pageCount - pagesUpdated, &pages[pagesUpdated]);
+    }
+    return oserr;
+}
+
+oserr_t
+MSCopyOnWriteShare(
+        _In_ MemorySpace_t*      source,
+        _In_ vaddr_t             sourceAddress,
+        _In_ MemorySpace_t*      destination,
+        _In_ vaddr_t             destinationAddress,
+        _In_ int                 pageCount,
+        _In_ unsigned int        attributes,
+        _In_ struct MSSyncBatch* batch)
+{
+    size_t        pageSize = GetMemorySpacePageSize();
+    paddr_t*      pages;
+    unsigned int* sourceAttributes;
+    int           pagesRetrieved;
+    oserr_t       oserr = OS_EOK;
+    int           i = 0;
+
+    TRACE("MSCopyOnWriteShare(sourceAddress=0x%" PRIxIN ", destinationAddress=0x%" PRIxIN ", pageCount=%i)",
+          sourceAddress, destinationAddress, pageCount);
+
+    pages            = kmalloc(sizeof(paddr_t) * pageCount);
+    sourceAttributes = kmalloc(sizeof(unsigned int) * pageCount);
+    if (!pages || !sourceAttributes) {
+        oserr = OS_EOOM;
+        goto exit;
+    }
+
+    // Parts of the region that have no page-tables are left out, they have never been touched
+    memset(pages, 0, sizeof(paddr_t) * pageCount);
+    memset(sourceAttributes, 0, sizeof(unsigned int) * pageCount);
+    (void)ArchMmuVirtualToPhysical(source, sourceAddress, pageCount, pages, &pagesRetrieved);
+    (void)ArchMmuGetPageAttributes(source, sourceAddress, pageCount, sourceAttributes, &pagesRetrieved);
+
+    // Handle the region in runs of pages that are shared the same way, to keep the number
+    // of page-table walks down.
+    while (i < pageCount && oserr == OS_EOK) {
+        enum __ShareType type = __GetShareType(sourceAttributes[i]);
+        int              j    = i + 1;
+
+        while (j < pageCount && sourceAttributes[j] == sourceAttributes[i]) {
+            j++;
+        }
+
+        oserr = __ShareRun(
+                source,
+                sourceAddress + (i * pageSize),
+                destination,
+                destinationAddress + (i * pageSize),
+                &pages[i],
+                j - i,
+                type,
+                sourceAttributes[i],
+                attributes ? attributes : (sourceAttributes[i] & ~(MAPPING_COPYONWRITE)),
+                batch
+        );
+        i = j;
+    }
+
+exit:
+    kfree(sourceAttributes);
+    kfree(pages);
+    return oserr;
+}
+
+static oserr_t
+__CopyPage(
+        _In_ paddr_t source,
+        _In_ paddr_t destination)
+{
+    size_t  pageSize = GetMemorySpacePageSize();
+    paddr_t pages[2] = { source, destination };
+    vaddr_t mapping;
+    oserr_t oserr;
+
+    oserr = MemorySpaceMap(
+            GetCurrentMemorySpace(),
+            &(struct MemorySpaceMapOptions) {
+                .Pages = &pages[0],
+                .Length = pageSize * 2,
+                .Flags = MAPPING_COMMIT | MAPPING_PERSISTENT,
+                .PlacementFlags = MAPPING_PHYSICAL_FIXED | MAPPING_VIRTUAL_GLOBAL
+            },
+            &mapping
+    );
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    memcpy((void*)(mapping + pageSize), (void*)mapping, pageSize);
+    return MemorySpaceUnmap(GetCurrentMemorySpace(), mapping, pageSize * 2);
+}
+
+static oserr_t
+__LookupCopyOnWrite(
+        _In_  MemorySpace_t* memorySpace,
+        _In_  vaddr_t        address,
+        _Out_ paddr_t*       physicalAddressOut,
+        _Out_ unsigned int*  attributesOut)
+{
+    int     pagesRetrieved;
+    oserr_t oserr;
+
+    oserr = ArchMmuGetPageAttributes(memorySpace, address, 1, attributesOut, &pagesRetrieved);
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    // Another thread may have gotten here first
+    if (!(*attributesOut & MAPPING_COPYONWRITE)) {
+        return OS_ENOENT;
+    }
+
+    *attributesOut &= ~(MAPPING_COPYONWRITE);
+    return ArchMmuVirtualToPhysical(memorySpace, address, 1, physicalAddressOut, &pagesRetrieved);
+}
+
+oserr_t
+MemorySpaceCopyOnWrite(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address)
+{
+    vaddr_t      pageAddress = address & ~(GetMemorySpacePageSize() - 1);
+    unsigned int attributes;
+    paddr_t      original;
+    paddr_t      copy;
+    oserr_t      oserr;
+
+    TRACE("MemorySpaceCopyOnWrite(address=0x%" PRIxIN ")", address);
+
+    if (memorySpace == NULL || memorySpace->Context == NULL) {
+        return OS_EINVALPARAMS;
+    }
+
+    // The context lock keeps the page from being shared by a fork while we decide
+    // whether it's still shared.
+    MutexLock(&memorySpace->Context->SyncObject);
+    oserr = __LookupCopyOnWrite(memorySpace, pageAddress, &original, &attributes);
+    if (oserr != OS_EOK) {
+        MutexUnlock(&memorySpace->Context->SyncObject);
+        return oserr == OS_ENOENT ? OS_EOK : oserr;
+    }
+
+    // When all other owners have let go of the page, it can simply be taken over, and pages
+    // that are not owned by the mapping are never copied. Making a page writable does not
+    // require other cores to be synchronized, a stale entry will fault and be invalidated.
+    if ((attributes & MAPPING_PERSISTENT) || GetPhysicalMemoryReferences(original) == 1) {
+        oserr = ArchMmuReplaceVirtualPage(memorySpace, pageAddress, original, original, attributes);
+        if (oserr == OS_EOK) {
+            g_reuses++;
+        }
+        MutexUnlock(&memorySpace->Context->SyncObject);
+        return oserr;
+    }
+    MutexUnlock(&memorySpace->Context->SyncObject);
+
+    // Copy the page without holding the lock, the temporary mapping needs it
+    oserr = AllocatePhysicalMemory(0, 1, &copy);
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    oserr = __CopyPage(original, copy);
+    if (oserr != OS_EOK) {
+        FreePhysicalMemory(1, &copy);
+        return oserr;
+    }
+
+    // Install the copy, unless the page was changed while we copied it, in which case
+    // the write is simply retried.
+    MutexLock(&memorySpace->Context->SyncObject);
+    oserr = __LookupCopyOnWrite(memorySpace, pageAddress, &original, &attributes);
+    if (oserr == OS_EOK) {
+        oserr = ArchMmuReplaceVirtualPage(memorySpace, pageAddress, original, copy, attributes);
+    }
+    if (oserr != OS_EOK) {
+        MutexUnlock(&memorySpace->Context->SyncObject);
+        FreePhysicalMemory(1, &copy);
+        return oserr == OS_ENOENT || oserr == OS_EBUSY ? OS_EOK : oserr;
+    }
+
+    // Other threads of the process may still read the shared page through their TLB, they
+    // must see the copy before the reference is dropped.
+    MSSync(memorySpace, pageAddress, GetMemorySpacePageSize());
+    MutexUnlock(&memorySpace->Context->SyncObject);
+    FreePhysicalMemory(1, &original);
+    g_copies++;
+    return OS_EOK;
+}
+
+static oserr_t
+__ForkAllocation(
+        _In_ MemorySpace_t*       source,
+        _In_ MemorySpace_t*       destination,
+        _In_ struct MSAllocation* allocation,
+        _In_ struct MSSyncBatch*  batch)
+{
+    struct MSAllocation* clone;
+    size_t               pageSize = GetMemorySpacePageSize();
+    int                  pageCount = (int)(allocation->Length / pageSize);
+    oserr_t              oserr;
+    int                  i = 0;
+
+    oserr = MSAllocationCreate(
+            destination,
+            allocation->SHMTag,
+            allocation->Address,
+            allocation->Length,
+            allocation->Flags
+    );
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    // The clone refers to the same original mapping as its parent, and has the same
+    // parts freed.
+    clone = MSAllocationLookup(destination->Context, allocation->Address);
+    clone->CloneOf = allocation->CloneOf;
+    memcpy(clone->Pages.data, allocation->Pages.data, BITMAP_SIZE(pageCount) * sizeof(uint32_t));
+
+    // Share the parts of the allocation that are not freed
+    while (i < pageCount && oserr == OS_EOK) {
+        int j = i;
+        if (bitmap_bits_set(&allocation->Pages, i, 1)) {
+            i++;
+            continue;
+        }
+
+        while (j < pageCount && !bitmap_bits_set(&allocation->Pages, j, 1)) {
+            j++;
+        }
+
+        oserr = MSCopyOnWriteShare(
+                source,
+                allocation->Address + (i * pageSize),
+                destination,
+                allocation->Address + (i * pageSize),
+                j - i,
+                0,
+                batch
+        );
+        i = j;
+    }
+    return oserr;
+}
+
+oserr_t
+MemorySpaceFork(
+        _In_ MemorySpace_t* source,
+        _In_ MemorySpace_t* destination)
+{
+    struct MSContext*  context;
+    struct MSSyncBatch batch;
+    interval_node_t*   node;
+    oserr_t            oserr;
+
+    TRACE("MemorySpaceFork()");
+
+    if (source == NULL || destination == NULL || source->Context == NULL || destination->Context == NULL) {
+        return OS_EINVALPARAMS;
+    }
+
+    context = source->Context;
+    MSSyncBatchInitialize(&batch, source);
+    MutexLock(&context->SyncObject);
+
+    // Start out with the exact same virtual memory layout
+    MemoryRangeDestroy(&destination->Context->Heap);
+    oserr = MemoryRangeClone(&context->Heap, &destination->Context->Heap);
+    if (oserr != OS_EOK) {
+        goto exit;
+    }
+    destination->Context->SignalHandler = context->SignalHandler;
+
+    // Compressed pages are reserved in the source, and are reserved in the fork as well
+    oserr = MSCompressedPagesClone(context, destination->Context);
+    if (oserr != OS_EOK) {
+        goto exit;
+    }
+
+    node = interval_tree_first_overlap(&context->Allocations, 0, UINTPTR_MAX);
+    while (node != NULL && oserr == OS_EOK) {
+        oserr = __ForkAllocation(source, destination, node->value, &batch);
+        node = interval_tree_next_overlap(&context->Allocations, node, 0, UINTPTR_MAX);
+    }
+
+exit:
+    MutexUnlock(&context->SyncObject);
+
+    // The pages that were made copy-on-write in the source must not be written through
+    // stale entries, before the call returns.
+    MSSyncBatchFlush(&batch);
+    return oserr;
+}
+
+void
+MemorySpaceGetCopyOnWriteStatistics(
+        _Out_ size_t* copiesOut,
+        _Out_ size_t* reusesOut,
+        _Out_ size_t* sharedPagesOut)
+{
+    *copiesOut      = g_copies;
+    *reusesOut      = g_reuses;
+    *sharedPagesOut = GetPhysicalMemorySharedPages();
+}
@@ -30,6 +30,11 @@ CreateMemorySpace(
     oserr_t        oserr;
     TRACE("CreateMemorySpace(flags=0x%x)", flags);
 
+    // A fork is a new process, it can't share the context of the caller
+    if ((flags & MEMORY_SPACE_FORK) && (flags & MEMORY_SPACE_INHERIT)) {
+        return OS_EINVALPARAMS;
+    }
+
     memorySpace = MemorySpaceNew(flags);
     if (!memorySpace) {
         return OS_EOOM;
@@ -101,11 +106,25 @@ CreateMemorySpace(
             return oserr;
         }
 
+        // The forked memory space starts out as a copy-on-write duplicate of the callers
+        if (flags & MEMORY_SPACE_FORK) {
+            oserr = MemorySpaceFork(GetCurrentMemorySpace(), memorySpace);
+            if (oserr != OS_EOK) {
+                MemorySpaceDelete(memorySpace);
+                return oserr;
+            }
+        }
+
         *handleOut = CreateHandle(
                 HandleTypeMemorySpace,
                 (HandleDestructorFn)MemorySpaceDelete,
                 memorySpace
         );
+
+        // The pages of a process are compressed through its root memory space
+        if (memorySpace->ParentHandle == UUID_INVALID) {
+            MSCompressRegister(memorySpace, *handleOut);
+        }
     } else {
         FATAL(FATAL_SCOPE_KERNEL, "Invalid flags parsed in CreateMemorySpace 0x%" PRIxIN "", flags);
     }
@@ -0,0 +1,262 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Memory Space Demand Faults
+ *   - Commits reserved memory the first time it is accessed. Userspace mappings commit
+ *     a window of neighbouring pages together with the page that faulted, so linear
+ *     accesses do not take a fault for every page. Pages that were compressed are restored
+ *     from their compressed copy instead.
+ */
+
+#define __MODULE "MEM2"
+#define __need_minmax
+
+//#define __TRACE
+
+#include <debug.h>
+#include <memoryspace.h>
+#include <mutex.h>
+#include <shm.h>
+#include "private.h"
+
+int
+MSFaultAroundWindow(
+        _In_  struct MSFaultAround* faultAround,
+        _In_  unsigned int          flags,
+        _In_  vaddr_t               address,
+        _In_  vaddr_t               start,
+        _In_  vaddr_t               end,
+        _Out_ vaddr_t*              windowStartOut,
+        _Out_ bool*                 sequentialOut)
+{
+    size_t  pageSize = GetMemorySpacePageSize();
+    int     limit    = (flags & MAPPING_SEQUENTIAL) ? MS_FAULTAROUND_SEQUENTIAL_PAGES : MS_FAULTAROUND_MAX_PAGES;
+    vaddr_t windowStart;
+    vaddr_t windowEnd;
+    bool    sequential;
+    int     pages;
+
+    // Accesses that continue on either side of the previous window are sequential, so
+    // memory that is walked downwards, like stacks, is detected as well.
+    sequential = faultAround->Pages != 0 &&
+                 (address == faultAround->End || address + pageSize == faultAround->Start);
+
+    if (flags & (MAPPING_RANDOM | MAPPING_TRAPPAGE)) {
+        // Every access to trap pages must be seen
+        pages = 1;
+    } else if (!faultAround->Pages || (flags & MAPPING_SEQUENTIAL)) {
+        pages = (flags & MAPPING_SEQUENTIAL) ? limit : MS_FAULTAROUND_INITIAL_PAGES;
+    } else if (sequential) {
+        pages = MIN(faultAround->Pages * 2, limit);
+    } else {
+        pages = MAX(faultAround->Pages / 2, 1);
+    }
+
+    windowStart = address & ~((pages * pageSize) - 1);
+    windowEnd   = MIN(windowStart + (pages * pageSize), end);
+    windowStart = MAX(windowStart, start);
+    TRACE("MSFaultAroundWindow(address=0x%" PRIxIN ") window=0x%" PRIxIN ", pages=%i, sequential=%i",
+          address, windowStart, pages, sequential);
+
+    faultAround->Start = windowStart;
+    faultAround->End   = windowEnd;
+    faultAround->Pages = pages;
+
+    *windowStartOut = windowStart;
+    *sequentialOut  = sequential;
+    return (int)((windowEnd - windowStart) / pageSize);
+}
+
+static oserr_t
+__CommitPages(
+        _In_ MemorySpace_t*        memorySpace,
+        _In_ OSMemoryDescriptor_t* descriptor,
+        _In_ vaddr_t               address,
+        _In_ int                   pageCount)
+{
+    paddr_t physicalAddresses[MS_FAULTAROUND_SEQUENTIAL_PAGES];
+    size_t  length = pageCount * GetMemorySpacePageSize();
+
+    // File views and other shared memory mappings commit the pages of the buffer.
+    if (descriptor->SHMTag != UUID_INVALID) {
+        return SHMCommit(
+                descriptor->SHMTag,
+                (void*)descriptor->StartAddress,
+                (void*)address,
+                length
+        );
+    } else {
+        // If the mapping has the attribute CLEAN, then the page must be zeroed, which is
+        // served from the zero pool when possible. However if the mapping was read-only, we
+        // cannot zero the page through the mapping when the pool is empty.
+        bool         readOnly       = (descriptor->Attributes & MAPPING_READONLY) != 0;
+        bool         shouldClean    = (descriptor->Attributes & MAPPING_CLEAN) != 0;
+        unsigned int placementFlags = (!readOnly && shouldClean) ? MAPPING_PHYSICAL_ZEROED : 0;
+
+        return MemorySpaceCommit(
+                memorySpace,
+                address,
+                &physicalAddresses[0],
+                length,
+                0,
+                placementFlags
+        );
+    }
+}
+
+static int
+__CommitWindow(
+        _In_ MemorySpace_t*        memorySpace,
+        _In_ OSMemoryDescriptor_t* descriptor,
+        _In_ vaddr_t               windowStart,
+        _In_ int                   pageCount)
+{
+    unsigned int attributes[MS_FAULTAROUND_SEQUENTIAL_PAGES];
+    size_t       pageSize       = GetMemorySpacePageSize();
+    int          pagesCommitted = 0;
+    int          i              = 0;
+
+    // Only the pages that are still reserved are committed, the rest of the window is either
+    // committed already or has been freed.
+    if (GetMemorySpaceAttributes(memorySpace, windowStart, pageCount * pageSize, &attributes[0]) != OS_EOK) {
+        return 0;
+    }
+
+    // Compressed pages are reserved as well, but must be restored by a fault of their own
+    if (atomic_load(&memorySpace->Context->CompressedPageCount)) {
+        MSCompressedPagesExclude(memorySpace->Context, windowStart, pageCount, &attributes[0]);
+    }
+
+    while (i < pageCount) {
+        int runLength = 0;
+        while (i + runLength < pageCount && attributes[i + runLength] &&
+               !(attributes[i + runLength] & MAPPING_COMMIT)) {
+            runLength++;
+        }
+
+        // The neighbours are committed on a best effort basis, another thread may
+        // be faulting on them at the same time.
+        if (runLength) {
+            if (__CommitPages(memorySpace, descriptor, windowStart + (i * pageSize), runLength) == OS_EOK) {
+                pagesCommitted += runLength;
+            }
+            i += runLength;
+        } else {
+            i++;
+        }
+    }
+    return pagesCommitted;
+}
+
+static void
+__FaultAround(
+        _In_ MemorySpace_t*        memorySpace,
+        _In_ OSMemoryDescriptor_t* descriptor,
+        _In_ vaddr_t               address)
+{
+    struct MSContext*    context = memorySpace->Context;
+    struct MSAllocation* allocation;
+    vaddr_t              windowStart;
+    bool                 sequential = false;
+    int                  pageCount  = 1;
+
+    atomic_fetch_add(&context->Faults, 1);
+
+    // Faults in memory that is not allocation tracked only commit the page itself
+    allocation = MSAllocationAcquire(context, address);
+    if (allocation == NULL) {
+        return;
+    }
+
+    // The start of the descriptor excludes guard pages
+    MutexLock(&context->SyncObject);
+    pageCount = MSFaultAroundWindow(
+            &allocation->FaultAround,
+            allocation->Flags,
+            address,
+            MAX(descriptor->StartAddress, allocation->Address),
+            allocation->Address + allocation->Length,
+            &windowStart,
+            &sequential
+    );
+    MutexUnlock(&context->SyncObject);
+    MSAllocationRelease(context, allocation);
+
+    if (sequential) {
+        atomic_fetch_add(&context->SequentialFaults, 1);
+    }
+    if (pageCount > 1) {
+        atomic_fetch_add(
+                &context->FaultAroundPages,
+                __CommitWindow(memorySpace, descriptor, windowStart, pageCount)
+        );
+    }
+}
+
+oserr_t
+MemorySpaceCommitFault(
+        _In_ MemorySpace_t*        memorySpace,
+        _In_ OSMemoryDescriptor_t* descriptor,
+        _In_ vaddr_t               address)
+{
+    vaddr_t pageAddress = address & ~(GetMemorySpacePageSize() - 1);
+    oserr_t oserr;
+    TRACE("MemorySpaceCommitFault(address=0x%" PRIxIN ")", address);
+
+    if (memorySpace == NULL || descriptor == NULL) {
+        return OS_EINVALPARAMS;
+    }
+
+    // A page that was compressed must be restored instead of committing a new one. The count
+    // is raised before pages are decommitted, so a page that faults while it's zero was not.
+    if (memorySpace->Context != NULL && atomic_load(&memorySpace->Context->CompressedPageCount)) {
+        oserr = MSCompressedPageRestore(memorySpace, pageAddress);
+        if (oserr != OS_ENOENT) {
+            return oserr;
+        }
+    }
+
+    // Commit the page and continue without anyone noticing, and handle race-conditions
+    // if two different threads have accessed a reserved page. OS_EEXISTS will be returned.
+    oserr = __CommitPages(memorySpace, descriptor, pageAddress, 1);
+    if (oserr == OS_EEXISTS) {
+        return OS_EOK;
+    } else if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    if (memorySpace->Context != NULL) {
+        __FaultAround(memorySpace, descriptor, pageAddress);
+    }
+    return OS_EOK;
+}
+
+oserr_t
+MemorySpaceGetFaultStatistics(
+        _In_  MemorySpace_t* memorySpace,
+        _Out_ size_t*        faultsOut,
+        _Out_ size_t*        sequentialOut,
+        _Out_ size_t*        faultAroundOut)
+{
+    if (memorySpace == NULL || memorySpace->Context == NULL) {
+        return OS_ENOTSUPPORTED;
+    }
+
+    *faultsOut      = atomic_load(&memorySpace->Context->Faults);
+    *sequentialOut  = atomic_load(&memorySpace->Context->SequentialFaults);
+    *faultAroundOut = atomic_load(&memorySpace->Context->FaultAroundPages);
+    return OS_EOK;
+}
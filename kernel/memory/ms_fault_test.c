@@ -0,0 +1,514 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <shm.h>
+#include "private.h"
+#include <string.h>
+
+#define TEST_PAGE_SIZE  0x1000
+#define TEST_BASE       0x10000000
+#define TEST_PAGES      256
+#define TEST_ADDRESS(i) (TEST_BASE + ((vaddr_t)(i) * TEST_PAGE_SIZE))
+
+enum __PageState {
+    __PAGE_FREE,
+    __PAGE_RESERVED,
+    __PAGE_COMMITTED,
+    __PAGE_COMPRESSED
+};
+
+struct __MemorySpaceCommit {
+    int Calls;
+    int PagesCommitted;
+};
+
+struct __SHMCommit {
+    int Calls;
+    int PagesCommitted;
+};
+
+struct __MutexLock {
+    int Held;
+};
+
+struct __MSCompressedPageRestore {
+    int Calls;
+    int PagesRestored;
+};
+
+DEFINE_TEST_CONTEXT({
+    enum __PageState    Pages[TEST_PAGES];
+    struct MSContext    Context;
+    struct MSAllocation Allocation;
+    MemorySpace_t       MemorySpace;
+    int                 Faults;
+    MOCK_STRUCT_FUNC(MemorySpaceCommit);
+    MOCK_STRUCT_FUNC(SHMCommit);
+    MOCK_STRUCT_FUNC(MutexLock);
+    MOCK_STRUCT_FUNC(MSCompressedPageRestore);
+});
+
+int Setup(void** state) {
+    (void)state;
+    return 0;
+}
+
+int Teardown(void** state) {
+    (void)state;
+    return 0;
+}
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(g_testContext));
+    for (int i = 0; i < TEST_PAGES; i++) {
+        g_testContext.Pages[i] = __PAGE_RESERVED;
+    }
+    g_testContext.Allocation.Address     = TEST_BASE;
+    g_testContext.Allocation.Length      = TEST_PAGES * TEST_PAGE_SIZE;
+    g_testContext.Allocation.SHMTag      = UUID_INVALID;
+    g_testContext.Allocation.Flags       = MAPPING_USERSPACE;
+    g_testContext.MemorySpace.Context    = &g_testContext.Context;
+    return 0;
+}
+
+static void
+__Access(
+        _In_ OSMemoryDescriptor_t* descriptor,
+        _In_ int                   page)
+{
+    if (g_testContext.Pages[page] == __PAGE_COMMITTED) {
+        return;
+    }
+
+    g_testContext.Faults++;
+    assert_int_equal(MemorySpaceCommitFault(&g_testContext.MemorySpace, descriptor, TEST_ADDRESS(page) + 0x10), OS_EOK);
+    assert_int_equal(g_testContext.Pages[page], __PAGE_COMMITTED);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+}
+
+static void
+__InitializeDescriptor(
+        _In_ OSMemoryDescriptor_t* descriptor)
+{
+    descriptor->SHMTag         = g_testContext.Allocation.SHMTag;
+    descriptor->StartAddress   = g_testContext.Allocation.Address;
+    descriptor->AllocationSize = g_testContext.Allocation.Length;
+    descriptor->Attributes     = g_testContext.Allocation.Flags;
+}
+
+static void
+__AssertStatistics(
+        _In_ size_t faults,
+        _In_ size_t sequential,
+        _In_ size_t faultAround)
+{
+    size_t faultsOut, sequentialOut, faultAroundOut;
+    assert_int_equal(MemorySpaceGetFaultStatistics(&g_testContext.MemorySpace, &faultsOut, &sequentialOut, &faultAroundOut), OS_EOK);
+    assert_int_equal(faultsOut, faults);
+    assert_int_equal(sequentialOut, sequential);
+    assert_int_equal(faultAroundOut, faultAround);
+}
+
+void TestMSFaultAroundWindow_Adapts(void** state)
+{
+    struct MSFaultAround faultAround = { 0 };
+    vaddr_t              windowStart;
+    bool                 sequential;
+    (void)state;
+
+    // The first fault gets the initial window, aligned on its size
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(5), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), MS_FAULTAROUND_INITIAL_PAGES);
+    assert_int_equal(windowStart, TEST_ADDRESS(4));
+    assert_false(sequential);
+
+    // Continuing where the window ended doubles it, up to the limit
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(8), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 8);
+    assert_int_equal(windowStart, TEST_ADDRESS(8));
+    assert_true(sequential);
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(16), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 16);
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(32), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), MS_FAULTAROUND_MAX_PAGES);
+    assert_true(sequential);
+
+    // And every fault elsewhere halves it, down to the page itself
+    for (int expected = MS_FAULTAROUND_MAX_PAGES / 2; expected >= 1; expected /= 2) {
+        assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(200), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                             &windowStart, &sequential), expected);
+        assert_false(sequential);
+    }
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(100), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 1);
+    assert_int_equal(windowStart, TEST_ADDRESS(100));
+}
+
+void TestMSFaultAroundWindow_Downwards(void** state)
+{
+    struct MSFaultAround faultAround = { 0 };
+    vaddr_t              windowStart;
+    bool                 sequential;
+    (void)state;
+
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(255), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 4);
+    assert_int_equal(windowStart, TEST_ADDRESS(252));
+
+    // The page below the window is sequential too
+    assert_int_equal(MSFaultAroundWindow(&faultAround, 0, TEST_ADDRESS(251), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 8);
+    assert_int_equal(windowStart, TEST_ADDRESS(248));
+    assert_true(sequential);
+}
+
+void TestMSFaultAroundWindow_Bounds(void** state)
+{
+    struct MSFaultAround faultAround = { 0 };
+    vaddr_t              windowStart;
+    bool                 sequential;
+    (void)state;
+
+    // Clipped to the start, i.e. when the first page of a stack is its guard page
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_SEQUENTIAL, TEST_ADDRESS(2), TEST_ADDRESS(1), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), MS_FAULTAROUND_SEQUENTIAL_PAGES - 1);
+    assert_int_equal(windowStart, TEST_ADDRESS(1));
+
+    // And to the end
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_SEQUENTIAL, TEST_ADDRESS(250), TEST_ADDRESS(0), TEST_ADDRESS(253),
+                                         &windowStart, &sequential), 253 - 224);
+    assert_int_equal(windowStart, TEST_ADDRESS(224));
+}
+
+void TestMSFaultAroundWindow_Hints(void** state)
+{
+    struct MSFaultAround faultAround = { 0 };
+    vaddr_t              windowStart;
+    bool                 sequential;
+    (void)state;
+
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_RANDOM, TEST_ADDRESS(3), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 1);
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_RANDOM, TEST_ADDRESS(4), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 1);
+    assert_true(sequential);
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_TRAPPAGE, TEST_ADDRESS(5), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), 1);
+
+    // Sequential mappings keep the largest window, even when accessed elsewhere
+    memset(&faultAround, 0, sizeof(struct MSFaultAround));
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_SEQUENTIAL, TEST_ADDRESS(3), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), MS_FAULTAROUND_SEQUENTIAL_PAGES);
+    assert_int_equal(MSFaultAroundWindow(&faultAround, MAPPING_SEQUENTIAL, TEST_ADDRESS(200), TEST_ADDRESS(0), TEST_ADDRESS(TEST_PAGES),
+                                         &windowStart, &sequential), MS_FAULTAROUND_SEQUENTIAL_PAGES);
+}
+
+void TestMemorySpaceCommitFault_LinearScan(void** state)
+{
+    OSMemoryDescriptor_t descriptor;
+    (void)state;
+
+    __InitializeDescriptor(&descriptor);
+    for (int i = 0; i < TEST_PAGES; i++) {
+        __Access(&descriptor, i);
+    }
+
+    // Windows of 4, 8 and 16 pages, and then a fault for every 16 pages. Each fault after the first
+    // continues where the previous window ended.
+    assert_int_equal(g_testContext.Faults, 3 + ((TEST_PAGES - 16) / MS_FAULTAROUND_MAX_PAGES));
+    __AssertStatistics(g_testContext.Faults, g_testContext.Faults - 1, TEST_PAGES - g_testContext.Faults);
+    assert_int_equal(g_testContext.MemorySpaceCommit.PagesCommitted, TEST_PAGES);
+}
+
+void TestMemorySpaceCommitFault_Random(void** state)
+{
+    OSMemoryDescriptor_t descriptor;
+    (void)state;
+
+    g_testContext.Allocation.Flags |= MAPPING_RANDOM;
+    __InitializeDescriptor(&descriptor);
+    for (int i = 0; i < 32; i++) {
+        __Access(&descriptor, i);
+    }
+    assert_int_equal(g_testContext.Faults, 32);
+    assert_int_equal(g_testContext.MemorySpaceCommit.PagesCommitted, 32);
+    __AssertStatistics(32, 31, 0);
+}
+
+void TestMemorySpaceCommitFault_Sequential(void** state)
+{
+    OSMemoryDescriptor_t descriptor;
+    (void)state;
+
+    g_testContext.Allocation.Flags |= MAPPING_SEQUENTIAL;
+    __InitializeDescriptor(&descriptor);
+    for (int i = 0; i < TEST_PAGES; i++) {
+        __Access(&descriptor, i);
+    }
+    assert_int_equal(g_testContext.Faults, TEST_PAGES / MS_FAULTAROUND_SEQUENTIAL_PAGES);
+}
+
+void TestMemorySpaceCommitFault_SkipsCommitted(void** state)
+{
+    OSMemoryDescriptor_t descriptor;
+    (void)state;
+
+    // Holes in the window are left alone, committed pages are not committed again
+    g_testContext.Pages[1] = __PAGE_COMMITTED;
+    g_testContext.Pages[2] = __PAGE_FREE;
+    __InitializeDescriptor(&descriptor);
+    __Access(&descriptor, 0);
+
+    assert_int_equal(g_testContext.Pages[2], __PAGE_FREE);
+    assert_int_equal(g_testContext.Pages[3], __PAGE_COMMITTED);
+    assert_int_equal(g_testContext.Pages[4], __PAGE_RESERVED);
+    assert_int_equal(g_testContext.MemorySpaceCommit.Calls, 2);
+    __AssertStatistics(1, 0, 1);
+}
+
+void TestMemorySpaceCommitFault_FileView(void** state)
+{
+    OSMemoryDescriptor_t descriptor;
+    (void)state;
+
+    g_testContext.Allocation.SHMTag = 1;
+    __InitializeDescriptor(&descriptor);
+    __Access(&descriptor, 0);
+    __Access(&descriptor, 4);
+
+    // The pages of the buffer are committed in runs
+    assert_int_equal(g_testContext.SHMCommit.Calls, 4);
+    assert_int_equal(g_testContext.SHMCommit.PagesCommitted, 8);
+    assert_int_equal(g_testContext.MemorySpaceCommit.Calls, 0);
+}
+
+void TestMemorySpaceCommitFault_Untracked(void** state)
+{
+    OSMemoryDescriptor_t descriptor = { .SHMTag = UUID_INVALID };
+    (void)state;
+
+    // Kernel memory is never faulted around, and has no statistics
+    g_testContext.MemorySpace.Context = NULL;
+    __Access(&descriptor, 10);
+    assert_int_equal(g_testContext.MemorySpaceCommit.PagesCommitted, 1);
+    assert_int_equal(g_testContext.Pages[11], __PAGE_RESERVED);
+}
+
+void TestMemorySpaceCommitFault_Compressed(void** state)
+{
+    OSMemoryDescriptor_t descriptor;
+    (void)state;
+
+    // Compressed pages are reserved, but are never committed as part of a window
+    g_testContext.Pages[1] = __PAGE_COMPRESSED;
+    g_testContext.Pages[6] = __PAGE_COMPRESSED;
+    atomic_store(&g_testContext.Context.CompressedPageCount, 2);
+    __InitializeDescriptor(&descriptor);
+    __Access(&descriptor, 0);
+
+    assert_int_equal(g_testContext.Pages[1], __PAGE_COMPRESSED);
+    assert_int_equal(g_testContext.Pages[2], __PAGE_COMMITTED);
+    assert_int_equal(g_testContext.Pages[3], __PAGE_COMMITTED);
+    assert_int_equal(g_testContext.MSCompressedPageRestore.Calls, 1);
+    assert_int_equal(g_testContext.MSCompressedPageRestore.PagesRestored, 0);
+
+    // A fault on one is served by restoring it, which does not count as a demand fault
+    __Access(&descriptor, 1);
+    assert_int_equal(g_testContext.MSCompressedPageRestore.PagesRestored, 1);
+    assert_int_equal(g_testContext.MemorySpaceCommit.PagesCommitted, 3);
+    __AssertStatistics(1, 0, 2);
+
+    // Once none are left, faults do not look for them
+    atomic_store(&g_testContext.Context.CompressedPageCount, 1);
+    __Access(&descriptor, 6);
+    assert_int_equal(g_testContext.MSCompressedPageRestore.PagesRestored, 2);
+    atomic_store(&g_testContext.Context.CompressedPageCount, 0);
+    __Access(&descriptor, 10);
+    assert_int_equal(g_testContext.MSCompressedPageRestore.Calls, 3);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestMSFaultAroundWindow_Adapts, SetupTest),
+            cmocka_unit_test_setup(TestMSFaultAroundWindow_Downwards, SetupTest),
+            cmocka_unit_test_setup(TestMSFaultAroundWindow_Bounds, SetupTest),
+            cmocka_unit_test_setup(TestMSFaultAroundWindow_Hints, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_LinearScan, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_Random, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_Sequential, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_SkipsCommitted, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_FileView, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_Untracked, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCommitFault_Compressed, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, Setup, Teardown);
+}
+
+size_t GetMemorySpacePageSize(void) {
+    return TEST_PAGE_SIZE;
+}
+
+static oserr_t
+__Commit(
+        _In_ vaddr_t address,
+        _In_ size_t  length)
+{
+    int first = (int)((address - TEST_BASE) / TEST_PAGE_SIZE);
+    int count = (int)(length / TEST_PAGE_SIZE);
+
+    assert_int_equal(address & (TEST_PAGE_SIZE - 1), 0);
+    assert_in_range(first, 0, TEST_PAGES - count);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+
+    for (int i = 0; i < count; i++) {
+        if (g_testContext.Pages[first + i] != __PAGE_RESERVED) {
+            return i == 0 ? OS_EEXISTS : OS_EINCOMPLETE;
+        }
+        g_testContext.Pages[first + i] = __PAGE_COMMITTED;
+    }
+    return OS_EOK;
+}
+
+oserr_t MemorySpaceCommit(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ uintptr_t*     physicalAddressValues,
+        _In_ size_t         size,
+        _In_ size_t         pageMask,
+        _In_ unsigned int   placementFlags) {
+    oserr_t oserr;
+    assert_ptr_equal(memorySpace, &g_testContext.MemorySpace);
+    assert_non_null(physicalAddressValues);
+    assert_in_range(size, TEST_PAGE_SIZE, MS_FAULTAROUND_SEQUENTIAL_PAGES * TEST_PAGE_SIZE);
+    (void)pageMask;
+    (void)placementFlags;
+
+    g_testContext.MemorySpaceCommit.Calls++;
+    oserr = __Commit(address, size);
+    if (oserr == OS_EOK) {
+        g_testContext.MemorySpaceCommit.PagesCommitted += (int)(size / TEST_PAGE_SIZE);
+    }
+    return oserr;
+}
+
+oserr_t SHMCommit(
+        _In_ uuid_t handle,
+        _In_ void*  memoryBase,
+        _In_ void*  memory,
+        _In_ size_t length) {
+    oserr_t oserr;
+    assert_int_equal(handle, 1);
+    assert_int_equal((vaddr_t)memoryBase, TEST_BASE);
+
+    g_testContext.SHMCommit.Calls++;
+    oserr = __Commit((vaddr_t)memory, length);
+    if (oserr == OS_EOK) {
+        g_testContext.SHMCommit.PagesCommitted += (int)(length / TEST_PAGE_SIZE);
+    }
+    return oserr;
+}
+
+oserr_t GetMemorySpaceAttributes(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ size_t         length,
+        _In_ unsigned int*  attributesArray) {
+    int first = (int)((address - TEST_BASE) / TEST_PAGE_SIZE);
+    int count = (int)(length / TEST_PAGE_SIZE);
+    assert_ptr_equal(memorySpace, &g_testContext.MemorySpace);
+    assert_in_range(first, 0, TEST_PAGES - count);
+
+    for (int i = 0; i < count; i++) {
+        switch (g_testContext.Pages[first + i]) {
+            case __PAGE_FREE: attributesArray[i] = 0; break;
+            case __PAGE_RESERVED:
+            case __PAGE_COMPRESSED: attributesArray[i] = MAPPING_USERSPACE; break;
+            case __PAGE_COMMITTED: attributesArray[i] = MAPPING_USERSPACE | MAPPING_COMMIT; break;
+        }
+    }
+    return OS_EOK;
+}
+
+struct MSAllocation* MSAllocationAcquire(
+        _In_ struct MSContext* context,
+        _In_ vaddr_t           address) {
+    assert_ptr_equal(context, &g_testContext.Context);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+    if (address < TEST_BASE || address >= TEST_ADDRESS(TEST_PAGES)) {
+        return NULL;
+    }
+    g_testContext.Allocation.References++;
+    return &g_testContext.Allocation;
+}
+
+oserr_t MSAllocationRelease(
+        _In_ struct MSContext*    context,
+        _In_ struct MSAllocation* allocation) {
+    assert_ptr_equal(context, &g_testContext.Context);
+    assert_ptr_equal(allocation, &g_testContext.Allocation);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+    allocation->References--;
+    return OS_EOK;
+}
+
+void MutexLock(Mutex_t* mutex) {
+    assert_ptr_equal(mutex, &g_testContext.Context.SyncObject);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+    g_testContext.MutexLock.Held = 1;
+}
+
+void MutexUnlock(Mutex_t* mutex) {
+    assert_ptr_equal(mutex, &g_testContext.Context.SyncObject);
+    assert_int_equal(g_testContext.MutexLock.Held, 1);
+    g_testContext.MutexLock.Held = 0;
+}
+
+oserr_t MSCompressedPageRestore(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address) {
+    int page = (int)((address - TEST_BASE) / TEST_PAGE_SIZE);
+    assert_ptr_equal(memorySpace, &g_testContext.MemorySpace);
+    assert_int_equal(address & (TEST_PAGE_SIZE - 1), 0);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+
+    g_testContext.MSCompressedPageRestore.Calls++;
+    if (g_testContext.Pages[page] != __PAGE_COMPRESSED) {
+        return OS_ENOENT;
+    }
+    g_testContext.Pages[page] = __PAGE_COMMITTED;
+    g_testContext.MSCompressedPageRestore.PagesRestored++;
+    return OS_EOK;
+}
+
+void MSCompressedPagesExclude(
+        _In_ struct MSContext* context,
+        _In_ vaddr_t           address,
+        _In_ int               pageCount,
+        _In_ unsigned int*     attributes) {
+    int first = (int)((address - TEST_BASE) / TEST_PAGE_SIZE);
+    assert_ptr_equal(context, &g_testContext.Context);
+    assert_int_equal(g_testContext.MutexLock.Held, 0);
+
+    for (int i = 0; i < pageCount; i++) {
+        if (g_testContext.Pages[first + i] == __PAGE_COMPRESSED) {
+            attributes[i] = 0;
+        }
+    }
+}
@@ -41,6 +41,7 @@
 
 static oserr_t
 __VerifyFixedVirtualAddress(
+        _In_  MemorySpace_t*                memorySpace,
         _In_  struct MemorySpaceMapOptions* options,
         _Out_ vaddr_t*                      baseAddressOut)
 {
@@ -59,6 +60,17 @@ __VerifyFixedVirtualAddress(
     // Align the provided value on a page-boundary
     *baseAddressOut = options->VirtualStart & ~(GetMemorySpacePageSize() - 1);
 
+    // Fixed mappings inside the process heap must be marked as used there, so the region
+    // is not handed out again by a later process allocation.
+    if (memorySpace->Context != NULL && MemoryRangeContains(&memorySpace->Context->Heap, *baseAddressOut)) {
+        size_t  length = (options->VirtualStart + options->Length) - *baseAddressOut;
+        oserr_t oserr  = MemoryRangeReserve(&memorySpace->Context->Heap, *baseAddressOut, length);
+        if (oserr != OS_EOK) {
+            ERROR("__AllocateVirtualMemory: fixed region 0x%" PRIxIN " is not available", options->VirtualStart);
+            return oserr;
+        }
+    }
+
     // Now fixup the allocated address if the allocation was a stack, but not
     // for pre-provided
     if (options->Flags & MAPPING_STACK) {
@@ -75,25 +87,29 @@ __AllocateProcessMemory(
         _In_ unsigned int   mapFlags)
 {
     vaddr_t address;
+    oserr_t oserr;
 
     if (memorySpace->Context == NULL) {
         ERROR("__AllocateProcessMemory: requested process memory for non-process memory space");
         return 0;
     }
 
-    address = DynamicMemoryPoolAllocate(&memorySpace->Context->Heap, size);
-    if (address == 0) {
+    // Best-fit keeps the large gaps intact for large mappings, the size is only rounded
+    // up to the memory granularity.
+    oserr = MemoryRangeAllocate(&memorySpace->Context->Heap, size, 0, MemoryRangeBestFit, &address);
+    if (oserr != OS_EOK) {
         ERROR("__AllocateProcessMemory: cannot allocate 0x%" PRIxIN " bytes of memory", size);
-    } else {
-        // We only track user allocations, not kernel allocations. If we wanted to track ALL allocations
-        // then we would have to guard against eternal loops as-well as the __CreateAllocation actually calls
-        // kmalloc
-        oserr_t oserr = MSAllocationCreate(memorySpace, shmTag, address, size, mapFlags);
-        if (oserr != OS_EOK) {
-            ERROR("__AllocateProcessMemory: cannot register allocation");
-            DynamicMemoryPoolFree(&memorySpace->Context->Heap, size);
-            address = 0;
-        }
+        return 0;
+    }
+
+    // We only track user allocations, not kernel allocations. If we wanted to track ALL allocations
+    // then we would have to guard against eternal loops as-well as the __CreateAllocation actually calls
+    // kmalloc
+    oserr = MSAllocationCreate(memorySpace, shmTag, address, size, mapFlags);
+    if (oserr != OS_EOK) {
+        ERROR("__AllocateProcessMemory: cannot register allocation");
+        MemoryRangeFree(&memorySpace->Context->Heap, address);
+        address = 0;
     }
     return address;
 }
@@ -116,7 +132,7 @@ __AllocateVirtualMemory(
 
     switch (__VMTYPE(options->PlacementFlags)) {
         case MAPPING_VIRTUAL_FIXED: {
-            return __VerifyFixedVirtualAddress(options, baseAddressOut);
+            return __VerifyFixedVirtualAddress(memorySpace, options, baseAddressOut);
         } break;
 
         case MAPPING_VIRTUAL_PROCESS: {
@@ -178,8 +194,16 @@ __FreeVirtualMemory(
 
     _CRT_UNUSED(size);
     switch (__VMTYPE(placementFlags)) {
+        case MAPPING_VIRTUAL_FIXED: {
+            // Fixed mappings only occupy the process heap when they were placed inside it. This
+            // undoes the reservation made by the failed mapping, so all of it is freed.
+            if (memorySpace->Context != NULL && MemoryRangeContains(&memorySpace->Context->Heap, address)) {
+                MemoryRangeFree(&memorySpace->Context->Heap, address);
+            }
+        } break;
+
         case MAPPING_VIRTUAL_PROCESS: {
-            DynamicMemoryPoolFree(&memorySpace->Context->Heap, address);
+            MemoryRangeFree(&memorySpace->Context->Heap, address);
         } break;
 
         case MAPPING_VIRTUAL_THREAD: {
@@ -233,7 +257,8 @@ __CommitMapping(
         _In_ vaddr_t        address,
         _In_ paddr_t*       pages,
         _In_ int            pageCount,
-        _In_ unsigned int   flags)
+        _In_ unsigned int   flags,
+        _In_ int            pagesZeroed)
 {
     int     pagesUpdated;
     oserr_t oserr;
@@ -259,11 +284,12 @@ __CommitMapping(
         return oserr;
     }
 
-    if (flags & MAPPING_CLEAN) {
+    // Pages taken from the zero pool are already clean, so only the rest need to be cleared
+    if ((flags & MAPPING_CLEAN) && pagesUpdated > pagesZeroed) {
         memset(
-                (void*)address,
+                (void*)(address + (pagesZeroed * GetMemorySpacePageSize())),
                 0,
-                (pagesUpdated * GetMemorySpacePageSize())
+                ((pagesUpdated - pagesZeroed) * GetMemorySpacePageSize())
         );
     }
     return OS_EOK;
@@ -311,6 +337,7 @@ MemorySpaceMap(
     struct MSAllocation* allocation;
     int                  pageCount;
     vaddr_t              virtualBase;
+    int                  pagesZeroed = 0;
     oserr_t              oserr;
 
     if (memorySpace == NULL || options == NULL) {
@@ -370,25 +397,56 @@ MemorySpaceMap(
         return oserr;
     }
 
-    // If we are doing a contigious physical mapping, then we should use another underlying call
+    // If we are doing a contigious physical mapping, then we should use another underlying call. When
+    // the caller wants the pages back, it means we must allocate the contiguous memory as well.
     if (__PMTYPE(options->PlacementFlags) == MAPPING_PHYSICAL_CONTIGUOUS) {
+        paddr_t physicalStart = options->PhysicalStart;
+        if (options->Pages != NULL) {
+            oserr = AllocatePhysicalMemoryContiguous(options->Mask, pageCount, &options->Pages[0]);
+            if (oserr != OS_EOK) {
+                ERROR("MemorySpaceMap: cannot allocate contiguous physical memory for mapping");
+                goto cleanup;
+            }
+            physicalStart = options->Pages[0];
+        }
+
         oserr = __ContiguousMapping(
                 memorySpace,
                 virtualBase,
-                options->PhysicalStart,
+                physicalStart,
                 pageCount,
                 options->Flags
         );
         if (oserr != OS_EOK) {
+            if (options->Pages != NULL) {
+                FreePhysicalMemory(pageCount, &options->Pages[0]);
+            }
             goto cleanup;
         }
+
+        // Only clear memory that was allocated here, a provided range can be device memory
+        if (options->Pages != NULL && (options->Flags & MAPPING_CLEAN)) {
+            memset((void*)virtualBase, 0, pageCount * GetMemorySpacePageSize());
+        }
         return oserr;
     }
 
     // If physical mappings are not provided in options->Pages, then fill it with mappings.
     // TODO: should we support partially filled pages?
 getPhysicalPages:
-    if (__PMTYPE(options->PlacementFlags) != MAPPING_PHYSICAL_FIXED) {
+    if (__PMTYPE(options->PlacementFlags) == MAPPING_PHYSICAL_INTERLEAVED) {
+        oserr = AllocatePhysicalMemoryInterleaved(options->Mask, pageCount, &options->Pages[0]);
+        if (oserr != OS_EOK) {
+            ERROR("MemorySpaceMap: cannot allocate physical memory for mapping");
+            goto cleanup;
+        }
+    } else if (__PMTYPE(options->PlacementFlags) != MAPPING_PHYSICAL_FIXED && (options->Flags & MAPPING_CLEAN)) {
+        oserr = AllocatePhysicalMemoryZeroed(options->Mask, pageCount, &options->Pages[0], &pagesZeroed);
+        if (oserr != OS_EOK) {
+            ERROR("MemorySpaceMap: cannot allocate physical memory for mapping");
+            goto cleanup;
+        }
+    } else if (__PMTYPE(options->PlacementFlags) != MAPPING_PHYSICAL_FIXED) {
         oserr = AllocatePhysicalMemory(options->Mask, pageCount, &options->Pages[0]);
         if (oserr != OS_EOK) {
             ERROR("MemorySpaceMap: cannot allocate physical memory for mapping");
@@ -401,7 +459,8 @@ getPhysicalPages:
             virtualBase,
             options->Pages,
             pageCount,
-            options->Flags
+            options->Flags,
+            pagesZeroed
     );
     if (oserr != OS_EOK) {
         ERROR("MemorySpaceMap: cannot commit allocated mappings");
@@ -429,15 +488,21 @@ MemorySpaceCommit(
         _In_ size_t         pageMask,
         _In_ unsigned int   placementFlags)
 {
-    int     pageCount = DIVUP(size, GetMemorySpacePageSize());
-    int     pagesComitted;
+    int     pageCount   = DIVUP(size, GetMemorySpacePageSize());
+    int     pagesZeroed = pageCount;
+    int     pagesComitted = 0;
     oserr_t oserr;
 
     if (!memorySpace || !physicalAddressValues) {
         return OS_EINVALPARAMS;
     }
 
-    if (__PMTYPE(placementFlags) != MAPPING_PHYSICAL_FIXED) {
+    if (__PMTYPE(placementFlags) != MAPPING_PHYSICAL_FIXED && (placementFlags & MAPPING_PHYSICAL_ZEROED)) {
+        oserr = AllocatePhysicalMemoryZeroed(pageMask, pageCount, &physicalAddressValues[0], &pagesZeroed);
+        if (oserr != OS_EOK) {
+            return oserr;
+        }
+    } else if (__PMTYPE(placementFlags) != MAPPING_PHYSICAL_FIXED) {
         oserr = AllocatePhysicalMemory(pageMask, pageCount, &physicalAddressValues[0]);
         if (oserr != OS_EOK) {
             return oserr;
@@ -451,10 +516,18 @@ MemorySpaceCommit(
             pageCount,
             &pagesComitted
     );
-    if (oserr != OS_EOK) {
-        if (__PMTYPE(placementFlags) != MAPPING_PHYSICAL_FIXED) {
-            FreePhysicalMemory(pageCount, &physicalAddressValues[0]);
-        }
+    if (oserr != OS_EOK && __PMTYPE(placementFlags) != MAPPING_PHYSICAL_FIXED) {
+        // The pages that were committed before the failure are in use by the mapping now
+        FreePhysicalMemory(pageCount - pagesComitted, &physicalAddressValues[pagesComitted]);
+    }
+    if (pagesZeroed < pagesComitted) {
+        // Clear the pages the zero pool could not provide through the new mapping
+        size_t pageSize = GetMemorySpacePageSize();
+        memset(
+                (void*)((address & ~(pageSize - 1)) + (pagesZeroed * pageSize)),
+                0,
+                (pagesComitted - pagesZeroed) * pageSize
+        );
     }
     return oserr;
 }
@@ -529,6 +602,11 @@ MemorySpaceCloneMapping(
         return OS_EINVALPARAMS;
     }
 
+    // Copy-on-write faults are resolved through the context of the memory space
+    if ((memoryFlags & MAPPING_COPYONWRITE) && (!sourceSpace->Context || !destinationSpace->Context)) {
+        return OS_ENOTSUPPORTED;
+    }
+
     // Increase reference of the source allocation first, to "acquire" it. We are not sure
     // that an allocation exists, especially if the allocation is made in non process-memory, so
     // take into account that sourceAllocation may be NULL
@@ -560,6 +638,36 @@ MemorySpaceCloneMapping(
 
     *destinationAddress = virtualBase;
 
+    // Private clones own the pages together with the source, until either writes to them. They
+    // don't keep the source allocation alive.
+    if (memoryFlags & MAPPING_COPYONWRITE) {
+        struct MSSyncBatch batch;
+
+        // Writes are resolved under the context lock, which must keep them from
+        // taking over pages while they are being shared.
+        MSSyncBatchInitialize(&batch, sourceSpace);
+        MutexLock(&sourceSpace->Context->SyncObject);
+        oserr = MSCopyOnWriteShare(
+                sourceSpace,
+                sourceAddress,
+                destinationSpace,
+                virtualBase,
+                pagesRetrieved,
+                (memoryFlags & ~(MAPPING_COPYONWRITE)) | MAPPING_COMMIT,
+                &batch
+        );
+        MutexUnlock(&sourceSpace->Context->SyncObject);
+        MSSyncBatchFlush(&batch);
+        if (sourceAllocation) {
+            (void)MSAllocationRelease(sourceSpace->Context, sourceAllocation);
+            sourceAllocation = NULL;
+        }
+        if (oserr != OS_EOK) {
+            (void)MemorySpaceUnmap(destinationSpace, virtualBase, length);
+        }
+        goto exit;
+    }
+
     // bind the source and destination allocation together
     if (sourceAllocation) {
         MSAllocationLink(destinationSpace->Context, virtualBase, sourceAllocation);
@@ -570,7 +678,8 @@ MemorySpaceCloneMapping(
             virtualBase,
             &pages[0],
             pagesRetrieved,
-            memoryFlags | MAPPING_PERSISTENT | MAPPING_COMMIT
+            memoryFlags | MAPPING_PERSISTENT | MAPPING_COMMIT,
+            0
     );
 
 exit:
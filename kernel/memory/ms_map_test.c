@@ -33,6 +33,11 @@ struct __AllocatePhysicalMemory {
     int     Calls;
 };
 
+struct __AllocatePhysicalMemoryZeroed {
+    struct __AllocatePhysicalMemory Allocate;
+    int                             PagesZeroed;
+};
+
 struct __ArchMmuSetVirtualPages {
     // Parameters
     vaddr_t      ExpectedAddress;
@@ -88,6 +93,20 @@ struct __MSAllocationLookup {
     int                  Calls;
 };
 
+struct __MSAllocationAcquire {
+    struct MSAllocation* ReturnValue;
+    int                  Calls;
+};
+
+struct __MSCopyOnWriteShare {
+    vaddr_t      ExpectedDestinationAddress;
+    int          ExpectedPageCount;
+    unsigned int ExpectedAttributes;
+
+    oserr_t ReturnValue;
+    int     Calls;
+};
+
 struct __StaticMemoryPoolAllocate {
     size_t ExpectedLength;
     bool   CheckLength;
@@ -96,6 +115,23 @@ struct __StaticMemoryPoolAllocate {
     int       Calls;
 };
 
+struct __MemoryRangeAllocate {
+    size_t ExpectedLength;
+    bool   CheckLength;
+
+    uintptr_t ReturnValue;
+    int       Calls;
+};
+
+struct __MemoryRangeContains {
+    bool ReturnValue;
+};
+
+struct __MemoryRangeReserve {
+    oserr_t ReturnValue;
+    int     Calls;
+};
+
 struct __DynamicMemoryPoolAllocate {
     size_t ExpectedLength;
     bool   CheckLength;
@@ -111,11 +147,21 @@ static struct __TestContext {
 
     // Function mocks
     struct __AllocatePhysicalMemory AllocatePhysicalMemory;
+    struct __AllocatePhysicalMemory AllocatePhysicalMemoryContiguous;
+    struct __AllocatePhysicalMemory AllocatePhysicalMemoryInterleaved;
+    struct __AllocatePhysicalMemoryZeroed AllocatePhysicalMemoryZeroed;
     struct __ArchMmuSetVirtualPages ArchMmuSetVirtualPages;
     struct __ArchMmuSetContiguousVirtualPages ArchMmuSetContiguousVirtualPages;
     struct __ArchMmuReserveVirtualPages ArchMmuReserveVirtualPages;
     struct __MSAllocationLookup MSAllocationLookup;
+    struct __MSAllocationAcquire MSAllocationAcquire;
+    struct __MSCopyOnWriteShare MSCopyOnWriteShare;
+    int MSAllocationLinkCalls;
+    int MSAllocationReleaseCalls;
     struct __StaticMemoryPoolAllocate StaticMemoryPoolAllocate;
+    struct __MemoryRangeAllocate       MemoryRangeAllocate;
+    struct __MemoryRangeContains       MemoryRangeContains;
+    struct __MemoryRangeReserve        MemoryRangeReserve;
     struct __DynamicMemoryPoolAllocate DynamicMemoryPoolAllocate;
 } g_testContext;
 
@@ -582,6 +628,77 @@ void TestMemorySpaceMap_CLEAN_COMMIT(void** state)
     test_free(expected);
 }
 
+void TestMemorySpaceMap_CLEAN_COMMIT_ZeroPool(void** state)
+{
+    oserr_t   oserr;
+    vaddr_t   mapping;
+    uintptr_t pageValues[2] = { 0x10000, 0x11000 };
+    paddr_t   pages[2];
+    void*     data;
+    void*     dataAligned;
+    void*     expected;
+    (void)state;
+
+    // Expected calls to happen:
+    // 1. MSAllocationLookup, let it return NULL to indicate no existing mapping,
+    //    and no parameter mocking neccessary
+
+    // 2. AllocatePhysicalMemoryZeroed, let it provide the first page from the zero pool
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.ExpectedMask       = __MASK;
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.CheckMask          = true;
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.ExpectedPageCount  = 2;
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.CheckPageCount     = true;
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.PageValues         = &pageValues[0];
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.PageValuesProvided = true;
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.ReturnValue        = OS_EOK;
+    g_testContext.AllocatePhysicalMemoryZeroed.PagesZeroed                 = 1;
+
+    // 3. ArchMmuSetVirtualPages.
+    g_testContext.ArchMmuSetVirtualPages.ExpectedPageCount  = 2;
+    g_testContext.ArchMmuSetVirtualPages.CheckPageCount     = true;
+    g_testContext.ArchMmuSetVirtualPages.ExpectedPageValues = &pageValues[0];
+    g_testContext.ArchMmuSetVirtualPages.CheckPageValues    = true;
+    g_testContext.ArchMmuSetVirtualPages.ReturnValue        = OS_EOK;
+
+    // When the physical pages are allocated for a clean mapping, the pages taken from the
+    // zero pool are already clean, and only the rest must be cleared. Fill both pages with
+    // a pattern, and expect the pattern to survive on the first page.
+    data = test_malloc(GetMemorySpacePageSize() * 3);
+    assert_non_null(data);
+    expected = test_malloc(GetMemorySpacePageSize() * 2);
+    assert_non_null(expected);
+
+    dataAligned = (void*)((uintptr_t)data + (GetMemorySpacePageSize() - ((uintptr_t)data & (GetMemorySpacePageSize() - 1))));
+    memset(dataAligned, 0xFF, GetMemorySpacePageSize() * 2);
+    memset(expected, 0xFF, GetMemorySpacePageSize());
+    memset((uint8_t*)expected + GetMemorySpacePageSize(), 0, GetMemorySpacePageSize());
+
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = (vaddr_t)dataAligned,
+                    .Pages = &pages[0],
+                    .Length = GetMemorySpacePageSize() * 2,
+                    .Mask = __MASK,
+                    .Flags = MAPPING_CLEAN | MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(mapping, (uintptr_t)dataAligned);
+    assert_memory_equal(dataAligned, expected, GetMemorySpacePageSize() * 2);
+
+    // Expected function calls
+    assert_int_equal(g_testContext.MSAllocationLookup.Calls, 1);
+    assert_int_equal(g_testContext.AllocatePhysicalMemoryZeroed.Allocate.Calls, 1);
+    assert_int_equal(g_testContext.AllocatePhysicalMemory.Calls, 0);
+    assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
+
+    test_free(data);
+    test_free(expected);
+}
+
 void TestMemorySpaceMap_STACK(void** state)
 {
     oserr_t oserr;
@@ -794,6 +911,58 @@ void TestMemorySpaceMap_PhysicalSimple(void** state)
     assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
 }
 
+void TestMemorySpaceMap_PHYSICAL_INTERLEAVED(void** state)
+{
+    oserr_t oserr;
+    vaddr_t mapping;
+    paddr_t pages[2];
+    paddr_t pageValues[2] = { 0x4000, 0x40004000 };
+    (void)state;
+
+    // Expected calls to happen:
+    // 1. MSAllocationLookup, let it return NULL to indicate no existing mapping,
+    //    and no parameter mocking neccessary
+
+    // 2. AllocatePhysicalMemoryInterleaved.
+    g_testContext.AllocatePhysicalMemoryInterleaved.ExpectedMask       = __MASK;
+    g_testContext.AllocatePhysicalMemoryInterleaved.CheckMask          = true;
+    g_testContext.AllocatePhysicalMemoryInterleaved.ExpectedPageCount  = 2;
+    g_testContext.AllocatePhysicalMemoryInterleaved.CheckPageCount     = true;
+    g_testContext.AllocatePhysicalMemoryInterleaved.PageValues         = &pageValues[0];
+    g_testContext.AllocatePhysicalMemoryInterleaved.PageValuesProvided = true;
+    g_testContext.AllocatePhysicalMemoryInterleaved.ReturnValue        = OS_EOK;
+
+    // 3. ArchMmuSetVirtualPages.
+    g_testContext.ArchMmuSetVirtualPages.ExpectedAddress    = 0x1000000;
+    g_testContext.ArchMmuSetVirtualPages.CheckAddress       = true;
+    g_testContext.ArchMmuSetVirtualPages.ExpectedPageCount  = 2;
+    g_testContext.ArchMmuSetVirtualPages.CheckPageCount     = true;
+    g_testContext.ArchMmuSetVirtualPages.ReturnValue        = OS_EOK;
+
+    // Test that MAPPING_PHYSICAL_INTERLEAVED allocates the pages with the interleave policy
+    mapping = 0x1000000;
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = mapping,
+                    .Pages = &pages[0],
+                    .Length = 2 * GetMemorySpacePageSize(),
+                    .Mask = __MASK,
+                    .Flags = MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED | MAPPING_PHYSICAL_INTERLEAVED
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(pages[0], pageValues[0]);
+    assert_int_equal(pages[1], pageValues[1]);
+
+    // Expected function calls
+    assert_int_equal(g_testContext.AllocatePhysicalMemoryInterleaved.Calls, 1);
+    assert_int_equal(g_testContext.AllocatePhysicalMemory.Calls, 0);
+    assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
+}
+
 void TestMemorySpaceMap_PHYSICAL_FIXED(void** state)
 {
     oserr_t oserr;
@@ -883,6 +1052,128 @@ void TestMemorySpaceMap_PHYSICAL_CONTIGUOUS(void** state)
     assert_int_equal(g_testContext.ArchMmuSetContiguousVirtualPages.Calls, 1);
 }
 
+void TestMemorySpaceMap_PHYSICAL_CONTIGUOUS_Allocated(void** state)
+{
+    oserr_t oserr;
+    vaddr_t mapping = 0x1000000;
+    paddr_t pages[4];
+    paddr_t pageValues[4] = { 0x400000, 0x401000, 0x402000, 0x403000 };
+    (void)state;
+
+    // Expected calls to happen:
+    // 1. MSAllocationLookup, let it return NULL to indicate no existing mapping,
+    //    and no parameter mocking neccessary
+
+    // 2. AllocatePhysicalMemoryContiguous.
+    g_testContext.AllocatePhysicalMemoryContiguous.ExpectedMask       = __MASK;
+    g_testContext.AllocatePhysicalMemoryContiguous.CheckMask          = true;
+    g_testContext.AllocatePhysicalMemoryContiguous.ExpectedPageCount  = 4;
+    g_testContext.AllocatePhysicalMemoryContiguous.CheckPageCount     = true;
+    g_testContext.AllocatePhysicalMemoryContiguous.PageValues         = &pageValues[0];
+    g_testContext.AllocatePhysicalMemoryContiguous.PageValuesProvided = true;
+    g_testContext.AllocatePhysicalMemoryContiguous.ReturnValue        = OS_EOK;
+
+    // 3. ArchMmuSetContiguousVirtualPages, which must map the allocated range
+    g_testContext.ArchMmuSetContiguousVirtualPages.ExpectedVirtualAddress  = 0x1000000;
+    g_testContext.ArchMmuSetContiguousVirtualPages.CheckVirtualAddress     = true;
+    g_testContext.ArchMmuSetContiguousVirtualPages.ExpectedPhysicalAddress = 0x400000;
+    g_testContext.ArchMmuSetContiguousVirtualPages.CheckPhysicalAddress    = true;
+    g_testContext.ArchMmuSetContiguousVirtualPages.ExpectedPageCount       = 4;
+    g_testContext.ArchMmuSetContiguousVirtualPages.CheckPageCount          = true;
+    g_testContext.ArchMmuSetContiguousVirtualPages.ReturnValue             = OS_EOK;
+
+    // When pages are provided together with MAPPING_PHYSICAL_CONTIGUOUS, the memory
+    // is allocated by the memory space, and the pages are returned to the caller.
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = mapping,
+                    .Pages = &pages[0],
+                    .Length = 4 * GetMemorySpacePageSize(),
+                    .Mask = __MASK,
+                    .Flags = MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED | MAPPING_PHYSICAL_CONTIGUOUS
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(mapping, 0x1000000);
+    for (int i = 0; i < 4; i++) {
+        assert_int_equal(pages[i], pageValues[i]);
+    }
+
+    // Expected function calls
+    assert_int_equal(g_testContext.AllocatePhysicalMemoryContiguous.Calls, 1);
+    assert_int_equal(g_testContext.AllocatePhysicalMemory.Calls, 0);
+    assert_int_equal(g_testContext.ArchMmuSetContiguousVirtualPages.Calls, 1);
+}
+
+void TestMemorySpaceMap_PHYSICAL_CONTIGUOUS_CLEAN(void** state)
+{
+    oserr_t oserr;
+    vaddr_t mapping;
+    paddr_t pages[2];
+    paddr_t pageValues[2] = { 0x400000, 0x401000 };
+    void*   data;
+    void*   dataAligned;
+    void*   expected;
+    (void)state;
+
+    g_testContext.AllocatePhysicalMemoryContiguous.ExpectedPageCount  = 2;
+    g_testContext.AllocatePhysicalMemoryContiguous.CheckPageCount     = true;
+    g_testContext.AllocatePhysicalMemoryContiguous.PageValues         = &pageValues[0];
+    g_testContext.AllocatePhysicalMemoryContiguous.PageValuesProvided = true;
+    g_testContext.AllocatePhysicalMemoryContiguous.ReturnValue        = OS_EOK;
+    g_testContext.ArchMmuSetContiguousVirtualPages.ReturnValue        = OS_EOK;
+
+    // Contiguous memory allocated for a clean mapping must be cleared like any other
+    data = test_malloc(GetMemorySpacePageSize() * 3);
+    assert_non_null(data);
+    expected = test_malloc(GetMemorySpacePageSize() * 2);
+    assert_non_null(expected);
+
+    dataAligned = (void*)((uintptr_t)data + (GetMemorySpacePageSize() - ((uintptr_t)data & (GetMemorySpacePageSize() - 1))));
+    memset(dataAligned, 0xFF, GetMemorySpacePageSize() * 2);
+    memset(expected, 0, GetMemorySpacePageSize() * 2);
+
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = (vaddr_t)dataAligned,
+                    .Pages = &pages[0],
+                    .Length = GetMemorySpacePageSize() * 2,
+                    .Mask = __MASK,
+                    .Flags = MAPPING_CLEAN | MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED | MAPPING_PHYSICAL_CONTIGUOUS
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_memory_equal(dataAligned, expected, GetMemorySpacePageSize() * 2);
+    assert_int_equal(g_testContext.AllocatePhysicalMemoryContiguous.Calls, 1);
+
+    // A provided physical range is left alone, it can be device memory
+    memset(dataAligned, 0xFF, GetMemorySpacePageSize());
+    memset(expected, 0xFF, GetMemorySpacePageSize());
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = (vaddr_t)dataAligned,
+                    .PhysicalStart = 0x180000,
+                    .Length = GetMemorySpacePageSize(),
+                    .Mask = __MASK,
+                    .Flags = MAPPING_CLEAN | MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED | MAPPING_PHYSICAL_CONTIGUOUS
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_memory_equal(dataAligned, expected, GetMemorySpacePageSize());
+
+    test_free(data);
+    test_free(expected);
+}
+
 void TestMemorySpaceMap_VIRTUAL_GLOBAL(void** state)
 {
     oserr_t oserr;
@@ -937,10 +1228,10 @@ void TestMemorySpaceMap_VIRTUAL_PROCESS(void** state)
     (void)state;
 
     // Expected calls to happen:
-    // 1. DynamicMemoryPoolAllocate.
-    g_testContext.DynamicMemoryPoolAllocate.ExpectedLength = GetMemorySpacePageSize();
-    g_testContext.DynamicMemoryPoolAllocate.CheckLength    = true;
-    g_testContext.DynamicMemoryPoolAllocate.ReturnValue    = 0x10000000;
+    // 1. MemoryRangeAllocate.
+    g_testContext.MemoryRangeAllocate.ExpectedLength = GetMemorySpacePageSize();
+    g_testContext.MemoryRangeAllocate.CheckLength    = true;
+    g_testContext.MemoryRangeAllocate.ReturnValue    = 0x10000000;
 
     // 2. ArchMmuSetVirtualPages.
     g_testContext.ArchMmuSetVirtualPages.ExpectedAddress    = 0x10000000;
@@ -971,7 +1262,7 @@ void TestMemorySpaceMap_VIRTUAL_PROCESS(void** state)
     assert_int_equal(mapping, 0x10000000);
 
     // Expected function calls
-    assert_int_equal(g_testContext.DynamicMemoryPoolAllocate.Calls, 1);
+    assert_int_equal(g_testContext.MemoryRangeAllocate.Calls, 1);
     assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
 }
 
@@ -1087,6 +1378,53 @@ void TestMemorySpaceMap_VIRTUAL_FIXED(void** state)
     assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
 }
 
+void TestMemorySpaceMap_VIRTUAL_FIXED_InHeap(void** state)
+{
+    oserr_t oserr;
+    vaddr_t mapping;
+    paddr_t page = 0x10000;
+    (void)state;
+
+    // Fixed mappings inside the process heap must reserve the region there first,
+    // and fail without touching the page tables if it is taken.
+    g_testContext.MemoryRangeContains.ReturnValue = true;
+    g_testContext.MemoryRangeReserve.ReturnValue  = OS_EEXISTS;
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = 0x1000000,
+                    .Pages = &page,
+                    .Length = GetMemorySpacePageSize(),
+                    .Mask = __MASK,
+                    .Flags = MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED | MAPPING_PHYSICAL_FIXED
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EEXISTS);
+    assert_int_equal(g_testContext.MemoryRangeReserve.Calls, 1);
+    assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 0);
+
+    g_testContext.MemoryRangeReserve.ReturnValue  = OS_EOK;
+    g_testContext.ArchMmuSetVirtualPages.ReturnValue = OS_EOK;
+    oserr = MemorySpaceMap(
+            &g_testContext.MemorySpace,
+            &(struct MemorySpaceMapOptions) {
+                    .VirtualStart = 0x1000000,
+                    .Pages = &page,
+                    .Length = GetMemorySpacePageSize(),
+                    .Mask = __MASK,
+                    .Flags = MAPPING_COMMIT,
+                    .PlacementFlags = MAPPING_VIRTUAL_FIXED | MAPPING_PHYSICAL_FIXED
+            },
+            &mapping
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(mapping, 0x1000000);
+    assert_int_equal(g_testContext.MemoryRangeReserve.Calls, 2);
+    assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
+}
+
 void TestMemorySpaceMap_VirtualMissing(void** state)
 {
     oserr_t oserr;
@@ -1114,12 +1452,82 @@ void TestMemorySpaceMap_VirtualMissing(void** state)
     assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 0);
 }
 
+void TestMemorySpaceCloneMapping_PERSISTENT(void** state)
+{
+    struct MSAllocation allocation;
+    oserr_t             oserr;
+    vaddr_t             mapping = 0;
+    (void)state;
+
+    g_testContext.MSAllocationAcquire.ReturnValue = &allocation;
+    g_testContext.MemoryRangeAllocate.ReturnValue = 0x20000;
+
+    // Regular clones map the pages of the source persistent, and keep the source alive
+    g_testContext.ArchMmuSetVirtualPages.CheckAddress = true;
+    g_testContext.ArchMmuSetVirtualPages.ExpectedAddress = 0x20000;
+    g_testContext.ArchMmuSetVirtualPages.CheckPageCount = true;
+    g_testContext.ArchMmuSetVirtualPages.ExpectedPageCount = 2;
+    g_testContext.ArchMmuSetVirtualPages.CheckAttributes = true;
+    g_testContext.ArchMmuSetVirtualPages.ExpectedAttributes = MAPPING_USERSPACE | MAPPING_PERSISTENT | MAPPING_COMMIT;
+
+    oserr = MemorySpaceCloneMapping(
+            &g_testContext.MemorySpace,
+            &g_testContext.MemorySpace,
+            0x10000,
+            &mapping,
+            GetMemorySpacePageSize() * 2,
+            MAPPING_USERSPACE,
+            MAPPING_VIRTUAL_PROCESS
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(mapping, 0x20000);
+
+    // Expected function calls
+    assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 1);
+    assert_int_equal(g_testContext.MSAllocationLinkCalls, 1);
+    assert_int_equal(g_testContext.MSAllocationReleaseCalls, 0);
+    assert_int_equal(g_testContext.MSCopyOnWriteShare.Calls, 0);
+}
+
+void TestMemorySpaceCloneMapping_COPYONWRITE(void** state)
+{
+    struct MSAllocation allocation;
+    oserr_t             oserr;
+    vaddr_t             mapping = 0;
+    (void)state;
+
+    g_testContext.MSAllocationAcquire.ReturnValue = &allocation;
+    g_testContext.MemoryRangeAllocate.ReturnValue = 0x20000;
+
+    // Private clones share the pages, and don't keep the source alive
+    g_testContext.MSCopyOnWriteShare.ExpectedDestinationAddress = 0x20000;
+    g_testContext.MSCopyOnWriteShare.ExpectedPageCount = 2;
+    g_testContext.MSCopyOnWriteShare.ExpectedAttributes = MAPPING_USERSPACE | MAPPING_COMMIT;
+
+    oserr = MemorySpaceCloneMapping(
+            &g_testContext.MemorySpace,
+            &g_testContext.MemorySpace,
+            0x10000,
+            &mapping,
+            GetMemorySpacePageSize() * 2,
+            MAPPING_USERSPACE | MAPPING_COPYONWRITE,
+            MAPPING_VIRTUAL_PROCESS
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(mapping, 0x20000);
+
+    // Expected function calls
+    assert_int_equal(g_testContext.MSCopyOnWriteShare.Calls, 1);
+    assert_int_equal(g_testContext.ArchMmuSetVirtualPages.Calls, 0);
+    assert_int_equal(g_testContext.MSAllocationLinkCalls, 0);
+    assert_int_equal(g_testContext.MSAllocationReleaseCalls, 1);
+}
+
 // TODO:
 // 1. Modification of existing allocations
 // 2. Error recovery
 // 3. MemorySpaceCommit Tests
-// 4. MemorySpaceCloneMapping Tests
-// 5. MemorySpaceQuery (test that we can check we hit guard page)
+// 4. MemorySpaceQuery (test that we can check we hit guard page)
 
 int main(void)
 {
@@ -1133,16 +1541,23 @@ int main(void)
             cmocka_unit_test_setup(TestMemorySpaceMap_DOMAIN, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_COMMIT, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_CLEAN_COMMIT, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceMap_CLEAN_COMMIT_ZeroPool, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_STACK, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_TRAPPAGE, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_PhysicalSimple, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_PHYSICAL_FIXED, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_PHYSICAL_CONTIGUOUS, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceMap_PHYSICAL_INTERLEAVED, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceMap_PHYSICAL_CONTIGUOUS_Allocated, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceMap_PHYSICAL_CONTIGUOUS_CLEAN, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_VIRTUAL_GLOBAL, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_VIRTUAL_PROCESS, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_VIRTUAL_THREAD, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_VIRTUAL_FIXED, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceMap_VIRTUAL_FIXED_InHeap, SetupTest),
             cmocka_unit_test_setup(TestMemorySpaceMap_VirtualMissing, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCloneMapping_PERSISTENT, SetupTest),
+            cmocka_unit_test_setup(TestMemorySpaceCloneMapping_COPYONWRITE, SetupTest),
     };
     return cmocka_run_group_tests(tests, Setup, Teardown);
 }
@@ -1185,6 +1600,71 @@ oserr_t AllocatePhysicalMemory(
     return g_testContext.AllocatePhysicalMemory.ReturnValue;
 }
 
+oserr_t AllocatePhysicalMemoryZeroed(
+        _In_  size_t     pageMask,
+        _In_  int        pageCount,
+        _In_  uintptr_t* pages,
+        _Out_ int*       pagesZeroedOut) {
+    printf("AllocatePhysicalMemoryZeroed()\n");
+    if (g_testContext.AllocatePhysicalMemoryZeroed.Allocate.CheckMask) {
+        assert_int_equal(pageMask, g_testContext.AllocatePhysicalMemoryZeroed.Allocate.ExpectedMask);
+    }
+    if (g_testContext.AllocatePhysicalMemoryZeroed.Allocate.CheckPageCount) {
+        assert_int_equal(pageCount, g_testContext.AllocatePhysicalMemoryZeroed.Allocate.ExpectedPageCount);
+        // Only check this in combination with page count
+        if (g_testContext.AllocatePhysicalMemoryZeroed.Allocate.PageValuesProvided) {
+            for (int i = 0; i < pageCount; i++) {
+                pages[i] = g_testContext.AllocatePhysicalMemoryZeroed.Allocate.PageValues[i];
+            }
+        }
+    }
+    *pagesZeroedOut = g_testContext.AllocatePhysicalMemoryZeroed.PagesZeroed;
+    g_testContext.AllocatePhysicalMemoryZeroed.Allocate.Calls++;
+    return g_testContext.AllocatePhysicalMemoryZeroed.Allocate.ReturnValue;
+}
+
+oserr_t AllocatePhysicalMemoryContiguous(
+        _In_ size_t     pageMask,
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages) {
+    printf("AllocatePhysicalMemoryContiguous()\n");
+    if (g_testContext.AllocatePhysicalMemoryContiguous.CheckMask) {
+        assert_int_equal(pageMask, g_testContext.AllocatePhysicalMemoryContiguous.ExpectedMask);
+    }
+    if (g_testContext.AllocatePhysicalMemoryContiguous.CheckPageCount) {
+        assert_int_equal(pageCount, g_testContext.AllocatePhysicalMemoryContiguous.ExpectedPageCount);
+        // Only check this in combination with page count
+        if (g_testContext.AllocatePhysicalMemoryContiguous.PageValuesProvided) {
+            for (int i = 0; i < pageCount; i++) {
+                pages[i] = g_testContext.AllocatePhysicalMemoryContiguous.PageValues[i];
+            }
+        }
+    }
+    g_testContext.AllocatePhysicalMemoryContiguous.Calls++;
+    return g_testContext.AllocatePhysicalMemoryContiguous.ReturnValue;
+}
+
+oserr_t AllocatePhysicalMemoryInterleaved(
+        _In_ size_t     pageMask,
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages) {
+    printf("AllocatePhysicalMemoryInterleaved()\n");
+    if (g_testContext.AllocatePhysicalMemoryInterleaved.CheckMask) {
+        assert_int_equal(pageMask, g_testContext.AllocatePhysicalMemoryInterleaved.ExpectedMask);
+    }
+    if (g_testContext.AllocatePhysicalMemoryInterleaved.CheckPageCount) {
+        assert_int_equal(pageCount, g_testContext.AllocatePhysicalMemoryInterleaved.ExpectedPageCount);
+        // Only check this in combination with page count
+        if (g_testContext.AllocatePhysicalMemoryInterleaved.PageValuesProvided) {
+            for (int i = 0; i < pageCount; i++) {
+                pages[i] = g_testContext.AllocatePhysicalMemoryInterleaved.PageValues[i];
+            }
+        }
+    }
+    g_testContext.AllocatePhysicalMemoryInterleaved.Calls++;
+    return g_testContext.AllocatePhysicalMemoryInterleaved.ReturnValue;
+}
+
 void FreePhysicalMemory(
         _In_ int              pageCount,
         _In_ const uintptr_t* pages) {
@@ -1295,6 +1775,7 @@ oserr_t ArchMmuCommitVirtualPage(
     assert_non_null(physicalAddresses);
     assert_int_not_equal(pageCount, 0);
     assert_non_null(pagesComittedOut);
+    *pagesComittedOut = pageCount;
     return OS_EOK;
 }
 
@@ -1327,6 +1808,10 @@ oserr_t ArchMmuVirtualToPhysical(
     assert_int_not_equal(pageCount, 0);
     assert_non_null(physicalAddressValues);
     assert_non_null(pagesRetrievedOut);
+    for (int i = 0; i < pageCount; i++) {
+        physicalAddressValues[i] = 0x100000 + (i * 0x1000);
+    }
+    *pagesRetrievedOut = pageCount;
     return OS_EOK;
 }
 
@@ -1364,7 +1849,18 @@ struct MSAllocation* MSAllocationAcquire(
     printf("MSAllocationAcquire()\n");
     assert_non_null(context);
     assert_int_not_equal(address, 0);
-    return NULL;
+    g_testContext.MSAllocationAcquire.Calls++;
+    return g_testContext.MSAllocationAcquire.ReturnValue;
+}
+
+oserr_t MSAllocationRelease(
+        _In_ struct MSContext*    context,
+        _In_ struct MSAllocation* allocation) {
+    printf("MSAllocationRelease()\n");
+    assert_non_null(context);
+    assert_non_null(allocation);
+    g_testContext.MSAllocationReleaseCalls++;
+    return OS_EOK;
 }
 
 struct MSAllocation* MSAllocationLookup(
@@ -1387,9 +1883,112 @@ oserr_t MSAllocationLink(
     assert_non_null(context);
     assert_int_not_equal(address, 0);
     assert_non_null(link);
+    g_testContext.MSAllocationLinkCalls++;
     return OS_EOK;
 }
 
+void MutexLock(Mutex_t* mutex) {
+    assert_non_null(mutex);
+}
+
+void MutexUnlock(Mutex_t* mutex) {
+    assert_non_null(mutex);
+}
+
+// Mocks from ms_cow
+oserr_t MSCopyOnWriteShare(
+        _In_ MemorySpace_t*      source,
+        _In_ vaddr_t             sourceAddress,
+        _In_ MemorySpace_t*      destination,
+        _In_ vaddr_t             destinationAddress,
+        _In_ int                 pageCount,
+        _In_ unsigned int        attributes,
+        _In_ struct MSSyncBatch* batch) {
+    printf("MSCopyOnWriteShare()\n");
+    assert_non_null(source);
+    assert_non_null(destination);
+    assert_int_not_equal(sourceAddress, 0);
+    assert_non_null(batch);
+    assert_int_equal(destinationAddress, g_testContext.MSCopyOnWriteShare.ExpectedDestinationAddress);
+    assert_int_equal(pageCount, g_testContext.MSCopyOnWriteShare.ExpectedPageCount);
+    assert_int_equal(attributes, g_testContext.MSCopyOnWriteShare.ExpectedAttributes);
+    g_testContext.MSCopyOnWriteShare.Calls++;
+    return g_testContext.MSCopyOnWriteShare.ReturnValue;
+}
+
+// Mocks from ms_sync
+void MSSyncBatchInitialize(
+        _In_ struct MSSyncBatch* batch,
+        _In_ MemorySpace_t*      memorySpace) {
+    batch->MemorySpace = memorySpace;
+}
+
+void MSSyncBatchFlush(
+        _In_ struct MSSyncBatch* batch) {
+    assert_non_null(batch->MemorySpace);
+}
+
+// Mocks from ms_unmap
+oserr_t MemorySpaceUnmap(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ size_t         length) {
+    printf("MemorySpaceUnmap()\n");
+    assert_non_null(memorySpace);
+    assert_int_not_equal(address, 0);
+    assert_int_not_equal(length, 0);
+    return OS_EOK;
+}
+
+// Mocks from memory_range
+oserr_t MemoryRangeAllocate(
+        _In_  MemoryRange_t*      range,
+        _In_  size_t              length,
+        _In_  size_t              alignment,
+        _In_  enum MemoryRangeFit fit,
+        _Out_ uintptr_t*          addressOut) {
+    printf("MemoryRangeAllocate()\n");
+    assert_non_null(range);
+    assert_non_null(addressOut);
+    (void)alignment;
+    (void)fit;
+    if (g_testContext.MemoryRangeAllocate.CheckLength) {
+        assert_int_equal(length, g_testContext.MemoryRangeAllocate.ExpectedLength);
+    }
+    g_testContext.MemoryRangeAllocate.Calls++;
+    *addressOut = g_testContext.MemoryRangeAllocate.ReturnValue;
+    return *addressOut ? OS_EOK : OS_EOOM;
+}
+
+oserr_t MemoryRangeReserve(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address,
+        _In_ size_t         length) {
+    printf("MemoryRangeReserve()\n");
+    assert_non_null(range);
+    assert_int_not_equal(address, 0);
+    assert_int_not_equal(length, 0);
+    g_testContext.MemoryRangeReserve.Calls++;
+    return g_testContext.MemoryRangeReserve.ReturnValue;
+}
+
+oserr_t MemoryRangeFree(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address) {
+    printf("MemoryRangeFree()\n");
+    assert_non_null(range);
+    assert_int_not_equal(address, 0);
+    return OS_EOK;
+}
+
+bool MemoryRangeContains(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address) {
+    assert_non_null(range);
+    (void)address;
+    return g_testContext.MemoryRangeContains.ReturnValue;
+}
+
 // Mocks from dynamic_pool
 uintptr_t DynamicMemoryPoolAllocate(
         _In_ DynamicMemoryPool_t* pool,
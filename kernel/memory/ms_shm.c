@@ -108,6 +108,9 @@ __CreateDeviceBuffer(
     size_t       pageMask;
     vaddr_t      mapping;
 
+    // Device buffers are used for DMA, so we prefer them physically contiguous, which
+    // makes the scatter-gather table a single entry. Should there not be a large enough
+    // contiguous range, then we fall back to regular pages.
     ArchSHMTypeToPageMask(shm->Conformity, &pageMask);
     oserr = MemorySpaceMap(
             GetCurrentMemorySpace(),
@@ -117,10 +120,24 @@ __CreateDeviceBuffer(
                 .Length = shm->Size,
                 .Mask = pageMask,
                 .Flags = mapFlags,
-                .PlacementFlags = MAPPING_VIRTUAL_PROCESS
+                .PlacementFlags = MAPPING_VIRTUAL_PROCESS | MAPPING_PHYSICAL_CONTIGUOUS
             },
             &mapping
     );
+    if (oserr == OS_EOOM) {
+        oserr = MemorySpaceMap(
+                GetCurrentMemorySpace(),
+                &(struct MemorySpaceMapOptions) {
+                    .SHMTag = buffer->ID,
+                    .Pages = &buffer->Pages[0],
+                    .Length = shm->Size,
+                    .Mask = pageMask,
+                    .Flags = mapFlags,
+                    .PlacementFlags = MAPPING_VIRTUAL_PROCESS
+                },
+                &mapping
+        );
+    }
     if (oserr != OS_EOK) {
         return oserr;
     }
@@ -262,10 +279,15 @@ __CreateRegularMappedBuffer(
         _In_  SHM_t*            shm,
         _Out_ void**            userMappingOut)
 {
-    unsigned int mapFlags = __MapFlagsForRegular(shm);
+    unsigned int mapFlags       = __MapFlagsForRegular(shm);
+    unsigned int placementFlags = MAPPING_VIRTUAL_PROCESS;
     oserr_t      oserr;
     vaddr_t      mapping;
 
+    if (shm->Flags & SHM_INTERLEAVED) {
+        placementFlags |= MAPPING_PHYSICAL_INTERLEAVED;
+    }
+
     oserr = MemorySpaceMap(
             GetCurrentMemorySpace(),
             &(struct MemorySpaceMapOptions) {
@@ -274,7 +296,7 @@ __CreateRegularMappedBuffer(
                 .Length = shm->Size,
                 .Mask = buffer->PageMask,
                 .Flags = mapFlags,
-                .PlacementFlags = MAPPING_VIRTUAL_PROCESS
+                .PlacementFlags = placementFlags
             },
             &mapping
     );
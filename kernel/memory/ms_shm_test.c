@@ -209,7 +209,7 @@ void TestSHMCreate_DEVICE(void** state)
     g_testContext.MemorySpaceMap.Calls[0].CheckLength             = true;
     g_testContext.MemorySpaceMap.Calls[0].ExpectedFlags           = MAPPING_COMMIT | MAPPING_PERSISTENT | MAPPING_NOCACHE | MAPPING_USERSPACE;
     g_testContext.MemorySpaceMap.Calls[0].CheckFlags              = true;
-    g_testContext.MemorySpaceMap.Calls[0].ExpectedPlacement       = MAPPING_VIRTUAL_PROCESS;
+    g_testContext.MemorySpaceMap.Calls[0].ExpectedPlacement       = MAPPING_VIRTUAL_PROCESS | MAPPING_PHYSICAL_CONTIGUOUS;
     g_testContext.MemorySpaceMap.Calls[0].CheckPlacement          = true;
     g_testContext.MemorySpaceMap.Calls[0].ReturnedMapping         = 0x10000;
     g_testContext.MemorySpaceMap.Calls[0].ReturnedMappingProvided = true;
@@ -237,6 +237,85 @@ void TestSHMCreate_DEVICE(void** state)
     TeardownTest(state);
 }
 
+void TestSHMCreate_DEVICEFragmented(void** state)
+{
+    oserr_t     oserr;
+    SHMHandle_t handle;
+    (void)state;
+
+    g_testContext.ArchSHMTypeToPageMask.PageMask         = 0xFFFFFFFF;
+    g_testContext.ArchSHMTypeToPageMask.PageMaskProvided = true;
+    g_testContext.ArchSHMTypeToPageMask.ReturnValue      = OS_EOK;
+
+    // 1. The contiguous mapping fails as there is no range large enough
+    g_testContext.MemorySpaceMap.Calls[0].ExpectedPlacement = MAPPING_VIRTUAL_PROCESS | MAPPING_PHYSICAL_CONTIGUOUS;
+    g_testContext.MemorySpaceMap.Calls[0].CheckPlacement    = true;
+    g_testContext.MemorySpaceMap.Calls[0].ReturnValue       = OS_EOOM;
+
+    // 2. The buffer is then created from regular pages instead
+    g_testContext.MemorySpaceMap.Calls[1].ExpectedLength          = 0x400000;
+    g_testContext.MemorySpaceMap.Calls[1].CheckLength             = true;
+    g_testContext.MemorySpaceMap.Calls[1].ExpectedPlacement       = MAPPING_VIRTUAL_PROCESS;
+    g_testContext.MemorySpaceMap.Calls[1].CheckPlacement          = true;
+    g_testContext.MemorySpaceMap.Calls[1].ReturnedMapping         = 0x10000;
+    g_testContext.MemorySpaceMap.Calls[1].ReturnedMappingProvided = true;
+    g_testContext.MemorySpaceMap.Calls[1].ReturnValue             = OS_EOK;
+
+    oserr = SHMCreate(
+            &(SHM_t) {
+                .Flags = SHM_DEVICE,
+                .Conformity = OSMEMORYCONFORMITY_LEGACY,
+                .Access = SHM_ACCESS_READ | SHM_ACCESS_WRITE,
+                .Size = 0x400000,
+            },
+            &handle
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(g_testContext.MemorySpaceMap.CallCount, 2);
+    assert_ptr_equal(handle.Buffer, 0x10000);
+    TeardownTest(state);
+}
+
+void TestSHMCreate_DEVICE_CLEAN(void** state)
+{
+    oserr_t     oserr;
+    SHMHandle_t handle;
+    (void)state;
+
+    g_testContext.ArchSHMTypeToPageMask.PageMask         = 0xFFFFFFFF;
+    g_testContext.ArchSHMTypeToPageMask.PageMaskProvided = true;
+    g_testContext.ArchSHMTypeToPageMask.ReturnValue      = OS_EOK;
+
+    // Clean device buffers must ask for cleared memory for both the contiguous
+    // mapping and the fallback to regular pages, MemorySpaceMap clears either.
+    g_testContext.MemorySpaceMap.Calls[0].ExpectedFlags     = MAPPING_CLEAN | MAPPING_COMMIT | MAPPING_PERSISTENT | MAPPING_NOCACHE | MAPPING_USERSPACE;
+    g_testContext.MemorySpaceMap.Calls[0].CheckFlags        = true;
+    g_testContext.MemorySpaceMap.Calls[0].ExpectedPlacement = MAPPING_VIRTUAL_PROCESS | MAPPING_PHYSICAL_CONTIGUOUS;
+    g_testContext.MemorySpaceMap.Calls[0].CheckPlacement    = true;
+    g_testContext.MemorySpaceMap.Calls[0].ReturnValue       = OS_EOOM;
+
+    g_testContext.MemorySpaceMap.Calls[1].ExpectedFlags           = MAPPING_CLEAN | MAPPING_COMMIT | MAPPING_PERSISTENT | MAPPING_NOCACHE | MAPPING_USERSPACE;
+    g_testContext.MemorySpaceMap.Calls[1].CheckFlags              = true;
+    g_testContext.MemorySpaceMap.Calls[1].ExpectedPlacement       = MAPPING_VIRTUAL_PROCESS;
+    g_testContext.MemorySpaceMap.Calls[1].CheckPlacement          = true;
+    g_testContext.MemorySpaceMap.Calls[1].ReturnedMapping         = 0x10000;
+    g_testContext.MemorySpaceMap.Calls[1].ReturnedMappingProvided = true;
+    g_testContext.MemorySpaceMap.Calls[1].ReturnValue             = OS_EOK;
+
+    oserr = SHMCreate(
+            &(SHM_t) {
+                .Flags = SHM_DEVICE | SHM_CLEAN,
+                .Conformity = OSMEMORYCONFORMITY_LEGACY,
+                .Access = SHM_ACCESS_READ | SHM_ACCESS_WRITE,
+                .Size = 0x400000,
+            },
+            &handle
+    );
+    assert_int_equal(oserr, OS_EOK);
+    assert_int_equal(g_testContext.MemorySpaceMap.CallCount, 2);
+    TeardownTest(state);
+}
+
 void TestSHMCreate_IPC(void** state)
 {
     oserr_t     oserr;
@@ -1884,6 +1963,8 @@ int main(void)
 {
     const struct CMUnitTest tests[] = {
             cmocka_unit_test_setup(TestSHMCreate_DEVICE, SetupTest),
+            cmocka_unit_test_setup(TestSHMCreate_DEVICEFragmented, SetupTest),
+            cmocka_unit_test_setup(TestSHMCreate_DEVICE_CLEAN, SetupTest),
             cmocka_unit_test_setup(TestSHMCreate_IPC, SetupTest),
             cmocka_unit_test_setup(TestSHMCreate_TRAP, SetupTest),
             cmocka_unit_test_setup(TestSHMCreate_REGULAR, SetupTest),
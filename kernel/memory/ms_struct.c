@@ -23,6 +23,9 @@
 #include <string.h>
 #include "private.h"
 
+// Id 0 is reserved for memory spaces that never had one assigned
+static _Atomic(size_t) g_nextSpaceId = 1;
+
 MemorySpace_t*
 MemorySpaceNew(
         _In_ unsigned int flags)
@@ -41,6 +44,7 @@ MemorySpaceNew(
     threadRegionStart = GetMachine()->MemoryMap.ThreadLocal.Start;
     threadRegionSize  = GetMachine()->MemoryMap.ThreadLocal.Length + 1;
 
+    memorySpace->Id           = atomic_fetch_add(&g_nextSpaceId, 1);
     memorySpace->Flags        = flags;
     memorySpace->ParentHandle = UUID_INVALID;
     DynamicMemoryPoolConstruct(
@@ -65,6 +69,7 @@ MemorySpaceDelete(
         MmuDestroyVirtualSpace(memorySpace);
     }
     if (memorySpace->ParentHandle == UUID_INVALID) {
+        MSCompressUnregister(memorySpace);
         MSContextDelete(memorySpace->Context);
     }
     if (memorySpace->ParentHandle != UUID_INVALID) {
@@ -16,93 +16,409 @@
  */
 
 //#define __TRACE
-
+#define __need_minmax
+#include <arch/interrupts.h>
+#include <arch/mmu.h>
 #include <arch/utils.h>
+#include <assert.h>
 #include <debug.h>
+#include <heap.h>
 #include <machine.h>
 #include <threading.h>
 #include "private.h"
 
+struct MSSyncBatchRelease {
+    struct MSSyncBatchRelease* Link;
+    vaddr_t                    StartAddress;
+    size_t                     Length;
+    int                        PageCount;
+    paddr_t*                   Pages;
+};
+
 struct MemorySynchronizationObject {
-    _Atomic(int) CallsCompleted;
-    uuid_t       MemorySpaceHandle;
-    uintptr_t    Address;
-    size_t       Length;
+    _Atomic(int)      CallsCompleted;
+    struct MSContext* Context;
+    size_t            Generation;
+    uintptr_t         Address;
+    size_t            Length;
+};
+
+// The context each core has loaded is only used to compare against and never dereferenced,
+// as the context may be gone by the time the core switches away from it. The address space
+// ids are only touched by the core itself.
+struct MSSyncCore {
+    _Atomic(uintptr_t) LoadedContext;
+    struct MSAsidCore  Asids;
+    bool               AsidsInitialized;
 };
 
+static struct MSSyncCore g_cores[__CPU_MAX_COUNT] = { 0 };
+static _Atomic(size_t)   g_ipisSent    = 0;
+static _Atomic(size_t)   g_ipisAvoided = 0;
+static _Atomic(size_t)   g_fullFlushes = 0;
+static int               g_asidsEnabled = -1;
+
+static bool
+__AsidsEnabled(void)
+{
+    // Ids are only used if the platform has enough of them for every core to hand
+    // out all of its slots.
+    if (g_asidsEnabled < 0) {
+        g_asidsEnabled = ArchMmuAddressSpaceIdCount() > MS_ASID_SLOTS;
+    }
+    return g_asidsEnabled != 0;
+}
+
 static void
 __MemorySyncCallback(
         _In_ void* context)
 {
-    struct MemorySynchronizationObject* object  = (struct MemorySynchronizationObject*)context;
-    MemorySpace_t*                      current = GetCurrentMemorySpace();
-    uuid_t                              currentHandle = GetCurrentMemorySpaceHandle();
-
-    // Make sure the current address space is matching
-    // If NULL => everyone must update
-    // If it matches our parent, we must update
-    // If it matches us, we must update
-    if (object->MemorySpaceHandle == UUID_INVALID || current->ParentHandle == object->MemorySpaceHandle ||
-        currentHandle == object->MemorySpaceHandle) {
+    struct MemorySynchronizationObject* object = (struct MemorySynchronizationObject*)context;
+    struct MSSyncCore*                  core   = &g_cores[ArchGetProcessorCoreId()];
+    enum MSAsidFlush                    flush  = MSAsidFlushRange;
+
+    // For synchronizations of a context, the core may have switched away from it since the
+    // message was sent, in which case the generation makes sure the entries are flushed
+    // when it switches back.
+    if (object->Context != NULL) {
+        if (atomic_load(&core->LoadedContext) != (uintptr_t)object->Context) {
+            flush = MSAsidFlushNone;
+        } else if (core->AsidsInitialized) {
+            flush = MSAsidSynchronize(
+                    &core->Asids,
+                    object->Generation,
+                    atomic_load(&object->Context->TlbGeneration)
+            );
+        }
+    }
+
+    // A NULL address flushes everything but global pages, which is only used for
+    // batches without any global regions.
+    if (flush == MSAsidFlushRange) {
         CpuInvalidateMemoryCache((void*)object->Address, object->Length);
+    } else if (flush == MSAsidFlushFull) {
+        CpuInvalidateMemoryCache(NULL, 0);
     }
     atomic_fetch_add(&object->CallsCompleted, 1);
 }
 
-void
-MSSync(
-        _In_ MemorySpace_t* memorySpace,
-        _In_ uintptr_t      address,
-        _In_ size_t         size)
+static void
+__WaitForCompletion(
+        _In_ struct MemorySynchronizationObject* syncObject,
+        _In_ int                                 numberOfCores)
+{
+    size_t        timeout = 1000;
+    OSTimestamp_t wakeUp;
+
+    SystemTimerGetWallClockTime(&wakeUp);
+    while (atomic_load(&syncObject->CallsCompleted) != numberOfCores && timeout > 0) {
+        OSTimestampAddNsec(&wakeUp, &wakeUp, 5 * NSEC_PER_MSEC);
+        SchedulerSleep(&wakeUp);
+        timeout -= 5;
+    }
+
+    if (!timeout) {
+        ERROR("MSSync timeout trying to synchronize with cores actual %i != target %i",
+              atomic_load(&syncObject->CallsCompleted), numberOfCores);
+    }
+}
+
+static int
+__SendToActiveCores(
+        _In_ struct MSContext*                   context,
+        _In_ struct MemorySynchronizationObject* syncObject)
+{
+    uuid_t currentCoreId = ArchGetProcessorCoreId();
+    int    numberOfCores = 0;
+
+    for (unsigned int i = 0; i < MS_CORE_MASK_WORDS; i++) {
+        size_t mask = atomic_load(&context->ActiveCores[i]);
+        while (mask) {
+            int    bit    = __builtin_ctzl(mask);
+            uuid_t coreId = (uuid_t)(i * MS_CORE_MASK_BITS + bit);
+            mask &= mask - 1;
+
+            // Entries a core keeps for the context while it runs something else are
+            // covered by the generation, which it checks when switching back.
+            if (coreId == currentCoreId ||
+                atomic_load(&g_cores[coreId].LoadedContext) != (uintptr_t)context) {
+                continue;
+            }
+
+            if (TxuMessageSend(coreId, CpuFunctionCustom, __MemorySyncCallback, syncObject, 1) == OS_EOK) {
+                numberOfCores++;
+            }
+        }
+    }
+    return numberOfCores;
+}
+
+static void
+__SyncBatch(
+        _In_ struct MSSyncBatch* batch)
 {
+    struct MSContext* context = batch->MemorySpace->Context;
+    int               numberOfCores;
+    int               numberOfActiveCores;
+    irqstate_t        irqState;
+
     // We can easily allocate this object on the stack as the stack is globally
     // visible to all kernel code. This spares us allocation on heap
     struct MemorySynchronizationObject syncObject = {
-            .Address        = address,
-            .Length         = size,
+            .Context        = NULL,
+            .Generation     = 0,
+            .Address        = batch->Start,
+            .Length         = batch->End - batch->Start,
             .CallsCompleted = 0
     };
 
-    int           numberOfCores;
-    int           numberOfActiveCores;
-    size_t        timeout = 1000;
-    OSTimestamp_t wakeUp;
-
-    // Skip this entire step if there is no multiple cores active
     numberOfActiveCores = atomic_load(&GetMachine()->NumberOfActiveCores);
-    if (numberOfActiveCores <= 1) {
+
+    // Global pages are not flushed by reloading the address space, so those are
+    // always invalidated page by page, and on every core.
+    if (batch->Global) {
+        if (numberOfActiveCores <= 1) {
+            return;
+        }
+        numberOfCores = ProcessorMessageSend(
+                1,
+                CpuFunctionCustom,
+                __MemorySyncCallback,
+                &syncObject,
+                1
+        );
+        atomic_fetch_add(&g_ipisSent, numberOfCores);
+    } else {
+        // Measure the entire range the batch covers, the regions added may be far apart
+        if (DIVUP(batch->End - batch->Start, GetMemorySpacePageSize()) > MS_SYNC_FULL_FLUSH_PAGES) {
+            syncObject.Address = 0;
+            syncObject.Length  = 0;
+            atomic_fetch_add(&g_fullFlushes, 1);
+        }
+
+        // The generation must be increased even without other cores, as this core may
+        // hold entries of the context under address space ids it's not running right now.
+        // The page tables must be updated before we look at which cores have the context
+        // loaded, this pairs with the barrier in MSSyncActivate
+        syncObject.Context    = context;
+        syncObject.Generation = atomic_fetch_add(&context->TlbGeneration, 1) + 1;
+        atomic_thread_fence(memory_order_seq_cst);
+
+        // Invalidate our own entries the same way the other cores do it, without being
+        // moved to another core halfway through.
+        irqState = InterruptDisable();
+        if (atomic_load(&g_cores[ArchGetProcessorCoreId()].LoadedContext) == (uintptr_t)context) {
+            __MemorySyncCallback(&syncObject);
+            atomic_store(&syncObject.CallsCompleted, 0);
+        }
+        InterruptRestoreState(irqState);
+
+        if (numberOfActiveCores <= 1) {
+            return;
+        }
+        numberOfCores = __SendToActiveCores(context, &syncObject);
+        atomic_fetch_add(&g_ipisSent, numberOfCores);
+        atomic_fetch_add(&g_ipisAvoided, (numberOfActiveCores - 1) - numberOfCores);
+    }
+
+    if (numberOfCores) {
+        __WaitForCompletion(&syncObject, numberOfCores);
+    }
+}
+
+void
+MSSyncBatchInitialize(
+        _In_ struct MSSyncBatch* batch,
+        _In_ MemorySpace_t*      memorySpace)
+{
+    batch->MemorySpace = memorySpace;
+    batch->Start       = 0;
+    batch->End         = 0;
+    batch->PageCount   = 0;
+    batch->Global      = false;
+    batch->Releases    = NULL;
+}
+
+void
+MSSyncBatchAdd(
+        _In_ struct MSSyncBatch* batch,
+        _In_ uintptr_t           address,
+        _In_ size_t              size)
+{
+    size_t    pageSize = GetMemorySpacePageSize();
+    uintptr_t start    = address & ~(pageSize - 1);
+    uintptr_t end      = address + size;
+    bool      global;
+
+    if (!size) {
         return;
     }
 
-    // Check for global address, in that case invalidate all cores
-    if (StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, address)) {
-        syncObject.MemorySpaceHandle = UUID_INVALID; // Everyone must update
+    // Regions that may be cached by any core must be invalidated page by page, so
+    // those are never merged with regions far away from them.
+    global = batch->MemorySpace->Context == NULL ||
+            StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, address);
+    if (batch->PageCount) {
+        uintptr_t mergedStart = MIN(batch->Start, start);
+        uintptr_t mergedEnd   = MAX(batch->End, end);
+        if (global != batch->Global ||
+            (global && DIVUP(mergedEnd - mergedStart, pageSize) > MS_SYNC_FULL_FLUSH_PAGES)) {
+            __SyncBatch(batch);
+            batch->PageCount = 0;
+        }
+    }
+
+    // The batch covers everything between the lowest and highest address added, which is
+    // fine as invalidating entries that did not change is harmless.
+    if (!batch->PageCount) {
+        batch->Start  = start;
+        batch->End    = end;
+        batch->Global = global;
+    } else {
+        batch->Start = MIN(batch->Start, start);
+        batch->End   = MAX(batch->End, end);
     }
-    else {
-        if (memorySpace->ParentHandle == UUID_INVALID) {
-            syncObject.MemorySpaceHandle = GetCurrentMemorySpaceHandle(); // Children of us must update
+    batch->PageCount += (int)DIVUP(end - start, pageSize);
+}
+
+void
+MSSyncBatchRelease(
+        _In_ struct MSSyncBatch* batch,
+        _In_ int                 pageCount,
+        _In_ paddr_t*            pages,
+        _In_ vaddr_t             startAddress,
+        _In_ size_t              length)
+{
+    struct MSSyncBatchRelease* release = kmalloc(sizeof(struct MSSyncBatchRelease));
+    if (!release) {
+        // Without a way to defer it, synchronize now and release right away
+        MSSyncBatchFlush(batch);
+        if (pageCount) {
+            FreePhysicalMemory(pageCount, pages);
         }
-        else {
-            syncObject.MemorySpaceHandle = memorySpace->ParentHandle; // Parent and siblings!
+        kfree(pages);
+        if (startAddress) {
+            MSFreeVirtualRegion(batch->MemorySpace, startAddress, length);
         }
+        return;
     }
 
-    numberOfCores = ProcessorMessageSend(
-            1,
-            CpuFunctionCustom,
-            __MemorySyncCallback,
-            &syncObject,
-            1
-    );
-    SystemTimerGetWallClockTime(&wakeUp);
-    while (atomic_load(&syncObject.CallsCompleted) != numberOfCores && timeout > 0) {
-        OSTimestampAddNsec(&wakeUp, &wakeUp, 5 * NSEC_PER_MSEC);
-        SchedulerSleep(&wakeUp);
-        timeout -= 5;
+    release->StartAddress = startAddress;
+    release->Length       = length;
+    release->PageCount    = pageCount;
+    release->Pages        = pages;
+    release->Link         = batch->Releases;
+    batch->Releases       = release;
+}
+
+void
+MSSyncBatchFlush(
+        _In_ struct MSSyncBatch* batch)
+{
+    struct MSSyncBatchRelease* release;
+
+    if (batch->PageCount) {
+        __SyncBatch(batch);
     }
 
-    if (!timeout) {
-        ERROR("MSSync timeout trying to synchronize with cores actual %i != target %i",
-              atomic_load(&syncObject.CallsCompleted), numberOfCores);
+    // No core can reach the released resources anymore
+    release = batch->Releases;
+    while (release) {
+        struct MSSyncBatchRelease* next = release->Link;
+        if (release->PageCount) {
+            FreePhysicalMemory(release->PageCount, release->Pages);
+        }
+        if (release->StartAddress) {
+            MSFreeVirtualRegion(batch->MemorySpace, release->StartAddress, release->Length);
+        }
+        kfree(release->Pages);
+        kfree(release);
+        release = next;
+    }
+    MSSyncBatchInitialize(batch, batch->MemorySpace);
+}
+
+void
+MSSync(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ uintptr_t      address,
+        _In_ size_t         size)
+{
+    struct MSSyncBatch batch;
+
+    MSSyncBatchInitialize(&batch, memorySpace);
+    MSSyncBatchAdd(&batch, address, size);
+    MSSyncBatchFlush(&batch);
+}
+
+void
+MSSyncActivate(
+        _In_  MemorySpace_t* memorySpace,
+        _Out_ int*           addressSpaceIdOut,
+        _Out_ bool*          flushOut)
+{
+    struct MSContext*  context = memorySpace->Context;
+    uuid_t             coreId  = ArchGetProcessorCoreId();
+    struct MSSyncCore* core;
+    size_t             bit;
+
+    assert(coreId < __CPU_MAX_COUNT);
+    core = &g_cores[coreId];
+    atomic_store(&core->LoadedContext, (uintptr_t)context);
+    if (context != NULL) {
+        // Avoid dirtying the shared cacheline when the bit is already set
+        bit = (size_t)1 << (coreId % MS_CORE_MASK_BITS);
+        if (!(atomic_load(&context->ActiveCores[coreId / MS_CORE_MASK_BITS]) & bit)) {
+            atomic_fetch_or(&context->ActiveCores[coreId / MS_CORE_MASK_BITS], bit);
+        }
     }
-}
\ No newline at end of file
+
+    // The core must be visible as having the context loaded before it can start
+    // caching entries from it, this pairs with the barrier in __SyncBatch
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!__AsidsEnabled()) {
+        *addressSpaceIdOut = 0;
+        *flushOut          = true;
+        return;
+    }
+
+    if (!core->AsidsInitialized) {
+        MSAsidInitialize(&core->Asids);
+        core->AsidsInitialized = true;
+    }
+
+    // Kernel memory spaces are not tagged, their entries are mostly global anyway. The
+    // generation is read after the barrier, so any synchronization we don't see here will
+    // see us as having the context loaded.
+    *addressSpaceIdOut = MSAsidAssign(
+            &core->Asids,
+            context != NULL ? memorySpace->Id : 0,
+            context != NULL ? atomic_load(&context->TlbGeneration) : 0,
+            flushOut
+    );
+}
+
+void
+MemorySpaceGetSyncStatistics(
+        _Out_ size_t* ipisSentOut,
+        _Out_ size_t* ipisAvoidedOut,
+        _Out_ size_t* fullFlushesOut)
+{
+    *ipisSentOut    = atomic_load(&g_ipisSent);
+    *ipisAvoidedOut = atomic_load(&g_ipisAvoided);
+    *fullFlushesOut = atomic_load(&g_fullFlushes);
+}
+
+void
+MemorySpaceGetSwitchStatistics(
+        _Out_ size_t* switchesKeptOut,
+        _Out_ size_t* switchesFlushedOut)
+{
+    *switchesKeptOut    = 0;
+    *switchesFlushedOut = 0;
+    for (int i = 0; i < __CPU_MAX_COUNT; i++) {
+        *switchesKeptOut    += g_cores[i].Asids.SwitchesKept;
+        *switchesFlushedOut += g_cores[i].Asids.SwitchesFlushed;
+    }
+}
@@ -0,0 +1,541 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <machine.h>
+#include "private.h"
+#include <string.h>
+#include <stdio.h>
+
+#define __TEST_CORE_COUNT 4
+#define __GLOBAL_START    0x80000000
+#define __GLOBAL_LENGTH   0x10000000
+
+struct __CpuInvalidateMemoryCache {
+    void*  LastStart;
+    size_t LastLength;
+    int    Calls;
+};
+
+struct __TxuMessageSend {
+    uuid_t CoreIds[__TEST_CORE_COUNT];
+    int    Calls;
+};
+
+struct __MSAsidAssign {
+    size_t LastSpaceId;
+    size_t LastGeneration;
+    int    ReturnValue;
+    bool   Flush;
+    int    Calls;
+};
+
+struct __MSAsidSynchronize {
+    size_t           LastSyncGeneration;
+    enum MSAsidFlush ReturnValue;
+    int              Calls;
+};
+
+static struct __TestContext {
+    SystemMachine_t  Machine;
+    MemorySpace_t    MemorySpace;
+    MemorySpace_t    KernelSpace;
+    struct MSContext Context;
+    uuid_t           CurrentCoreId;
+
+    // Sequence numbers used to verify resources are released after synchronizing
+    int Sequence;
+    int LastSyncSequence;
+    int LastReleaseSequence;
+
+    // Function mocks
+    struct __CpuInvalidateMemoryCache CpuInvalidateMemoryCache;
+    struct __TxuMessageSend           TxuMessageSend;
+    struct __MSAsidAssign             MSAsidAssign;
+    struct __MSAsidSynchronize        MSAsidSynchronize;
+    int                               ProcessorMessageSendCalls;
+    int                               FreePhysicalMemoryPages;
+    int                               MSFreeVirtualRegionCalls;
+} g_testContext;
+
+int Setup(void** state) {
+    (void)state;
+    return 0;
+}
+
+int Teardown(void** state) {
+    (void)state;
+    return 0;
+}
+
+static void
+__ActivateOnCore(
+        _In_ uuid_t         coreId,
+        _In_ MemorySpace_t* memorySpace)
+{
+    uuid_t previous = g_testContext.CurrentCoreId;
+    int    addressSpaceId;
+    bool   flush;
+
+    g_testContext.CurrentCoreId = coreId;
+    MSSyncActivate(memorySpace, &addressSpaceId, &flush);
+    g_testContext.CurrentCoreId = previous;
+}
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+
+    g_testContext.MemorySpace.Id      = 1;
+    g_testContext.MemorySpace.Context = &g_testContext.Context;
+    g_testContext.MemorySpace.Flags   = MEMORY_SPACE_APPLICATION;
+    g_testContext.Machine.MemoryGranularity = 0x1000;
+    atomic_store(&g_testContext.Machine.NumberOfActiveCores, __TEST_CORE_COUNT);
+
+    // Reset which context each core has loaded, left over from previous tests
+    for (uuid_t i = 0; i < __TEST_CORE_COUNT; i++) {
+        __ActivateOnCore(i, &g_testContext.KernelSpace);
+    }
+    g_testContext.CurrentCoreId = 0;
+    memset(&g_testContext.MSAsidAssign, 0, sizeof(struct __MSAsidAssign));
+    g_testContext.MSAsidAssign.Flush = true;
+    g_testContext.MSAsidSynchronize.ReturnValue = MSAsidFlushRange;
+    return 0;
+}
+
+void TestMSSync_OnlyLoadedCores(void** state)
+{
+    size_t sent, avoided, fullFlushes;
+    size_t sentAfter, avoidedAfter, fullFlushesAfter;
+    (void)state;
+
+    // The context is loaded on the calling core and on core 2, core 1 and 3 run something else.
+    // The calling core invalidates its own entries without sending itself a message.
+    __ActivateOnCore(0, &g_testContext.MemorySpace);
+    __ActivateOnCore(2, &g_testContext.MemorySpace);
+
+    MemorySpaceGetSyncStatistics(&sent, &avoided, &fullFlushes);
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x2000);
+    MemorySpaceGetSyncStatistics(&sentAfter, &avoidedAfter, &fullFlushesAfter);
+
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 0);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 1);
+    assert_int_equal(g_testContext.TxuMessageSend.CoreIds[0], 2);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, 2);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)0x1000000);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.LastLength, 0x2000);
+
+    assert_int_equal(sentAfter - sent, 1);
+    assert_int_equal(avoidedAfter - avoided, 2);
+    assert_int_equal(fullFlushesAfter - fullFlushes, 0);
+}
+
+void TestMSSync_SwitchedAway(void** state)
+{
+    (void)state;
+
+    // Core 1 has had the context loaded, but has switched to a kernel thread since
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+    __ActivateOnCore(3, &g_testContext.MemorySpace);
+    __ActivateOnCore(1, &g_testContext.KernelSpace);
+
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 1);
+    assert_int_equal(g_testContext.TxuMessageSend.CoreIds[0], 3);
+}
+
+void TestMSSync_NotLoaded(void** state)
+{
+    (void)state;
+
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 0);
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 0);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, 0);
+}
+
+void TestMSSync_FullFlush(void** state)
+{
+    size_t sent, avoided, fullFlushes;
+    size_t sentAfter, avoidedAfter, fullFlushesAfter;
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    MemorySpaceGetSyncStatistics(&sent, &avoided, &fullFlushes);
+    MSSync(&g_testContext.MemorySpace, 0x1000000, (MS_SYNC_FULL_FLUSH_PAGES + 1) * 0x1000);
+    MemorySpaceGetSyncStatistics(&sentAfter, &avoidedAfter, &fullFlushesAfter);
+
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 1);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, 1);
+    assert_null(g_testContext.CpuInvalidateMemoryCache.LastStart);
+    assert_int_equal(fullFlushesAfter - fullFlushes, 1);
+
+    // Exactly at the threshold the pages are still invalidated one by one
+    MSSync(&g_testContext.MemorySpace, 0x1000000, MS_SYNC_FULL_FLUSH_PAGES * 0x1000);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)0x1000000);
+}
+
+void TestMSSync_Global(void** state)
+{
+    (void)state;
+
+    // Global regions are synchronized with every core, even when the context is not loaded
+    // anywhere, and are never flushed with a full flush as that skips global pages.
+    MSSync(&g_testContext.MemorySpace, __GLOBAL_START, (MS_SYNC_FULL_FLUSH_PAGES + 1) * 0x1000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 0);
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 1);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, __TEST_CORE_COUNT - 1);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)__GLOBAL_START);
+}
+
+void TestMSSync_SingleCore(void** state)
+{
+    (void)state;
+
+    atomic_store(&g_testContext.Machine.NumberOfActiveCores, 1);
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    MSSync(&g_testContext.MemorySpace, __GLOBAL_START, 0x1000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 0);
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 0);
+
+    // Core 1 may still hold entries under its address space id, so the generation
+    // must move even though no one was told
+    assert_int_equal(atomic_load(&g_testContext.Context.TlbGeneration), 1);
+}
+
+void TestMSSync_Generation(void** state)
+{
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    assert_int_equal(atomic_load(&g_testContext.Context.TlbGeneration), 2);
+    assert_int_equal(g_testContext.MSAsidSynchronize.Calls, 2);
+    assert_int_equal(g_testContext.MSAsidSynchronize.LastSyncGeneration, 2);
+
+    // Global regions are not covered by the generation
+    MSSync(&g_testContext.MemorySpace, __GLOBAL_START, 0x1000);
+    assert_int_equal(atomic_load(&g_testContext.Context.TlbGeneration), 2);
+    assert_int_equal(g_testContext.MSAsidSynchronize.Calls, 2);
+}
+
+void TestMSSync_AsidFlush(void** state)
+{
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    // The address space id decides how much must be invalidated
+    g_testContext.MSAsidSynchronize.ReturnValue = MSAsidFlushFull;
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 1);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, 1);
+    assert_null(g_testContext.CpuInvalidateMemoryCache.LastStart);
+
+    g_testContext.MSAsidSynchronize.ReturnValue = MSAsidFlushNone;
+    MSSync(&g_testContext.MemorySpace, 0x1000000, 0x1000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 2);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, 1);
+}
+
+void TestMSSyncActivate_Asid(void** state)
+{
+    int  addressSpaceId;
+    bool flush;
+    (void)state;
+
+    atomic_store(&g_testContext.Context.TlbGeneration, 5);
+    g_testContext.MSAsidAssign.ReturnValue = 3;
+    g_testContext.MSAsidAssign.Flush       = false;
+
+    MSSyncActivate(&g_testContext.MemorySpace, &addressSpaceId, &flush);
+    assert_int_equal(addressSpaceId, 3);
+    assert_false(flush);
+    assert_int_equal(g_testContext.MSAsidAssign.LastSpaceId, g_testContext.MemorySpace.Id);
+    assert_int_equal(g_testContext.MSAsidAssign.LastGeneration, 5);
+
+    // Kernel memory spaces are never tagged
+    MSSyncActivate(&g_testContext.KernelSpace, &addressSpaceId, &flush);
+    assert_int_equal(g_testContext.MSAsidAssign.LastSpaceId, 0);
+}
+
+void TestMSSyncBatch_Coalesce(void** state)
+{
+    struct MSSyncBatch batch;
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+    __ActivateOnCore(2, &g_testContext.MemorySpace);
+
+    // Three small unmaps, one round of IPIs covering all of them
+    MSSyncBatchInitialize(&batch, &g_testContext.MemorySpace);
+    MSSyncBatchAdd(&batch, 0x1002000, 0x1000);
+    MSSyncBatchAdd(&batch, 0x1000000, 0x1000);
+    MSSyncBatchAdd(&batch, 0x1004000, 0x2000);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 0);
+
+    MSSyncBatchFlush(&batch);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 2);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.Calls, 2);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)0x1000000);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.LastLength, 0x6000);
+
+    // The batch is empty after a flush
+    MSSyncBatchFlush(&batch);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 2);
+}
+
+void TestMSSyncBatch_FarApart(void** state)
+{
+    struct MSSyncBatch batch;
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    // Regions far apart are covered by a single full flush
+    MSSyncBatchInitialize(&batch, &g_testContext.MemorySpace);
+    MSSyncBatchAdd(&batch, 0x1000000, 0x1000);
+    MSSyncBatchAdd(&batch, 0x4000000, 0x1000);
+    MSSyncBatchFlush(&batch);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 1);
+    assert_null(g_testContext.CpuInvalidateMemoryCache.LastStart);
+}
+
+void TestMSSyncBatch_GlobalNotMerged(void** state)
+{
+    struct MSSyncBatch batch;
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    // Global regions far apart must not be merged into one range to invalidate page by page,
+    // and a global region can't be merged with a regular one.
+    MSSyncBatchInitialize(&batch, &g_testContext.MemorySpace);
+    MSSyncBatchAdd(&batch, __GLOBAL_START, 0x1000);
+    MSSyncBatchAdd(&batch, __GLOBAL_START + 0x1000000, 0x1000);
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 1);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)__GLOBAL_START);
+    assert_int_equal(g_testContext.CpuInvalidateMemoryCache.LastLength, 0x1000);
+
+    MSSyncBatchAdd(&batch, 0x1000000, 0x1000);
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 2);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)(__GLOBAL_START + 0x1000000));
+
+    MSSyncBatchFlush(&batch);
+    assert_int_equal(g_testContext.ProcessorMessageSendCalls, 2);
+    assert_int_equal(g_testContext.TxuMessageSend.Calls, 1);
+    assert_ptr_equal(g_testContext.CpuInvalidateMemoryCache.LastStart, (void*)0x1000000);
+}
+
+void TestMSSyncBatch_ReleaseAfterSync(void** state)
+{
+    struct MSSyncBatch batch;
+    paddr_t*           pages;
+    (void)state;
+
+    __ActivateOnCore(1, &g_testContext.MemorySpace);
+
+    pages = test_malloc(sizeof(paddr_t) * 2);
+    pages[0] = 0x10000;
+    pages[1] = 0x11000;
+
+    MSSyncBatchInitialize(&batch, &g_testContext.MemorySpace);
+    MSSyncBatchAdd(&batch, 0x1000000, 0x2000);
+    MSSyncBatchRelease(&batch, 2, pages, 0x1000000, 0x2000);
+    assert_int_equal(g_testContext.FreePhysicalMemoryPages, 0);
+    assert_int_equal(g_testContext.MSFreeVirtualRegionCalls, 0);
+
+    MSSyncBatchFlush(&batch);
+    assert_int_equal(g_testContext.FreePhysicalMemoryPages, 2);
+    assert_int_equal(g_testContext.MSFreeVirtualRegionCalls, 1);
+    assert_true(g_testContext.LastSyncSequence < g_testContext.LastReleaseSequence);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestMSSync_OnlyLoadedCores, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_SwitchedAway, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_NotLoaded, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_FullFlush, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_Global, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_SingleCore, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_Generation, SetupTest),
+            cmocka_unit_test_setup(TestMSSync_AsidFlush, SetupTest),
+            cmocka_unit_test_setup(TestMSSyncActivate_Asid, SetupTest),
+            cmocka_unit_test_setup(TestMSSyncBatch_Coalesce, SetupTest),
+            cmocka_unit_test_setup(TestMSSyncBatch_FarApart, SetupTest),
+            cmocka_unit_test_setup(TestMSSyncBatch_GlobalNotMerged, SetupTest),
+            cmocka_unit_test_setup(TestMSSyncBatch_ReleaseAfterSync, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, Setup, Teardown);
+}
+
+void* kmalloc(size_t size) {
+    return test_malloc(size);
+}
+
+void kfree(void* memp) {
+    test_free(memp);
+}
+
+size_t GetMemorySpacePageSize(void) {
+    return g_testContext.Machine.MemoryGranularity;
+}
+
+SystemMachine_t* GetMachine(void) {
+    return &g_testContext.Machine;
+}
+
+uuid_t ArchGetProcessorCoreId(void) {
+    return g_testContext.CurrentCoreId;
+}
+
+int ArchMmuAddressSpaceIdCount(void) {
+    return 4096;
+}
+
+irqstate_t InterruptDisable(void) {
+    return 0;
+}
+
+irqstate_t InterruptRestoreState(irqstate_t state) {
+    return state;
+}
+
+int StaticMemoryPoolContains(
+        _In_ StaticMemoryPool_t* pool,
+        _In_ uintptr_t           address) {
+    (void)pool;
+    return address >= __GLOBAL_START && address < (__GLOBAL_START + __GLOBAL_LENGTH);
+}
+
+void CpuInvalidateMemoryCache(
+        _In_ void*  start,
+        _In_ size_t length) {
+    g_testContext.CpuInvalidateMemoryCache.LastStart  = start;
+    g_testContext.CpuInvalidateMemoryCache.LastLength = length;
+    g_testContext.CpuInvalidateMemoryCache.Calls++;
+}
+
+// The messages are delivered right away, so the sync never has to wait on them
+oserr_t TxuMessageSend(
+        _In_ uuid_t                  coreId,
+        _In_ SystemCpuFunctionType_t type,
+        _In_ TxuFunction_t           function,
+        _In_ void*                   argument,
+        _In_ int                     asynchronous) {
+    uuid_t previous;
+    printf("TxuMessageSend(coreId=%u)\n", coreId);
+    assert_int_equal(type, CpuFunctionCustom);
+    assert_int_not_equal(coreId, g_testContext.CurrentCoreId);
+    (void)asynchronous;
+
+    g_testContext.TxuMessageSend.CoreIds[g_testContext.TxuMessageSend.Calls++] = coreId;
+    g_testContext.LastSyncSequence = ++g_testContext.Sequence;
+
+    // Run the handler as the target core
+    previous = g_testContext.CurrentCoreId;
+    g_testContext.CurrentCoreId = coreId;
+    function(argument);
+    g_testContext.CurrentCoreId = previous;
+    return OS_EOK;
+}
+
+int ProcessorMessageSend(
+        _In_ int                     excludeSelf,
+        _In_ SystemCpuFunctionType_t type,
+        _In_ TxuFunction_t           function,
+        _In_ void*                   argument,
+        _In_ int                     asynchronous) {
+    int cores = atomic_load(&g_testContext.Machine.NumberOfActiveCores) - 1;
+    printf("ProcessorMessageSend()\n");
+    assert_int_equal(excludeSelf, 1);
+    assert_int_equal(type, CpuFunctionCustom);
+    (void)asynchronous;
+
+    g_testContext.ProcessorMessageSendCalls++;
+    g_testContext.LastSyncSequence = ++g_testContext.Sequence;
+    for (int i = 0; i < cores; i++) {
+        function(argument);
+    }
+    return cores;
+}
+
+void SystemTimerGetWallClockTime(OSTimestamp_t* time) {
+    time->Seconds = 0;
+    time->Nanoseconds = 0;
+}
+
+oserr_t SchedulerSleep(OSTimestamp_t* deadline) {
+    (void)deadline;
+    return OS_EOK;
+}
+
+void FreePhysicalMemory(
+        _In_ int              pageCount,
+        _In_ const uintptr_t* pages) {
+    assert_non_null(pages);
+    g_testContext.FreePhysicalMemoryPages += pageCount;
+    g_testContext.LastReleaseSequence = ++g_testContext.Sequence;
+}
+
+void MSFreeVirtualRegion(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        startAddress,
+        _In_ size_t         length) {
+    assert_non_null(memorySpace);
+    assert_int_not_equal(startAddress, 0);
+    assert_int_not_equal(length, 0);
+    g_testContext.MSFreeVirtualRegionCalls++;
+    g_testContext.LastReleaseSequence = ++g_testContext.Sequence;
+}
+
+void MSAsidInitialize(
+        _In_ struct MSAsidCore* core) {
+    memset(core, 0, sizeof(struct MSAsidCore));
+    core->Current = -1;
+}
+
+int MSAsidAssign(
+        _In_  struct MSAsidCore* core,
+        _In_  size_t             spaceId,
+        _In_  size_t             generation,
+        _Out_ bool*              flushOut) {
+    assert_non_null(core);
+    g_testContext.MSAsidAssign.LastSpaceId    = spaceId;
+    g_testContext.MSAsidAssign.LastGeneration = generation;
+    g_testContext.MSAsidAssign.Calls++;
+    *flushOut = g_testContext.MSAsidAssign.Flush;
+    return g_testContext.MSAsidAssign.ReturnValue;
+}
+
+enum MSAsidFlush MSAsidSynchronize(
+        _In_ struct MSAsidCore* core,
+        _In_ size_t             syncGeneration,
+        _In_ size_t             currentGeneration) {
+    assert_non_null(core);
+    assert_true(syncGeneration <= currentGeneration);
+    g_testContext.MSAsidSynchronize.LastSyncGeneration = syncGeneration;
+    g_testContext.MSAsidSynchronize.Calls++;
+    return g_testContext.MSAsidSynchronize.ReturnValue;
+}
@@ -23,9 +23,10 @@
 
 static oserr_t
 __ClearPhysicalPages(
-        _In_ MemorySpace_t* memorySpace,
-        _In_ vaddr_t        address,
-        _In_ size_t         size)
+        _In_ MemorySpace_t*      memorySpace,
+        _In_ vaddr_t             address,
+        _In_ size_t              size,
+        _In_ struct MSSyncBatch* batch)
 {
     paddr_t* addresses;
     oserr_t  oserr;
@@ -53,11 +54,13 @@ __ClearPhysicalPages(
             &pagesCleared
     );
     if (pagesCleared) {
-        // free the physical memory
+        // Other cores may still have the pages cached until the batch is flushed,
+        // so the batch frees the physical memory once they are synchronized.
+        MSSyncBatchAdd(batch, address, size);
         if (pagesFreed) {
-            FreePhysicalMemory(pagesFreed, &addresses[0]);
+            MSSyncBatchRelease(batch, pagesFreed, addresses, 0, 0);
+            addresses = NULL;
         }
-        MSSync(memorySpace, address, size);
     }
     kfree(addresses);
 
@@ -66,28 +69,45 @@ exit:
     return oserr;
 }
 
-oserr_t
-MemorySpaceUnmap(
+void
+MSFreeVirtualRegion(
         _In_ MemorySpace_t* memorySpace,
-        _In_ vaddr_t        address,
+        _In_ vaddr_t        startAddress,
         _In_ size_t         length)
+{
+    // Only the given part of a region in the heap is freed, fixed mappings reserve their
+    // region there, and may be unmapped a part at a time.
+    if (memorySpace->Context != NULL && MemoryRangeContains(&memorySpace->Context->Heap, startAddress)) {
+        vaddr_t alignedAddress = startAddress & ~(GetMemorySpacePageSize() - 1);
+        MemoryRangeRelease(&memorySpace->Context->Heap, alignedAddress, length + (startAddress - alignedAddress));
+    } else if (StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, startAddress)) {
+        StaticMemoryPoolFree(&GetMachine()->GlobalAccessMemory, startAddress);
+    } else if (DynamicMemoryPoolContains(&memorySpace->ThreadMemory, startAddress)) {
+        DynamicMemoryPoolFree(&memorySpace->ThreadMemory, startAddress);
+    }
+}
+
+static oserr_t
+__UnmapRegion(
+        _In_ MemorySpace_t*      memorySpace,
+        _In_ vaddr_t             address,
+        _In_ size_t              length,
+        _In_ struct MSSyncBatch* batch)
 {
     struct MSAllocation* allocation;
     vaddr_t              startAddress = address;
+    size_t               regionLength = length;
     oserr_t              oserr;
     bool                 incomplete = false;
 
-    TRACE("MemorySpaceUnmap(memorySpace=0x%" PRIxIN ", address=0x%" PRIxIN ", size=0x%" PRIxIN ")",
-          memorySpace, address, size);
-
-    if (memorySpace == NULL) {
-        return OS_EINVALPARAMS;
-    }
+    TRACE("__UnmapRegion(memorySpace=0x%" PRIxIN ", address=0x%" PRIxIN ", size=0x%" PRIxIN ")",
+          memorySpace, address, length);
 
     allocation = MSAllocationLookup(memorySpace->Context, address);
     if (allocation != NULL) {
         struct MSAllocation* original;
         startAddress = allocation->Address;
+        regionLength = allocation->Length;
 
         oserr = MSAllocationFree(
                 memorySpace->Context,
@@ -109,30 +129,50 @@ MemorySpaceUnmap(
 
     // We managed to free the allocation, now free the underlying
     // pages
-    oserr = __ClearPhysicalPages(memorySpace, address, length);
+    oserr = __ClearPhysicalPages(memorySpace, address, length, batch);
     if (oserr != OS_EOK) {
         WARNING("__FreeMapping failed to clear underlying pages!!");
         return oserr;
     }
 
+    // Pages that were compressed have no physical page to clear, only their compressed copy
+    if (memorySpace->Context != NULL && atomic_load(&memorySpace->Context->CompressedPageCount)) {
+        MSCompressedPagesDiscard(memorySpace->Context, address, length);
+    }
+
     if (incomplete) {
         // In the case of an incomplete free, we cannot free the virtual region
         // just yet. We have to wait for a full free to occur for the region. Make sure
         // we proxy the information that a full free did not occur
-        oserr = OS_EINCOMPLETE;
-        goto exit;
+        return OS_EINCOMPLETE;
     }
 
     // When a full free occurs, we must always use the start address of the allocation
-    // and it's full length when freeing the virtual region.
-    if (memorySpace->Context != NULL && DynamicMemoryPoolContains(&memorySpace->Context->Heap, startAddress)) {
-        DynamicMemoryPoolFree(&memorySpace->Context->Heap, startAddress);
-    } else if (StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, startAddress)) {
-        StaticMemoryPoolFree(&GetMachine()->GlobalAccessMemory, startAddress);
-    } else if (DynamicMemoryPoolContains(&memorySpace->ThreadMemory, startAddress)) {
-        DynamicMemoryPoolFree(&memorySpace->ThreadMemory, startAddress);
+    // and it's full length when freeing the virtual region. Without an allocation, only
+    // the unmapped part is freed. The region can't be handed out again before no core
+    // has it cached anymore.
+    MSSyncBatchRelease(batch, 0, NULL, startAddress, regionLength);
+    return OS_EOK;
+}
+
+oserr_t
+MemorySpaceUnmap(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address,
+        _In_ size_t         length)
+{
+    struct MSSyncBatch batch;
+    oserr_t            oserr;
+
+    TRACE("MemorySpaceUnmap(memorySpace=0x%" PRIxIN ", address=0x%" PRIxIN ", size=0x%" PRIxIN ")",
+          memorySpace, address, length);
+
+    if (memorySpace == NULL) {
+        return OS_EINVALPARAMS;
     }
 
-exit:
+    MSSyncBatchInitialize(&batch, memorySpace);
+    oserr = __UnmapRegion(memorySpace, address, length, &batch);
+    MSSyncBatchFlush(&batch);
     return oserr;
 }
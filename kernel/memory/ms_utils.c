@@ -15,10 +15,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define __need_minmax
 #include <arch/mmu.h>
 #include <arch/utils.h>
 #include <assert.h>
 #include <machine.h>
+#include <string.h>
 #include <threading.h>
 #include "private.h"
 
@@ -36,6 +38,61 @@ MemorySpaceInitialize(
     return MmuLoadKernel(memorySpace, bootInformation, kernelMappings);
 }
 
+// The number of page frames looked up at a time when changing protection of shared memory
+#define __PROTECTION_BATCH_PAGES 64
+
+// Updates the attributes in runs of pages that are either shared or not. The shared pages must
+// not become writable, so the first write to each of them gets its own copy.
+static oserr_t
+__ChangeSharedProtection(
+        _In_  MemorySpace_t* memorySpace,
+        _In_  vaddr_t        address,
+        _In_  int            pageCount,
+        _In_  unsigned int   attributes,
+        _Out_ unsigned int*  previousAttributes)
+{
+    size_t  pageSize = GetMemorySpacePageSize();
+    paddr_t pages[__PROTECTION_BATCH_PAGES];
+    int     i = 0;
+
+    while (i < pageCount) {
+        int count = MIN(pageCount - i, __PROTECTION_BATCH_PAGES);
+        int pagesRetrieved;
+        int j = 0;
+
+        memset(&pages[0], 0, sizeof(paddr_t) * count);
+        (void)ArchMmuVirtualToPhysical(memorySpace, address + (i * pageSize), count, &pages[0], &pagesRetrieved);
+        while (j < count) {
+            bool         shared = GetPhysicalMemoryReferences(pages[j]) > 1;
+            unsigned int runAttributes = shared ? (attributes | MAPPING_COPYONWRITE) : attributes;
+            int          pagesUpdated;
+            int          k = j + 1;
+            oserr_t      oserr;
+
+            while (k < count && (GetPhysicalMemoryReferences(pages[k]) > 1) == shared) {
+                k++;
+            }
+
+            oserr = ArchMmuUpdatePageAttributes(
+                    memorySpace,
+                    address + ((i + j) * pageSize),
+                    k - j,
+                    &runAttributes,
+                    &pagesUpdated
+            );
+            if (i == 0 && j == 0) {
+                *previousAttributes = runAttributes;
+            }
+            if (oserr != OS_EOK) {
+                return oserr;
+            }
+            j = k;
+        }
+        i += count;
+    }
+    return OS_EOK;
+}
+
 oserr_t
 MemorySpaceChangeProtection(
         _In_    MemorySpace_t* memorySpace,
@@ -52,14 +109,26 @@ MemorySpaceChangeProtection(
         return OS_EINVALPARAMS;
     }
 
-    *previousAttributes = attributes;
-    oserr = ArchMmuUpdatePageAttributes(
-            memorySpace,
-            address,
-            pageCount,
-            previousAttributes,
-            &pagesUpdated
-    );
+    // Pages that are shared with other memory spaces must not become writable, which
+    // only needs to be checked page by page while any pages are shared at all.
+    if (!(attributes & MAPPING_READONLY) && GetPhysicalMemorySharedPages()) {
+        oserr = __ChangeSharedProtection(
+                memorySpace,
+                address & ~(GetMemorySpacePageSize() - 1),
+                pageCount,
+                attributes,
+                previousAttributes
+        );
+    } else {
+        *previousAttributes = attributes;
+        oserr = ArchMmuUpdatePageAttributes(
+                memorySpace,
+                address,
+                pageCount,
+                previousAttributes,
+                &pagesUpdated
+        );
+    }
     if (oserr != OS_EOK && oserr != OS_EINCOMPLETE) {
         return oserr;
     }
@@ -166,8 +235,12 @@ void
 MemorySpaceSwitch(
         _In_ MemorySpace_t* memorySpace)
 {
+    int  addressSpaceId;
+    bool flush;
+
     assert(memorySpace != NULL);
-    ArchMmuSwitchMemorySpace(memorySpace);
+    MSSyncActivate(memorySpace, &addressSpaceId, &flush);
+    ArchMmuSwitchMemorySpace(memorySpace, addressSpaceId, flush);
 }
 
 MemorySpace_t*
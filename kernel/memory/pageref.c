@@ -0,0 +1,144 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Physical Page References
+ *   - Counts the references of physical pages that are shared between mappings that
+ *     each own the page, like copy-on-write mappings. Each page frame has a counter of
+ *     the references beyond its first owner, so pages that are not shared read as 0.
+ */
+
+#include <machine.h>
+#include <memoryspace.h>
+
+static _Atomic(uint32_t)* g_references     = NULL;
+static size_t             g_referenceCount = 0;
+static _Atomic(size_t)    g_sharedPages    = 0;
+
+static inline _Atomic(uint32_t)*
+__GetReferences(
+        _In_ uintptr_t page)
+{
+    size_t index = page / GetMemorySpacePageSize();
+    if (index >= g_referenceCount) {
+        return NULL;
+    }
+    return &g_references[index];
+}
+
+oserr_t
+PhysicalMemoryReferencesInitialize(
+        _In_ uintptr_t highestAddress)
+{
+    size_t  pageSize  = GetMemorySpacePageSize();
+    size_t  pageCount = DIVUP(highestAddress, pageSize);
+    vaddr_t storage;
+    oserr_t oserr;
+
+    // One counter per page frame, the storage is cleared so all pages start out with
+    // only their owner.
+    oserr = MemorySpaceMap(
+            GetCurrentMemorySpace(),
+            &(struct MemorySpaceMapOptions) {
+                .Length = DIVUP(pageCount * sizeof(_Atomic(uint32_t)), pageSize) * pageSize,
+                .Flags = MAPPING_COMMIT | MAPPING_CLEAN,
+                .PlacementFlags = MAPPING_VIRTUAL_GLOBAL
+            },
+            &storage
+    );
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    g_references     = (_Atomic(uint32_t)*)storage;
+    g_referenceCount = pageCount;
+    return OS_EOK;
+}
+
+oserr_t
+SharePhysicalMemory(
+        _In_ int              pageCount,
+        _In_ const uintptr_t* pages)
+{
+    for (int i = 0; i < pageCount; i++) {
+        _Atomic(uint32_t)* references = __GetReferences(pages[i]);
+        if (!references) {
+            // Drop the references added so far
+            while (i--) {
+                (void)UnsharePhysicalMemory(pages[i]);
+            }
+            return OS_EINVALPARAMS;
+        }
+
+        if (atomic_fetch_add(references, 1) == 0) {
+            atomic_fetch_add(&g_sharedPages, 1);
+        }
+    }
+    return OS_EOK;
+}
+
+bool
+UnsharePhysicalMemory(
+        _In_ uintptr_t page)
+{
+    _Atomic(uint32_t)* references;
+    uint32_t           count;
+
+    // Most pages are never shared, don't look them up
+    if (!atomic_load(&g_sharedPages)) {
+        return false;
+    }
+
+    references = __GetReferences(page);
+    if (!references) {
+        return false;
+    }
+
+    count = atomic_load(references);
+    do {
+        if (!count) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(references, &count, count - 1));
+
+    // The last owner has the page to itself again
+    if (count == 1) {
+        atomic_fetch_sub(&g_sharedPages, 1);
+    }
+    return true;
+}
+
+int
+GetPhysicalMemoryReferences(
+        _In_ uintptr_t page)
+{
+    _Atomic(uint32_t)* references;
+
+    if (!atomic_load(&g_sharedPages)) {
+        return 1;
+    }
+
+    references = __GetReferences(page);
+    if (!references) {
+        return 1;
+    }
+    return (int)atomic_load(references) + 1;
+}
+
+size_t
+GetPhysicalMemorySharedPages(void)
+{
+    return atomic_load(&g_sharedPages);
+}
@@ -0,0 +1,203 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <machine.h>
+#include <memoryspace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGEREF_TEST_PAGES 3000
+#define PAGEREF_PAGE_SIZE  0x1000
+
+// The counters cover the test pages, and the page after them is out of range
+#define PAGEREF_HIGHEST_ADDRESS ((uintptr_t)(PAGEREF_TEST_PAGES + 1) * PAGEREF_PAGE_SIZE)
+
+struct __MemorySpaceMap {
+    unsigned int Flags;
+    size_t       Length;
+    void*        Storage;
+};
+
+DEFINE_TEST_CONTEXT({
+    MemorySpace_t MemorySpace;
+    MOCK_STRUCT_FUNC(MemorySpaceMap);
+});
+
+int Setup(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(g_testContext));
+    return PhysicalMemoryReferencesInitialize(PAGEREF_HIGHEST_ADDRESS) == OS_EOK ? 0 : -1;
+}
+
+int Teardown(void** state) {
+    (void)state;
+    free(g_testContext.MemorySpaceMap.Storage);
+    return 0;
+}
+
+int SetupTest(void** state) {
+    (void)state;
+    return 0;
+}
+
+int TeardownTest(void** state) {
+    (void)state;
+    // Every test must drop the references it added
+    assert_int_equal(GetPhysicalMemorySharedPages(), 0);
+    return 0;
+}
+
+void TestInitialize(void** state)
+{
+    (void)state;
+
+    // A cleared counter for each page frame
+    assert_true(g_testContext.MemorySpaceMap.Flags & MAPPING_CLEAN);
+    assert_true(g_testContext.MemorySpaceMap.Length >= (PAGEREF_TEST_PAGES + 1) * sizeof(uint32_t));
+}
+
+void TestUnshared(void** state)
+{
+    (void)state;
+
+    // Pages start out with their single owner, which must free them itself
+    assert_int_equal(GetPhysicalMemoryReferences(0x1000), 1);
+    assert_false(UnsharePhysicalMemory(0x1000));
+}
+
+void TestShare(void** state)
+{
+    uintptr_t pages[] = { 0x1000, 0x2000, 0x3000 };
+    (void)state;
+
+    assert_int_equal(SharePhysicalMemory(3, pages), OS_EOK);
+    assert_int_equal(GetPhysicalMemorySharedPages(), 3);
+    for (int i = 0; i < 3; i++) {
+        assert_int_equal(GetPhysicalMemoryReferences(pages[i]), 2);
+    }
+    assert_int_equal(GetPhysicalMemoryReferences(0x4000), 1);
+
+    // Dropping the second reference gives the page back to the remaining owner
+    for (int i = 0; i < 3; i++) {
+        assert_true(UnsharePhysicalMemory(pages[i]));
+        assert_int_equal(GetPhysicalMemoryReferences(pages[i]), 1);
+    }
+    assert_int_equal(GetPhysicalMemorySharedPages(), 0);
+
+    // And the owner must free it
+    assert_false(UnsharePhysicalMemory(pages[0]));
+}
+
+void TestShareMany(void** state)
+{
+    uintptr_t page = 0x5000;
+    (void)state;
+
+    // A page shared by a fork of a fork
+    for (int i = 0; i < 4; i++) {
+        assert_int_equal(SharePhysicalMemory(1, &page), OS_EOK);
+        assert_int_equal(GetPhysicalMemoryReferences(page), i + 2);
+    }
+    assert_int_equal(GetPhysicalMemorySharedPages(), 1);
+
+    for (int i = 4; i > 0; i--) {
+        assert_true(UnsharePhysicalMemory(page));
+        assert_int_equal(GetPhysicalMemoryReferences(page), i);
+    }
+    assert_false(UnsharePhysicalMemory(page));
+}
+
+void TestAllPages(void** state)
+{
+    uintptr_t pages[PAGEREF_TEST_PAGES];
+    (void)state;
+
+    for (int i = 0; i < PAGEREF_TEST_PAGES; i++) {
+        pages[i] = (uintptr_t)(i + 1) * PAGEREF_PAGE_SIZE;
+    }
+
+    assert_int_equal(SharePhysicalMemory(PAGEREF_TEST_PAGES, pages), OS_EOK);
+    assert_int_equal(GetPhysicalMemorySharedPages(), PAGEREF_TEST_PAGES);
+
+    // Removing every other page must leave the neighbouring counters alone
+    for (int i = 0; i < PAGEREF_TEST_PAGES; i += 2) {
+        assert_true(UnsharePhysicalMemory(pages[i]));
+    }
+    for (int i = 0; i < PAGEREF_TEST_PAGES; i++) {
+        assert_int_equal(GetPhysicalMemoryReferences(pages[i]), (i & 1) ? 2 : 1);
+    }
+    for (int i = 1; i < PAGEREF_TEST_PAGES; i += 2) {
+        assert_true(UnsharePhysicalMemory(pages[i]));
+    }
+}
+
+void TestShareOutOfRange(void** state)
+{
+    uintptr_t pages[] = { 0x1000, 0x2000, PAGEREF_HIGHEST_ADDRESS };
+    uintptr_t shared  = 0x2000;
+    (void)state;
+
+    assert_int_equal(SharePhysicalMemory(1, &shared), OS_EOK);
+
+    // The last page has no counter, the references added before it must be undone
+    assert_int_equal(SharePhysicalMemory(3, pages), OS_EINVALPARAMS);
+    assert_int_equal(GetPhysicalMemoryReferences(0x1000), 1);
+    assert_int_equal(GetPhysicalMemoryReferences(0x2000), 2);
+    assert_int_equal(GetPhysicalMemoryReferences(PAGEREF_HIGHEST_ADDRESS), 1);
+    assert_int_equal(GetPhysicalMemorySharedPages(), 1);
+    assert_false(UnsharePhysicalMemory(PAGEREF_HIGHEST_ADDRESS));
+
+    assert_true(UnsharePhysicalMemory(shared));
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup_teardown(TestInitialize, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestUnshared, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestShare, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestShareMany, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestAllPages, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestShareOutOfRange, SetupTest, TeardownTest),
+    };
+    return cmocka_run_group_tests(tests, Setup, Teardown);
+}
+
+size_t GetMemorySpacePageSize(void) {
+    return PAGEREF_PAGE_SIZE;
+}
+
+MemorySpace_t* GetCurrentMemorySpace(void) {
+    return &g_testContext.MemorySpace;
+}
+
+oserr_t MemorySpaceMap(
+        _In_  MemorySpace_t*                memorySpace,
+        _In_  struct MemorySpaceMapOptions* options,
+        _Out_ vaddr_t*                      mappingOut)
+{
+    assert_ptr_equal(memorySpace, &g_testContext.MemorySpace);
+    assert_int_equal(options->Length % PAGEREF_PAGE_SIZE, 0);
+
+    g_testContext.MemorySpaceMap.Flags   = options->Flags;
+    g_testContext.MemorySpaceMap.Length  = options->Length;
+    g_testContext.MemorySpaceMap.Storage = calloc(1, options->Length);
+    assert_non_null(g_testContext.MemorySpaceMap.Storage);
+    *mappingOut = (vaddr_t)g_testContext.MemorySpaceMap.Storage;
+    return OS_EOK;
+}
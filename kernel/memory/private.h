@@ -18,10 +18,12 @@
 #ifndef __MS_PRIVATE_H__
 #define __MS_PRIVATE_H__
 
-#include <ds/list.h>
+#include <ds/interval_tree.h>
 #include <ds/bitmap.h>
+#include <component/cpu.h>
 #include <memoryspace.h>
 #include <mutex.h>
+#include <utils/memory_range.h>
 
 /**
  * @brief Internal SHMBuffer representation.
@@ -40,8 +42,21 @@ struct SHMBuffer {
     paddr_t           Pages[];
 };
 
+// Fault-around windows are powers of two in pages, and are aligned on their own size. A window starts
+// out small, doubles for each fault that continues where the previous window ended and halves for
+// each fault that does not.
+#define MS_FAULTAROUND_INITIAL_PAGES    4
+#define MS_FAULTAROUND_MAX_PAGES        16
+#define MS_FAULTAROUND_SEQUENTIAL_PAGES 32
+
+struct MSFaultAround {
+    vaddr_t Start;
+    vaddr_t End;
+    int     Pages;
+};
+
 struct MSAllocation {
-    element_t            Header;
+    interval_node_t      Header;
     MemorySpace_t*       MemorySpace;
     uuid_t               SHMTag;
     vaddr_t              Address;
@@ -50,15 +65,121 @@ struct MSAllocation {
     unsigned int         Flags;
     int                  References;
     struct MSAllocation* CloneOf;
+    struct MSFaultAround FaultAround;
+};
+
+/**
+ * @brief A page of a process that has been compressed to give its physical page back to the system. The
+ * page is reserved in the memory space, and is restored from the entry when it's faulted on. Pages that
+ * are filled with a single word are stored without any data.
+ */
+struct MSCompressedPage {
+    interval_node_t Header;
+    void*           Data;
+    size_t          Length;
+    uintptr_t       Fill;
+    bool            Restoring;
+    bool            Discarded;
 };
 
+#define MS_CORE_MASK_BITS  (sizeof(size_t) * 8)
+#define MS_CORE_MASK_WORDS (__CPU_MAX_COUNT / MS_CORE_MASK_BITS)
+
 struct MSContext {
-    DynamicMemoryPool_t Heap;
-    list_t              Allocations;
+    MemoryRange_t       Heap;
+    interval_tree_t     Allocations;
     uintptr_t           SignalHandler;
     Mutex_t             SyncObject;
+
+    // Bitmask of core ids that have had any memory space of this context loaded. Bits are
+    // set when a core switches to the context, and are never cleared, as MSSync checks which
+    // context each core currently has loaded before sending it anything.
+    _Atomic(size_t)     ActiveCores[MS_CORE_MASK_WORDS];
+
+    // Increased by every synchronization of the context. Cores that keep TLB entries of the
+    // context around while running something else compare it against the generation they
+    // last synchronized with, to know whether their entries are stale.
+    _Atomic(size_t)     TlbGeneration;
+
+    // Demand fault statistics of the process
+    _Atomic(size_t)     Faults;
+    _Atomic(size_t)     SequentialFaults;
+    _Atomic(size_t)     FaultAroundPages;
+
+    // Pages that have been compressed, protected by SyncObject. The count is increased before
+    // a page is decommitted, so faults that see it at zero know the page was not compressed.
+    interval_tree_t     CompressedPages;
+    _Atomic(size_t)     CompressedPageCount;
+    vaddr_t             CompressCursor;
 };
 
+// The number of address space ids each core hands out to memory spaces. When they run out, the
+// least recently used id is recycled. Id 0 is never handed out, as it's used for memory spaces
+// that are not tagged, which are flushed on every switch.
+#define MS_ASID_SLOTS 16
+
+struct MSAsidSlot {
+    size_t SpaceId;
+    size_t Generation;
+    size_t LastUsed;
+};
+
+/**
+ * @brief The address space ids of a single core. It must only be accessed by the core it belongs to,
+ * with interrupts disabled.
+ */
+struct MSAsidCore {
+    struct MSAsidSlot Slots[MS_ASID_SLOTS];
+    int               Current;
+    size_t            Clock;
+    size_t            SwitchesKept;
+    size_t            SwitchesFlushed;
+};
+
+enum MSAsidFlush {
+    MSAsidFlushNone,
+    MSAsidFlushRange,
+    MSAsidFlushFull
+};
+
+/**
+ * @brief Initializes the address space ids of a core, with no ids handed out.
+ * @param core The core state to initialize.
+ */
+extern void
+MSAsidInitialize(
+        _In_ struct MSAsidCore* core);
+
+/**
+ * @brief Assigns an address space id to a memory space that is being switched to on the core.
+ * @param core       The core state of the calling core.
+ * @param spaceId    The id of the memory space, or 0 if the memory space must not be tagged.
+ * @param generation The current TLB generation of the memory space context.
+ * @param flushOut   Set to true if the entries of the address space id must be flushed when it
+ *                   is loaded, because it was recycled or the entries are stale.
+ * @return The address space id to load the memory space with.
+ */
+extern int
+MSAsidAssign(
+        _In_  struct MSAsidCore* core,
+        _In_  size_t             spaceId,
+        _In_  size_t             generation,
+        _Out_ bool*              flushOut);
+
+/**
+ * @brief Determines how the loaded address space id must be invalidated when receiving a
+ * synchronization for the loaded context, and marks it as synchronized.
+ * @param core              The core state of the calling core.
+ * @param syncGeneration    The generation the synchronization increased the context to.
+ * @param currentGeneration The generation of the context right now.
+ * @return Whether nothing, the synchronized range or the entire address space id must be invalidated.
+ */
+extern enum MSAsidFlush
+MSAsidSynchronize(
+        _In_ struct MSAsidCore* core,
+        _In_ size_t             syncGeneration,
+        _In_ size_t             currentGeneration);
+
 /**
  * @brief Returns a new instance of a memory space (shared) context.
  * @return An allocated and instantiated memory space context.
@@ -185,6 +306,73 @@ void
 MemorySpaceDelete(
         _In_ MemorySpace_t* memorySpace);
 
+// Past this many pages a synchronization flushes the entire TLB of the targeted cores instead
+// of invalidating each page.
+#define MS_SYNC_FULL_FLUSH_PAGES 32
+
+/**
+ * @brief Collects the regions changed by one or more mapping operations in a memory space, so the
+ * TLB of other cores can be synchronized with a single round of IPIs. Physical pages and virtual
+ * regions released by the operations must not be reused before the batch has been flushed, so
+ * they are kept by the batch and freed in MSSyncBatchFlush.
+ */
+struct MSSyncBatch {
+    MemorySpace_t*             MemorySpace;
+    uintptr_t                  Start;
+    uintptr_t                  End;
+    int                        PageCount;
+    bool                       Global;
+    struct MSSyncBatchRelease* Releases;
+};
+
+/**
+ * @brief Initializes a new, empty synchronization batch for the memory space.
+ * @param batch       The batch to initialize.
+ * @param memorySpace The memory space the changes are made in.
+ */
+extern void
+MSSyncBatchInitialize(
+        _In_ struct MSSyncBatch* batch,
+        _In_ MemorySpace_t*      memorySpace);
+
+/**
+ * @brief Adds a changed region to the batch.
+ * @param batch   The batch to add the region to.
+ * @param address The start of the region.
+ * @param size    The length of the region in bytes.
+ */
+extern void
+MSSyncBatchAdd(
+        _In_ struct MSSyncBatch* batch,
+        _In_ uintptr_t           address,
+        _In_ size_t              size);
+
+/**
+ * @brief Defers freeing physical pages and a virtual region until the batch has been flushed. The
+ * batch takes ownership of <pages>, which must be allocated with kmalloc.
+ * @param batch        The batch to add the release to.
+ * @param pageCount    The number of physical pages in <pages>.
+ * @param pages        The physical pages to free, or NULL.
+ * @param startAddress The start of the virtual region to free, or 0.
+ * @param length       The length of the virtual region to free.
+ */
+extern void
+MSSyncBatchRelease(
+        _In_ struct MSSyncBatch* batch,
+        _In_ int                 pageCount,
+        _In_ paddr_t*            pages,
+        _In_ vaddr_t             startAddress,
+        _In_ size_t              length);
+
+/**
+ * @brief Synchronizes the regions of the batch with the cores that may have them cached, and then
+ * frees the resources that were released into the batch. The batch is empty afterwards.
+ * @param batch The batch to flush.
+ */
+extern void
+MSSyncBatchFlush(
+        _In_ struct MSSyncBatch* batch);
+
 /**
  * @brief Synchronizes a region of memory with all active memory spaces across CPU cores.
  * @param memorySpace
@@ -197,4 +385,145 @@ MSSync(
         _In_ uintptr_t      address,
         _In_ size_t         size);
 
+/**
+ * @brief Marks the memory space as loaded on the calling core, and assigns it an address space id
+ * on the core if the platform supports them. Must be called before the memory space is switched to.
+ * @param memorySpace       The memory space that is being loaded.
+ * @param addressSpaceIdOut The address space id to load the memory space with.
+ * @param flushOut          Whether the TLB entries of the address space id must be flushed.
+ */
+extern void
+MSSyncActivate(
+        _In_  MemorySpace_t* memorySpace,
+        _Out_ int*           addressSpaceIdOut,
+        _Out_ bool*          flushOut);
+
+/**
+ * @brief Shares the pages of a region in one memory space with another memory space. Owned pages are
+ * shared by reference, and writable pages become copy-on-write in both memory spaces. Pages that are not
+ * owned by the source are mapped persistent. The source must be synchronized through <batch>.
+ * @param source             The memory space that has the pages mapped.
+ * @param sourceAddress      The start of the region in the source.
+ * @param destination        The memory space to map the pages in.
+ * @param destinationAddress The start of the region in the destination, which must be allocated.
+ * @param pageCount          The number of pages in the region.
+ * @param attributes         The attributes of the pages in the destination, or 0 to keep the attributes
+ *                           each page has in the source.
+ * @param batch              The batch that collects the changes made to the source.
+ */
+extern oserr_t
+MSCopyOnWriteShare(
+        _In_ MemorySpace_t*      source,
+        _In_ vaddr_t             sourceAddress,
+        _In_ MemorySpace_t*      destination,
+        _In_ vaddr_t             destinationAddress,
+        _In_ int                 pageCount,
+        _In_ unsigned int        attributes,
+        _In_ struct MSSyncBatch* batch);
+
+/**
+ * @brief Determines the window of pages to commit for a fault in an allocation, and adapts the window
+ * of the allocation to the access. The window always includes the faulting page, and never extends
+ * beyond the bounds given.
+ * @param faultAround    The fault-around state of the allocation.
+ * @param flags          The mapping flags of the allocation.
+ * @param address        The page that faulted.
+ * @param start          The first page of the allocation that may be committed.
+ * @param end            The end of the allocation.
+ * @param windowStartOut The first page of the window.
+ * @param sequentialOut  Set to true if the fault continued where the previous window ended.
+ * @return The number of pages in the window.
+ */
+extern int
+MSFaultAroundWindow(
+        _In_  struct MSFaultAround* faultAround,
+        _In_  unsigned int          flags,
+        _In_  vaddr_t               address,
+        _In_  vaddr_t               start,
+        _In_  vaddr_t               end,
+        _Out_ vaddr_t*              windowStartOut,
+        _Out_ bool*                 sequentialOut);
+
+/**
+ * @brief Frees a virtual region in the memory space. Regions in the process heap can be freed
+ * partially, the pools only free entire regions, so there it must be the start of the region.
+ * @param memorySpace  The memory space that owns the region.
+ * @param startAddress The start of the region.
+ * @param length       The length of the region.
+ */
+extern void
+MSFreeVirtualRegion(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        startAddress,
+        _In_ size_t         length);
+
+/**
+ * @brief Restores a compressed page of the memory space that was faulted on. If another thread is
+ * already restoring the page, nothing is done, and the access will simply fault again until it's done.
+ * @param memorySpace The memory space that took the fault.
+ * @param address     The page that faulted.
+ * @return OS_ENOENT if the page was not compressed.
+ */
+extern oserr_t
+MSCompressedPageRestore(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ vaddr_t        address);
+
+/**
+ * @brief Clears the attributes of the pages in the range that are compressed, so they are not
+ * committed along with their neighbours. Must be called after the attributes were read.
+ * @param context    The memory space context the pages belong to.
+ * @param address    The start of the range.
+ * @param pageCount  The number of pages in the range.
+ * @param attributes The attributes of the pages in the range.
+ */
+extern void
+MSCompressedPagesExclude(
+        _In_ struct MSContext* context,
+        _In_ vaddr_t           address,
+        _In_ int               pageCount,
+        _In_ unsigned int*     attributes);
+
+/**
+ * @brief Discards the compressed pages in a range that is being unmapped.
+ * @param context The memory space context the pages belong to.
+ * @param address The start of the range.
+ * @param length  The length of the range in bytes.
+ */
+extern void
+MSCompressedPagesDiscard(
+        _In_ struct MSContext* context,
+        _In_ vaddr_t           address,
+        _In_ size_t            length);
+
+/**
+ * @brief Copies the compressed pages of a context to a context that is forked from it. The lock
+ * of the source context must be held.
+ * @param source      The context to copy the pages of.
+ * @param destination The forked context.
+ */
+extern oserr_t
+MSCompressedPagesClone(
+        _In_ struct MSContext* source,
+        _In_ struct MSContext* destination);
+
+/**
+ * @brief Registers the root memory space of a process with the compression worker, which does nothing
+ * unless the worker is running.
+ * @param memorySpace The memory space to register.
+ * @param handle      The handle of the memory space.
+ */
+extern void
+MSCompressRegister(
+        _In_ MemorySpace_t* memorySpace,
+        _In_ uuid_t         handle);
+
+/**
+ * @brief Unregisters a memory space from the compression worker.
+ * @param memorySpace The memory space to unregister.
+ */
+extern void
+MSCompressUnregister(
+        _In_ MemorySpace_t* memorySpace);
+
 #endif //!__MS_PRIVATE_H__
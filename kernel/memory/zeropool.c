@@ -0,0 +1,273 @@
+/**
+ * Copyright 2021, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Memory Zero Pool
+ *   - Keeps a pool of zeroed pages for each memory domain, which are filled in the
+ *     background so page faults and clean mappings don't have to zero pages on the spot.
+ */
+
+//#define __TRACE
+#define __need_minmax
+#include <component/timer.h>
+#include <debug.h>
+#include <futex.h>
+#include <machine.h>
+#include <memoryspace.h>
+#include <string.h>
+#include <threading.h>
+
+// The worker zeroes pages in batches through a temporary mapping, and checks on
+// the pools periodically in case a wakeup was skipped.
+#define ZERO_POOL_BATCH_PAGES  64
+#define ZERO_POOL_INTERVAL_MS  1000
+
+static _Atomic(int) g_zeroRequests = 0;
+static uuid_t       g_zeroHandle   = UUID_INVALID;
+static int          g_zeroTarget   = MEMORY_ZERO_POOL_TARGET;
+
+// Memory is considered low when less than an eighth of the memory is free, which
+// is the same point where the heap reaper starts giving memory back.
+static int
+__IsMemoryLow(void)
+{
+    size_t maxBlocks  = GetMachine()->NumberOfMemoryBlocks;
+    size_t freeBlocks = atomic_load(&GetMachine()->NumberOfFreeMemoryBlocks);
+    return freeBlocks < (maxBlocks >> 3U);
+}
+
+static SystemMemoryAllocator_t*
+__GetAllocator(
+        _In_ int index)
+{
+    // Index 0 is the default allocator, which serves memory outside the domains
+    if (index == 0) {
+        return &GetMachine()->PhysicalMemory;
+    }
+    return &GetMachine()->MemoryTopology.Domains[index - 1]->Allocator;
+}
+
+static int
+__GetAllocatorCount(void)
+{
+    return GetMachine()->MemoryTopology.DomainCount + 1;
+}
+
+static SystemMemoryAllocator_t*
+__GetLocalAllocator(void)
+{
+    SystemMemoryTopology_t* topology = &GetMachine()->MemoryTopology;
+    SystemDomain_t*         domain   = GetCurrentDomain();
+
+    if (domain != NULL) {
+        for (int i = 0; i < topology->DomainCount; i++) {
+            if (topology->Domains[i] == &domain->Memory) {
+                return &topology->Domains[i]->Allocator;
+            }
+        }
+    }
+    return &GetMachine()->PhysicalMemory;
+}
+
+static void
+__WakeWorker(void)
+{
+    // Requests are coalesced until the worker has run
+    int expected = 0;
+    if (g_zeroHandle == UUID_INVALID) {
+        return;
+    }
+    if (atomic_compare_exchange_strong(&g_zeroRequests, &expected, 1)) {
+        FutexWake(&g_zeroRequests, 1, 0);
+    }
+}
+
+static oserr_t
+__ZeroPages(
+        _In_ int        pageCount,
+        _In_ uintptr_t* pages)
+{
+    size_t  pageSize = GetMemorySpacePageSize();
+    vaddr_t mapping;
+    oserr_t oserr;
+
+    oserr = MemorySpaceMap(
+            GetCurrentMemorySpace(),
+            &(struct MemorySpaceMapOptions) {
+                .Pages = pages,
+                .Length = pageSize * pageCount,
+                .Flags = MAPPING_COMMIT | MAPPING_PERSISTENT,
+                .PlacementFlags = MAPPING_PHYSICAL_FIXED | MAPPING_VIRTUAL_GLOBAL
+            },
+            &mapping
+    );
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    memset((void*)mapping, 0, pageSize * pageCount);
+    return MemorySpaceUnmap(GetCurrentMemorySpace(), mapping, pageSize * pageCount);
+}
+
+static void
+__FillPool(
+        _In_ SystemMemoryAllocator_t* allocator)
+{
+    uintptr_t pages[ZERO_POOL_BATCH_PAGES];
+    int       deficit;
+
+    while ((deficit = SystemMemoryAllocatorZeroPoolDeficit(allocator)) > 0 && !__IsMemoryLow()) {
+        int     pageCount = MIN(deficit, ZERO_POOL_BATCH_PAGES);
+        int     pagesAdded;
+        oserr_t oserr;
+
+        // Allocate from the allocator directly, so the pages end up in the pool
+        // of the domain they belong to.
+        oserr = SystemMemoryAllocatorAllocate(allocator, 0, pageCount, &pages[0]);
+        if (oserr != OS_EOK) {
+            return;
+        }
+        atomic_fetch_sub(&GetMachine()->NumberOfFreeMemoryBlocks, (size_t)pageCount);
+
+        oserr = __ZeroPages(pageCount, &pages[0]);
+        if (oserr != OS_EOK) {
+            WARNING("__FillPool failed to map pages for zeroing: %u", oserr);
+            FreePhysicalMemory(pageCount, &pages[0]);
+            return;
+        }
+
+        // The target may have been lowered while we were zeroing
+        pagesAdded = SystemMemoryAllocatorZeroPoolPut(allocator, pageCount, &pages[0]);
+        if (pagesAdded < pageCount) {
+            FreePhysicalMemory(pageCount - pagesAdded, &pages[pagesAdded]);
+            return;
+        }
+    }
+}
+
+static void
+__TrimPool(
+        _In_ SystemMemoryAllocator_t* allocator,
+        _In_ bool                     drain)
+{
+    uintptr_t pages[ZERO_POOL_BATCH_PAGES];
+    int       pageCount;
+
+    while ((pageCount = SystemMemoryAllocatorZeroPoolReclaim(allocator, drain, ZERO_POOL_BATCH_PAGES, &pages[0]))) {
+        FreePhysicalMemory(pageCount, &pages[0]);
+    }
+}
+
+_Noreturn static void
+__ZeroThread(
+        _In_Opt_ void* argument)
+{
+    OSTimestamp_t deadline;
+    _CRT_UNUSED(argument);
+
+    for (;;) {
+        SystemTimerGetWallClockTime(&deadline);
+        OSTimestampAddNsec(&deadline, &deadline, ZERO_POOL_INTERVAL_MS * NSEC_PER_MSEC);
+        (void)FutexWait(NULL, &g_zeroRequests, 0, 0, NULL, 0, 0, &deadline);
+
+        // Reset the request before filling, so new requests that come in
+        // while we run will trigger another round.
+        atomic_store(&g_zeroRequests, 0);
+        for (int i = 0; i < __GetAllocatorCount(); i++) {
+            SystemMemoryAllocator_t* allocator = __GetAllocator(i);
+            if (__IsMemoryLow()) {
+                __TrimPool(allocator, true);
+            } else {
+                __TrimPool(allocator, false);
+                __FillPool(allocator);
+            }
+        }
+    }
+}
+
+oserr_t
+MemoryZeroPoolInitialize(void)
+{
+    for (int i = 0; i < __GetAllocatorCount(); i++) {
+        SystemMemoryAllocatorInitializeZeroPool(__GetAllocator(i), g_zeroTarget);
+    }
+    return ThreadCreate("zero-worker", __ZeroThread, NULL,
+                        THREADING_BACKGROUND, UUID_INVALID, 0, 0,
+                        &g_zeroHandle);
+}
+
+void
+MemoryZeroPoolSetTarget(
+        _In_ int pageCount)
+{
+    g_zeroTarget = MAX(0, MIN(pageCount, MEMORY_ZERO_POOL_CAPACITY));
+    for (int i = 0; i < __GetAllocatorCount(); i++) {
+        SystemMemoryAllocatorZeroPoolSetTarget(__GetAllocator(i), g_zeroTarget);
+    }
+    __WakeWorker();
+}
+
+void
+MemoryZeroPoolGetStatistics(
+        _Out_ size_t* pagesOut,
+        _Out_ size_t* targetOut,
+        _Out_ size_t* hitsOut,
+        _Out_ size_t* missesOut)
+{
+    *pagesOut  = 0;
+    *targetOut = 0;
+    *hitsOut   = 0;
+    *missesOut = 0;
+    for (int i = 0; i < __GetAllocatorCount(); i++) {
+        SystemMemoryAllocatorStatistics_t statistics;
+
+        SystemMemoryAllocatorGetStatistics(__GetAllocator(i), &statistics);
+        *pagesOut  += statistics.ZeroPoolPages;
+        *targetOut += statistics.ZeroPoolTarget;
+        *hitsOut   += statistics.ZeroPoolHits;
+        *missesOut += statistics.ZeroPoolMisses;
+    }
+}
+
+oserr_t
+AllocatePhysicalMemoryZeroed(
+        _In_  size_t     pageMask,
+        _In_  int        pageCount,
+        _In_  uintptr_t* pages,
+        _Out_ int*       pagesZeroedOut)
+{
+    SystemMemoryAllocator_t* allocator = __GetLocalAllocator();
+    int                      pagesZeroed;
+    oserr_t                  oserr;
+
+    // Pages in the pool are already accounted as allocated
+    pagesZeroed = SystemMemoryAllocatorZeroPoolTake(allocator, pageMask, pageCount, pages);
+    if (pagesZeroed < pageCount) {
+        oserr = AllocatePhysicalMemory(pageMask, pageCount - pagesZeroed, &pages[pagesZeroed]);
+        if (oserr != OS_EOK) {
+            if (pagesZeroed) {
+                FreePhysicalMemory(pagesZeroed, pages);
+            }
+            return oserr;
+        }
+    }
+
+    // Get the worker going once the pool is half empty, instead of waiting for it to run dry
+    if (SystemMemoryAllocatorZeroPoolDeficit(allocator) > (g_zeroTarget / 2)) {
+        __WakeWorker();
+    }
+    *pagesZeroedOut = pagesZeroed;
+    return OS_EOK;
+}
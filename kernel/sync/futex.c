@@ -396,7 +396,9 @@ WakeWaiters:
         SpinlockReleaseIrq(&FutexItem->BlockQueueSyncObject);
         
         if (Front) {
-            Status = SchedulerQueueObject(Front->value);
+            // Only the first woken thread can take over the core of a sync waker
+            Status = SchedulerWakeObject(Front->value,
+                (i == 0 && (Flags & FUTEX_FLAG_SYNC)) ? SCHEDULER_WAKE_SYNC : 0);
             if (Status != OS_EOK) {
                 break;
             }
@@ -18,15 +18,20 @@
  * Synchronization (Mutex)
  * - Hybrid mutex implementation. Contains a spinlock that serves
  *   as the locking primitive, with extended block capabilities.
+ * - Owners of contended mutexes inherit the best scheduler level of the threads
+ *   waiting on them. If an owner is itself waiting on another mutex, the level is
+ *   passed on along the chain of owners.
  */
 #define __MODULE "MUTX"
 
+#define __need_minmax
 #include <arch/interrupts.h>
 #include <assert.h>
 #include <handle.h>
 #include <machine.h>
 #include <mutex.h>
 #include <scheduler.h>
+#include <threading.h>
 #include <arch/thread.h>
 
 // Internal, very private definitions
@@ -35,6 +40,14 @@
 
 #define MUTEX_SPINS 100
 
+// Bounds the walk along a chain of owners, a longer chain is either a
+// deadlock or a design problem in the code holding the mutexes.
+#define MUTEX_CHAIN_MAX 16
+
+// The inheritance state crosses mutexes when following chains of owners, so it is
+// protected by a single lock. This is only taken on the contended paths.
+static Spinlock_t g_inheritanceLock = OS_SPINLOCK_INIT;
+
 static inline int __HasFlags(Mutex_t* mutex, unsigned int flags)
 {
     return (atomic_load(&mutex->Flags) & flags) == flags;
@@ -50,6 +63,174 @@ static inline void __SetFlags(Mutex_t* mutex, unsigned int flags)
     (void)atomic_fetch_or(&mutex->Flags, flags);
 }
 
+static MutexInheritance_t*
+__CurrentInheritance(
+        _Out_ SchedulerObject_t** objectOut)
+{
+    Thread_t* thread = CpuCoreCurrentThread(CpuCoreCurrent());
+    *objectOut = ThreadSchedulerHandle(thread);
+    return ThreadMutexInheritance(thread);
+}
+
+static void
+__UnlinkHeld(
+        _In_ Mutex_t* mutex)
+{
+    Mutex_t** iter;
+
+    if (mutex->HeldBy == NULL) {
+        return;
+    }
+
+    iter = &mutex->HeldBy->Held;
+    while (*iter && *iter != mutex) {
+        iter = &(*iter)->HeldLink;
+    }
+    if (*iter) {
+        *iter = mutex->HeldLink;
+    }
+    mutex->HeldBy   = NULL;
+    mutex->HeldLink = NULL;
+}
+
+static void
+__LinkHeld(
+        _In_ Mutex_t*            mutex,
+        _In_ MutexInheritance_t* inheritance)
+{
+    if (mutex->HeldBy == inheritance) {
+        return;
+    }
+
+    __UnlinkHeld(mutex);
+    mutex->HeldBy     = inheritance;
+    mutex->HeldLink   = inheritance->Held;
+    inheritance->Held = mutex;
+}
+
+static int
+__GetWaiterLevel(
+        _In_ int        index,
+        _In_ element_t* element,
+        _In_ void*      context)
+{
+    int* level = context;
+    _CRT_UNUSED(index);
+
+    *level = MIN(*level, SchedulerObjectGetQueue(element->value));
+    return LIST_ENUMERATE_CONTINUE;
+}
+
+static int
+__GetInheritedLevel(
+        _In_ MutexInheritance_t* inheritance)
+{
+    int level = SCHEDULER_LEVEL_COUNT;
+    for (Mutex_t* mutex = inheritance->Held; mutex != NULL; mutex = mutex->HeldLink) {
+        list_enumerate(&mutex->BlockQueue, __GetWaiterLevel, &level);
+    }
+    return level;
+}
+
+// Recomputes the level the thread inherits from the mutexes it holds. If the thread is
+// waiting on a mutex itself, the change is passed on to the owner of that mutex, and so on.
+static void
+__UpdateInheritance(
+        _In_ uuid_t threadHandle)
+{
+    for (int i = 0; i < MUTEX_CHAIN_MAX && threadHandle != UUID_INVALID; i++) {
+        Thread_t*           thread = THREAD_GET(threadHandle);
+        MutexInheritance_t* inheritance;
+        SchedulerObject_t*  object;
+        int                 level;
+
+        if (thread == NULL) {
+            return;
+        }
+
+        inheritance = ThreadMutexInheritance(thread);
+        object      = ThreadSchedulerHandle(thread);
+        level       = SchedulerObjectGetQueue(object);
+        SchedulerObjectSetInheritedQueue(object, __GetInheritedLevel(inheritance));
+
+        // The rest of the chain only depends on the level of this thread
+        if (SchedulerObjectGetQueue(object) == level || inheritance->BlockedOn == NULL) {
+            return;
+        }
+        threadHandle = atomic_load(&inheritance->BlockedOn->Owner);
+    }
+}
+
+// Called by a thread that has just been queued on the mutex
+static void
+__StartWaiting(
+        _In_ Mutex_t*            mutex,
+        _In_ MutexInheritance_t* inheritance)
+{
+    uuid_t    owner;
+    Thread_t* ownerThread;
+
+    SpinlockAcquireIrq(&g_inheritanceLock);
+    inheritance->BlockedOn = mutex;
+    owner       = atomic_load(&mutex->Owner);
+    ownerThread = owner != UUID_INVALID ? THREAD_GET(owner) : NULL;
+    if (ownerThread != NULL) {
+        __LinkHeld(mutex, ThreadMutexInheritance(ownerThread));
+        __UpdateInheritance(owner);
+    }
+    SpinlockReleaseIrq(&g_inheritanceLock);
+}
+
+// Called by a thread that no longer waits on the mutex, either because it was woken
+// or because it timed out. If it timed out, the owner may have to drop a level.
+static void
+__StopWaiting(
+        _In_ Mutex_t*            mutex,
+        _In_ MutexInheritance_t* inheritance)
+{
+    SpinlockAcquireIrq(&g_inheritanceLock);
+    inheritance->BlockedOn = NULL;
+    if (!list_count(&mutex->BlockQueue)) {
+        __UnlinkHeld(mutex);
+    }
+    __UpdateInheritance(atomic_load(&mutex->Owner));
+    SpinlockReleaseIrq(&g_inheritanceLock);
+}
+
+// Called by the new owner of a mutex that still has waiters
+static void
+__AdoptWaiters(
+        _In_ Mutex_t* mutex)
+{
+    MutexInheritance_t* inheritance;
+    SchedulerObject_t*  object;
+
+    SpinlockAcquireIrq(&g_inheritanceLock);
+    inheritance = __CurrentInheritance(&object);
+    if (list_count(&mutex->BlockQueue)) {
+        __LinkHeld(mutex, inheritance);
+    }
+    SchedulerObjectSetInheritedQueue(object, __GetInheritedLevel(inheritance));
+    SpinlockReleaseIrq(&g_inheritanceLock);
+}
+
+// Called by the owner when it releases a mutex that has waiters
+static void
+__ReleaseInheritance(
+        _In_ Mutex_t* mutex)
+{
+    MutexInheritance_t* inheritance;
+    SchedulerObject_t*  object;
+
+    SpinlockAcquireIrq(&g_inheritanceLock);
+    inheritance = __CurrentInheritance(&object);
+    if (mutex->HeldBy == inheritance) {
+        __UnlinkHeld(mutex);
+    }
+    SchedulerObjectSetInheritedQueue(object, __GetInheritedLevel(inheritance));
+    SpinlockReleaseIrq(&g_inheritanceLock);
+}
+
 // Try performing a quick lock of the mutex by using cmpxchg
 static oserr_t
 __TryQuickLock(
@@ -70,6 +251,9 @@ __TryQuickLock(
     }
 
     mutex->ReferenceCount = 1;
+    if (__HasFlags(mutex, MUTEX_FLAG_PENDING)) {
+        __AdoptWaiters(mutex);
+    }
     return OS_EOK;
 }
 
@@ -99,8 +283,10 @@ __SlowLock(
         _In_ Mutex_t*       mutex,
         _In_ OSTimestamp_t* deadline)
 {
-    irqstate_t intStatus;
-    uuid_t     owner;
+    MutexInheritance_t* inheritance;
+    SchedulerObject_t*  object;
+    irqstate_t          intStatus;
+    uuid_t              owner;
 
     // TODO: Detect mutex locking during IRQs
 
@@ -122,14 +308,17 @@ __SlowLock(
 
     // mark us having waiters
     __SetFlags(mutex, MUTEX_FLAG_PENDING);
+    inheritance = __CurrentInheritance(&object);
     for (;;) {
         // block task and then reenable interrupts
         oserr_t oserr = SchedulerBlock(&mutex->BlockQueue, deadline);
         if (oserr == OS_EOK) {
+            __StartWaiting(mutex, inheritance);
             SpinlockRelease(&mutex->Lock);
             InterruptRestoreState(intStatus);
             ArchThreadYield();
             oserr = SchedulerGetTimeoutReason();
+            __StopWaiting(mutex, inheritance);
         }
 
         // at this point we've been waken up either by an unlock or timeout
@@ -168,6 +357,8 @@ MutexConstruct(
     mutex->Owner          = UUID_INVALID;
     mutex->Flags          = configuration;
     mutex->ReferenceCount = 0;
+    mutex->HeldBy         = NULL;
+    mutex->HeldLink       = NULL;
 }
 
 void
@@ -182,7 +373,12 @@ MutexDestruct(
     mutex->ReferenceCount = 0;
     __SetFlags(mutex, MUTEX_FLAG_INVALID);
     __ClearFlags(mutex, MUTEX_FLAG_PENDING);
-    atomic_store(&mutex->Owner, UUID_INVALID);
+
+    // the owner no longer inherits anything from the waiters
+    SpinlockAcquireIrq(&g_inheritanceLock);
+    __UnlinkHeld(mutex);
+    __UpdateInheritance(atomic_exchange(&mutex->Owner, UUID_INVALID));
+    SpinlockReleaseIrq(&g_inheritanceLock);
 
     SpinlockAcquire(&mutex->Lock);
     waiter = list_front(&mutex->BlockQueue);
@@ -256,6 +452,7 @@ MutexUnlock(
         return;
 
     SpinlockAcquire(&mutex->Lock);
+    __ReleaseInheritance(mutex);
     waiter = list_front(&mutex->BlockQueue);
     if (waiter) {
         list_remove(&mutex->BlockQueue, waiter);
@@ -0,0 +1,480 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <arch/interrupts.h>
+#include <arch/thread.h>
+#include <component/cpu.h>
+#include <handle.h>
+#include <machine.h>
+#include <mutex.h>
+#include <scheduler.h>
+#include <threading.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#define THREAD_COUNT 4
+#define STACK_SIZE   (64 * 1024)
+#define TRACE_COUNT  256
+
+// The threads are run as coroutines by a simple priority scheduler, so every run
+// of a scenario is the same. A thread runs until it blocks or reaches one of its
+// preemption points, and then the runnable thread with the best level is picked.
+// Time only moves when a thread does work.
+struct SchedulerObject {
+    element_t     Header;
+    int           Queue;
+    int           InheritedQueue;
+    bool          Blocked;
+    list_t*       BlockQueue;
+    uint64_t      Deadline;
+    oserr_t       TimeoutReason;
+};
+
+struct Thread {
+    int                Index;
+    SchedulerObject_t  Object;
+    MutexInheritance_t Inheritance;
+    ucontext_t         Context;
+    char*              Stack;
+    void             (*Entry)(void);
+    uint64_t           StartAt;
+    bool               Done;
+};
+
+struct __TraceEntry {
+    int      Thread;
+    uint64_t Time;
+    int      Level; // The level the thread ran at
+};
+
+static struct __TestContext {
+    struct Thread       Threads[THREAD_COUNT];
+    int                 ThreadCount;
+    struct Thread*      Current;
+    ucontext_t          SchedulerContext;
+    uint64_t            Time;
+    SystemMachine_t     Machine;
+    Mutex_t             Mutexes[2];
+    struct __TraceEntry Trace[TRACE_COUNT];
+    int                 TraceCount;
+
+    // Set by the scenarios at the interesting points
+    uint64_t            AcquiredAt;
+} g_testContext;
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(g_testContext));
+    g_testContext.Machine.NumberOfActiveCores = 1;
+    MutexConstruct(&g_testContext.Mutexes[0], MUTEX_FLAG_TIMED);
+    MutexConstruct(&g_testContext.Mutexes[1], MUTEX_FLAG_TIMED);
+    return 0;
+}
+
+int TeardownTest(void** state) {
+    (void)state;
+    for (int i = 0; i < g_testContext.ThreadCount; i++) {
+        free(g_testContext.Threads[i].Stack);
+    }
+    return 0;
+}
+
+static int
+__Level(struct Thread* thread)
+{
+    return SchedulerObjectGetQueue(&thread->Object);
+}
+
+static void
+__ThreadEntry(void)
+{
+    g_testContext.Current->Entry();
+    g_testContext.Current->Done = true;
+}
+
+static int
+__CreateThread(int level, uint64_t startAt, void (*entry)(void))
+{
+    int            index  = g_testContext.ThreadCount++;
+    struct Thread* thread = &g_testContext.Threads[index];
+    assert_true(index < THREAD_COUNT);
+
+    thread->Index                 = index;
+    thread->Object.Queue          = level;
+    thread->Object.InheritedQueue = SCHEDULER_LEVEL_COUNT;
+    thread->Entry                 = entry;
+    thread->StartAt               = startAt;
+    thread->Stack                 = malloc(STACK_SIZE);
+    assert_non_null(thread->Stack);
+    ELEMENT_INIT(&thread->Object.Header, 0, &thread->Object);
+
+    getcontext(&thread->Context);
+    thread->Context.uc_stack.ss_sp   = thread->Stack;
+    thread->Context.uc_stack.ss_size = STACK_SIZE;
+    thread->Context.uc_link          = &g_testContext.SchedulerContext;
+    makecontext(&thread->Context, __ThreadEntry, 0);
+    return index;
+}
+
+// Times out blocked threads the same way the scheduler does, by taking them
+// off the queue they wait on.
+static void
+__HandleTimeouts(void)
+{
+    for (int i = 0; i < g_testContext.ThreadCount; i++) {
+        struct Thread* thread = &g_testContext.Threads[i];
+        if (thread->Object.Blocked && thread->Object.Deadline &&
+            thread->Object.Deadline <= g_testContext.Time) {
+            list_remove(thread->Object.BlockQueue, &thread->Object.Header);
+            thread->Object.TimeoutReason = OS_ETIMEOUT;
+            thread->Object.Blocked       = false;
+        }
+    }
+}
+
+// Threads on the same level take turns, starting after the thread that ran last
+static struct Thread*
+__PickThread(void)
+{
+    struct Thread* next  = NULL;
+    int            start = g_testContext.Current ? g_testContext.Current->Index + 1 : 0;
+
+    for (int j = 0; j < g_testContext.ThreadCount; j++) {
+        struct Thread* thread = &g_testContext.Threads[(start + j) % g_testContext.ThreadCount];
+        if (thread->Done || thread->Object.Blocked || thread->StartAt > g_testContext.Time) {
+            continue;
+        }
+        if (next == NULL || __Level(thread) < __Level(next)) {
+            next = thread;
+        }
+    }
+    return next;
+}
+
+static void
+__Run(void)
+{
+    for (;;) {
+        struct Thread* next;
+        bool           pending = false;
+
+        __HandleTimeouts();
+        next = __PickThread();
+        if (next == NULL) {
+            // Move time to the next thread that starts, otherwise everything is done
+            for (int i = 0; i < g_testContext.ThreadCount; i++) {
+                if (!g_testContext.Threads[i].Done) {
+                    assert_true(g_testContext.Threads[i].StartAt > g_testContext.Time);
+                    pending = true;
+                }
+            }
+            if (!pending) {
+                return;
+            }
+            g_testContext.Time++;
+            continue;
+        }
+
+        g_testContext.Current = next;
+        swapcontext(&g_testContext.SchedulerContext, &next->Context);
+    }
+}
+
+// Runs for the given time, giving the scheduler a chance to preempt after each unit
+static void
+__Work(int units)
+{
+    struct Thread* current = g_testContext.Current;
+
+    for (int i = 0; i < units; i++) {
+        assert_true(g_testContext.TraceCount < TRACE_COUNT);
+        g_testContext.Trace[g_testContext.TraceCount++] = (struct __TraceEntry) {
+            current->Index, g_testContext.Time, __Level(current)
+        };
+        g_testContext.Time++;
+        ArchThreadYield();
+    }
+}
+
+// Returns the best level the thread ran at in the time span
+static int
+__BestLevel(int thread, uint64_t from, uint64_t to)
+{
+    int level = SCHEDULER_LEVEL_COUNT;
+    for (int i = 0; i < g_testContext.TraceCount; i++) {
+        struct __TraceEntry* entry = &g_testContext.Trace[i];
+        if (entry->Thread == thread && entry->Time >= from && entry->Time < to) {
+            level = entry->Level < level ? entry->Level : level;
+        }
+    }
+    return level;
+}
+
+// Returns the time the thread last did work
+static uint64_t
+__LastWork(int thread)
+{
+    uint64_t time = 0;
+    for (int i = 0; i < g_testContext.TraceCount; i++) {
+        if (g_testContext.Trace[i].Thread == thread) {
+            time = g_testContext.Trace[i].Time;
+        }
+    }
+    return time;
+}
+
+#define MUTEX_A (&g_testContext.Mutexes[0])
+#define MUTEX_B (&g_testContext.Mutexes[1])
+
+// Low priority thread holding A for a while
+static void __LowHoldsA(void)
+{
+    MutexLock(MUTEX_A);
+    __Work(10);
+    MutexUnlock(MUTEX_A);
+    __Work(1);
+}
+
+static void __HighTakesA(void)
+{
+    MutexLock(MUTEX_A);
+    g_testContext.AcquiredAt = g_testContext.Time;
+    MutexUnlock(MUTEX_A);
+}
+
+static void __MediumSpins(void)
+{
+    __Work(30);
+}
+
+// Priority inversion: L holds A, H waits on A, and M is runnable with a level
+// between the two. M must not be able to delay H.
+void TestInheritance_BoundsInversion(void** state)
+{
+    int low, high, medium;
+    (void)state;
+
+    low    = __CreateThread(20, 0, __LowHoldsA);
+    high   = __CreateThread(1, 2, __HighTakesA);
+    medium = __CreateThread(10, 3, __MediumSpins);
+    __Run();
+
+    // L runs at the level of H from the moment H blocks until it releases A at
+    // time 10, and H gets A at the next scheduling point. Without inheritance M
+    // would run first, and H would only get A after time 40.
+    assert_int_equal(__BestLevel(low, 0, 2), 20);
+    assert_int_equal(__BestLevel(low, 2, 10), 1);
+    assert_int_equal(__BestLevel(low, 10, 11), 20);
+    assert_int_equal(g_testContext.AcquiredAt, 11);
+    assert_int_equal(__Level(&g_testContext.Threads[low]), 20);
+    assert_int_equal(__LastWork(medium), 40);
+    assert_null(g_testContext.Threads[low].Inheritance.Held);
+
+    // H never lent its level away, and released A again
+    assert_int_equal(__Level(&g_testContext.Threads[high]), 1);
+    assert_null(g_testContext.Threads[high].Inheritance.Held);
+}
+
+static void __MiddleTakesBThenA(void)
+{
+    MutexLock(MUTEX_B);
+    MutexLock(MUTEX_A);
+    __Work(2);
+    MutexUnlock(MUTEX_A);
+    __Work(2);
+    MutexUnlock(MUTEX_B);
+}
+
+static void __HighTakesB(void)
+{
+    MutexLock(MUTEX_B);
+    g_testContext.AcquiredAt = g_testContext.Time;
+    MutexUnlock(MUTEX_B);
+}
+
+// Chained inheritance: L holds A, P holds B and waits on A, and H waits on B. The
+// level of H must reach L through P.
+void TestInheritance_FollowsChain(void** state)
+{
+    int low, middle, high, medium;
+    (void)state;
+
+    low    = __CreateThread(30, 0, __LowHoldsA);
+    middle = __CreateThread(20, 1, __MiddleTakesBThenA);
+    high   = __CreateThread(1, 2, __HighTakesB);
+    medium = __CreateThread(10, 3, __MediumSpins);
+    __Run();
+
+    // L first inherits the level of P, and then the level of H through P
+    assert_int_equal(__BestLevel(low, 0, 1), 30);
+    assert_int_equal(__BestLevel(low, 1, 2), 20);
+    assert_int_equal(__BestLevel(low, 2, 10), 1);
+
+    // P keeps the level of H after it gets A, as H is still waiting on B, and
+    // drops it again when it releases B.
+    assert_int_equal(__BestLevel(middle, 11, 15), 1);
+    assert_int_equal(g_testContext.AcquiredAt, 15);
+    assert_int_equal(__Level(&g_testContext.Threads[low]), 30);
+    assert_int_equal(__Level(&g_testContext.Threads[middle]), 20);
+    assert_int_equal(__LastWork(medium), 44);
+    assert_null(g_testContext.Threads[middle].Inheritance.Held);
+    (void)high;
+}
+
+static void __HighTakesATimed(void)
+{
+    OSTimestamp_t deadline = { .Seconds = 5 };
+    assert_int_equal(MutexLockTimed(MUTEX_A, &deadline), OS_ETIMEOUT);
+    g_testContext.AcquiredAt = g_testContext.Time;
+}
+
+// A waiter that gives up must take the level it lent back with it
+void TestInheritance_TimeoutRestoresLevel(void** state)
+{
+    int low, high;
+    (void)state;
+
+    low  = __CreateThread(20, 0, __LowHoldsA);
+    high = __CreateThread(1, 2, __HighTakesATimed);
+    __Run();
+
+    assert_int_equal(g_testContext.AcquiredAt, 5);
+    assert_int_equal(__BestLevel(low, 2, 5), 1);
+    assert_int_equal(__BestLevel(low, 5, 10), 20);
+    assert_null(g_testContext.Threads[low].Inheritance.Held);
+    (void)high;
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup_teardown(TestInheritance_BoundsInversion, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestInheritance_FollowsChain, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestInheritance_TimeoutRestoresLevel, SetupTest, TeardownTest),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+// Mocks
+
+SchedulerObject_t* ThreadSchedulerHandle(Thread_t* thread) {
+    return &thread->Object;
+}
+
+MutexInheritance_t* ThreadMutexInheritance(Thread_t* thread) {
+    return &thread->Inheritance;
+}
+
+// Handle 0 is UUID_INVALID, so thread handles start at 1
+uuid_t ThreadCurrentHandle(void) {
+    return (uuid_t)g_testContext.Current->Index + 1;
+}
+
+void* LookupHandleOfType(uuid_t handle, HandleType_t type) {
+    assert_int_equal(type, HandleTypeThread);
+    if (handle == UUID_INVALID || handle > (uuid_t)g_testContext.ThreadCount) {
+        return NULL;
+    }
+    return &g_testContext.Threads[handle - 1];
+}
+
+SystemCpuCore_t* CpuCoreCurrent(void) {
+    return NULL;
+}
+
+uuid_t CpuCoreId(SystemCpuCore_t* cpuCore) {
+    (void)cpuCore;
+    return 0;
+}
+
+Thread_t* CpuCoreCurrentThread(SystemCpuCore_t* cpuCore) {
+    (void)cpuCore;
+    return g_testContext.Current;
+}
+
+SystemMachine_t* GetMachine(void) {
+    return &g_testContext.Machine;
+}
+
+int SchedulerObjectGetQueue(SchedulerObject_t* object) {
+    return object->Queue < object->InheritedQueue ? object->Queue : object->InheritedQueue;
+}
+
+void SchedulerObjectSetInheritedQueue(SchedulerObject_t* object, int queue) {
+    object->InheritedQueue = queue;
+}
+
+uuid_t SchedulerObjectGetAffinity(SchedulerObject_t* object) {
+    (void)object;
+    return 0;
+}
+
+oserr_t SchedulerBlock(list_t* blockQueue, OSTimestamp_t* deadline) {
+    SchedulerObject_t* object = &g_testContext.Current->Object;
+
+    object->Blocked       = true;
+    object->BlockQueue    = blockQueue;
+    object->Deadline      = deadline ? (uint64_t)deadline->Seconds : 0;
+    object->TimeoutReason = OS_EOK;
+    list_append(blockQueue, &object->Header);
+    return OS_EOK;
+}
+
+oserr_t SchedulerQueueObject(SchedulerObject_t* object) {
+    object->Blocked = false;
+    return OS_EOK;
+}
+
+oserr_t SchedulerGetTimeoutReason(void) {
+    return g_testContext.Current->Object.TimeoutReason;
+}
+
+void ArchThreadYield(void) {
+    struct Thread* current = g_testContext.Current;
+    swapcontext(&current->Context, &g_testContext.SchedulerContext);
+}
+
+irqstate_t InterruptDisable(void) {
+    return 0;
+}
+
+irqstate_t InterruptRestoreState(irqstate_t state) {
+    return state;
+}
+
+void SpinlockConstruct(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void SpinlockAcquire(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void SpinlockRelease(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void SpinlockAcquireIrq(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void SpinlockReleaseIrq(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
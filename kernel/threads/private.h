@@ -61,6 +61,7 @@ typedef struct Thread {
 
     Mutex_t                 SyncObject;
     Semaphore_t             EventObject;
+    MutexInheritance_t      MutexInheritance;
     _Atomic(int)            References;
     UInteger64_t            StartedAt;
     struct Thread*          Children;
@@ -716,6 +716,16 @@ ThreadSchedulerHandle(
     return Thread->SchedulerObject;
 }
 
+MutexInheritance_t*
+ThreadMutexInheritance(
+        _In_ Thread_t* thread)
+{
+    if (!thread) {
+        return NULL;
+    }
+    return &thread->MutexInheritance;
+}
+
 PlatformThreadBlock_t*
 ThreadPlatformBlock(
         _In_ Thread_t* thread)
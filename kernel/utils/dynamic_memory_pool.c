@@ -92,6 +92,52 @@ DynamicMemoryPoolDestroy(
 	Pool->Root = NULL;
 }
 
+static DynamicMemoryChunk_t*
+CloneNode(
+	_In_ DynamicMemoryChunk_t* Node,
+	_In_ DynamicMemoryChunk_t* Parent)
+{
+	DynamicMemoryChunk_t* Clone;
+
+	if (!Node) {
+		return NULL;
+	}
+
+	Clone = CreateNode(Parent);
+	if (!Clone) {
+		return NULL;
+	}
+
+	Clone->Split     = Node->Split;
+	Clone->Allocated = Node->Allocated;
+	Clone->Left      = CloneNode(Node->Left, Clone);
+	Clone->Right     = CloneNode(Node->Right, Clone);
+	if ((Node->Left && !Clone->Left) || (Node->Right && !Clone->Right)) {
+		DestroyNode(Clone);
+		return NULL;
+	}
+	return Clone;
+}
+
+oserr_t
+DynamicMemoryPoolClone(
+	_In_ DynamicMemoryPool_t* Pool,
+	_In_ DynamicMemoryPool_t* Clone)
+{
+	assert(Pool != NULL);
+	assert(Clone != NULL);
+
+    SpinlockConstruct(&Clone->SyncObject);
+	Clone->StartAddress = Pool->StartAddress;
+	Clone->Length       = Pool->Length;
+	Clone->ChunkSize    = Pool->ChunkSize;
+
+	SpinlockAcquireIrq(&Pool->SyncObject);
+	Clone->Root = CloneNode(Pool->Root, NULL);
+	SpinlockReleaseIrq(&Pool->SyncObject);
+	return Clone->Root != NULL ? OS_EOK : OS_EOOM;
+}
+
 static DynamicMemoryChunk_t*
 FindNextParent(
 	_In_  DynamicMemoryPool_t*  Pool,
@@ -0,0 +1,243 @@
+/**
+ * Copyright 2021, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * MollenOS System Component Infrastructure
+ * - Buddy allocator for physically contiguous memory. Free blocks are
+ *   tracked with a bitmap per order, which is kept outside the memory managed.
+ */
+
+//#define __TRACE
+
+#include <assert.h>
+#include <debug.h>
+#include <utils/memory_buddy.h>
+#include <string.h>
+
+#define __BLOCKS_AT_ORDER(buddy, order) ((buddy)->block_count >> (order))
+#define __WORDS_AT_ORDER(buddy, order)  DIVUP(__BLOCKS_AT_ORDER(buddy, order), 64)
+
+void
+MemoryBuddyConstruct(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ uintptr_t      base,
+        _In_ size_t         blockSize,
+        _In_ int            blockCount,
+        _In_ uint64_t*      storage)
+{
+    uint64_t* bitmap = storage;
+    TRACE("MemoryBuddyConstruct(base=0x%" PRIxIN ", blockCount=%i)", base, blockCount);
+
+    assert(buddy != NULL);
+    assert(blockSize != 0);
+    assert(blockCount == 0 || storage != NULL);
+    assert((base % (blockSize << MEMORY_BUDDY_MAX_ORDER)) == 0);
+
+    buddy->base        = base;
+    buddy->block_size  = blockSize;
+    buddy->block_count = blockCount;
+    buddy->blocks_free = 0;
+
+    // Each order has its own bitmap, where a set bit means the block at that
+    // order is free. The bitmaps are placed back to back in the storage provided.
+    for (int i = 0; i <= MEMORY_BUDDY_MAX_ORDER; i++) {
+        int words = __WORDS_AT_ORDER(buddy, i);
+        buddy->bitmaps[i]    = bitmap;
+        buddy->free_count[i] = 0;
+        buddy->word_hint[i]  = 0;
+        if (words) {
+            memset(bitmap, 0, words * sizeof(uint64_t));
+            bitmap += words;
+        }
+    }
+}
+
+static inline bool
+__IsFree(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ int            order,
+        _In_ int            index)
+{
+    return (buddy->bitmaps[order][index / 64] & (1ULL << (index % 64))) != 0;
+}
+
+static inline void
+__MarkFree(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ int            order,
+        _In_ int            index)
+{
+    int word = index / 64;
+    buddy->bitmaps[order][word] |= (1ULL << (index % 64));
+    buddy->free_count[order]++;
+
+    // The hint is the lowest word that may contain a free block
+    if (word < buddy->word_hint[order]) {
+        buddy->word_hint[order] = word;
+    }
+}
+
+static inline void
+__MarkUsed(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ int            order,
+        _In_ int            index)
+{
+    buddy->bitmaps[order][index / 64] &= ~(1ULL << (index % 64));
+    buddy->free_count[order]--;
+}
+
+static int
+__FindFree(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ int            order)
+{
+    int words = __WORDS_AT_ORDER(buddy, order);
+    for (int i = buddy->word_hint[order]; i < words; i++) {
+        uint64_t word = buddy->bitmaps[order][i];
+        if (word) {
+            buddy->word_hint[order] = i;
+            return (i * 64) + __builtin_ctzll(word);
+        }
+    }
+    return -1;
+}
+
+static void
+__FreeBlock(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ int            order,
+        _In_ int            index)
+{
+    // Merge with the buddy as long as it is free. When both the block and its buddy
+    // exist at this order, the parent will also exist at the next order.
+    while (order < MEMORY_BUDDY_MAX_ORDER) {
+        int buddyIndex = index ^ 1;
+        if (buddyIndex >= __BLOCKS_AT_ORDER(buddy, order) || !__IsFree(buddy, order, buddyIndex)) {
+            break;
+        }
+        __MarkUsed(buddy, order, buddyIndex);
+        index >>= 1;
+        order++;
+    }
+    __MarkFree(buddy, order, index);
+}
+
+void
+MemoryBuddyFree(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ uintptr_t      address,
+        _In_ int            blockCount)
+{
+    int index;
+    TRACE("MemoryBuddyFree(address=0x%" PRIxIN ", blockCount=%i)", address, blockCount);
+
+    assert(buddy != NULL);
+    assert(MemoryBuddyContains(buddy, address));
+    assert(MemoryBuddyContains(buddy, address + ((blockCount - 1) * buddy->block_size)));
+
+    index = (int)((address - buddy->base) / buddy->block_size);
+    buddy->blocks_free += blockCount;
+
+    // Split the range into the largest naturally aligned blocks that fit
+    while (blockCount) {
+        int order = MEMORY_BUDDY_MAX_ORDER;
+        while (order && ((index & ((1 << order) - 1)) || (1 << order) > blockCount ||
+                         (index >> order) >= __BLOCKS_AT_ORDER(buddy, order))) {
+            order--;
+        }
+        __FreeBlock(buddy, order, index >> order);
+        index      += (1 << order);
+        blockCount -= (1 << order);
+    }
+}
+
+oserr_t
+MemoryBuddyAllocate(
+        _In_  MemoryBuddy_t* buddy,
+        _In_  int            blockCount,
+        _Out_ uintptr_t*     addressOut)
+{
+    int order = 0;
+    int currentOrder;
+    int index;
+    TRACE("MemoryBuddyAllocate(blockCount=%i)", blockCount);
+
+    assert(buddy != NULL);
+    assert(blockCount != 0);
+    assert(addressOut != NULL);
+
+    while ((1 << order) < blockCount) {
+        order++;
+    }
+    if (order > MEMORY_BUDDY_MAX_ORDER) {
+        return OS_EOOM;
+    }
+
+    currentOrder = order;
+    while (currentOrder <= MEMORY_BUDDY_MAX_ORDER && !buddy->free_count[currentOrder]) {
+        currentOrder++;
+    }
+    if (currentOrder > MEMORY_BUDDY_MAX_ORDER) {
+        return OS_EOOM;
+    }
+
+    index = __FindFree(buddy, currentOrder);
+    assert(index != -1);
+    __MarkUsed(buddy, currentOrder, index);
+
+    // Split the block down to the requested order, keeping the lower half
+    while (currentOrder > order) {
+        currentOrder--;
+        index <<= 1;
+        __MarkFree(buddy, currentOrder, index + 1);
+    }
+
+    *addressOut = buddy->base + (((uintptr_t)index << order) * buddy->block_size);
+    buddy->blocks_free -= (1 << order);
+
+    // Give back the tail that was only needed to round up to a power of two
+    if ((1 << order) > blockCount) {
+        MemoryBuddyFree(
+                buddy,
+                *addressOut + (blockCount * buddy->block_size),
+                (1 << order) - blockCount
+        );
+    }
+    return OS_EOK;
+}
+
+bool
+MemoryBuddyContains(
+        _In_ MemoryBuddy_t* buddy,
+        _In_ uintptr_t      address)
+{
+    assert(buddy != NULL);
+    return address >= buddy->base &&
+           address < (buddy->base + (buddy->block_count * buddy->block_size));
+}
+
+int
+MemoryBuddyLargestFreeOrder(
+        _In_ MemoryBuddy_t* buddy)
+{
+    assert(buddy != NULL);
+    for (int i = MEMORY_BUDDY_MAX_ORDER; i >= 0; i--) {
+        if (buddy->free_count[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
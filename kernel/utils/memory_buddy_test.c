@@ -0,0 +1,307 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <utils/memory_buddy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The buddy allocator never touches the memory it manages, so any
+// address can be used for the zone.
+#define PAGE_SIZE   0x1000
+#define ZONE_BASE   0x40000000
+#define ZONE_PAGES  16384
+#define MAX_BLOCK   (1 << MEMORY_BUDDY_MAX_ORDER)
+
+static struct __TestContext {
+    MemoryBuddy_t Buddy;
+    uint64_t      Storage[MEMORY_BUDDY_STORAGE_WORDS(ZONE_PAGES)];
+} g_testContext;
+
+struct __Allocation {
+    uintptr_t Address;
+    int       PageCount;
+};
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+    MemoryBuddyConstruct(&g_testContext.Buddy, ZONE_BASE, PAGE_SIZE, ZONE_PAGES, &g_testContext.Storage[0]);
+    MemoryBuddyFree(&g_testContext.Buddy, ZONE_BASE, ZONE_PAGES);
+    return 0;
+}
+
+// Simple LCG, so the benchmarks are reproducible
+static unsigned int
+__Random(unsigned int* seed)
+{
+    *seed = (*seed * 1103515245U) + 12345U;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+void TestMemoryBuddy_Construct(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    (void)state;
+
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], ZONE_PAGES / MAX_BLOCK);
+    for (int i = 0; i < MEMORY_BUDDY_MAX_ORDER; i++) {
+        assert_int_equal(buddy->free_count[i], 0);
+    }
+    assert_int_equal(MemoryBuddyLargestFreeOrder(buddy), MEMORY_BUDDY_MAX_ORDER);
+    assert_true(MemoryBuddyContains(buddy, ZONE_BASE));
+    assert_true(MemoryBuddyContains(buddy, ZONE_BASE + ((ZONE_PAGES - 1) * PAGE_SIZE)));
+    assert_false(MemoryBuddyContains(buddy, ZONE_BASE + (ZONE_PAGES * PAGE_SIZE)));
+    assert_false(MemoryBuddyContains(buddy, ZONE_BASE - PAGE_SIZE));
+}
+
+void TestMemoryBuddy_AllocateSplitsAndCoalesces(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    uintptr_t      address;
+    (void)state;
+
+    // A single page splits one of the largest blocks all the way down
+    assert_int_equal(MemoryBuddyAllocate(buddy, 1, &address), OS_EOK);
+    assert_int_equal(address, ZONE_BASE);
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES - 1);
+    for (int i = 0; i < MEMORY_BUDDY_MAX_ORDER; i++) {
+        assert_int_equal(buddy->free_count[i], 1);
+    }
+
+    // Freeing it merges everything back together
+    MemoryBuddyFree(buddy, address, 1);
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], ZONE_PAGES / MAX_BLOCK);
+    for (int i = 0; i < MEMORY_BUDDY_MAX_ORDER; i++) {
+        assert_int_equal(buddy->free_count[i], 0);
+    }
+}
+
+void TestMemoryBuddy_AllocateIsAligned(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    uintptr_t      single, eight, three;
+    (void)state;
+
+    assert_int_equal(MemoryBuddyAllocate(buddy, 1, &single), OS_EOK);
+    assert_int_equal(MemoryBuddyAllocate(buddy, 8, &eight), OS_EOK);
+    assert_int_equal((eight - ZONE_BASE) % (8 * PAGE_SIZE), 0);
+
+    // Three pages are taken from a block of four, and the last page is given back
+    assert_int_equal(MemoryBuddyAllocate(buddy, 3, &three), OS_EOK);
+    assert_int_equal((three - ZONE_BASE) % (4 * PAGE_SIZE), 0);
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES - 12);
+
+    MemoryBuddyFree(buddy, three, 3);
+    MemoryBuddyFree(buddy, eight, 8);
+    MemoryBuddyFree(buddy, single, 1);
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], ZONE_PAGES / MAX_BLOCK);
+}
+
+void TestMemoryBuddy_AllocateTooLarge(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    uintptr_t      address;
+    (void)state;
+
+    assert_int_equal(MemoryBuddyAllocate(buddy, MAX_BLOCK + 1, &address), OS_EOOM);
+    assert_int_equal(MemoryBuddyAllocate(buddy, MAX_BLOCK, &address), OS_EOK);
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES - MAX_BLOCK);
+}
+
+void TestMemoryBuddy_Exhaustion(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    uintptr_t*     pages = malloc(sizeof(uintptr_t) * ZONE_PAGES);
+    uintptr_t      address;
+    (void)state;
+
+    assert_non_null(pages);
+    for (int i = 0; i < ZONE_PAGES; i++) {
+        assert_int_equal(MemoryBuddyAllocate(buddy, 1, &pages[i]), OS_EOK);
+    }
+    assert_int_equal(buddy->blocks_free, 0);
+    assert_int_equal(MemoryBuddyAllocate(buddy, 1, &address), OS_EOOM);
+    assert_int_equal(MemoryBuddyLargestFreeOrder(buddy), -1);
+
+    // Free them in reverse, so the buddies are merged in another order
+    // than they were split
+    for (int i = ZONE_PAGES - 1; i >= 0; i--) {
+        MemoryBuddyFree(buddy, pages[i], 1);
+    }
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], ZONE_PAGES / MAX_BLOCK);
+    free(pages);
+}
+
+void TestMemoryBuddy_FreeUnalignedRange(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    uintptr_t      address;
+    (void)state;
+
+    // Start out empty, and add a range that is missing the first page
+    MemoryBuddyConstruct(buddy, ZONE_BASE, PAGE_SIZE, MAX_BLOCK, &g_testContext.Storage[0]);
+    MemoryBuddyFree(buddy, ZONE_BASE + PAGE_SIZE, MAX_BLOCK - 1);
+    assert_int_equal(buddy->blocks_free, MAX_BLOCK - 1);
+    for (int i = 0; i < MEMORY_BUDDY_MAX_ORDER; i++) {
+        assert_int_equal(buddy->free_count[i], 1);
+    }
+
+    assert_int_equal(MemoryBuddyAllocate(buddy, MAX_BLOCK, &address), OS_EOOM);
+    assert_int_equal(MemoryBuddyAllocate(buddy, MAX_BLOCK / 2, &address), OS_EOK);
+    assert_int_equal(address, ZONE_BASE + ((MAX_BLOCK / 2) * PAGE_SIZE));
+
+    // Giving back the missing page completes the block
+    MemoryBuddyFree(buddy, address, MAX_BLOCK / 2);
+    MemoryBuddyFree(buddy, ZONE_BASE, 1);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], 1);
+}
+
+void TestMemoryBuddy_PartialBlockAtEnd(void** state)
+{
+    MemoryBuddy_t* buddy = &g_testContext.Buddy;
+    uintptr_t      address;
+    (void)state;
+
+    // A zone that is not a multiple of the largest block, the tail can
+    // never be merged into a block of the largest order.
+    MemoryBuddyConstruct(buddy, ZONE_BASE, PAGE_SIZE, MAX_BLOCK + 3, &g_testContext.Storage[0]);
+    MemoryBuddyFree(buddy, ZONE_BASE, MAX_BLOCK + 3);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], 1);
+    assert_int_equal(buddy->free_count[1], 1);
+    assert_int_equal(buddy->free_count[0], 1);
+
+    assert_int_equal(MemoryBuddyAllocate(buddy, 4, &address), OS_EOK);
+    assert_int_equal(address, ZONE_BASE);
+    MemoryBuddyFree(buddy, address, 4);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], 1);
+    assert_int_equal(buddy->blocks_free, MAX_BLOCK + 3);
+}
+
+void TestMemoryBuddy_FragmentationBenchmark(void** state)
+{
+    MemoryBuddy_t*       buddy       = &g_testContext.Buddy;
+    const int            maxLive     = 2048;
+    const int            iterations  = 1000000;
+    struct __Allocation* allocations = calloc(maxLive, sizeof(struct __Allocation));
+    unsigned int         seed        = 1;
+    int                  failures    = 0;
+    size_t               pagesInUse  = 0;
+    size_t               worstFree   = ZONE_PAGES;
+    (void)state;
+
+    assert_non_null(allocations);
+
+    // Random mix of driver sized buffers between 1 and 64 pages, with up to
+    // half of the zone in use at any time.
+    for (int i = 0; i < iterations; i++) {
+        struct __Allocation* allocation = &allocations[__Random(&seed) % maxLive];
+        if (allocation->Address) {
+            MemoryBuddyFree(buddy, allocation->Address, allocation->PageCount);
+            pagesInUse -= allocation->PageCount;
+            allocation->Address = 0;
+            continue;
+        }
+
+        allocation->PageCount = (int)(__Random(&seed) % 64) + 1;
+        if (pagesInUse + allocation->PageCount > ZONE_PAGES / 2) {
+            continue;
+        }
+        if (MemoryBuddyAllocate(buddy, allocation->PageCount, &allocation->Address) != OS_EOK) {
+            allocation->Address = 0;
+            failures++;
+            continue;
+        }
+        pagesInUse += allocation->PageCount;
+        if (buddy->blocks_free < worstFree) {
+            worstFree = buddy->blocks_free;
+        }
+    }
+
+    // Report how much of the free memory is still available as the largest blocks
+    printf("fragmentation: %zu pages in use, %zu free, %i%% free as %i page blocks, largest order %i, %i failures\n",
+           pagesInUse, buddy->blocks_free,
+           (int)((buddy->free_count[MEMORY_BUDDY_MAX_ORDER] * MAX_BLOCK * 100) / buddy->blocks_free),
+           MAX_BLOCK, MemoryBuddyLargestFreeOrder(buddy), failures);
+    assert_int_equal(buddy->blocks_free + pagesInUse, ZONE_PAGES);
+    assert_int_equal(failures, 0);
+
+    // Everything must coalesce back once all is freed
+    for (int i = 0; i < maxLive; i++) {
+        if (allocations[i].Address) {
+            MemoryBuddyFree(buddy, allocations[i].Address, allocations[i].PageCount);
+        }
+    }
+    assert_int_equal(buddy->blocks_free, ZONE_PAGES);
+    assert_int_equal(buddy->free_count[MEMORY_BUDDY_MAX_ORDER], ZONE_PAGES / MAX_BLOCK);
+    free(allocations);
+}
+
+static double
+__RunThroughput(int pageCount, int iterations)
+{
+    MemoryBuddy_t*  buddy = &g_testContext.Buddy;
+    uintptr_t       addresses[64];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        for (int j = 0; j < 64; j++) {
+            assert_int_equal(MemoryBuddyAllocate(buddy, pageCount, &addresses[j]), OS_EOK);
+        }
+        for (int j = 0; j < 64; j++) {
+            MemoryBuddyFree(buddy, addresses[j], pageCount);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+void TestMemoryBuddy_ThroughputBenchmark(void** state)
+{
+    const int sizes[]    = { 1, 4, 16, 64 };
+    const int iterations = 20000;
+    (void)state;
+
+    for (int i = 0; i < 4; i++) {
+        double elapsed = __RunThroughput(sizes[i], iterations);
+        printf("throughput: %2i pages, %.0f ops/s\n", sizes[i], (iterations * 64 * 2) / elapsed);
+        assert_int_equal(g_testContext.Buddy.blocks_free, ZONE_PAGES);
+    }
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestMemoryBuddy_Construct, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_AllocateSplitsAndCoalesces, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_AllocateIsAligned, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_AllocateTooLarge, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_Exhaustion, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_FreeUnalignedRange, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_PartialBlockAtEnd, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_FragmentationBenchmark, SetupTest),
+            cmocka_unit_test_setup(TestMemoryBuddy_ThroughputBenchmark, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,932 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Datastructure (Memory Range)
+ * - Every allocated range is a node in two red-black trees. The address tree is ordered by
+ *   the start of the range and keeps the largest gap of each subtree, which lets first-fit
+ *   skip every subtree without a large enough gap. The gap tree is ordered by the size of
+ *   the gap in front of the range, which makes best-fit a lower bound search. The free space
+ *   after the last range is held by a zero-length node at the end, so every gap belongs to
+ *   exactly one node.
+ */
+
+#include <assert.h>
+#include <heap.h>
+#include <utils/memory_range.h>
+#include <string.h>
+
+#define COLOR_BLACK 0
+#define COLOR_RED   1
+
+#define ADDRESS_TREE 0
+#define GAP_TREE     1
+
+#define NODE_NIL(range)          (&(range)->Nil)
+#define IS_NODE_NIL(range, node) ((node) == NODE_NIL(range))
+
+#define PARENT(node, tree) ((node)->Links[tree].Parent)
+#define LEFT(node, tree)   ((node)->Links[tree].Left)
+#define RIGHT(node, tree)  ((node)->Links[tree].Right)
+#define COLOR(node, tree)  ((node)->Links[tree].Color)
+
+#define GAP_START(node) ((node)->Start - (node)->Gap)
+
+static bool
+__Less(
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node,
+        _In_ MemoryRangeNode_t* other)
+{
+    // Gaps of equal size are ordered by address, so best-fit prefers lower addresses
+    if (tree == GAP_TREE && node->Gap != other->Gap) {
+        return node->Gap < other->Gap;
+    }
+    return node->Start < other->Start;
+}
+
+static void
+__UpdateMaxGap(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* node)
+{
+    // The nil node has a max gap of zero, so it needs no special casing
+    size_t maxGap = node->Gap;
+    (void)range;
+
+    if (LEFT(node, ADDRESS_TREE)->MaxGap > maxGap) {
+        maxGap = LEFT(node, ADDRESS_TREE)->MaxGap;
+    }
+    if (RIGHT(node, ADDRESS_TREE)->MaxGap > maxGap) {
+        maxGap = RIGHT(node, ADDRESS_TREE)->MaxGap;
+    }
+    node->MaxGap = maxGap;
+}
+
+static void
+__UpdateMaxGapToRoot(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* node)
+{
+    while (!IS_NODE_NIL(range, node)) {
+        __UpdateMaxGap(range, node);
+        node = PARENT(node, ADDRESS_TREE);
+    }
+}
+
+static void
+__ReplaceChild(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node,
+        _In_ MemoryRangeNode_t* with)
+{
+    MemoryRangeNode_t* parent = PARENT(node, tree);
+    if (IS_NODE_NIL(range, parent)) {
+        range->Roots[tree] = with;
+    } else if (node == LEFT(parent, tree)) {
+        LEFT(parent, tree) = with;
+    } else {
+        RIGHT(parent, tree) = with;
+    }
+    PARENT(with, tree) = parent;
+}
+
+static void
+__RotateLeft(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* right = RIGHT(node, tree);
+
+    RIGHT(node, tree) = LEFT(right, tree);
+    if (!IS_NODE_NIL(range, LEFT(right, tree))) {
+        PARENT(LEFT(right, tree), tree) = node;
+    }
+    __ReplaceChild(range, tree, node, right);
+    LEFT(right, tree)  = node;
+    PARENT(node, tree) = right;
+
+    if (tree == ADDRESS_TREE) {
+        __UpdateMaxGap(range, node);
+        __UpdateMaxGap(range, right);
+    }
+}
+
+static void
+__RotateRight(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* left = LEFT(node, tree);
+
+    LEFT(node, tree) = RIGHT(left, tree);
+    if (!IS_NODE_NIL(range, RIGHT(left, tree))) {
+        PARENT(RIGHT(left, tree), tree) = node;
+    }
+    __ReplaceChild(range, tree, node, left);
+    RIGHT(left, tree)  = node;
+    PARENT(node, tree) = left;
+
+    if (tree == ADDRESS_TREE) {
+        __UpdateMaxGap(range, node);
+        __UpdateMaxGap(range, left);
+    }
+}
+
+static void
+__InsertFixup(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* i = node;
+
+    while (COLOR(PARENT(i, tree), tree) == COLOR_RED) {
+        MemoryRangeNode_t* parent      = PARENT(i, tree);
+        MemoryRangeNode_t* grandParent = PARENT(parent, tree);
+        MemoryRangeNode_t* uncle;
+
+        if (parent == LEFT(grandParent, tree)) {
+            uncle = RIGHT(grandParent, tree);
+            if (COLOR(uncle, tree) == COLOR_RED) {
+                COLOR(parent, tree)      = COLOR_BLACK;
+                COLOR(uncle, tree)       = COLOR_BLACK;
+                COLOR(grandParent, tree) = COLOR_RED;
+                i = grandParent;
+                continue;
+            }
+
+            // Check if double rotation is required
+            if (i == RIGHT(parent, tree)) {
+                i = parent;
+                __RotateLeft(range, tree, i);
+            }
+
+            COLOR(PARENT(i, tree), tree)               = COLOR_BLACK;
+            COLOR(PARENT(PARENT(i, tree), tree), tree) = COLOR_RED;
+            __RotateRight(range, tree, PARENT(PARENT(i, tree), tree));
+        } else {
+            uncle = LEFT(grandParent, tree);
+            if (COLOR(uncle, tree) == COLOR_RED) {
+                COLOR(parent, tree)      = COLOR_BLACK;
+                COLOR(uncle, tree)       = COLOR_BLACK;
+                COLOR(grandParent, tree) = COLOR_RED;
+                i = grandParent;
+                continue;
+            }
+
+            // Check if double rotation is required
+            if (i == LEFT(parent, tree)) {
+                i = parent;
+                __RotateRight(range, tree, i);
+            }
+
+            COLOR(PARENT(i, tree), tree)               = COLOR_BLACK;
+            COLOR(PARENT(PARENT(i, tree), tree), tree) = COLOR_RED;
+            __RotateLeft(range, tree, PARENT(PARENT(i, tree), tree));
+        }
+    }
+    COLOR(range->Roots[tree], tree) = COLOR_BLACK;
+}
+
+static void
+__Insert(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* parent = NODE_NIL(range);
+    MemoryRangeNode_t* i      = range->Roots[tree];
+
+    LEFT(node, tree)  = NODE_NIL(range);
+    RIGHT(node, tree) = NODE_NIL(range);
+    COLOR(node, tree) = COLOR_RED;
+    if (tree == ADDRESS_TREE) {
+        node->MaxGap = node->Gap;
+    }
+
+    // The gap of the new node is included in the maximum of all the nodes passed
+    while (!IS_NODE_NIL(range, i)) {
+        parent = i;
+        if (tree == ADDRESS_TREE && node->Gap > i->MaxGap) {
+            i->MaxGap = node->Gap;
+        }
+        i = __Less(tree, node, i) ? LEFT(i, tree) : RIGHT(i, tree);
+    }
+
+    PARENT(node, tree) = parent;
+    if (IS_NODE_NIL(range, parent)) {
+        range->Roots[tree] = node;
+    } else if (__Less(tree, node, parent)) {
+        LEFT(parent, tree) = node;
+    } else {
+        RIGHT(parent, tree) = node;
+    }
+    __InsertFixup(range, tree, node);
+}
+
+static MemoryRangeNode_t*
+__Minimum(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* i = node;
+    while (!IS_NODE_NIL(range, LEFT(i, tree))) {
+        i = LEFT(i, tree);
+    }
+    return i;
+}
+
+static MemoryRangeNode_t*
+__Next(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* i = node;
+
+    if (!IS_NODE_NIL(range, RIGHT(i, tree))) {
+        return __Minimum(range, tree, RIGHT(i, tree));
+    }
+
+    while (!IS_NODE_NIL(range, PARENT(i, tree)) && i == RIGHT(PARENT(i, tree), tree)) {
+        i = PARENT(i, tree);
+    }
+    return IS_NODE_NIL(range, PARENT(i, tree)) ? NULL : PARENT(i, tree);
+}
+
+static void
+__RemoveFixup(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* i = node;
+
+    while (i != range->Roots[tree] && COLOR(i, tree) == COLOR_BLACK) {
+        MemoryRangeNode_t* sibling;
+        if (i == LEFT(PARENT(i, tree), tree)) {
+            sibling = RIGHT(PARENT(i, tree), tree);
+            if (COLOR(sibling, tree) == COLOR_RED) {
+                COLOR(sibling, tree)         = COLOR_BLACK;
+                COLOR(PARENT(i, tree), tree) = COLOR_RED;
+                __RotateLeft(range, tree, PARENT(i, tree));
+                sibling = RIGHT(PARENT(i, tree), tree);
+            }
+
+            if (COLOR(LEFT(sibling, tree), tree) == COLOR_BLACK &&
+                COLOR(RIGHT(sibling, tree), tree) == COLOR_BLACK) {
+                COLOR(sibling, tree) = COLOR_RED;
+                i = PARENT(i, tree);
+                continue;
+            }
+
+            if (COLOR(RIGHT(sibling, tree), tree) == COLOR_BLACK) {
+                COLOR(LEFT(sibling, tree), tree) = COLOR_BLACK;
+                COLOR(sibling, tree)             = COLOR_RED;
+                __RotateRight(range, tree, sibling);
+                sibling = RIGHT(PARENT(i, tree), tree);
+            }
+
+            COLOR(sibling, tree)              = COLOR(PARENT(i, tree), tree);
+            COLOR(PARENT(i, tree), tree)      = COLOR_BLACK;
+            COLOR(RIGHT(sibling, tree), tree) = COLOR_BLACK;
+            __RotateLeft(range, tree, PARENT(i, tree));
+            i = range->Roots[tree];
+        } else {
+            sibling = LEFT(PARENT(i, tree), tree);
+            if (COLOR(sibling, tree) == COLOR_RED) {
+                COLOR(sibling, tree)         = COLOR_BLACK;
+                COLOR(PARENT(i, tree), tree) = COLOR_RED;
+                __RotateRight(range, tree, PARENT(i, tree));
+                sibling = LEFT(PARENT(i, tree), tree);
+            }
+
+            if (COLOR(RIGHT(sibling, tree), tree) == COLOR_BLACK &&
+                COLOR(LEFT(sibling, tree), tree) == COLOR_BLACK) {
+                COLOR(sibling, tree) = COLOR_RED;
+                i = PARENT(i, tree);
+                continue;
+            }
+
+            if (COLOR(LEFT(sibling, tree), tree) == COLOR_BLACK) {
+                COLOR(RIGHT(sibling, tree), tree) = COLOR_BLACK;
+                COLOR(sibling, tree)              = COLOR_RED;
+                __RotateLeft(range, tree, sibling);
+                sibling = LEFT(PARENT(i, tree), tree);
+            }
+
+            COLOR(sibling, tree)             = COLOR(PARENT(i, tree), tree);
+            COLOR(PARENT(i, tree), tree)     = COLOR_BLACK;
+            COLOR(LEFT(sibling, tree), tree) = COLOR_BLACK;
+            __RotateRight(range, tree, PARENT(i, tree));
+            i = range->Roots[tree];
+        }
+    }
+    COLOR(i, tree) = COLOR_BLACK;
+}
+
+static void
+__Remove(
+        _In_ MemoryRange_t*     range,
+        _In_ int                tree,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* replacement = node;
+    MemoryRangeNode_t* child;
+    int                removedColor = COLOR(node, tree);
+
+    // The nil node is used as a regular leaf while removing, so its parent
+    // may be pointed to the removed position.
+    if (IS_NODE_NIL(range, LEFT(node, tree))) {
+        child = RIGHT(node, tree);
+        __ReplaceChild(range, tree, node, child);
+    } else if (IS_NODE_NIL(range, RIGHT(node, tree))) {
+        child = LEFT(node, tree);
+        __ReplaceChild(range, tree, node, child);
+    } else {
+        replacement  = __Minimum(range, tree, RIGHT(node, tree));
+        removedColor = COLOR(replacement, tree);
+        child        = RIGHT(replacement, tree);
+        if (PARENT(replacement, tree) == node) {
+            PARENT(child, tree) = replacement;
+        } else {
+            __ReplaceChild(range, tree, replacement, child);
+            RIGHT(replacement, tree) = RIGHT(node, tree);
+            PARENT(RIGHT(replacement, tree), tree) = replacement;
+        }
+        __ReplaceChild(range, tree, node, replacement);
+        LEFT(replacement, tree) = LEFT(node, tree);
+        PARENT(LEFT(replacement, tree), tree) = replacement;
+        COLOR(replacement, tree) = COLOR(node, tree);
+    }
+
+    // Every node from where the tree changed and up has lost a gap from its subtree
+    if (tree == ADDRESS_TREE) {
+        __UpdateMaxGapToRoot(range, PARENT(child, tree));
+    }
+    if (removedColor == COLOR_BLACK) {
+        __RemoveFixup(range, tree, child);
+    }
+    PARENT(NODE_NIL(range), tree) = NULL;
+}
+
+static void
+__SetGap(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* node,
+        _In_ size_t             gap)
+{
+    // The gap is the key of the gap tree, so the node must be moved in it
+    __Remove(range, GAP_TREE, node);
+    node->Gap = gap;
+    __Insert(range, GAP_TREE, node);
+    __UpdateMaxGapToRoot(range, node);
+}
+
+// Determines where an allocation would start in the gap in front of the node, if it fits.
+static bool
+__Fits(
+        _In_  MemoryRangeNode_t* node,
+        _In_  size_t             length,
+        _In_  size_t             alignment,
+        _Out_ uintptr_t*         startOut)
+{
+    uintptr_t gapStart = GAP_START(node);
+    uintptr_t start    = (gapStart + (alignment - 1)) & ~(alignment - 1);
+
+    if (start < gapStart || start > node->Start || (node->Start - start) < length) {
+        return false;
+    }
+    *startOut = start;
+    return true;
+}
+
+// Finds the lowest gap the allocation fits in. Subtrees without a large enough gap are
+// skipped entirely, so this is logarithmic unless many gaps are large enough but misaligned.
+static MemoryRangeNode_t*
+__FindFirstFit(
+        _In_  MemoryRange_t*     range,
+        _In_  MemoryRangeNode_t* node,
+        _In_  size_t             length,
+        _In_  size_t             alignment,
+        _Out_ uintptr_t*         startOut)
+{
+    MemoryRangeNode_t* result;
+
+    if (IS_NODE_NIL(range, node) || node->MaxGap < length) {
+        return NULL;
+    }
+
+    result = __FindFirstFit(range, LEFT(node, ADDRESS_TREE), length, alignment, startOut);
+    if (result) {
+        return result;
+    }
+
+    if (__Fits(node, length, alignment, startOut)) {
+        return node;
+    }
+    return __FindFirstFit(range, RIGHT(node, ADDRESS_TREE), length, alignment, startOut);
+}
+
+static MemoryRangeNode_t*
+__FindBestFit(
+        _In_  MemoryRange_t* range,
+        _In_  size_t         length,
+        _In_  size_t         alignment,
+        _Out_ uintptr_t*     startOut)
+{
+    MemoryRangeNode_t* best = NULL;
+    MemoryRangeNode_t* i    = range->Roots[GAP_TREE];
+
+    while (!IS_NODE_NIL(range, i)) {
+        if (i->Gap >= length) {
+            best = i;
+            i = LEFT(i, GAP_TREE);
+        } else {
+            i = RIGHT(i, GAP_TREE);
+        }
+    }
+
+    // A gap that is large enough may still be too small once aligned, in which case
+    // the next larger gaps are tried.
+    while (best && !__Fits(best, length, alignment, startOut)) {
+        best = __Next(range, GAP_TREE, best);
+    }
+    return best;
+}
+
+// Finds the node with the lowest start above the address, which is the node that
+// owns the gap the address is in, if it is free.
+static MemoryRangeNode_t*
+__FindAbove(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address)
+{
+    MemoryRangeNode_t* result = NULL;
+    MemoryRangeNode_t* i      = range->Roots[ADDRESS_TREE];
+
+    while (!IS_NODE_NIL(range, i)) {
+        if (i->Start > address) {
+            result = i;
+            i = LEFT(i, ADDRESS_TREE);
+        } else {
+            i = RIGHT(i, ADDRESS_TREE);
+        }
+    }
+    return result;
+}
+
+// Finds the range with the highest start at or below the address, which is the
+// range that contains the address if it is allocated.
+static MemoryRangeNode_t*
+__FindBelow(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address)
+{
+    MemoryRangeNode_t* result = NULL;
+    MemoryRangeNode_t* i      = range->Roots[ADDRESS_TREE];
+
+    while (!IS_NODE_NIL(range, i)) {
+        if (i->Start <= address) {
+            result = i;
+            i = RIGHT(i, ADDRESS_TREE);
+        } else {
+            i = LEFT(i, ADDRESS_TREE);
+        }
+    }
+    return result;
+}
+
+static MemoryRangeNode_t*
+__Find(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address)
+{
+    MemoryRangeNode_t* i = range->Roots[ADDRESS_TREE];
+
+    while (!IS_NODE_NIL(range, i)) {
+        if (address == i->Start) {
+            return i;
+        }
+        i = (address < i->Start) ? LEFT(i, ADDRESS_TREE) : RIGHT(i, ADDRESS_TREE);
+    }
+    return NULL;
+}
+
+// Splits the gap in front of <owner> by placing <node> at [start, start + length).
+static void
+__Place(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* owner,
+        _In_ MemoryRangeNode_t* node,
+        _In_ uintptr_t          start,
+        _In_ size_t             length)
+{
+    node->Start  = start;
+    node->Length = length;
+    node->Gap    = start - GAP_START(owner);
+
+    __SetGap(range, owner, owner->Start - (start + length));
+    __Insert(range, ADDRESS_TREE, node);
+    __Insert(range, GAP_TREE, node);
+    range->Count++;
+    range->BytesAllocated += length;
+}
+
+static oserr_t
+__Reserve(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* node,
+        _In_ uintptr_t          address,
+        _In_ size_t             length)
+{
+    MemoryRangeNode_t* owner;
+
+    if (address < range->StartAddress || address > range->End.Start ||
+        (range->End.Start - address) < length) {
+        return OS_EINVALPARAMS;
+    }
+
+    owner = __FindAbove(range, address);
+    if (!owner || GAP_START(owner) > address || (owner->Start - address) < length) {
+        return OS_EEXISTS;
+    }
+
+    __Place(range, owner, node, address, length);
+    return OS_EOK;
+}
+
+static void
+__Reset(
+        _In_ MemoryRange_t* range)
+{
+    memset(NODE_NIL(range), 0, sizeof(MemoryRangeNode_t));
+    COLOR(NODE_NIL(range), ADDRESS_TREE) = COLOR_BLACK;
+    COLOR(NODE_NIL(range), GAP_TREE)     = COLOR_BLACK;
+    range->Roots[ADDRESS_TREE] = NODE_NIL(range);
+    range->Roots[GAP_TREE]     = NODE_NIL(range);
+    range->Count               = 0;
+    range->BytesAllocated      = 0;
+
+    memset(&range->End, 0, sizeof(MemoryRangeNode_t));
+    range->End.Start = range->StartAddress + range->Length;
+    range->End.Gap   = range->Length;
+    __Insert(range, ADDRESS_TREE, &range->End);
+    __Insert(range, GAP_TREE, &range->End);
+}
+
+static void
+__DestroyNodes(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* node)
+{
+    if (IS_NODE_NIL(range, node)) {
+        return;
+    }
+
+    __DestroyNodes(range, LEFT(node, ADDRESS_TREE));
+    __DestroyNodes(range, RIGHT(node, ADDRESS_TREE));
+    if (node != &range->End) {
+        kfree(node);
+    }
+}
+
+void
+MemoryRangeConstruct(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      startAddress,
+        _In_ size_t         length,
+        _In_ size_t         granularity)
+{
+    assert(range != NULL);
+    assert(granularity != 0 && (granularity & (granularity - 1)) == 0);
+
+    // The end node starts right after the range, so it must not wrap
+    assert(startAddress + length >= startAddress);
+
+    range->StartAddress = startAddress;
+    range->Length       = length;
+    range->Granularity  = granularity;
+    SpinlockConstruct(&range->SyncObject);
+    __Reset(range);
+}
+
+void
+MemoryRangeDestroy(
+        _In_ MemoryRange_t* range)
+{
+    assert(range != NULL);
+    __DestroyNodes(range, range->Roots[ADDRESS_TREE]);
+    range->Roots[ADDRESS_TREE] = NODE_NIL(range);
+    range->Roots[GAP_TREE]     = NODE_NIL(range);
+    range->Count               = 0;
+    range->BytesAllocated      = 0;
+}
+
+oserr_t
+MemoryRangeClone(
+        _In_ MemoryRange_t* range,
+        _In_ MemoryRange_t* clone)
+{
+    MemoryRangeNode_t* nodes     = NULL;
+    int                nodeCount = 0;
+    int                count;
+    MemoryRangeNode_t* i;
+    oserr_t            oserr = OS_EOK;
+
+    assert(range != NULL);
+    assert(clone != NULL);
+
+    MemoryRangeConstruct(clone, range->StartAddress, range->Length, range->Granularity);
+
+    // The heap must not be called with the allocator locked, so the nodes for the copy
+    // are allocated up front, and again if ranges were added in the meantime. The spare
+    // nodes are kept in a list through their parent link.
+    SpinlockAcquireIrq(&range->SyncObject);
+    count = range->Count;
+    while (nodeCount < count) {
+        SpinlockReleaseIrq(&range->SyncObject);
+        for (; nodeCount < count; nodeCount++) {
+            MemoryRangeNode_t* node = kmalloc(sizeof(MemoryRangeNode_t));
+            if (!node) {
+                oserr = OS_EOOM;
+                goto exit;
+            }
+            PARENT(node, ADDRESS_TREE) = nodes;
+            nodes = node;
+        }
+        SpinlockAcquireIrq(&range->SyncObject);
+        count = range->Count;
+    }
+
+    i = __Minimum(range, ADDRESS_TREE, range->Roots[ADDRESS_TREE]);
+    while (i && i != &range->End) {
+        MemoryRangeNode_t* node = nodes;
+        nodes = PARENT(node, ADDRESS_TREE);
+        nodeCount--;
+
+        // The source ranges do not overlap, so they always fit in the clone
+        oserr = __Reserve(clone, node, i->Start, i->Length);
+        assert(oserr == OS_EOK);
+        i = __Next(range, ADDRESS_TREE, i);
+    }
+    SpinlockReleaseIrq(&range->SyncObject);
+
+exit:
+    // Ranges may have been freed since they were counted
+    while (nodes) {
+        MemoryRangeNode_t* node = nodes;
+        nodes = PARENT(node, ADDRESS_TREE);
+        kfree(node);
+    }
+
+    if (oserr != OS_EOK) {
+        MemoryRangeDestroy(clone);
+        __Reset(clone);
+    }
+    return oserr;
+}
+
+oserr_t
+MemoryRangeAllocate(
+        _In_  MemoryRange_t*      range,
+        _In_  size_t              length,
+        _In_  size_t              alignment,
+        _In_  enum MemoryRangeFit fit,
+        _Out_ uintptr_t*          addressOut)
+{
+    MemoryRangeNode_t* node;
+    MemoryRangeNode_t* owner;
+    uintptr_t          start;
+
+    assert(range != NULL);
+    assert(addressOut != NULL);
+    assert((alignment & (alignment - 1)) == 0);
+
+    if (!length) {
+        return OS_EINVALPARAMS;
+    }
+
+    length = (length + (range->Granularity - 1)) & ~(range->Granularity - 1);
+    if (alignment < range->Granularity) {
+        alignment = range->Granularity;
+    }
+
+    // The heap must not be called with the allocator locked
+    node = kmalloc(sizeof(MemoryRangeNode_t));
+    if (!node) {
+        return OS_EOOM;
+    }
+
+    SpinlockAcquireIrq(&range->SyncObject);
+    if (fit == MemoryRangeBestFit) {
+        owner = __FindBestFit(range, length, alignment, &start);
+    } else {
+        owner = __FindFirstFit(range, range->Roots[ADDRESS_TREE], length, alignment, &start);
+    }
+
+    if (owner) {
+        __Place(range, owner, node, start, length);
+        node = NULL;
+    }
+    SpinlockReleaseIrq(&range->SyncObject);
+
+    if (node) {
+        kfree(node);
+        return OS_EOOM;
+    }
+    *addressOut = start;
+    return OS_EOK;
+}
+
+oserr_t
+MemoryRangeReserve(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address,
+        _In_ size_t         length)
+{
+    MemoryRangeNode_t* node;
+    oserr_t            oserr;
+
+    assert(range != NULL);
+
+    if (!length || (address & (range->Granularity - 1))) {
+        return OS_EINVALPARAMS;
+    }
+    length = (length + (range->Granularity - 1)) & ~(range->Granularity - 1);
+
+    node = kmalloc(sizeof(MemoryRangeNode_t));
+    if (!node) {
+        return OS_EOOM;
+    }
+
+    SpinlockAcquireIrq(&range->SyncObject);
+    oserr = __Reserve(range, node, address, length);
+    SpinlockReleaseIrq(&range->SyncObject);
+
+    if (oserr != OS_EOK) {
+        kfree(node);
+    }
+    return oserr;
+}
+
+// Removes the range, the freed range and the gap in front of it join the gap of the
+// next range, the end node guarantees there is one.
+static void
+__Free(
+        _In_ MemoryRange_t*     range,
+        _In_ MemoryRangeNode_t* node)
+{
+    MemoryRangeNode_t* next = __Next(range, ADDRESS_TREE, node);
+
+    __Remove(range, ADDRESS_TREE, node);
+    __Remove(range, GAP_TREE, node);
+    __SetGap(range, next, next->Gap + node->Length + node->Gap);
+    range->Count--;
+    range->BytesAllocated -= node->Length;
+}
+
+oserr_t
+MemoryRangeFree(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address)
+{
+    MemoryRangeNode_t* node;
+
+    assert(range != NULL);
+
+    SpinlockAcquireIrq(&range->SyncObject);
+    node = __Find(range, address);
+    if (!node || node == &range->End) {
+        SpinlockReleaseIrq(&range->SyncObject);
+        return OS_ENOENT;
+    }
+    __Free(range, node);
+    SpinlockReleaseIrq(&range->SyncObject);
+
+    kfree(node);
+    return OS_EOK;
+}
+
+oserr_t
+MemoryRangeRelease(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address,
+        _In_ size_t         length)
+{
+    MemoryRangeNode_t* split;
+    MemoryRangeNode_t* node;
+    MemoryRangeNode_t* freed = NULL;
+    uintptr_t          end;
+    uintptr_t          nodeEnd;
+    oserr_t            oserr = OS_EOK;
+
+    assert(range != NULL);
+
+    if (!length || (address & (range->Granularity - 1))) {
+        return OS_EINVALPARAMS;
+    }
+    length = (length + (range->Granularity - 1)) & ~(range->Granularity - 1);
+    end    = address + length;
+
+    // The heap must not be called with the allocator locked, releasing the middle
+    // of a range needs a node for the part above it.
+    split = kmalloc(sizeof(MemoryRangeNode_t));
+
+    SpinlockAcquireIrq(&range->SyncObject);
+    node = __FindBelow(range, address);
+    if (!node || node == &range->End || end < address || end > (node->Start + node->Length)) {
+        SpinlockReleaseIrq(&range->SyncObject);
+        if (split) {
+            kfree(split);
+        }
+        return OS_ENOENT;
+    }
+
+    nodeEnd = node->Start + node->Length;
+    if (address == node->Start && end == nodeEnd) {
+        __Free(range, node);
+        freed = node;
+    } else if (address == node->Start) {
+        // The released part joins the gap in front of the range
+        __Remove(range, GAP_TREE, node);
+        node->Start   = end;
+        node->Length -= length;
+        node->Gap    += length;
+        __Insert(range, GAP_TREE, node);
+        __UpdateMaxGapToRoot(range, node);
+        range->BytesAllocated -= length;
+    } else if (end == nodeEnd || split) {
+        MemoryRangeNode_t* next = __Next(range, ADDRESS_TREE, node);
+
+        // The range is cut at the address, and everything above it joins the gap of the next
+        // range, before the part above the released range is placed again in that gap.
+        node->Length = address - node->Start;
+        __SetGap(range, next, next->Gap + (nodeEnd - address));
+        range->BytesAllocated -= nodeEnd - address;
+        if (end != nodeEnd) {
+            oserr = __Reserve(range, split, end, nodeEnd - end);
+            assert(oserr == OS_EOK);
+            split = NULL;
+        }
+    } else {
+        oserr = OS_EOOM;
+    }
+    SpinlockReleaseIrq(&range->SyncObject);
+
+    if (split) {
+        kfree(split);
+    }
+    if (freed) {
+        kfree(freed);
+    }
+    return oserr;
+}
+
+bool
+MemoryRangeContains(
+        _In_ MemoryRange_t* range,
+        _In_ uintptr_t      address)
+{
+    assert(range != NULL);
+    return address >= range->StartAddress && (address - range->StartAddress) < range->Length;
+}
+
+void
+MemoryRangeStatistics(
+        _In_  MemoryRange_t* range,
+        _Out_ int*           allocationsOut,
+        _Out_ size_t*        bytesFreeOut,
+        _Out_ size_t*        largestGapOut)
+{
+    assert(range != NULL);
+
+    SpinlockAcquireIrq(&range->SyncObject);
+    if (allocationsOut) {
+        *allocationsOut = range->Count;
+    }
+    if (bytesFreeOut) {
+        *bytesFreeOut = range->Length - range->BytesAllocated;
+    }
+    if (largestGapOut) {
+        *largestGapOut = range->Roots[ADDRESS_TREE]->MaxGap;
+    }
+    SpinlockReleaseIrq(&range->SyncObject);
+}
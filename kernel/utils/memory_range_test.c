@@ -0,0 +1,517 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <utils/memory_range.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The allocator never touches the memory it manages, so any range can be used
+#define PAGE_SIZE    0x1000
+#define RANGE_BASE   0x100000000ULL
+#define RANGE_LENGTH 0x40000000ULL
+
+static struct __TestContext {
+    MemoryRange_t Range;
+    int           Held;
+    int           Allocations;
+    int           FailAllocation;
+} g_testContext;
+
+struct __Allocation {
+    uintptr_t Address;
+    size_t    Length;
+};
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+    MemoryRangeConstruct(&g_testContext.Range, RANGE_BASE, RANGE_LENGTH, PAGE_SIZE);
+    return 0;
+}
+
+int TeardownTest(void** state) {
+    (void)state;
+    MemoryRangeDestroy(&g_testContext.Range);
+    assert_int_equal(g_testContext.Held, 0);
+    assert_int_equal(g_testContext.Allocations, 0);
+    return 0;
+}
+
+// Simple LCG, so the benchmarks are reproducible
+static unsigned int
+__Random(unsigned int* seed)
+{
+    *seed = (*seed * 1103515245U) + 12345U;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+// Validates both trees, and that every gap and maximum gap agree with the ranges,
+// returns the black height of the subtree.
+static int
+__Verify(MemoryRange_t* range, MemoryRangeNode_t* node, int tree, MemoryRangeNode_t** previous)
+{
+    int leftHeight, rightHeight;
+
+    if (node == &range->Nil) {
+        return 1;
+    }
+
+    if (node->Links[tree].Color == 1) {
+        assert_int_equal(node->Links[tree].Left->Links[tree].Color, 0);
+        assert_int_equal(node->Links[tree].Right->Links[tree].Color, 0);
+    }
+    if (node->Links[tree].Left != &range->Nil) {
+        assert_ptr_equal(node->Links[tree].Left->Links[tree].Parent, node);
+    }
+    if (node->Links[tree].Right != &range->Nil) {
+        assert_ptr_equal(node->Links[tree].Right->Links[tree].Parent, node);
+    }
+
+    leftHeight = __Verify(range, node->Links[tree].Left, tree, previous);
+    if (tree == 0) {
+        uintptr_t previousEnd = *previous ? (*previous)->Start + (*previous)->Length : range->StartAddress;
+        size_t    maxGap      = node->Gap;
+        assert_int_equal(node->Start - node->Gap, previousEnd);
+        if (node->Links[0].Left->MaxGap > maxGap) maxGap = node->Links[0].Left->MaxGap;
+        if (node->Links[0].Right->MaxGap > maxGap) maxGap = node->Links[0].Right->MaxGap;
+        assert_int_equal(node->MaxGap, maxGap);
+    } else if (*previous) {
+        assert_true((*previous)->Gap < node->Gap ||
+                    ((*previous)->Gap == node->Gap && (*previous)->Start < node->Start));
+    }
+    *previous = node;
+    rightHeight = __Verify(range, node->Links[tree].Right, tree, previous);
+
+    assert_int_equal(leftHeight, rightHeight);
+    return leftHeight + (node->Links[tree].Color == 0 ? 1 : 0);
+}
+
+static void
+__VerifyRange(MemoryRange_t* range)
+{
+    MemoryRangeNode_t* previous = NULL;
+    int                count;
+    size_t             bytesFree;
+
+    __Verify(range, range->Roots[0], 0, &previous);
+    assert_ptr_equal(previous, &range->End);
+    previous = NULL;
+    __Verify(range, range->Roots[1], 1, &previous);
+
+    MemoryRangeStatistics(range, &count, &bytesFree, NULL);
+    assert_int_equal(count, range->Count);
+    assert_int_equal(bytesFree, range->Length - range->BytesAllocated);
+}
+
+void TestMemoryRange_Construct(void** state)
+{
+    int    count;
+    size_t bytesFree;
+    size_t largestGap;
+    (void)state;
+
+    MemoryRangeStatistics(&g_testContext.Range, &count, &bytesFree, &largestGap);
+    assert_int_equal(count, 0);
+    assert_int_equal(bytesFree, RANGE_LENGTH);
+    assert_int_equal(largestGap, RANGE_LENGTH);
+
+    assert_true(MemoryRangeContains(&g_testContext.Range, RANGE_BASE));
+    assert_true(MemoryRangeContains(&g_testContext.Range, RANGE_BASE + RANGE_LENGTH - 1));
+    assert_false(MemoryRangeContains(&g_testContext.Range, RANGE_BASE - 1));
+    assert_false(MemoryRangeContains(&g_testContext.Range, RANGE_BASE + RANGE_LENGTH));
+    __VerifyRange(&g_testContext.Range);
+}
+
+void TestMemoryRange_AllocateExactSize(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    uintptr_t      address[3];
+    size_t         bytesFree;
+    (void)state;
+
+    // Sizes are only rounded to the granularity, not to a power of two
+    assert_int_equal(MemoryRangeAllocate(range, 3 * PAGE_SIZE, 0, MemoryRangeFirstFit, &address[0]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, 5 * PAGE_SIZE - 100, 0, MemoryRangeFirstFit, &address[1]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, 1, 0, MemoryRangeFirstFit, &address[2]), OS_EOK);
+    assert_int_equal(address[0], RANGE_BASE);
+    assert_int_equal(address[1], RANGE_BASE + 3 * PAGE_SIZE);
+    assert_int_equal(address[2], RANGE_BASE + 8 * PAGE_SIZE);
+
+    MemoryRangeStatistics(range, NULL, &bytesFree, NULL);
+    assert_int_equal(bytesFree, RANGE_LENGTH - 9 * PAGE_SIZE);
+    assert_int_equal(MemoryRangeAllocate(range, 0, 0, MemoryRangeFirstFit, &address[0]), OS_EINVALPARAMS);
+    __VerifyRange(range);
+}
+
+void TestMemoryRange_FirstFitAndBestFit(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    uintptr_t      address[6];
+    uintptr_t      result;
+    (void)state;
+
+    // Create holes of 4, 2 and 3 pages in that order
+    assert_int_equal(MemoryRangeAllocate(range, 4 * PAGE_SIZE, 0, MemoryRangeFirstFit, &address[0]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address[1]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, 2 * PAGE_SIZE, 0, MemoryRangeFirstFit, &address[2]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address[3]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, 3 * PAGE_SIZE, 0, MemoryRangeFirstFit, &address[4]), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address[5]), OS_EOK);
+    assert_int_equal(MemoryRangeFree(range, address[0]), OS_EOK);
+    assert_int_equal(MemoryRangeFree(range, address[2]), OS_EOK);
+    assert_int_equal(MemoryRangeFree(range, address[4]), OS_EOK);
+    __VerifyRange(range);
+
+    // First fit takes the lowest hole that fits, best fit the smallest
+    assert_int_equal(MemoryRangeAllocate(range, 3 * PAGE_SIZE, 0, MemoryRangeFirstFit, &result), OS_EOK);
+    assert_int_equal(result, address[0]);
+    assert_int_equal(MemoryRangeAllocate(range, 2 * PAGE_SIZE, 0, MemoryRangeBestFit, &result), OS_EOK);
+    assert_int_equal(result, address[2]);
+    assert_int_equal(MemoryRangeAllocate(range, 3 * PAGE_SIZE, 0, MemoryRangeBestFit, &result), OS_EOK);
+    assert_int_equal(result, address[4]);
+    __VerifyRange(range);
+}
+
+void TestMemoryRange_Alignment(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    uintptr_t      address;
+    uintptr_t      aligned;
+    uintptr_t      next;
+    (void)state;
+
+    assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0x200000, MemoryRangeFirstFit, &aligned), OS_EOK);
+    assert_int_equal(aligned & 0x1FFFFF, 0);
+    assert_int_equal(aligned, RANGE_BASE + 0x200000);
+
+    // The space skipped for the alignment stays free
+    assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0, MemoryRangeFirstFit, &next), OS_EOK);
+    assert_int_equal(next, RANGE_BASE + PAGE_SIZE);
+
+    // Best fit must skip gaps that are large enough, but not once aligned. The smallest gap
+    // is now [0x201000, 0x302000), which cannot hold an aligned megabyte.
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0x302000, PAGE_SIZE), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(range, 0x100000, 0x100000, MemoryRangeBestFit, &address), OS_EOK);
+    assert_int_equal(address, RANGE_BASE + 0x100000);
+    __VerifyRange(range);
+}
+
+void TestMemoryRange_Reserve(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    uintptr_t      address;
+    (void)state;
+
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0x10000, 4 * PAGE_SIZE), OS_EOK);
+
+    // Overlapping the start, the end, or all of it
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0xE000, 4 * PAGE_SIZE), OS_EEXISTS);
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0x13000, PAGE_SIZE), OS_EEXISTS);
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE, 0x20000), OS_EEXISTS);
+
+    // Right next to it on both sides is fine
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0xF000, PAGE_SIZE), OS_EOK);
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0x14000, PAGE_SIZE), OS_EOK);
+
+    // Outside of the range, or not aligned
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE - PAGE_SIZE, PAGE_SIZE), OS_EINVALPARAMS);
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + RANGE_LENGTH - PAGE_SIZE, 2 * PAGE_SIZE), OS_EINVALPARAMS);
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + 0x100, PAGE_SIZE), OS_EINVALPARAMS);
+    assert_int_equal(MemoryRangeReserve(range, RANGE_BASE + RANGE_LENGTH - PAGE_SIZE, PAGE_SIZE), OS_EOK);
+
+    // Allocations go around the reservations
+    assert_int_equal(MemoryRangeAllocate(range, 0x10000, 0, MemoryRangeFirstFit, &address), OS_EOK);
+    assert_int_equal(address, RANGE_BASE + 0x15000);
+    assert_int_equal(MemoryRangeAllocate(range, 0xF000, 0, MemoryRangeBestFit, &address), OS_EOK);
+    assert_int_equal(address, RANGE_BASE);
+    __VerifyRange(range);
+}
+
+void TestMemoryRange_FreeCoalesces(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    uintptr_t      address[8];
+    size_t         largestGap;
+    int            count;
+    (void)state;
+
+    for (int i = 0; i < 8; i++) {
+        assert_int_equal(MemoryRangeAllocate(range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address[i]), OS_EOK);
+    }
+    assert_int_equal(MemoryRangeFree(range, address[0] + PAGE_SIZE / 2), OS_ENOENT);
+    assert_int_equal(MemoryRangeFree(range, RANGE_BASE + RANGE_LENGTH), OS_ENOENT);
+
+    // Free every other one, then the rest, every gap must join its neighbours
+    for (int i = 1; i < 8; i += 2) {
+        assert_int_equal(MemoryRangeFree(range, address[i]), OS_EOK);
+        __VerifyRange(range);
+    }
+    assert_int_equal(MemoryRangeFree(range, address[1]), OS_ENOENT);
+    for (int i = 0; i < 8; i += 2) {
+        assert_int_equal(MemoryRangeFree(range, address[i]), OS_EOK);
+        __VerifyRange(range);
+    }
+
+    MemoryRangeStatistics(range, &count, NULL, &largestGap);
+    assert_int_equal(count, 0);
+    assert_int_equal(largestGap, RANGE_LENGTH);
+}
+
+void TestMemoryRange_Exhaustion(void** state)
+{
+    MemoryRange_t range;
+    uintptr_t     address;
+    (void)state;
+
+    MemoryRangeConstruct(&range, RANGE_BASE, 8 * PAGE_SIZE, PAGE_SIZE);
+    assert_int_equal(MemoryRangeAllocate(&range, 9 * PAGE_SIZE, 0, MemoryRangeFirstFit, &address), OS_EOOM);
+    assert_int_equal(MemoryRangeAllocate(&range, 8 * PAGE_SIZE, 0, MemoryRangeBestFit, &address), OS_EOK);
+    assert_int_equal(MemoryRangeAllocate(&range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address), OS_EOOM);
+    assert_int_equal(MemoryRangeAllocate(&range, PAGE_SIZE, 0, MemoryRangeBestFit, &address), OS_EOOM);
+
+    // Running out of heap must leave the allocator untouched
+    assert_int_equal(MemoryRangeFree(&range, RANGE_BASE), OS_EOK);
+    g_testContext.FailAllocation = 1;
+    assert_int_equal(MemoryRangeAllocate(&range, PAGE_SIZE, 0, MemoryRangeFirstFit, &address), OS_EOOM);
+    assert_int_equal(range.Count, 0);
+    g_testContext.FailAllocation = 0;
+    __VerifyRange(&range);
+    MemoryRangeDestroy(&range);
+}
+
+void TestMemoryRange_Release(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    uintptr_t      base  = RANGE_BASE + (16 * PAGE_SIZE);
+    uintptr_t      result;
+    (void)state;
+
+    assert_int_equal(MemoryRangeReserve(range, base, 8 * PAGE_SIZE), OS_EOK);
+
+    // The first and the last page, the rest of the range stays allocated
+    assert_int_equal(MemoryRangeRelease(range, base, PAGE_SIZE), OS_EOK);
+    assert_int_equal(MemoryRangeRelease(range, base + (7 * PAGE_SIZE), PAGE_SIZE), OS_EOK);
+    assert_int_equal(range->Count, 1);
+    assert_int_equal(range->BytesAllocated, 6 * PAGE_SIZE);
+    __VerifyRange(range);
+
+    // Splitting needs memory, running out leaves the range untouched
+    g_testContext.FailAllocation = 1;
+    assert_int_equal(MemoryRangeRelease(range, base + (3 * PAGE_SIZE), 2 * PAGE_SIZE), OS_EOOM);
+    assert_int_equal(range->Count, 1);
+    assert_int_equal(range->BytesAllocated, 6 * PAGE_SIZE);
+
+    // The middle splits the range in two
+    assert_int_equal(MemoryRangeRelease(range, base + (3 * PAGE_SIZE), 2 * PAGE_SIZE), OS_EOK);
+    assert_int_equal(range->Count, 2);
+    assert_int_equal(range->BytesAllocated, 4 * PAGE_SIZE);
+    __VerifyRange(range);
+
+    assert_int_equal(MemoryRangeReserve(range, base + PAGE_SIZE, PAGE_SIZE), OS_EEXISTS);
+    assert_int_equal(MemoryRangeReserve(range, base + (5 * PAGE_SIZE), PAGE_SIZE), OS_EEXISTS);
+    assert_int_equal(MemoryRangeReserve(range, base + (3 * PAGE_SIZE), 2 * PAGE_SIZE), OS_EOK);
+    assert_int_equal(MemoryRangeFree(range, base + (3 * PAGE_SIZE)), OS_EOK);
+
+    // Only parts of a single allocated range can be released
+    assert_int_equal(MemoryRangeRelease(range, base, PAGE_SIZE), OS_ENOENT);
+    assert_int_equal(MemoryRangeRelease(range, base + (2 * PAGE_SIZE), 2 * PAGE_SIZE), OS_ENOENT);
+    assert_int_equal(MemoryRangeRelease(range, base + PAGE_SIZE / 2, PAGE_SIZE), OS_EINVALPARAMS);
+    assert_int_equal(MemoryRangeRelease(range, base + PAGE_SIZE, 0), OS_EINVALPARAMS);
+
+    // Releasing the rest frees the ranges entirely
+    assert_int_equal(MemoryRangeRelease(range, base + PAGE_SIZE, 2 * PAGE_SIZE), OS_EOK);
+    assert_int_equal(MemoryRangeRelease(range, base + (5 * PAGE_SIZE), 2 * PAGE_SIZE), OS_EOK);
+    assert_int_equal(range->Count, 0);
+    __VerifyRange(range);
+    assert_int_equal(MemoryRangeAllocate(range, RANGE_LENGTH, 0, MemoryRangeFirstFit, &result), OS_EOK);
+    assert_int_equal(MemoryRangeFree(range, result), OS_EOK);
+}
+
+void TestMemoryRange_Clone(void** state)
+{
+    MemoryRange_t* range = &g_testContext.Range;
+    MemoryRange_t  clone;
+    uintptr_t      address[4];
+    uintptr_t      result;
+    (void)state;
+
+    for (int i = 0; i < 4; i++) {
+        assert_int_equal(MemoryRangeAllocate(range, (i + 1) * PAGE_SIZE, 0, MemoryRangeFirstFit, &address[i]), OS_EOK);
+    }
+    assert_int_equal(MemoryRangeFree(range, address[1]), OS_EOK);
+
+    assert_int_equal(MemoryRangeClone(range, &clone), OS_EOK);
+    __VerifyRange(&clone);
+    assert_int_equal(clone.Count, 3);
+    assert_int_equal(clone.BytesAllocated, range->BytesAllocated);
+
+    // The clone is independent of the original
+    assert_int_equal(MemoryRangeReserve(&clone, address[0], PAGE_SIZE), OS_EEXISTS);
+    assert_int_equal(MemoryRangeAllocate(&clone, 2 * PAGE_SIZE, 0, MemoryRangeBestFit, &result), OS_EOK);
+    assert_int_equal(result, address[1]);
+    assert_int_equal(MemoryRangeFree(range, address[0]), OS_EOK);
+    assert_int_equal(MemoryRangeFree(&clone, address[0]), OS_EOK);
+    MemoryRangeDestroy(&clone);
+
+    // A failed clone is left empty
+    g_testContext.FailAllocation = 2;
+    assert_int_equal(MemoryRangeClone(range, &clone), OS_EOOM);
+    assert_int_equal(clone.Count, 0);
+    __VerifyRange(&clone);
+    g_testContext.FailAllocation = 0;
+}
+
+void TestMemoryRange_Random(void** state)
+{
+    MemoryRange_t*       range       = &g_testContext.Range;
+    const int            maxLive     = 512;
+    struct __Allocation* allocations = calloc(maxLive, sizeof(struct __Allocation));
+    unsigned int         seed        = 7;
+    (void)state;
+
+    assert_non_null(allocations);
+    for (int i = 0; i < 20000; i++) {
+        struct __Allocation* allocation = &allocations[__Random(&seed) % maxLive];
+        if (allocation->Address) {
+            assert_int_equal(MemoryRangeFree(range, allocation->Address), OS_EOK);
+            allocation->Address = 0;
+        } else {
+            size_t alignment = (__Random(&seed) & 3) == 0 ? 0x10000 : 0;
+            allocation->Length = ((__Random(&seed) % 64) + 1) * PAGE_SIZE;
+            assert_int_equal(MemoryRangeAllocate(range, allocation->Length, alignment,
+                                                 (i & 1) ? MemoryRangeBestFit : MemoryRangeFirstFit,
+                                                 &allocation->Address), OS_EOK);
+            assert_int_equal(allocation->Address & (alignment ? alignment - 1 : 0), 0);
+        }
+        if ((i % 1000) == 0) {
+            __VerifyRange(range);
+        }
+    }
+    __VerifyRange(range);
+    free(allocations);
+}
+
+static size_t
+__NextPowerOfTwo(size_t value)
+{
+    size_t power = PAGE_SIZE;
+    while (power < value) {
+        power <<= 1;
+    }
+    return power;
+}
+
+void TestMemoryRange_Benchmark(void** state)
+{
+    MemoryRange_t*       range       = &g_testContext.Range;
+    const int            maxLive     = 4096;
+    const int            iterations  = 1000000;
+    struct __Allocation* allocations = calloc(maxLive, sizeof(struct __Allocation));
+    unsigned int         seed        = 1;
+    size_t               live        = 0;
+    size_t               livePow2    = 0;
+    size_t               peak        = 0;
+    size_t               peakPow2    = 0;
+    struct timespec      start, end;
+    double               elapsed;
+    (void)state;
+
+    assert_non_null(allocations);
+
+    // Random mix of mappings between 1 and 64 pages. The address space used is compared
+    // to what rounding every request to a power of two would have reserved.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        struct __Allocation* allocation = &allocations[__Random(&seed) % maxLive];
+        if (allocation->Address) {
+            assert_int_equal(MemoryRangeFree(range, allocation->Address), OS_EOK);
+            live     -= allocation->Length;
+            livePow2 -= __NextPowerOfTwo(allocation->Length);
+            allocation->Address = 0;
+            continue;
+        }
+
+        allocation->Length = ((__Random(&seed) % 64) + 1) * PAGE_SIZE;
+        assert_int_equal(MemoryRangeAllocate(range, allocation->Length, 0, MemoryRangeBestFit,
+                                             &allocation->Address), OS_EOK);
+        live     += allocation->Length;
+        livePow2 += __NextPowerOfTwo(allocation->Length);
+        if (live > peak) peak = live;
+        if (livePow2 > peakPow2) peakPow2 = livePow2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_nsec - start.tv_nsec) / 1e9);
+
+    printf("throughput: %.0f ops/s, %i live ranges\n", iterations / elapsed, range->Count);
+    printf("address space: peak %zu KiB exact, %zu KiB with power of two sizes (%.1f%% more)\n",
+           peak / 1024, peakPow2 / 1024, ((double)peakPow2 - (double)peak) * 100.0 / (double)peak);
+    __VerifyRange(range);
+    free(allocations);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Construct, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_AllocateExactSize, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_FirstFitAndBestFit, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Alignment, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Reserve, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_FreeCoalesces, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Exhaustion, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Release, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Clone, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Random, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestMemoryRange_Benchmark, SetupTest, TeardownTest),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+void* kmalloc(size_t size) {
+    // The heap must never be called with the allocator locked
+    assert_int_equal(g_testContext.Held, 0);
+    if (g_testContext.FailAllocation && --g_testContext.FailAllocation == 0) {
+        return NULL;
+    }
+    g_testContext.Allocations++;
+    return test_malloc(size);
+}
+
+void kfree(void* memp) {
+    g_testContext.Allocations--;
+    test_free(memp);
+}
+
+void SpinlockConstruct(Spinlock_t* spinlock) {
+    (void)spinlock;
+}
+
+void SpinlockAcquireIrq(Spinlock_t* spinlock) {
+    (void)spinlock;
+    assert_int_equal(g_testContext.Held, 0);
+    g_testContext.Held = 1;
+}
+
+void SpinlockReleaseIrq(Spinlock_t* spinlock) {
+    (void)spinlock;
+    assert_int_equal(g_testContext.Held, 1);
+    g_testContext.Held = 0;
+}
@@ -51,9 +51,11 @@ MemoryStackConstruct(
     stack->data_size  = dataSize;
 }
 
-static void
-__ExtendStack(
-        _In_ MemoryStack_t* stack)
+oserr_t
+MemoryStackAllocateStorage(
+        _In_  MemoryStack_t* stack,
+        _Out_ uintptr_t*     dataAddressOut,
+        _Out_ size_t*        dataSizeOut)
 {
     // double up each time
     oserr_t   oserr;
@@ -73,23 +75,65 @@ __ExtendStack(
             },
             &space
     );
-    assert(oserr == OS_EOK);
+    if (oserr != OS_EOK) {
+        return oserr;
+    }
+
+    *dataAddressOut = (uintptr_t)space;
+    *dataSizeOut    = newSize;
+    return OS_EOK;
+}
+
+void
+MemoryStackReplaceStorage(
+        _In_  MemoryStack_t* stack,
+        _In_  uintptr_t      dataAddress,
+        _In_  size_t         dataSize,
+        _Out_ uintptr_t*     oldDataAddressOut,
+        _Out_ size_t*        oldDataSizeOut)
+{
+    assert(dataSize >= stack->data_size);
 
     // copy the data
-    memcpy((void*)space, stack->items, stack->data_size);
+    memcpy((void*)dataAddress, stack->items, stack->index * sizeof(struct MemoryStackItem));
+
+    *oldDataAddressOut = (uintptr_t)stack->items;
+    *oldDataSizeOut    = stack->data_size;
+
+    // update the stack with new space, capacity and pointer
+    stack->capacity  = (int)(dataSize / sizeof(struct MemoryStackItem));
+    stack->data_size = dataSize;
+    stack->items     = (struct MemoryStackItem*)dataAddress;
+}
 
-    // free the old space
-    oserr = MemorySpaceUnmap(
+void
+MemoryStackFreeStorage(
+        _In_ uintptr_t dataAddress,
+        _In_ size_t    dataSize)
+{
+    oserr_t oserr = MemorySpaceUnmap(
             GetCurrentMemorySpace(),
-            (vaddr_t)stack->items,
-            stack->data_size
+            (vaddr_t)dataAddress,
+            dataSize
     );
     assert(oserr == OS_EOK);
+}
 
-    // update the stack with new space, capacity and pointer
-    stack->capacity = (int)(newSize / sizeof(struct MemoryStackItem));
-    stack->data_size = newSize;
-    stack->items = (struct MemoryStackItem*)space;
+static void
+__ExtendStack(
+        _In_ MemoryStack_t* stack)
+{
+    oserr_t   oserr;
+    uintptr_t space;
+    size_t    size;
+
+    oserr = MemoryStackAllocateStorage(stack, &space, &size);
+    assert(oserr == OS_EOK);
+
+    // The new storage is installed before the old one is freed, so any
+    // push that happens while unmapping ends up in the new storage.
+    MemoryStackReplaceStorage(stack, space, size, &space, &size);
+    MemoryStackFreeStorage(space, size);
 }
 
 void
@@ -113,13 +157,19 @@ MemoryStackPush(
 {
     uintptr_t lastAddress;
 
-    // can we extend the last entry instead of going to next
+    // can we extend the last entry instead of going to next, either at the end of
+    // it, or at the start of it when the blocks are given back in descending order
     if (stack->index != 0) {
         lastAddress = stack->items[stack->index - 1].base + (stack->items[stack->index - 1].block_count * stack->block_size);
         if (lastAddress == address) {
             stack->items[stack->index - 1].block_count += blockCount;
             return;
         }
+        if (address + (blockCount * stack->block_size) == stack->items[stack->index - 1].base) {
+            stack->items[stack->index - 1].base = address;
+            stack->items[stack->index - 1].block_count += blockCount;
+            return;
+        }
     }
 
     if (stack->index == stack->capacity) {
@@ -0,0 +1,266 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Page Compression
+ * - Greedy single pass compressor, matches are found through a hash table of the
+ *   last position every 4 byte sequence was seen at.
+ */
+
+#include <utils/page_compress.h>
+#include <string.h>
+
+#define MIN_MATCH     4
+#define RUN_MASK      15
+
+// Matches never reach into the last bytes of the block, and are not started close to
+// the end, so the block always ends with literals.
+#define LAST_LITERALS 5
+#define MATCH_LIMIT   12
+
+static inline uint32_t
+__Read32(
+        _In_ const uint8_t* pointer)
+{
+    uint32_t value;
+    memcpy(&value, pointer, sizeof(uint32_t));
+    return value;
+}
+
+static inline uint32_t
+__Hash(
+        _In_ uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - PAGE_COMPRESS_HASH_LOG);
+}
+
+static uint8_t*
+__WriteLength(
+        _In_ uint8_t*       output,
+        _In_ const uint8_t* outputEnd,
+        _In_ size_t         length)
+{
+    while (length >= 255) {
+        if (output >= outputEnd) {
+            return NULL;
+        }
+        *output++ = 255;
+        length -= 255;
+    }
+
+    if (output >= outputEnd) {
+        return NULL;
+    }
+    *output++ = (uint8_t)length;
+    return output;
+}
+
+// Writes a sequence of literals followed by a match. The last sequence of a block
+// has no match, which is marked by a match length of 0.
+static uint8_t*
+__WriteSequence(
+        _In_ uint8_t*       output,
+        _In_ const uint8_t* outputEnd,
+        _In_ const uint8_t* literals,
+        _In_ size_t         literalLength,
+        _In_ size_t         offset,
+        _In_ size_t         matchLength)
+{
+    uint8_t* token;
+
+    if (output >= outputEnd) {
+        return NULL;
+    }
+
+    token  = output++;
+    *token = (uint8_t)((literalLength >= RUN_MASK ? RUN_MASK : literalLength) << 4);
+    if (literalLength >= RUN_MASK) {
+        output = __WriteLength(output, outputEnd, literalLength - RUN_MASK);
+        if (output == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((size_t)(outputEnd - output) < literalLength) {
+        return NULL;
+    }
+    memcpy(output, literals, literalLength);
+    output += literalLength;
+    if (!matchLength) {
+        return output;
+    }
+
+    if ((outputEnd - output) < 2) {
+        return NULL;
+    }
+    *output++ = (uint8_t)(offset & 0xFF);
+    *output++ = (uint8_t)(offset >> 8);
+
+    matchLength -= MIN_MATCH;
+    *token |= (uint8_t)(matchLength >= RUN_MASK ? RUN_MASK : matchLength);
+    if (matchLength >= RUN_MASK) {
+        output = __WriteLength(output, outputEnd, matchLength - RUN_MASK);
+    }
+    return output;
+}
+
+size_t
+PageCompress(
+        _In_ const void* source,
+        _In_ size_t      length,
+        _In_ void*       destination,
+        _In_ size_t      capacity,
+        _In_ void*       workspace)
+{
+    const uint8_t* input      = source;
+    const uint8_t* inputPtr   = source;
+    const uint8_t* anchor     = source;
+    const uint8_t* inputEnd   = input + length;
+    const uint8_t* matchLimit = length > MATCH_LIMIT ? inputEnd - MATCH_LIMIT : input;
+    uint8_t*       output     = destination;
+    uint8_t*       outputEnd  = output + capacity;
+    uint16_t*      table      = workspace;
+
+    if (length > PAGE_COMPRESS_MAX_LENGTH) {
+        return 0;
+    }
+
+    memset(table, 0, PAGE_COMPRESS_WORKSPACE_SIZE);
+    while (inputPtr < matchLimit) {
+        uint32_t       sequence = __Read32(inputPtr);
+        uint32_t       hash     = __Hash(sequence);
+        const uint8_t* match    = input + table[hash];
+        const uint8_t* matchEnd;
+        const uint8_t* reference;
+
+        table[hash] = (uint16_t)(inputPtr - input);
+        if (match >= inputPtr || (inputPtr - match) > 0xFFFF || __Read32(match) != sequence) {
+            inputPtr++;
+            continue;
+        }
+
+        // Grow the match backwards into the pending literals
+        while (inputPtr > anchor && match > input && inputPtr[-1] == match[-1]) {
+            inputPtr--;
+            match--;
+        }
+
+        matchEnd  = inputPtr + MIN_MATCH;
+        reference = match + MIN_MATCH;
+        while (matchEnd < inputEnd - LAST_LITERALS && *matchEnd == *reference) {
+            matchEnd++;
+            reference++;
+        }
+
+        output = __WriteSequence(output, outputEnd, anchor, (size_t)(inputPtr - anchor),
+                                 (size_t)(inputPtr - match), (size_t)(matchEnd - inputPtr));
+        if (output == NULL) {
+            return 0;
+        }
+        inputPtr = matchEnd;
+        anchor   = matchEnd;
+    }
+
+    output = __WriteSequence(output, outputEnd, anchor, (size_t)(inputEnd - anchor), 0, 0);
+    if (output == NULL) {
+        return 0;
+    }
+    return (size_t)(output - (uint8_t*)destination);
+}
+
+static const uint8_t*
+__ReadLength(
+        _In_  const uint8_t* input,
+        _In_  const uint8_t* inputEnd,
+        _Out_ size_t*        lengthOut)
+{
+    uint8_t value;
+
+    do {
+        if (input >= inputEnd) {
+            return NULL;
+        }
+        value = *input++;
+        *lengthOut += value;
+    } while (value == 255);
+    return input;
+}
+
+oserr_t
+PageDecompress(
+        _In_ const void* source,
+        _In_ size_t      length,
+        _In_ void*       destination,
+        _In_ size_t      destinationLength)
+{
+    const uint8_t* input     = source;
+    const uint8_t* inputEnd  = input + length;
+    uint8_t*       output    = destination;
+    uint8_t*       outputEnd = output + destinationLength;
+
+    while (input < inputEnd) {
+        uint8_t        token         = *input++;
+        size_t         literalLength = token >> 4;
+        size_t         matchLength   = token & RUN_MASK;
+        size_t         offset;
+        const uint8_t* match;
+
+        if (literalLength == RUN_MASK) {
+            input = __ReadLength(input, inputEnd, &literalLength);
+            if (input == NULL) {
+                return OS_EINVALPARAMS;
+            }
+        }
+
+        if ((size_t)(inputEnd - input) < literalLength || (size_t)(outputEnd - output) < literalLength) {
+            return OS_EINVALPARAMS;
+        }
+        memcpy(output, input, literalLength);
+        input  += literalLength;
+        output += literalLength;
+
+        // The last sequence only has literals
+        if (input == inputEnd) {
+            break;
+        }
+
+        if ((inputEnd - input) < 2) {
+            return OS_EINVALPARAMS;
+        }
+        offset = input[0] | ((size_t)input[1] << 8);
+        input += 2;
+        if (offset == 0 || offset > (size_t)(output - (uint8_t*)destination)) {
+            return OS_EINVALPARAMS;
+        }
+
+        if (matchLength == RUN_MASK) {
+            input = __ReadLength(input, inputEnd, &matchLength);
+            if (input == NULL) {
+                return OS_EINVALPARAMS;
+            }
+        }
+        matchLength += MIN_MATCH;
+        if ((size_t)(outputEnd - output) < matchLength) {
+            return OS_EINVALPARAMS;
+        }
+
+        // Matches may overlap the output they produce, so copy byte by byte
+        match = output - offset;
+        while (matchLength--) {
+            *output++ = *match++;
+        }
+    }
+    return output == outputEnd ? OS_EOK : OS_EINVALPARAMS;
+}
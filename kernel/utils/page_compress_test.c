@@ -0,0 +1,323 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <utils/page_compress.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAGE_SIZE 0x1000
+
+static struct __TestContext {
+    uint8_t Page[PAGE_SIZE];
+    uint8_t Compressed[PAGE_SIZE];
+    uint8_t Decompressed[PAGE_SIZE];
+    uint8_t Workspace[PAGE_COMPRESS_WORKSPACE_SIZE];
+} g_testContext;
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+    return 0;
+}
+
+int TeardownTest(void** state) {
+    (void)state;
+    return 0;
+}
+
+// Simple LCG, so the page contents are reproducible
+static unsigned int
+__Random(unsigned int* seed)
+{
+    *seed = (*seed * 1103515245U) + 12345U;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+// The page classes approximate what is found in the anonymous memory of a process; zero
+// filled pages, text, tables of pointers into a heap, and data that does not compress.
+enum __PageClass {
+    PAGE_CLASS_ZERO,
+    PAGE_CLASS_TEXT,
+    PAGE_CLASS_POINTERS,
+    PAGE_CLASS_STRUCTURES,
+    PAGE_CLASS_RANDOM,
+    PAGE_CLASS_COUNT
+};
+
+static const char* g_classNames[PAGE_CLASS_COUNT] = {
+        "zero", "text", "pointers", "structures", "random"
+};
+
+static void
+__FillPage(
+        _In_ uint8_t*         page,
+        _In_ enum __PageClass pageClass,
+        _In_ unsigned int*    seed)
+{
+    static const char* words[] = {
+            "memory", "space", "the", "page", "thread", "handle", "of", "a", "fault",
+            "scheduler", "and", "mapping", "physical", "virtual", "to", "process"
+    };
+
+    switch (pageClass) {
+        case PAGE_CLASS_ZERO: {
+            memset(page, 0, PAGE_SIZE);
+        } break;
+        case PAGE_CLASS_TEXT: {
+            size_t i = 0;
+            while (i < PAGE_SIZE) {
+                const char* word = words[__Random(seed) % (sizeof(words) / sizeof(words[0]))];
+                while (*word && i < PAGE_SIZE) {
+                    page[i++] = (uint8_t)*word++;
+                }
+                if (i < PAGE_SIZE) {
+                    page[i++] = ' ';
+                }
+            }
+        } break;
+        case PAGE_CLASS_POINTERS: {
+            uint64_t* pointers = (uint64_t*)page;
+            for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+                pointers[i] = (__Random(seed) % 4) == 0 ? 0 :
+                        0x00007F0000100000ULL + ((uint64_t)(__Random(seed) % 2048) * 16);
+            }
+        } break;
+        case PAGE_CLASS_STRUCTURES: {
+            // Records of 32 bytes, with a pointer, a small counter, flags and padding
+            uint32_t* words32 = (uint32_t*)page;
+            for (size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i += 8) {
+                words32[i + 0] = 0x00100000U + (__Random(seed) % 256) * 64;
+                words32[i + 1] = 0x00007F00U;
+                words32[i + 2] = (uint32_t)(i / 8);
+                words32[i + 3] = __Random(seed) % 4;
+                words32[i + 4] = 0x1000;
+                words32[i + 5] = 0;
+                words32[i + 6] = 0;
+                words32[i + 7] = 0xDEADBEEF;
+            }
+        } break;
+        default: {
+            for (size_t i = 0; i < PAGE_SIZE; i++) {
+                page[i] = (uint8_t)(__Random(seed) >> 3);
+            }
+        } break;
+    }
+}
+
+static size_t
+__RoundTrip(
+        _In_ const uint8_t* data,
+        _In_ size_t         length)
+{
+    size_t  compressed;
+    oserr_t oserr;
+
+    compressed = PageCompress(data, length, g_testContext.Compressed, PAGE_SIZE, g_testContext.Workspace);
+    if (!compressed) {
+        return 0;
+    }
+
+    memset(g_testContext.Decompressed, 0xCC, PAGE_SIZE);
+    oserr = PageDecompress(g_testContext.Compressed, compressed, g_testContext.Decompressed, length);
+    assert_int_equal(oserr, OS_EOK);
+    assert_memory_equal(g_testContext.Decompressed, data, length);
+    return compressed;
+}
+
+void TestPageCompress_ZeroPage(void** state)
+{
+    size_t compressed;
+    (void)state;
+
+    compressed = __RoundTrip(g_testContext.Page, PAGE_SIZE);
+    assert_int_not_equal(compressed, 0);
+    assert_true(compressed < 32);
+}
+
+void TestPageCompress_PageClasses(void** state)
+{
+    unsigned int seed = 1;
+    (void)state;
+
+    for (int pageClass = 0; pageClass < PAGE_CLASS_COUNT; pageClass++) {
+        for (int i = 0; i < 64; i++) {
+            size_t compressed;
+
+            __FillPage(g_testContext.Page, pageClass, &seed);
+            compressed = __RoundTrip(g_testContext.Page, PAGE_SIZE);
+            if (pageClass == PAGE_CLASS_RANDOM) {
+                assert_int_equal(compressed, 0);
+            } else {
+                assert_int_not_equal(compressed, 0);
+            }
+        }
+    }
+}
+
+void TestPageCompress_SmallBlocks(void** state)
+{
+    unsigned int seed = 7;
+    (void)state;
+
+    // Blocks shorter than the match limit are stored as literals only, and blocks of
+    // all sizes up to a few hundred bytes exercise the length encodings around 15 and 255
+    for (size_t length = 0; length < 600; length++) {
+        size_t compressed;
+
+        for (size_t i = 0; i < length; i++) {
+            g_testContext.Page[i] = (uint8_t)(length % 3 ? __Random(&seed) : (i % 7));
+        }
+
+        compressed = PageCompress(g_testContext.Page, length, g_testContext.Compressed,
+                                  PAGE_SIZE, g_testContext.Workspace);
+        assert_int_not_equal(compressed, 0);
+        assert_int_equal(PageDecompress(g_testContext.Compressed, compressed,
+                                        g_testContext.Decompressed, length), OS_EOK);
+        assert_memory_equal(g_testContext.Decompressed, g_testContext.Page, length);
+    }
+}
+
+void TestPageCompress_RejectsWhenFull(void** state)
+{
+    unsigned int seed = 3;
+    size_t       compressed;
+    (void)state;
+
+    __FillPage(g_testContext.Page, PAGE_CLASS_TEXT, &seed);
+    compressed = PageCompress(g_testContext.Page, PAGE_SIZE, g_testContext.Compressed,
+                              PAGE_SIZE, g_testContext.Workspace);
+    assert_int_not_equal(compressed, 0);
+
+    // The same page must be rejected when the buffer is one byte short
+    assert_int_equal(PageCompress(g_testContext.Page, PAGE_SIZE, g_testContext.Compressed,
+                                  compressed - 1, g_testContext.Workspace), 0);
+    assert_int_equal(PageCompress(g_testContext.Page, PAGE_COMPRESS_MAX_LENGTH + 1,
+                                  g_testContext.Compressed, PAGE_SIZE, g_testContext.Workspace), 0);
+}
+
+void TestPageCompress_CorruptInput(void** state)
+{
+    unsigned int seed = 5;
+    size_t       compressed;
+    (void)state;
+
+    __FillPage(g_testContext.Page, PAGE_CLASS_STRUCTURES, &seed);
+    compressed = PageCompress(g_testContext.Page, PAGE_SIZE, g_testContext.Compressed,
+                              PAGE_SIZE, g_testContext.Workspace);
+    assert_int_not_equal(compressed, 0);
+
+    // Wrong length of output, and truncated input
+    assert_int_equal(PageDecompress(g_testContext.Compressed, compressed,
+                                    g_testContext.Decompressed, PAGE_SIZE - 1), OS_EINVALPARAMS);
+    assert_int_equal(PageDecompress(g_testContext.Compressed, compressed - 1,
+                                    g_testContext.Decompressed, PAGE_SIZE), OS_EINVALPARAMS);
+
+    // An offset reaching before the start of the output
+    g_testContext.Compressed[0] = 0x10;
+    g_testContext.Compressed[1] = 'a';
+    g_testContext.Compressed[2] = 0x02;
+    g_testContext.Compressed[3] = 0x00;
+    g_testContext.Compressed[4] = 0x00;
+    assert_int_equal(PageDecompress(g_testContext.Compressed, 5,
+                                    g_testContext.Decompressed, 6), OS_EINVALPARAMS);
+
+    // Random garbage must never decode outside the buffers
+    for (int i = 0; i < 10000; i++) {
+        size_t length = (__Random(&seed) % 64) + 1;
+        for (size_t j = 0; j < length; j++) {
+            g_testContext.Compressed[j] = (uint8_t)__Random(&seed);
+        }
+        (void)PageDecompress(g_testContext.Compressed, length, g_testContext.Decompressed, PAGE_SIZE);
+    }
+}
+
+void TestPageCompress_Benchmark(void** state)
+{
+    const int    pagesPerClass = 4096;
+    uint8_t*     pages         = malloc((size_t)pagesPerClass * PAGE_SIZE);
+    unsigned int seed          = 11;
+    size_t       totalIn       = 0;
+    size_t       totalOut      = 0;
+    (void)state;
+
+    assert_non_null(pages);
+
+    for (int pageClass = 0; pageClass < PAGE_CLASS_COUNT; pageClass++) {
+        struct timespec start, end;
+        double          compressTime, decompressTime;
+        size_t          stored   = 0;
+        size_t          rejected = 0;
+
+        for (int i = 0; i < pagesPerClass; i++) {
+            __FillPage(&pages[(size_t)i * PAGE_SIZE], pageClass, &seed);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < pagesPerClass; i++) {
+            size_t compressed = PageCompress(&pages[(size_t)i * PAGE_SIZE], PAGE_SIZE, g_testContext.Compressed,
+                                             PAGE_SIZE, g_testContext.Workspace);
+            if (compressed) {
+                stored += compressed;
+            } else {
+                stored += PAGE_SIZE;
+                rejected++;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        compressTime = (double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_nsec - start.tv_nsec) / 1e9);
+
+        // Decompression is measured on the last compressible page of the class
+        decompressTime = 0;
+        if (rejected != (size_t)pagesPerClass) {
+            size_t compressed = __RoundTrip(&pages[0], PAGE_SIZE);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < pagesPerClass; i++) {
+                assert_int_equal(PageDecompress(g_testContext.Compressed, compressed,
+                                                 g_testContext.Decompressed, PAGE_SIZE), OS_EOK);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            decompressTime = (double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_nsec - start.tv_nsec) / 1e9);
+        }
+
+        printf("%-10s ratio %5.2f, %4zu/%i rejected, compress %7.1f MB/s, decompress %7.1f MB/s\n",
+               g_classNames[pageClass], (double)pagesPerClass * PAGE_SIZE / (double)stored,
+               rejected, pagesPerClass,
+               (double)pagesPerClass * PAGE_SIZE / compressTime / 1e6,
+               decompressTime > 0 ? (double)pagesPerClass * PAGE_SIZE / decompressTime / 1e6 : 0.0);
+        totalIn  += (size_t)pagesPerClass * PAGE_SIZE;
+        totalOut += stored;
+    }
+
+    printf("overall ratio %.2f\n", (double)totalIn / (double)totalOut);
+    free(pages);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup_teardown(TestPageCompress_ZeroPage, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestPageCompress_PageClasses, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestPageCompress_SmallBlocks, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestPageCompress_RejectsWhenFull, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestPageCompress_CorruptInput, SetupTest, TeardownTest),
+            cmocka_unit_test_setup_teardown(TestPageCompress_Benchmark, SetupTest, TeardownTest),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
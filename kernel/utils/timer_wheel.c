@@ -0,0 +1,217 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Datastructure (Timer Wheel)
+ * - An entry is queued on the lowest level whose range covers its expiry, in the slot of
+ *   its expiry rounded down to the slot size of that level. Slots are never cascaded when
+ *   the wheel turns. Instead, when a slot on an upper level comes due, the entries that
+ *   have not yet expired are queued again, which puts them on a lower level. An entry is
+ *   requeued at most once per level, and no work is done for slots that are empty.
+ *
+ *   The slots of a level that can hold entries always cover the 64 slot-sized steps
+ *   after the current time, so every slot maps to exactly one point in time.
+ */
+
+#include <assert.h>
+#include <utils/timer_wheel.h>
+#include <string.h>
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_SLOT_BITS)
+#define SLOT_MASK          (TIMER_WHEEL_SLOTS - 1)
+
+// Rotating right by the index of the first pending step puts the slots in the
+// order they come due.
+static inline uint64_t
+__RotateRight(
+        _In_ uint64_t value,
+        _In_ int      count)
+{
+    count &= SLOT_MASK;
+    if (!count) {
+        return value;
+    }
+    return (value >> count) | (value << (TIMER_WHEEL_SLOTS - count));
+}
+
+void
+TimerWheelConstruct(
+        _In_ TimerWheel_t* wheel,
+        _In_ uint64_t      time)
+{
+    memset(wheel, 0, sizeof(TimerWheel_t));
+    wheel->Time = time;
+}
+
+void
+TimerWheelAdd(
+        _In_ TimerWheel_t*      wheel,
+        _In_ TimerWheelEntry_t* entry,
+        _In_ uint64_t           expires)
+{
+    uint64_t step;
+    uint64_t delta;
+    int      level = 0;
+    int      slot;
+
+    assert(!TIMER_WHEEL_ENTRY_QUEUED(entry));
+
+    // Expired entries go in the very next slot
+    entry->Expires = expires;
+    if (expires <= wheel->Time) {
+        expires = wheel->Time + 1;
+    }
+
+    delta = expires - wheel->Time;
+    while (level < (TIMER_WHEEL_LEVELS - 1) && delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+
+    step = expires >> LEVEL_SHIFT(level);
+    if (delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+        // Beyond the range of the top level, park it in the last step of the range
+        step = (wheel->Time >> LEVEL_SHIFT(level)) + TIMER_WHEEL_SLOTS;
+    }
+    slot = (int)(step & SLOT_MASK);
+
+    entry->Slot = (level * TIMER_WHEEL_SLOTS) + slot;
+    entry->Prev = NULL;
+    entry->Next = wheel->Slots[level][slot];
+    if (entry->Next) {
+        entry->Next->Prev = entry;
+    }
+    wheel->Slots[level][slot] = entry;
+    wheel->Occupied[level] |= (1ULL << slot);
+    wheel->Count++;
+}
+
+void
+TimerWheelRemove(
+        _In_ TimerWheel_t*      wheel,
+        _In_ TimerWheelEntry_t* entry)
+{
+    int level = entry->Slot / TIMER_WHEEL_SLOTS;
+    int slot  = entry->Slot % TIMER_WHEEL_SLOTS;
+
+    assert(TIMER_WHEEL_ENTRY_QUEUED(entry));
+
+    if (entry->Prev) {
+        entry->Prev->Next = entry->Next;
+    } else {
+        wheel->Slots[level][slot] = entry->Next;
+        if (entry->Next == NULL) {
+            wheel->Occupied[level] &= ~(1ULL << slot);
+        }
+    }
+    if (entry->Next) {
+        entry->Next->Prev = entry->Prev;
+    }
+
+    entry->Next = NULL;
+    entry->Prev = NULL;
+    entry->Slot = -1;
+    wheel->Count--;
+}
+
+TimerWheelEntry_t*
+TimerWheelAdvance(
+        _In_ TimerWheel_t* wheel,
+        _In_ uint64_t      time)
+{
+    TimerWheelEntry_t* due     = NULL;
+    TimerWheelEntry_t* expired = NULL;
+
+    if (time <= wheel->Time) {
+        return NULL;
+    }
+
+    // Take out every slot that has come due on each level. The steps between the
+    // last time and now are the due ones, which are at most a full turn.
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t first = (wheel->Time >> LEVEL_SHIFT(level)) + 1;
+        uint64_t last  = time >> LEVEL_SHIFT(level);
+        uint64_t slots;
+        uint64_t mask;
+
+        if (last < first || !wheel->Occupied[level]) {
+            continue;
+        }
+
+        if ((last - first) >= (TIMER_WHEEL_SLOTS - 1)) {
+            mask = ~0ULL;
+        } else {
+            mask = __RotateRight((1ULL << (last - first + 1)) - 1, -(int)(first & SLOT_MASK));
+        }
+
+        slots = wheel->Occupied[level] & mask;
+        wheel->Occupied[level] &= ~mask;
+        while (slots) {
+            int                slot  = __builtin_ctzll(slots);
+            TimerWheelEntry_t* entry = wheel->Slots[level][slot];
+
+            wheel->Slots[level][slot] = NULL;
+            while (entry) {
+                TimerWheelEntry_t* next = entry->Next;
+                entry->Next = due;
+                entry->Prev = NULL;
+                entry->Slot = -1;
+                due = entry;
+                wheel->Count--;
+                entry = next;
+            }
+            slots &= slots - 1;
+        }
+    }
+
+    // Return the expired entries, and queue the rest again relative to the new time
+    wheel->Time = time;
+    while (due) {
+        TimerWheelEntry_t* next = due->Next;
+        if (due->Expires <= time) {
+            due->Next = expired;
+            expired   = due;
+        } else {
+            due->Next = NULL;
+            TimerWheelAdd(wheel, due, due->Expires);
+        }
+        due = next;
+    }
+    return expired;
+}
+
+bool
+TimerWheelNext(
+        _In_  TimerWheel_t* wheel,
+        _Out_ uint64_t*     timeOut)
+{
+    bool found = false;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t first = (wheel->Time >> LEVEL_SHIFT(level)) + 1;
+        uint64_t time;
+
+        if (!wheel->Occupied[level]) {
+            continue;
+        }
+
+        first += __builtin_ctzll(__RotateRight(wheel->Occupied[level], (int)(first & SLOT_MASK)));
+        time   = first << LEVEL_SHIFT(level);
+        if (!found || time < *timeOut) {
+            *timeOut = time;
+            found    = true;
+        }
+    }
+    return found;
+}
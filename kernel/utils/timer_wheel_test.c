@@ -0,0 +1,206 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <testbase.h>
+#include <utils/timer_wheel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_COUNT 512
+
+static struct __TestContext {
+    TimerWheel_t      Wheel;
+    TimerWheelEntry_t Entries[ENTRY_COUNT];
+    // Set when the entry has been returned as expired
+    bool              Expired[ENTRY_COUNT];
+    uint64_t          ExpiredAt[ENTRY_COUNT];
+} g_testContext;
+
+int SetupTest(void** state) {
+    (void)state;
+    memset(&g_testContext, 0, sizeof(struct __TestContext));
+    TimerWheelConstruct(&g_testContext.Wheel, 1000);
+    for (int i = 0; i < ENTRY_COUNT; i++) {
+        TIMER_WHEEL_ENTRY_INIT(&g_testContext.Entries[i], (void*)(uintptr_t)i);
+    }
+    return 0;
+}
+
+// Simple LCG, so the random test is reproducible
+static unsigned int
+__Random(unsigned int* seed)
+{
+    *seed = (*seed * 1103515245U) + 12345U;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+static int
+__Advance(uint64_t time)
+{
+    TimerWheelEntry_t* entry = TimerWheelAdvance(&g_testContext.Wheel, time);
+    int                count = 0;
+
+    while (entry) {
+        int index = (int)(uintptr_t)entry->Value;
+        assert_false(TIMER_WHEEL_ENTRY_QUEUED(entry));
+        assert_false(g_testContext.Expired[index]);
+        assert_true(entry->Expires <= time);
+        g_testContext.Expired[index]   = true;
+        g_testContext.ExpiredAt[index] = time;
+        entry = entry->Next;
+        count++;
+    }
+    return count;
+}
+
+void TestTimerWheel_Empty(void** state)
+{
+    uint64_t time;
+    (void)state;
+
+    assert_false(TimerWheelNext(&g_testContext.Wheel, &time));
+    assert_int_equal(__Advance(100000), 0);
+    assert_int_equal(g_testContext.Wheel.Count, 0);
+}
+
+void TestTimerWheel_ExpiresOnTime(void** state)
+{
+    static const uint64_t deltas[] = { 1, 63, 64, 65, 4095, 4096, 4097, 300000, 20000000 };
+    const int             count    = sizeof(deltas) / sizeof(deltas[0]);
+    uint64_t              time     = 1000;
+    (void)state;
+
+    for (int i = 0; i < count; i++) {
+        TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[i], time + deltas[i]);
+    }
+    assert_int_equal(g_testContext.Wheel.Count, count);
+
+    // Advancing to the next reported time must never skip past an expiry, and
+    // must never return an entry too early.
+    while (TimerWheelNext(&g_testContext.Wheel, &time)) {
+        __Advance(time);
+    }
+    for (int i = 0; i < count; i++) {
+        assert_true(g_testContext.Expired[i]);
+        assert_int_equal(g_testContext.ExpiredAt[i], 1000 + deltas[i]);
+    }
+    assert_int_equal(g_testContext.Wheel.Count, 0);
+}
+
+void TestTimerWheel_AlreadyExpired(void** state)
+{
+    uint64_t time;
+    (void)state;
+
+    TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[0], 10);
+    assert_true(TimerWheelNext(&g_testContext.Wheel, &time));
+    assert_int_equal(time, 1001);
+    assert_int_equal(__Advance(1000), 0);
+    assert_int_equal(__Advance(1001), 1);
+}
+
+void TestTimerWheel_Remove(void** state)
+{
+    uint64_t time;
+    (void)state;
+
+    TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[0], 1010);
+    TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[1], 1010);
+    TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[2], 1010);
+    TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[3], 9000);
+
+    // Remove from the middle, head and tail of the same slot
+    TimerWheelRemove(&g_testContext.Wheel, &g_testContext.Entries[1]);
+    TimerWheelRemove(&g_testContext.Wheel, &g_testContext.Entries[2]);
+    TimerWheelRemove(&g_testContext.Wheel, &g_testContext.Entries[0]);
+    assert_false(TIMER_WHEEL_ENTRY_QUEUED(&g_testContext.Entries[0]));
+    assert_int_equal(g_testContext.Wheel.Count, 1);
+
+    assert_true(TimerWheelNext(&g_testContext.Wheel, &time));
+    assert_true(time > 1010 && time <= 9000);
+
+    TimerWheelRemove(&g_testContext.Wheel, &g_testContext.Entries[3]);
+    assert_false(TimerWheelNext(&g_testContext.Wheel, &time));
+    assert_int_equal(__Advance(100000), 0);
+}
+
+void TestTimerWheel_LargeJump(void** state)
+{
+    (void)state;
+
+    // A single advance far past every level must return everything at once
+    for (int i = 0; i < 64; i++) {
+        TimerWheelAdd(&g_testContext.Wheel, &g_testContext.Entries[i], 1000 + ((uint64_t)i << (i % 28)));
+    }
+    assert_int_equal(__Advance(1000 + (1ULL << 40)), 64);
+    assert_int_equal(g_testContext.Wheel.Count, 0);
+}
+
+// Random adds, removes and advances compared against the expiry of each entry
+void TestTimerWheel_Random(void** state)
+{
+    unsigned int seed = 1;
+    uint64_t     time = 1000;
+    uint64_t     next;
+    (void)state;
+
+    for (int round = 0; round < 20000; round++) {
+        int                index = __Random(&seed) % ENTRY_COUNT;
+        TimerWheelEntry_t* entry = &g_testContext.Entries[index];
+
+        if (TIMER_WHEEL_ENTRY_QUEUED(entry)) {
+            if (__Random(&seed) & 1) {
+                TimerWheelRemove(&g_testContext.Wheel, entry);
+            }
+        } else {
+            uint64_t delta = __Random(&seed);
+            delta <<= (__Random(&seed) % 12);
+            g_testContext.Expired[index] = false;
+            TimerWheelAdd(&g_testContext.Wheel, entry, time + delta);
+        }
+
+        if (TimerWheelNext(&g_testContext.Wheel, &next)) {
+            for (int i = 0; i < ENTRY_COUNT; i++) {
+                if (TIMER_WHEEL_ENTRY_QUEUED(&g_testContext.Entries[i])) {
+                    assert_true(next <= g_testContext.Entries[i].Expires || g_testContext.Entries[i].Expires <= time);
+                }
+            }
+        }
+
+        time += __Random(&seed) % 2000;
+        __Advance(time);
+        for (int i = 0; i < ENTRY_COUNT; i++) {
+            if (TIMER_WHEEL_ENTRY_QUEUED(&g_testContext.Entries[i])) {
+                assert_true(g_testContext.Entries[i].Expires > time);
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test_setup(TestTimerWheel_Empty, SetupTest),
+            cmocka_unit_test_setup(TestTimerWheel_ExpiresOnTime, SetupTest),
+            cmocka_unit_test_setup(TestTimerWheel_AlreadyExpired, SetupTest),
+            cmocka_unit_test_setup(TestTimerWheel_Remove, SetupTest),
+            cmocka_unit_test_setup(TestTimerWheel_LargeJump, SetupTest),
+            cmocka_unit_test_setup(TestTimerWheel_Random, SetupTest),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
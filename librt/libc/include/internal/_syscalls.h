@@ -95,5 +95,6 @@ _CODE_END
 #define Syscall_Time(source, timeOut)                                      (oserr_t)syscall2(59, SCPARAM(source), SCPARAM(timeOut))
 #define Syscall_Sleep(DurationNs, RemainingNs)                             (oserr_t)syscall2(60, SCPARAM(DurationNs), SCPARAM(RemainingNs))
 #define Syscall_Stall(DurationNs)                                          (oserr_t)syscall1(61, SCPARAM(DurationNs))
+#define Syscall_ThreadSetDeadline(Parameters)                              (oserr_t)syscall1(62, SCPARAM(Parameters))
 
 #endif //!__INTERNAL_CRT_SYSCALLS__
@@ -21,6 +21,9 @@
 
 #include <ddk/ddkdefs.h>
 
+// Duplicates the memory of the calling process into the new memory space, copy-on-write
+#define MEMORY_SPACE_FORK 0x00000004U
+
 struct MemoryMappingParameters {
     uintptr_t    VirtualAddress;
     size_t       Length;
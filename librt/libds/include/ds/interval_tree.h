@@ -0,0 +1,142 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Interval Tree Implementation
+ *  - Implements a red-black tree of [start, end) ranges ordered by their start, where
+ *    each node also tracks the highest end in its subtree to answer overlap queries.
+ */
+
+#ifndef __LIBDS_INTERVALTREE_H__
+#define __LIBDS_INTERVALTREE_H__
+
+#include <ds/dsdefs.h>
+
+typedef struct interval_node {
+    struct interval_node* parent;
+    struct interval_node* left;
+    struct interval_node* right;
+    int                   color;
+
+    uintptr_t             start;
+    uintptr_t             end;
+    uintptr_t             max_end;
+    void*                 value;
+} interval_node_t;
+
+#define INTERVAL_NODE_INIT(node, _start, _end, _value) (node)->parent = NULL; (node)->left = NULL; (node)->right = NULL; (node)->color = 0; (node)->start = (uintptr_t)(_start); (node)->end = (uintptr_t)(_end); (node)->max_end = 0; (node)->value = _value
+
+// The tree does no locking of its own, callers must serialize access.
+typedef struct interval_tree {
+    interval_node_t* root;
+    interval_node_t  nil;
+    int              count;
+} interval_tree_t;
+
+/**
+ * interval_tree_construct
+ * * Constructs and initializes a new, empty interval tree.
+ * @param tree [In] The interval tree to initialize, must be allocated.
+ */
+DSDECL(void,
+interval_tree_construct(
+    _In_ interval_tree_t* tree));
+
+/**
+ * interval_tree_insert
+ * * Inserts a node into the tree. The range of the node is [start, end), and ranges
+ *   are allowed to overlap. The node must not be changed while it is in the tree.
+ * @param tree [In] The interval tree to insert the node into.
+ * @param node [In] The node to insert, initialized with INTERVAL_NODE_INIT.
+ */
+DSDECL(void,
+interval_tree_insert(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node));
+
+/**
+ * interval_tree_remove
+ * * Removes a node from the tree, the node must be present in the tree.
+ * @param tree [In] The interval tree to remove the node from.
+ * @param node [In] The node to remove.
+ */
+DSDECL(void,
+interval_tree_remove(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node));
+
+/**
+ * interval_tree_lookup
+ * * Looks up the node with the lowest start whose range contains the given point.
+ * @param tree  [In] The interval tree to perform the lookup in.
+ * @param point [In] The point to look up.
+ * @return The node found, or NULL if no range contains the point.
+ */
+DSDECL(interval_node_t*,
+interval_tree_lookup(
+    _In_ interval_tree_t* tree,
+    _In_ uintptr_t        point));
+
+/**
+ * interval_tree_first_overlap
+ * * Finds the node with the lowest start whose range overlaps [start, end).
+ * @param tree  [In] The interval tree to search.
+ * @param start [In] The start of the range to query.
+ * @param end   [In] The end of the range to query, exclusive.
+ * @return The node found, or NULL if no range overlaps the query.
+ */
+DSDECL(interval_node_t*,
+interval_tree_first_overlap(
+    _In_ interval_tree_t* tree,
+    _In_ uintptr_t        start,
+    _In_ uintptr_t        end));
+
+/**
+ * interval_tree_next_overlap
+ * * Finds the next node, in order of start, after <node> whose range overlaps [start, end). Used
+ *   together with interval_tree_first_overlap to visit all ranges that overlap a query.
+ * @param tree  [In] The interval tree to search.
+ * @param node  [In] The node returned by the previous query.
+ * @param start [In] The start of the range to query.
+ * @param end   [In] The end of the range to query, exclusive.
+ * @return The node found, or NULL if there are no more overlapping ranges.
+ */
+DSDECL(interval_node_t*,
+interval_tree_next_overlap(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node,
+    _In_ uintptr_t        start,
+    _In_ uintptr_t        end));
+
+/**
+ * interval_tree_minimum
+ * * Retrieves the node with the lowest start, or NULL if the tree is empty.
+ * @param tree [In] The interval tree to perform the lookup in.
+ */
+DSDECL(interval_node_t*,
+interval_tree_minimum(
+    _In_ interval_tree_t* tree));
+
+/**
+ * interval_tree_count
+ * * Returns the number of nodes in the tree.
+ * @param tree [In] The interval tree to count the nodes of.
+ */
+DSDECL(int,
+interval_tree_count(
+    _In_ interval_tree_t* tree));
+
+#endif //!__LIBDS_INTERVALTREE_H__
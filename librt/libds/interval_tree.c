@@ -0,0 +1,459 @@
+/**
+ * Copyright 2023, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <ds/interval_tree.h>
+
+#define COLOR_BLACK 0
+#define COLOR_RED   1
+
+#define NODE_NIL(tree)          (&(tree)->nil)
+#define IS_NODE_NIL(tree, node) ((node) == NODE_NIL(tree))
+
+// Ranges are half-open, so [a, b) and [b, c) do not overlap
+#define OVERLAPS(node, _start, _end) ((node)->start < (_end) && (node)->end > (_start))
+
+void
+interval_tree_construct(
+    _In_ interval_tree_t* tree)
+{
+    assert(tree != NULL);
+
+    INTERVAL_NODE_INIT(NODE_NIL(tree), 0, 0, NULL);
+    tree->nil.color = COLOR_BLACK;
+    tree->root      = NODE_NIL(tree);
+    tree->count     = 0;
+}
+
+static void
+update_max(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    uintptr_t max = node->end;
+    if (!IS_NODE_NIL(tree, node->left) && node->left->max_end > max) {
+        max = node->left->max_end;
+    }
+    if (!IS_NODE_NIL(tree, node->right) && node->right->max_end > max) {
+        max = node->right->max_end;
+    }
+    node->max_end = max;
+}
+
+static void
+update_max_to_root(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    while (!IS_NODE_NIL(tree, node)) {
+        update_max(tree, node);
+        node = node->parent;
+    }
+}
+
+static void
+replace_child(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node,
+    _In_ interval_node_t* with)
+{
+    if (IS_NODE_NIL(tree, node->parent)) {
+        tree->root = with;
+    }
+    else if (node == node->parent->left) {
+        node->parent->left = with;
+    }
+    else {
+        node->parent->right = with;
+    }
+    with->parent = node->parent;
+}
+
+// Rotations only change the subtrees of the two nodes involved, so the
+// maximum end of every node above them stays the same.
+static void
+rotate_left(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* right = node->right;
+
+    node->right = right->left;
+    if (!IS_NODE_NIL(tree, right->left)) {
+        right->left->parent = node;
+    }
+    replace_child(tree, node, right);
+    right->left  = node;
+    node->parent = right;
+
+    update_max(tree, node);
+    update_max(tree, right);
+}
+
+static void
+rotate_right(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* left = node->left;
+
+    node->left = left->right;
+    if (!IS_NODE_NIL(tree, left->right)) {
+        left->right->parent = node;
+    }
+    replace_child(tree, node, left);
+    left->right  = node;
+    node->parent = left;
+
+    update_max(tree, node);
+    update_max(tree, left);
+}
+
+static void
+fixup_tree(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* i = node;
+
+    while (i->parent->color == COLOR_RED) {
+        interval_node_t* uncle;
+        if (i->parent == i->parent->parent->left) {
+            uncle = i->parent->parent->right;
+            if (uncle->color == COLOR_RED) {
+                i->parent->color         = COLOR_BLACK;
+                uncle->color             = COLOR_BLACK;
+                i->parent->parent->color = COLOR_RED;
+                i = i->parent->parent;
+                continue;
+            }
+
+            // Check if double rotation is required
+            if (i == i->parent->right) {
+                i = i->parent;
+                rotate_left(tree, i);
+            }
+
+            i->parent->color         = COLOR_BLACK;
+            i->parent->parent->color = COLOR_RED;
+            rotate_right(tree, i->parent->parent);
+        }
+        else {
+            uncle = i->parent->parent->left;
+            if (uncle->color == COLOR_RED) {
+                i->parent->color         = COLOR_BLACK;
+                uncle->color             = COLOR_BLACK;
+                i->parent->parent->color = COLOR_RED;
+                i = i->parent->parent;
+                continue;
+            }
+
+            // Check if double rotation is required
+            if (i == i->parent->left) {
+                i = i->parent;
+                rotate_right(tree, i);
+            }
+
+            i->parent->color         = COLOR_BLACK;
+            i->parent->parent->color = COLOR_RED;
+            rotate_left(tree, i->parent->parent);
+        }
+    }
+    tree->root->color = COLOR_BLACK;
+}
+
+void
+interval_tree_insert(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* parent = NODE_NIL(tree);
+    interval_node_t* i;
+
+    assert(tree != NULL);
+    assert(node != NULL);
+
+    node->left    = NODE_NIL(tree);
+    node->right   = NODE_NIL(tree);
+    node->color   = COLOR_RED;
+    node->max_end = node->end;
+
+    // Walk down to the insertion point, ranges with the same start are kept in
+    // insertion order. The new end is included in the maximum of all the nodes passed.
+    i = tree->root;
+    while (!IS_NODE_NIL(tree, i)) {
+        parent = i;
+        if (node->end > i->max_end) {
+            i->max_end = node->end;
+        }
+        i = (node->start < i->start) ? i->left : i->right;
+    }
+
+    node->parent = parent;
+    if (IS_NODE_NIL(tree, parent)) {
+        tree->root = node;
+    }
+    else if (node->start < parent->start) {
+        parent->left = node;
+    }
+    else {
+        parent->right = node;
+    }
+
+    fixup_tree(tree, node);
+    tree->count++;
+}
+
+static interval_node_t*
+get_minimum_node(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* i = node;
+    while (!IS_NODE_NIL(tree, i->left)) {
+        i = i->left;
+    }
+    return i;
+}
+
+static void
+fixup_tree_after_remove(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* i = node;
+
+    while (i != tree->root && i->color == COLOR_BLACK) {
+        if (i == i->parent->left) {
+            interval_node_t* sibling = i->parent->right;
+            if (sibling->color == COLOR_RED) {
+                sibling->color   = COLOR_BLACK;
+                i->parent->color = COLOR_RED;
+                rotate_left(tree, i->parent);
+                sibling = i->parent->right;
+            }
+
+            if (sibling->left->color == COLOR_BLACK && sibling->right->color == COLOR_BLACK) {
+                sibling->color = COLOR_RED;
+                i = i->parent;
+                continue;
+            }
+
+            if (sibling->right->color == COLOR_BLACK) {
+                sibling->left->color = COLOR_BLACK;
+                sibling->color       = COLOR_RED;
+                rotate_right(tree, sibling);
+                sibling = i->parent->right;
+            }
+
+            sibling->color        = i->parent->color;
+            i->parent->color      = COLOR_BLACK;
+            sibling->right->color = COLOR_BLACK;
+            rotate_left(tree, i->parent);
+            i = tree->root;
+        }
+        else {
+            interval_node_t* sibling = i->parent->left;
+            if (sibling->color == COLOR_RED) {
+                sibling->color   = COLOR_BLACK;
+                i->parent->color = COLOR_RED;
+                rotate_right(tree, i->parent);
+                sibling = i->parent->left;
+            }
+
+            if (sibling->right->color == COLOR_BLACK && sibling->left->color == COLOR_BLACK) {
+                sibling->color = COLOR_RED;
+                i = i->parent;
+                continue;
+            }
+
+            if (sibling->left->color == COLOR_BLACK) {
+                sibling->right->color = COLOR_BLACK;
+                sibling->color        = COLOR_RED;
+                rotate_left(tree, sibling);
+                sibling = i->parent->left;
+            }
+
+            sibling->color       = i->parent->color;
+            i->parent->color     = COLOR_BLACK;
+            sibling->left->color = COLOR_BLACK;
+            rotate_right(tree, i->parent);
+            i = tree->root;
+        }
+    }
+    i->color = COLOR_BLACK;
+}
+
+void
+interval_tree_remove(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node)
+{
+    interval_node_t* replacement;
+    interval_node_t* child;
+    int              removedColor;
+
+    assert(tree != NULL);
+    assert(node != NULL);
+
+    // The nil node is used as a regular leaf while removing, so its parent
+    // may be pointed to the removed position.
+    replacement  = node;
+    removedColor = replacement->color;
+    if (IS_NODE_NIL(tree, node->left)) {
+        child = node->right;
+        replace_child(tree, node, node->right);
+    }
+    else if (IS_NODE_NIL(tree, node->right)) {
+        child = node->left;
+        replace_child(tree, node, node->left);
+    }
+    else {
+        replacement  = get_minimum_node(tree, node->right);
+        removedColor = replacement->color;
+        child        = replacement->right;
+        if (replacement->parent == node) {
+            child->parent = replacement;
+        }
+        else {
+            replace_child(tree, replacement, replacement->right);
+            replacement->right         = node->right;
+            replacement->right->parent = replacement;
+        }
+        replace_child(tree, node, replacement);
+        replacement->left         = node->left;
+        replacement->left->parent = replacement;
+        replacement->color        = node->color;
+    }
+
+    // Every node from where the tree changed and up has lost a range from its subtree
+    update_max_to_root(tree, child->parent);
+    if (removedColor == COLOR_BLACK) {
+        fixup_tree_after_remove(tree, child);
+    }
+
+    NODE_NIL(tree)->parent = NULL;
+    node->parent = NULL;
+    node->left   = NULL;
+    node->right  = NULL;
+    tree->count--;
+}
+
+// Finds the overlapping node with the lowest start within the subtree. When the left subtree
+// has a range that ends after the query start, but none of its ranges overlap, then that range
+// starts after the query and so does everything to the right of it.
+static interval_node_t*
+first_overlap_in_subtree(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node,
+    _In_ uintptr_t        start,
+    _In_ uintptr_t        end)
+{
+    interval_node_t* i = node;
+
+    while (!IS_NODE_NIL(tree, i) && i->max_end > start) {
+        if (!IS_NODE_NIL(tree, i->left) && i->left->max_end > start) {
+            i = i->left;
+        }
+        else if (OVERLAPS(i, start, end)) {
+            return i;
+        }
+        else if (i->start >= end) {
+            return NULL;
+        }
+        else {
+            i = i->right;
+        }
+    }
+    return NULL;
+}
+
+interval_node_t*
+interval_tree_first_overlap(
+    _In_ interval_tree_t* tree,
+    _In_ uintptr_t        start,
+    _In_ uintptr_t        end)
+{
+    assert(tree != NULL);
+    if (start >= end) {
+        return NULL;
+    }
+    return first_overlap_in_subtree(tree, tree->root, start, end);
+}
+
+interval_node_t*
+interval_tree_next_overlap(
+    _In_ interval_tree_t* tree,
+    _In_ interval_node_t* node,
+    _In_ uintptr_t        start,
+    _In_ uintptr_t        end)
+{
+    interval_node_t* result;
+    interval_node_t* i = node;
+
+    assert(tree != NULL);
+    assert(node != NULL);
+
+    // Everything after the node is either in its right subtree, or in the right
+    // subtree of an ancestor that we reach from the left.
+    result = first_overlap_in_subtree(tree, i->right, start, end);
+    while (result == NULL && !IS_NODE_NIL(tree, i->parent)) {
+        interval_node_t* parent = i->parent;
+        if (i == parent->left) {
+            if (parent->start >= end) {
+                return NULL;
+            }
+            if (OVERLAPS(parent, start, end)) {
+                return parent;
+            }
+            result = first_overlap_in_subtree(tree, parent->right, start, end);
+        }
+        i = parent;
+    }
+    return result;
+}
+
+interval_node_t*
+interval_tree_lookup(
+    _In_ interval_tree_t* tree,
+    _In_ uintptr_t        point)
+{
+    assert(tree != NULL);
+    if (point == UINTPTR_MAX) {
+        return NULL;
+    }
+    return first_overlap_in_subtree(tree, tree->root, point, point + 1);
+}
+
+interval_node_t*
+interval_tree_minimum(
+    _In_ interval_tree_t* tree)
+{
+    assert(tree != NULL);
+    if (IS_NODE_NIL(tree, tree->root)) {
+        return NULL;
+    }
+    return get_minimum_node(tree, tree->root);
+}
+
+int
+interval_tree_count(
+    _In_ interval_tree_t* tree)
+{
+    assert(tree != NULL);
+    return tree->count;
+}
@@ -37,6 +37,7 @@
 #define FUTEX_FLAG_ACTION(Flags) ((Flags) & 0x3)
 #define FUTEX_FLAG_OP            0x10U
 #define FUTEX_FLAG_PRIVATE       0x20U
+#define FUTEX_FLAG_SYNC          0x40U // The waker is about to wait for the first woken thread
 
 CRTDECL(oserr_t,
 OSFutex(
@@ -134,6 +134,19 @@ ThreadsSignal(
         _In_ uuid_t threadId,
         _In_ int    signal));
 
+/**
+ * @brief Moves the calling thread into the deadline scheduling class, where it is guaranteed
+ * its runtime within the deadline of every period, and runs before all other threads. The thread
+ * is throttled until its next period if it uses more than its runtime. A runtime of 0 moves the
+ * thread back to the normal scheduling. Only a limited share of each processor core is
+ * set aside for deadline threads of userspace.
+ * @param parameters The runtime, deadline and period in nanoseconds.
+ * @return OS_EBUSY if the processor core of the thread cannot admit the bandwidth.
+ */
+CRTDECL(oserr_t,
+ThreadsSetDeadline(
+        _In_ const OSThreadDeadlineParameters_t* parameters));
+
 /**
  * @brief
  * @param name
@@ -35,12 +35,18 @@
 #define MEMORY_CLONE         0x00000008U                  // Clone the memory mapping passed in as hint
 #define MEMORY_FIXED         0x00000010U                  // Use the value provided in Hint
 #define MEMORY_STACK         0x00000020U                  // Memory is used as a stack, and should grow downwards
+#define MEMORY_PRIVATE       0x00000040U                  // Together with MEMORY_CLONE, the clone is copied on write
 
 #define MEMORY_READ          0x00000100U                  // Memory is readable
 #define MEMORY_WRITE         0x00000200U                  // Memory is writable
 #define MEMORY_EXECUTABLE    0x00000400U                  // Memory is executable
 #define MEMORY_DIRTY         0x00000800U                  // Memory is dirty
 
+// Access hints for memory that is not committed immediately. First accesses commit the neighbouring
+// pages as well, and these hints decide how many.
+#define MEMORY_SEQUENTIAL    0x00001000U                  // Memory is accessed sequentially, commit ahead aggressively
+#define MEMORY_RANDOM        0x00002000U                  // Memory is accessed randomly, only commit the page accessed
+
 enum OSMemoryConformity {
     // No memory conformity required
     OSMEMORYCONFORMITY_NONE,
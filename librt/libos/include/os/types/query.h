@@ -23,6 +23,12 @@ enum OSSystemQueryRequest {
     OSSYSTEMQUERY_CPUINFO,
     OSSYSTEMQUERY_MEMINFO,
     OSSYSTEMQUERY_THREADS,
+    OSSYSTEMQUERY_HEAPINFO,
+    OSSYSTEMQUERY_MEMDOMAININFO,
+    OSSYSTEMQUERY_FAULTINFO,
+    OSSYSTEMQUERY_SCHEDINFO,
+    OSSYSTEMQUERY_SCHEDLATENCY,
+    OSSYSTEMQUERY_THREADLATENCY,
 };
 
 typedef struct OSSystemCPUInfo {
@@ -35,6 +41,150 @@ typedef struct OSSystemMemoryInfo {
     size_t PagesUsed;
     size_t PageSizeBytes;
     size_t AllocationGranularityBytes;
+    size_t LargePageSizeBytes;
+    size_t LargePagesMapped;
+    size_t LargePageSplits;
+    size_t ZeroPoolPages;
+    size_t ZeroPoolTarget;
+    size_t ZeroPoolHits;
+    size_t ZeroPoolMisses;
+    size_t TlbIpisSent;
+    size_t TlbIpisAvoided;
+    size_t TlbFullFlushes;
+    size_t TlbSwitchesKept;
+    size_t TlbSwitchesFlushed;
+    size_t CopyOnWriteCopies;
+    size_t CopyOnWriteReuses;
+    size_t SharedPages;
+    // Pages compressed to free up memory. The compression ratio is the pages stored
+    // against the bytes they take up, pages filled with a single word take up none.
+    size_t   CompressedPages;
+    size_t   CompressedBytes;
+    size_t   CompressedSameFilled;
+    size_t   CompressRejected;
+    size_t   CompressRestores;
+    uint64_t CompressRestoreTimeNs;
+    uint64_t CompressRestoreMaxTimeNs;
 } OSSystemMemoryInfo_t;
 
+// OSSYSTEMQUERY_HEAPINFO returns an array of these, one for each kernel heap cache.
+// The counters are totals since the cache was created, rates must be calculated
+// by sampling them.
+typedef struct OSSystemHeapCacheInfo {
+    char     Name[32];
+    size_t   ObjectSize;
+    size_t   ObjectPadding;
+    size_t   ObjectsPerSlab;
+    size_t   SlabCount;
+    size_t   PartialSlabCount;
+    size_t   PartialObjectsInUse;
+    uint64_t Allocations;
+    uint64_t Frees;
+    size_t   LiveObjects;
+    size_t   PeakObjects;
+    uint64_t MagazineHits;
+    uint64_t MagazineMisses;
+    size_t   TotalBytes;
+    size_t   PaddingBytes;
+} OSSystemHeapCacheInfo_t;
+
+// OSSYSTEMQUERY_MEMDOMAININFO returns an array of these, one for each NUMA memory
+// domain. Nothing is returned on machines without NUMA domains. The counters are
+// in pages, and are totals since boot.
+typedef struct OSSystemMemoryDomainInfo {
+    int      Domain;
+    uint64_t PhysicalBase;
+    uint64_t Size;
+    uint64_t LocalPages;
+    uint64_t FallbackPages;
+    uint64_t RemotePages;
+    uint64_t InterleavedPages;
+    uint64_t FreedPages;
+} OSSystemMemoryDomainInfo_t;
+
+// OSSYSTEMQUERY_FAULTINFO returns the page fault counters of the calling process. The
+// counters are totals since the process was created.
+typedef struct OSSystemFaultInfo {
+    // Faults on memory that was reserved but not yet committed
+    size_t Faults;
+    // The faults that continued where the previous fault-around window ended
+    size_t SequentialFaults;
+    // Neighbouring pages committed by fault-around, each of which would have
+    // taken a fault of its own when accessed
+    size_t FaultAroundPages;
+} OSSystemFaultInfo_t;
+
+// OSSYSTEMQUERY_SCHEDINFO returns an array of these, one for each processor core.
+typedef struct OSSystemSchedulerInfo {
+    uuid_t CoreId;
+    // Threads waiting to run on the core, and threads assigned to the core in total
+    int    RunnableCount;
+    int    ThreadCount;
+    // Threads moved to and from the core by load balancing
+    size_t MigrationsIn;
+    size_t MigrationsOut;
+    // The part of MigrationsOut that was handed over to idle cores on request
+    size_t Steals;
+    // Wakeups that queued a thread that last ran on the core, from the core itself or
+    // from another core, and wakeups that placed a thread here that last ran on another core
+    size_t WakeupsLocal;
+    size_t WakeupsRemote;
+    size_t WakeupsMoved;
+    // Deadline threads on the core, the share of the core admitted to them in
+    // percent, how often they ran out of budget and how often they missed their deadline
+    int    DeadlineCount;
+    int    DeadlineBandwidth;
+    size_t DeadlineThrottles;
+    size_t DeadlineMisses;
+} OSSystemSchedulerInfo_t;
+
+// Scheduler latencies are measured in ticks of the performance counter, the
+// frequency is returned with them.
+#define OSSCHEDULER_LATENCY_BUCKETS 32
+#define OSSCHEDULER_LATENCY_WORST   16
+
+enum OSSchedulerLatencyType {
+    // From a blocked thread being woken until it runs
+    OSSCHEDULERLATENCY_WAKEUP,
+    // From a thread being queued until it runs, this includes threads that
+    // were preempted and wait to run again.
+    OSSCHEDULERLATENCY_RUNQUEUE,
+    OSSCHEDULERLATENCY_COUNT
+};
+
+// Bucket n counts the latencies from 2^n up to 2^(n+1) ticks, bucket 0 also counts
+// latencies of 0, and the last bucket everything above.
+typedef struct OSSchedulerLatencyHistogram {
+    uint64_t Count;
+    uint64_t Total;
+    uint64_t Max;
+    uint32_t Buckets[OSSCHEDULER_LATENCY_BUCKETS];
+} OSSchedulerLatencyHistogram_t;
+
+typedef struct OSSchedulerLatencyEvent {
+    uuid_t   ThreadHandle;
+    int      Type;
+    uint64_t Latency;
+    // The performance counter tick the thread was dispatched at
+    uint64_t Timestamp;
+} OSSchedulerLatencyEvent_t;
+
+// OSSYSTEMQUERY_SCHEDLATENCY returns an array of these, one for each processor core.
+// Worst holds the largest latencies seen on the core in no particular order, unused
+// entries have a latency of 0.
+typedef struct OSSystemSchedulerLatencyInfo {
+    uuid_t                        CoreId;
+    uint64_t                      Frequency;
+    OSSchedulerLatencyHistogram_t Histograms[OSSCHEDULERLATENCY_COUNT];
+    OSSchedulerLatencyEvent_t     Worst[OSSCHEDULER_LATENCY_WORST];
+} OSSystemSchedulerLatencyInfo_t;
+
+// OSSYSTEMQUERY_THREADLATENCY returns the latencies of the thread given by ThreadHandle,
+// or of the calling thread if ThreadHandle is UUID_INVALID.
+typedef struct OSSystemThreadLatencyInfo {
+    uuid_t                        ThreadHandle;
+    uint64_t                      Frequency;
+    OSSchedulerLatencyHistogram_t Histograms[OSSCHEDULERLATENCY_COUNT];
+} OSSystemThreadLatencyInfo_t;
+
 #endif //!__TYPES_QUERY_H__
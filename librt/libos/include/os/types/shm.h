@@ -34,6 +34,8 @@
  *                 the underlying physical memory pages. This flag automatically implies that
  *                 SHM_COMMIT will be set.
  * SHM_PRIVATE     region is intended for private use (private to the process memory space).
+ * SHM_INTERLEAVED spreads the physical pages of the region evenly over all memory domains, which
+ *                 is useful for large buffers shared by threads on all domains.
  */
 #define SHM_COMMIT       0x00000001U
 #define SHM_CLEAN        0x00000002U
@@ -41,6 +43,7 @@
 #define SHM_BIGPAGES_2MB 0x00000010U
 #define SHM_BIGPAGES_1GB 0x00000020U
 #define SHM_CONFORM      0x00000040U
+#define SHM_INTERLEAVED  0x00000080U
 #define SHM_TRAP         0x00000100U
 #define SHM_IPC          0x00000200U
 #define SHM_DEVICE       0x00000300U
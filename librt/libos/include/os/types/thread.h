@@ -34,4 +34,14 @@ typedef struct OSThreadParameters {
     size_t       MaximumStackSize;
 } OSThreadParameters_t;
 
+// Deadline threads are guaranteed Runtime nanoseconds of processor time within
+// Deadline nanoseconds of the start of every period. The values must satisfy
+// Runtime <= Deadline <= Period, a Runtime of 0 returns the thread to the normal
+// priority levels.
+typedef struct OSThreadDeadlineParameters {
+    uint64_t Runtime;
+    uint64_t Deadline;
+    uint64_t Period;
+} OSThreadDeadlineParameters_t;
+
 #endif //!__TYPES_THREAD_H__
@@ -176,6 +176,16 @@ ThreadParametersInitialize(
     parameters->MaximumStackSize  = __MASK;
 }
 
+oserr_t
+ThreadsSetDeadline(
+        _In_ const OSThreadDeadlineParameters_t* parameters)
+{
+    if (parameters == NULL) {
+        return OS_EINVALPARAMS;
+    }
+    return Syscall_ThreadSetDeadline(parameters);
+}
+
 oserr_t
 ThreadsSetName(
         _In_ const char* name)